@@ -13,6 +13,8 @@ extern struct pico_tree Device_tree;
 #include "pico_ipv6_nd.h"
 #define MAX_DEVICE_NAME 16
 
+struct pico_qdisc;
+
 
 struct pico_ethdev {
     struct pico_eth mac;
@@ -38,8 +40,24 @@ struct pico_device {
   #ifdef PICO_SUPPORT_IPV6
     struct pico_nd_hostvars hostvars;
   #endif
+  #ifdef PICO_SUPPORT_QDISC
+    struct pico_qdisc *qdisc; /* NULL: plain FIFO on q_out */
+  #endif
+  #ifdef PICO_SUPPORT_STATS
+    uint32_t stats_tx;      /* frames taken by the driver */
+    uint32_t stats_drop;    /* incoming frames lost before q_in */
+  #endif
+  #ifdef PICO_SUPPORT_SIMTIME
+    uint8_t hairpin;        /* send frames for local addresses out, as pipes do */
+  #endif
 };
 
+#ifdef PICO_SUPPORT_SIMTIME
+#define PICO_DEV_IS_HAIRPIN(dev) ((dev) && (dev)->hairpin)
+#else
+#define PICO_DEV_IS_HAIRPIN(dev) (0)
+#endif
+
 
 int pico_device_init(struct pico_device *dev, const char *name, const uint8_t *mac);
 void pico_device_destroy(struct pico_device *dev);
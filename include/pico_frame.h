@@ -6,6 +6,7 @@
 #ifndef INCLUDE_PICO_FRAME
 #define INCLUDE_PICO_FRAME
 #include "pico_config.h"
+#include "pico_tree.h"
 
 
 #define PICO_FRAME_FLAG_BCAST               (0x01)
@@ -20,6 +21,14 @@
 struct pico_socket;
 
 
+#ifdef PICO_SUPPORT_STATS
+/* Set to 0 to leave out the queue latency histograms, and the time stamp
+ * they take on every enqueue */
+#ifndef PICO_STATS_LATENCY
+#define PICO_STATS_LATENCY  (1)
+#endif
+#endif
+
 struct pico_frame {
 
     /* Connector for queues */
@@ -80,6 +89,11 @@ struct pico_frame {
     /* Pointer to socket */
     struct pico_socket *sock;
 
+#ifdef PICO_SUPPORT_TCP
+    /* Link in the TCP output/hold queue, ordered by sequence number */
+    struct pico_rb_node tcp_node;
+#endif
+
     /* Pointer to transport info, used to store remote UDP endpoint (IP + port) */
     void *info;
 
@@ -92,6 +106,10 @@ struct pico_frame {
 
     uint8_t send_ttl; /* Special TTL/HOPS value, 0 = auto assign */
     uint8_t send_tos; /* Type of service */
+
+#if defined(PICO_SUPPORT_STATS) && PICO_STATS_LATENCY
+    pico_time queued; /* Time of the last enqueue */
+#endif
 };
 
 /** frame alloc/dealloc/copy **/
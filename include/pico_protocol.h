@@ -93,5 +93,9 @@ int pico_protocol_datalink_loop(int loop_score, int direction);
 int pico_protocol_network_loop(int loop_score, int direction);
 int pico_protocol_transport_loop(int loop_score, int direction);
 int pico_protocol_socket_loop(int loop_score, int direction);
+#ifdef PICO_SUPPORT_STATS
+/* Registered protocols, layer by layer. NULL starts, NULL at the end. */
+struct pico_protocol *pico_protocol_next(struct pico_protocol *prev);
+#endif
 
 #endif
@@ -21,6 +21,26 @@ int pico_mutex_lock_timeout(void *mutex, int timeout);
 void pico_mutex_unlock(void *mutex);
 void pico_mutex_unlock_ISR(void *mutex);
 
+#ifdef PICO_SUPPORT_STATS
+/* Enqueue to dequeue latency, in units of PICO_STATS_TIME(). Bucket 0 counts
+ * zero, bucket n latencies from 2^(n-1) up to 2^n, the last bucket the rest. */
+#ifndef PICO_STATS_LATENCY_BUCKETS
+#define PICO_STATS_LATENCY_BUCKETS  (16)
+#endif
+
+#ifndef PICO_STATS_TIME
+#define PICO_STATS_TIME()           PICO_TIME_MS()
+#endif
+
+struct pico_queue_stats {
+    uint32_t enqueued;
+    uint32_t dequeued;
+    uint32_t full;          /* frames refused */
+    uint32_t high_water;    /* most frames queued at once */
+    uint32_t latency[PICO_STATS_LATENCY_BUCKETS];
+};
+#endif
+
 struct pico_queue {
     uint32_t frames;
     uint32_t size;
@@ -33,6 +53,9 @@ struct pico_queue {
 #endif
     uint8_t shared;
     uint16_t overhead;
+#ifdef PICO_SUPPORT_STATS
+    struct pico_queue_stats stats;
+#endif
 };
 
 #ifdef PICO_SUPPORT_MUTEX
@@ -67,19 +90,61 @@ static void debug_q(struct pico_queue *q)
 #define debug_q(x) do {} while(0)
 #endif
 
+#ifdef PICO_SUPPORT_STATS
+static inline int32_t pico_queue_stats_full(struct pico_queue *q)
+{
+    q->stats.full++;
+    return -1;
+}
+
+static inline void pico_queue_stats_in(struct pico_queue *q, struct pico_frame *p)
+{
+    q->stats.enqueued++;
+    if (q->frames > q->stats.high_water)
+        q->stats.high_water = q->frames;
+
+#if PICO_STATS_LATENCY
+    p->queued = PICO_STATS_TIME();
+#else
+    (void)p;
+#endif
+}
+
+static inline void pico_queue_stats_out(struct pico_queue *q, struct pico_frame *p)
+{
+#if PICO_STATS_LATENCY
+    pico_time delay = PICO_STATS_TIME() - p->queued;
+    uint32_t bucket = 0;
+
+    while (delay && (bucket < (PICO_STATS_LATENCY_BUCKETS - 1))) {
+        delay >>= 1;
+        bucket++;
+    }
+    q->stats.latency[bucket]++;
+#else
+    (void)p;
+#endif
+    q->stats.dequeued++;
+}
+#else
+#define pico_queue_stats_full(q)        (-1)
+#define pico_queue_stats_in(q, p)       do {} while(0)
+#define pico_queue_stats_out(q, p)      do {} while(0)
+#endif
+
 static inline int32_t pico_enqueue(struct pico_queue *q, struct pico_frame *p)
 {
     if ((q->max_frames) && (q->max_frames <= q->frames))
-        return -1;
+        return pico_queue_stats_full(q);
 
 #if (Q_LIMIT != 0)
     if ((Q_LIMIT < p->buffer_len + q->size))
-        return -1;
+        return pico_queue_stats_full(q);
 
 #endif
 
     if ((q->max_size) && (q->max_size < (p->buffer_len + q->size)))
-        return -1;
+        return pico_queue_stats_full(q);
 
     if (q->shared)
         PICOTCP_MUTEX_LOCK(q->mutex);
@@ -97,6 +162,7 @@ static inline int32_t pico_enqueue(struct pico_queue *q, struct pico_frame *p)
 
     q->size += p->buffer_len + q->overhead;
     q->frames++;
+    pico_queue_stats_in(q, p);
     debug_q(q);
 
     if (q->shared)
@@ -123,6 +189,7 @@ static inline struct pico_frame *pico_dequeue(struct pico_queue *q)
     if (q->head == NULL)
         q->tail = NULL;
 
+    pico_queue_stats_out(q, p);
     debug_q(q);
 
     p->next = NULL;
@@ -36,16 +36,24 @@
 
 struct pico_sockport
 {
-    struct pico_tree socks; /* how you make the connection ? */
+    struct pico_rb_tree socks; /* sockets bound to this port */
+    struct pico_rb_node node;  /* in the per protocol port table */
     uint16_t number;
     uint16_t proto;
 };
 
+#define pico_sockport_foreach(idx, sp) pico_rb_foreach(idx, &(sp)->socks)
+#define pico_sockport_foreach_safe(idx, sp, idx2) pico_rb_foreach_safe(idx, &(sp)->socks, idx2)
+#define pico_sockport_entry(idx) pico_rb_entry(idx, struct pico_socket, node)
+
 
 struct pico_socket {
     struct pico_protocol *proto;
     struct pico_protocol *net;
 
+    /* Link in the sockport's socks tree */
+    struct pico_rb_node node;
+
     union pico_address local_addr;
     union pico_address remote_addr;
 
@@ -241,6 +249,7 @@ int pico_transport_process_in(struct pico_protocol *self, struct pico_frame *f);
 struct pico_socket *pico_socket_clone(struct pico_socket *facsimile);
 int8_t pico_socket_add(struct pico_socket *s);
 int pico_transport_error(struct pico_frame *f, uint8_t proto, int code);
+int pico_transport_pmtu_update(struct pico_frame *f, uint8_t proto);
 
 /* Socket loop */
 int pico_sockets_loop(int loop_score);
@@ -251,9 +260,13 @@ int pico_is_port_free(uint16_t proto, uint16_t port, void *addr, void *net);
 struct pico_sockport *pico_get_sockport(uint16_t proto, uint16_t port);
 
 uint32_t pico_socket_get_mss(struct pico_socket *s);
+uint32_t pico_socket_get_link_mss(struct pico_socket *s);
 int pico_socket_set_family(struct pico_socket *s, uint16_t family);
 
 int pico_count_sockets(uint8_t proto);
+/* Calls cb for every socket of proto (0 for TCP and UDP) until it returns
+ * nonzero. cb must not close sockets. Returns the number of calls. */
+int pico_socket_foreach(uint8_t proto, int (*cb)(struct pico_socket *s, void *arg), void *arg);
 
 #define PICO_SOCKET_SETOPT_EN(socket, index)  (socket->opt_flags |=  (1 << index))
 #define PICO_SOCKET_SETOPT_DIS(socket, index) (socket->opt_flags &= (uint16_t) ~(1 << index))
@@ -1,6 +1,14 @@
 #ifndef PICO_SOCKET_MULTICAST_H
 #define PICO_SOCKET_MULTICAST_H
 int pico_socket_mcast_filter(struct pico_socket *s, union pico_address *mcast_group, union pico_address *src);
+/* Iterator over the members of a group, zeroed to start */
+struct pico_mcast_it {
+    void *listen;
+    uint32_t gen;
+};
+/* Next socket on port that joined grp and accepts datagrams from src.
+ * If sockets joined, left or closed since the last call, the walk starts over. */
+struct pico_socket *pico_socket_mcast_next(struct pico_mcast_it *it, uint16_t proto, uint16_t port, union pico_address *grp, union pico_address *src);
 void pico_multicast_delete(struct pico_socket *s);
 int pico_setsockopt_mcast(struct pico_socket *s, int option, void *value);
 int pico_getsockopt_mcast(struct pico_socket *s, int option, void *value);
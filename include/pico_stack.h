@@ -9,7 +9,9 @@
 #include "pico_frame.h"
 #include "pico_constants.h"
 
+#ifndef PICO_MAX_TIMERS
 #define PICO_MAX_TIMERS 20
+#endif
 
 #define PICO_ETH_MRU (1514u)
 #define PICO_IP_MRU (1500u)
@@ -89,4 +91,13 @@ void pico_to_lowercase(char *str);
 int pico_address_compare(union pico_address *a, union pico_address *b, uint16_t proto);
 int32_t pico_seq_compare(uint32_t a, uint32_t b);
 
+#ifdef PICO_SUPPORT_SIMTIME
+/* For the pico_simtime driver: nonzero if the last pico_stack_tick() fired a
+ * timer or moved a frame, and the expiry of the first timer (-1 if none) */
+int pico_stack_tick_busy(void);
+int pico_timer_next(pico_time *expire);
+/* Restarts the stack's own pico_rand() sequence */
+void pico_rand_seed(uint32_t seed);
+#endif
+
 #endif
@@ -0,0 +1,73 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+ *********************************************************************/
+#ifndef INCLUDE_PICO_TOKEN_BUCKET
+#define INCLUDE_PICO_TOKEN_BUCKET
+#include "pico_config.h"
+
+/* Token bucket, refilled at 'rate' tokens per second up to 'burst' tokens.
+ * Time is in milliseconds, as pico_tick. */
+struct pico_token_bucket {
+    uint32_t rate;
+    uint32_t burst;
+    uint32_t tokens;
+    uint32_t frac;      /* thousandths of a token, earned but not yet whole */
+    pico_time last;
+};
+
+static inline void pico_token_bucket_init(struct pico_token_bucket *tb, uint32_t rate, uint32_t burst, pico_time now)
+{
+    tb->rate = rate;
+    tb->burst = (burst) ? (burst) : (rate);
+    tb->tokens = tb->burst;
+    tb->frac = 0;
+    tb->last = now;
+}
+
+static inline void pico_token_bucket_refill(struct pico_token_bucket *tb, pico_time now)
+{
+    pico_time elapsed;
+    uint64_t earned, add;
+
+    if (now <= tb->last)
+        return;
+
+    /* Beyond 49 days the bucket is full anyway, and the product fits */
+    elapsed = now - tb->last;
+    if (elapsed > 0xFFFFFFFFu)
+        elapsed = 0xFFFFFFFFu;
+
+    /* In thousandths of a token, what doesn't make a whole one is kept */
+    earned = elapsed * (uint64_t)tb->rate + tb->frac;
+    add = earned / 1000u;
+    tb->frac = (uint32_t)(earned % 1000u);
+    tb->last = now;
+
+    /* A full bucket drops the fraction of a token earned so far */
+    if (add >= (uint64_t)(tb->burst - tb->tokens)) {
+        tb->tokens = tb->burst;
+        tb->frac = 0;
+    } else {
+        tb->tokens += (uint32_t)add;
+    }
+}
+
+/* Takes n tokens if available. A request larger than the bucket is served
+ * when the bucket is full, so that it can never block forever.
+ * Returns 0 on success, -1 if the caller is over the limit. */
+static inline int pico_token_bucket_consume(struct pico_token_bucket *tb, uint32_t n, pico_time now)
+{
+    pico_token_bucket_refill(tb, now);
+    if (n > tb->burst)
+        n = tb->burst;
+
+    if (tb->tokens < n)
+        return -1;
+
+    tb->tokens -= n;
+    return 0;
+}
+
+#endif
@@ -90,4 +90,125 @@ struct pico_tree_node *pico_tree_prev(struct pico_tree_node *node);
          ((idx) != &LEAF) && ((idx2) = pico_tree_prev(idx), 1); \
          (idx) = (idx2))
 
+/*
+ * Intrusive variant: the node is embedded in the keyed struct, so inserting
+ * never allocates and a node leads to its key without a pointer chase.
+ * Leaves are NULL, an empty tree is { NULL }.
+ */
+struct pico_rb_node
+{
+    struct pico_rb_node *parent;
+    struct pico_rb_node *left;
+    struct pico_rb_node *right;
+    uint8_t color;
+};
+
+struct pico_rb_tree
+{
+    struct pico_rb_node *root;
+};
+
+#define PICO_RB_TREE_INIT { NULL }
+
+#define pico_rb_entry(ptr, type, member) \
+    ((type *)(void *)((uint8_t *)(ptr) - offsetof(type, member)))
+
+/* Rebalance after linking n as a leaf of the tree */
+void pico_rb_insert_color(struct pico_rb_tree *tree, struct pico_rb_node *n);
+void pico_rb_erase(struct pico_rb_tree *tree, struct pico_rb_node *n);
+struct pico_rb_node *pico_rb_first(const struct pico_rb_tree *tree);
+struct pico_rb_node *pico_rb_last(const struct pico_rb_tree *tree);
+struct pico_rb_node *pico_rb_next(const struct pico_rb_node *n);
+struct pico_rb_node *pico_rb_prev(const struct pico_rb_node *n);
+
+static inline void pico_rb_link(struct pico_rb_node *n, struct pico_rb_node *parent, struct pico_rb_node **link)
+{
+    n->parent = parent;
+    n->left = n->right = NULL;
+    n->color = 0; /* red */
+    *link = n;
+}
+
+static inline int pico_rb_empty(const struct pico_rb_tree *tree)
+{
+    return tree->root == NULL;
+}
+
+/* Only valid for nodes zeroed at allocation, erase clears them again */
+static inline int pico_rb_linked(const struct pico_rb_tree *tree, const struct pico_rb_node *n)
+{
+    return (n->parent != NULL) || (tree->root == n);
+}
+
+#define pico_rb_foreach(idx, tree) \
+    for ((idx) = pico_rb_first(tree); (idx); (idx) = pico_rb_next(idx))
+
+#define pico_rb_foreach_reverse(idx, tree) \
+    for ((idx) = pico_rb_last(tree); (idx); (idx) = pico_rb_prev(idx))
+
+#define pico_rb_foreach_safe(idx, tree, idx2) \
+    for ((idx) = pico_rb_first(tree); \
+         (idx) && ((idx2) = pico_rb_next(idx), 1); \
+         (idx) = (idx2))
+
+/*
+ * Typed accessors with the comparator resolved at compile time:
+ *   PICO_RB_GENERATE(routes, struct route, node, route_cmp)
+ * declares routes_find(), routes_insert(), routes_remove(), routes_first(),
+ * routes_last(), routes_next() and routes_prev(). cmp(a, b) takes two
+ * (type *) and returns <0, 0, >0. _insert returns the element already
+ * holding the key, or NULL once elm is linked.
+ */
+#define PICO_RB_GENERATE(name, type, field, cmp) \
+    static inline type *name ## _find(struct pico_rb_tree *tree, type *key) \
+    { \
+        struct pico_rb_node *n = tree->root; \
+        while (n) { \
+            int c = cmp(key, pico_rb_entry(n, type, field)); \
+            if (c == 0) \
+                return pico_rb_entry(n, type, field); \
+            n = (c < 0) ? n->left : n->right; \
+        } \
+        return NULL; \
+    } \
+    static inline type *name ## _insert(struct pico_rb_tree *tree, type *elm) \
+    { \
+        struct pico_rb_node **link = &tree->root, *parent = NULL; \
+        while (*link) { \
+            int c; \
+            parent = *link; \
+            c = cmp(elm, pico_rb_entry(parent, type, field)); \
+            if (c == 0) \
+                return pico_rb_entry(parent, type, field); \
+            link = (c < 0) ? &parent->left : &parent->right; \
+        } \
+        pico_rb_link(&elm->field, parent, link); \
+        pico_rb_insert_color(tree, &elm->field); \
+        return NULL; \
+    } \
+    static inline void name ## _remove(struct pico_rb_tree *tree, type *elm) \
+    { \
+        pico_rb_erase(tree, &elm->field); \
+    } \
+    static inline type *name ## _first(struct pico_rb_tree *tree) \
+    { \
+        struct pico_rb_node *n = pico_rb_first(tree); \
+        return n ? pico_rb_entry(n, type, field) : NULL; \
+    } \
+    static inline type *name ## _last(struct pico_rb_tree *tree) \
+    { \
+        struct pico_rb_node *n = pico_rb_last(tree); \
+        return n ? pico_rb_entry(n, type, field) : NULL; \
+    } \
+    static inline type *name ## _next(type *elm) \
+    { \
+        struct pico_rb_node *n = pico_rb_next(&elm->field); \
+        return n ? pico_rb_entry(n, type, field) : NULL; \
+    } \
+    static inline type *name ## _prev(type *elm) \
+    { \
+        struct pico_rb_node *n = pico_rb_prev(&elm->field); \
+        return n ? pico_rb_entry(n, type, field) : NULL; \
+    }
+
 #endif
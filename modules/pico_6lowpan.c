@@ -84,6 +84,20 @@
 #define FRAG1_DISPATCH      (0xC0)
 #define FRAGN_DISPATCH      (0xE0)
 #define FRAG_TIMEOUT        (5)
+/* Datagrams in reassembly at once, over all senders. A context costs about
+ * 80 bytes of static RAM, its datagram buffer is only allocated while in use.
+ * A border router wants roughly one per node that may be sending fragmented
+ * traffic within FRAG_TIMEOUT: the default covers 64 of them. */
+#ifndef PICO_6LOWPAN_REASSEMBLY_CTX
+#define PICO_6LOWPAN_REASSEMBLY_CTX (64)
+#endif
+/* Contexts a single sender may hold, so one burst can't evict everyone else */
+#ifndef PICO_6LOWPAN_REASSEMBLY_PER_SRC
+#define PICO_6LOWPAN_REASSEMBLY_PER_SRC (4)
+#endif
+#define REASM_HASH_SIZE     (32)    /* Power of two */
+#define REASM_WHEEL_SLOTS   (8)     /* One per second, more than FRAG_TIMEOUT */
+#define REASM_UNITS         (256)   /* 8-octet units in an 11-bit datagram_size */
 /*******************************************************************************
  * Type definitions
  ******************************************************************************/
@@ -105,6 +119,20 @@ struct frag_ctx {
     pico_time timestamp;
 };
 
+/* Reassembly context, the datagram is placed in f as fragments come in */
+struct reasm_ctx {
+    struct pico_frame *f;           /* NULL while the context is free */
+    struct reasm_ctx *next;         /* Hash chain or free list */
+    struct reasm_ctx *wnext;        /* Timer wheel slot */
+    struct reasm_ctx **wprev;
+    uint16_t dgram_size;
+    uint16_t dgram_tag;
+    uint16_t copied;
+    uint8_t key;
+    uint32_t seq;                   /* Order of creation */
+    uint8_t units[REASM_UNITS >> 3]; /* Units received */
+};
+
 /*******************************************************************************
  *  Global Variables
  ******************************************************************************/
@@ -156,28 +184,7 @@ frag_ctx_cmp(void *a, void *b)
     return (int32_t)(fa->hash - fb->hash);
 }
 
-/* Compares two fragmentation cookies according to RFC4944 5.3 */
-static int32_t
-frag_cmp(void *a, void *b)
-{
-    struct frag_ctx *fa = (struct frag_ctx *)a;
-    struct frag_ctx *fb = (struct frag_ctx *)b;
-    int32_t ret = 0;
-    if (fa->dgram_size != fb->dgram_size) {
-        return (int32_t)(fa->dgram_size - fb->dgram_size);
-    } else if (fa->dgram_tag != fb->dgram_tag) {
-        return (int32_t)(fa->dgram_tag - fb->dgram_tag);
-    } else {
-        if ((ret = pico_6lowpan_lls[fa->f->dev->mode].addr_cmp(&fa->f->src, &fb->f->src))) {
-            return ret;
-        } else {
-            return pico_6lowpan_lls[fa->f->dev->mode].addr_cmp(&fa->f->dst, &fb->f->dst);
-        }
-    }
-}
-
 PICO_TREE_DECLARE(FragTree, &frag_ctx_cmp);
-PICO_TREE_DECLARE(ReassemblyTree, &frag_cmp);
 
 /* Find a fragmentation cookie for transmission of subsequent fragments */
 static struct frag_ctx *
@@ -187,52 +194,10 @@ frag_ctx_find(uint32_t hash)
     return pico_tree_findKey(&FragTree, &f);
 }
 
-/* Reassembly timeout function, deletes */
-static void
-frag_timeout(pico_time now, void *arg)
-{
-    struct pico_tree_node *i = NULL, *next = NULL;
-    struct frag_ctx *key = NULL;
-    IGNORE_PARAMETER(arg);
-    pico_tree_foreach_safe(i, &ReassemblyTree, next) {
-        if ((key = i->keyValue)) {
-            if ((pico_time)(FRAG_TIMEOUT * 1000) <= (now - key->timestamp)) {
-                lp_dbg("Timeout for reassembly: %d\n", key->dgram_tag);
-                pico_tree_delete(&ReassemblyTree, key);
-                pico_frame_discard(key->f);
-                PICO_FREE(key);
-            }
-        }
-    }
-
-    /* If adding a timer fails, there's not really an easy way to recover, so abort all ongoing
-     * reassemblies
-     * TODO: Maybe using a global variable allows recovering from this situation */
-    if (0 == pico_timer_add(1000, frag_timeout, NULL)) {
-        lp_dbg("6LP: Failed to set reassembly timeout! Aborting all ongoing reassemblies...\n");
-        pico_tree_foreach_safe(i, &ReassemblyTree, next) {
-            if ((key = i->keyValue)) {
-                pico_tree_delete(&ReassemblyTree, key);
-                pico_frame_discard(key->f);
-                PICO_FREE(key);
-            }
-        }
-    }
-}
-
-/* Finds a reassembly cookie in the reassembly-tree */
-static struct frag_ctx *
-frag_find(uint16_t dgram_size, uint16_t tag, struct pico_frame *frame)
-{
-    struct frag_ctx f = {.f = frame, .dgram_size = dgram_size, .dgram_tag = tag};
-    return pico_tree_findKey(&ReassemblyTree, &f);
-}
-
-/* Stores a fragmentation cookie in either the fragmentetion cookie tree or
- * in the reassembly tree */
+/* Stores a fragmentation cookie in the fragmentation cookie tree */
 static int32_t
 frag_store(struct pico_frame *f, uint16_t dgram_size, uint16_t tag,
-           uint8_t dgram_off, uint16_t copied, struct pico_tree *tree)
+           uint8_t dgram_off, uint16_t copied)
 {
     struct frag_ctx *fr = PICO_ZALLOC(sizeof(struct frag_ctx));
     if (fr) {
@@ -242,15 +207,10 @@ frag_store(struct pico_frame *f, uint16_t dgram_size, uint16_t tag,
         fr->dgram_tag = tag;
         fr->copied = copied;
         fr->timestamp = PICO_TIME_MS();
-        if (&FragTree == tree) {
-            fr->hash = pico_hash((void *)fr, sizeof(struct frag_ctx));
-            f->hash = fr->hash; // Also set hash in frame so we can identify it
-            lp_dbg("6LP: START: "ORG"fragmentation"RST" with hash '%X' of %u bytes.\n", fr->hash, f->len);
-        } else {
-            lp_dbg("6LP: START: "GRN"reassembly"RST" with tag '%d' of %u bytes.\n", tag, dgram_size);
-        }
-        /* Insert the cookie in the appropriate tree (FragTree/ReassemblyTree) */
-        if (pico_tree_insert(tree, fr)) {
+        fr->hash = pico_hash((void *)fr, sizeof(struct frag_ctx));
+        f->hash = fr->hash; // Also set hash in frame so we can identify it
+        lp_dbg("6LP: START: "ORG"fragmentation"RST" with hash '%X' of %u bytes.\n", fr->hash, f->len);
+        if (pico_tree_insert(&FragTree, fr)) {
             PICO_FREE(fr);
             return -1;
         }
@@ -260,6 +220,238 @@ frag_store(struct pico_frame *f, uint16_t dgram_size, uint16_t tag,
     return (1); // Succes for 'proto_loop_out'
 }
 
+/*******************************************************************************
+ *  Reassembly
+ *  Contexts come from a fixed pool and are hashed on (src, dst, tag, size).
+ *  Each one sits in the slot of a timer wheel where it expires, the wheel
+ *  only turns while there are reassemblies going on.
+ ******************************************************************************/
+
+static struct reasm_ctx reasm_pool[PICO_6LOWPAN_REASSEMBLY_CTX];
+static struct reasm_ctx *reasm_free = NULL;
+static struct reasm_ctx *reasm_hash[REASM_HASH_SIZE];
+static struct reasm_ctx *reasm_wheel[REASM_WHEEL_SLOTS];
+static uint8_t reasm_wheel_pos = 0;
+static uint32_t reasm_active = 0;
+static uint32_t reasm_timer = 0;
+static uint32_t reasm_seq = 0;
+
+static void
+reasm_init(void)
+{
+    int i = 0;
+
+    /* Keep reassemblies in progress on a stack re-init */
+    if (reasm_active)
+        return;
+
+    memset(reasm_pool, 0, sizeof(reasm_pool));
+    memset(reasm_hash, 0, sizeof(reasm_hash));
+    memset(reasm_wheel, 0, sizeof(reasm_wheel));
+    reasm_free = NULL;
+    for (i = PICO_6LOWPAN_REASSEMBLY_CTX - 1; i >= 0; i--) {
+        reasm_pool[i].next = reasm_free;
+        reasm_free = &reasm_pool[i];
+    }
+}
+
+static uint8_t
+reasm_key(struct pico_frame *f, uint16_t dgram_size, uint16_t tag)
+{
+    struct pico_6lowpan_ll_protocol *ll = &pico_6lowpan_lls[f->dev->mode];
+    uint8_t iid[16] = { 0 };
+    uint32_t h = ((uint32_t)tag << 16) | dgram_size;
+    int i = 0;
+
+    if (ll->addr_iid) {
+        ll->addr_iid(iid, &f->src);
+        ll->addr_iid(iid + 8, &f->dst);
+    }
+    for (i = 0; i < 16; i++)
+        h = (h ^ iid[i]) * 16777619u;
+    h ^= h >> 16;
+    return (uint8_t)(h & (REASM_HASH_SIZE - 1));
+}
+
+/* Same datagram according to RFC4944 5.3 */
+static struct reasm_ctx *
+reasm_find(struct pico_frame *f, uint16_t dgram_size, uint16_t tag, uint8_t key)
+{
+    struct pico_6lowpan_ll_protocol *ll = &pico_6lowpan_lls[f->dev->mode];
+    struct reasm_ctx *c = reasm_hash[key];
+
+    while (c) {
+        if (c->dgram_size == dgram_size && c->dgram_tag == tag &&
+            c->f->dev == f->dev &&
+            !ll->addr_cmp(&c->f->src, &f->src) && !ll->addr_cmp(&c->f->dst, &f->dst))
+            return c;
+        c = c->next;
+    }
+    return NULL;
+}
+
+/* Takes a context out of the hash and the wheel, discards the datagram
+ * unless it's been handed on */
+static void
+reasm_release(struct reasm_ctx *c, int discard)
+{
+    struct reasm_ctx **pp = &reasm_hash[c->key];
+
+    while (*pp && *pp != c)
+        pp = &(*pp)->next;
+    if (*pp)
+        *pp = c->next;
+
+    *c->wprev = c->wnext;
+    if (c->wnext)
+        c->wnext->wprev = c->wprev;
+
+    if (discard)
+        pico_frame_discard(c->f);
+    c->f = NULL;
+    c->next = reasm_free;
+    reasm_free = c;
+    reasm_active--;
+}
+
+static void
+reasm_tick(pico_time now, void *arg)
+{
+    IGNORE_PARAMETER(now);
+    IGNORE_PARAMETER(arg);
+
+    reasm_timer = 0;
+    reasm_wheel_pos = (uint8_t)((reasm_wheel_pos + 1) % REASM_WHEEL_SLOTS);
+    while (reasm_wheel[reasm_wheel_pos]) {
+        lp_dbg("Timeout for reassembly: %d\n", reasm_wheel[reasm_wheel_pos]->dgram_tag);
+        reasm_release(reasm_wheel[reasm_wheel_pos], 1);
+    }
+
+    if (reasm_active) {
+        reasm_timer = pico_timer_add(1000, reasm_tick, NULL);
+        if (!reasm_timer) {
+            /* Nothing would expire anymore, abort all ongoing reassemblies */
+            lp_dbg("6LP: Failed to set reassembly timeout! Aborting all ongoing reassemblies...\n");
+            while (reasm_active) {
+                while (!reasm_wheel[reasm_wheel_pos])
+                    reasm_wheel_pos = (uint8_t)((reasm_wheel_pos + 1) % REASM_WHEEL_SLOTS);
+                reasm_release(reasm_wheel[reasm_wheel_pos], 1);
+            }
+        }
+    }
+}
+
+/* The context that expires first */
+static struct reasm_ctx *
+reasm_oldest(void)
+{
+    uint8_t i = 0, slot = 0;
+
+    for (i = 1; i <= REASM_WHEEL_SLOTS; i++) {
+        slot = (uint8_t)((reasm_wheel_pos + i) % REASM_WHEEL_SLOTS);
+        if (reasm_wheel[slot])
+            return reasm_wheel[slot];
+    }
+    return NULL;
+}
+
+/* The oldest context of the sender of 'f' if it already holds its share */
+static struct reasm_ctx *
+reasm_src_full(struct pico_frame *f)
+{
+    struct pico_6lowpan_ll_protocol *ll = &pico_6lowpan_lls[f->dev->mode];
+    struct reasm_ctx *c = NULL, *oldest = NULL;
+    uint32_t n = 0;
+    int i = 0;
+
+    for (i = 0; i < PICO_6LOWPAN_REASSEMBLY_CTX; i++) {
+        c = &reasm_pool[i];
+        if (!c->f || c->f->dev != f->dev || ll->addr_cmp(&c->f->src, &f->src))
+            continue;
+        if (!oldest || (int32_t)(c->seq - oldest->seq) < 0)
+            oldest = c;
+        n++;
+    }
+    return (n >= PICO_6LOWPAN_REASSEMBLY_PER_SRC) ? oldest : NULL;
+}
+
+static struct reasm_ctx *
+reasm_new(struct pico_frame *f, uint16_t dgram_size, uint16_t tag, uint8_t key)
+{
+    struct reasm_ctx *c = NULL;
+    struct pico_frame *r = NULL;
+    uint8_t slot = 0;
+
+    if (!reasm_timer) {
+        reasm_timer = pico_timer_add(1000, reasm_tick, NULL);
+        if (!reasm_timer)
+            return NULL;
+    }
+
+    /* Sender at its share, its own oldest reassembly makes way */
+    if ((c = reasm_src_full(f))) {
+        lp_dbg("6LP: Sender holds %d reassemblies, dropping tag '%u'\n", PICO_6LOWPAN_REASSEMBLY_PER_SRC, c->dgram_tag);
+        reasm_release(c, 1);
+    }
+
+    /* Pool exhausted, the oldest reassembly makes way */
+    if (!reasm_free) {
+        lp_dbg("6LP: Reassembly pool full, dropping tag '%u'\n", reasm_oldest()->dgram_tag);
+        reasm_release(reasm_oldest(), 1);
+    }
+
+    r = pico_proto_6lowpan_ll.alloc(&pico_proto_6lowpan_ll, f->dev, dgram_size);
+    if (!r)
+        return NULL;
+
+    r->start = r->buffer + (int32_t)(r->buffer_len - (uint32_t)dgram_size);
+    r->len = dgram_size;
+    r->net_hdr = r->start;
+    r->net_len = 0;
+    r->transport_len = dgram_size;
+    r->src = f->src;
+    r->dst = f->dst;
+
+    c = reasm_free;
+    reasm_free = c->next;
+    memset(c->units, 0, sizeof(c->units));
+    c->f = r;
+    c->dgram_size = dgram_size;
+    c->dgram_tag = tag;
+    c->copied = 0;
+    c->key = key;
+    c->seq = reasm_seq++;
+    c->next = reasm_hash[key];
+    reasm_hash[key] = c;
+
+    /* Expires after FRAG_TIMEOUT to FRAG_TIMEOUT + 1 seconds */
+    slot = (uint8_t)((reasm_wheel_pos + FRAG_TIMEOUT + 1) % REASM_WHEEL_SLOTS);
+    c->wnext = reasm_wheel[slot];
+    if (c->wnext)
+        c->wnext->wprev = &c->wnext;
+    reasm_wheel[slot] = c;
+    c->wprev = &reasm_wheel[slot];
+    reasm_active++;
+    lp_dbg("6LP: START: "GRN"reassembly"RST" with tag '%d' of %u bytes.\n", tag, dgram_size);
+    return c;
+}
+
+/* Marks the units of a fragment as received, returns the number of bytes
+ * that weren't received before, so duplicates don't count */
+static uint16_t
+reasm_mark(struct reasm_ctx *c, uint16_t off, uint16_t len)
+{
+    uint16_t u = 0, end = (uint16_t)(off + len), fresh = 0;
+
+    for (u = (uint16_t)(off >> 3); (uint16_t)(u << 3) < end; u++) {
+        if (c->units[u >> 3] & (1u << (u & 7)))
+            continue;
+        c->units[u >> 3] = (uint8_t)(c->units[u >> 3] | (1u << (u & 7)));
+        fresh = (uint16_t)(fresh + (((u + 1) << 3) > end ? (end - (u << 3)) : 8));
+    }
+    return fresh;
+}
+
 /*******************************************************************************
  *  IPHC
  ******************************************************************************/
@@ -926,7 +1118,7 @@ compressor_nhc_ext(struct pico_frame *f, int32_t *compressed_len, uint8_t *nh)
             buf_move(buf + lead, (uint8_t *)ext, (size_t)(len - lead));
             buf[0] = dispatch; // Set the dispatch header
             *compressed_len = len;
-            f->net_hdr += *compressed_len; // Move to next header
+            f->net_hdr += ret; // Move to next header, past the original one
             return buf;
         }
     }
@@ -958,6 +1150,14 @@ ext_nh_retrieve(uint8_t *buf, int32_t len)
     return 0;
 }
 
+/* Checks whether a NHC compressed header follows, ext_nh_retrieve can't tell
+ * since the hop-by-hop header is 0 */
+static int
+nhc_follows(uint8_t *buf)
+{
+    return ((buf[0] & 0xF0) == EXT_DISPATCH) || ((buf[0] & 0xF8) == UDP_DISPATCH);
+}
+
 /* RFC6282: A decompressor MUST ensure that the
  * containing header is padded out to a multiple of 8 octets in length,
  * using a Pad1 or PadN option if necessary. */
@@ -1028,8 +1228,9 @@ decompressor_nhc_ext(struct pico_frame *f, int32_t *compressed_len, int32_t *dec
             ext = (struct pico_ipv6_exthdr *)PICO_ZALLOC((size_t)alloc);
             if (ext) {
                 buf_move((uint8_t *)ext + head, buf + 1, (size_t)(len - head));
-                ext->nxthdr = nh;
-                if (EXT_HOPBYHOP == eid || EXT_DSTOPT == eid || EXT_ROUTING) {
+                if (head) // Next header was elided, take it from what follows
+                    ext->nxthdr = nh;
+                if (EXT_HOPBYHOP == eid || EXT_DSTOPT == eid || EXT_ROUTING == eid) {
                     ext->ext.destopt.len = (uint8_t)((alloc / 8) - 1);
                     ext_align((uint8_t *)ext, alloc, len);
                 }
@@ -1108,7 +1309,7 @@ pico_iphc_reassemble(struct pico_frame *f, uint8_t **chunks, int32_t *chunks_len
 static struct pico_frame *
 pico_iphc_compress(struct pico_frame *f)
 {
-    int32_t i = 0, compressed_len = 0, loop = 1, uncompressed = f->net_len;
+    int32_t i = 0, compressed_len = 0, loop = 1, uncompressed = 0;
     uint8_t *old_nethdr = f->net_hdr; // Save net_hdr temporary ...
     uint8_t nh = PICO_PROTO_IPV6;
     uint8_t *chunks[8] = { NULL };
@@ -1146,6 +1347,8 @@ pico_iphc_compress(struct pico_frame *f)
         compressed_len += chunks_len[i++];
     } while (compressible_nh(nh) && loop && i < 8);
 
+    /* Headers walked so far, whether or not the stack counted them in net_len */
+    uncompressed += (int32_t)(f->net_hdr - old_nethdr);
     f->net_hdr = old_nethdr; // ... Restore old net_hdr
     return pico_iphc_reassemble(f, chunks, chunks_len, i, compressed_len, uncompressed);
 }
@@ -1214,7 +1417,7 @@ pico_iphc_decompress(struct pico_frame *f)
         /* Get next dispatch header */
         f->net_hdr += ret;
         dispatch = ext_nh_retrieve(f->net_hdr, 0);
-    } while (dispatch && loop && i < 8);
+    } while (nhc_follows(f->net_hdr) && loop && i < 8);
     f->net_hdr = old_nethdr; // ... Restore old net_hdr
 
     /* Reassemble gathererd decompressed buffers */
@@ -1358,7 +1561,7 @@ frag_1st(struct pico_frame *f, uint16_t dgram_size, uint8_t dgram_off, uint16_t
             return -1;
 
         /* Everything was a success store a cookie for subsequent fragments */
-        return frag_store(f, dgram_size, dgram_tag++, dgram_off, copy, &FragTree);
+        return frag_store(f, dgram_size, dgram_tag++, dgram_off, copy);
     } else {
         pico_err = PICO_ERR_ENOMEM;
         return -1;
@@ -1515,51 +1718,48 @@ pico_6lowpan_decompress(struct pico_frame *f)
     }
 }
 
+/* Places a fragment directly at its offset in the datagram buffer */
 static int32_t
-defrag_new(struct pico_frame *f, uint16_t dgram_size, uint16_t tag, uint16_t off)
+defrag_place(struct pico_frame *f, uint16_t dgram_size, uint16_t tag, uint16_t off)
 {
-    struct pico_frame *r = pico_proto_6lowpan_ll.alloc(&pico_proto_6lowpan_ll, f->dev, dgram_size);
-    if (r) {
-        r->start = r->buffer + (int32_t)(r->buffer_len - (uint32_t)dgram_size);
-        r->len = dgram_size;
-        r->net_hdr = r->start;
+    uint8_t key = reasm_key(f, dgram_size, tag);
+    struct reasm_ctx *c = reasm_find(f, dgram_size, tag, key);
+    struct pico_frame *r = NULL;
+
+    if (!f->len || ((uint32_t)off + f->len > dgram_size)) {
+        lp_dbg("6LP: RCVD fragment beyond datagram size\n");
+        pico_frame_discard(f);
+        return -1;
+    }
+
+    if (!c && !(c = reasm_new(f, dgram_size, tag, key))) {
+        pico_frame_discard(f);
+        return -1;
+    }
+
+    r = c->f;
+    buf_move(r->net_hdr + off, f->start, f->len);
+    if (!off) {
         r->net_len = f->net_len;
         r->transport_len = (uint16_t)(r->len - r->net_len);
-        r->src = f->src;
-        r->dst = f->dst;
-        buf_move(r->net_hdr + off, f->start, f->len);
-        if (frag_store(r, dgram_size, tag, 0, (uint16_t)f->len, &ReassemblyTree) < 0) {
-            pico_frame_discard(f);
-            pico_frame_discard(r);
-            return -1;
-        }
     }
+    c->copied = (uint16_t)(c->copied + reasm_mark(c, off, (uint16_t)f->len));
     pico_frame_discard(f);
-    return 1;
-}
 
-static int32_t
-defrag_update(struct frag_ctx *frag, uint16_t off, struct pico_frame *f)
-{
-    struct pico_frame *r = frag->f;
-    buf_move(r->start + (int32_t)off, f->start, f->len); // Copy at start
-    frag->copied = (uint16_t)(frag->copied + (uint16_t)f->len);
-    pico_frame_discard(f);
-    if (frag->copied >= frag->dgram_size) { // Datagram completely reassembled
-        lp_dbg("6LP: FIN: "GRN"reassembly"RST" with tag '%u', stats:  len: %d net: %d trans: %d\n", frag->dgram_tag, r->len, r->net_len, r->transport_len);
-        pico_tree_delete(&ReassemblyTree, frag);
-        PICO_FREE(frag);
+    if (c->copied < c->dgram_size) {
+        lp_dbg("6LP: UPDATE: "GRN"reassembly"RST" with tag '%u', %u of %u bytes received\n", c->dgram_tag, c->copied, c->dgram_size);
+        return (int32_t)r->len;
+    }
+
+    lp_dbg("6LP: FIN: "GRN"reassembly"RST" with tag '%u', stats:  len: %d net: %d trans: %d\n", c->dgram_tag, r->len, r->net_len, r->transport_len);
+    reasm_release(c, 0);
 #ifdef PICO_6LOWPAN_IPHC_ENABLED
-        r = pico_ipv6_finalize(r, 0);
+    r = pico_ipv6_finalize(r, 0);
 #endif
-        return pico_network_receive(r);
-    } else {
-        lp_dbg("6LP: UPDATE: "GRN"reassembly"RST" with tag '%u', %u of %u bytes received\n", frag->dgram_tag, frag->copied, frag->dgram_size);
-    }
-    return (int32_t)r->len;
+    return pico_network_receive(r);
 }
 
-static struct frag_ctx *
+static void
 defrag_remove_header(struct pico_frame *f, uint16_t *dgram_size, uint16_t *tag, uint16_t *off, int32_t size)
 {
     *dgram_size = (uint16_t)(((uint16_t)(f->net_hdr[0] & 0x07) << 8) | (uint16_t)f->net_hdr[1]);
@@ -1569,33 +1769,27 @@ defrag_remove_header(struct pico_frame *f, uint16_t *dgram_size, uint16_t *tag,
     f->len = (uint32_t)(f->len - (uint32_t)size);
     f->net_hdr += size;
     f->start = f->net_hdr;
-    return frag_find(*dgram_size, *tag, f);
 }
 
 static int32_t
 defrag(struct pico_frame *f)
 {
     uint16_t size = 0, tag = 0, off = 0;
-    struct frag_ctx *frag = NULL;
 
     if ((f->net_hdr[0] & 0xF8) == FRAG1_DISPATCH) {
-        frag = defrag_remove_header(f, &size, &tag, &off, FRAG1_SIZE);
+        defrag_remove_header(f, &size, &tag, &off, FRAG1_SIZE);
         if (!(f = pico_6lowpan_decompress(f)))
             return -1;
         off = 0;
     } else if ((f->net_hdr[0] & 0xF8) == FRAGN_DISPATCH) {
-        frag = defrag_remove_header(f, &size, &tag, &off, FRAGN_SIZE);
+        defrag_remove_header(f, &size, &tag, &off, FRAGN_SIZE);
     } else {
         lp_dbg("6LP: RCVD invalid frame\n");
         pico_frame_discard(f);
         return -1;
     }
 
-    if (frag) {
-        return defrag_update(frag, off, f);
-    } else {
-        return defrag_new(f, size, tag, off);
-    }
+    return defrag_place(f, size, tag, off);
 }
 
 static int32_t
@@ -1638,9 +1832,7 @@ struct pico_protocol pico_proto_6lowpan = {
 int pico_6lowpan_init(void)
 {
     pico_6lowpan_ll_init();
-    if (0 == pico_timer_add(1000, frag_timeout, NULL)) {
-        return -1; /* We care if timer fails, results in memory leak if frames don't get reassembled */
-    }
+    reasm_init();
     return 0;
 }
 
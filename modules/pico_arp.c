@@ -9,7 +9,6 @@
 
 #include "pico_config.h"
 #include "pico_arp.h"
-#include "pico_tree.h"
 #include "pico_ipv4.h"
 #include "pico_device.h"
 #include "pico_stack.h"
@@ -18,7 +17,17 @@
 extern const uint8_t PICO_ETHADDR_ALL[6];
 #define PICO_ARP_TIMEOUT 600000llu
 #define PICO_ARP_RETRY 300lu
-#define PICO_ARP_MAX_PENDING 5
+#define PICO_ARP_MAX_REQUESTS 3
+
+/* Frames parked on each unresolved neighbour */
+#ifndef PICO_ARP_MAX_PENDING
+#define PICO_ARP_MAX_PENDING 8
+#endif
+
+/* Destination to neighbour cache slots, power of two */
+#ifndef PICO_ARP_DST_CACHE
+#define PICO_ARP_DST_CACHE 16
+#endif
 
 #ifdef DEBUG_ARP
     #define arp_dbg dbg
@@ -27,24 +36,6 @@ extern const uint8_t PICO_ETHADDR_ALL[6];
 #endif
 
 static int max_arp_reqs = PICO_ARP_MAX_RATE;
-static struct pico_frame *frames_queued[PICO_ARP_MAX_PENDING] = {
-    0
-};
-
-static void pico_arp_queued_trigger(void)
-{
-    int i;
-    struct pico_frame *f;
-    for (i = 0; i < PICO_ARP_MAX_PENDING; i++)
-    {
-        f = frames_queued[i];
-        if (f) {
-            if (pico_datalink_send(f) <= 0)
-                pico_frame_discard(f);
-            frames_queued[i] = NULL;
-        }
-    }
-}
 
 static void update_max_arp_reqs(pico_time now, void *unused)
 {
@@ -99,211 +90,230 @@ static struct arp_service_ipconflict conflict_ipv4;
 
 #define PICO_SIZE_ARPHDR ((sizeof(struct pico_arp_hdr)))
 
-/* Arp Entries for the tables. */
-struct pico_arp {
-/* CAREFUL MAN! ARP entry MUST begin with a pico_eth structure,
- * due to in-place casting!!! */
-    struct pico_eth eth;
-    struct pico_ip4 ipv4;
-    int arp_status;
-    pico_time timestamp;
-    struct pico_device *dev;
-    uint32_t timer;
+/* Next hop resolved for a destination, valid while the routes are unchanged */
+struct pico_arp_dst {
+    struct pico_ip4 dst;
+    uint32_t gen;
+    struct pico_neighbor *nb;
 };
 
+static struct pico_arp_dst arp_dst_cache[PICO_ARP_DST_CACHE];
+
+static int32_t arp_request_to(struct pico_device *dev, struct pico_ip4 *dst, uint8_t type, const uint8_t *hwdst);
 
+static pico_time arp_retrans(struct pico_neighbor *n)
+{
+    IGNORE_PARAMETER(n);
+    return PICO_ARP_RETRY;
+}
 
-/*****************/
-/**  ARP TREE **/
-/*****************/
+/* INCOMPLETE entries broadcast their requests, PROBE entries poll the cached address */
+static void arp_solicit(struct pico_neighbor *n)
+{
+    const uint8_t *hwdst = PICO_ETHADDR_ALL;
+
+    if (!n->dev)
+        return;
 
-/* Routing destination */
+    if (n->state == PICO_NEIGH_PROBE)
+        hwdst = n->hwaddr.mac.addr;
 
-static int arp_compare(void *ka, void *kb)
+    arp_dbg("================= ARP REQUIRED: %d =============\n\n", n->probes);
+    arp_request_to(n->dev, &n->addr.ip4, PICO_ARP_QUERY, hwdst);
+}
+
+static void pico_arp_unreachable(struct pico_neighbor *n)
 {
-    struct pico_arp *a = ka, *b = kb;
-    return pico_ipv4_compare(&a->ipv4, &b->ipv4);
+    struct pico_frame *f;
+
+    for (f = n->pending.head; f; f = f->next) {
+        if (!pico_source_is_local(f))
+            pico_notify_dest_unreachable(f);
+    }
 }
 
-static PICO_TREE_DECLARE(arp_tree, arp_compare);
+static void arp_release(struct pico_neighbor *n)
+{
+    int i;
 
-/*********************/
-/**  END ARP TREE **/
-/*********************/
+    for (i = 0; i < PICO_ARP_DST_CACHE; i++) {
+        if (arp_dst_cache[i].nb == n)
+            arp_dst_cache[i].nb = NULL;
+    }
+}
+
+static const struct pico_neighbor_proto arp_proto = {
+    .l3_proto = PICO_IDETH_IPV4,
+    .addr_len = PICO_SIZE_IP4,
+    .max_solicit = PICO_ARP_MAX_REQUESTS,
+    .max_pending = PICO_ARP_MAX_PENDING,
+    .reachable = PICO_ARP_TIMEOUT,
+    .delay = 0,
+    .gc = PICO_ARP_TIMEOUT,
+    .retrans = arp_retrans,
+    .solicit = arp_solicit,
+    .unreachable = pico_arp_unreachable,
+    .release = arp_release,
+};
+
+static struct pico_neighbor *arp_find(struct pico_device *dev, uint32_t addr)
+{
+    return pico_neighbor_find(&arp_proto, dev, &addr);
+}
 
 struct pico_eth *pico_arp_lookup(struct pico_ip4 *dst)
 {
-    struct pico_arp search, *found;
-    search.ipv4.addr = dst->addr;
-    found = pico_tree_findKey(&arp_tree, &search);
-    if (found && (found->arp_status != PICO_ARP_STATUS_STALE))
-        return &found->eth;
+    struct pico_neighbor *found = arp_find(NULL, dst->addr);
+    if (found && (found->state != PICO_ARP_STATUS_INCOMPLETE))
+        return &found->hwaddr.mac;
 
     return NULL;
 }
 
 struct pico_ip4 *pico_arp_reverse_lookup(struct pico_eth *dst)
 {
-    struct pico_arp*search;
-    struct pico_tree_node *index;
-    pico_tree_foreach(index, &arp_tree){
-        search = index->keyValue;
-        if(memcmp(&(search->eth.addr), &dst->addr, 6) == 0)
-            return &search->ipv4;
+    struct pico_neighbor *search = NULL;
+
+    while ((search = pico_neighbor_next(&arp_proto, search)) != NULL) {
+        if ((search->state != PICO_ARP_STATUS_INCOMPLETE) &&
+            (memcmp(&(search->hwaddr.mac.addr), &dst->addr, 6) == 0))
+            return &search->addr.ip4;
     }
     return NULL;
 }
 
-static void pico_arp_unreachable(struct pico_ip4 *a)
+static struct pico_arp_dst *arp_dst_slot(struct pico_ip4 *dst)
 {
-    int i;
-    struct pico_frame *f;
-    struct pico_ipv4_hdr *hdr;
-    struct pico_ip4 dst;
-    for (i = 0; i < PICO_ARP_MAX_PENDING; i++)
-    {
-        f = frames_queued[i];
-        if (f) {
-            hdr = (struct pico_ipv4_hdr *) f->net_hdr;
-            dst = pico_ipv4_route_get_gateway(&hdr->dst);
-            if (!dst.addr)
-                dst.addr = hdr->dst.addr;
-
-            if (dst.addr ==  a->addr) {
-                if (!pico_source_is_local(f)) {
-                    pico_notify_dest_unreachable(f);
-                }
-
-            }
-        }
-    }
+    uint32_t h = dst->addr;
+
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return &arp_dst_cache[h & (PICO_ARP_DST_CACHE - 1)];
+}
+
+/* Neighbour entry for the next hop of the frame, from the destination
+ * cache when the routes did not change since it was filled */
+static struct pico_neighbor *arp_dst_get(struct pico_frame *f)
+{
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *) f->net_hdr;
+    struct pico_arp_dst *d = arp_dst_slot(&hdr->dst);
+
+    if (d->nb && (d->dst.addr == hdr->dst.addr) && (d->nb->dev == f->dev) &&
+        (d->gen == pico_ipv4_route_generation()))
+        return d->nb;
+
+    return NULL;
 }
 
-static void pico_arp_retry(struct pico_frame *f, struct pico_ip4 *where)
+static struct pico_neighbor *arp_dst_resolve(struct pico_frame *f)
 {
-    if (++f->failure_count < 4) {
-        arp_dbg ("================= ARP REQUIRED: %d =============\n\n", f->failure_count);
-        /* check if dst is local (gateway = 0), or if to use gateway */
-        pico_arp_request(f->dev, where, PICO_ARP_QUERY);
-    } else {
-        pico_arp_unreachable(where);
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *) f->net_hdr;
+    struct pico_arp_dst *d = arp_dst_slot(&hdr->dst);
+    struct pico_ip4 where;
+    struct pico_neighbor *n;
+
+    /* check if dst is local (gateway = 0), or if to use gateway */
+    where = pico_ipv4_route_get_gateway(&hdr->dst);
+    if (!where.addr)
+        where.addr = hdr->dst.addr;
+
+    n = arp_find(f->dev, where.addr);
+    if (!n) {
+        n = pico_neighbor_add(&arp_proto, f->dev, &where);
+        if (!n)
+            return NULL;
+
+        if (pico_neighbor_solicit(n) < 0) {
+            pico_neighbor_del(n);
+            return NULL;
+        }
     }
+
+    d->dst.addr = hdr->dst.addr;
+    d->gen = pico_ipv4_route_generation();
+    d->nb = n;
+    return n;
 }
 
-struct pico_eth *pico_arp_get(struct pico_frame *f)
+struct pico_neighbor *pico_arp_resolve(struct pico_frame *f, struct pico_eth **local)
 {
-    struct pico_eth *a4;
-    struct pico_ip4 gateway;
-    struct pico_ip4 *where;
     struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *) f->net_hdr;
     struct pico_ipv4_link *l;
+    struct pico_neighbor *n;
+
+    *local = NULL;
     if (!hdr)
         return NULL;
 
-    l = pico_ipv4_link_get(&hdr->dst);
-    if(l) {
-        /* address belongs to ourself */
-        return &l->dev->eth->mac;
+    n = arp_dst_get(f);
+    if (!n) {
+        l = pico_ipv4_link_get(&hdr->dst);
+        if(l) {
+            /* address belongs to ourself */
+            *local = &l->dev->eth->mac;
+            return NULL;
+        }
+
+        n = arp_dst_resolve(f);
+        if (!n)
+            return NULL;
     }
 
-    gateway = pico_ipv4_route_get_gateway(&hdr->dst);
-    /* check if dst is local (gateway = 0), or if to use gateway */
-    if (gateway.addr != 0)
-        where = &gateway;
-    else
-        where = &hdr->dst;
+    return pico_neighbor_use(n);
+}
 
-    a4 = pico_arp_lookup(where);      /* check if dst ip mac in cache */
+struct pico_eth *pico_arp_get(struct pico_frame *f)
+{
+    struct pico_eth *local;
+    struct pico_neighbor *n = pico_arp_resolve(f, &local);
 
-    if (!a4)
-        pico_arp_retry(f, where);
+    if (n)
+        return &n->hwaddr.mac;
 
-    return a4;
+    return local;
 }
 
 
+/* Park the frame on its unresolved neighbour. The frame is always consumed. */
 void pico_arp_postpone(struct pico_frame *f)
 {
-    int i;
-    for (i = 0; i < PICO_ARP_MAX_PENDING; i++)
-    {
-        if (!frames_queued[i]) {
-            if (f->failure_count < 4)
-                frames_queued[i] = f;
+    struct pico_neighbor *n = NULL;
 
-            return;
-        }
+    if (f->net_hdr)
+        n = arp_dst_get(f);
+
+    if (!n) {
+        pico_frame_discard(f);
+        return;
     }
-    /* Not possible to enqueue: caller will discard packet */
+
+    pico_neighbor_postpone(n, f);
 }
 
 
 #ifdef DEBUG_ARP
 static void dbg_arp(void)
 {
-    struct pico_arp *a;
-    struct pico_tree_node *index;
+    struct pico_neighbor *a = NULL;
 
-    pico_tree_foreach(index, &arp_tree) {
-        a = index->keyValue;
-        arp_dbg("ARP to  %08x, mac: %02x:%02x:%02x:%02x:%02x:%02x\n", a->ipv4.addr, a->eth.addr[0], a->eth.addr[1], a->eth.addr[2], a->eth.addr[3], a->eth.addr[4], a->eth.addr[5] );
-    }
+    while ((a = pico_neighbor_next(&arp_proto, a)) != NULL)
+        arp_dbg("ARP to  %08x, mac: %02x:%02x:%02x:%02x:%02x:%02x, status %d\n", a->addr.ip4.addr, a->hwaddr.mac.addr[0], a->hwaddr.mac.addr[1], a->hwaddr.mac.addr[2], a->hwaddr.mac.addr[3], a->hwaddr.mac.addr[4], a->hwaddr.mac.addr[5], a->state);
 }
 #endif
 
-static void arp_expire(pico_time now, void *_stale)
-{
-    struct pico_arp *stale = (struct pico_arp *) _stale;
-    if (now >= (stale->timestamp + PICO_ARP_TIMEOUT)) {
-        stale->arp_status = PICO_ARP_STATUS_STALE;
-        arp_dbg("ARP: Setting arp_status to STALE\n");
-        pico_arp_request(stale->dev, &stale->ipv4, PICO_ARP_QUERY);
-    } else {
-        /* Timer must be rescheduled, ARP entry has been renewed lately.
-         * No action required to refresh the entry, will check on the next timeout */
-        if (!pico_timer_add(PICO_ARP_TIMEOUT + stale->timestamp - now, arp_expire, stale)) {
-            arp_dbg("ARP: Failed to start expiration timer, destroying arp entry\n");
-            pico_tree_delete(&arp_tree, stale);
-            PICO_FREE(stale);
-        }
-    }
-}
-
-static int pico_arp_add_entry(struct pico_arp *entry)
+int pico_arp_create_entry(uint8_t *hwaddr, struct pico_ip4 ipv4, struct pico_device *dev)
 {
-    entry->arp_status = PICO_ARP_STATUS_REACHABLE;
-    entry->timestamp  = PICO_TIME();
+    struct pico_neighbor *arp = arp_find(dev, ipv4.addr);
 
-    if (pico_tree_insert(&arp_tree, entry)) {
-        arp_dbg("ARP: Failed to insert new entry in tree\n");
-        return -1;
+    if (!arp) {
+        arp = pico_neighbor_add(&arp_proto, dev, &ipv4);
+        if (!arp)
+            return -1;
     }
 
     arp_dbg("ARP ## reachable.\n");
-    pico_arp_queued_trigger();
-    if (!pico_timer_add(PICO_ARP_TIMEOUT, arp_expire, entry)) {
-        arp_dbg("ARP: Failed to start expiration timer\n");
-        pico_tree_delete(&arp_tree, entry);
-        return -1;
-    }
-
-    return 0;
-}
-
-int pico_arp_create_entry(uint8_t *hwaddr, struct pico_ip4 ipv4, struct pico_device *dev)
-{
-    struct pico_arp*arp = PICO_ZALLOC(sizeof(struct pico_arp));
-    if(!arp) {
-        pico_err = PICO_ERR_ENOMEM;
-        return -1;
-    }
-
-    memcpy(arp->eth.addr, hwaddr, 6);
-    arp->ipv4.addr = ipv4.addr;
-    arp->dev = dev;
-
-    if (pico_arp_add_entry(arp) < 0) {
-        PICO_FREE(arp);
+    if (pico_neighbor_update(arp, hwaddr, PICO_SIZE_ETH, PICO_ARP_STATUS_REACHABLE) < 0) {
+        pico_neighbor_del(arp);
         return -1;
     }
 
@@ -323,33 +333,24 @@ static void pico_arp_check_conflict(struct pico_arp_hdr *hdr)
     }
 }
 
-static struct pico_arp *pico_arp_lookup_entry(struct pico_frame *f)
+/* Any request, reply or gratuitous announcement refreshes the sender's
+ * entry if it is already known (RFC 826 merge). Probes carry no sender. */
+static struct pico_neighbor *pico_arp_lookup_entry(struct pico_frame *f)
 {
-    struct pico_arp search;
-    struct pico_arp *found = NULL;
+    struct pico_neighbor *found;
     struct pico_arp_hdr *hdr = (struct pico_arp_hdr *) f->net_hdr;
-    /* Populate a new arp entry */
-    search.ipv4.addr = hdr->src.addr;
 
-    /* Search for already existing entry */
-    found = pico_tree_findKey(&arp_tree, &search);
+    if (!hdr->src.addr)
+        return NULL;
+
+    found = arp_find(f->dev, hdr->src.addr);
     if (found) {
-        if (found->arp_status == PICO_ARP_STATUS_STALE) {
-            /* Replace if stale */
-            pico_tree_delete(&arp_tree, found);
-            if (pico_arp_add_entry(found) < 0) {
-                arp_dbg("ARP: Failed to re-instert stale arp entry\n");
-                PICO_FREE(found);
-                found = NULL;
-            }
-        } else {
-            /* Update mac address */
-            memcpy(found->eth.addr, hdr->s_mac, PICO_SIZE_ETH);
-            arp_dbg("ARP entry updated!\n");
-
-            /* Refresh timestamp, this will force a reschedule on the next timeout*/
-            found->timestamp = PICO_TIME();
+        if (pico_neighbor_update(found, hdr->s_mac, PICO_SIZE_ETH, PICO_ARP_STATUS_REACHABLE) < 0) {
+            pico_neighbor_del(found);
+            return NULL;
         }
+
+        arp_dbg("ARP entry updated!\n");
     }
 
     return found;
@@ -428,14 +429,17 @@ static int pico_arp_check_flooding(struct pico_frame *f, struct pico_ip4 me)
     return 0;
 }
 
-static int pico_arp_process_in(struct pico_frame *f, struct pico_arp_hdr *hdr, struct pico_arp *found)
+static int pico_arp_process_in(struct pico_frame *f, struct pico_arp_hdr *hdr)
 {
     struct pico_ip4 me;
+    struct pico_neighbor *found;
     if (pico_arp_check_incoming_hdr(f, &me) < 0) {
         pico_frame_discard(f);
         return -1;
     }
 
+    found = pico_arp_lookup_entry(f);
+
     if (pico_arp_check_flooding(f, me) < 0) {
         pico_frame_discard(f);
         return -1;
@@ -460,7 +464,6 @@ static int pico_arp_process_in(struct pico_frame *f, struct pico_arp_hdr *hdr, s
 int pico_arp_receive(struct pico_frame *f)
 {
     struct pico_arp_hdr *hdr;
-    struct pico_arp *found = NULL;
 
     hdr = (struct pico_arp_hdr *) f->net_hdr;
     if (!hdr) {
@@ -469,8 +472,7 @@ int pico_arp_receive(struct pico_frame *f)
     }
 
     pico_arp_check_conflict(hdr);
-    found = pico_arp_lookup_entry(f);
-    return pico_arp_process_in(f, hdr, found);
+    return pico_arp_process_in(f, hdr);
 
 }
 
@@ -510,7 +512,7 @@ static int32_t pico_arp_request_xmit(struct pico_device *dev, struct pico_frame
     return ret;
 }
 
-int32_t pico_arp_request(struct pico_device *dev, struct pico_ip4 *dst, uint8_t type)
+static int32_t arp_request_to(struct pico_device *dev, struct pico_ip4 *dst, uint8_t type, const uint8_t *hwdst)
 {
     struct pico_frame *q = pico_frame_alloc(PICO_SIZE_ETHHDR + PICO_SIZE_ARPHDR);
     struct pico_eth_hdr *eh;
@@ -534,21 +536,25 @@ int32_t pico_arp_request(struct pico_device *dev, struct pico_ip4 *dst, uint8_t
 
     /* Fill eth header */
     memcpy(eh->saddr, dev->eth->mac.addr, PICO_SIZE_ETH);
-    memcpy(eh->daddr, PICO_ETHADDR_ALL, PICO_SIZE_ETH);
+    memcpy(eh->daddr, hwdst, PICO_SIZE_ETH);
     eh->proto = PICO_IDETH_ARP;
 
     return pico_arp_request_xmit(dev, q, src, dst, type);
 }
 
+int32_t pico_arp_request(struct pico_device *dev, struct pico_ip4 *dst, uint8_t type)
+{
+    return arp_request_to(dev, dst, type, PICO_ETHADDR_ALL);
+}
+
 int pico_arp_get_neighbors(struct pico_device *dev, struct pico_ip4 *neighbors, int maxlen)
 {
-    struct pico_arp*search;
-    struct pico_tree_node *index;
+    struct pico_neighbor *search = NULL;
     int i = 0;
-    pico_tree_foreach(index, &arp_tree){
-        search = index->keyValue;
-        if (search->dev == dev) {
-            neighbors[i++].addr = search->ipv4.addr;
+
+    while ((search = pico_neighbor_next(&arp_proto, search)) != NULL) {
+        if ((search->dev == dev) && (search->state != PICO_ARP_STATUS_INCOMPLETE)) {
+            neighbors[i++].addr = search->addr.ip4.addr;
             if (i >= maxlen)
                 return i;
         }
@@ -7,16 +7,22 @@
 #define INCLUDE_PICO_ARP
 #include "pico_eth.h"
 #include "pico_device.h"
+#include "pico_neighbor.h"
 
 int pico_arp_receive(struct pico_frame *);
 
 
 struct pico_eth *pico_arp_get(struct pico_frame *f);
+/* Next hop of an outgoing frame: the neighbour entry, or NULL with *local set
+ * for one of our own addresses, or NULL while resolving (see pico_arp_postpone) */
+struct pico_neighbor *pico_arp_resolve(struct pico_frame *f, struct pico_eth **local);
 int32_t pico_arp_request(struct pico_device *dev, struct pico_ip4 *dst, uint8_t type);
 
-#define PICO_ARP_STATUS_REACHABLE 0x00
-#define PICO_ARP_STATUS_PERMANENT 0x01
-#define PICO_ARP_STATUS_STALE     0x02
+#define PICO_ARP_STATUS_REACHABLE  PICO_NEIGH_REACHABLE
+#define PICO_ARP_STATUS_PERMANENT  PICO_NEIGH_PERMANENT
+#define PICO_ARP_STATUS_STALE      PICO_NEIGH_STALE
+#define PICO_ARP_STATUS_INCOMPLETE PICO_NEIGH_INCOMPLETE
+#define PICO_ARP_STATUS_PROBE      PICO_NEIGH_PROBE
 
 #define PICO_ARP_QUERY    0x00
 #define PICO_ARP_PROBE    0x01
@@ -0,0 +1,352 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   Packet capture into a pcapng ring.
+ *********************************************************************/
+
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_device.h"
+#include "pico_6lowpan.h"
+#include "pico_capture.h"
+
+#ifdef PICO_SUPPORT_CAPTURE
+
+#ifdef DEBUG_CAPTURE
+    #define capture_dbg dbg
+#else
+    #define capture_dbg(...) do {} while(0)
+#endif
+
+#define PCAPNG_SHB                  (0x0A0D0D0Au)
+#define PCAPNG_IDB                  (0x00000001u)
+#define PCAPNG_EPB                  (0x00000006u)
+#define PCAPNG_BOM                  (0x1A2B3C4Du)
+#define PCAPNG_OPT_END              (0)
+#define PCAPNG_OPT_IF_NAME          (2)
+#define PCAPNG_OPT_IF_TSRESOL       (9)
+#define PCAPNG_OPT_EPB_FLAGS        (2)
+
+#define LINKTYPE_ETHERNET           (1)
+#define LINKTYPE_RAW                (101)
+#define LINKTYPE_IPV6               (229)
+#define LINKTYPE_IEEE802_15_4_NOFCS (230)
+
+#define CAPTURE_EPB_OVERHEAD        (44u)
+#define CAPTURE_PAD4(x)             (((x) + 3u) & ~3u)
+
+struct capture_if {
+    uint32_t dev_hash;
+    uint16_t linktype;
+};
+
+struct pico_capture_ring *pico_capture_active = NULL;
+static struct pico_capture_filter capture_filter;
+static struct capture_if capture_ifs[PICO_CAPTURE_INTERFACES];
+static uint32_t capture_n_ifs;
+
+static uint32_t capture_put32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return 4;
+}
+
+static uint32_t capture_put16(uint8_t *p, uint16_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return 2;
+}
+
+static uint32_t capture_get32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t capture_shb(uint8_t *p)
+{
+    uint32_t n = 0;
+
+    n += capture_put32(p + n, PCAPNG_SHB);
+    n += capture_put32(p + n, 28);
+    n += capture_put32(p + n, PCAPNG_BOM);
+    n += capture_put16(p + n, 1);
+    n += capture_put16(p + n, 0);
+    n += capture_put32(p + n, 0xFFFFFFFFu);    /* section length unknown */
+    n += capture_put32(p + n, 0xFFFFFFFFu);
+    n += capture_put32(p + n, 28);
+    return n;
+}
+
+static uint32_t capture_idb(uint8_t *p, uint16_t linktype, const char *name)
+{
+    uint32_t name_len = (uint32_t)strlen(name);
+    uint32_t n = 8;
+
+    n += capture_put16(p + n, linktype);
+    n += capture_put16(p + n, 0);
+    n += capture_put32(p + n, 0);               /* no snaplen */
+    n += capture_put16(p + n, PCAPNG_OPT_IF_NAME);
+    n += capture_put16(p + n, (uint16_t)name_len);
+    memset(p + n, 0, CAPTURE_PAD4(name_len));
+    memcpy(p + n, name, name_len);
+    n += CAPTURE_PAD4(name_len);
+    n += capture_put16(p + n, PCAPNG_OPT_IF_TSRESOL);
+    n += capture_put16(p + n, 1);
+    n += capture_put32(p + n, 3);               /* ms, the rest is padding */
+    n += capture_put32(p + n, PCAPNG_OPT_END);
+    capture_put32(p, PCAPNG_IDB);
+    capture_put32(p + 4, n + 4);
+    n += capture_put32(p + n, n + 4);
+    return n;
+}
+
+static uint16_t capture_linktype(struct pico_device *dev, uint8_t dir)
+{
+    if (PICO_DEV_IS_6LOWPAN(dev))
+        return (dir == PICO_CAPTURE_IN) ? LINKTYPE_IEEE802_15_4_NOFCS : LINKTYPE_IPV6;
+
+    if (dev->eth)
+        return LINKTYPE_ETHERNET;
+
+    return LINKTYPE_RAW;
+}
+
+/* Interface id of the device, appended to the preamble the first time.
+ * Readers see it there before any block that uses it. */
+static int capture_if_id(struct pico_capture_ring *ring, struct pico_device *dev, uint8_t dir)
+{
+    uint16_t linktype = capture_linktype(dev, dir);
+    uint32_t i, len;
+
+    for (i = 0; i < capture_n_ifs; i++) {
+        if ((capture_ifs[i].dev_hash == dev->hash) && (capture_ifs[i].linktype == linktype))
+            return (int)i;
+    }
+
+    if (capture_n_ifs >= PICO_CAPTURE_INTERFACES)
+        return -1;
+
+    capture_ifs[i].dev_hash = dev->hash;
+    capture_ifs[i].linktype = linktype;
+    capture_n_ifs++;
+    len = capture_idb(ring->preamble + ring->preamble_len, linktype, dev->name);
+    PICO_CAPTURE_BARRIER();
+    ring->preamble_len += len;
+    capture_dbg("CAPTURE: interface %u is %s, link type %u\n", i, dev->name, linktype);
+    return (int)i;
+}
+
+static int capture_match(const struct pico_capture_match *m, const uint8_t *buf, uint32_t len)
+{
+    uint32_t v = 0;
+    uint32_t i;
+
+    if (((uint32_t)m->offset + m->size) > len)
+        return 0;
+
+    for (i = 0; i < m->size; i++)
+        v = (v << 8) | buf[m->offset + i];
+
+    return (v & m->mask) == m->value;
+}
+
+static int capture_filter_pass(struct pico_frame *f, uint8_t dir)
+{
+    uint32_t i;
+
+    if (capture_filter.dir && !(capture_filter.dir & dir))
+        return 0;
+
+    if (capture_filter.dev && (capture_filter.dev != f->dev))
+        return 0;
+
+    for (i = 0; i < capture_filter.n_match; i++) {
+        if (!capture_match(&capture_filter.match[i], f->start, f->len))
+            return 0;
+    }
+    return 1;
+}
+
+void pico_capture_frame(struct pico_frame *f, uint8_t dir)
+{
+    struct pico_capture_ring *ring = pico_capture_active;
+    uint8_t *data, *p;
+    uint32_t caplen, block, skip, pos;
+    pico_time now = PICO_TIME_MS();
+    int id;
+
+    if (!ring || !f || !f->dev || !capture_filter_pass(f, dir))
+        return;
+
+    caplen = f->len;
+    if (capture_filter.snaplen && (caplen > capture_filter.snaplen))
+        caplen = capture_filter.snaplen;
+
+    block = CAPTURE_EPB_OVERHEAD + CAPTURE_PAD4(caplen);
+    id = capture_if_id(ring, f->dev, dir);
+    if ((id < 0) || (block > ring->size)) {
+        ring->dropped++;
+        return;
+    }
+
+    /* A block never wraps: a zero word sends readers back to the start */
+    data = (uint8_t *)(ring + 1);
+    pos = ring->head & (ring->size - 1);
+    skip = ((ring->size - pos) < block) ? (ring->size - pos) : 0;
+    ring->reserve = ring->head + skip + block;
+    PICO_CAPTURE_BARRIER();
+    if (skip) {
+        capture_put32(data + pos, 0);
+        pos = 0;
+    }
+
+    p = data + pos;
+    p += capture_put32(p, PCAPNG_EPB);
+    p += capture_put32(p, block);
+    p += capture_put32(p, (uint32_t)id);
+    p += capture_put32(p, (uint32_t)(now >> 32));
+    p += capture_put32(p, (uint32_t)now);
+    p += capture_put32(p, caplen);
+    p += capture_put32(p, f->len);
+    memcpy(p, f->start, caplen);
+    memset(p + caplen, 0, CAPTURE_PAD4(caplen) - caplen);
+    p += CAPTURE_PAD4(caplen);
+    p += capture_put16(p, PCAPNG_OPT_EPB_FLAGS);
+    p += capture_put16(p, 4);
+    p += capture_put32(p, (dir == PICO_CAPTURE_IN) ? 1u : 2u);
+    p += capture_put32(p, PCAPNG_OPT_END);
+    capture_put32(p, block);
+
+    PICO_CAPTURE_BARRIER();
+    ring->head = ring->reserve;
+    ring->captured++;
+}
+
+int pico_capture_start(void *mem, uint32_t size, const struct pico_capture_filter *filter)
+{
+    struct pico_capture_ring *ring = (struct pico_capture_ring *)mem;
+    uint32_t room;
+
+    if (!mem || (size < sizeof(struct pico_capture_ring) + CAPTURE_EPB_OVERHEAD) ||
+        (filter && (filter->n_match > PICO_CAPTURE_MATCH_MAX))) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    room = size - (uint32_t)sizeof(struct pico_capture_ring);
+    while (room & (room - 1))
+        room &= room - 1;
+
+    pico_capture_active = NULL;
+    memset(ring, 0, sizeof(*ring));
+    ring->size = room;
+    ring->preamble_len = capture_shb(ring->preamble);
+    memset(&capture_filter, 0, sizeof(capture_filter));
+    if (filter)
+        capture_filter = *filter;
+
+    capture_n_ifs = 0;
+    PICO_CAPTURE_BARRIER();
+    ring->magic = PICO_CAPTURE_MAGIC;
+    pico_capture_active = ring;
+    return 0;
+}
+
+void pico_capture_stop(void)
+{
+    pico_capture_active = NULL;
+}
+
+int pico_capture_cursor_init(const struct pico_capture_ring *ring, struct pico_capture_cursor *c)
+{
+    if (!ring || !c || (ring->magic != PICO_CAPTURE_MAGIC)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    c->pos = ring->head;
+    c->preamble = 0;
+    c->lost = 0;
+    return 0;
+}
+
+int pico_capture_read(const struct pico_capture_ring *ring, struct pico_capture_cursor *c, uint8_t *buf, uint32_t len)
+{
+    const uint8_t *data;
+    uint32_t head, preamble, copied = 0;
+    uint32_t pos, block;
+
+    if (!ring || !c || !buf || (ring->magic != PICO_CAPTURE_MAGIC)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    /* Interfaces are in the preamble before the blocks that use them */
+    head = ring->head;
+    PICO_CAPTURE_BARRIER();
+    preamble = ring->preamble_len;
+    if (c->preamble < preamble) {
+        if ((preamble - c->preamble) > len) {
+            pico_err = PICO_ERR_EINVAL;
+            return -1;
+        }
+
+        memcpy(buf, ring->preamble + c->preamble, preamble - c->preamble);
+        copied = preamble - c->preamble;
+        c->preamble = preamble;
+    }
+
+    if ((head - c->pos) > ring->size) {
+        c->lost += head - c->pos;
+        c->pos = head;
+    }
+
+    data = (const uint8_t *)(ring + 1);
+    while ((int32_t)(head - c->pos) > 0) {
+        pos = c->pos & (ring->size - 1);
+        block = capture_get32(data + pos);
+        if (block == 0) {
+            c->pos += ring->size - pos;
+            continue;
+        }
+
+        block = capture_get32(data + pos + 4);
+        if ((block < CAPTURE_EPB_OVERHEAD) || (block > (ring->size - pos))) {
+            /* Overwritten under us */
+            c->lost += head - c->pos;
+            c->pos = head;
+            break;
+        }
+
+        if (block > (len - copied)) {
+            if (copied == 0) {
+                pico_err = PICO_ERR_EINVAL;
+                return -1;
+            }
+
+            break;
+        }
+
+        memcpy(buf + copied, data + pos, block);
+        PICO_CAPTURE_BARRIER();
+        if ((ring->reserve - c->pos) > ring->size) {
+            /* The writer got here while we were copying */
+            c->lost += ring->head - c->pos;
+            c->pos = ring->head;
+            break;
+        }
+
+        copied += block;
+        c->pos += block;
+    }
+
+    if ((int32_t)(head - c->pos) < 0)
+        c->pos = head;
+
+    return (int)copied;
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+ *********************************************************************/
+#ifndef INCLUDE_PICO_CAPTURE
+#define INCLUDE_PICO_CAPTURE
+#include "pico_config.h"
+#include "pico_frame.h"
+
+/* Packet capture into a pcapng ring. Frames are copied as the devices see
+ * them, on their way in (dequeued from q_in) and out (handed to q_out), when
+ * they pass the filter. The ring is memory supplied by the caller, e.g. a
+ * shared mapping: a reader, in this process or another one, tails it with
+ * pico_capture_read() and gets a pcapng stream back.
+ *
+ * There is one writer, the stack, and it never waits for readers. A reader
+ * that falls a whole ring behind loses what was overwritten and carries on
+ * from the newest block. */
+
+/* Interfaces (device and link type) in one capture */
+#ifndef PICO_CAPTURE_INTERFACES
+#define PICO_CAPTURE_INTERFACES     (8)
+#endif
+
+#ifndef PICO_CAPTURE_MATCH_MAX
+#define PICO_CAPTURE_MATCH_MAX      (4)
+#endif
+
+#ifndef PICO_CAPTURE_BARRIER
+#ifdef __GNUC__
+#define PICO_CAPTURE_BARRIER()      __sync_synchronize()
+#else
+#define PICO_CAPTURE_BARRIER()      do {} while(0)
+#endif
+#endif
+
+#define PICO_CAPTURE_MAGIC          (0x70636170u)
+#define PICO_CAPTURE_IN             (0x01)
+#define PICO_CAPTURE_OUT            (0x02)
+
+/* SHB followed by one IDB per interface seen so far */
+#define PICO_CAPTURE_PREAMBLE       (28 + (PICO_CAPTURE_INTERFACES * 56))
+
+/* Holds if (frame[offset..offset + size - 1] & mask) == value, the bytes
+ * read in network order. offset counts from the link layer header. */
+struct pico_capture_match {
+    uint16_t offset;
+    uint8_t size;               /* 1, 2 or 4 */
+    uint32_t mask;
+    uint32_t value;
+};
+
+struct pico_capture_filter {
+    struct pico_device *dev;    /* NULL for every device */
+    uint8_t dir;                /* PICO_CAPTURE_IN and/or PICO_CAPTURE_OUT, 0 for both */
+    uint32_t snaplen;           /* 0 for whole frames */
+    uint8_t n_match;            /* all of them must hold */
+    struct pico_capture_match match[PICO_CAPTURE_MATCH_MAX];
+};
+
+/* Start of the memory given to pico_capture_start(), blocks follow it */
+struct pico_capture_ring {
+    uint32_t magic;
+    uint32_t size;                      /* bytes for blocks, a power of two */
+    volatile uint32_t head;             /* bytes published, wraps around */
+    volatile uint32_t reserve;          /* bytes published or being written */
+    volatile uint32_t preamble_len;
+    volatile uint32_t captured;
+    volatile uint32_t dropped;          /* too big for the ring, or no interface left */
+    uint32_t pad;
+    uint8_t preamble[PICO_CAPTURE_PREAMBLE];
+};
+
+struct pico_capture_cursor {
+    uint32_t pos;
+    uint32_t preamble;          /* preamble bytes returned */
+    uint32_t lost;              /* bytes overwritten before they were read */
+};
+
+/* mem is laid out as a struct pico_capture_ring followed by the blocks,
+ * whose room is rounded down to a power of two. filter may be NULL. */
+int pico_capture_start(void *mem, uint32_t size, const struct pico_capture_filter *filter);
+void pico_capture_stop(void);
+
+/* Reader side, touches the ring only. Start from the newest block. */
+int pico_capture_cursor_init(const struct pico_capture_ring *ring, struct pico_capture_cursor *c);
+/* Copies pcapng into buf: the section header and interfaces not returned
+ * yet, then whole blocks while they fit. Returns the bytes copied, 0 if
+ * there is nothing new, -1 if buf can't hold the next block. */
+int pico_capture_read(const struct pico_capture_ring *ring, struct pico_capture_cursor *c, uint8_t *buf, uint32_t len);
+
+/* Called by the stack */
+extern struct pico_capture_ring *pico_capture_active;
+void pico_capture_frame(struct pico_frame *f, uint8_t dir);
+
+#endif
@@ -0,0 +1,242 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   Point to point links with bandwidth and delay.
+ *********************************************************************/
+
+#include "pico_device.h"
+#include "pico_dev_pipe.h"
+#include "pico_stack.h"
+
+#ifdef DEBUG_PIPE
+    #define pipe_dbg dbg
+#else
+    #define pipe_dbg(...) do {} while(0)
+#endif
+
+/* Frame on the wire, data follows */
+struct pipe_frame {
+    struct pipe_frame *next;
+    pico_time due;
+    uint32_t len;
+};
+
+struct pico_device_pipe {
+    struct pico_device dev;
+    struct pico_device_pipe *peer;      /* receives what this end sends, NULL once gone */
+    struct pico_device_pipe *next;      /* every pipe, for pico_pipe_next() */
+    struct pico_pipe_link link;
+    uint64_t wire_free;                 /* us, the wire is busy until then */
+    struct pipe_frame *head, *tail;     /* on their way to peer */
+    struct pico_pipe_stats stats;
+    uint32_t rand;
+};
+
+static struct pico_device_pipe *pipe_list = NULL;
+
+static void pipe_flush(struct pico_device_pipe *p)
+{
+    struct pipe_frame *pf;
+
+    while (p->head) {
+        pf = p->head;
+        p->head = pf->next;
+        PICO_FREE(pf);
+    }
+    p->tail = NULL;
+}
+
+/* xorshift32, so loss doesn't depend on pico_rand() or the platform */
+static uint32_t pipe_rand(struct pico_device_pipe *p)
+{
+    uint32_t x = p->rand;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    p->rand = x;
+    return x;
+}
+
+static int pipe_send(struct pico_device *dev, void *buf, int len)
+{
+    struct pico_device_pipe *p = (struct pico_device_pipe *)dev;
+    uint64_t now = (uint64_t)PICO_TIME_MS() * 1000u;
+    uint64_t wire = 0;
+    struct pipe_frame *pf;
+
+    if (!p->peer) {
+        p->stats.dropped++;
+        return len;
+    }
+
+    if (p->wire_free < now)
+        p->wire_free = now;
+
+    /* Bottleneck queue: bytes still waiting for the wire */
+    if (p->link.bandwidth && p->link.queue &&
+        ((((p->wire_free - now) * p->link.bandwidth) / 8000000u) + (uint32_t)len > p->link.queue)) {
+        pipe_dbg("PIPE: %s drops %d bytes\n", dev->name, len);
+        p->stats.dropped++;
+        return len;
+    }
+
+    if (p->link.bandwidth)
+        wire = (((uint64_t)len * 8000000u) + p->link.bandwidth - 1) / p->link.bandwidth;
+
+    /* Lost frames still take their time on the wire */
+    if (p->link.loss && ((pipe_rand(p) % 1000000u) < p->link.loss)) {
+        p->wire_free += wire;
+        p->stats.lost++;
+        return len;
+    }
+
+    pf = PICO_ZALLOC(sizeof(struct pipe_frame) + (uint32_t)len);
+    if (!pf)
+        return 0;
+
+    memcpy(pf + 1, buf, (size_t)len);
+    pf->len = (uint32_t)len;
+    p->wire_free += wire;
+
+    pf->due = (p->wire_free + ((uint64_t)p->link.delay * 1000u) + 999u) / 1000u;
+    if (p->tail)
+        p->tail->next = pf;
+    else
+        p->head = pf;
+
+    p->tail = pf;
+    p->stats.sent++;
+    return len;
+}
+
+static int pipe_poll(struct pico_device *dev, int loop_score)
+{
+    struct pico_device_pipe *p = (struct pico_device_pipe *)dev;
+    struct pico_device_pipe *from = p->peer;
+    pico_time now = PICO_TIME_MS();
+    struct pipe_frame *pf;
+
+    if (!from)
+        return loop_score;
+
+    while ((loop_score > 0) && from->head && (from->head->due <= now)) {
+        pf = from->head;
+        from->head = pf->next;
+        if (!from->head)
+            from->tail = NULL;
+
+        if (pico_stack_recv(dev, (uint8_t *)(pf + 1), pf->len) > 0)
+            from->stats.delivered++;
+        else
+            from->stats.dropped++;
+
+        PICO_FREE(pf);
+        loop_score--;
+    }
+    return loop_score;
+}
+
+static void pipe_destroy(struct pico_device *dev)
+{
+    struct pico_device_pipe *p = (struct pico_device_pipe *)dev;
+    struct pico_device_pipe **pp = &pipe_list;
+
+    while (*pp && (*pp != p))
+        pp = &(*pp)->next;
+    if (*pp)
+        *pp = p->next;
+
+    pipe_flush(p);
+    if (p->peer && (p->peer != p)) {
+        pipe_flush(p->peer);
+        p->peer->peer = NULL;
+    }
+}
+
+static struct pico_device_pipe *pipe_create(const char *name, const struct pico_pipe_link *link, uint32_t seed)
+{
+    struct pico_device_pipe *p = PICO_ZALLOC(sizeof(struct pico_device_pipe));
+
+    if (!p) {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    if (0 != pico_device_init((struct pico_device *)p, name, NULL)) {
+        dbg("Pipe init failed.\n");
+        pico_device_destroy((struct pico_device *)p);
+        return NULL;
+    }
+
+    if (link)
+        p->link = *link;
+
+    p->rand = seed ? seed : 1u;
+
+    p->dev.send = pipe_send;
+    p->dev.poll = pipe_poll;
+    p->dev.destroy = pipe_destroy;
+    p->dev.hairpin = 1;
+    p->next = pipe_list;
+    pipe_list = p;
+    dbg("Device %s created.\n", p->dev.name);
+    return p;
+}
+
+struct pico_device *pico_pipe_create(const char *name, const char *peer_name,
+                                     const struct pico_pipe_link *link, struct pico_device **peer)
+{
+    struct pico_device_pipe *a, *b;
+
+    if (!name || (peer_name && !peer)) {
+        pico_err = PICO_ERR_EINVAL;
+        return NULL;
+    }
+
+    a = pipe_create(name, link, link ? link->seed : 0);
+    if (!a)
+        return NULL;
+
+    if (!peer_name) {
+        a->peer = a;
+        return (struct pico_device *)a;
+    }
+
+    b = pipe_create(peer_name, link, link ? ~link->seed : 0);
+    if (!b) {
+        pico_device_destroy((struct pico_device *)a);
+        return NULL;
+    }
+
+    a->peer = b;
+    b->peer = a;
+    *peer = (struct pico_device *)b;
+    return (struct pico_device *)a;
+}
+
+int pico_pipe_stats(struct pico_device *dev, struct pico_pipe_stats *stats)
+{
+    if (!dev || !stats || (dev->destroy != pipe_destroy)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    *stats = ((struct pico_device_pipe *)dev)->stats;
+    return 0;
+}
+
+int pico_pipe_next(pico_time *due)
+{
+    struct pico_device_pipe *p;
+    int found = -1;
+
+    for (p = pipe_list; p; p = p->next) {
+        if (p->head && ((found < 0) || (p->head->due < *due))) {
+            *due = p->head->due;
+            found = 0;
+        }
+    }
+    return found;
+}
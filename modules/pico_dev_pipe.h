@@ -0,0 +1,52 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+ *********************************************************************/
+#ifndef INCLUDE_PICO_PIPE
+#define INCLUDE_PICO_PIPE
+#include "pico_config.h"
+#include "pico_device.h"
+
+/* Point to point link between two devices of this stack, or from one device
+ * back to itself, with a bandwidth, a one way delay and a bottleneck queue.
+ * Frames are serialized one after the other at the link rate, then arrive
+ * at the other end delay ms later, unless the loss setting takes them.
+ * Frames that would wait for the wire longer than the queue allows are
+ * dropped. The link follows PICO_TIME_MS(),
+ * so under pico_simtime it runs on simulated time.
+ *
+ * Both ends belong to this stack, so IPv4 sends frames for local addresses
+ * out through a pipe instead of looping them back. Give the ends addresses
+ * in one subnet and a host route to the other end through each:
+ *   pico_ipv4_link_add(a, 10.0.0.1, 255.255.255.0)
+ *   pico_ipv4_link_add(b, 10.0.0.2, 255.255.255.0)
+ *   pico_ipv4_route_add(10.0.0.2, 255.255.255.255, 0, 1, link of a)
+ *   pico_ipv4_route_add(10.0.0.1, 255.255.255.255, 0, 1, link of b) */
+
+struct pico_pipe_link {
+    uint32_t bandwidth;         /* bits per second, 0 for no limit */
+    uint32_t delay;             /* one way, ms */
+    uint32_t queue;             /* bytes waiting for the wire, 0 for no limit */
+    uint32_t loss;              /* frames lost on the wire, per million */
+    uint32_t seed;              /* of the loss pattern, runs with the same seed lose the same frames */
+};
+
+struct pico_pipe_stats {
+    uint32_t sent;
+    uint32_t delivered;
+    uint32_t dropped;           /* by the queue, or with no peer to take them */
+    uint32_t lost;              /* on the wire, by the loss setting */
+};
+
+/* Creates name and, unless peer_name is NULL, its peer, returned in *peer.
+ * Without a peer the device receives what it sends, like the loop device.
+ * link may be NULL for no limits. Both ends use the same link. */
+struct pico_device *pico_pipe_create(const char *name, const char *peer_name,
+                                     const struct pico_pipe_link *link, struct pico_device **peer);
+int pico_pipe_stats(struct pico_device *dev, struct pico_pipe_stats *stats);
+
+/* Earliest arrival on any pipe, -1 if nothing is on its way */
+int pico_pipe_next(pico_time *due);
+
+#endif
@@ -37,6 +37,7 @@
 #define PPP_HDR_SIZE 3u
 #define PPP_PROTO_SLOT_SIZE 2u
 #define PPP_FCS_SIZE 2u
+#define PPP_FCS_GOOD 0xf0b8u /* FCS residue over a frame and its own FCS */
 #define PPP_PROTO_LCP short_be(0xc021)
 #define PPP_PROTO_IP  short_be(0x0021)
 #define PPP_PROTO_PAP short_be(0xc023)
@@ -74,6 +75,17 @@
 #define PAP_AUTH_NAK 3
 
 
+/* Escaped frames waiting for serial_send. Power of two, holding at least
+ * one fully escaped MTU sized frame. */
+#ifndef PICO_PPP_TX_RING
+#define PICO_PPP_TX_RING (4096)
+#endif
+
+/* Bytes read from serial_recv at once */
+#ifndef PICO_PPP_RX_CHUNK
+#define PICO_PPP_RX_CHUNK (64)
+#endif
+
 #define PICO_PPP_DEFAULT_TIMER (3) /* seconds */
 #define PICO_PPP_DEFAULT_MAX_TERMINATE (2)
 #define PICO_PPP_DEFAULT_MAX_CONFIGURE (10)
@@ -103,7 +115,6 @@ static const unsigned char PPPF_ADDR      = 0xffu;
 static const unsigned char PPPF_CTRL      = 0x03u;
 
 static int ppp_devnum = 0;
-static uint8_t ppp_recv_buf[PPP_MAXPKT];
 
 PACKED_STRUCT_DEF pico_lcp_hdr {
     uint8_t code;
@@ -282,8 +293,28 @@ struct pico_device_ppp {
     uint8_t frame_id;
     uint8_t timer_on;
     uint16_t mru;
+    /* TX ring, flushed to serial_send */
+    uint8_t tx_ring[PICO_PPP_TX_RING];
+    uint32_t tx_head;
+    uint32_t tx_len;
+    uint16_t tx_fcs;
+    /* RX: frames are unescaped straight into the buffer of rx_frame */
+    struct pico_frame *rx_frame;
+    uint8_t rx_chunk[PICO_PPP_RX_CHUNK];
+    uint16_t rx_chunk_pos;
+    uint16_t rx_chunk_len;
+    uint32_t rx_len;
+    uint16_t rx_fcs;
+    uint8_t rx_hdr[4];
+    uint8_t rx_hlen;
+    uint8_t rx_flags;
 };
 
+#define PPP_RX_ESCAPE   0x01u /* last byte was PPPF_CTRL_ESC */
+#define PPP_RX_PAYLOAD  0x02u /* address, control and protocol fields received */
+#define PPP_RX_DISCARD  0x04u /* skip to the next flag */
+#define PPP_RX_S3       0x08u /* modem line: last byte was AT_S3 */
+
 
 /* Unit test interceptor */
 static void (*mock_modem_state)(struct pico_device_ppp *ppp, enum ppp_modem_event event) = NULL;
@@ -302,14 +333,172 @@ static void lcp_optflags_print(struct pico_device_ppp *ppp, uint8_t *opts, uint3
 #define PPP_TIMER_ON_AUTH       0x10u
 #define PPP_TIMER_ON_IPCP       0x20u
 
-/* Escape and send */
+/* CRC16 / FCS Calculation, RFC 1662 table driven */
+static const uint16_t ppp_fcstab[256] = {
+    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+};
+
+static inline uint16_t ppp_fcs_char(uint16_t old_crc, uint8_t data)
+{
+    return (uint16_t)((old_crc >> 8u) ^ ppp_fcstab[(old_crc ^ data) & 0xFFu]);
+}
+
+static uint16_t ppp_fcs_continue(uint16_t fcs, uint8_t *buf, uint32_t len)
+{
+    uint8_t *pos = buf;
+    for (pos = buf; pos < buf + len; pos++)
+    {
+        fcs = ppp_fcs_char(fcs, *pos);
+    }
+    return fcs;
+}
+
+static uint16_t ppp_fcs_finish(uint16_t fcs)
+{
+    return fcs ^ 0xFFFF;
+}
+
+static uint16_t ppp_fcs_start(uint8_t *buf, uint32_t len)
+{
+    uint16_t fcs = 0xFFFF;
+    return ppp_fcs_continue(fcs, buf, len);
+}
+
+/* TX ring. Frames are escaped into the ring in a single pass and flushed
+ * to the serial line; what the line does not take now is sent at the
+ * next poll. */
+#define PPP_TX_MASK (PICO_PPP_TX_RING - 1u)
+#define PPP_NEEDS_ESCAPE(c) ((((c) + 1u) >> 1) == 0x3Fu) /* 0x7d, 0x7e */
+
+static void ppp_tx_flush(struct pico_device_ppp *ppp)
+{
+    uint32_t tail, chunk;
+    int r;
+
+    while (ppp->tx_len) {
+        tail = (ppp->tx_head - ppp->tx_len) & PPP_TX_MASK;
+        chunk = PICO_PPP_TX_RING - tail;
+        if (chunk > ppp->tx_len)
+            chunk = ppp->tx_len;
+
+        r = ppp->serial_send(&ppp->dev, ppp->tx_ring + tail, (int)chunk);
+        if (r <= 0)
+            return;
+
+        if ((uint32_t)r > chunk)
+            r = (int)chunk;
+
+        ppp->tx_len -= (uint32_t)r;
+        if ((uint32_t)r < chunk)
+            return;
+    }
+    /* keep frames contiguous while the line keeps up */
+    ppp->tx_head = 0;
+}
+
+static inline void ppp_tx_byte(struct pico_device_ppp *ppp, uint8_t c)
+{
+    ppp->tx_ring[ppp->tx_head & PPP_TX_MASK] = c;
+    ppp->tx_head = (ppp->tx_head + 1u) & PPP_TX_MASK;
+    ppp->tx_len++;
+}
+
+static inline void ppp_tx_escaped(struct pico_device_ppp *ppp, uint8_t c)
+{
+    if (PPP_NEEDS_ESCAPE(c)) {
+        ppp_tx_byte(ppp, PPPF_CTRL_ESC);
+        c ^= 0x20;
+    }
+
+    ppp_tx_byte(ppp, c);
+}
+
+/* Makes room for a frame of len unescaped bytes, flags included */
+static int ppp_tx_reserve(struct pico_device_ppp *ppp, uint32_t len)
+{
+    uint32_t need = len << 1;
+
+    if (need > PICO_PPP_TX_RING)
+        return -1;
+
+    if (PICO_PPP_TX_RING - ppp->tx_len < need)
+        ppp_tx_flush(ppp);
+
+    if (PICO_PPP_TX_RING - ppp->tx_len < need)
+        return -1;
+
+    return 0;
+}
+
+/* Starts a frame whose content, FCS excluded, is len bytes */
+static int ppp_tx_begin(struct pico_device_ppp *ppp, uint32_t len)
+{
+    if (ppp_tx_reserve(ppp, len + PPP_FCS_SIZE + 2u) < 0)
+        return -1;
+
+    ppp_tx_byte(ppp, PPPF_FLAG_SEQ);
+    ppp->tx_fcs = 0xFFFF;
+    return 0;
+}
+
+static void ppp_tx_put(struct pico_device_ppp *ppp, const uint8_t *buf, uint32_t len)
+{
+    uint16_t fcs = ppp->tx_fcs;
+    const uint8_t *end = buf + len;
+
+    while (buf < end) {
+        fcs = ppp_fcs_char(fcs, *buf);
+        ppp_tx_escaped(ppp, *buf++);
+    }
+    ppp->tx_fcs = fcs;
+}
+
+static void ppp_tx_end(struct pico_device_ppp *ppp)
+{
+    uint16_t fcs = ppp_fcs_finish(ppp->tx_fcs);
+
+    ppp_tx_escaped(ppp, (uint8_t)(fcs & 0xFFu));
+    ppp_tx_escaped(ppp, (uint8_t)((fcs & 0xFF00u) >> 8));
+    ppp_tx_byte(ppp, PPPF_FLAG_SEQ);
+    ppp_tx_flush(ppp);
+}
+
+/* Escape and send a complete frame, FCS and flags included */
 static int ppp_serial_send_escape(struct pico_device_ppp *ppp, void *buf, int len)
 {
     uint8_t *in_buf = (uint8_t *)buf;
-    uint8_t *out_buf = NULL;
-    int esc_char_count = 0;
-    int newlen = 0, ret = -1;
-    int i, j;
+    int i;
 
 #ifdef PPP_DEBUG
     {
@@ -324,42 +513,16 @@ static int ppp_serial_send_escape(struct pico_device_ppp *ppp, void *buf, int le
     }
 #endif
 
-    for (i = 1; i < (len - 1); i++) /* from 1 to len -1, as start/stop are not escaped */
-    {
-        if (((in_buf[i] + 1u) >> 1) == 0x3Fu)
-            esc_char_count++;
-    }
-    if (!esc_char_count) {
-        return ppp->serial_send(&ppp->dev, buf, len);
-    }
-
-    newlen = len + esc_char_count;
-    out_buf = PICO_ZALLOC((uint32_t)newlen);
-    if(!out_buf)
+    if ((len < 2) || (ppp_tx_reserve(ppp, (uint32_t)len) < 0))
         return -1;
 
-    /* Start byte. */
-    out_buf[0] = in_buf[0];
-    for(i = 1, j = 1; i < (len - 1); i++) {
-        if (((in_buf[i] + 1u) >> 1) == 0x3Fu) {
-            out_buf[j++] = PPPF_CTRL_ESC;
-            out_buf[j++] = in_buf[i] ^ 0x20;
-        } else {
-            out_buf[j++] = in_buf[i];
-        }
-    }
-    /* Stop byte. */
-    out_buf[newlen - 1] = in_buf[len - 1];
-
-    ret = ppp->serial_send(&ppp->dev, out_buf, newlen);
-
-    PICO_FREE(out_buf);
-
-    if (ret == newlen)
-        return len;
-
-    return ret;
-
+    /* start/stop are not escaped */
+    ppp_tx_byte(ppp, in_buf[0]);
+    for (i = 1; i < (len - 1); i++)
+        ppp_tx_escaped(ppp, in_buf[i]);
+    ppp_tx_byte(ppp, in_buf[len - 1]);
+    ppp_tx_flush(ppp);
+    return len;
 }
 
 static void lcp_timer_start(struct pico_device_ppp *ppp, uint8_t timer_type)
@@ -435,47 +598,6 @@ static uint32_t ppp_ctl_packet_size(struct pico_device_ppp *ppp, uint16_t proto,
     return prefix;
 }
 
-/* CRC16 / FCS Calculation */
-static uint16_t ppp_fcs_char(uint16_t old_crc, uint8_t data)
-{
-    uint16_t word = (old_crc ^ data) & (uint16_t)0x00FFu;
-    word = (uint16_t)(word ^ (uint16_t)((word << 4u) & (uint16_t)0x00FFu));
-    word = (uint16_t)((word << 8u) ^ (word << 3u) ^ (word >> 4u));
-    return ((old_crc >> 8u) ^ word);
-}
-
-static uint16_t ppp_fcs_continue(uint16_t fcs, uint8_t *buf, uint32_t len)
-{
-    uint8_t *pos = buf;
-    for (pos = buf; pos < buf + len; pos++)
-    {
-        fcs = ppp_fcs_char(fcs, *pos);
-    }
-    return fcs;
-}
-
-static uint16_t ppp_fcs_finish(uint16_t fcs)
-{
-    return fcs ^ 0xFFFF;
-}
-
-static uint16_t ppp_fcs_start(uint8_t *buf, uint32_t len)
-{
-    uint16_t fcs = 0xFFFF;
-    return ppp_fcs_continue(fcs, buf, len);
-}
-
-static int ppp_fcs_verify(uint8_t *buf, uint32_t len)
-{
-    uint16_t fcs = ppp_fcs_start(buf, len - 2);
-    fcs = ppp_fcs_finish(fcs);
-    if ((((fcs & 0xFF00u) >> 8) != buf[len - 1]) || ((fcs & 0xFFu) != buf[len - 2])) {
-        return -1;
-    }
-
-    return 0;
-}
-
 /* Serial send (DTE->DCE) functions */
 static int pico_ppp_ctl_send(struct pico_device *dev, uint16_t code, uint8_t *pkt, uint32_t len)
 {
@@ -505,13 +627,11 @@ static int pico_ppp_ctl_send(struct pico_device *dev, uint16_t code, uint8_t *pk
     return (int)len;
 }
 
-static uint8_t pico_ppp_data_buffer[PPP_HDR_SIZE + PPP_PROTO_SLOT_SIZE + PICO_PPP_MTU + PPP_FCS_SIZE + 1];
 static int pico_ppp_send(struct pico_device *dev, void *buf, int len)
 {
     struct pico_device_ppp *ppp = (struct pico_device_ppp *) dev;
-    uint16_t fcs = 0;
-    int fcs_start;
-    int i = 0;
+    uint8_t hdr[4];
+    uint32_t i = 0;
 
     ppp_dbg(" >>>>>>>>> PPP OUT\n");
 
@@ -521,30 +641,26 @@ static int pico_ppp_send(struct pico_device *dev, void *buf, int len)
     if (!ppp->serial_send)
         return len;
 
-    pico_ppp_data_buffer[i++] = PPPF_FLAG_SEQ;
     if (!LCPOPT_ISSET_PEER(ppp, LCPOPT_ADDRCTL_COMP))
     {
-        pico_ppp_data_buffer[i++] = PPPF_ADDR;
-        pico_ppp_data_buffer[i++] = PPPF_CTRL;
+        hdr[i++] = PPPF_ADDR;
+        hdr[i++] = PPPF_CTRL;
     }
 
-    fcs_start = i;
-
     if (!LCPOPT_ISSET_PEER(ppp, LCPOPT_PROTO_COMP))
     {
-        pico_ppp_data_buffer[i++] = 0x00;
+        hdr[i++] = 0x00;
     }
 
-    pico_ppp_data_buffer[i++] = 0x21;
-    memcpy(pico_ppp_data_buffer + i, buf, (uint32_t)len);
-    i += len;
-    fcs = ppp_fcs_start(pico_ppp_data_buffer + fcs_start, (uint32_t)(i - fcs_start));
-    fcs = ppp_fcs_finish(fcs);
-    pico_ppp_data_buffer[i++] = (uint8_t)(fcs & 0xFFu);
-    pico_ppp_data_buffer[i++] = (uint8_t)((fcs & 0xFF00u) >> 8);
-    pico_ppp_data_buffer[i++] = PPPF_FLAG_SEQ;
+    hdr[i++] = 0x21;
 
-    ppp_serial_send_escape(ppp, pico_ppp_data_buffer, i);
+    /* TX ring full: let the stack retry later */
+    if (ppp_tx_begin(ppp, i + (uint32_t)len) < 0)
+        return 0;
+
+    ppp_tx_put(ppp, hdr, i);
+    ppp_tx_put(ppp, (uint8_t *)buf, (uint32_t)len);
+    ppp_tx_end(ppp);
     return len;
 }
 
@@ -1400,44 +1516,175 @@ static void ppp_process_packet_payload(struct pico_device_ppp *ppp, uint8_t *pkt
     ppp_dbg("PPP: Unrecognized protocol %02x%02x\n", pkt[0], pkt[1]);
 }
 
-static void ppp_process_packet(struct pico_device_ppp *ppp, uint8_t *pkt, uint32_t len)
+/* RX. Bytes are unescaped as they arrive: the address, control and
+ * protocol fields go to rx_hdr, the rest straight into the buffer of
+ * rx_frame, which is kept from frame to frame. IP packets are copied once,
+ * by pico_stack_recv().
+ * The FCS is accumulated on the way and checked against the residue. */
+static void ppp_rx_reset(struct pico_device_ppp *ppp)
+{
+    ppp->rx_len = 0;
+    ppp->rx_hlen = 0;
+    ppp->rx_fcs = 0xFFFF;
+    ppp->rx_flags = 0;
+}
+
+static int ppp_rx_is_ip(const uint8_t *proto, uint8_t len)
 {
-    /* Verify incoming FCS */
-    if (ppp_fcs_verify(pkt, len) != 0)
+    if ((len == 2) && (proto[0] != 0x00))
+        return 0;
+
+    return (proto[len - 1] == 0x21) || (proto[len - 1] == 0x57);
+}
+
+static void ppp_rx_deliver(struct pico_device_ppp *ppp)
+{
+    struct pico_frame *f = ppp->rx_frame;
+    uint8_t *proto = ppp->rx_hdr;
+    uint8_t plen = ppp->rx_hlen;
+    uint32_t len;
+
+    if (!(ppp->rx_flags & PPP_RX_PAYLOAD) || (ppp->rx_len < PPP_FCS_SIZE) || (ppp->rx_fcs != PPP_FCS_GOOD)) {
+        ppp_dbg("PPP: bad frame, %u bytes\n", ppp->rx_len);
         return;
+    }
 
-    /* Remove trailing FCS */
-    len -= 2;
+    len = ppp->rx_len - PPP_FCS_SIZE;
+    if ((proto[0] == PPPF_ADDR) && (plen > 2)) {
+        proto += 2;
+        plen = (uint8_t)(plen - 2);
+    }
+
+    if (ppp_rx_is_ip(proto, plen)) {
+        if (!len)
+            return;
 
-    /* Remove ADDR/CTRL, then process */
-    if ((pkt[0] == PPPF_ADDR) && (pkt[1] == PPPF_CTRL)) {
-        pkt += 2;
-        len -= 2;
+        /* through the receive path of every driver, for its accounting
+         * and hooks; rx_frame stays for the next frame */
+        pico_stack_recv(&ppp->dev, f->buffer, len);
+        return;
     }
 
-    ppp_process_packet_payload(ppp, pkt, len);
+    /* control protocols are parsed with the protocol field in front */
+    memmove(f->buffer + plen, f->buffer, len);
+    memcpy(f->buffer, proto, plen);
+    ppp_process_packet_payload(ppp, f->buffer, len + plen);
+}
+
+/* Unescapes len bytes of a PPP stream. Returns the number of bytes used,
+ * stopping after the first complete frame. */
+static uint32_t ppp_rx_stream(struct pico_device_ppp *ppp, const uint8_t *buf, uint32_t len, int *frames)
+{
+    uint32_t i;
+    uint8_t c;
+
+    for (i = 0; i < len; i++) {
+        c = buf[i];
+        if (c == PPPF_FLAG_SEQ) {
+            if (ppp->rx_flags & PPP_RX_ESCAPE) {
+                /* Illegal sequence, discard frame */
+                ppp_dbg("PPP: illegal escape sequence\n");
+            } else if (!(ppp->rx_flags & PPP_RX_DISCARD) && (ppp->rx_len || ppp->rx_hlen)) {
+                ppp_rx_deliver(ppp);
+                ppp_rx_reset(ppp);
+                (*frames)++;
+                return i + 1;
+            }
+
+            ppp_rx_reset(ppp);
+            continue;
+        }
+
+        if (ppp->rx_flags & PPP_RX_DISCARD)
+            continue;
+
+        if (c == PPPF_CTRL_ESC) {
+            ppp->rx_flags |= PPP_RX_ESCAPE;
+            continue;
+        }
+
+        if (ppp->rx_flags & PPP_RX_ESCAPE) {
+            c ^= 0x20;
+            ppp->rx_flags &= (uint8_t)~PPP_RX_ESCAPE;
+        }
+
+        ppp->rx_fcs = ppp_fcs_char(ppp->rx_fcs, c);
+        if (!(ppp->rx_flags & PPP_RX_PAYLOAD)) {
+            if (ppp->rx_hlen >= sizeof(ppp->rx_hdr)) {
+                ppp->rx_flags |= PPP_RX_DISCARD;
+                continue;
+            }
+
+            ppp->rx_hdr[ppp->rx_hlen++] = c;
+            /* after the optional address and control fields, the
+             * protocol field ends with its first odd byte */
+            if ((c & 0x01u) && ((ppp->rx_hdr[0] != PPPF_ADDR) || (ppp->rx_hlen > 2)))
+                ppp->rx_flags |= PPP_RX_PAYLOAD;
+
+            continue;
+        }
+
+        if (!ppp->rx_frame) {
+            ppp->rx_frame = pico_frame_alloc(PPP_MAXPKT);
+            if (!ppp->rx_frame) {
+                ppp->rx_flags |= PPP_RX_DISCARD;
+                continue;
+            }
+        }
+
+        /* room is left to put the protocol field back in front */
+        if (ppp->rx_len >= (PPP_MAXPKT - PPP_PROTO_SLOT_SIZE)) {
+            ppp->rx_flags |= PPP_RX_DISCARD;
+            continue;
+        }
 
+        ppp->rx_frame->buffer[ppp->rx_len++] = c;
+    }
+    return len;
 }
 
-static void ppp_recv_data(struct pico_device_ppp *ppp, void *data, uint32_t len)
+/* AT command mode: collects lines in the RX buffer */
+static uint32_t ppp_rx_modem(struct pico_device_ppp *ppp, const uint8_t *buf, uint32_t len)
 {
-    uint8_t *pkt = (uint8_t *)data;
+    uint32_t i;
+    uint8_t c;
+
+    if (!ppp->rx_frame) {
+        ppp->rx_frame = pico_frame_alloc(PPP_MAXPKT);
+        if (!ppp->rx_frame)
+            return len;
+    }
+
+    for (i = 0; (i < len) && (ppp->modem_state != PPP_MODEM_STATE_CONNECTED); i++) {
+        c = buf[i];
+        if (c == AT_S3) {
+            ppp->rx_flags |= PPP_RX_S3;
+            if (ppp->rx_len > 0) {
+                ppp->rx_frame->buffer[ppp->rx_len] = '\0';
+                ppp_modem_recv(ppp, ppp->rx_frame->buffer, ppp->rx_len);
+                ppp->rx_len = 0;
+            }
+        } else if (c == AT_S4) {
+            if (!(ppp->rx_flags & PPP_RX_S3))
+                ppp->rx_frame->buffer[ppp->rx_len++] = c;
 
-#ifdef PPP_DEBUG
-    uint32_t idx;
-    if (len > 0) {
-        ppp_dbg("PPP   <<<<< ");
-        for(idx = 0; idx < len; idx++) {
-            ppp_dbg(" %02x", ((uint8_t *)data)[idx]);
+            ppp->rx_flags &= (uint8_t)~PPP_RX_S3;
+        } else {
+            ppp->rx_flags &= (uint8_t)~PPP_RX_S3;
+            ppp->rx_frame->buffer[ppp->rx_len++] = c;
         }
-        ppp_dbg("\n");
+
+        if (ppp->rx_len >= (PPP_MAXPKT - 1u))
+            ppp->rx_len = 0;
     }
 
-#endif
+    if (ppp->modem_state == PPP_MODEM_STATE_CONNECTED)
+        ppp_rx_reset(ppp);
 
-    ppp_process_packet(ppp, pkt, len);
+    return i;
 }
 
+
 static void lcp_this_layer_up(struct pico_device_ppp *ppp)
 {
     ppp_dbg("PPP: LCP up.\n");
@@ -2024,61 +2271,35 @@ static void evaluate_ipcp_state(struct pico_device_ppp *ppp, enum ppp_ipcp_event
 static int pico_ppp_poll(struct pico_device *dev, int loop_score)
 {
     struct pico_device_ppp *ppp = (struct pico_device_ppp *) dev;
-    static uint32_t len = 0;
-    int r;
-    if (ppp->serial_recv) {
-        do {
-            r = ppp->serial_recv(&ppp->dev, &ppp_recv_buf[len], 1);
+    uint8_t *chunk;
+    uint32_t avail;
+    int r, frames;
+
+    if (ppp->serial_send && ppp->tx_len)
+        ppp_tx_flush(ppp);
+
+    if (!ppp->serial_recv)
+        return loop_score;
+
+    while (loop_score > 0) {
+        if (ppp->rx_chunk_pos >= ppp->rx_chunk_len) {
+            r = ppp->serial_recv(&ppp->dev, ppp->rx_chunk, PICO_PPP_RX_CHUNK);
             if (r <= 0)
                 break;
 
-            if (ppp->modem_state == PPP_MODEM_STATE_CONNECTED) {
-                static int control_escape = 0;
-
-                if (ppp_recv_buf[len] == PPPF_FLAG_SEQ) {
-                    if (control_escape) {
-                        /* Illegal sequence, discard frame */
-                        ppp_dbg("Illegal sequence, ppp_recv_buf[%d] = %d\n", len, ppp_recv_buf[len]);
-                        control_escape = 0;
-                        len = 0;
-                    }
-
-                    if (len > 1) {
-                        ppp_recv_data(ppp, ppp_recv_buf, len);
-                        loop_score--;
-                        len = 0;
-                    }
-                } else if (control_escape) {
-                    ppp_recv_buf[len] ^= 0x20;
-                    control_escape = 0;
-                    len++;
-                } else if (ppp_recv_buf[len] == PPPF_CTRL_ESC) {
-                    control_escape = 1;
-                } else {
-                    len++;
-                }
-            } else {
-                static int s3 = 0;
-
-                if (ppp_recv_buf[len] == AT_S3) {
-                    s3 = 1;
-                    if (len > 0) {
-                        ppp_recv_buf[len] = '\0';
-                        ppp_modem_recv(ppp, ppp_recv_buf, len);
-                        len = 0;
-                    }
-                } else if (ppp_recv_buf[len] == AT_S4) {
-                    if (!s3) {
-                        len++;
-                    }
-
-                    s3 = 0;
-                } else {
-                    s3 = 0;
-                    len++;
-                }
-            }
-        } while ((r > 0) && (len < ARRAY_SIZE(ppp_recv_buf)) && (loop_score > 0));
+            ppp->rx_chunk_pos = 0;
+            ppp->rx_chunk_len = (uint16_t)r;
+        }
+
+        chunk = ppp->rx_chunk + ppp->rx_chunk_pos;
+        avail = (uint32_t)(ppp->rx_chunk_len - ppp->rx_chunk_pos);
+        if (ppp->modem_state == PPP_MODEM_STATE_CONNECTED) {
+            frames = 0;
+            ppp->rx_chunk_pos = (uint16_t)(ppp->rx_chunk_pos + ppp_rx_stream(ppp, chunk, avail, &frames));
+            loop_score -= frames;
+        } else {
+            ppp->rx_chunk_pos = (uint16_t)(ppp->rx_chunk_pos + ppp_rx_modem(ppp, chunk, avail));
+        }
     }
 
     return loop_score;
@@ -2103,6 +2324,8 @@ void pico_ppp_destroy(struct pico_device *ppp)
     /* Perform custom cleanup here before calling 'pico_device_destroy'
      * or register a custom cleanup function during initialization
      * by setting 'ppp->dev.destroy'. */
+    if (((struct pico_device_ppp *)ppp)->rx_frame)
+        pico_frame_discard(((struct pico_device_ppp *)ppp)->rx_frame);
 
     pico_device_destroy(ppp);
 }
@@ -2207,6 +2430,7 @@ struct pico_device *pico_ppp_create(void)
         return NULL;
     }
     ppp->mru = PICO_PPP_MRU;
+    ppp_rx_reset(ppp);
 
     LCPOPT_SET_LOCAL(ppp, LCPOPT_MRU);
     LCPOPT_SET_LOCAL(ppp, LCPOPT_AUTH); /* We support authentication, even if it's not part of the req */
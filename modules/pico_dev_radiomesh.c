@@ -0,0 +1,399 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   In-process IEEE 802.15.4 medium for simulating large 6LoWPAN networks.
+ *********************************************************************/
+
+#include "pico_dev_radiomesh.h"
+#include "pico_6lowpan_ll.h"
+#include "pico_addressing.h"
+#include "pico_802154.h"
+#include "pico_device.h"
+#include "pico_config.h"
+#include "pico_stack.h"
+
+#ifdef DEBUG_RADIOMESH
+#define mesh_dbg        dbg
+#else
+#define mesh_dbg(...)   do { } while (0)
+#endif
+
+#define RADIOMESH_PANID     (0xABCD)
+#define RADIOMESH_MAX_ID    (0xFFFD)    /* 0xFFFE and 0xFFFF are reserved */
+
+struct radiomesh_link {
+    uint32_t latency;
+    uint16_t peer;
+    uint8_t loss;
+};
+
+struct radiomesh_slot {
+    pico_time due;
+    union pico_ll_addr src;
+    union pico_ll_addr dst;
+    uint16_t len;
+    uint8_t buf[MTU_802154_PHY];
+};
+
+struct radiomesh_node {
+    struct pico_dev_6lowpan dev;
+    struct pico_6lowpan_info addr;
+    struct pico_radiomesh *mesh;
+    struct radiomesh_link *links;
+    struct radiomesh_slot *ring;
+    uint32_t head;
+    uint32_t tail;
+    uint16_t n_links;
+    uint16_t max_links;
+    uint16_t id;
+};
+
+struct pico_radiomesh {
+    struct radiomesh_node **nodes;      /* Indexed by id */
+    struct pico_radiomesh_stats stats;
+    pico_time now;
+    uint32_t n_nodes;                   /* Size of nodes */
+    uint32_t rand;
+};
+
+/* xorshift32, so loss doesn't depend on pico_rand() or the platform */
+static uint32_t radiomesh_rand(struct pico_radiomesh *mesh)
+{
+    uint32_t x = mesh->rand;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    mesh->rand = x;
+    return x;
+}
+
+static struct radiomesh_node *radiomesh_get(struct pico_radiomesh *mesh, uint16_t id)
+{
+    if ((uint32_t)id >= mesh->n_nodes)
+        return NULL;
+
+    return mesh->nodes[id];
+}
+
+static void radiomesh_gen_ext(uint16_t id, uint8_t *ext)
+{
+    memset(ext, 0, SIZE_6LOWPAN_EXT);
+    ext[3] = 0xaa;
+    ext[4] = 0xab;
+    ext[6] = (uint8_t)(id >> 8);
+    ext[7] = (uint8_t)(id & 0xFF);
+}
+
+/* Node a link layer destination refers to, NULL for broadcast. Sets *valid
+ * to 0 for an address that isn't in the mesh. */
+static struct radiomesh_node *radiomesh_dst(struct pico_radiomesh *mesh, union pico_ll_addr *dst, int *valid)
+{
+    struct radiomesh_node *node = NULL;
+    uint8_t *a = dst->pan.addr.data;
+    uint16_t id = 0;
+
+    *valid = 1;
+    if (dst->pan.mode == AM_6LOWPAN_SHORT) {
+        id = (uint16_t)((a[0] << 8) | a[1]);
+        if (id == 0xFFFF)
+            return NULL;
+        node = radiomesh_get(mesh, id);
+    } else if (dst->pan.mode == AM_6LOWPAN_EXT) {
+        id = (uint16_t)((a[6] << 8) | a[7]);
+        node = radiomesh_get(mesh, id);
+        if (node && memcmp(node->addr.addr_ext.addr, a, SIZE_6LOWPAN_EXT))
+            node = NULL;
+    }
+
+    if (!node)
+        *valid = 0;
+
+    return node;
+}
+
+static void radiomesh_deliver(struct radiomesh_node *from, struct radiomesh_link *l, struct radiomesh_node *to,
+                              void *buf, int len, union pico_ll_addr *src, union pico_ll_addr *dst)
+{
+    struct pico_radiomesh *mesh = from->mesh;
+    struct radiomesh_slot *slot = NULL;
+
+    if (l->loss && (radiomesh_rand(mesh) % 100u) < l->loss) {
+        mesh->stats.lost++;
+        return;
+    }
+
+    if ((to->tail - to->head) >= PICO_RADIOMESH_RING) {
+        mesh_dbg("Radiomesh: ring of node %u full\n", to->id);
+        mesh->stats.overflow++;
+        return;
+    }
+
+    slot = &to->ring[to->tail & (PICO_RADIOMESH_RING - 1)];
+    slot->due = mesh->now + l->latency;
+    slot->src = *src;
+    slot->dst = *dst;
+    slot->len = (uint16_t)len;
+    memcpy(slot->buf, buf, (size_t)len);
+    to->tail++;
+}
+
+static int radiomesh_send(struct pico_device *dev, void *buf, int len, union pico_ll_addr src, union pico_ll_addr dst)
+{
+    struct radiomesh_node *node = (struct radiomesh_node *)dev;
+    struct pico_radiomesh *mesh = node->mesh;
+    struct radiomesh_node *to = NULL, *peer = NULL;
+    int valid = 0, heard = 0;
+    uint16_t i = 0;
+
+    /* Consumed either way, a frame that can't go on air would block the queue */
+    if (len <= 0 || len > (int)MTU_802154_PHY)
+        return len;
+
+    mesh->stats.sent++;
+    to = radiomesh_dst(mesh, &dst, &valid);
+    for (i = 0; i < node->n_links; i++) {
+        peer = radiomesh_get(mesh, node->links[i].peer);
+        if (!peer || (to && peer != to))
+            continue;
+
+        radiomesh_deliver(node, &node->links[i], peer, buf, len, &src, &dst);
+        heard = 1;
+    }
+
+    if (!valid || (to && !heard)) {
+        mesh_dbg("Radiomesh: node %u can't reach the destination\n", node->id);
+        mesh->stats.unreachable++;
+    }
+
+    return len;
+}
+
+static int radiomesh_poll(struct pico_device *dev, int loop_score)
+{
+    struct radiomesh_node *node = (struct radiomesh_node *)dev;
+    struct radiomesh_slot *slot = NULL;
+
+    /* In order of transmission, none before its time */
+    while ((loop_score > 0) && (node->head != node->tail)) {
+        slot = &node->ring[node->head & (PICO_RADIOMESH_RING - 1)];
+        if (slot->due > node->mesh->now)
+            break;
+
+        pico_6lowpan_stack_recv(dev, slot->buf, slot->len, &slot->src, &slot->dst);
+        node->mesh->stats.delivered++;
+        node->head++;
+        loop_score--;
+    }
+    return loop_score;
+}
+
+static void radiomesh_node_destroy(struct pico_device *dev)
+{
+    struct radiomesh_node *node = (struct radiomesh_node *)dev;
+
+    node->mesh->nodes[node->id] = NULL;
+    if (node->links)
+        PICO_FREE(node->links);
+    PICO_FREE(node->ring);
+    /* pico_device_destroy only frees the ethernet info */
+    if (dev->eth)
+        PICO_FREE(dev->eth);
+    dev->eth = NULL;
+}
+
+static int radiomesh_grow(struct pico_radiomesh *mesh, uint16_t id)
+{
+    struct radiomesh_node **nodes = NULL;
+    uint32_t size = mesh->n_nodes ? mesh->n_nodes : 64u;
+
+    while (size <= id)
+        size <<= 1;
+    if (size > (uint32_t)RADIOMESH_MAX_ID + 1u)
+        size = (uint32_t)RADIOMESH_MAX_ID + 1u;
+
+    nodes = PICO_ZALLOC(size * sizeof(struct radiomesh_node *));
+    if (!nodes) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    if (mesh->nodes) {
+        memcpy(nodes, mesh->nodes, mesh->n_nodes * sizeof(struct radiomesh_node *));
+        PICO_FREE(mesh->nodes);
+    }
+
+    mesh->nodes = nodes;
+    mesh->n_nodes = size;
+    return 0;
+}
+
+struct pico_radiomesh *pico_radiomesh_create(uint32_t seed)
+{
+    struct pico_radiomesh *mesh = PICO_ZALLOC(sizeof(struct pico_radiomesh));
+
+    if (!mesh) {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    mesh->rand = seed ? seed : 1u;
+    return mesh;
+}
+
+void pico_radiomesh_destroy(struct pico_radiomesh *mesh)
+{
+    uint32_t i = 0;
+
+    if (!mesh)
+        return;
+
+    for (i = 0; i < mesh->n_nodes; i++) {
+        if (mesh->nodes[i])
+            pico_device_destroy((struct pico_device *)mesh->nodes[i]);
+    }
+    if (mesh->nodes)
+        PICO_FREE(mesh->nodes);
+    PICO_FREE(mesh);
+}
+
+struct pico_device *pico_radiomesh_node_add(struct pico_radiomesh *mesh, uint16_t id)
+{
+    struct radiomesh_node *node = NULL;
+    char name[MAX_DEVICE_NAME];
+
+    if (!mesh || id > RADIOMESH_MAX_ID || radiomesh_get(mesh, id)) {
+        pico_err = PICO_ERR_EINVAL;
+        return NULL;
+    }
+
+    if (((uint32_t)id >= mesh->n_nodes) && radiomesh_grow(mesh, id))
+        return NULL;
+
+    node = PICO_ZALLOC(sizeof(struct radiomesh_node));
+    if (!node) {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    node->ring = PICO_ZALLOC(PICO_RADIOMESH_RING * sizeof(struct radiomesh_slot));
+    if (!node->ring) {
+        PICO_FREE(node);
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    node->mesh = mesh;
+    node->id = id;
+    node->addr.pan_id.addr = short_be(RADIOMESH_PANID);
+    node->addr.addr_short.addr = short_be(id);
+    radiomesh_gen_ext(id, node->addr.addr_ext.addr);
+
+    /* Registered before init, which may already send */
+    mesh->nodes[id] = node;
+    node->dev.dev.destroy = radiomesh_node_destroy;
+    /* Mesh nodes route. Hosts would each keep soliciting a router on a
+     * timer of their own, which runs out the timer heap on large meshes. */
+    node->dev.dev.hostvars.routing = 1;
+    snprintf(name, MAX_DEVICE_NAME, "mesh%u", id);
+    if (pico_dev_6lowpan_init(&node->dev, name, (uint8_t *)&node->addr, LL_MODE_IEEE802154, MTU_802154_MAC, 0,
+                              radiomesh_send, radiomesh_poll)) {
+        pico_device_destroy((struct pico_device *)node);
+        return NULL;
+    }
+
+    mesh_dbg("Radiomesh: node %u added\n", id);
+    return (struct pico_device *)node;
+}
+
+int pico_radiomesh_link(struct pico_radiomesh *mesh, uint16_t a, uint16_t b, uint8_t loss, uint32_t latency)
+{
+    struct radiomesh_node *node = NULL;
+    struct radiomesh_link *links = NULL;
+    uint16_t i = 0;
+
+    if (!mesh || !(node = radiomesh_get(mesh, a)) || !radiomesh_get(mesh, b) || a == b || loss > 100) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < node->n_links; i++) {
+        if (node->links[i].peer == b)
+            break;
+    }
+
+    if (i == node->max_links) {
+        links = PICO_ZALLOC((size_t)(node->max_links ? (node->max_links << 1) : 4) * sizeof(struct radiomesh_link));
+        if (!links) {
+            pico_err = PICO_ERR_ENOMEM;
+            return -1;
+        }
+
+        if (node->links) {
+            memcpy(links, node->links, node->n_links * sizeof(struct radiomesh_link));
+            PICO_FREE(node->links);
+        }
+
+        node->links = links;
+        node->max_links = (uint16_t)(node->max_links ? (node->max_links << 1) : 4);
+    }
+
+    if (i == node->n_links)
+        node->n_links++;
+
+    node->links[i].peer = b;
+    node->links[i].loss = loss;
+    node->links[i].latency = latency;
+    return 0;
+}
+
+int pico_radiomesh_link_both(struct pico_radiomesh *mesh, uint16_t a, uint16_t b, uint8_t loss, uint32_t latency)
+{
+    if (pico_radiomesh_link(mesh, a, b, loss, latency))
+        return -1;
+
+    return pico_radiomesh_link(mesh, b, a, loss, latency);
+}
+
+int pico_radiomesh_grid(struct pico_radiomesh *mesh, uint16_t width, uint16_t height, uint8_t loss, uint32_t latency)
+{
+    uint32_t x = 0, y = 0, id = 0;
+
+    if (!mesh || !width || !height || ((uint32_t)width * height > (uint32_t)RADIOMESH_MAX_ID + 1u)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            id = y * width + x;
+            if (!radiomesh_get(mesh, (uint16_t)id))
+                continue;
+
+            if ((x + 1 < width) && radiomesh_get(mesh, (uint16_t)(id + 1)) &&
+                pico_radiomesh_link_both(mesh, (uint16_t)id, (uint16_t)(id + 1), loss, latency))
+                return -1;
+
+            if ((y + 1 < height) && radiomesh_get(mesh, (uint16_t)(id + width)) &&
+                pico_radiomesh_link_both(mesh, (uint16_t)id, (uint16_t)(id + width), loss, latency))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+void pico_radiomesh_advance(struct pico_radiomesh *mesh, uint32_t ms)
+{
+    mesh->now += ms;
+}
+
+pico_time pico_radiomesh_time(struct pico_radiomesh *mesh)
+{
+    return mesh->now;
+}
+
+void pico_radiomesh_get_stats(struct pico_radiomesh *mesh, struct pico_radiomesh_stats *stats)
+{
+    *stats = mesh->stats;
+}
@@ -0,0 +1,53 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+ *********************************************************************/
+#ifndef INCLUDE_PICO_DEV_RADIOMESH
+#define INCLUDE_PICO_DEV_RADIOMESH
+
+#include "pico_config.h"
+#include "pico_device.h"
+
+/* In-process IEEE 802.15.4 medium. Every node is a 6LoWPAN device on this
+ * stack with its own receive ring. A frame sent by a node is copied into the
+ * rings of the nodes that hear it, according to the links of the sender.
+ * Frames become receivable once the link latency has passed on the clock of
+ * the medium, which only moves with pico_radiomesh_advance(), so runs with
+ * the same seed and the same calls are identical. */
+
+/* Receive slots per node, power of two. A frame for a full ring is lost. */
+#ifndef PICO_RADIOMESH_RING
+#define PICO_RADIOMESH_RING     (16)
+#endif
+
+struct pico_radiomesh;
+
+struct pico_radiomesh_stats {
+    uint64_t sent;          /* Frames transmitted by nodes */
+    uint64_t delivered;     /* Copies handed to a receiving node */
+    uint64_t lost;          /* Copies dropped by the loss model */
+    uint64_t overflow;      /* Copies dropped on a full ring */
+    uint64_t unreachable;   /* Unicast frames with no link to the destination */
+};
+
+struct pico_radiomesh *pico_radiomesh_create(uint32_t seed);
+/* Destroys the remaining nodes as well */
+void pico_radiomesh_destroy(struct pico_radiomesh *mesh);
+
+/* Node id is its short address, 0 to 0xFFFD. The device is named "mesh<id>". */
+struct pico_device *pico_radiomesh_node_add(struct pico_radiomesh *mesh, uint16_t id);
+/* Node b hears node a, losing loss percent of the frames, latency ms later.
+ * Linking again updates the link. */
+int pico_radiomesh_link(struct pico_radiomesh *mesh, uint16_t a, uint16_t b, uint8_t loss, uint32_t latency);
+/* Both ways */
+int pico_radiomesh_link_both(struct pico_radiomesh *mesh, uint16_t a, uint16_t b, uint8_t loss, uint32_t latency);
+/* Links the existing nodes with ids below width * height as a grid, each to
+ * its horizontal and vertical neighbours */
+int pico_radiomesh_grid(struct pico_radiomesh *mesh, uint16_t width, uint16_t height, uint8_t loss, uint32_t latency);
+
+void pico_radiomesh_advance(struct pico_radiomesh *mesh, uint32_t ms);
+pico_time pico_radiomesh_time(struct pico_radiomesh *mesh);
+void pico_radiomesh_get_stats(struct pico_radiomesh *mesh, struct pico_radiomesh_stats *stats);
+
+#endif /* INCLUDE_PICO_DEV_RADIOMESH */
@@ -31,6 +31,19 @@
 /* maximum size of a DHCP message */
 #define DHCP_SERVER_MAXMSGSIZE (PICO_IP_MRU - sizeof(struct pico_ipv4_hdr) - sizeof(struct pico_udp_hdr))
 
+/* how long an offered address is held for the client to request it */
+#ifndef PICO_DHCPD_OFFER_TIMEOUT
+#define PICO_DHCPD_OFFER_TIMEOUT (30000u)
+#endif
+
+/* initial size of the lease hash tables, they double when full */
+#define DHCPS_HASH_MIN         (16u)
+
+#define DHCPS_BY_MAC           (0)
+#define DHCPS_BY_XID           (1)
+
+#define DHCPS_SNAPSHOT_MAGIC   (0x50444C31u) /* "PDL1" */
+
 enum dhcp_server_state {
     PICO_DHCP_STATE_DISCOVER = 0,
     PICO_DHCP_STATE_OFFER,
@@ -46,6 +59,31 @@ struct pico_dhcp_server_negotiation {
     struct pico_ip4 ciaddr;
     struct pico_eth hwaddr;
     uint8_t bcast;
+    /* lease database */
+    struct pico_dhcp_server_negotiation *next_mac;
+    struct pico_dhcp_server_negotiation *next_xid;
+    pico_time expire;
+    uint32_t heap_index; /* 1-based, 0 when not in the expiry heap */
+};
+
+struct dhcps_hash {
+    struct pico_dhcp_server_negotiation **bucket;
+    uint32_t size; /* power of two, 0 while empty */
+    uint32_t count;
+};
+
+PACKED_STRUCT_DEF dhcps_snapshot_hdr
+{
+    uint32_t magic;
+    uint32_t count;
+};
+
+PACKED_STRUCT_DEF dhcps_snapshot_lease
+{
+    uint8_t hwaddr[PICO_SIZE_ETH];
+    uint16_t reserved;
+    uint32_t addr;
+    uint32_t remaining; /* seconds */
 };
 
 static inline int ip_address_is_in_dhcp_range(struct pico_dhcp_server_negotiation *n, uint32_t x)
@@ -73,16 +111,112 @@ static int dhcp_settings_cmp(void *ka, void *kb)
 }
 static PICO_TREE_DECLARE(DHCPSettings, dhcp_settings_cmp);
 
-static int dhcp_negotiations_cmp(void *ka, void *kb)
+/* Leases, by (server, client MAC) and by transaction id */
+static struct dhcps_hash DHCPLeasesMac, DHCPLeasesXid;
+
+/* Leases of all servers in a min-heap on their expiry time, one timer
+ * for the earliest */
+static struct pico_dhcp_server_negotiation **DHCPLeaseHeap;
+static uint32_t dhcps_heap_len, dhcps_heap_size;
+static uint32_t dhcps_timer;
+static pico_time dhcps_timer_due;
+
+static uint32_t dhcps_mac_hash(const struct pico_eth *mac)
 {
-    struct pico_dhcp_server_negotiation *a = ka, *b = kb;
-    if (a->xid == b->xid)
-        return 0;
+    uint32_t h = 2166136261u, i;
+
+    for (i = 0; i < PICO_SIZE_ETH; i++)
+        h = (h ^ mac->addr[i]) * 16777619u;
+    return h;
+}
+
+static uint32_t dhcps_xid_hash(uint32_t xid)
+{
+    xid *= 0x9E3779B1u;
+    return xid ^ (xid >> 16);
+}
+
+static uint32_t dhcps_lease_hash(struct pico_dhcp_server_negotiation *n, int by)
+{
+    return (by == DHCPS_BY_XID) ? dhcps_xid_hash(n->xid) : dhcps_mac_hash(&n->hwaddr);
+}
+
+static struct pico_dhcp_server_negotiation **dhcps_lease_next(struct pico_dhcp_server_negotiation *n, int by)
+{
+    return (by == DHCPS_BY_XID) ? &n->next_xid : &n->next_mac;
+}
+
+static int dhcps_hash_grow(struct dhcps_hash *t, int by)
+{
+    uint32_t size = t->size ? (t->size << 1) : DHCPS_HASH_MIN;
+    struct pico_dhcp_server_negotiation **bucket, *n, *next;
+    uint32_t i, h;
+
+    bucket = PICO_ZALLOC(size * sizeof(struct pico_dhcp_server_negotiation *));
+    if (!bucket) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    for (i = 0; i < t->size; i++) {
+        for (n = t->bucket[i]; n; n = next) {
+            next = *dhcps_lease_next(n, by);
+            h = dhcps_lease_hash(n, by) & (size - 1);
+            *dhcps_lease_next(n, by) = bucket[h];
+            bucket[h] = n;
+        }
+    }
+    if (t->bucket)
+        PICO_FREE(t->bucket);
+
+    t->bucket = bucket;
+    t->size = size;
+    return 0;
+}
+
+static int dhcps_hash_insert(struct dhcps_hash *t, struct pico_dhcp_server_negotiation *n, int by)
+{
+    uint32_t h;
+
+    /* failing to grow only makes the chains longer */
+    if ((t->count >= t->size) && (dhcps_hash_grow(t, by) < 0) && !t->size)
+        return -1;
+
+    h = dhcps_lease_hash(n, by) & (t->size - 1);
+    *dhcps_lease_next(n, by) = t->bucket[h];
+    t->bucket[h] = n;
+    t->count++;
+    return 0;
+}
 
-    return (a->xid < b->xid) ? (-1) : (1);
+static void dhcps_hash_remove(struct dhcps_hash *t, struct pico_dhcp_server_negotiation *n, int by)
+{
+    struct pico_dhcp_server_negotiation **pp;
+
+    if (!t->size)
+        return;
+
+    pp = &t->bucket[dhcps_lease_hash(n, by) & (t->size - 1)];
+    while (*pp) {
+        if (*pp == n) {
+            *pp = *dhcps_lease_next(n, by);
+            t->count--;
+            return;
+        }
+
+        pp = dhcps_lease_next(*pp, by);
+    }
 }
-static PICO_TREE_DECLARE(DHCPNegotiations, dhcp_negotiations_cmp);
 
+static void dhcps_hash_release(struct dhcps_hash *t)
+{
+    if (t->count || !t->bucket)
+        return;
+
+    PICO_FREE(t->bucket);
+    t->bucket = NULL;
+    t->size = 0;
+}
 
 static inline void dhcps_set_default_pool_start_if_not_provided(struct pico_dhcp_server_setting *dhcps)
 {
@@ -101,26 +235,137 @@ static inline void dhcps_set_default_lease_time_if_not_provided(struct pico_dhcp
         dhcps->lease_time = DHCP_SERVER_LEASE_TIME;
 }
 
+/* Address pool: one bit per address from pool_start to pool_end */
+static inline uint32_t dhcps_pool_index(struct pico_dhcp_server_setting *dhcps, uint32_t addr)
+{
+    return long_be(addr) - long_be(dhcps->pool_start);
+}
+
+static inline uint32_t dhcps_pool_addr(struct pico_dhcp_server_setting *dhcps, uint32_t idx)
+{
+    return long_be(long_be(dhcps->pool_start) + idx);
+}
+
+static int dhcps_pool_is_free(struct pico_dhcp_server_setting *dhcps, uint32_t addr)
+{
+    uint32_t idx = dhcps_pool_index(dhcps, addr);
+
+    return (idx < dhcps->pool_size) && !(dhcps->pool_map[idx >> 5] & (1u << (idx & 31)));
+}
+
+static int dhcps_pool_take(struct pico_dhcp_server_setting *dhcps, uint32_t addr)
+{
+    uint32_t idx = dhcps_pool_index(dhcps, addr);
+
+    if (!dhcps_pool_is_free(dhcps, addr))
+        return -1;
+
+    dhcps->pool_map[idx >> 5] |= (1u << (idx & 31));
+    dhcps->pool_used++;
+    return 0;
+}
+
+static void dhcps_pool_release(struct pico_dhcp_server_setting *dhcps, uint32_t addr)
+{
+    uint32_t idx = dhcps_pool_index(dhcps, addr);
+
+    if ((idx >= dhcps->pool_size) || !(dhcps->pool_map[idx >> 5] & (1u << (idx & 31))))
+        return;
+
+    dhcps->pool_map[idx >> 5] &= ~(1u << (idx & 31));
+    dhcps->pool_used--;
+}
+
+/* Next fit from pool_next, so a released address is handed out again as
+ * late as possible. Returns 0 when the pool is exhausted. */
+static uint32_t dhcps_pool_alloc(struct pico_dhcp_server_setting *dhcps)
+{
+    uint32_t words = (dhcps->pool_size + 31) >> 5;
+    uint32_t start = dhcps_pool_index(dhcps, dhcps->pool_next);
+    uint32_t w, i, bit, idx;
+
+    if (dhcps->pool_used >= dhcps->pool_size)
+        return 0;
+
+    if (start >= dhcps->pool_size)
+        start = 0;
+
+    w = start >> 5;
+    for (i = 0; i <= words; i++) {
+        if (dhcps->pool_map[w] != 0xFFFFFFFFu) {
+            for (bit = (i == 0) ? (start & 31) : 0; bit < 32; bit++) {
+                if (!(dhcps->pool_map[w] & (1u << bit))) {
+                    idx = (w << 5) + bit;
+                    dhcps->pool_map[w] |= (1u << bit);
+                    dhcps->pool_used++;
+                    dhcps->pool_next = dhcps_pool_addr(dhcps, idx + 1);
+                    return dhcps_pool_addr(dhcps, idx);
+                }
+            }
+        }
+
+        if (++w == words)
+            w = 0;
+    }
+    return 0;
+}
+
+static int dhcps_pool_init(struct pico_dhcp_server_setting *dhcps)
+{
+    uint32_t words, net = dhcps->server_ip.addr & dhcps->netmask.addr;
+
+    if (long_be(dhcps->pool_end) < long_be(dhcps->pool_start)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    dhcps->pool_size = long_be(dhcps->pool_end) - long_be(dhcps->pool_start) + 1;
+    words = (dhcps->pool_size + 31) >> 5;
+    dhcps->pool_map = PICO_ZALLOC(words * sizeof(uint32_t));
+    if (!dhcps->pool_map) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    /* bits past the end of the pool are never free */
+    if (dhcps->pool_size & 31)
+        dhcps->pool_map[words - 1] = ~((1u << (dhcps->pool_size & 31)) - 1u);
+
+    dhcps->pool_used = 0;
+    dhcps_pool_take(dhcps, dhcps->server_ip.addr);
+    dhcps_pool_take(dhcps, net);
+    dhcps_pool_take(dhcps, net | ~dhcps->netmask.addr);
+    return 0;
+}
+
+static inline void dhcps_setting_free(struct pico_dhcp_server_setting *dhcps)
+{
+    if (dhcps->pool_map)
+        PICO_FREE(dhcps->pool_map);
+
+    PICO_FREE(dhcps);
+}
+
 static inline struct pico_dhcp_server_setting *dhcps_try_open_socket(struct pico_dhcp_server_setting *dhcps)
 {
     uint16_t port = PICO_DHCPD_PORT;
     dhcps->s = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_UDP, &pico_dhcpd_wakeup);
     if (!dhcps->s) {
         dhcps_dbg("DHCP server ERROR: failure opening socket (%s)\n", strerror(pico_err));
-        PICO_FREE(dhcps);
+        dhcps_setting_free(dhcps);
         return NULL;
     }
 
     if (pico_socket_bind(dhcps->s, &dhcps->server_ip, &port) < 0) {
         dhcps_dbg("DHCP server ERROR: failure binding socket (%s)\n", strerror(pico_err));
-        PICO_FREE(dhcps);
+        dhcps_setting_free(dhcps);
         return NULL;
     }
 
     if (pico_tree_insert(&DHCPSettings, dhcps)) {
-    	dhcps_dbg("DHCP server ERROR: could not insert settings in tree\n");
-		PICO_FREE(dhcps);
-		return NULL;
+        dhcps_dbg("DHCP server ERROR: could not insert settings in tree\n");
+        dhcps_setting_free(dhcps);
+        return NULL;
     }
 
     return dhcps;
@@ -166,47 +411,219 @@ static struct pico_dhcp_server_setting *pico_dhcp_server_add_setting(struct pico
     dhcps_set_default_pool_start_if_not_provided(dhcps);
 
     dhcps->pool_next = dhcps->pool_start;
+    if (dhcps_pool_init(dhcps) < 0) {
+        dhcps_setting_free(dhcps);
+        return NULL;
+    }
 
     return dhcps_try_open_socket(dhcps);
 
 }
 
-static struct pico_dhcp_server_negotiation *pico_dhcp_server_find_negotiation(uint32_t xid)
+static struct pico_dhcp_server_setting *dhcps_find_setting(struct pico_device *dev)
 {
-    struct pico_dhcp_server_negotiation test = {
+    struct pico_dhcp_server_setting test = {
         0
-    }, *found = NULL;
+    };
 
-    test.xid = xid;
-    found = pico_tree_findKey(&DHCPNegotiations, &test);
-    if (found)
-        return found;
-    else
+    test.dev = dev;
+    return pico_tree_findKey(&DHCPSettings, &test);
+}
+
+static struct pico_dhcp_server_negotiation *pico_dhcp_server_find_negotiation(uint32_t xid)
+{
+    struct pico_dhcp_server_negotiation *n;
+
+    if (!DHCPLeasesXid.size)
         return NULL;
+
+    n = DHCPLeasesXid.bucket[dhcps_xid_hash(xid) & (DHCPLeasesXid.size - 1)];
+    while (n && (n->xid != xid))
+        n = n->next_xid;
+    return n;
+}
+
+static struct pico_dhcp_server_negotiation *dhcps_find_lease(struct pico_dhcp_server_setting *dhcps, const uint8_t *hwaddr)
+{
+    struct pico_dhcp_server_negotiation *n;
+
+    if (!DHCPLeasesMac.size)
+        return NULL;
+
+    n = DHCPLeasesMac.bucket[dhcps_mac_hash((const struct pico_eth *)hwaddr) & (DHCPLeasesMac.size - 1)];
+    while (n && ((n->dhcps != dhcps) || memcmp(n->hwaddr.addr, hwaddr, PICO_SIZE_ETH)))
+        n = n->next_mac;
+    return n;
+}
+
+static void dhcps_heap_set(uint32_t i, struct pico_dhcp_server_negotiation *n)
+{
+    DHCPLeaseHeap[i] = n;
+    n->heap_index = i;
 }
 
-static inline void dhcp_negotiation_set_ciaddr(struct pico_dhcp_server_negotiation *dhcpn)
+static void dhcps_heap_up(uint32_t i)
 {
-    struct pico_ip4 *ciaddr = NULL;
-    ciaddr = pico_arp_reverse_lookup(&dhcpn->hwaddr);
-    if (!ciaddr) {
-        dhcpn->ciaddr.addr = dhcpn->dhcps->pool_next;
-        dhcpn->dhcps->pool_next = long_be(long_be(dhcpn->dhcps->pool_next) + 1);
-        pico_arp_create_entry(dhcpn->hwaddr.addr, dhcpn->ciaddr, dhcpn->dhcps->dev);
-    } else {
-        dhcpn->ciaddr = *ciaddr;
+    struct pico_dhcp_server_negotiation *n = DHCPLeaseHeap[i];
+
+    while ((i > 1) && (DHCPLeaseHeap[i >> 1]->expire > n->expire)) {
+        dhcps_heap_set(i, DHCPLeaseHeap[i >> 1]);
+        i >>= 1;
     }
+    dhcps_heap_set(i, n);
 }
 
-static struct pico_dhcp_server_negotiation *pico_dhcp_server_add_negotiation(struct pico_device *dev, struct pico_dhcp_hdr *hdr)
+static void dhcps_heap_down(uint32_t i)
 {
-    struct pico_dhcp_server_negotiation *dhcpn = NULL;
-    struct pico_dhcp_server_setting test = {
-        0
-    };
+    struct pico_dhcp_server_negotiation *n = DHCPLeaseHeap[i];
+    uint32_t child;
 
-    if (pico_dhcp_server_find_negotiation(hdr->xid))
-        return NULL;
+    while ((child = i << 1) <= dhcps_heap_len) {
+        if ((child < dhcps_heap_len) && (DHCPLeaseHeap[child + 1]->expire < DHCPLeaseHeap[child]->expire))
+            child++;
+
+        if (DHCPLeaseHeap[child]->expire >= n->expire)
+            break;
+
+        dhcps_heap_set(i, DHCPLeaseHeap[child]);
+        i = child;
+    }
+    dhcps_heap_set(i, n);
+}
+
+static int dhcps_heap_push(struct pico_dhcp_server_negotiation *n)
+{
+    struct pico_dhcp_server_negotiation **grown;
+    uint32_t size;
+
+    if (dhcps_heap_len + 1u >= dhcps_heap_size) {
+        size = dhcps_heap_size ? (dhcps_heap_size << 1) : DHCPS_HASH_MIN;
+        grown = PICO_ZALLOC(size * sizeof(struct pico_dhcp_server_negotiation *));
+        if (!grown) {
+            pico_err = PICO_ERR_ENOMEM;
+            return -1;
+        }
+
+        if (DHCPLeaseHeap) {
+            memcpy(grown, DHCPLeaseHeap, dhcps_heap_size * sizeof(struct pico_dhcp_server_negotiation *));
+            PICO_FREE(DHCPLeaseHeap);
+        }
+
+        DHCPLeaseHeap = grown;
+        dhcps_heap_size = size;
+    }
+
+    DHCPLeaseHeap[++dhcps_heap_len] = n;
+    dhcps_heap_up(dhcps_heap_len);
+    return 0;
+}
+
+static void dhcps_heap_remove(struct pico_dhcp_server_negotiation *n)
+{
+    uint32_t i = n->heap_index;
+
+    if (!i)
+        return;
+
+    n->heap_index = 0;
+    if (i == dhcps_heap_len) {
+        dhcps_heap_len--;
+        return;
+    }
+
+    dhcps_heap_set(i, DHCPLeaseHeap[dhcps_heap_len--]);
+    dhcps_heap_up(i);
+    dhcps_heap_down(DHCPLeaseHeap[i]->heap_index);
+}
+
+static void dhcps_lease_free(struct pico_dhcp_server_negotiation *dhcpn)
+{
+    dhcps_hash_remove(&DHCPLeasesMac, dhcpn, DHCPS_BY_MAC);
+    dhcps_hash_remove(&DHCPLeasesXid, dhcpn, DHCPS_BY_XID);
+    dhcps_heap_remove(dhcpn);
+    dhcps_pool_release(dhcpn->dhcps, dhcpn->ciaddr.addr);
+    PICO_FREE(dhcpn);
+}
+
+static void dhcps_expiry_tick(pico_time now, void *arg);
+
+/* The timer may fire early, it only has to be armed no later than the
+ * first expiry */
+static void dhcps_expiry_arm(void)
+{
+    pico_time now = PICO_TIME_MS(), due;
+
+    if (!dhcps_heap_len) {
+        if (dhcps_timer)
+            pico_timer_cancel(dhcps_timer);
+
+        dhcps_timer = 0;
+        return;
+    }
+
+    due = DHCPLeaseHeap[1]->expire;
+    if (dhcps_timer && (dhcps_timer_due <= due))
+        return;
+
+    if (dhcps_timer)
+        pico_timer_cancel(dhcps_timer);
+
+    dhcps_timer = pico_timer_add((due > now) ? (due - now) : 1u, dhcps_expiry_tick, NULL);
+    dhcps_timer_due = due;
+    if (!dhcps_timer)
+        dhcps_dbg("DHCP server ERROR: failed to start lease timer\n");
+}
+
+static void dhcps_expiry_tick(pico_time now, void *arg)
+{
+    struct pico_dhcp_server_negotiation *dhcpn;
+
+    IGNORE_PARAMETER(arg);
+    dhcps_timer = 0;
+    while (dhcps_heap_len && (DHCPLeaseHeap[1]->expire <= now)) {
+        dhcpn = DHCPLeaseHeap[1];
+        dhcps_dbg("DHCP server: lease of %08X expired\n", long_be(dhcpn->ciaddr.addr));
+        dhcps_lease_free(dhcpn);
+    }
+    dhcps_expiry_arm();
+}
+
+static int dhcps_lease_extend(struct pico_dhcp_server_negotiation *dhcpn, pico_time ms)
+{
+    pico_time expire = PICO_TIME_MS() + ms;
+
+    if (expire > dhcpn->expire)
+        dhcpn->expire = expire;
+
+    if (dhcpn->heap_index)
+        dhcps_heap_down(dhcpn->heap_index);
+    else if (dhcps_heap_push(dhcpn) < 0)
+        return -1;
+
+    dhcps_expiry_arm();
+    return 0;
+}
+
+static inline pico_time dhcps_lease_ms(struct pico_dhcp_server_setting *dhcps)
+{
+    return (pico_time)long_be(dhcps->lease_time) * 1000u;
+}
+
+static void dhcps_lease_set_xid(struct pico_dhcp_server_negotiation *dhcpn, uint32_t xid)
+{
+    if (dhcpn->xid == xid)
+        return;
+
+    dhcps_hash_remove(&DHCPLeasesXid, dhcpn, DHCPS_BY_XID);
+    dhcpn->xid = xid;
+    /* xid 0 is used by restored leases, lookups fall back on the MAC */
+    if (xid)
+        dhcps_hash_insert(&DHCPLeasesXid, dhcpn, DHCPS_BY_XID);
+}
+
+static struct pico_dhcp_server_negotiation *dhcps_lease_create(struct pico_dhcp_server_setting *dhcps, const uint8_t *hwaddr, uint32_t addr, pico_time ms)
+{
+    struct pico_dhcp_server_negotiation *dhcpn = NULL;
 
     dhcpn = PICO_ZALLOC(sizeof(struct pico_dhcp_server_negotiation));
     if (!dhcpn) {
@@ -214,25 +631,72 @@ static struct pico_dhcp_server_negotiation *pico_dhcp_server_add_negotiation(str
         return NULL;
     }
 
-    dhcpn->xid = hdr->xid;
+    dhcpn->dhcps = dhcps;
     dhcpn->state = PICO_DHCP_STATE_DISCOVER;
-    dhcpn->bcast = ((short_be(hdr->flags) & PICO_DHCP_FLAG_BROADCAST) != 0) ? (1) : (0);
-    memcpy(dhcpn->hwaddr.addr, hdr->hwaddr, PICO_SIZE_ETH);
+    memcpy(dhcpn->hwaddr.addr, hwaddr, PICO_SIZE_ETH);
 
-    test.dev = dev;
-    dhcpn->dhcps = pico_tree_findKey(&DHCPSettings, &test);
-    if (!dhcpn->dhcps) {
-        dhcps_dbg("DHCP server WARNING: received DHCP message on unconfigured link %s\n", dev->name);
+    /* a free requested address first, then the next one in the pool */
+    if (addr && (dhcps_pool_take(dhcps, addr) == 0))
+        dhcpn->ciaddr.addr = addr;
+    else
+        dhcpn->ciaddr.addr = dhcps_pool_alloc(dhcps);
+
+    if (!dhcpn->ciaddr.addr) {
+        dhcps_dbg("DHCP server WARNING: address pool exhausted\n");
         PICO_FREE(dhcpn);
+        pico_err = PICO_ERR_EAGAIN;
+        return NULL;
+    }
+
+    if ((dhcps_hash_insert(&DHCPLeasesMac, dhcpn, DHCPS_BY_MAC) < 0) || (dhcps_lease_extend(dhcpn, ms) < 0)) {
+        dhcps_lease_free(dhcpn);
+        return NULL;
+    }
+
+    return dhcpn;
+}
+
+static struct pico_dhcp_server_negotiation *pico_dhcp_server_add_negotiation(struct pico_device *dev, struct pico_dhcp_hdr *hdr, uint32_t reqip)
+{
+    struct pico_dhcp_server_negotiation *dhcpn = NULL;
+    struct pico_dhcp_server_setting *dhcps = NULL;
+
+    dhcps = dhcps_find_setting(dev);
+    if (!dhcps) {
+        dhcps_dbg("DHCP server WARNING: received DHCP message on unconfigured link %s\n", dev ? dev->name : "(null)");
         return NULL;
     }
 
-    dhcp_negotiation_set_ciaddr(dhcpn);
-    if (pico_tree_insert(&DHCPNegotiations, dhcpn)) {
-		dhcps_dbg("DHCP server ERROR: could not insert negotiations in tree\n");
-		PICO_FREE(dhcpn);
-		return NULL;
-	}
+    dhcpn = dhcps_lease_create(dhcps, hdr->hwaddr, reqip, PICO_DHCPD_OFFER_TIMEOUT);
+    if (!dhcpn)
+        return NULL;
+
+    dhcpn->bcast = ((short_be(hdr->flags) & PICO_DHCP_FLAG_BROADCAST) != 0) ? (1) : (0);
+    dhcps_lease_set_xid(dhcpn, hdr->xid);
+    pico_arp_create_entry(dhcpn->hwaddr.addr, dhcpn->ciaddr, dhcps->dev);
+    return dhcpn;
+}
+
+/* The lease of the client sending hdr, on the server of dev */
+static struct pico_dhcp_server_negotiation *dhcps_lookup(struct pico_device *dev, struct pico_dhcp_hdr *hdr)
+{
+    struct pico_dhcp_server_negotiation *dhcpn = pico_dhcp_server_find_negotiation(hdr->xid);
+    struct pico_dhcp_server_setting *dhcps = NULL;
+
+    if (dhcpn && (dhcpn->dhcps->dev == dev) && !memcmp(dhcpn->hwaddr.addr, hdr->hwaddr, PICO_SIZE_ETH))
+        return dhcpn;
+
+    dhcps = dhcps_find_setting(dev);
+    if (!dhcps)
+        return NULL;
+
+    /* known client, new transaction */
+    dhcpn = dhcps_find_lease(dhcps, hdr->hwaddr);
+    if (dhcpn) {
+        dhcpn->bcast = ((short_be(hdr->flags) & PICO_DHCP_FLAG_BROADCAST) != 0) ? (1) : (0);
+        dhcps_lease_set_xid(dhcpn, hdr->xid);
+        pico_arp_create_entry(dhcpn->hwaddr.addr, dhcpn->ciaddr, dhcps->dev);
+    }
 
     return dhcpn;
 }
@@ -316,11 +780,14 @@ static inline void parse_opt_serverid(struct pico_dhcp_opt *opt,  struct pico_ip
 
 static inline void dhcps_make_reply_to_request_msg(struct pico_dhcp_server_negotiation *dhcpn, int bound_valid_flag)
 {
-    if ((dhcpn->state == PICO_DHCP_STATE_BOUND) && bound_valid_flag)
+    if ((dhcpn->state == PICO_DHCP_STATE_BOUND) && bound_valid_flag) {
+        dhcps_lease_extend(dhcpn, dhcps_lease_ms(dhcpn->dhcps));
         dhcpd_make_reply(dhcpn, PICO_DHCP_MSG_ACK);
+    }
 
     if (dhcpn->state == PICO_DHCP_STATE_OFFER) {
         dhcpn->state = PICO_DHCP_STATE_BOUND;
+        dhcps_lease_extend(dhcpn, dhcps_lease_ms(dhcpn->dhcps));
         dhcpd_make_reply(dhcpn, PICO_DHCP_MSG_ACK);
     }
 }
@@ -328,6 +795,7 @@ static inline void dhcps_make_reply_to_request_msg(struct pico_dhcp_server_negot
 static inline void dhcps_make_reply_to_discover_or_request(struct pico_dhcp_server_negotiation *dhcpn,  uint8_t msgtype, int bound_valid_flag)
 {
     if (PICO_DHCP_MSG_DISCOVER == msgtype) {
+        dhcps_lease_extend(dhcpn, PICO_DHCPD_OFFER_TIMEOUT);
         dhcpd_make_reply(dhcpn, PICO_DHCP_MSG_OFFER);
         dhcpn->state = PICO_DHCP_STATE_OFFER;
     } else if (PICO_DHCP_MSG_REQUEST == msgtype) {
@@ -335,22 +803,15 @@ static inline void dhcps_make_reply_to_discover_or_request(struct pico_dhcp_serv
     }
 }
 
-static inline void dhcps_parse_options_loop(struct pico_dhcp_server_negotiation *dhcpn, struct pico_dhcp_hdr *hdr)
+static inline void dhcps_parse_options_loop(struct pico_dhcp_hdr *hdr, uint8_t *msgtype, struct pico_ip4 *reqip, struct pico_ip4 *server_id)
 {
     struct pico_dhcp_opt *opt = DHCP_OPT(hdr, 0);
-    uint8_t msgtype = 0;
-    struct pico_ip4 reqip = {
-        0
-    }, server_id = {
-        0
-    };
 
     do {
-        parse_opt_msgtype(opt, &msgtype);
-        parse_opt_reqip(opt, &reqip);
-        parse_opt_serverid(opt, &server_id);
+        parse_opt_msgtype(opt, msgtype);
+        parse_opt_reqip(opt, reqip);
+        parse_opt_serverid(opt, server_id);
     } while (pico_dhcp_next_option(&opt));
-    dhcps_make_reply_to_discover_or_request(dhcpn, msgtype, (!reqip.addr) && (!server_id.addr) && (hdr->ciaddr == dhcpn->ciaddr.addr));
 }
 
 static void pico_dhcp_server_recv(struct pico_socket *s, uint8_t *buf, uint32_t len)
@@ -359,20 +820,46 @@ static void pico_dhcp_server_recv(struct pico_socket *s, uint8_t *buf, uint32_t
     struct pico_dhcp_hdr *hdr = (struct pico_dhcp_hdr *)buf;
     struct pico_dhcp_server_negotiation *dhcpn = NULL;
     struct pico_device *dev = NULL;
+    uint8_t msgtype = 0;
+    struct pico_ip4 reqip = {
+        0
+    }, server_id = {
+        0
+    };
 
-    if (!pico_dhcp_are_options_valid(DHCP_OPT(hdr, 0), optlen))
+    if ((len < sizeof(struct pico_dhcp_hdr)) || !pico_dhcp_are_options_valid(DHCP_OPT(hdr, 0), optlen))
         return;
 
+    dhcps_parse_options_loop(hdr, &msgtype, &reqip, &server_id);
     dev = pico_ipv4_link_find(&s->local_addr.ip4);
-    dhcpn = pico_dhcp_server_find_negotiation(hdr->xid);
-    if (!dhcpn)
-        dhcpn = pico_dhcp_server_add_negotiation(dev, hdr);
+    dhcpn = dhcps_lookup(dev, hdr);
+    if (!dhcpn) {
+        /* only a DISCOVER gets a new lease */
+        if (msgtype != PICO_DHCP_MSG_DISCOVER)
+            return;
+
+        dhcpn = pico_dhcp_server_add_negotiation(dev, hdr, reqip.addr);
+        if (!dhcpn)
+            return;
+    }
 
     if (!ip_address_is_in_dhcp_range(dhcpn, dhcpn->ciaddr.addr))
         return;
 
-    dhcps_parse_options_loop(dhcpn, hdr);
+    if ((msgtype == PICO_DHCP_MSG_RELEASE) && (hdr->ciaddr == dhcpn->ciaddr.addr)) {
+        dhcps_dbg("DHCP server: %08X released\n", long_be(dhcpn->ciaddr.addr));
+        dhcps_lease_free(dhcpn);
+        return;
+    }
+
+    /* the client went with another server */
+    if ((msgtype == PICO_DHCP_MSG_REQUEST) && (dhcpn->state == PICO_DHCP_STATE_OFFER) &&
+        server_id.addr && (server_id.addr != dhcpn->dhcps->server_ip.addr)) {
+        dhcps_lease_free(dhcpn);
+        return;
+    }
 
+    dhcps_make_reply_to_discover_or_request(dhcpn, msgtype, (!reqip.addr) && (!server_id.addr) && (hdr->ciaddr == dhcpn->ciaddr.addr));
 }
 
 static void pico_dhcpd_wakeup(uint16_t ev, struct pico_socket *s)
@@ -408,19 +895,130 @@ int pico_dhcp_server_initiate(struct pico_dhcp_server_setting *setting)
 
 int pico_dhcp_server_destroy(struct pico_device *dev)
 {
-    struct pico_dhcp_server_setting *found, test = {
-        0
-    };
-    test.dev = dev;
-    found = pico_tree_findKey(&DHCPSettings, &test);
+    struct pico_dhcp_server_setting *found;
+    struct pico_dhcp_server_negotiation *n, *next;
+    uint32_t i;
+
+    found = dhcps_find_setting(dev);
     if (!found) {
         pico_err = PICO_ERR_ENOENT;
         return -1;
     }
 
+    for (i = 0; i < DHCPLeasesMac.size; i++) {
+        for (n = DHCPLeasesMac.bucket[i]; n; n = next) {
+            next = n->next_mac;
+            if (n->dhcps == found)
+                dhcps_lease_free(n);
+        }
+    }
+    dhcps_hash_release(&DHCPLeasesMac);
+    dhcps_hash_release(&DHCPLeasesXid);
+    if (!dhcps_heap_len && DHCPLeaseHeap) {
+        PICO_FREE(DHCPLeaseHeap);
+        DHCPLeaseHeap = NULL;
+        dhcps_heap_size = 0;
+    }
+
+    dhcps_expiry_arm();
+
     pico_tree_delete(&DHCPSettings, found);
-    PICO_FREE(found);
+    pico_socket_close(found->s);
+    dhcps_setting_free(found);
     return 0;
 }
 
+int pico_dhcp_server_leases_save(struct pico_device *dev, void *buf, uint32_t len)
+{
+    struct pico_dhcp_server_setting *dhcps = dhcps_find_setting(dev);
+    struct dhcps_snapshot_hdr *hdr = (struct dhcps_snapshot_hdr *)buf;
+    struct dhcps_snapshot_lease *rec;
+    struct pico_dhcp_server_negotiation *n;
+    pico_time now = PICO_TIME_MS();
+    uint32_t i, count = 0;
+
+    if (!dhcps) {
+        pico_err = PICO_ERR_ENOENT;
+        return -1;
+    }
+
+    for (i = 0; i < DHCPLeasesMac.size; i++) {
+        for (n = DHCPLeasesMac.bucket[i]; n; n = n->next_mac) {
+            if ((n->dhcps != dhcps) || (n->state != PICO_DHCP_STATE_BOUND) || (n->expire <= now))
+                continue;
+
+            if (buf) {
+                if (len < sizeof(struct dhcps_snapshot_hdr) + (count + 1) * sizeof(struct dhcps_snapshot_lease)) {
+                    pico_err = PICO_ERR_ENOMEM;
+                    return -1;
+                }
+
+                rec = (struct dhcps_snapshot_lease *)(hdr + 1) + count;
+                memcpy(rec->hwaddr, n->hwaddr.addr, PICO_SIZE_ETH);
+                rec->reserved = 0;
+                rec->addr = n->ciaddr.addr;
+                rec->remaining = long_be((uint32_t)((n->expire - now) / 1000u));
+            }
+
+            count++;
+        }
+    }
+
+    if (buf) {
+        if (len < sizeof(struct dhcps_snapshot_hdr)) {
+            pico_err = PICO_ERR_ENOMEM;
+            return -1;
+        }
+
+        hdr->magic = long_be(DHCPS_SNAPSHOT_MAGIC);
+        hdr->count = long_be(count);
+    }
+
+    return (int)(sizeof(struct dhcps_snapshot_hdr) + count * sizeof(struct dhcps_snapshot_lease));
+}
+
+int pico_dhcp_server_leases_restore(struct pico_device *dev, const void *buf, uint32_t len)
+{
+    struct pico_dhcp_server_setting *dhcps = dhcps_find_setting(dev);
+    const struct dhcps_snapshot_hdr *hdr = (const struct dhcps_snapshot_hdr *)buf;
+    const struct dhcps_snapshot_lease *rec;
+    struct pico_dhcp_server_negotiation *n;
+    struct pico_ip4 addr;
+    uint32_t i, count, restored = 0;
+
+    if (!dhcps) {
+        pico_err = PICO_ERR_ENOENT;
+        return -1;
+    }
+
+    if (!buf || (len < sizeof(struct dhcps_snapshot_hdr)) || (long_be(hdr->magic) != DHCPS_SNAPSHOT_MAGIC)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    count = long_be(hdr->count);
+    if (count > (len - sizeof(struct dhcps_snapshot_hdr)) / sizeof(struct dhcps_snapshot_lease)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    rec = (const struct dhcps_snapshot_lease *)(hdr + 1);
+    for (i = 0; i < count; i++, rec++) {
+        addr.addr = rec->addr;
+        /* leases handed out since the restart win */
+        if (!rec->remaining || dhcps_find_lease(dhcps, rec->hwaddr) || !dhcps_pool_is_free(dhcps, addr.addr))
+            continue;
+
+        n = dhcps_lease_create(dhcps, rec->hwaddr, addr.addr, (pico_time)long_be(rec->remaining) * 1000u);
+        if (!n)
+            continue;
+
+        n->state = PICO_DHCP_STATE_BOUND;
+        pico_arp_create_entry(n->hwaddr.addr, n->ciaddr, dhcps->dev);
+        restored++;
+    }
+
+    return (int)restored;
+}
+
 #endif /* PICO_SUPPORT_DHCP */
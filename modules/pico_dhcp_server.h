@@ -22,6 +22,10 @@ struct pico_dhcp_server_setting
     struct pico_ip4 server_ip;
     struct pico_ip4 netmask;
     uint8_t flags; /* unused atm */
+    /* address pool bitmap, managed by the server */
+    uint32_t *pool_map;
+    uint32_t pool_size;
+    uint32_t pool_used;
 };
 
 /* required field: IP address of the interface to serve, only IPs of this network will be served. */
@@ -30,5 +34,14 @@ int pico_dhcp_server_initiate(struct pico_dhcp_server_setting *dhcps);
 /* To destroy an existing DHCP server configuration, running on a given interface */
 int pico_dhcp_server_destroy(struct pico_device *dev);
 
+/* Snapshot of the bound leases of the server on dev, to be kept across a
+ * restart (e.g. in a memory mapped file or a flash sector). Returns the
+ * number of bytes written, or the number of bytes needed if buf is NULL. */
+int pico_dhcp_server_leases_save(struct pico_device *dev, void *buf, uint32_t len);
+
+/* Loads a snapshot made by pico_dhcp_server_leases_save into a running
+ * server. Returns the number of leases restored. */
+int pico_dhcp_server_leases_restore(struct pico_device *dev, const void *buf, uint32_t len);
+
 #endif /* _INCLUDE_PICO_DHCP_SERVER */
 #endif
@@ -32,6 +32,16 @@
 #define PICO_DNS_CLIENT_RETRANS 4000
 #define PICO_DNS_CLIENT_MAX_RETRANS 3
 
+/* Resolver cache entries */
+#ifndef PICO_DNS_CACHE_MAX
+#define PICO_DNS_CACHE_MAX 32
+#endif
+
+/* Upper bound on the lifetime of a cached answer (sec) */
+#ifndef PICO_DNS_CACHE_MAX_TTL
+#define PICO_DNS_CACHE_MAX_TTL 3600
+#endif
+
 static void pico_dns_client_callback(uint16_t ev, struct pico_socket *s);
 static void pico_dns_client_retransmission(pico_time now, void *arg);
 static int pico_dns_client_getaddr_init(const char *url, uint16_t proto, void (*callback)(char *, void *), void *arg);
@@ -48,18 +58,28 @@ static int dns_ns_cmp(void *ka, void *kb)
 }
 static PICO_TREE_DECLARE(NSTable, dns_ns_cmp);
 
+/* Lookup that joined a query already in flight */
+struct pico_dns_waiter
+{
+    void (*callback)(char *, void *);
+    void *arg;
+    struct pico_dns_waiter *next;
+};
+
 struct pico_dns_query
 {
     char *query;
+    char *name; /* as looked up, the cache key */
     uint16_t len;
     uint16_t id;
     uint16_t qtype;
     uint16_t qclass;
-    uint8_t retrans;
+    uint8_t retrans; /* 0 once answered */
     struct pico_dns_ns q_ns;
     struct pico_socket *s;
     void (*callback)(char *, void *);
     void *arg;
+    struct pico_dns_waiter *waiters;
 };
 
 static int dns_query_cmp(void *ka, void *kb)
@@ -72,6 +92,252 @@ static int dns_query_cmp(void *ka, void *kb)
 }
 static PICO_TREE_DECLARE(DNSTable, dns_query_cmp);
 
+/* Resolver cache, keyed on (qtype, name). answer is NULL for negative
+ * entries (RFC 2308). Each entry expires on its own timer, the least
+ * recently used one makes room when the cache is full. */
+struct pico_dns_cache
+{
+    const char *name;
+    char *answer;
+    uint16_t qtype;
+    uint32_t timer;
+    struct pico_dns_cache *lru_prev, *lru_next;
+};
+
+static int dns_cache_cmp(void *ka, void *kb)
+{
+    struct pico_dns_cache *a = ka, *b = kb;
+    if (a->qtype != b->qtype)
+        return (a->qtype < b->qtype) ? (-1) : (1);
+
+    return strcasecmp(a->name, b->name);
+}
+static PICO_TREE_DECLARE(DNSCache, dns_cache_cmp);
+
+static struct pico_dns_cache *dns_cache_head, *dns_cache_tail; /* most recently used first */
+static uint16_t dns_cache_count;
+
+static void pico_dns_cache_unlink(struct pico_dns_cache *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        dns_cache_head = e->lru_next;
+
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        dns_cache_tail = e->lru_prev;
+
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+}
+
+static void pico_dns_cache_push(struct pico_dns_cache *e)
+{
+    e->lru_next = dns_cache_head;
+    if (dns_cache_head)
+        dns_cache_head->lru_prev = e;
+    else
+        dns_cache_tail = e;
+
+    dns_cache_head = e;
+}
+
+static void pico_dns_cache_del(struct pico_dns_cache *e)
+{
+    if (e->timer)
+        pico_timer_cancel(e->timer);
+
+    pico_dns_cache_unlink(e);
+    pico_tree_delete(&DNSCache, e);
+    dns_cache_count--;
+    PICO_FREE(e);
+}
+
+static void pico_dns_cache_expire(pico_time now, void *arg)
+{
+    struct pico_dns_cache *e = (struct pico_dns_cache *)arg;
+    IGNORE_PARAMETER(now);
+    e->timer = 0;
+    pico_dns_cache_del(e);
+}
+
+static struct pico_dns_cache *pico_dns_cache_find(const char *name, uint16_t qtype)
+{
+    struct pico_dns_cache test = {
+        0
+    }, *e = NULL;
+
+    test.name = name;
+    test.qtype = qtype;
+    e = pico_tree_findKey(&DNSCache, &test);
+    if (e && (e != dns_cache_head)) {
+        pico_dns_cache_unlink(e);
+        pico_dns_cache_push(e);
+    }
+
+    return e;
+}
+
+static void pico_dns_cache_add(const char *name, uint16_t qtype, const char *answer, uint32_t ttl)
+{
+    struct pico_dns_cache *e = NULL;
+    uint16_t namelen = (uint16_t)(strlen(name) + 1);
+    uint16_t anslen = (uint16_t)(answer ? (strlen(answer) + 1) : 0);
+
+    if (ttl == 0)
+        return;
+
+    if (ttl > PICO_DNS_CACHE_MAX_TTL)
+        ttl = PICO_DNS_CACHE_MAX_TTL;
+
+    e = pico_dns_cache_find(name, qtype);
+    if (e)
+        pico_dns_cache_del(e);
+    else if (dns_cache_count >= PICO_DNS_CACHE_MAX)
+        pico_dns_cache_del(dns_cache_tail);
+
+    e = PICO_ZALLOC(sizeof(struct pico_dns_cache) + namelen + anslen);
+    if (!e)
+        return;
+
+    memcpy((char *)e + sizeof(struct pico_dns_cache), name, namelen);
+    e->name = (char *)e + sizeof(struct pico_dns_cache);
+    if (answer) {
+        e->answer = (char *)e + sizeof(struct pico_dns_cache) + namelen;
+        memcpy(e->answer, answer, anslen);
+    }
+
+    e->qtype = qtype;
+    e->timer = pico_timer_add((pico_time)ttl * 1000u, pico_dns_cache_expire, e);
+    if (!e->timer) {
+        dns_dbg("DNS: Failed to start cache timer\n");
+        PICO_FREE(e);
+        return;
+    }
+
+    if (pico_tree_insert(&DNSCache, e)) {
+        pico_timer_cancel(e->timer);
+        PICO_FREE(e);
+        return;
+    }
+
+    dns_cache_count++;
+    pico_dns_cache_push(e);
+}
+
+void pico_dns_client_cache_flush(void)
+{
+    while (dns_cache_head)
+        pico_dns_cache_del(dns_cache_head);
+}
+
+/* Answers from the cache are delivered from a timer, like the others */
+struct pico_dns_cache_hit
+{
+    void (*callback)(char *, void *);
+    void *arg;
+    char *answer;
+};
+
+static void pico_dns_cache_hit_deliver(pico_time now, void *arg)
+{
+    struct pico_dns_cache_hit *hit = (struct pico_dns_cache_hit *)arg;
+    IGNORE_PARAMETER(now);
+    if (!hit->answer)
+        pico_err = PICO_ERR_ENOENT;
+
+    hit->callback(hit->answer, hit->arg);
+    PICO_FREE(hit);
+}
+
+static int pico_dns_cache_hit(struct pico_dns_cache *e, void (*callback)(char *, void *), void *arg)
+{
+    struct pico_dns_cache_hit *hit = NULL;
+    uint16_t anslen = (uint16_t)(e->answer ? (strlen(e->answer) + 1) : 0);
+
+    hit = PICO_ZALLOC(sizeof(struct pico_dns_cache_hit) + anslen);
+    if (!hit) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    hit->callback = callback;
+    hit->arg = arg;
+    if (e->answer) {
+        hit->answer = (char *)hit + sizeof(struct pico_dns_cache_hit);
+        memcpy(hit->answer, e->answer, anslen);
+    }
+
+    if (!pico_timer_add(0, pico_dns_cache_hit_deliver, hit)) {
+        PICO_FREE(hit);
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct pico_dns_query *pico_dns_client_find_pending(const char *name, uint16_t qtype)
+{
+    struct pico_tree_node *node = NULL;
+    struct pico_dns_query *q = NULL;
+
+    pico_tree_foreach(node, &DNSTable) {
+        q = node->keyValue;
+        if (q->retrans && (q->qtype == qtype) && (strcasecmp(q->name, name) == 0))
+            return q;
+    }
+    return NULL;
+}
+
+/* Returns 1 if the lookup is answered from the cache or joins a query in
+ * flight, 0 if a query has to be sent, -1 on error. */
+static int pico_dns_client_lookup(const char *name, uint16_t qtype, void (*callback)(char *, void *), void *arg)
+{
+    struct pico_dns_cache *e = pico_dns_cache_find(name, qtype);
+    struct pico_dns_query *q = NULL;
+    struct pico_dns_waiter *w = NULL;
+
+    if (e)
+        return (pico_dns_cache_hit(e, callback, arg) < 0) ? (-1) : (1);
+
+    q = pico_dns_client_find_pending(name, qtype);
+    if (!q)
+        return 0;
+
+    w = PICO_ZALLOC(sizeof(struct pico_dns_waiter));
+    if (!w) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    w->callback = callback;
+    w->arg = arg;
+    w->next = q->waiters;
+    q->waiters = w;
+    return 1;
+}
+
+/* Delivers the answer, or NULL and err, to everybody waiting on q */
+static void pico_dns_client_notify(struct pico_dns_query *q, char *str, int err)
+{
+    struct pico_dns_waiter *w = NULL;
+
+    /* answered: later lookups don't join it anymore */
+    q->retrans = 0;
+    if (!str)
+        pico_err = err;
+
+    q->callback(str, q->arg);
+    for (w = q->waiters; w; w = w->next) {
+        if (!str)
+            pico_err = err;
+
+        w->callback(str, w->arg);
+    }
+}
+
 static int pico_dns_client_del_ns(struct pico_ip4 *ns_addr)
 {
     struct pico_dns_ns test = {{0}}, *found = NULL;
@@ -150,14 +416,17 @@ static struct pico_dns_ns pico_dns_client_next_ns(struct pico_ip4 *ns_addr)
 }
 
 static struct pico_dns_query *pico_dns_client_add_query(struct pico_dns_header *hdr, uint16_t len, struct pico_dns_question_suffix *suffix,
-                                                        void (*callback)(char *, void *), void *arg)
+                                                        const char *name, void (*callback)(char *, void *), void *arg)
 {
     struct pico_dns_query *q = NULL, *found = NULL;
+    uint16_t namelen = (uint16_t)(strlen(name) + 1);
 
-    q = PICO_ZALLOC(sizeof(struct pico_dns_query));
+    q = PICO_ZALLOC(sizeof(struct pico_dns_query) + namelen);
     if (!q)
         return NULL;
 
+    q->name = (char *)q + sizeof(struct pico_dns_query);
+    memcpy(q->name, name, namelen);
     q->query = (char *)hdr;
     q->len = len;
     q->id = short_be(hdr->id);
@@ -196,6 +465,11 @@ static int pico_dns_client_del_query(uint16_t id)
     if (!found)
         return -1;
 
+    while (found->waiters) {
+        struct pico_dns_waiter *w = found->waiters;
+        found->waiters = w->next;
+        PICO_FREE(w);
+    }
     PICO_FREE(found->query);
     pico_socket_close(found->s);
     pico_tree_delete(&DNSTable, found);
@@ -271,6 +545,72 @@ static int pico_dns_client_check_header(struct pico_dns_header *pre)
     return 0;
 }
 
+/* NXDOMAIN, or NODATA: no error but no answer either (RFC 2308) */
+static int pico_dns_client_is_negative(struct pico_dns_header *pre)
+{
+    if (pre->qr != PICO_DNS_QR_RESPONSE || pre->opcode != PICO_DNS_OPCODE_QUERY)
+        return 0;
+
+    if (pre->rcode == PICO_DNS_RCODE_ENAME)
+        return 1;
+
+    return (pre->rcode == PICO_DNS_RCODE_NO_ERROR) && (short_be(pre->ancount) == 0);
+}
+
+static char *pico_dns_client_skip_name(char *ptr, char *end)
+{
+    while (ptr < end) {
+        if ((*ptr & 0xC0) == 0xC0)
+            return ((ptr + 2) <= end) ? (ptr + 2) : (NULL);
+
+        if (*ptr == 0)
+            return ptr + 1;
+
+        ptr += (uint8_t)*ptr + 1;
+    }
+    return NULL;
+}
+
+/* Negative TTL: the SOA minimum, capped by the TTL of the SOA record itself.
+ * 0 when the authority section holds no SOA, the answer isn't cached then. */
+static uint32_t pico_dns_client_negative_ttl(struct pico_dns_header *pre, uint16_t len)
+{
+    struct pico_dns_record_suffix *rsuffix = NULL;
+    char *end = (char *)pre + len;
+    char *ptr = (char *)pre + sizeof(struct pico_dns_header);
+    uint16_t ancount = short_be(pre->ancount);
+    uint16_t count = (uint16_t)(ancount + short_be(pre->nscount));
+    uint16_t i = 0, rdlength = 0;
+    uint32_t ttl = 0, minimum = 0;
+
+    ptr = pico_dns_client_skip_name(ptr, end);
+    if (!ptr)
+        return 0;
+
+    ptr += sizeof(struct pico_dns_question_suffix);
+    for (i = 0; i < count; i++) {
+        ptr = pico_dns_client_skip_name(ptr, end);
+        if (!ptr || (ptr + sizeof(struct pico_dns_record_suffix)) > end)
+            return 0;
+
+        rsuffix = (struct pico_dns_record_suffix *)ptr;
+        rdlength = short_be(rsuffix->rdlength);
+        ptr += sizeof(struct pico_dns_record_suffix);
+        if ((ptr + rdlength) > end)
+            return 0;
+
+        /* MINIMUM is the last field of the SOA rdata */
+        if ((i >= ancount) && (short_be(rsuffix->rtype) == PICO_DNS_TYPE_SOA) && (rdlength >= 22)) {
+            ttl = long_be(rsuffix->rttl);
+            minimum = long_be(long_from(ptr + rdlength - 4));
+            return (minimum < ttl) ? (minimum) : (ttl);
+        }
+
+        ptr += rdlength;
+    }
+    return 0;
+}
+
 static int pico_dns_client_check_qsuffix(struct pico_dns_question_suffix *suf, struct pico_dns_query *q)
 {
     if (!suf)
@@ -414,8 +754,7 @@ static void pico_dns_client_retransmission(pico_time now, void *arg)
         q->q_ns = pico_dns_client_next_ns(&q->q_ns.ns);
         pico_dns_client_send(q);
     } else {
-        pico_err = PICO_ERR_EIO;
-        q->callback(NULL, q->arg);
+        pico_dns_client_notify(q, NULL, PICO_ERR_EIO);
         pico_dns_client_del_query(q->id);
     }
 }
@@ -488,8 +827,10 @@ static int pico_dns_client_user_callback(struct pico_dns_record_suffix *asuffix,
     }
 
     if (q->retrans) {
-        q->callback(str, q->arg);
-        q->retrans = 0;
+        if (str)
+            pico_dns_cache_add(q->name, q->qtype, str, long_be(asuffix->rttl));
+
+        pico_dns_client_notify(q, str, PICO_ERR_NOERR);
         pico_dns_client_del_query(q->id);
     }
 
@@ -512,6 +853,7 @@ static void pico_dns_try_fallback_cname(struct pico_dns_query *q, struct pico_dn
     char *cname_orig = NULL;
     char *cname = NULL;
     uint16_t cname_len;
+    struct pico_dns_waiter *w = NULL;
 
     /* Try to use CNAME only if A or AAAA query is ongoing */
     if (type != PICO_DNS_TYPE_A && type != PICO_DNS_TYPE_AAAA)
@@ -542,7 +884,10 @@ static void pico_dns_try_fallback_cname(struct pico_dns_query *q, struct pico_dn
         cname++;
 
     dns_dbg("Restarting query for name '%s'\n", cname);
+    q->retrans = 0;
     pico_dns_client_getaddr_init(cname, proto, q->callback, q->arg);
+    for (w = q->waiters; w; w = w->next)
+        pico_dns_client_getaddr_init(cname, proto, w->callback, w->arg);
     PICO_FREE(cname_orig);
     pico_dns_client_del_query(q->id);
 }
@@ -555,6 +900,7 @@ static void pico_dns_client_callback(uint16_t ev, struct pico_socket *s)
     struct pico_dns_record_suffix *asuffix = NULL;
     struct pico_dns_query *q = NULL;
     char *p_asuffix = NULL;
+    int len = 0;
 
     if (ev == PICO_SOCK_EV_ERR) {
         dns_dbg("DNS: socket error received\n");
@@ -562,7 +908,8 @@ static void pico_dns_client_callback(uint16_t ev, struct pico_socket *s)
     }
 
     if (ev & PICO_SOCK_EV_RD) {
-        if (pico_socket_read(s, dns_response, PICO_IP_MRU) < 0)
+        len = pico_socket_read(s, dns_response, PICO_IP_MRU);
+        if (len < 0)
             return;
     }
 
@@ -571,13 +918,24 @@ static void pico_dns_client_callback(uint16_t ev, struct pico_socket *s)
     qsuffix = (struct pico_dns_question_suffix *)pico_dns_client_seek(domain);
     /* valid asuffix is determined dynamically later on */
 
-    if (pico_dns_client_check_header(header) < 0)
-        return;
-
     q = pico_dns_client_find_query(short_be(header->id));
     if (!q)
         return;
 
+    if (pico_dns_client_is_negative(header)) {
+        if ((pico_dns_client_check_qsuffix(qsuffix, q) < 0) || (pico_dns_client_check_url(header, q) < 0))
+            return;
+
+        dns_dbg("DNS: no such name or no data (RCODE %d)\n", header->rcode);
+        pico_dns_cache_add(q->name, q->qtype, NULL, pico_dns_client_negative_ttl(header, (uint16_t)len));
+        pico_dns_client_notify(q, NULL, PICO_ERR_ENOENT);
+        pico_dns_client_del_query(q->id);
+        return;
+    }
+
+    if (pico_dns_client_check_header(header) < 0)
+        return;
+
     if (pico_dns_client_check_qsuffix(qsuffix, q) < 0)
         return;
 
@@ -710,22 +1068,29 @@ static int pico_dns_client_getaddr_init(const char *url, uint16_t proto, void (*
     struct pico_dns_question_suffix *qsuffix = NULL;
     struct pico_dns_query *q = NULL;
     uint16_t len = 0, lblen = 0;
-    (void)proto;
+    uint16_t qtype = PICO_DNS_TYPE_A;
+    int ret = 0;
 
     if (pico_dns_client_getaddr_check(url, callback) < 0)
         return -1;
 
+#ifdef PICO_SUPPORT_IPV6
+    if (proto == PICO_PROTO_IPV6)
+        qtype = PICO_DNS_TYPE_AAAA;
+#else
+    IGNORE_PARAMETER(proto);
+#endif
+
+    ret = pico_dns_client_lookup(url, qtype, callback, arg);
+    if (ret != 0)
+        return (ret < 0) ? (-1) : (0);
+
     if(pico_dns_create_message(&header, &qsuffix, PICO_DNS_NO_ARPA, url, &lblen, &len) != 0)
         return -1;
 
-#ifdef PICO_SUPPORT_IPV6
-    if (proto == PICO_PROTO_IPV6) {
-        pico_dns_question_fill_suffix(qsuffix, PICO_DNS_TYPE_AAAA, PICO_DNS_CLASS_IN);
-    } else
-#endif
-    pico_dns_question_fill_suffix(qsuffix, PICO_DNS_TYPE_A, PICO_DNS_CLASS_IN);
+    pico_dns_question_fill_suffix(qsuffix, qtype, PICO_DNS_CLASS_IN);
 
-    q = pico_dns_client_add_query(header, len, qsuffix, callback, arg);
+    q = pico_dns_client_add_query(header, len, qsuffix, url, callback, arg);
     if (!q) {
         PICO_FREE(header);
         return -1;
@@ -755,17 +1120,22 @@ static int pico_dns_getname_univ(const char *ip, void (*callback)(char *, void *
     struct pico_dns_question_suffix *qsuffix = NULL;
     struct pico_dns_query *q = NULL;
     uint16_t len = 0, lblen = 0;
+    int ret = 0;
 
     if (!ip || !callback) {
         pico_err = PICO_ERR_EINVAL;
         return -1;
     }
 
+    ret = pico_dns_client_lookup(ip, PICO_DNS_TYPE_PTR, callback, arg);
+    if (ret != 0)
+        return (ret < 0) ? (-1) : (0);
+
     if(pico_dns_create_message(&header, &qsuffix, arpa, ip, &lblen, &len) != 0)
         return -1;
 
     pico_dns_question_fill_suffix(qsuffix, PICO_DNS_TYPE_PTR, PICO_DNS_CLASS_IN);
-    q = pico_dns_client_add_query(header, len, qsuffix, callback, arg);
+    q = pico_dns_client_add_query(header, len, qsuffix, ip, callback, arg);
     if (!q) {
         PICO_FREE(header);
         return -1;
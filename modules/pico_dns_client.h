@@ -42,6 +42,8 @@ int pico_dns_client_init(void);
 int pico_dns_client_nameserver(struct pico_ip4 *ns, uint8_t flag);
 int pico_dns_client_getaddr(const char *url, void (*callback)(char *ip, void *arg), void *arg);
 int pico_dns_client_getname(const char *ip, void (*callback)(char *url, void *arg), void *arg);
+/* Forget all cached answers, e.g. after changing nameservers */
+void pico_dns_client_cache_flush(void);
 #ifdef PICO_SUPPORT_IPV6
 int pico_dns_client_getaddr6(const char *url, void (*callback)(char *, void *), void *arg);
 int pico_dns_client_getname6(const char *url, void (*callback)(char *, void *), void *arg);
@@ -462,6 +462,223 @@ pico_dns_ipv6_set_ptr( const char *ip, char *dst )
 #endif
 
 /* MARK: ^ NAME & IP FUNCTIONS */
+/* MARK: v NAME COMPRESSION */
+
+/* Labels remembered for name compression while a packet is built */
+#ifndef PICO_DNS_COMPRESS_MAX
+#define PICO_DNS_COMPRESS_MAX (256)
+#endif
+
+/* Buckets, power of two */
+#define PICO_DNS_COMPRESS_HASH (64)
+#define PICO_DNS_COMPRESS_LABELS (128)
+
+/* ****************************************************************************
+ *  Dictionary of the names already in a packet. Every label written is an
+ *  entry keyed on (label, entry of the rest of the name), so the longest
+ *  suffix of a name that can be pointed to is found with one lookup per
+ *  label, starting from the root.
+ * ****************************************************************************/
+struct pico_dns_compress_entry
+{
+    uint16_t offset; /* of the label in the packet */
+    uint16_t parent; /* entry of the rest of the name, 0 for the root */
+    uint16_t next;   /* hash chain */
+};
+
+struct pico_dns_compress
+{
+    uint8_t *packet;
+    uint16_t count;
+    uint16_t bucket[PICO_DNS_COMPRESS_HASH];
+    struct pico_dns_compress_entry entry[PICO_DNS_COMPRESS_MAX + 1]; /* 0 unused */
+};
+
+static uint16_t
+pico_dns_compress_hash( uint16_t parent, const uint8_t *label )
+{
+    uint32_t h = 2166136261u ^ parent;
+    uint16_t i = 0;
+
+    for (i = 0; i <= label[0]; i++)
+        h = (h ^ label[i]) * 16777619u;
+
+    return (uint16_t)((h ^ (h >> 16)) & (PICO_DNS_COMPRESS_HASH - 1));
+}
+
+static uint16_t
+pico_dns_compress_find( struct pico_dns_compress *c,
+                        uint16_t parent,
+                        const uint8_t *label )
+{
+    uint16_t e = c->bucket[pico_dns_compress_hash(parent, label)];
+
+    while (e) {
+        if ((c->entry[e].parent == parent) &&
+            (memcmp(c->packet + c->entry[e].offset, label,
+                    (size_t)label[0] + 1u) == 0))
+            return e;
+
+        e = c->entry[e].next;
+    }
+    return 0;
+}
+
+/* label must be in the packet already */
+static uint16_t
+pico_dns_compress_insert( struct pico_dns_compress *c,
+                          uint16_t parent,
+                          const uint8_t *label )
+{
+    uint16_t e = 0, h = 0;
+
+    /* Compression pointers are 14 bits */
+    if ((c->count >= PICO_DNS_COMPRESS_MAX) || (label - c->packet) > 0x3FFF)
+        return 0;
+
+    e = ++c->count;
+    h = pico_dns_compress_hash(parent, label);
+    c->entry[e].offset = (uint16_t)(label - c->packet);
+    c->entry[e].parent = parent;
+    c->entry[e].next = c->bucket[h];
+    c->bucket[h] = e;
+    return e;
+}
+
+/* ****************************************************************************
+ *  Splits an uncompressed name in labels.
+ *
+ *  @return Number of labels, -1 if the name holds a compression pointer or is
+ *			longer than maxlen.
+ * ****************************************************************************/
+static int
+pico_dns_compress_labels( const uint8_t *name,
+                          const uint8_t **label,
+                          uint16_t maxlen )
+{
+    const uint8_t *iterator = name;
+    int n = 0;
+
+    while (*iterator) {
+        if ((*iterator & 0xC0) || (n >= PICO_DNS_COMPRESS_LABELS))
+            return -1;
+
+        label[n++] = iterator;
+        iterator = iterator + *iterator + 1;
+        if ((iterator - name) >= maxlen)
+            return -1;
+    }
+    return n;
+}
+
+/* ****************************************************************************
+ *  Remembers the suffixes of a name that is in the packet but that is not
+ *  compressed itself, like the rdata of a PTR record.
+ * ****************************************************************************/
+static void
+pico_dns_compress_add( struct pico_dns_compress *c,
+                       const uint8_t *name,
+                       uint16_t maxlen )
+{
+    const uint8_t *label[PICO_DNS_COMPRESS_LABELS];
+    uint16_t parent = 0, e = 0;
+    int n = pico_dns_compress_labels(name, label, maxlen);
+
+    while (n-- > 0) {
+        e = pico_dns_compress_find(c, parent, label[n]);
+        if (!e && !(e = pico_dns_compress_insert(c, parent, label[n])))
+            return;
+
+        parent = e;
+    }
+}
+
+/* ****************************************************************************
+ *  Writes a name to dest, its longest suffix already in the packet replaced
+ *  by a compression pointer, and adds the labels written to the dictionary.
+ *  Without dictionary the name is copied as is. name may overlap dest, as long
+ *  as it doesn't start before it.
+ *
+ *  @return Pointer right after the name written.
+ * ****************************************************************************/
+static uint8_t *
+pico_dns_compress_name( struct pico_dns_compress *c,
+                        uint8_t *dest,
+                        uint8_t *name )
+{
+    const uint8_t *label[PICO_DNS_COMPRESS_LABELS];
+    uint16_t parent = 0, e = 0, len = 0;
+    int n = -1, i = 0, j = 0;
+
+    if (c)
+        n = pico_dns_compress_labels(name, label, PICO_DNS_NAMEBUF_SIZE);
+
+    if (n < 0) {
+        len = (uint16_t)(pico_dns_namelen_comp((char *)name) + 1u);
+        memmove(dest, name, len);
+        return dest + len;
+    }
+
+    /* Longest suffix already known */
+    for (i = n; i > 0; i--) {
+        if (!(e = pico_dns_compress_find(c, parent, label[i - 1])))
+            break;
+
+        parent = e;
+    }
+
+    /* Labels in front of it are written out */
+    for (j = 0; j < i; j++) {
+        len = (uint16_t)(label[j][0] + 1u);
+        memmove(dest, label[j], len);
+        label[j] = dest;
+        dest += len;
+    }
+
+    if (parent) {
+        *dest++ = (uint8_t)(0xC0u | (c->entry[parent].offset >> 8));
+        *dest++ = (uint8_t)(c->entry[parent].offset & 0xFFu);
+    } else {
+        *dest++ = 0;
+    }
+
+    while (i-- > 0) {
+        if (!(parent = pico_dns_compress_insert(c, parent, label[i])))
+            break;
+    }
+    return dest;
+}
+
+/* ****************************************************************************
+ *  Writes a resource record to dest, compressing its name. Name, suffix and
+ *  rdata may lie in the same buffer after dest.
+ *
+ *  @return Pointer right after the record written.
+ * ****************************************************************************/
+static uint8_t *
+pico_dns_compress_rr( struct pico_dns_compress *c,
+                      uint8_t *dest,
+                      uint8_t *name,
+                      const struct pico_dns_record_suffix *rsuffix,
+                      const uint8_t *rdata )
+{
+    uint16_t rdlength = short_be(rsuffix->rdlength);
+    uint16_t rtype = short_be(rsuffix->rtype);
+
+    dest = pico_dns_compress_name(c, dest, name);
+    memmove(dest, rsuffix, sizeof(struct pico_dns_record_suffix));
+    dest += sizeof(struct pico_dns_record_suffix);
+    memmove(dest, rdata, rdlength);
+
+    /* Names in rdata can be pointed to by what follows */
+    if (c && rdlength && (dest[rdlength - 1] == 0) &&
+        ((rtype == PICO_DNS_TYPE_PTR) || (rtype == PICO_DNS_TYPE_CNAME)))
+        pico_dns_compress_add(c, dest, rdlength);
+
+    return dest + rdlength;
+}
+
+/* MARK: ^ NAME COMPRESSION */
 /* MARK: v QUESTION FUNCTIONS */
 
 /* ****************************************************************************
@@ -669,44 +886,24 @@ pico_dns_question_decompress( struct pico_dns_question *question,
  *  @param destination Pointer-pointer to flat memory buffer to copy DNS record
  *					   to. When function returns, this will point to location
  *					   right after the flat copied DNS Resource Record.
+ *  @param c           Name compression dictionary of the packet, or NULL to
+ *					   copy the name as is.
  *  @return Returns 0 on success, something else on failure.
  * ****************************************************************************/
 static int
 pico_dns_record_copy_flat( struct pico_dns_record *record,
-                           uint8_t **destination )
+                           uint8_t **destination,
+                           struct pico_dns_compress *c )
 {
-    char *dest_rname = NULL; /* rname destination location */
-    struct pico_dns_record_suffix *dest_rsuffix = NULL; /* rsuffix destin. */
-    uint8_t *dest_rdata = NULL; /* rdata destination location */
-
     /* Check if there are no NULL-pointers given */
     if (!record || !destination || !(*destination)) {
         pico_err = PICO_ERR_EINVAL;
         return -1;
     }
 
-    /* Initialise the destination pointers to the right locations */
-    dest_rname = (char *) *destination;
-    dest_rsuffix = (struct pico_dns_record_suffix *)
-                   (dest_rname + record->rname_length);
-    dest_rdata = ((uint8_t *)dest_rsuffix +
-                  sizeof(struct pico_dns_record_suffix));
-
-    /* Copy the rname of the resource record into the flat location */
-    strcpy(dest_rname, record->rname);
-
-    /* Copy the question suffix fields */
-    dest_rsuffix->rtype = record->rsuffix->rtype;
-    dest_rsuffix->rclass = record->rsuffix->rclass;
-    dest_rsuffix->rttl = record->rsuffix->rttl;
-    dest_rsuffix->rdlength = record->rsuffix->rdlength;
-
-    /* Copy the rdata of the resource */
-    memcpy(dest_rdata, record->rdata, short_be(dest_rsuffix->rdlength));
-
-    /* Point to location right after flat resource record */
-    *destination = (uint8_t *)(dest_rdata +
-                               short_be(record->rsuffix->rdlength));
+    *destination = pico_dns_compress_rr(c, *destination,
+                                        (uint8_t *)record->rname,
+                                        record->rsuffix, record->rdata);
     return 0;
 }
 
@@ -1343,18 +1540,20 @@ pico_dns_fill_packet_header( struct pico_dns_header *hdr,
  *  @param rtree Tree that contains the DNS resource records.
  *  @param dest  Pointer-pointer to location where you want to insert records.
  *				 Will point to location after current section on return.
+ *  @param c     Name compression dictionary, or NULL.
  *  @return 0 on success, something else on failure.
  * ****************************************************************************/
 static int
 pico_dns_fill_packet_rr_section( struct pico_tree *rtree,
-                                 uint8_t **dest )
+                                 uint8_t **dest,
+                                 struct pico_dns_compress *c )
 {
     struct pico_tree_node *node = NULL;
     struct pico_dns_record *record = NULL;
 
     pico_tree_foreach(node, rtree) {
         record = node->keyValue;
-        if ((record) && pico_dns_record_copy_flat(record, dest)) {
+        if ((record) && pico_dns_record_copy_flat(record, dest, c)) {
             dns_dbg("Could not copy record into Answer Section!\n");
             return -1;
         }
@@ -1366,43 +1565,37 @@ pico_dns_fill_packet_rr_section( struct pico_tree *rtree,
  *  Fills the resource record sections of a DNS packet with provided record-
  *  trees.
  *
- *  @param packet Packet you want to fill
- *  @param qtree  Question tree to determine where the rrsections begin.
  *  @param antree DNS records to put in Answer section
  *  @param nstree DNS records to put in Authority section
  *  @param artree DNS records to put in Additional section
+ *  @param dest   Pointer-pointer to the end of the Question section. Will
+ *				  point to the end of the packet on return.
+ *  @param c      Name compression dictionary, or NULL.
  *  @return 0 on success, something else on failure.
  * ****************************************************************************/
 static int
-pico_dns_fill_packet_rr_sections( pico_dns_packet *packet,
-                                  struct pico_tree *qtree,
-                                  struct pico_tree *antree,
+pico_dns_fill_packet_rr_sections( struct pico_tree *antree,
                                   struct pico_tree *nstree,
-                                  struct pico_tree *artree )
+                                  struct pico_tree *artree,
+                                  uint8_t **dest,
+                                  struct pico_dns_compress *c )
 {
     int anret = 0, nsret = 0, arret = 0;
-    uint16_t temp = 0;
-    uint8_t *destination = NULL;
 
     /* Check params */
-    if (!packet || !qtree || !antree || !nstree || !artree) {
+    if (!dest || !(*dest) || !antree || !nstree || !artree) {
         pico_err = PICO_ERR_EINVAL;
         return -1;
     }
 
-    /* Initialise the destination pointers before iterating */
-    destination = (uint8_t *)packet + sizeof(struct pico_dns_header);
-    pico_tree_size(qtree, &temp, &pico_dns_question_size);
-    destination = destination + temp;
-
     /* Iterate over ANSWERS */
-    anret = pico_dns_fill_packet_rr_section(antree, &destination);
+    anret = pico_dns_fill_packet_rr_section(antree, dest, c);
 
     /* Iterate over AUTHORITIES */
-    nsret = pico_dns_fill_packet_rr_section(nstree, &destination);
+    nsret = pico_dns_fill_packet_rr_section(nstree, dest, c);
 
     /* Iterate over ADDITIONALS */
-    arret = pico_dns_fill_packet_rr_section(artree, &destination);
+    arret = pico_dns_fill_packet_rr_section(artree, dest, c);
 
     if (anret || nsret || arret)
         return -1;
@@ -1414,201 +1607,125 @@ pico_dns_fill_packet_rr_sections( pico_dns_packet *packet,
  *  Fills the question section of a DNS packet with provided questions in the
  *  tree.
  *
- *  @param packet Packet you want to fill
- *  @param qtree  Question tree with question you want to insert
+ *  @param qtree Question tree with question you want to insert
+ *  @param dest  Pointer-pointer to the start of the Question section. Will
+ *				 point to the end of it on return.
+ *  @param c     Name compression dictionary, or NULL.
  *  @return 0 on success, something else on failure.
  * ****************************************************************************/
 static int
-pico_dns_fill_packet_question_section( pico_dns_packet *packet,
-                                       struct pico_tree *qtree )
+pico_dns_fill_packet_question_section( struct pico_tree *qtree,
+                                       uint8_t **dest,
+                                       struct pico_dns_compress *c )
 {
     struct pico_tree_node *node = NULL;
     struct pico_dns_question *question = NULL;
     struct pico_dns_question_suffix *dest_qsuffix = NULL;
-    char *dest_qname = NULL;
 
     /* Check params */
-    if (!packet || !qtree) {
+    if (!dest || !(*dest) || !qtree) {
         pico_err = PICO_ERR_EINVAL;
         return -1;
     }
 
-    /* Initialise pointer */
-    dest_qname = (char *)((char *)packet + sizeof(struct pico_dns_header));
-
     pico_tree_foreach(node, qtree) {
         question = node->keyValue;
         if (question) {
             /* Copy the name */
-            memcpy(dest_qname, question->qname, question->qname_length);
+            dest_qsuffix = (struct pico_dns_question_suffix *)
+                           pico_dns_compress_name(c, *dest,
+                                                  (uint8_t *)question->qname);
 
             /* Copy the suffix */
-            dest_qsuffix = (struct pico_dns_question_suffix *)
-                           (dest_qname + question->qname_length);
             dest_qsuffix->qtype = question->qsuffix->qtype;
             dest_qsuffix->qclass = question->qsuffix->qclass;
 
             /* Move to next question */
-            dest_qname = (char *)((char *)dest_qsuffix +
-                                  sizeof(struct pico_dns_question_suffix));
+            *dest = (uint8_t *)dest_qsuffix +
+                    sizeof(struct pico_dns_question_suffix);
         }
     }
     return 0;
 }
 
 /* ****************************************************************************
- *  Looks for a name somewhere else in packet, more specifically between the
- *  beginning of the data buffer and the name itself.
- * ****************************************************************************/
-static uint8_t *
-pico_dns_packet_compress_find_ptr( uint8_t *name,
-                                   uint8_t *data,
-                                   uint16_t len )
-{
-    uint8_t *iterator = NULL;
-
-    /* Check params */
-    if (!name || !data || !len)
-        return NULL;
-
-    if ((name < data) || (name > (data + len)))
-        return NULL;
-
-    iterator = data;
-
-    /* Iterate from the beginning of data up until the name-ptr */
-    while (iterator < name) {
-        /* Compare in each iteration of current name is equal to a section of
-           the DNS packet and if so return the pointer to that section */
-        if (memcmp((void *)iterator++, (void *)name,
-                   pico_dns_strlen((char *)name) + 1u) == 0)
-            return (iterator - 1);
-    }
-    return NULL;
-}
-
-/* ****************************************************************************
- *  Compresses a single name by looking for the same name somewhere else in the
- *  packet-buffer.
+ *  Length of a name in a received packet, the zero-byte or the compression
+ *  pointer included.
+ *
+ *  @return 0 if the name runs past end or holds a reserved label type.
  * ****************************************************************************/
-static int
-pico_dns_packet_compress_name( uint8_t *name,
-                               uint8_t *packet,
-                               uint16_t *len)
+static uint16_t
+pico_dns_compress_namelen( const uint8_t *name, const uint8_t *end )
 {
-    uint8_t *lbl_iterator = NULL;    /* To iterate over labels */
-    uint8_t *compression_ptr = NULL; /* PTR to somewhere else in the packet */
-    uint8_t *offset = NULL;          /* PTR after compression pointer */
-    uint8_t *ptr_after_str = NULL;
-    uint8_t *last_byte = NULL;
-    uint8_t *i = NULL;
-    uint16_t ptr = 0;
-    uint16_t difference = 0;
+    const uint8_t *iterator = name;
 
-    /* Check params */
-    if (!name || !packet || !len) {
-        pico_err = PICO_ERR_EINVAL;
-        return -1;
-    }
+    while ((iterator < end) && ((iterator - name) < PICO_DNS_NAMEBUF_SIZE)) {
+        if (*iterator == 0)
+            return (uint16_t)(iterator - name + 1);
 
-    if ((name < packet) || (name > (packet + *len))) {
-        dns_dbg("Name ptr OOB. name: %p max: %p\n", name, packet + *len);
-        pico_err = PICO_ERR_EINVAL;
-        return -1;
-    }
+        if ((*iterator & 0xC0) == 0xC0)
+            return (uint16_t)(((iterator + 1) < end) ? (iterator - name + 2) : 0);
 
-    /* Try to compress name */
-    lbl_iterator = name;
-    while (lbl_iterator != '\0') {
-        /* Try to find a compression pointer with current name */
-        compression_ptr = pico_dns_packet_compress_find_ptr(lbl_iterator,
-                                                            packet + 12, *len);
-        /* If name can be compressed */
-        if (compression_ptr) {
-            /* Point to place after current string */
-            ptr_after_str = lbl_iterator + strlen((char *)lbl_iterator) + 1u;
-
-            /* Calculate the compression pointer value */
-            ptr = (uint16_t)(compression_ptr - packet);
-
-            /* Set the compression pointer in the packet */
-            *lbl_iterator = (uint8_t)(0xC0 | (uint8_t)(ptr >> 8));
-            *(lbl_iterator + 1) = (uint8_t)(ptr & 0xFF);
-
-            /* Move up the rest of the packet data to right after the pointer */
-            offset = lbl_iterator + 2;
-
-            /* Move up left over data */
-            difference = (uint16_t)(ptr_after_str - offset);
-            last_byte = packet + *len;
-            for (i = ptr_after_str; i < last_byte; i++) {
-                *((uint8_t *)(i - difference)) = *i;
-            }
-            /* Update length */
-            *len = (uint16_t)(*len - difference);
-            break;
-        }
+        if (*iterator & 0xC0)
+            return 0;
 
-        /* Move to next length label */
-        lbl_iterator = lbl_iterator + *(lbl_iterator) + 1;
+        iterator = iterator + *iterator + 1;
     }
     return 0;
 }
 
 /* ****************************************************************************
- *  Utility function compress a record section
+ *  Checks that every question and record of a packet lies within end.
  * ****************************************************************************/
 static int
-pico_dns_compress_record_sections( uint16_t qdcount, uint16_t count,
-                                   uint8_t *buf, uint8_t **iterator,
-                                   uint16_t *len )
+pico_dns_compress_check( uint8_t *src, const uint8_t *end,
+                         uint16_t qdcount, uint16_t rcount )
 {
     struct pico_dns_record_suffix *rsuffix = NULL;
-    uint8_t *_iterator = NULL;
-    uint16_t i = 0;
+    uint16_t namelen = 0, i = 0;
 
-    /* Check params */
-    if (!iterator || !(*iterator) || !buf || !len) {
-        pico_err = PICO_ERR_EINVAL;
-        return -1;
-    }
+    for (i = 0; i < qdcount; i++) {
+        if (!(namelen = pico_dns_compress_namelen(src, end)) ||
+            ((end - src) < (namelen + (int)sizeof(struct pico_dns_question_suffix))))
+            return -1;
 
-    _iterator = *iterator;
+        src = src + namelen + sizeof(struct pico_dns_question_suffix);
+    }
 
-    for (i = 0; i < count; i++) {
-        if (qdcount || i)
-            pico_dns_packet_compress_name(_iterator, buf, len);
+    for (i = 0; i < rcount; i++) {
+        if (!(namelen = pico_dns_compress_namelen(src, end)) ||
+            ((end - src) < (namelen + (int)sizeof(struct pico_dns_record_suffix))))
+            return -1;
 
-        /* To get rdlength */
-        rsuffix = (struct pico_dns_record_suffix *)
-                  (_iterator + pico_dns_namelen_comp((char *)_iterator) + 1u);
+        rsuffix = (struct pico_dns_record_suffix *)(src + namelen);
+        src = (uint8_t *)rsuffix + sizeof(struct pico_dns_record_suffix);
+        if ((end - src) < short_be(rsuffix->rdlength))
+            return -1;
 
-        /* Move to next res record */
-        _iterator = ((uint8_t *)rsuffix +
-                     sizeof(struct pico_dns_record_suffix) +
-                     short_be(rsuffix->rdlength));
+        src = src + short_be(rsuffix->rdlength);
     }
-    *iterator = _iterator;
     return 0;
 }
 
 /* ****************************************************************************
- *  Applies DNS name compression to an entire DNS packet
+ *  Applies DNS name compression to an entire DNS packet, in a single pass
  * ****************************************************************************/
-static int
+int
 pico_dns_packet_compress( pico_dns_packet *packet, uint16_t *len )
 {
-    uint8_t *packet_buf = NULL;
-    uint8_t *iterator = NULL;
+    struct pico_dns_compress *c = NULL;
+    struct pico_dns_record_suffix *rsuffix = NULL;
+    uint8_t *src = NULL, *dest = NULL, *next = NULL, *end = NULL;
     uint16_t qdcount = 0, rcount = 0, i = 0;
 
     /* Check params */
-    if (!packet || !len) {
+    if (!packet || !len || (*len < sizeof(struct pico_dns_header))) {
         pico_err = PICO_ERR_EINVAL;
         return -1;
     }
 
-    packet_buf = (uint8_t *)packet;
+    end = (uint8_t *)packet + *len;
+    src = dest = (uint8_t *)packet + sizeof(struct pico_dns_header);
 
     /* Temporarily store the question & record counts */
     qdcount = short_be(packet->qdcount);
@@ -1616,23 +1733,44 @@ pico_dns_packet_compress( pico_dns_packet *packet, uint16_t *len )
     rcount = (uint16_t)(rcount + short_be(packet->nscount));
     rcount = (uint16_t)(rcount + short_be(packet->arcount));
 
-    /* Move past the DNS packet header */
-    iterator = (uint8_t *)((uint8_t *) packet + 12u);
+    /* Nothing is read below before it's known to be in the packet */
+    if (pico_dns_compress_check(src, end, qdcount, rcount)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    if (!(c = PICO_ZALLOC(sizeof(struct pico_dns_compress)))) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
 
-    /* Start with the questions */
+    c->packet = (uint8_t *)packet;
+
+    /* Names only get shorter, so everything moves down in place */
     for (i = 0; i < qdcount; i++) {
-        if(i) { /* First question can't be compressed */
-            pico_dns_packet_compress_name(iterator, packet_buf, len);
-        }
+        next = src + pico_dns_namelen_comp((char *)src) + 1u;
+        dest = pico_dns_compress_name(c, dest, src);
+        memmove(dest, next, sizeof(struct pico_dns_question_suffix));
+        dest += sizeof(struct pico_dns_question_suffix);
+        src = next + sizeof(struct pico_dns_question_suffix);
+    }
 
-        /* Move to next question */
-        iterator = (uint8_t *)(iterator +
-                               pico_dns_namelen_comp((char *)iterator) +
-                               sizeof(struct pico_dns_question_suffix) + 1u);
+    for (i = 0; i < rcount; i++) {
+        rsuffix = (struct pico_dns_record_suffix *)
+                  (src + pico_dns_namelen_comp((char *)src) + 1u);
+        next = (uint8_t *)rsuffix + sizeof(struct pico_dns_record_suffix) +
+               short_be(rsuffix->rdlength);
+        dest = pico_dns_compress_rr(c, dest, src, rsuffix,
+                                    (uint8_t *)rsuffix +
+                                    sizeof(struct pico_dns_record_suffix));
+        src = next;
     }
-    /* Then onto the answers */
-    pico_dns_compress_record_sections(qdcount, rcount, packet_buf, &iterator,
-                                      len);
+
+    if (src < end)
+        memmove(dest, src, (size_t)(end - src));
+
+    *len = (uint16_t)(*len - (src - dest));
+    PICO_FREE(c);
     return 0;
 }
 
@@ -1698,6 +1836,8 @@ pico_dns_packet_create( struct pico_tree *qtree,
     PICO_DNS_RTREE_DECLARE(_nstree);
     PICO_DNS_RTREE_DECLARE(_artree);
     pico_dns_packet *packet = NULL;
+    struct pico_dns_compress *c = NULL;
+    uint8_t *dest = NULL;
     uint8_t qdcount = 0, ancount = 0, nscount = 0, arcount = 0;
 
     /* Set default vector, if arguments are NULL-pointers */
@@ -1710,32 +1850,43 @@ pico_dns_packet_create( struct pico_tree *qtree,
     *len = pico_dns_packet_len(&_qtree, &_antree, &_nstree, &_artree,
                                &qdcount, &ancount, &nscount, &arcount);
 
-    /* Provide space for the entire packet */
+    /* Provide space for the entire packet, before compression */
     if (!(packet = PICO_ZALLOC(*len))) {
         pico_err = PICO_ERR_ENOMEM;
         return NULL;
     }
 
+    /* Names are compressed while they are written. Without a dictionary,
+     * the packet just isn't compressed. */
+    if ((c = PICO_ZALLOC(sizeof(struct pico_dns_compress))))
+        c->packet = (uint8_t *)packet;
+
+    dest = (uint8_t *)packet + sizeof(struct pico_dns_header);
+
     /* Fill the Question Section with questions */
     if (qtree && pico_tree_count(&_qtree) != 0) {
-        if (pico_dns_fill_packet_question_section(packet, &_qtree)) {
+        if (pico_dns_fill_packet_question_section(&_qtree, &dest, c)) {
             dns_dbg("Could not fill Question Section correctly!\n");
+            PICO_FREE(c);
             PICO_FREE(packet);
             return NULL;
         }
     }
 
     /* Fill the Resource Record Sections with resource records */
-    if (pico_dns_fill_packet_rr_sections(packet, &_qtree, &_antree,
-                                         &_nstree, &_artree)) {
+    if (pico_dns_fill_packet_rr_sections(&_antree, &_nstree, &_artree,
+                                         &dest, c)) {
         dns_dbg("Could not fill Resource Record Sections correctly!\n");
+        PICO_FREE(c);
         PICO_FREE(packet);
         return NULL;
     }
 
-    /* Fill the DNS packet header and try to compress */
+    PICO_FREE(c);
+
+    /* Fill the DNS packet header */
     pico_dns_fill_packet_header(packet, qdcount, ancount, nscount, arcount);
-    pico_dns_packet_compress(packet, len);
+    *len = (uint16_t)(dest - (uint8_t *)packet);
 
     return packet;
 }
@@ -15,6 +15,7 @@
 /* TYPE values */
 #define PICO_DNS_TYPE_A 1
 #define PICO_DNS_TYPE_CNAME 5
+#define PICO_DNS_TYPE_SOA 6
 #define PICO_DNS_TYPE_PTR 12
 #define PICO_DNS_TYPE_TXT 16
 #define PICO_DNS_TYPE_AAAA 28
@@ -489,6 +490,19 @@ pico_dns_fill_packet_header( struct pico_dns_header *hdr,
                              uint16_t authcount,
                              uint16_t addcount );
 
+/* ****************************************************************************
+ *  Applies DNS name compression in place to a packet with uncompressed names.
+ *  Packets from pico_dns_query_create and pico_dns_answer_create are
+ *  compressed already.
+ *
+ *  @param packet Packet to compress
+ *  @param len    Length of the packet, updated to the compressed length
+ *  @return 0 on success, something else on failure. A packet with a name,
+ *			suffix or rdata running past len is left untouched.
+ * ****************************************************************************/
+int
+pico_dns_packet_compress( pico_dns_packet *packet, uint16_t *len );
+
 /* ****************************************************************************
  *  Creates a DNS Query packet with given question and resource records to put
  *  the Resource Record Sections. If a NULL-pointer is provided for a certain
@@ -262,7 +262,9 @@ static struct pico_eth *pico_ethernet_mcast6_translate(struct pico_frame *f, uin
 }
 #endif
 
-static int pico_ethernet_ipv6_dst(struct pico_frame *f, struct pico_eth *const dstmac)
+/* Resolves the IPv6 destination: a neighbour entry with its prebuilt
+ * header, or a multicast/local address in dstmac. */
+static int pico_ethernet_ipv6_dst(struct pico_frame *f, struct pico_eth *const dstmac, struct pico_neighbor **nb)
 {
     int retval = -1;
     if (!dstmac)
@@ -277,16 +279,19 @@ static int pico_ethernet_ipv6_dst(struct pico_frame *f, struct pico_eth *const d
         memcpy(dstmac, pico_mcast6_mac, PICO_SIZE_ETH);
         retval = 0;
     } else {
-        struct pico_eth *neighbor = pico_ipv6_get_neighbor(f);
-        if (neighbor)
-        {
-            memcpy(dstmac, neighbor, PICO_SIZE_ETH);
+        struct pico_eth *local = NULL;
+        *nb = pico_ipv6_nd_resolve(f, &local);
+        if (*nb) {
+            retval = 0;
+        } else if (local) {
+            memcpy(dstmac, local, PICO_SIZE_ETH);
             retval = 0;
         }
     }
 
     #else
     (void)f;
+    (void)nb;
     pico_err = PICO_ERR_EPROTONOSUPPORT;
     #endif
     return retval;
@@ -359,13 +364,14 @@ int32_t MOCKABLE pico_ethernet_send(struct pico_frame *f)
     struct pico_eth dstmac;
     uint8_t dstmac_valid = 0;
     uint16_t proto = PICO_IDETH_IPV4;
+    struct pico_neighbor *nb = NULL;
 
 #ifdef PICO_SUPPORT_IPV6
     /* Step 1: If the frame has an IPv6 packet,
      * destination address is taken from the ND tables
      */
     if (IS_IPV6(f)) {
-        if (pico_ethernet_ipv6_dst(f, &dstmac) < 0)
+        if (pico_ethernet_ipv6_dst(f, &dstmac, &nb) < 0)
         {
             /* Enqueue copy of frame in IPv6 ND-module to retry later. Discard
              * frame, otherwise we have a duplicate in IPv6-ND */
@@ -398,10 +404,12 @@ int32_t MOCKABLE pico_ethernet_send(struct pico_frame *f)
 
 #if (defined PICO_SUPPORT_IPV4)
     else {
-        struct pico_eth *arp_get;
-        arp_get = pico_arp_get(f);
-        if (arp_get) {
-            memcpy(&dstmac, arp_get, PICO_SIZE_ETH);
+        struct pico_eth *local = NULL;
+        nb = pico_arp_resolve(f, &local);
+        if (nb || local) {
+            if (local)
+                memcpy(&dstmac, local, PICO_SIZE_ETH);
+
             dstmac_valid = 1;
         } else {
             /* Enqueue copy of frame in ARP-module to retry later. Discard
@@ -423,9 +431,14 @@ int32_t MOCKABLE pico_ethernet_send(struct pico_frame *f)
                 f->len += PICO_SIZE_ETHHDR;
                 f->datalink_hdr = f->start;
                 hdr = (struct pico_eth_hdr *) f->datalink_hdr;
-                memcpy(hdr->saddr, f->dev->eth->mac.addr, PICO_SIZE_ETH);
-                memcpy(hdr->daddr, &dstmac, PICO_SIZE_ETH);
-                hdr->proto = proto;
+                if (nb) {
+                    /* resolved neighbour: header prebuilt on the entry */
+                    memcpy(hdr, nb->l2hdr, PICO_SIZE_ETHHDR);
+                } else {
+                    memcpy(hdr->saddr, f->dev->eth->mac.addr, PICO_SIZE_ETH);
+                    memcpy(hdr->daddr, &dstmac, PICO_SIZE_ETH);
+                    hdr->proto = proto;
+                }
             }
 
             if (pico_ethsend_local(f, hdr) || pico_ethsend_bcast(f) || pico_ethsend_dispatch(f)) {
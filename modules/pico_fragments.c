@@ -53,308 +53,446 @@
 #define IP4_FRAG_ID(hdr)        (0)
 #endif
 
+#if (defined(PICO_SUPPORT_IPV4) && defined(PICO_SUPPORT_IPV4FRAG)) || \
+    (defined(PICO_SUPPORT_IPV6) && defined(PICO_SUPPORT_IPV6FRAG))
+#define FRAG_REASSEMBLY
+#endif
+
 #define PICO_IPV6_FRAG_TIMEOUT   60000
 #define PICO_IPV4_FRAG_TIMEOUT   15000
 
+/* Memory used by all datagrams under reassembly. When a datagram needs more,
+ * the oldest other datagrams are dropped to make room. */
+#ifndef PICO_FRAG_MEM_MAX
+#define PICO_FRAG_MEM_MAX        (128 * 1024)
+#endif
+
+/* Holes a single datagram may have before it is dropped */
+#ifndef PICO_FRAG_MAX_RANGES
+#define PICO_FRAG_MAX_RANGES     (64)
+#endif
+
+#ifdef FRAG_REASSEMBLY
+
+/* Received payload bytes [start, end), sorted and never adjacent */
+struct pico_frag_range {
+    uint32_t start;
+    uint32_t end;
+    struct pico_frag_range *next;
+};
+
+/* A datagram under reassembly. Fragments are copied into 'full' as they
+ * arrive: the buffer grows until the last fragment tells the total length,
+ * which is then allocated at once. */
+struct pico_frag_dgram {
+    /* key */
+    uint8_t net;
+    uint8_t proto;
+    uint32_t id;
+    union pico_address src;
+    union pico_address dst;
+
+    uint8_t has_first;      /* offset 0 received, header is the one of the first fragment */
+    uint8_t has_last;       /* total is known */
+    uint16_t nranges;
+    uint32_t total;         /* payload length */
+    uint32_t size;          /* payload bytes the buffer holds */
+    uint32_t mem;           /* bytes charged to the memory cap */
+    uint32_t seq;           /* creation order, for eviction */
+    uint32_t timer;
+    struct pico_frame *full;
+    struct pico_frag_range *ranges;
+};
+
+static uint32_t pico_frag_mem = 0u;
+static uint32_t pico_frag_seq = 0u;
+
 static void pico_frag_expire(pico_time now, void *arg);
-static void pico_fragments_complete(unsigned int bookmark, uint8_t proto, uint8_t net);
-static int pico_fragments_check_complete(struct pico_tree *tree, uint8_t proto, uint8_t net);
-static int pico_fragments_reassemble(struct pico_tree *tree, unsigned int len, uint8_t proto, uint8_t net);
-static int pico_fragments_get_more_flag(struct pico_frame *frame, uint8_t net);
-static uint32_t pico_fragments_get_offset(struct pico_frame *frame, uint8_t net);
-static void pico_fragments_send_notify(struct pico_frame *first);
+static void pico_fragments_send_notify(struct pico_frag_dgram *dg);
 static uint16_t pico_fragments_get_header_length(uint8_t net);
-static void pico_fragments_empty_tree(struct pico_tree *tree);
-
-#if defined(PICO_SUPPORT_IPV6) && defined(PICO_SUPPORT_IPV6FRAG)
-static uint32_t ipv6_cur_frag_id = 0u;
-static uint32_t ipv6_fragments_timer = 0u;
 
-static int pico_ipv6_frag_compare(void *ka, void *kb)
+static int pico_frag_dgram_cmp(void *ka, void *kb)
 {
-    struct pico_frame *a = ka, *b = kb;
-    if (IP6_FRAG_OFF(a->frag) > IP6_FRAG_OFF(b->frag))
-        return 1;
+    struct pico_frag_dgram *a = ka, *b = kb;
+    int ret;
 
-    if (IP6_FRAG_OFF(a->frag) < IP6_FRAG_OFF(b->frag))
-        return -1;
+    if (a->net != b->net)
+        return (a->net < b->net) ? -1 : 1;
 
-    return 0;
-}
-static PICO_TREE_DECLARE(ipv6_fragments, pico_ipv6_frag_compare);
+    if (a->id != b->id)
+        return (a->id < b->id) ? -1 : 1;
 
-static void pico_ipv6_fragments_complete(unsigned int len, uint8_t proto)
-{
-    if (pico_fragments_reassemble(&ipv6_fragments, len, proto, PICO_PROTO_IPV6) == 0)
-    {
-        pico_timer_cancel(ipv6_fragments_timer);
-        ipv6_fragments_timer = 0;
-    }
+    if (a->proto != b->proto)
+        return (a->proto < b->proto) ? -1 : 1;
+
+    ret = memcmp(&a->src, &b->src, sizeof(union pico_address));
+    if (ret)
+        return ret;
+
+    return memcmp(&a->dst, &b->dst, sizeof(union pico_address));
 }
+static PICO_TREE_DECLARE(pico_frag_dgrams, pico_frag_dgram_cmp);
 
-static void pico_ipv6_frag_timer_on(void)
+static uint32_t pico_fragments_max_payload(uint8_t net)
 {
-    ipv6_fragments_timer = pico_timer_add(PICO_IPV6_FRAG_TIMEOUT, pico_frag_expire, &ipv6_fragments);
-    if (!ipv6_fragments_timer) {
-        frag_dbg("FRAG: Failed to start IPv6 expiration timer\n");
-        pico_fragments_empty_tree(&ipv6_fragments);
-    }
+    if (net == PICO_PROTO_IPV4)
+        return 0xFFFFu - PICO_SIZE_IP4HDR;
+
+    return 0xFFFFu;
 }
 
-static int pico_ipv6_frag_match(struct pico_frame *a, struct pico_frame *b)
+static void pico_frag_dgram_free(struct pico_frag_dgram *dg)
 {
-    struct pico_ipv6_hdr *ha = NULL, *hb = NULL;
-    if (!a || !b)
-        return -1;
-
-    ha = (struct pico_ipv6_hdr *)a->net_hdr;
-    hb = (struct pico_ipv6_hdr *)b->net_hdr;
-    if (!ha || !hb)
-        return -2;
+    struct pico_frag_range *r;
 
-    if (memcmp(ha->src.addr, hb->src.addr, PICO_SIZE_IP6) != 0)
-        return 1;
+    pico_tree_delete(&pico_frag_dgrams, dg);
+    if (dg->timer)
+        pico_timer_cancel(dg->timer);
 
-    if (memcmp(ha->dst.addr, hb->dst.addr, PICO_SIZE_IP6) != 0)
-        return 2;
+    while (dg->ranges) {
+        r = dg->ranges;
+        dg->ranges = r->next;
+        PICO_FREE(r);
+    }
+    if (dg->full)
+        pico_frame_discard(dg->full);
 
-    return 0;
+    pico_frag_mem -= dg->mem;
+    PICO_FREE(dg);
 }
-#endif
-
-#if defined(PICO_SUPPORT_IPV4) && defined(PICO_SUPPORT_IPV4FRAG)
-static uint32_t ipv4_cur_frag_id = 0u;
-static uint32_t ipv4_fragments_timer = 0u;
 
-static int pico_ipv4_frag_compare(void *ka, void *kb)
+static struct pico_frag_dgram *pico_frag_oldest(struct pico_frag_dgram *keep)
 {
-    struct pico_frame *a = ka, *b = kb;
-    if (IP4_FRAG_OFF(a->frag) > IP4_FRAG_OFF(b->frag))
-        return 1;
+    struct pico_tree_node *index;
+    struct pico_frag_dgram *dg, *oldest = NULL;
 
-    if (IP4_FRAG_OFF(a->frag) < IP4_FRAG_OFF(b->frag))
-        return -1;
+    pico_tree_foreach(index, &pico_frag_dgrams) {
+        dg = index->keyValue;
+        if (dg == keep)
+            continue;
 
-    return 0;
-}
-static PICO_TREE_DECLARE(ipv4_fragments, pico_ipv4_frag_compare);
-
-static void pico_ipv4_fragments_complete(unsigned int len, uint8_t proto)
-{
-    if (pico_fragments_reassemble(&ipv4_fragments, len, proto, PICO_PROTO_IPV4) == 0)
-    {
-        pico_timer_cancel(ipv4_fragments_timer);
-        ipv4_fragments_timer = 0;
+        if (!oldest || (int32_t)(dg->seq - oldest->seq) < 0)
+            oldest = dg;
     }
+    return oldest;
 }
 
-static void pico_ipv4_frag_timer_on(void)
+/* Charges 'bytes' to dg, dropping the oldest other datagrams if the cap
+ * would be exceeded. */
+static int pico_frag_mem_reserve(struct pico_frag_dgram *dg, uint32_t bytes)
 {
-    ipv4_fragments_timer = pico_timer_add( PICO_IPV4_FRAG_TIMEOUT, pico_frag_expire, &ipv4_fragments);
-    if (!ipv4_fragments_timer) {
-        frag_dbg("FRAG: Failed to start IPv4 expiration timer\n");
-        pico_fragments_empty_tree(&ipv4_fragments);
-    }
-}
+    struct pico_frag_dgram *old;
 
-static int pico_ipv4_frag_match(struct pico_frame *a, struct pico_frame *b)
-{
-    struct pico_ipv4_hdr *ha, *hb;
-    if (!a || !b)
+    if (bytes > PICO_FRAG_MEM_MAX)
         return -1;
 
-    ha = (struct pico_ipv4_hdr *)a->net_hdr;
-    hb = (struct pico_ipv4_hdr *)b->net_hdr;
-    if (!ha || !hb)
-        return -2;
-
-    if (memcmp(&(ha->src.addr), &(hb->src.addr), PICO_SIZE_IP4) != 0)
-        return 1;
-
-    if (memcmp(&(ha->dst.addr), &(hb->dst.addr), PICO_SIZE_IP4) != 0)
-        return 2;
+    while (pico_frag_mem + bytes > PICO_FRAG_MEM_MAX) {
+        old = pico_frag_oldest(dg);
+        if (!old)
+            return -1;
 
+        frag_dbg("FRAG: memory cap reached, dropping datagram %08x\n", old->id);
+        pico_frag_dgram_free(old);
+    }
+    pico_frag_mem += bytes;
+    dg->mem += bytes;
     return 0;
 }
+
+static void pico_frag_copy_header(struct pico_frag_dgram *dg, struct pico_frame *f)
+{
+    memcpy(dg->full->net_hdr, f->net_hdr, dg->full->net_len);
+#if defined(PICO_SUPPORT_IPV4) && defined(PICO_SUPPORT_IPV4FRAG)
+    if (dg->net == PICO_PROTO_IPV4) {
+        /* options are not carried over */
+        ((struct pico_ipv4_hdr *)dg->full->net_hdr)->vhl = 0x45;
+    }
 #endif
+    dg->full->dev = f->dev;
+}
 
-static void pico_fragments_complete(unsigned int bookmark, uint8_t proto, uint8_t net)
+/* Sets the length fields of the stored header to 'len' payload bytes */
+static void pico_frag_set_length(struct pico_frag_dgram *dg, uint32_t len)
 {
-    if (0) {}
+    struct pico_frame *full = dg->full;
 
+    full->transport_len = (uint16_t)len;
+    full->len = full->net_len + len;
 #if defined(PICO_SUPPORT_IPV4) && defined(PICO_SUPPORT_IPV4FRAG)
-    else if (net == PICO_PROTO_IPV4)
-    {
-        pico_ipv4_fragments_complete(bookmark, proto);
+    if (dg->net == PICO_PROTO_IPV4) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)full->net_hdr;
+        hdr->len = short_be((uint16_t)(full->net_len + len));
     }
 #endif
 #if defined(PICO_SUPPORT_IPV6) && defined(PICO_SUPPORT_IPV6FRAG)
-    else if (net == PICO_PROTO_IPV6)
-    {
-        pico_ipv6_fragments_complete(bookmark, proto);
+    if (dg->net == PICO_PROTO_IPV6) {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)full->net_hdr;
+        hdr->len = short_be((uint16_t)len);
+        hdr->nxthdr = dg->proto;
     }
 #endif
 }
 
-static void pico_fragments_empty_tree(struct pico_tree *tree)
+/* Makes the buffer hold at least 'end' payload bytes */
+static int pico_frag_buffer_fit(struct pico_frag_dgram *dg, struct pico_frame *f, uint32_t end)
 {
-    struct pico_tree_node *index, *tmp;
+    uint16_t hlen = pico_fragments_get_header_length(dg->net);
+    uint32_t size;
 
-    if (!tree)
-    {
-        return;
+    if (end <= dg->size && dg->full)
+        return 0;
+
+    if (dg->has_last) {
+        size = dg->total;
+    } else {
+        /* total unknown yet: double, so that in-order arrival
+         * does not move the payload at every fragment */
+        size = dg->size << 1;
+        if (size < end)
+            size = end;
+
+        if (size > pico_fragments_max_payload(dg->net))
+            size = pico_fragments_max_payload(dg->net);
     }
 
-    pico_tree_foreach_safe(index, tree, tmp) {
-        struct pico_frame * old = index->keyValue;
-        pico_tree_delete(tree, old);
-        pico_frame_discard(old);
+    if (pico_frag_mem_reserve(dg, size - dg->size) < 0)
+        return -1;
+
+    if (!dg->full) {
+        dg->full = pico_frame_alloc(hlen + size);
+        if (!dg->full)
+            return -1;
+
+        dg->full->net_hdr = dg->full->buffer;
+        dg->full->net_len = hlen;
+        dg->full->transport_hdr = dg->full->net_hdr + hlen;
+        pico_frag_copy_header(dg, f);
+    } else if (pico_frame_grow(dg->full, hlen + size) < 0) {
+        return -1;
     }
 
+    dg->size = size;
+    return 0;
 }
 
-static int pico_fragments_check_complete(struct pico_tree *tree, uint8_t proto, uint8_t net)
+/* Records [start, end) as received, merging ranges that touch it.
+ * Returns 1 if data was already there, 0 if not, -1 on error. */
+static int pico_frag_range_add(struct pico_frag_dgram *dg, uint32_t start, uint32_t end)
 {
-    struct pico_tree_node *index, *temp;
-    struct pico_frame *cur;
-    unsigned int bookmark = 0;
-
-    if (!tree)
+    struct pico_frag_range **pp = &dg->ranges;
+    struct pico_frag_range *r, *n;
+    int overlap = 0;
+
+    while (*pp && (*pp)->end < start)
+        pp = &(*pp)->next;
+
+    r = *pp;
+    if (!r || r->start > end) {
+        if (dg->nranges >= PICO_FRAG_MAX_RANGES)
+            return -1;
+
+        n = PICO_ZALLOC(sizeof(struct pico_frag_range));
+        if (!n)
+            return -1;
+
+        n->start = start;
+        n->end = end;
+        n->next = r;
+        *pp = n;
+        dg->nranges++;
         return 0;
+    }
+
+    if (start < r->end && end > r->start)
+        overlap = 1;
 
-    pico_tree_foreach_safe(index, tree, temp) {
-        cur = index->keyValue;
-        if (cur) {
-            if (pico_fragments_get_offset(cur, net) != bookmark)
-                return -1;
+    if (start < r->start)
+        r->start = start;
 
-            bookmark += cur->transport_len;
-            if (!pico_fragments_get_more_flag(cur, net)) {
-                pico_fragments_complete(bookmark, proto, net);
-                return 0;
-            }
-        }
+    if (end > r->end)
+        r->end = end;
+
+    while (r->next && r->next->start <= r->end) {
+        n = r->next;
+        if (n->start < end)
+            overlap = 1;
+
+        if (n->end > r->end)
+            r->end = n->end;
+
+        r->next = n->next;
+        PICO_FREE(n);
+        dg->nranges--;
     }
-    return 1;
+    return overlap;
 }
 
-static void pico_frag_expire(pico_time now, void *arg)
+static uint32_t pico_frag_received_end(struct pico_frag_dgram *dg)
 {
-    struct pico_tree *tree = (struct pico_tree *) arg;
-    struct pico_frame *first = NULL;
-    IGNORE_PARAMETER(now);
+    struct pico_frag_range *r = dg->ranges;
 
-    if (!tree)
-    {
-        frag_dbg("Expired packet but no tree supplied!\n");
-        return;
-    }
+    if (!r)
+        return 0;
+
+    while (r->next)
+        r = r->next;
+    return r->end;
+}
 
-    first = pico_tree_first(tree);
+static struct pico_frag_dgram *pico_frag_dgram_new(struct pico_frag_dgram *key)
+{
+    struct pico_frag_dgram *dg = PICO_ZALLOC(sizeof(struct pico_frag_dgram));
+    pico_time timeout = (key->net == PICO_PROTO_IPV4) ? PICO_IPV4_FRAG_TIMEOUT : PICO_IPV6_FRAG_TIMEOUT;
 
-    if (!first) {
-        frag_dbg("Empty tree - not sending notify\n");
-        return;
+    if (!dg)
+        return NULL;
+
+    dg->net = key->net;
+    dg->proto = key->proto;
+    dg->id = key->id;
+    dg->src = key->src;
+    dg->dst = key->dst;
+    dg->seq = pico_frag_seq++;
+    if (pico_frag_mem_reserve(dg, (uint32_t)sizeof(struct pico_frag_dgram)) < 0) {
+        PICO_FREE(dg);
+        return NULL;
+    }
+
+    if (pico_tree_insert(&pico_frag_dgrams, dg)) {
+        frag_dbg("FRAG: Could not insert datagram in tree\n");
+        pico_frag_mem -= dg->mem;
+        PICO_FREE(dg);
+        return NULL;
     }
 
-    pico_fragments_send_notify(first);
+    dg->timer = pico_timer_add(timeout, pico_frag_expire, dg);
+    if (!dg->timer) {
+        frag_dbg("FRAG: Failed to start expiration timer\n");
+        pico_frag_dgram_free(dg);
+        return NULL;
+    }
 
-    pico_fragments_empty_tree(tree);
+    frag_dbg("Started new reassembly, ID:%08x\n", dg->id);
+    return dg;
 }
 
-static void pico_fragments_send_notify(struct pico_frame *first)
+static void pico_frag_complete(struct pico_frag_dgram *dg)
 {
-    uint8_t net = 0;
+    struct pico_frame *full = dg->full;
+    uint8_t proto = dg->proto;
+
+    pico_frag_set_length(dg, dg->total);
+#if defined(PICO_SUPPORT_IPV4) && defined(PICO_SUPPORT_IPV4FRAG)
+    if (dg->net == PICO_PROTO_IPV4) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)full->net_hdr;
+        hdr->frag = 0;
+        hdr->crc = 0;
+        hdr->crc = short_be(pico_checksum(hdr, PICO_SIZE_IP4HDR));
+    }
+#endif
+    full->frag = 0;
+    dg->full = NULL;
+    pico_frag_dgram_free(dg);
 
-    if (!first)
+    frag_dbg("FRAG: reassembled %u bytes\n", full->transport_len);
+    if (pico_transport_receive(full, proto) == -1)
     {
-        return;
+        pico_frame_discard(full);
     }
+}
 
-    if (0) {}
+/* Adds one fragment carrying payload [off, off + transport_len) to the
+ * datagram identified by key. */
+static void pico_fragments_process(struct pico_frag_dgram *key, struct pico_frame *f, uint32_t off, int more)
+{
+    struct pico_frag_dgram *dg;
+    uint32_t len = f->transport_len;
+    uint32_t end = off + len;
+    int overlap;
 
-#if defined(PICO_SUPPORT_IPV4) && defined(PICO_SUPPORT_IPV4FRAG)
-    else if (IS_IPV4(first))
-    {
-        net = PICO_PROTO_IPV4;
-        frag_dbg("Packet expired! ID:%hu\n", ipv4_cur_frag_id);
+    if (!len && (more || !off))
+        return;
+
+    if (end > pico_fragments_max_payload(key->net)) {
+        frag_dbg("FRAG: fragment beyond maximum datagram size\n");
+        return;
     }
 
-#endif
-#if defined(PICO_SUPPORT_IPV6) && defined(PICO_SUPPORT_IPV6FRAG)
-    else if (IS_IPV6(first))
-    {
-        net = PICO_PROTO_IPV6;
-        frag_dbg("Packet expired! ID:%hu\n", ipv6_cur_frag_id);
+    dg = pico_tree_findKey(&pico_frag_dgrams, key);
+    if (!dg) {
+        dg = pico_frag_dgram_new(key);
+        if (!dg)
+            return;
     }
 
-#endif
+    if (!more) {
+        if ((dg->has_last && dg->total != end) || (pico_frag_received_end(dg) > end))
+            goto drop;
 
-    if (((pico_fragments_get_offset(first, net) == 0) && (pico_frame_dst_is_unicast(first))))
-    {
-        frag_dbg("sending notify\n");
-        pico_notify_frag_expired(first);
+        dg->has_last = 1;
+        dg->total = end;
+    } else if (dg->has_last && end > dg->total) {
+        goto drop;
     }
-    else
-    {
-        frag_dbg("Not first packet or not unicast address, not sending notify");
+
+    if (pico_frag_buffer_fit(dg, f, end) < 0)
+        goto drop;
+
+    if (len) {
+        overlap = pico_frag_range_add(dg, off, end);
+        /* RFC 5722: overlapping IPv6 fragments void the whole datagram */
+        if (overlap < 0 || (overlap && dg->net == PICO_PROTO_IPV6))
+            goto drop;
+
+        memcpy(dg->full->transport_hdr + off, f->transport_hdr, len);
+    }
+
+    if (!off) {
+        pico_frag_copy_header(dg, f);
+        dg->has_first = 1;
     }
+
+    if (dg->has_last && dg->ranges && !dg->ranges->next &&
+        dg->ranges->start == 0 && dg->ranges->end == dg->total)
+        pico_frag_complete(dg);
+
+    return;
+
+drop:
+    frag_dbg("FRAG: dropping datagram %08x\n", dg->id);
+    pico_frag_dgram_free(dg);
 }
 
-static int pico_fragments_reassemble(struct pico_tree *tree, unsigned int len, uint8_t proto, uint8_t net)
+static void pico_frag_expire(pico_time now, void *arg)
 {
-    struct pico_tree_node *index, *tmp;
-    struct pico_frame *f;
-    uint16_t header_length = 0;
-    unsigned int bookmark = 0;
-    struct pico_frame *full = NULL;
-    struct pico_frame *first = NULL;
-
-    if (!tree)
-    {
-        frag_dbg("Cannot reassemble packet, no tree supplied!\n");
-        return -1;
-    }
+    struct pico_frag_dgram *dg = (struct pico_frag_dgram *)arg;
+    IGNORE_PARAMETER(now);
 
-    first = pico_tree_first(tree);
+    dg->timer = 0;
+    frag_dbg("Packet expired! ID:%08x\n", dg->id);
+    pico_fragments_send_notify(dg);
+    pico_frag_dgram_free(dg);
+}
 
-    if (!first)
+static void pico_fragments_send_notify(struct pico_frag_dgram *dg)
+{
+    if (!dg->has_first)
     {
-        frag_dbg("Cannot reassemble packet, empty tree supplied!\n");
-        return -2;
+        frag_dbg("First fragment not received, not sending notify\n");
+        return;
     }
 
-    header_length = pico_fragments_get_header_length(net);
-
-    if (!header_length)
+    /* quote only what was received from the start of the datagram */
+    pico_frag_set_length(dg, dg->ranges->end);
+    if (pico_frame_dst_is_unicast(dg->full))
     {
-        return -3;
-    }
-
-    full = pico_frame_alloc((uint16_t)(header_length + len));
-    if (full) {
-        full->net_hdr = full->buffer;
-        full->net_len = header_length;
-        memcpy(full->net_hdr, first->net_hdr, full->net_len);
-        full->transport_hdr = full->net_hdr + full->net_len;
-        full->transport_len = (uint16_t)len;
-        full->dev = first->dev;
-        pico_tree_foreach_safe(index, tree, tmp) {
-            f = index->keyValue;
-            memcpy(full->transport_hdr + bookmark, f->transport_hdr, f->transport_len);
-            bookmark += f->transport_len;
-            pico_tree_delete(tree, f);
-            pico_frame_discard(f);
-        }
-        if (pico_transport_receive(full, proto) == -1)
-        {
-            pico_frame_discard(full);
-        }
-
-        return 0;
+        frag_dbg("sending notify\n");
+        pico_notify_frag_expired(dg->full);
+    }
+    else
+    {
+        frag_dbg("Not unicast address, not sending notify");
     }
-
-    return 1;
 }
 
 static uint16_t pico_fragments_get_header_length(uint8_t net)
@@ -428,11 +566,13 @@ static uint32_t pico_fragments_get_offset(struct pico_frame *frame, uint8_t net)
 
     return 0;
 }
+#endif /* FRAG_REASSEMBLY */
 
 void pico_ipv6_process_frag(struct pico_ipv6_exthdr *frag, struct pico_frame *f, uint8_t proto)
 {
 #if defined(PICO_SUPPORT_IPV6) && defined(PICO_SUPPORT_IPV6FRAG)
-    struct pico_frame *first = NULL;
+    struct pico_frag_dgram key;
+    struct pico_ipv6_hdr *hdr;
 
     if (!f || !frag)
     {
@@ -440,56 +580,15 @@ void pico_ipv6_process_frag(struct pico_ipv6_exthdr *frag, struct pico_frame *f,
         return;
     }
 
-    first = pico_tree_first(&ipv6_fragments);
-
-    if (first)
-    {
-        if ((pico_ipv6_frag_match(f, first) == 0 && (IP6_FRAG_ID(frag) == ipv6_cur_frag_id))) {
-            struct pico_frame *temp = NULL;
-
-            temp = pico_frame_copy(f);
-
-            if (!temp) {
-                frag_dbg("Could not allocate memory to continue reassembly of IPV6 fragmented packet (id: %hu)\n", ipv6_cur_frag_id);
-                return;
-            }
-
-            if (pico_tree_insert(&ipv6_fragments, temp)) {
-                frag_dbg("FRAG: Could not insert picoframe in tree\n");
-                pico_frame_discard(temp);
-                return;
-            }
-        }
-    }
-    else
-    {
-        struct pico_frame *temp = NULL;
-
-        if (ipv6_cur_frag_id && (IP6_FRAG_ID(frag) == ipv6_cur_frag_id)) {
-            /* Discard late arrivals, without firing the timer. */
-            frag_dbg("discarded late arrival, exp:%hu found:%hu\n", ipv6_cur_frag_id, IP6_FRAG_ID(frag));
-            return;
-        }
-
-        temp = pico_frame_copy(f);
-
-        if (!temp) {
-            frag_dbg("Could not allocate memory to start reassembly of fragmented packet\n");
-            return;
-        }
-
-        pico_ipv6_frag_timer_on();
-        ipv6_cur_frag_id = IP6_FRAG_ID(frag);
-        frag_dbg("Started new reassembly, ID:%hu\n", ipv6_cur_frag_id);
-
-        if (pico_tree_insert(&ipv6_fragments, temp)) {
-            frag_dbg("FRAG: Could not insert picoframe in tree\n");
-            pico_frame_discard(temp);
-            return;
-        }
-    }
-
-    pico_fragments_check_complete(&ipv6_fragments, proto, PICO_PROTO_IPV6);
+    hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+    memset(&key, 0, sizeof(key));
+    key.net = PICO_PROTO_IPV6;
+    key.proto = proto;
+    key.id = IP6_FRAG_ID(frag);
+    memcpy(key.src.ip6.addr, hdr->src.addr, PICO_SIZE_IP6);
+    memcpy(key.dst.ip6.addr, hdr->dst.addr, PICO_SIZE_IP6);
+    pico_fragments_process(&key, f, pico_fragments_get_offset(f, PICO_PROTO_IPV6),
+                           pico_fragments_get_more_flag(f, PICO_PROTO_IPV6));
 #else
     IGNORE_PARAMETER(frag);
     IGNORE_PARAMETER(f);
@@ -500,7 +599,8 @@ void pico_ipv6_process_frag(struct pico_ipv6_exthdr *frag, struct pico_frame *f,
 void pico_ipv4_process_frag(struct pico_ipv4_hdr *hdr, struct pico_frame *f, uint8_t proto)
 {
 #if defined(PICO_SUPPORT_IPV4) && defined(PICO_SUPPORT_IPV4FRAG)
-    struct pico_frame *first = NULL;
+    struct pico_frag_dgram key;
+    struct pico_ipv4_hdr *net;
 
     if (!f || !hdr)
     {
@@ -508,63 +608,15 @@ void pico_ipv4_process_frag(struct pico_ipv4_hdr *hdr, struct pico_frame *f, uin
         return;
     }
 
-    first = pico_tree_first(&ipv4_fragments);
-
-    if (first)
-    {
-        /* fragments from old packets still in tree, and new first fragment ? */
-        if ((IP4_FRAG_ID(hdr) != ipv4_cur_frag_id) && (IP4_FRAG_OFF(f->frag) == 0)) {
-            pico_fragments_empty_tree(&ipv4_fragments);
-
-            first = NULL;
-            ipv4_cur_frag_id = 0;
-        }
-
-        if ((pico_ipv4_frag_match(f, first) == 0 && (IP4_FRAG_ID(hdr) == ipv4_cur_frag_id))) {
-            struct pico_frame *temp = NULL;
-
-            temp = pico_frame_copy(f);
-
-            if (!temp) {
-                frag_dbg("Could not allocate memory to continue reassembly of IPV4 fragmented packet (id: %hu)\n", ipv4_cur_frag_id);
-                return;
-            }
-
-            if (pico_tree_insert(&ipv4_fragments, temp)) {
-            	frag_dbg("FRAG: Could not insert picoframe in tree\n");
-                pico_frame_discard(temp);
-                return;
-			}
-        }
-    }
-    else
-    {
-        struct pico_frame *temp = NULL;
-
-        if (ipv4_cur_frag_id && (IP4_FRAG_ID(hdr) == ipv4_cur_frag_id)) {
-            /* Discard late arrivals, without firing the timer */
-            return;
-        }
-
-        temp = pico_frame_copy(f);
-
-        if (!temp) {
-            frag_dbg("Could not allocate memory to start reassembly fragmented packet\n");
-            return;
-        }
-
-        pico_ipv4_frag_timer_on();
-        ipv4_cur_frag_id = IP4_FRAG_ID(hdr);
-        frag_dbg("Started new reassembly, ID:%hu\n", ipv4_cur_frag_id);
-
-        if (pico_tree_insert(&ipv4_fragments, temp)) {
-            frag_dbg("FRAG: Could not insert picoframe in tree\n");
-            pico_frame_discard(temp);
-            return;
-        }
-    }
-
-    pico_fragments_check_complete(&ipv4_fragments, proto, PICO_PROTO_IPV4);
+    net = (struct pico_ipv4_hdr *)f->net_hdr;
+    memset(&key, 0, sizeof(key));
+    key.net = PICO_PROTO_IPV4;
+    key.proto = proto;
+    key.id = IP4_FRAG_ID(hdr);
+    key.src.ip4.addr = net->src.addr;
+    key.dst.ip4.addr = net->dst.addr;
+    pico_fragments_process(&key, f, pico_fragments_get_offset(f, PICO_PROTO_IPV4),
+                           pico_fragments_get_more_flag(f, PICO_PROTO_IPV4));
 #else
     IGNORE_PARAMETER(hdr);
     IGNORE_PARAMETER(f);
@@ -15,6 +15,7 @@
 #include "pico_device.h"
 #include "pico_stack.h"
 #include "pico_tree.h"
+#include "pico_icmp_limit.h"
 
 /* Queues */
 static struct pico_queue icmp_in = {
@@ -67,10 +68,24 @@ static int pico_icmp4_process_in(struct pico_protocol *self, struct pico_frame *
         firstpkt = 0;
         last_id = hdr->hun.ih_idseq.idseq_id;
         last_seq = hdr->hun.ih_idseq.idseq_seq;
+#ifdef PICO_SUPPORT_ICMP_LIMIT
+        if (pico_icmp_limit_consume(PICO_ICMP_LIMIT_ECHO, PICO_PROTO_IPV4,
+                                    (union pico_address *)&((struct pico_ipv4_hdr *)f->net_hdr)->src) < 0) {
+            pico_frame_discard(f);
+            return 0;
+        }
+
+#endif
         pico_icmp4_checksum(f);
         pico_ipv4_rebound(f);
     } else if (hdr->type == PICO_ICMP_UNREACH) {
         f->net_hdr = f->transport_hdr + PICO_ICMPHDR_UN_SIZE;
+#ifdef PICO_SUPPORT_PMTU
+        if (hdr->code == PICO_ICMP_UNREACH_NEEDFRAG) {
+            pico_ipv4_pkt_too_big(f, short_be(hdr->hun.ih_pmtu.ipm_nmtu));
+            return 0;
+        }
+#endif
         pico_ipv4_unreachable(f, hdr->code);
     } else if (hdr->type == PICO_ICMP_ECHOREPLY) {
 #ifdef PICO_SUPPORT_PING
@@ -125,13 +140,27 @@ static int pico_icmp4_notify(struct pico_frame *f, uint8_t type, uint8_t code)
         f_tot_len = (sizeof(struct pico_ipv4_hdr) + 8u);
     }
 
-    reply = pico_proto_ipv4.alloc(&pico_proto_ipv4, f->dev, (uint16_t) (f_tot_len + PICO_ICMPHDR_UN_SIZE));
     info = (struct pico_ipv4_hdr*)(f->net_hdr);
+#ifdef PICO_SUPPORT_ICMP_LIMIT
+    if (pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, (union pico_address *)&info->src) < 0)
+        return 0;
+
+#endif
+    reply = pico_proto_ipv4.alloc(&pico_proto_ipv4, f->dev, (uint16_t) (f_tot_len + PICO_ICMPHDR_UN_SIZE));
+    if (!reply) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
     hdr = (struct pico_icmp4_hdr *) reply->transport_hdr;
     hdr->type = type;
     hdr->code = code;
-    hdr->hun.ih_pmtu.ipm_nmtu = short_be(1500);
     hdr->hun.ih_pmtu.ipm_void = 0;
+    hdr->hun.ih_pmtu.ipm_nmtu = 0;
+    /* RFC 1191 4: MTU of the next hop, f->dev is the outgoing device */
+    if ((type == PICO_ICMP_UNREACH) && (code == PICO_ICMP_UNREACH_NEEDFRAG) && f->dev)
+        hdr->hun.ih_pmtu.ipm_nmtu = short_be((uint16_t)f->dev->mtu);
+
     reply->transport_len = (uint16_t)(f_tot_len +  PICO_ICMPHDR_UN_SIZE);
     reply->payload = reply->transport_hdr + PICO_ICMPHDR_UN_SIZE;
     memcpy(reply->payload, f->net_hdr, f_tot_len);
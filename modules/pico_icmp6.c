@@ -17,6 +17,7 @@
 #include "pico_tree.h"
 #include "pico_socket.h"
 #include "pico_mld.h"
+#include "pico_icmp_limit.h"
 
 #ifdef DEBUG_ICMP6
     #define icmp6_dbg dbg
@@ -65,6 +66,12 @@ static int pico_icmp6_send_echoreply(struct pico_frame *echo)
     struct pico_ip6 src;
     struct pico_ip6 dst;
 
+#ifdef PICO_SUPPORT_ICMP_LIMIT
+    if (pico_icmp_limit_consume(PICO_ICMP_LIMIT_ECHO, PICO_PROTO_IPV6,
+                                (union pico_address *)&((struct pico_ipv6_hdr *)echo->net_hdr)->src) < 0)
+        return 0;
+
+#endif
     reply = pico_proto_ipv6.alloc(&pico_proto_ipv6, echo->dev, (uint16_t)(echo->transport_len));
     if (!reply) {
         pico_err = PICO_ERR_ENOMEM;
@@ -105,6 +112,15 @@ static int pico_icmp6_process_in(struct pico_protocol *self, struct pico_frame *
         pico_ipv6_unreachable(f, hdr->code);
         break;
 
+    case PICO_ICMP6_PKT_TOO_BIG:
+#ifdef PICO_SUPPORT_PMTU
+        f->net_hdr = f->transport_hdr + PICO_ICMP6HDR_PKT_TOO_BIG_SIZE;
+        pico_ipv6_pkt_too_big(f, long_be(hdr->msg.err.pkt_too_big.mtu));
+#else
+        pico_frame_discard(f);
+#endif
+        break;
+
     case PICO_ICMP6_ECHO_REQUEST:
         icmp6_dbg("ICMP6: Received ECHO REQ\n");
         f->transport_len = (uint16_t)(f->len - f->net_len - (uint16_t)(f->net_hdr - f->buffer));
@@ -161,6 +177,12 @@ static int pico_icmp6_notify(struct pico_frame *f, uint8_t type, uint8_t code, u
         return -1;
 
     ipv6_hdr = (struct pico_ipv6_hdr *)(f->net_hdr);
+#ifdef PICO_SUPPORT_ICMP_LIMIT
+    /* RFC 4443 2.4 (f) */
+    if (pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV6, (union pico_address *)&ipv6_hdr->src) < 0)
+        return 0;
+
+#endif
     len = (uint16_t)(short_be(ipv6_hdr->len) + PICO_SIZE_IP6HDR);
     switch (type)
     {
@@ -198,6 +220,22 @@ static int pico_icmp6_notify(struct pico_frame *f, uint8_t type, uint8_t code, u
         icmp6_hdr->msg.err.time_exceeded.unused = 0;
         break;
 
+    case PICO_ICMP6_PKT_TOO_BIG:
+        if (PICO_SIZE_IP6HDR + PICO_ICMP6HDR_PKT_TOO_BIG_SIZE + len > PICO_IPV6_MIN_MTU)
+            len = PICO_IPV6_MIN_MTU - (PICO_SIZE_IP6HDR + PICO_ICMP6HDR_PKT_TOO_BIG_SIZE);
+
+        notice = pico_proto_ipv6.alloc(&pico_proto_ipv6, f->dev, (uint16_t)(PICO_ICMP6HDR_PKT_TOO_BIG_SIZE + len));
+        if (!notice) {
+            pico_err = PICO_ERR_ENOMEM;
+            return -1;
+        }
+
+        notice->payload = notice->transport_hdr + PICO_ICMP6HDR_PKT_TOO_BIG_SIZE;
+        notice->payload_len = len;
+        icmp6_hdr = (struct pico_icmp6_hdr *)notice->transport_hdr;
+        icmp6_hdr->msg.err.pkt_too_big.mtu = long_be(ptr);
+        break;
+
     case PICO_ICMP6_PARAM_PROBLEM:
         if (PICO_SIZE_IP6HDR + PICO_ICMP6HDR_PARAM_PROBLEM_SIZE + len > PICO_IPV6_MIN_MTU)
             len = PICO_IPV6_MIN_MTU - (PICO_SIZE_IP6HDR + PICO_ICMP6HDR_PARAM_PROBLEM_SIZE);
@@ -268,7 +306,8 @@ int pico_icmp6_pkt_too_big(struct pico_frame *f)
     if (pico_ipv6_is_multicast(hdr->dst.addr))
         return 0;
 
-    return pico_icmp6_notify(f, PICO_ICMP6_PKT_TOO_BIG, 0, 0);
+    /* MTU of the outgoing device */
+    return pico_icmp6_notify(f, PICO_ICMP6_PKT_TOO_BIG, 0, f->dev ? f->dev->mtu : PICO_IPV6_MIN_MTU);
 }
 
 #ifdef PICO_SUPPORT_IPFILTER
@@ -16,6 +16,7 @@
 #define PICO_ICMP6HDR_DEST_UNREACH_SIZE 8
 #define PICO_ICMP6HDR_TIME_XCEEDED_SIZE 8
 #define PICO_ICMP6HDR_PARAM_PROBLEM_SIZE 8
+#define PICO_ICMP6HDR_PKT_TOO_BIG_SIZE  8
 #define PICO_ICMP6HDR_NEIGH_SOL_SIZE    24
 #define PICO_ICMP6HDR_NEIGH_ADV_SIZE    24
 #define PICO_ICMP6HDR_ROUTER_SOL_SIZE   8
@@ -0,0 +1,237 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   ICMP rate limiting.
+ *********************************************************************/
+
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_protocol.h"
+#include "pico_token_bucket.h"
+#include "pico_icmp_limit.h"
+
+#ifdef PICO_SUPPORT_ICMP_LIMIT
+
+#ifdef DEBUG_ICMP_LIMIT
+    #define limit_dbg dbg
+#else
+    #define limit_dbg(...) do {} while(0)
+#endif
+
+struct icmp_limit_entry {
+    union pico_address addr;
+    struct pico_token_bucket tb[PICO_ICMP_LIMIT_CLASSES];
+    struct icmp_limit_entry *next;      /* Hash chain */
+    struct icmp_limit_entry *newer;     /* LRU list */
+    struct icmp_limit_entry *older;
+    uint16_t proto;
+};
+
+static struct pico_icmp_limit_config icmp_limit_cfg[PICO_ICMP_LIMIT_CLASSES] = {
+    { PICO_ICMP_LIMIT_ERROR_RATE, 0, PICO_ICMP_LIMIT_ERROR_TOTAL },
+    { PICO_ICMP_LIMIT_ECHO_RATE, 0, PICO_ICMP_LIMIT_ECHO_TOTAL }
+};
+
+static struct icmp_limit_entry icmp_limit_pool[PICO_ICMP_LIMIT_ENTRIES];
+static struct icmp_limit_entry *icmp_limit_table[PICO_ICMP_LIMIT_HASH_SIZE];
+static struct icmp_limit_entry *icmp_limit_newest;
+static struct icmp_limit_entry *icmp_limit_oldest;
+static struct pico_token_bucket icmp_limit_total[PICO_ICMP_LIMIT_CLASSES];
+static struct pico_icmp_limit_stats icmp_limit_stats;
+
+static uint32_t icmp_limit_addr_len(uint16_t proto)
+{
+    return (proto == PICO_PROTO_IPV6) ? PICO_SIZE_IP6 : PICO_SIZE_IP4;
+}
+
+static uint32_t icmp_limit_hash(uint16_t proto, const union pico_address *dst)
+{
+    const uint8_t *addr = (const uint8_t *)dst;
+    uint32_t h = proto;
+    uint32_t w, i;
+
+    for (i = 0; i < icmp_limit_addr_len(proto); i += 4) {
+        memcpy(&w, addr + i, sizeof(w));
+        h ^= w;
+    }
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return h & (PICO_ICMP_LIMIT_HASH_SIZE - 1);
+}
+
+static void icmp_limit_lru_unlink(struct icmp_limit_entry *e)
+{
+    if (e->newer)
+        e->newer->older = e->older;
+    else
+        icmp_limit_newest = e->older;
+
+    if (e->older)
+        e->older->newer = e->newer;
+    else
+        icmp_limit_oldest = e->newer;
+
+    e->newer = NULL;
+    e->older = NULL;
+}
+
+static void icmp_limit_lru_push(struct icmp_limit_entry *e)
+{
+    e->older = icmp_limit_newest;
+    e->newer = NULL;
+    if (icmp_limit_newest)
+        icmp_limit_newest->newer = e;
+    else
+        icmp_limit_oldest = e;
+
+    icmp_limit_newest = e;
+}
+
+static void icmp_limit_unhash(struct icmp_limit_entry *e)
+{
+    struct icmp_limit_entry **pp = &icmp_limit_table[icmp_limit_hash(e->proto, &e->addr)];
+
+    while (*pp) {
+        if (*pp == e) {
+            *pp = e->next;
+            break;
+        }
+
+        pp = &(*pp)->next;
+    }
+    e->next = NULL;
+}
+
+static void icmp_limit_bucket_init(struct pico_token_bucket *tb, uint8_t cls)
+{
+    pico_token_bucket_init(tb, icmp_limit_cfg[cls].rate, icmp_limit_cfg[cls].burst, pico_tick);
+}
+
+static struct icmp_limit_entry *icmp_limit_find(uint16_t proto, const union pico_address *dst)
+{
+    struct icmp_limit_entry *e = icmp_limit_table[icmp_limit_hash(proto, dst)];
+
+    while (e) {
+        if ((e->proto == proto) && (memcmp(&e->addr, dst, icmp_limit_addr_len(proto)) == 0))
+            return e;
+
+        e = e->next;
+    }
+    return NULL;
+}
+
+/* Free slot while the pool lasts, the least recently used one after that */
+static struct icmp_limit_entry *icmp_limit_add(uint16_t proto, const union pico_address *dst)
+{
+    struct icmp_limit_entry *e;
+    uint32_t h;
+    uint8_t cls;
+
+    if (icmp_limit_stats.entries < PICO_ICMP_LIMIT_ENTRIES) {
+        e = &icmp_limit_pool[icmp_limit_stats.entries++];
+    } else {
+        e = icmp_limit_oldest;
+        icmp_limit_lru_unlink(e);
+        icmp_limit_unhash(e);
+        icmp_limit_stats.evicted++;
+        limit_dbg("ICMP limit: table full, evicting a destination\n");
+    }
+
+    memset(&e->addr, 0, sizeof(e->addr));
+    memcpy(&e->addr, dst, icmp_limit_addr_len(proto));
+    e->proto = proto;
+    for (cls = 0; cls < PICO_ICMP_LIMIT_CLASSES; cls++)
+        icmp_limit_bucket_init(&e->tb[cls], cls);
+
+    h = icmp_limit_hash(proto, dst);
+    e->next = icmp_limit_table[h];
+    icmp_limit_table[h] = e;
+    icmp_limit_lru_push(e);
+    return e;
+}
+
+int pico_icmp_limit_consume(uint8_t cls, uint16_t proto, const union pico_address *dst)
+{
+    struct icmp_limit_entry *e;
+
+    if ((cls >= PICO_ICMP_LIMIT_CLASSES) || !dst) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    if (icmp_limit_cfg[cls].rate) {
+        e = icmp_limit_find(proto, dst);
+        if (e) {
+            icmp_limit_lru_unlink(e);
+            icmp_limit_lru_push(e);
+        } else {
+            e = icmp_limit_add(proto, dst);
+        }
+
+        if (pico_token_bucket_consume(&e->tb[cls], 1, pico_tick) < 0) {
+            icmp_limit_stats.limited[cls]++;
+            return -1;
+        }
+    }
+
+    if (icmp_limit_cfg[cls].total) {
+        if (!icmp_limit_total[cls].rate)
+            pico_token_bucket_init(&icmp_limit_total[cls], icmp_limit_cfg[cls].total, 0, pico_tick);
+
+        if (pico_token_bucket_consume(&icmp_limit_total[cls], 1, pico_tick) < 0) {
+            icmp_limit_stats.capped[cls]++;
+            return -1;
+        }
+    }
+
+    icmp_limit_stats.sent[cls]++;
+    return 0;
+}
+
+int pico_icmp_limit_set(uint8_t cls, const struct pico_icmp_limit_config *cfg)
+{
+    uint32_t i;
+
+    if ((cls >= PICO_ICMP_LIMIT_CLASSES) || !cfg) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    icmp_limit_cfg[cls] = *cfg;
+    for (i = 0; i < icmp_limit_stats.entries; i++)
+        icmp_limit_bucket_init(&icmp_limit_pool[i].tb[cls], cls);
+
+    /* Set up again on first use */
+    icmp_limit_total[cls].rate = 0;
+    return 0;
+}
+
+int pico_icmp_limit_get(uint8_t cls, struct pico_icmp_limit_config *cfg)
+{
+    if ((cls >= PICO_ICMP_LIMIT_CLASSES) || !cfg) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    *cfg = icmp_limit_cfg[cls];
+    return 0;
+}
+
+void pico_icmp_limit_get_stats(struct pico_icmp_limit_stats *stats)
+{
+    if (stats)
+        *stats = icmp_limit_stats;
+}
+
+void pico_icmp_limit_flush(void)
+{
+    memset(icmp_limit_pool, 0, sizeof(icmp_limit_pool));
+    memset(icmp_limit_table, 0, sizeof(icmp_limit_table));
+    memset(icmp_limit_total, 0, sizeof(icmp_limit_total));
+    memset(&icmp_limit_stats, 0, sizeof(icmp_limit_stats));
+    icmp_limit_newest = NULL;
+    icmp_limit_oldest = NULL;
+}
+
+#endif
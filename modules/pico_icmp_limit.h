@@ -0,0 +1,71 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+ *********************************************************************/
+#ifndef INCLUDE_PICO_ICMP_LIMIT
+#define INCLUDE_PICO_ICMP_LIMIT
+#include "pico_config.h"
+#include "pico_addressing.h"
+
+/* ICMP rate limiting, RFC 1812 4.3.2.8 and RFC 4443 2.4 (f). Every
+ * destination gets a token bucket per class of message, kept in a small
+ * table that evicts the least recently used destination when full. A
+ * second bucket per class caps all destinations together, so a flood from
+ * spoofed sources can't get a fresh bucket per packet. */
+
+/* Destinations tracked at once. The table is allocated up front, a flood
+ * never makes it allocate. */
+#ifndef PICO_ICMP_LIMIT_ENTRIES
+#define PICO_ICMP_LIMIT_ENTRIES         (32)
+#endif
+
+/* Hash buckets, power of two */
+#ifndef PICO_ICMP_LIMIT_HASH_SIZE
+#define PICO_ICMP_LIMIT_HASH_SIZE       (16)
+#endif
+
+/* Default limits, messages per second */
+#ifndef PICO_ICMP_LIMIT_ERROR_RATE
+#define PICO_ICMP_LIMIT_ERROR_RATE      (10)
+#endif
+#ifndef PICO_ICMP_LIMIT_ERROR_TOTAL
+#define PICO_ICMP_LIMIT_ERROR_TOTAL     (100)
+#endif
+#ifndef PICO_ICMP_LIMIT_ECHO_RATE
+#define PICO_ICMP_LIMIT_ECHO_RATE       (100)
+#endif
+#ifndef PICO_ICMP_LIMIT_ECHO_TOTAL
+#define PICO_ICMP_LIMIT_ECHO_TOTAL      (1000)
+#endif
+
+#define PICO_ICMP_LIMIT_ERROR           (0)     /* Unreachable, time exceeded, too big, ... */
+#define PICO_ICMP_LIMIT_ECHO            (1)     /* Echo replies */
+#define PICO_ICMP_LIMIT_CLASSES         (2)
+
+struct pico_icmp_limit_config {
+    uint32_t rate;      /* to one destination, 0 for no limit */
+    uint32_t burst;     /* 0 for one second at rate */
+    uint32_t total;     /* to all destinations together, 0 for no limit */
+};
+
+struct pico_icmp_limit_stats {
+    uint32_t sent[PICO_ICMP_LIMIT_CLASSES];
+    uint32_t limited[PICO_ICMP_LIMIT_CLASSES];  /* over the limit of the destination */
+    uint32_t capped[PICO_ICMP_LIMIT_CLASSES];   /* over the total */
+    uint32_t evicted;                           /* destinations dropped from a full table */
+    uint32_t entries;
+};
+
+/* proto is PICO_PROTO_IPV4 or PICO_PROTO_IPV6, dst the destination of the
+ * message. Returns 0 if it may be sent, -1 if not. */
+int pico_icmp_limit_consume(uint8_t cls, uint16_t proto, const union pico_address *dst);
+
+/* Resets the buckets of the class */
+int pico_icmp_limit_set(uint8_t cls, const struct pico_icmp_limit_config *cfg);
+int pico_icmp_limit_get(uint8_t cls, struct pico_icmp_limit_config *cfg);
+void pico_icmp_limit_get_stats(struct pico_icmp_limit_stats *stats);
+/* Forgets every destination and clears the counters */
+void pico_icmp_limit_flush(void);
+
+#endif
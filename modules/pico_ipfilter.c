@@ -7,8 +7,10 @@
  *********************************************************************/
 
 #include "pico_ipv4.h"
+#include "pico_ipv6.h"
 #include "pico_config.h"
 #include "pico_icmp4.h"
+#include "pico_icmp6.h"
 #include "pico_stack.h"
 #include "pico_eth.h"
 #include "pico_socket.h"
@@ -22,6 +24,21 @@
 #define MAX_PRIORITY    (10)
 #define MIN_PRIORITY    (-10)
 
+/* Every rule is a range in each of these dimensions. Addresses are stored
+ * as host order 32-bit words, one for IPv4 and four for IPv6, so that
+ * prefixes and port ranges are compared in the same way. */
+#define FILTER_DIM_PROTO    (0)
+#define FILTER_DIM_SRC      (1)
+#define FILTER_DIM_DST      (2)
+#define FILTER_DIM_SPORT    (3)
+#define FILTER_DIM_DPORT    (4)
+#define FILTER_DIMS         (5)
+#define FILTER_WORDS        (4)
+
+#define FILTER_FAMILY_IPV4  (0)
+#define FILTER_FAMILY_IPV6  (1)
+#define FILTER_FAMILIES     (2)
+
 #ifdef DEBUG_IPF
     #define ipf_dbg dbg
 #else
@@ -36,281 +53,444 @@ static int filter_compare(void *filterA, void *filterB);
 
 struct filter_node {
     struct pico_device *fdev;
-    /* output address */
-    uint32_t out_addr;
-    uint32_t out_addr_netmask;
-    /* input address */
-    uint32_t in_addr;
-    uint32_t in_addr_netmask;
-    /* transport */
-    uint16_t out_port;
-    uint16_t in_port;
-    /* filter details */
-    uint8_t proto;
+    uint32_t filter_id;
+    uint32_t hits;
+    uint8_t family;
     int8_t priority;
     uint8_t tos;
-    uint32_t filter_id;
+    struct pico_token_bucket policer;
+    /* inclusive [lo, hi] range per dimension */
+    uint32_t lo[FILTER_DIMS][FILTER_WORDS];
+    uint32_t hi[FILTER_DIMS][FILTER_WORDS];
     int (*function_ptr)(struct filter_node *filter, struct pico_frame *f);
 };
 
+/* Header fields of a packet being classified, in the same layout as the rules */
+struct filter_key {
+    struct pico_device *dev;
+    uint8_t family;
+    uint32_t val[FILTER_DIMS][FILTER_WORDS];
+};
+
+/* Rules are kept in insertion order: the first rule added wins when several match */
 static PICO_TREE_DECLARE(filter_tree, &filter_compare);
 
-static inline int ipfilter_uint32_cmp(uint32_t a, uint32_t b)
+static int filter_compare(void *filterA, void *filterB)
 {
-    if (a < b)
+    struct filter_node *a = (struct filter_node *)filterA;
+    struct filter_node *b = (struct filter_node *)filterB;
+
+    if (a->filter_id < b->filter_id)
         return -1;
 
-    if (b < a)
+    if (a->filter_id > b->filter_id)
         return 1;
 
     return 0;
 }
 
-static inline int ipfilter_uint16_cmp(uint16_t a, uint16_t b)
+static inline uint32_t filter_dim_width(uint8_t family, int dim)
 {
-    if (a < b)
-        return -1;
+    if (family == FILTER_FAMILY_IPV6 && (dim == FILTER_DIM_SRC || dim == FILTER_DIM_DST))
+        return FILTER_WORDS;
 
-    if (b < a)
-        return 1;
+    return 1u;
+}
 
+static inline int filter_word_cmp(const uint32_t *a, const uint32_t *b, uint32_t width)
+{
+    uint32_t i;
+    for (i = 0; i < width; i++) {
+        if (a[i] != b[i])
+            return (a[i] < b[i]) ? (-1) : (1);
+    }
     return 0;
 }
 
-static inline int ipfilter_uint8_cmp(uint8_t a, uint8_t b)
+/* Reference matcher: returns 0 if rule matches the packet */
+static int filter_match_packet(struct filter_node *rule, struct filter_key *pkt)
 {
-    if (a < b)
-        return -1;
+    int dim;
+    uint32_t width;
+
+    if (rule->family != pkt->family)
+        return 1;
 
-    if (b < a)
+    if (rule->fdev && rule->fdev != pkt->dev)
         return 1;
 
+    for (dim = 0; dim < FILTER_DIMS; dim++) {
+        width = filter_dim_width(rule->family, dim);
+        if (filter_word_cmp(pkt->val[dim], rule->lo[dim], width) < 0)
+            return -1;
+
+        if (filter_word_cmp(pkt->val[dim], rule->hi[dim], width) > 0)
+            return 1;
+    }
     return 0;
 }
 
-static inline int ipfilter_ptr_cmp(void *a, void *b)
-{
-    if (a < b)
-        return -1;
+/**************** RULE COMPILER ****************/
+
+/* Bit-vector classifier. Each dimension is cut into elementary intervals at
+ * every rule boundary; each interval carries a bitmap of the rules that cover
+ * it. A lookup is one binary search per dimension followed by an AND of the
+ * bitmaps; the lowest set bit is the first matching rule.
+ * The bitmaps take O(rules^2) memory, so rules are compiled in groups of
+ * PICO_IPFILTER_GROUP, in insertion order, and a lookup tries the groups in
+ * turn until one matches. That bounds memory at about 1.3 * PICO_IPFILTER_GROUP
+ * bytes per rule, at the cost of one group lookup per PICO_IPFILTER_GROUP rules.
+ * When compiling runs out of memory, rules are matched one by one until the
+ * rule set changes. */
+#ifndef PICO_IPFILTER_GROUP
+#define PICO_IPFILTER_GROUP         (256u)
+#endif
 
-    if (b < a)
-        return 1;
+struct filter_dim {
+    uint32_t n;         /* number of elementary intervals */
+    uint32_t *start;    /* lower bound of each interval, ascending */
+    uint32_t *bits;     /* rule bitmap of each interval */
+};
 
-    return 0;
-}
+struct filter_classifier {
+    uint32_t nrules;
+    uint32_t words;             /* 32-bit words per bitmap */
+    struct filter_node **rules; /* bit index -> rule */
+    struct filter_dim dim[FILTER_DIMS];
+    uint32_t ndev;
+    struct pico_device **dev;   /* devices named by at least one rule */
+    uint32_t *dev_bits;         /* ndev + 1 bitmaps, the last one for any other device */
+};
 
+/* The groups of one family */
+struct filter_set {
+    uint32_t ngroups;
+    struct filter_classifier *group;
+};
 
+static struct filter_set filter_cls[FILTER_FAMILIES];
+static uint32_t filter_count[FILTER_FAMILIES];
+static int filter_dirty = 0;
+static int filter_failed = 0;    /* compiling this rule set failed, don't retry */
 
-static inline int filter_compare_ports(struct filter_node *a, struct filter_node *b)
+static void filter_classifier_free(struct filter_classifier *c)
 {
-    int cmp;
-    cmp = ipfilter_uint16_cmp(a->in_port, b->in_port);
-    if (cmp)
-        return cmp;
+    int dim;
+    for (dim = 0; dim < FILTER_DIMS; dim++) {
+        if (c->dim[dim].start)
+            PICO_FREE(c->dim[dim].start);
 
-    cmp = ipfilter_uint16_cmp(a->out_port, b->out_port);
-    return cmp;
-}
+        if (c->dim[dim].bits)
+            PICO_FREE(c->dim[dim].bits);
+    }
+    if (c->rules)
+        PICO_FREE(c->rules);
 
-static inline int filter_compare_addresses(struct filter_node *a, struct filter_node *b)
-{
-    int cmp;
-    /* Compare source address */
-    cmp = ipfilter_uint32_cmp((a->in_addr & a->in_addr_netmask), (b->in_addr & b->in_addr_netmask));
-    if (cmp)
-        return cmp;
+    if (c->dev)
+        PICO_FREE(c->dev);
 
-    /* Compare destination address */
-    cmp = ipfilter_uint32_cmp((a->out_addr & a->out_addr_netmask), (b->out_addr & b->out_addr_netmask));
-    return cmp;
+    if (c->dev_bits)
+        PICO_FREE(c->dev_bits);
+
+    memset(c, 0, sizeof(struct filter_classifier));
 }
 
-static inline int filter_compare_proto(struct filter_node *a, struct filter_node *b)
+static void filter_set_free(struct filter_set *set)
 {
-    return ipfilter_uint8_cmp(a->proto, b->proto);
+    uint32_t g;
+    for (g = 0; g < set->ngroups; g++)
+        filter_classifier_free(&set->group[g]);
+
+    if (set->group)
+        PICO_FREE(set->group);
+
+    memset(set, 0, sizeof(struct filter_set));
 }
 
-static inline int filter_compare_address_port(struct filter_node *a, struct filter_node *b)
+static inline void filter_bit_set(uint32_t *bits, uint32_t idx)
 {
-    int cmp;
-    cmp = filter_compare_addresses(a, b);
-    if (cmp)
-        return cmp;
-
-    return filter_compare_ports(a, b);
+    bits[idx >> 5] |= (1u << (idx & 31u));
 }
 
-static inline int filter_match_packet_dev(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
+static inline uint32_t filter_lowest_bit(uint32_t m)
 {
-    int cmp;
-    /* 1. Compare devices */
-    if (rule->fdev) {
-        cmp = ipfilter_ptr_cmp(a->fdev, b->fdev);
-        if (cmp)
-            return cmp;
+    uint32_t b = 0;
+    if (!(m & 0xFFFFu)) {
+        m >>= 16;
+        b += 16;
     }
 
-    return 0;
+    if (!(m & 0xFFu)) {
+        m >>= 8;
+        b += 8;
+    }
 
+    while (!(m & 1u)) {
+        m >>= 1;
+        b++;
+    }
+    return b;
 }
 
-static inline int filter_match_packet_proto(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
+/* Sets next to v + 1, returns nonzero on wrap-around */
+static int filter_word_next(uint32_t *next, const uint32_t *v, uint32_t width)
 {
-    int cmp;
-    /* 2. Compare protocol */
-    if (rule->proto) {
-        cmp = filter_compare_proto(a, b);
-        if (cmp)
-            return cmp;
+    uint32_t i = width;
+    memcpy(next, v, width * sizeof(uint32_t));
+    while (i-- > 0) {
+        if (++next[i] != 0)
+            return 0;
     }
-
-    return 0;
-
+    return 1;
 }
-static inline int filter_match_packet_addr_in(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
+
+static void filter_points_sort(uint32_t *p, uint32_t n, uint32_t width)
 {
-    int cmp;
-    /* 3. Compare addresses order: in, out */
-    if (rule->in_addr_netmask) {
-        cmp = ipfilter_uint32_cmp(a->in_addr & rule->in_addr_netmask, b->in_addr & rule->in_addr_netmask);
-        if (cmp)
-            return cmp;
+    uint32_t gap, i, j;
+    uint32_t tmp[FILTER_WORDS];
+
+    for (gap = n >> 1; gap > 0; gap >>= 1) {
+        for (i = gap; i < n; i++) {
+            memcpy(tmp, p + i * width, width * sizeof(uint32_t));
+            for (j = i; j >= gap && filter_word_cmp(p + (j - gap) * width, tmp, width) > 0; j -= gap)
+                memcpy(p + j * width, p + (j - gap) * width, width * sizeof(uint32_t));
+            memcpy(p + j * width, tmp, width * sizeof(uint32_t));
+        }
     }
+}
 
-    return 0;
+static uint32_t filter_dim_find(const struct filter_dim *d, const uint32_t *key, uint32_t width)
+{
+    uint32_t lo = 0, hi = d->n - 1, mid;
+    while (lo < hi) {
+        mid = lo + ((hi - lo + 1) >> 1);
+        if (filter_word_cmp(d->start + mid * width, key, width) <= 0)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
 }
-static inline int filter_match_packet_addr_out(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
+
+static int filter_compile_dim(struct filter_classifier *c, uint8_t family, int dim)
 {
-    int cmp;
-    if (rule->out_addr_netmask) {
-        cmp = ipfilter_uint32_cmp(a->out_addr & rule->out_addr_netmask, b->out_addr & rule->out_addr_netmask);
-        if (cmp) {
-            return cmp;
+    struct filter_dim *d = &c->dim[dim];
+    uint32_t width = filter_dim_width(family, dim);
+    uint32_t i, j, n = 1;
+    struct filter_node *rule;
+
+    d->start = PICO_ZALLOC((2 * c->nrules + 1) * width * sizeof(uint32_t));
+    if (!d->start)
+        return -1;
+
+    /* start[0] is the all-zero point, so every key falls in some interval */
+    for (i = 0; i < c->nrules; i++) {
+        rule = c->rules[i];
+        memcpy(d->start + n * width, rule->lo[dim], width * sizeof(uint32_t));
+        n++;
+        if (!filter_word_next(d->start + n * width, rule->hi[dim], width))
+            n++;
+    }
+    filter_points_sort(d->start, n, width);
+
+    for (i = 1, j = 1; i < n; i++) {
+        if (filter_word_cmp(d->start + i * width, d->start + (j - 1) * width, width) != 0) {
+            if (i != j)
+                memcpy(d->start + j * width, d->start + i * width, width * sizeof(uint32_t));
+            j++;
         }
     }
+    d->n = j;
 
+    d->bits = PICO_ZALLOC(d->n * c->words * sizeof(uint32_t));
+    if (!d->bits)
+        return -1;
+
+    for (i = 0; i < c->nrules; i++) {
+        rule = c->rules[i];
+        for (j = filter_dim_find(d, rule->lo[dim], width);
+             j < d->n && filter_word_cmp(d->start + j * width, rule->hi[dim], width) <= 0; j++)
+            filter_bit_set(d->bits + j * c->words, i);
+    }
     return 0;
 }
-static inline int filter_match_packet_port_in(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
+
+static int filter_compile_dev(struct filter_classifier *c)
 {
-    int cmp;
-    /* 4. Compare ports     order: in, out */
-    if (rule->in_port) {
-        cmp = ipfilter_uint16_cmp(a->in_port, b->in_port);
-        if (cmp)
-            return cmp;
+    uint32_t i, j;
+    struct filter_node *rule;
+
+    c->dev = PICO_ZALLOC((c->nrules + 1) * sizeof(struct pico_device *));
+    if (!c->dev)
+        return -1;
+
+    for (i = 0; i < c->nrules; i++) {
+        rule = c->rules[i];
+        if (!rule->fdev)
+            continue;
+
+        for (j = 0; j < c->ndev && c->dev[j] != rule->fdev; j++) ;
+        if (j == c->ndev)
+            c->dev[c->ndev++] = rule->fdev;
     }
 
+    c->dev_bits = PICO_ZALLOC((c->ndev + 1) * c->words * sizeof(uint32_t));
+    if (!c->dev_bits)
+        return -1;
+
+    for (i = 0; i < c->nrules; i++) {
+        rule = c->rules[i];
+        for (j = 0; j <= c->ndev; j++) {
+            if (!rule->fdev || (j < c->ndev && c->dev[j] == rule->fdev))
+                filter_bit_set(c->dev_bits + j * c->words, i);
+        }
+    }
     return 0;
 }
-static inline int filter_match_packet_port_out(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
+
+static int filter_compile_group(struct filter_classifier *c, uint8_t family)
 {
-    int cmp;
-    if (rule->out_port) {
-        cmp = ipfilter_uint16_cmp(a->out_port, b->out_port);
-        if (cmp)
-            return cmp;
+    int dim;
+
+    c->words = (c->nrules + 31u) >> 5;
+    for (dim = 0; dim < FILTER_DIMS; dim++) {
+        if (filter_compile_dim(c, family, dim) < 0)
+            return -1;
     }
 
-    return 0;
+    return filter_compile_dev(c);
 }
 
-static inline int filter_match_packet_dev_and_proto(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
+static int filter_compile_family(uint8_t family)
 {
-    int cmp = filter_match_packet_dev(a, b, rule);
-    if (cmp)
-        return cmp;
+    struct filter_set *set = &filter_cls[family];
+    struct pico_tree_node *index;
+    struct filter_node *rule;
+    struct filter_classifier *c;
+    uint32_t g, n = 0;
 
-    return filter_match_packet_proto(a, b, rule);
-}
+    filter_set_free(set);
+    if (!filter_count[family])
+        return 0;
 
-static inline int filter_match_packet_addr(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
-{
-    int cmp = filter_match_packet_addr_in(a, b, rule);
-    if (cmp)
-        return cmp;
+    set->ngroups = (filter_count[family] + PICO_IPFILTER_GROUP - 1u) / PICO_IPFILTER_GROUP;
+    set->group = PICO_ZALLOC(set->ngroups * sizeof(struct filter_classifier));
+    if (!set->group) {
+        set->ngroups = 0;
+        return -1;
+    }
 
-    return filter_match_packet_addr_out(a, b, rule);
+    for (g = 0; g < set->ngroups; g++) {
+        set->group[g].rules = PICO_ZALLOC(PICO_IPFILTER_GROUP * sizeof(struct filter_node *));
+        if (!set->group[g].rules)
+            goto fail;
+    }
 
-}
+    pico_tree_foreach(index, &filter_tree) {
+        rule = index->keyValue;
+        if (rule->family != family)
+            continue;
 
-static inline int filter_match_packet_port(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
-{
-    int cmp = filter_match_packet_port_in(a, b, rule);
-    if (cmp)
-        return cmp;
+        c = &set->group[n / PICO_IPFILTER_GROUP];
+        c->rules[c->nrules++] = rule;
+        n++;
+    }
 
-    return filter_match_packet_port_out(a, b, rule);
-}
+    for (g = 0; g < set->ngroups; g++) {
+        if (filter_compile_group(&set->group[g], family) < 0)
+            goto fail;
+    }
 
-static inline struct filter_node *filter_match_packet_find_rule(struct filter_node *a, struct filter_node *b)
-{
-    if (!a->filter_id)
-        return b;
+    return 0;
 
-    return a;
+fail:
+    filter_set_free(set);
+    return -1;
 }
 
-static inline int filter_match_packet(struct filter_node *a, struct filter_node *b)
+static int filter_compile(void)
 {
-    struct filter_node *rule;
-    int cmp = 0;
-    rule = filter_match_packet_find_rule(a, b);
+    uint8_t family;
+    for (family = 0; family < FILTER_FAMILIES; family++) {
+        if (filter_compile_family(family) < 0)
+            return -1;
+    }
+    filter_dirty = 0;
+    return 0;
+}
 
-    cmp = filter_match_packet_dev_and_proto(a, b, rule);
-    if (cmp)
-        return cmp;
+static struct filter_node *filter_classify_group(struct filter_classifier *c, struct filter_key *pkt)
+{
+    const uint32_t *vec[FILTER_DIMS + 1];
+    uint32_t i, m, width;
+    int dim;
 
-    cmp = filter_match_packet_addr(a, b, rule);
-    if (cmp)
-        return cmp;
+    for (dim = 0; dim < FILTER_DIMS; dim++) {
+        width = filter_dim_width(pkt->family, dim);
+        vec[dim] = c->dim[dim].bits + filter_dim_find(&c->dim[dim], pkt->val[dim], width) * c->words;
+    }
 
-    cmp = filter_match_packet_port(a, b, rule);
-    if (cmp)
-        return cmp;
+    for (i = 0; i < c->ndev && c->dev[i] != pkt->dev; i++) ;
+    vec[FILTER_DIMS] = c->dev_bits + i * c->words;
 
-    return 0;
+    for (i = 0; i < c->words; i++) {
+        m = vec[0][i] & vec[1][i] & vec[2][i] & vec[3][i] & vec[4][i] & vec[5][i];
+        if (m)
+            return c->rules[(i << 5) + filter_lowest_bit(m)];
+    }
+    return NULL;
 }
 
-
-int filter_compare(void *filterA, void *filterB)
+static struct filter_node *filter_classify(struct filter_key *pkt)
 {
+    struct filter_set *set = &filter_cls[pkt->family];
+    struct filter_node *rule;
+    uint32_t g;
 
-    struct filter_node *a = (struct filter_node *)filterA;
-    struct filter_node *b = (struct filter_node *)filterB;
-    int cmp = 0;
-    if (a->filter_id == 0 || b->filter_id == 0) {
-        return filter_match_packet(a, b);
+    for (g = 0; g < set->ngroups; g++) {
+        rule = filter_classify_group(&set->group[g], pkt);
+        if (rule)
+            return rule;
     }
+    return NULL;
+}
 
-    /* improve the search */
-    if(a->filter_id == b->filter_id)
-        return 0;
+/* Used while the compiled structure is out of date, e.g. after running out of memory */
+static struct filter_node *filter_classify_linear(struct filter_key *pkt)
+{
+    struct pico_tree_node *index;
+    struct filter_node *rule;
+
+    pico_tree_foreach(index, &filter_tree) {
+        rule = index->keyValue;
+        if (filter_match_packet(rule, pkt) == 0)
+            return rule;
+    }
+    return NULL;
+}
 
-    /* 1. Compare devices */
-    cmp = ipfilter_ptr_cmp(a->fdev, a->fdev);
-    if (cmp)
-        return cmp;
+static void filter_changed(void)
+{
+    filter_dirty = 1;
+    filter_failed = 0;
+}
 
-    /* 2. Compare protocol */
-    cmp = filter_compare_proto(a, b);
-    if(cmp)
-        return cmp;
+static struct filter_node *filter_lookup(struct filter_key *pkt)
+{
+    if (filter_dirty && !filter_failed && (filter_compile() < 0))
+        filter_failed = 1;
 
-    /* 3. Compare addresses order: in, out */
-    /* 4. Compare ports     order: in, out */
-    cmp = filter_compare_address_port(a, b);
+    if (filter_dirty)
+        return filter_classify_linear(pkt);
 
-    return cmp;
+    return filter_classify(pkt);
 }
 
 /**************** FILTER CALLBACKS ****************/
 
 static int fp_priority(struct filter_node *filter, struct pico_frame *f)
 {
-    /* TODO do priority-stuff */
-    IGNORE_PARAMETER(filter);
-    IGNORE_PARAMETER(f);
+    f->priority = filter->priority;
     return 0;
 }
 
@@ -319,6 +499,11 @@ static int fp_reject(struct filter_node *filter, struct pico_frame *f)
 /* TODO check first if sender is pico itself or not */
     IGNORE_PARAMETER(filter);
     ipf_dbg("ipfilter> reject\n");
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(f))
+        (void)pico_icmp6_packet_filtered(f);
+    else
+#endif
     (void)pico_icmp4_packet_filtered(f);
     pico_frame_discard(f);
     return 1;
@@ -332,6 +517,25 @@ static int fp_drop(struct filter_node *filter, struct pico_frame *f)
     return 1;
 }
 
+static uint32_t fp_frame_len(struct pico_frame *f)
+{
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(f))
+        return (uint32_t)short_be(((struct pico_ipv6_hdr *)f->net_hdr)->len) + PICO_SIZE_IP6HDR;
+#endif
+    return short_be(((struct pico_ipv4_hdr *)f->net_hdr)->len);
+}
+
+static int fp_rate_limit(struct filter_node *filter, struct pico_frame *f)
+{
+    if (pico_token_bucket_consume(&filter->policer, fp_frame_len(f), pico_tick) == 0)
+        return 0;
+
+    ipf_dbg("ipfilter> rate limit exceeded\n");
+    pico_frame_discard(f);
+    return 1;
+}
+
 struct fp_function {
     int (*fn)(struct filter_node *filter, struct pico_frame *f);
 };
@@ -341,7 +545,8 @@ static const struct fp_function fp_function[FILTER_COUNT] =
 {
     {&fp_priority},
     {&fp_reject},
-    {&fp_drop}
+    {&fp_drop},
+    {&fp_rate_limit}
 };
 
 static int pico_ipv4_filter_add_validate(int8_t priority, enum filter_action action)
@@ -357,18 +562,134 @@ static int pico_ipv4_filter_add_validate(int8_t priority, enum filter_action act
     return 0;
 }
 
+/**************** RULE CONVERSION ****************/
+
+static inline uint32_t filter_prefix_mask(uint8_t prefix, uint32_t word)
+{
+    int bits = (int)prefix - (int)(word << 5);
+    if (bits <= 0)
+        return 0u;
+
+    if (bits >= 32)
+        return 0xFFFFFFFFu;
+
+    return ~(0xFFFFFFFFu >> bits);
+}
+
+static int filter_rule_addr(struct filter_node *node, int dim, const union pico_address *addr, uint8_t prefix)
+{
+    uint32_t width = filter_dim_width(node->family, dim);
+    uint32_t i, mask, v;
+
+    if (prefix > (width << 5))
+        return -1;
+
+    for (i = 0; i < width; i++) {
+        if (node->family == FILTER_FAMILY_IPV4) {
+            v = long_be(addr->ip4.addr);
+        } else {
+            const uint8_t *b = &addr->ip6.addr[i << 2];
+            v = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | (uint32_t)b[3];
+        }
+
+        mask = filter_prefix_mask(prefix, i);
+        node->lo[dim][i] = v & mask;
+        node->hi[dim][i] = v | ~mask;
+    }
+    return 0;
+}
+
+static void filter_rule_range(struct filter_node *node, int dim, uint32_t min, uint32_t max, uint32_t any)
+{
+    if (!min && !max) {
+        max = any;
+    } else if (max < min) {
+        max = min;
+    }
+
+    node->lo[dim][0] = min;
+    node->hi[dim][0] = max;
+}
+
+static int filter_rule_convert(const struct pico_ipfilter_rule *rule, struct filter_node *node)
+{
+    if (rule->net == PICO_PROTO_IPV4) {
+        node->family = FILTER_FAMILY_IPV4;
+    }
+#ifdef PICO_SUPPORT_IPV6
+    else if (rule->net == PICO_PROTO_IPV6) {
+        node->family = FILTER_FAMILY_IPV6;
+    }
+#endif
+    else {
+        return -1;
+    }
+
+    node->fdev = rule->dev;
+    filter_rule_range(node, FILTER_DIM_PROTO, rule->proto, rule->proto, 0xFFu);
+    filter_rule_range(node, FILTER_DIM_SPORT, rule->sport_min, rule->sport_max, 0xFFFFu);
+    filter_rule_range(node, FILTER_DIM_DPORT, rule->dport_min, rule->dport_max, 0xFFFFu);
+    if (filter_rule_addr(node, FILTER_DIM_SRC, &rule->src, rule->src_prefix) < 0)
+        return -1;
+
+    if (filter_rule_addr(node, FILTER_DIM_DST, &rule->dst, rule->dst_prefix) < 0)
+        return -1;
+
+    node->priority = rule->priority;
+    node->tos = rule->tos;
+    node->function_ptr = fp_function[rule->action].fn;
+    if (rule->action == FILTER_RATE_LIMIT) {
+        if (!rule->rate)
+            return -1;
+
+        pico_token_bucket_init(&node->policer, rule->rate, rule->burst, pico_tick);
+    }
+
+    return 0;
+}
+
+static struct filter_node *filter_find_duplicate(struct filter_node *node)
+{
+    struct pico_tree_node *index;
+    struct filter_node *rule;
+
+    pico_tree_foreach(index, &filter_tree) {
+        rule = index->keyValue;
+        if (rule->family == node->family && rule->fdev == node->fdev &&
+            rule->priority == node->priority && rule->tos == node->tos &&
+            rule->function_ptr == node->function_ptr &&
+            rule->policer.rate == node->policer.rate && rule->policer.burst == node->policer.burst &&
+            memcmp(rule->lo, node->lo, sizeof(node->lo)) == 0 &&
+            memcmp(rule->hi, node->hi, sizeof(node->hi)) == 0)
+            return rule;
+    }
+    return NULL;
+}
+
+static int filter_netmask_to_prefix(uint32_t netmask, uint8_t *prefix)
+{
+    uint32_t m = long_be(netmask);
+    uint32_t inv = ~m;
+
+    /* only contiguous netmasks can be expressed as a prefix */
+    if (inv & (inv + 1u))
+        return -1;
+
+    *prefix = 0;
+    while (m & 0x80000000u) {
+        (*prefix)++;
+        m <<= 1;
+    }
+    return 0;
+}
 
 /**************** FILTER API's ****************/
-uint32_t pico_ipv4_filter_add(struct pico_device *dev, uint8_t proto,
-                              struct pico_ip4 *out_addr, struct pico_ip4 *out_addr_netmask,
-                              struct pico_ip4 *in_addr, struct pico_ip4 *in_addr_netmask,
-                              uint16_t out_port, uint16_t in_port, int8_t priority,
-                              uint8_t tos, enum filter_action action)
+uint32_t pico_ipfilter_add(const struct pico_ipfilter_rule *rule)
 {
-    static uint32_t filter_id = 1u; /* 0 is a special value used in the binary-tree search for packets being processed */
-    struct filter_node *new_filter;
+    static uint32_t filter_id = 1u;
+    struct filter_node *new_filter, *dup;
 
-    if (pico_ipv4_filter_add_validate(priority, action) < 0) {
+    if (!rule || pico_ipv4_filter_add_validate(rule->priority, rule->action) < 0) {
         pico_err = PICO_ERR_EINVAL;
         return 0;
     }
@@ -379,30 +700,32 @@ uint32_t pico_ipv4_filter_add(struct pico_device *dev, uint8_t proto,
         return 0;
     }
 
-    new_filter->fdev = dev;
-    new_filter->proto = proto;
-    new_filter->out_addr = (!out_addr) ? (0U) : (out_addr->addr);
-    new_filter->out_addr_netmask = (!out_addr_netmask) ? (0U) : (out_addr_netmask->addr);
-    new_filter->in_addr = (!in_addr) ? (0U) : (in_addr->addr);
-    new_filter->in_addr_netmask = (!in_addr_netmask) ? (0U) : (in_addr_netmask->addr);
-    new_filter->out_port = out_port;
-    new_filter->in_port = in_port;
-    new_filter->priority = priority;
-    new_filter->tos = tos;
-    new_filter->filter_id = filter_id++;
-    new_filter->function_ptr = fp_function[action].fn;
+    if (filter_rule_convert(rule, new_filter) < 0) {
+        PICO_FREE(new_filter);
+        pico_err = PICO_ERR_EINVAL;
+        return 0;
+    }
 
-    if(pico_tree_insert(&filter_tree, new_filter))
-    {
+    /* Adding the same rule twice returns the existing one */
+    dup = filter_find_duplicate(new_filter);
+    if (dup) {
+        PICO_FREE(new_filter);
+        return dup->filter_id;
+    }
+
+    new_filter->filter_id = filter_id++;
+    if (pico_tree_insert(&filter_tree, new_filter)) {
         PICO_FREE(new_filter);
         filter_id--;
         return 0;
     }
 
+    filter_count[new_filter->family]++;
+    filter_changed();
     return new_filter->filter_id;
 }
 
-int pico_ipv4_filter_del(uint32_t filter_id)
+int pico_ipfilter_del(uint32_t filter_id)
 {
     struct filter_node *node = NULL;
     struct filter_node dummy = {
@@ -413,52 +736,161 @@ int pico_ipv4_filter_del(uint32_t filter_id)
     if((node = pico_tree_delete(&filter_tree, &dummy)) == NULL)
     {
         ipf_dbg("ipfilter> failed to delete filter :%d\n", filter_id);
+        pico_err = PICO_ERR_EINVAL;
         return -1;
     }
 
+    filter_count[node->family]--;
+    filter_changed();
     PICO_FREE(node);
     return 0;
 }
 
-static int ipfilter_apply_filter(struct pico_frame *f, struct filter_node *pkt)
+int pico_ipfilter_hits(uint32_t filter_id, uint32_t *hits)
 {
-    struct filter_node *filter_frame = NULL;
-    filter_frame = pico_tree_findKey(&filter_tree, pkt);
-    if(filter_frame)
-    {
-        filter_frame->function_ptr(filter_frame, f);
-        return 1;
+    struct filter_node *node = NULL;
+    struct filter_node dummy = {
+        0
+    };
+
+    dummy.filter_id = filter_id;
+    node = pico_tree_findKey(&filter_tree, &dummy);
+    if (!node || !hits) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
     }
 
+    *hits = node->hits;
     return 0;
 }
 
-int ipfilter(struct pico_frame *f)
+uint32_t pico_ipv4_filter_add(struct pico_device *dev, uint8_t proto,
+                              struct pico_ip4 *out_addr, struct pico_ip4 *out_addr_netmask,
+                              struct pico_ip4 *in_addr, struct pico_ip4 *in_addr_netmask,
+                              uint16_t out_port, uint16_t in_port, int8_t priority,
+                              uint8_t tos, enum filter_action action)
+{
+    struct pico_ipfilter_rule rule;
+
+    memset(&rule, 0, sizeof(rule));
+    rule.dev = dev;
+    rule.net = PICO_PROTO_IPV4;
+    rule.proto = proto;
+    if (out_addr)
+        rule.dst.ip4 = *out_addr;
+
+    if (in_addr)
+        rule.src.ip4 = *in_addr;
+
+    if ((out_addr_netmask && filter_netmask_to_prefix(out_addr_netmask->addr, &rule.dst_prefix) < 0) ||
+        (in_addr_netmask && filter_netmask_to_prefix(in_addr_netmask->addr, &rule.src_prefix) < 0)) {
+        pico_err = PICO_ERR_EINVAL;
+        return 0;
+    }
+
+    rule.dport_min = out_port;
+    rule.sport_min = in_port;
+    rule.priority = priority;
+    rule.tos = tos;
+    rule.action = action;
+    return pico_ipfilter_add(&rule);
+}
+
+int pico_ipv4_filter_del(uint32_t filter_id)
+{
+    return pico_ipfilter_del(filter_id);
+}
+
+/**************** PACKET CLASSIFICATION ****************/
+
+static int ipfilter_key_ipv4(struct pico_frame *f, struct filter_key *pkt)
 {
-    struct filter_node temp;
     struct pico_ipv4_hdr *ipv4_hdr = (struct pico_ipv4_hdr *) f->net_hdr;
     struct pico_trans *trans;
     struct pico_icmp4_hdr *icmp_hdr;
 
-    memset(&temp, 0u, sizeof(struct filter_node));
-
-    temp.fdev = f->dev;
-    temp.out_addr = ipv4_hdr->dst.addr;
-    temp.in_addr = ipv4_hdr->src.addr;
     if ((ipv4_hdr->proto == PICO_PROTO_TCP) || (ipv4_hdr->proto == PICO_PROTO_UDP)) {
         trans = (struct pico_trans *) f->transport_hdr;
-        temp.out_port = short_be(trans->dport);
-        temp.in_port = short_be(trans->sport);
+        pkt->val[FILTER_DIM_DPORT][0] = short_be(trans->dport);
+        pkt->val[FILTER_DIM_SPORT][0] = short_be(trans->sport);
     }
     else if(ipv4_hdr->proto == PICO_PROTO_ICMP4) {
         icmp_hdr = (struct pico_icmp4_hdr *) f->transport_hdr;
         if(icmp_hdr->type == PICO_ICMP_UNREACH && icmp_hdr->code == PICO_ICMP_UNREACH_FILTER_PROHIB)
-            return 0;
+            return -1;
     }
 
-    temp.proto = ipv4_hdr->proto;
-    temp.priority = f->priority;
-    temp.tos = ipv4_hdr->tos;
-    return ipfilter_apply_filter(f, &temp);
+    pkt->family = FILTER_FAMILY_IPV4;
+    pkt->val[FILTER_DIM_PROTO][0] = ipv4_hdr->proto;
+    pkt->val[FILTER_DIM_SRC][0] = long_be(ipv4_hdr->src.addr);
+    pkt->val[FILTER_DIM_DST][0] = long_be(ipv4_hdr->dst.addr);
+    return 0;
+}
+
+#ifdef PICO_SUPPORT_IPV6
+static void ipfilter_key_ip6(uint32_t *val, const struct pico_ip6 *a)
+{
+    uint32_t i;
+    const uint8_t *b;
+    for (i = 0; i < FILTER_WORDS; i++) {
+        b = &a->addr[i << 2];
+        val[i] = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | (uint32_t)b[3];
+    }
 }
 
+static int ipfilter_key_ipv6(struct pico_frame *f, struct filter_key *pkt)
+{
+    struct pico_ipv6_hdr *ipv6_hdr = (struct pico_ipv6_hdr *) f->net_hdr;
+    struct pico_trans *trans;
+    struct pico_icmp6_hdr *icmp_hdr;
+    /* on input the extension headers have been walked already */
+    uint8_t proto = (f->proto) ? (f->proto) : (ipv6_hdr->nxthdr);
+
+    if ((proto == PICO_PROTO_TCP) || (proto == PICO_PROTO_UDP)) {
+        trans = (struct pico_trans *) f->transport_hdr;
+        pkt->val[FILTER_DIM_DPORT][0] = short_be(trans->dport);
+        pkt->val[FILTER_DIM_SPORT][0] = short_be(trans->sport);
+    }
+    else if (proto == PICO_PROTO_ICMP6) {
+        icmp_hdr = (struct pico_icmp6_hdr *) f->transport_hdr;
+        if (icmp_hdr->type == PICO_ICMP6_DEST_UNREACH && icmp_hdr->code == PICO_ICMP6_UNREACH_ADMIN)
+            return -1;
+    }
+
+    pkt->family = FILTER_FAMILY_IPV6;
+    pkt->val[FILTER_DIM_PROTO][0] = proto;
+    ipfilter_key_ip6(pkt->val[FILTER_DIM_SRC], &ipv6_hdr->src);
+    ipfilter_key_ip6(pkt->val[FILTER_DIM_DST], &ipv6_hdr->dst);
+    return 0;
+}
+#endif
+
+int ipfilter(struct pico_frame *f)
+{
+    struct filter_key pkt;
+    struct filter_node *rule;
+    int ret = -1;
+
+    if (!filter_count[FILTER_FAMILY_IPV4] && !filter_count[FILTER_FAMILY_IPV6])
+        return 0;
+
+    memset(&pkt, 0u, sizeof(struct filter_key));
+    pkt.dev = f->dev;
+    if (IS_IPV4(f))
+        ret = ipfilter_key_ipv4(f, &pkt);
+
+#ifdef PICO_SUPPORT_IPV6
+    else if (IS_IPV6(f))
+        ret = ipfilter_key_ipv6(f, &pkt);
+#endif
+
+    if (ret < 0 || !filter_count[pkt.family])
+        return 0;
+
+    rule = filter_lookup(&pkt);
+    if (!rule)
+        return 0;
+
+    rule->hits++;
+    return rule->function_ptr(rule, f);
+}
@@ -8,14 +8,49 @@
 #define INCLUDE_PICO_IPFILTER
 
 #include "pico_device.h"
+#include "pico_addressing.h"
+#include "pico_token_bucket.h"
 
 enum filter_action {
     FILTER_PRIORITY = 0,
     FILTER_REJECT,
     FILTER_DROP,
+    FILTER_RATE_LIMIT,
     FILTER_COUNT
 };
 
+/* Filter rule for IPv4 or IPv6 traffic. Zeroed fields are wildcards:
+ * a prefix length of 0 matches any address, a port range of 0-0 matches
+ * any port and a max port below min selects the single port min.
+ * Ports are in host byte order. When several rules match a packet,
+ * the one added first is applied.
+ * FILTER_PRIORITY sets the priority of the matching frames, which selects
+ * their band in the device queueing discipline. FILTER_RATE_LIMIT polices
+ * the matching traffic to 'rate' bytes per second with a bucket of 'burst'
+ * bytes (one second worth of traffic if 0) and drops the excess. */
+struct pico_ipfilter_rule {
+    struct pico_device *dev;
+    uint16_t net;           /* PICO_PROTO_IPV4 or PICO_PROTO_IPV6 */
+    uint8_t proto;
+    union pico_address src;
+    uint8_t src_prefix;
+    union pico_address dst;
+    uint8_t dst_prefix;
+    uint16_t sport_min;
+    uint16_t sport_max;
+    uint16_t dport_min;
+    uint16_t dport_max;
+    int8_t priority;
+    uint8_t tos;
+    enum filter_action action;
+    uint32_t rate;
+    uint32_t burst;
+};
+
+uint32_t pico_ipfilter_add(const struct pico_ipfilter_rule *rule);
+int pico_ipfilter_del(uint32_t filter_id);
+int pico_ipfilter_hits(uint32_t filter_id, uint32_t *hits);
+
 uint32_t pico_ipv4_filter_add(struct pico_device *dev, uint8_t proto,
                               struct pico_ip4 *out_addr, struct pico_ip4 *out_addr_netmask, struct pico_ip4 *in_addr,
                               struct pico_ip4 *in_addr_netmask, uint16_t out_port, uint16_t in_port,
@@ -26,4 +61,3 @@ int pico_ipv4_filter_del(uint32_t filter_id);
 int ipfilter(struct pico_frame *f);
 
 #endif /* _INCLUDE_PICO_IPFILTER */
-
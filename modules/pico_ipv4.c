@@ -24,6 +24,7 @@
 #include "pico_fragments.h"
 #include "pico_ethernet.h"
 #include "pico_mcast.h"
+#include "pico_pmtu.h"
 
 #ifdef PICO_SUPPORT_IPV4
 
@@ -49,7 +50,7 @@ static struct pico_queue out = {
 };
 
 /* Functions */
-static int ipv4_route_compare(void *ka, void *kb);
+static inline int ipv4_route_compare(struct pico_ipv4_route *a, struct pico_ipv4_route *b);
 static struct pico_frame *pico_ipv4_alloc(struct pico_protocol *self, struct pico_device *dev, uint16_t size);
 
 
@@ -469,7 +470,17 @@ static int pico_ipv4_process_in(struct pico_protocol *self, struct pico_frame *f
     return 0;
 }
 
-PICO_TREE_DECLARE(Routes, ipv4_route_compare);
+PICO_RB_GENERATE(ipv4_routes, struct pico_ipv4_route, node, ipv4_route_compare)
+
+struct pico_rb_tree Routes = PICO_RB_TREE_INIT;
+
+/* Bumped whenever routes or links change, lets the datalink layer cache next hops */
+static uint32_t ipv4_route_gen;
+
+uint32_t pico_ipv4_route_generation(void)
+{
+    return ipv4_route_gen;
+}
 
 
 static int pico_ipv4_process_out(struct pico_protocol *self, struct pico_frame *f)
@@ -524,9 +535,8 @@ struct pico_protocol pico_proto_ipv4 = {
 };
 
 
-static int ipv4_route_compare(void *ka, void *kb)
+static inline int ipv4_route_compare(struct pico_ipv4_route *a, struct pico_ipv4_route *b)
 {
-    struct pico_ipv4_route *a = ka, *b = kb;
     uint32_t a_nm, b_nm;
     int cmp;
 
@@ -571,15 +581,13 @@ static struct pico_ipv4_route *route_find_default_bcast(void)
 static struct pico_ipv4_route *route_find(const struct pico_ip4 *addr)
 {
     struct pico_ipv4_route *r;
-    struct pico_tree_node *index;
 
     if (addr->addr == PICO_IP4_ANY) {
         return NULL;
     }
 
     if (addr->addr != PICO_IP4_BCAST) {
-        pico_tree_foreach_reverse(index, &Routes) {
-            r = index->keyValue;
+        for (r = ipv4_routes_last(&Routes); r; r = ipv4_routes_prev(r)) {
             if ((addr->addr & (r->netmask.addr)) == (r->dest.addr)) {
                 return r;
             }
@@ -944,11 +952,9 @@ struct pico_ipv4_link *pico_ipv4_get_default_mcastlink(void)
 void dbg_route(void)
 {
     struct pico_ipv4_route *r;
-    struct pico_tree_node *index;
     int count_hosts = 0;
     dbg("==== ROUTING TABLE =====\n");
-    pico_tree_foreach(index, &Routes) {
-        r = index->keyValue;
+    for (r = ipv4_routes_first(&Routes); r; r = ipv4_routes_next(r)) {
         dbg("Route to %08x/%08x, gw %08x, dev: %s, metric: %d\n", r->dest.addr, r->netmask.addr, r->gateway.addr, r->link->dev->name, r->metric);
         if (r->netmask.addr == 0xFFFFFFFF)
             count_hosts++;
@@ -1118,7 +1124,7 @@ int pico_ipv4_frame_push(struct pico_frame *f, struct pico_ip4 *dst, uint8_t pro
     }
 #endif
 
-    if (pico_ipv4_link_get(&hdr->dst)) {
+    if (pico_ipv4_link_get(&hdr->dst) && !PICO_DEV_IS_HAIRPIN(f->dev)) {
         /* it's our own IP */
         retval = pico_enqueue(&in, f);
         if (retval > 0)
@@ -1164,7 +1170,7 @@ int MOCKABLE pico_ipv4_route_add(struct pico_ip4 address, struct pico_ip4 netmas
     test.netmask.addr = netmask.addr;
     test.metric = (uint32_t)metric;
 
-    if (pico_tree_findKey(&Routes, &test)) {
+    if (ipv4_routes_find(&Routes, &test)) {
         pico_err = PICO_ERR_EINVAL;
         return -1;
     }
@@ -1205,12 +1211,13 @@ int MOCKABLE pico_ipv4_route_add(struct pico_ip4 address, struct pico_ip4 netmas
         return -1;
     }
 
-    if (pico_tree_insert(&Routes, new)) {
+    if (ipv4_routes_insert(&Routes, new)) {
         dbg("IPv4: Failed to insert route in tree\n");
         PICO_FREE(new);
 		return -1;
 	}
 
+    ipv4_route_gen++;
     dbg_route();
     return 0;
 }
@@ -1223,11 +1230,12 @@ int pico_ipv4_route_del(struct pico_ip4 address, struct pico_ip4 netmask, int me
     test.netmask.addr = netmask.addr;
     test.metric = (uint32_t)metric;
 
-    found = pico_tree_findKey(&Routes, &test);
+    found = ipv4_routes_find(&Routes, &test);
     if (found) {
 
-        pico_tree_delete(&Routes, found);
+        ipv4_routes_remove(&Routes, found);
         PICO_FREE(found);
+        ipv4_route_gen++;
 
         dbg_route();
         return 0;
@@ -1296,6 +1304,7 @@ int pico_ipv4_link_add(struct pico_device *dev, struct pico_ip4 address, struct
 		return -1;
 	}
 
+    ipv4_route_gen++;
 #ifdef PICO_SUPPORT_MCAST
     do {
         struct pico_ip4 mcast_all_hosts, mcast_addr, mcast_nm, mcast_gw;
@@ -1325,11 +1334,10 @@ int pico_ipv4_link_add(struct pico_device *dev, struct pico_ip4 address, struct
 
 static int pico_ipv4_cleanup_routes(struct pico_ipv4_link *link)
 {
-    struct pico_tree_node *index = NULL, *tmp = NULL;
-    struct pico_ipv4_route *route = NULL;
+    struct pico_ipv4_route *route = NULL, *next = NULL;
 
-    pico_tree_foreach_safe(index, &Routes, tmp) {
-        route = index->keyValue;
+    for (route = ipv4_routes_first(&Routes); route; route = next) {
+        next = ipv4_routes_next(route);
         if (link == route->link)
             pico_ipv4_route_del(route->dest, route->netmask, (int)route->metric);
     }
@@ -1384,6 +1392,7 @@ int pico_ipv4_link_del(struct pico_device *dev, struct pico_ip4 address)
 
     pico_ipv4_cleanup_routes(found);
     pico_tree_delete(&Tree_dev_link, found);
+    ipv4_route_gen++;
     if (default_bcast_route.link == found)
         default_bcast_route.link = NULL;
 
@@ -1641,6 +1650,45 @@ void pico_ipv4_unreachable(struct pico_frame *f, int err)
 #endif
 }
 
+#ifdef PICO_SUPPORT_PMTU
+/* ICMP "fragmentation needed", f->net_hdr is the header of our packet */
+void pico_ipv4_pkt_too_big(struct pico_frame *f, uint16_t mtu)
+{
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *) f->net_hdr;
+    union pico_address dst;
+    struct pico_ip4 src;
+
+    if (f->transport_len < (PICO_ICMPHDR_UN_SIZE + PICO_SIZE_IP4HDR + 8u)) {
+        pico_frame_discard(f);
+        return;
+    }
+
+    /* RFC 1191 5: routers not reporting the next-hop MTU */
+    if (mtu == 0)
+        mtu = (uint16_t)pico_pmtu_plateau(short_be(hdr->len));
+
+    /* Not our packet, or no smaller than what went out */
+    src.addr = hdr->src.addr;
+    if (!pico_ipv4_link_get(&src) || (mtu >= short_be(hdr->len))) {
+        pico_frame_discard(f);
+        return;
+    }
+
+    dst.ip4 = hdr->dst;
+    if (pico_pmtu_lower(PICO_PROTO_IPV4, &dst, mtu) < 0) {
+        pico_frame_discard(f);
+        return;
+    }
+
+#if defined PICO_SUPPORT_TCP || defined PICO_SUPPORT_UDP
+    f->transport_hdr = ((uint8_t *)f->net_hdr) + PICO_SIZE_IP4HDR;
+    pico_transport_pmtu_update(f, hdr->proto);
+#else
+    pico_frame_discard(f);
+#endif
+}
+#endif
+
 int pico_ipv4_cleanup_links(struct pico_device *dev)
 {
     struct pico_tree_node *index = NULL, *_tmp = NULL;
@@ -70,6 +70,7 @@ struct pico_ipv4_link
 
 struct pico_ipv4_route
 {
+    struct pico_rb_node node; /* in Routes */
     struct pico_ip4 dest;
     struct pico_ip4 netmask;
     struct pico_ip4 gateway;
@@ -77,7 +78,7 @@ struct pico_ipv4_route
     uint32_t metric;
 };
 
-extern struct pico_tree Routes;
+extern struct pico_rb_tree Routes;
 
 
 int pico_ipv4_compare(struct pico_ip4 *a, struct pico_ip4 *b);
@@ -104,8 +105,10 @@ struct pico_device *pico_ipv4_source_dev_find(const struct pico_ip4 *dst);
 int pico_ipv4_route_add(struct pico_ip4 address, struct pico_ip4 netmask, struct pico_ip4 gateway, int metric, struct pico_ipv4_link *link);
 int pico_ipv4_route_del(struct pico_ip4 address, struct pico_ip4 netmask, int metric);
 struct pico_ip4 pico_ipv4_route_get_gateway(struct pico_ip4 *addr);
+uint32_t pico_ipv4_route_generation(void);
 void pico_ipv4_route_set_bcast_link(struct pico_ipv4_link *link);
 void pico_ipv4_unreachable(struct pico_frame *f, int err);
+void pico_ipv4_pkt_too_big(struct pico_frame *f, uint16_t mtu);
 
 int pico_ipv4_mcast_join(struct pico_ip4 *mcast_link, struct pico_ip4 *mcast_group, uint8_t reference_count, uint8_t filter_mode, struct pico_tree *MCASTFilter);
 int pico_ipv4_mcast_leave(struct pico_ip4 *mcast_link, struct pico_ip4 *mcast_group, uint8_t reference_count, uint8_t filter_mode, struct pico_tree *MCASTFilter);
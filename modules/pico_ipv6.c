@@ -21,6 +21,8 @@
 #include "pico_6lowpan_ll.h"
 #include "pico_mld.h"
 #include "pico_mcast.h"
+#include "pico_ipfilter.h"
+#include "pico_pmtu.h"
 #ifdef PICO_SUPPORT_IPV6
 
 
@@ -114,9 +116,8 @@ static inline int ipv6_compare_metric(struct pico_ipv6_route *a, struct pico_ipv
     return 0;
 }
 
-static int ipv6_route_compare(void *ka, void *kb)
+static inline int ipv6_route_compare(struct pico_ipv6_route *a, struct pico_ipv6_route *b)
 {
-    struct pico_ipv6_route *a = ka, *b = kb;
     int ret;
 
     /* Routes are sorted by (host side) netmask len, then by addr, then by metric. */
@@ -132,8 +133,8 @@ static int ipv6_route_compare(void *ka, void *kb)
 
 }
 
-static PICO_TREE_DECLARE(Tree_dev_ip6_link, ipv6_link_compare);
-PICO_TREE_DECLARE(IPV6Routes, ipv6_route_compare);
+PICO_RB_GENERATE(ipv6_routes, struct pico_ipv6_route, node, ipv6_route_compare)
+struct pico_rb_tree IPV6Routes = PICO_RB_TREE_INIT;
 static PICO_TREE_DECLARE(IPV6Links, ipv6_link_compare);
 
 static char pico_ipv6_dec_to_char(uint8_t u)
@@ -397,15 +398,13 @@ int pico_ipv6_is_unspecified(const uint8_t addr[PICO_SIZE_IP6])
 
 static struct pico_ipv6_route *pico_ipv6_route_find(const struct pico_ip6 *addr)
 {
-    struct pico_tree_node *index = NULL;
     struct pico_ipv6_route *r = NULL;
     int i = 0;
     if (!pico_ipv6_is_localhost(addr->addr) && (pico_ipv6_is_linklocal(addr->addr)  || pico_ipv6_is_sitelocal(addr->addr)))    {
         return NULL;
     }
 
-    pico_tree_foreach_reverse(index, &IPV6Routes) {
-        r = index->keyValue;
+    for (r = ipv6_routes_last(&IPV6Routes); r; r = ipv6_routes_prev(r)) {
         for (i = 0; i < PICO_SIZE_IP6; ++i) {
             if ((addr->addr[i] & (r->netmask.addr[i])) != ((r->dest.addr[i]) & (r->netmask.addr[i]))) {
                 break;
@@ -660,17 +659,26 @@ static int pico_ipv6_check_headers_sequence(struct pico_frame *f)
 {
     struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
     int ptr = sizeof(struct pico_ipv6_hdr);
+    int end = ptr + short_be(hdr->len);
     int cur_nexthdr = 6; /* Starts with nexthdr field in ipv6 pkt */
     uint8_t nxthdr = hdr->nxthdr;
+    uint16_t optlen;
+
+    /* Never walk past the buffer, whatever the payload length claims */
+    if (f->net_hdr + end > f->buffer + f->buffer_len)
+        end = (int)(f->buffer + f->buffer_len - f->net_hdr);
+
     for (;; ) {
-        uint8_t optlen = *(f->net_hdr + ptr + 1);
         switch (nxthdr) {
         case PICO_IPV6_EXTHDR_DESTOPT:
         case PICO_IPV6_EXTHDR_ROUTING:
         case PICO_IPV6_EXTHDR_HOPBYHOP:
         case PICO_IPV6_EXTHDR_ESP:
         case PICO_IPV6_EXTHDR_AUTH:
-            optlen = (uint8_t)IPV6_OPTLEN(optlen);
+            if (ptr + 2 > end)
+                return -1;
+
+            optlen = IPV6_OPTLEN(*(f->net_hdr + ptr + 1));
             break;
         case PICO_IPV6_EXTHDR_FRAG:
             optlen = 8;
@@ -687,6 +695,10 @@ static int pico_ipv6_check_headers_sequence(struct pico_frame *f)
             pico_icmp6_parameter_problem(f, PICO_ICMP6_PARAMPROB_NXTHDR, (uint32_t)cur_nexthdr);
             return -1;
         }
+        /* Header runs past the payload length */
+        if (ptr + optlen > end)
+            return -1;
+
         cur_nexthdr = ptr;
         nxthdr = *(f->net_hdr + ptr);
         ptr += optlen;
@@ -861,6 +873,14 @@ static int pico_ipv6_process_in(struct pico_protocol *self, struct pico_frame *f
     f->proto = (uint8_t)proto;
     ipv6_dbg("IPv6: payload %u net_len %u nxthdr %u\n", short_be(hdr->len), f->net_len, proto);
 
+#ifdef PICO_SUPPORT_IPFILTER
+    if (ipfilter(f)) {
+        /*pico_frame is discarded as result of the filtering*/
+        return 0;
+    }
+
+#endif
+
     if (pico_ipv6_is_unicast(&hdr->dst)) {
         pico_transport_receive(f, f->proto);
     } else if (pico_ipv6_is_multicast(hdr->dst.addr)) {
@@ -879,6 +899,13 @@ static int pico_ipv6_process_out(struct pico_protocol *self, struct pico_frame *
     IGNORE_PARAMETER(self);
 
     f->start = (uint8_t*)f->net_hdr;
+#ifdef PICO_SUPPORT_IPFILTER
+    if (ipfilter(f)) {
+        /*pico_frame is discarded as result of the filtering*/
+        return 0;
+    }
+
+#endif
 
     return pico_datalink_send(f);
 }
@@ -1152,7 +1179,7 @@ static int pico_ipv6_mcast_filter(struct pico_frame *f)
 #endif
     test.mcast_addr.ip6 = hdr->dst;
 
-    pico_tree_foreach(index, &Tree_dev_ip6_link) {
+    pico_tree_foreach(index, &IPV6Links) {
         link = index->keyValue;
         g = pico_tree_findKey(link->MCASTGroups, &test);
         if (g) {
@@ -1459,13 +1486,11 @@ struct pico_protocol pico_proto_ipv6 = {
 static void pico_ipv6_dbg_route(void)
 {
     struct pico_ipv6_route *r;
-    struct pico_tree_node *index;
     char ipv6_addr[PICO_IPV6_STRING];
     char netmask_addr[PICO_IPV6_STRING];
     char gateway_addr[PICO_IPV6_STRING];
 
-    pico_tree_foreach(index, &Routes){
-        r = index->keyValue;
+    for (r = ipv6_routes_first(&IPV6Routes); r; r = ipv6_routes_next(r)) {
         pico_ipv6_to_string(ipv6_addr, r->dest.addr);
         pico_ipv6_to_string(netmask_addr, r->netmask.addr);
         pico_ipv6_to_string(gateway_addr, r->gateway.addr);
@@ -1498,11 +1523,9 @@ struct pico_ipv6_route *pico_ipv6_gateway_by_dev(struct pico_device *dev)
 {
     struct pico_ipv6_link *link = pico_ipv6_link_by_dev(dev);
     struct pico_ipv6_route *route = NULL;
-    struct pico_tree_node *node = NULL;
 
     /* Iterate over the IPv6-routes */
-    pico_tree_foreach(node, &IPV6Routes) {
-        route = (struct pico_ipv6_route *)node->keyValue;
+    for (route = ipv6_routes_first(&IPV6Routes); route; route = ipv6_routes_next(route)) {
         /* If the route is a default router, specified by the gw being set */
         if (!pico_ipv6_is_unspecified(route->gateway.addr) && pico_ipv6_is_unspecified(route->netmask.addr)) {
             /* Iterate over device's links */
@@ -1522,14 +1545,12 @@ struct pico_ipv6_route *pico_ipv6_gateway_by_dev_next(struct pico_device *dev, s
 {
     struct pico_ipv6_link *link = NULL;
     struct pico_ipv6_route *gw = NULL;
-    struct pico_tree_node *i = NULL;
     int valid = 0;
 
     if (last == NULL)
         valid = 1;
 
-    pico_tree_foreach(i, &IPV6Routes) {
-        gw = (struct pico_ipv6_route *)i->keyValue;
+    for (gw = ipv6_routes_first(&IPV6Routes); gw; gw = ipv6_routes_next(gw)) {
         /* If the route is a default router, specified by the gw being set */
         if (!pico_ipv6_is_unspecified(gw->gateway.addr) && pico_ipv6_is_unspecified(gw->netmask.addr)) {
             /* Iterate over device's links */
@@ -1557,7 +1578,7 @@ int pico_ipv6_route_add(struct pico_ip6 address, struct pico_ip6 netmask, struct
     test.dest = address;
     test.netmask = netmask;
     test.metric = (uint32_t)metric;
-    if (pico_tree_findKey(&IPV6Routes, &test)) {
+    if (ipv6_routes_find(&IPV6Routes, &test)) {
         /* Route already exists */
         pico_err = PICO_ERR_EINVAL;
         return -1;
@@ -1601,7 +1622,7 @@ int pico_ipv6_route_add(struct pico_ip6 address, struct pico_ip6 netmask, struct
         return -1;
     }
 
-    if (pico_tree_insert(&IPV6Routes, new)) {
+    if (ipv6_routes_insert(&IPV6Routes, new)) {
         ipv6_dbg("IPv6: Failed to insert route in tree\n");
         PICO_FREE(new);
 		return -1;
@@ -1626,9 +1647,9 @@ int pico_ipv6_route_del(struct pico_ip6 address, struct pico_ip6 netmask, struct
     test.netmask = netmask;
     test.metric = (uint32_t)metric;
 
-    found = pico_tree_findKey(&IPV6Routes, &test);
+    found = ipv6_routes_find(&IPV6Routes, &test);
     if (found) {
-        pico_tree_delete(&IPV6Routes, found);
+        ipv6_routes_remove(&IPV6Routes, found);
         PICO_FREE(found);
         pico_ipv6_dbg_route();
         return 0;
@@ -1640,14 +1661,13 @@ int pico_ipv6_route_del(struct pico_ip6 address, struct pico_ip6 netmask, struct
 
 void pico_ipv6_router_down(struct pico_ip6 *address)
 {
-    struct pico_tree_node *index = NULL, *_tmp = NULL;
-    struct pico_ipv6_route *route = NULL;
+    struct pico_ipv6_route *route = NULL, *next = NULL;
     if (!address)
         return;
 
-    pico_tree_foreach_safe(index, &IPV6Routes, _tmp)
+    for (route = ipv6_routes_first(&IPV6Routes); route; route = next)
     {
-        route = index->keyValue;
+        next = ipv6_routes_next(route);
         if (pico_ipv6_compare(address, &route->gateway) == 0)
             pico_ipv6_route_del(route->dest, route->netmask, route->gateway, (int)route->metric, route->link);
     }
@@ -1852,12 +1872,11 @@ struct pico_ipv6_link *pico_ipv6_link_add(struct pico_device *dev, struct pico_i
 
 static int pico_ipv6_cleanup_routes(struct pico_ipv6_link *link)
 {
-    struct pico_tree_node *index = NULL, *_tmp = NULL;
-    struct pico_ipv6_route *route = NULL;
+    struct pico_ipv6_route *route = NULL, *next = NULL;
 
-    pico_tree_foreach_safe(index, &IPV6Routes, _tmp)
+    for (route = ipv6_routes_first(&IPV6Routes); route; route = next)
     {
-        route = index->keyValue;
+        next = ipv6_routes_next(route);
         if (link == route->link)
             pico_ipv6_route_del(route->dest, route->netmask, route->gateway, (int)route->metric, route->link);
     }
@@ -1901,6 +1920,12 @@ int pico_ipv6_link_del(struct pico_device *dev, struct pico_ip6 address)
     if (found->dad_timer)
         pico_timer_cancel(found->dad_timer);
 
+#ifdef PICO_SUPPORT_MCAST
+    /* The multicast route went with the routes of the link */
+    if (found == mcast_default_link_ipv6)
+        mcast_default_link_ipv6 = NULL;
+#endif
+
     pico_tree_delete(&IPV6Links, found);
     /* XXX MUST leave the solicited-node multicast address corresponding to the address (RFC 4861 $7.2.1) */
     PICO_FREE(found);
@@ -2058,7 +2083,7 @@ struct pico_ipv6_link *pico_ipv6_global_get(struct pico_device *dev)
 {
     struct pico_ipv6_link *link = pico_ipv6_link_by_dev(dev);
     while (link && !pico_ipv6_is_global(link->address.addr)) {
-        dbg("[0x%02X] - is global: %d - %d\n", link->address.addr[0], pico_ipv6_is_global(link->address.addr), link->address.addr[0] >> 0x05);
+        ipv6_dbg("[0x%02X] - is global: %d - %d\n", link->address.addr[0], pico_ipv6_is_global(link->address.addr), link->address.addr[0] >> 0x05);
         link = pico_ipv6_link_by_dev_next(dev, link);
     }
     return link;
@@ -2135,6 +2160,35 @@ void pico_ipv6_unreachable(struct pico_frame *f, uint8_t code)
 #endif
 }
 
+#ifdef PICO_SUPPORT_PMTU
+/* ICMPv6 "packet too big", f->net_hdr is the header of our packet */
+void pico_ipv6_pkt_too_big(struct pico_frame *f, uint32_t mtu)
+{
+    struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+    union pico_address dst;
+
+    if ((f->transport_len < (PICO_ICMP6HDR_PKT_TOO_BIG_SIZE + PICO_SIZE_IP6HDR + 8u)) ||
+        !pico_ipv6_link_get(&hdr->src) || (mtu >= (short_be(hdr->len) + PICO_SIZE_IP6HDR))) {
+        pico_frame_discard(f);
+        return;
+    }
+
+    /* RFC 8201 4: below the minimum MTU, stay at the minimum */
+    dst.ip6 = hdr->dst;
+    if (pico_pmtu_lower(PICO_PROTO_IPV6, &dst, mtu) < 0) {
+        pico_frame_discard(f);
+        return;
+    }
+
+#if defined PICO_SUPPORT_TCP || defined PICO_SUPPORT_UDP
+    f->transport_hdr = ((uint8_t *)f->net_hdr) + PICO_SIZE_IP6HDR;
+    pico_transport_pmtu_update(f, hdr->nxthdr);
+#else
+    pico_frame_discard(f);
+#endif
+}
+#endif
+
 
 
 #endif
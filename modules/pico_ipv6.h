@@ -32,7 +32,7 @@
 
 extern const uint8_t PICO_IP6_ANY[PICO_SIZE_IP6];
 extern struct pico_protocol pico_proto_ipv6;
-extern struct pico_tree IPV6Routes;
+extern struct pico_rb_tree IPV6Routes;
 
 PACKED_STRUCT_DEF pico_ipv6_hdr {
     uint32_t vtf;
@@ -94,6 +94,7 @@ struct pico_ipv6_destoption {
 
 struct pico_ipv6_route
 {
+    struct pico_rb_node node; /* in IPV6Routes */
     struct pico_ip6 dest;
     struct pico_ip6 netmask;
     struct pico_ip6 gateway;
@@ -148,6 +149,7 @@ int pico_ipv6_frame_push(struct pico_frame *f, struct pico_ip6 *src, struct pico
 int pico_ipv6_route_add(struct pico_ip6 address, struct pico_ip6 netmask, struct pico_ip6 gateway, int metric, struct pico_ipv6_link *link);
 int pico_ipv6_route_del(struct pico_ip6 address, struct pico_ip6 netmask, struct pico_ip6 gateway, int metric, struct pico_ipv6_link *link);
 void pico_ipv6_unreachable(struct pico_frame *f, uint8_t code);
+void pico_ipv6_pkt_too_big(struct pico_frame *f, uint32_t mtu);
 
 struct pico_ipv6_link *pico_ipv6_link_add(struct pico_device *dev, struct pico_ip6 address, struct pico_ip6 netmask);
 struct pico_ipv6_link *pico_ipv6_link_add_no_dad(struct pico_device *dev, struct pico_ip6 address, struct pico_ip6 netmask);
@@ -16,6 +16,7 @@
 #include "pico_eth.h"
 #include "pico_addressing.h"
 #include "pico_ipv6_nd.h"
+#include "pico_neighbor.h"
 #include "pico_ethernet.h"
 #include "pico_6lowpan.h"
 #include "pico_6lowpan_ll.h"
@@ -36,27 +37,14 @@
     #define MAX_RTR_SOLICITATION_INTERVAL   (60000)
 #endif
 
-static struct pico_frame *frames_queued_v6[PICO_ND_MAX_FRAMES_QUEUED] = {
-    0
-};
+/* Unused STALE neighbours are dropped after this */
+#define PICO_ND_GC_TIME                     ((pico_time)(10 * ONE_MINUTE))
 
-enum pico_ipv6_neighbor_state {
-    PICO_ND_STATE_INCOMPLETE = 0,
-    PICO_ND_STATE_REACHABLE,
-    PICO_ND_STATE_STALE,
-    PICO_ND_STATE_DELAY,
-    PICO_ND_STATE_PROBE
-};
-
-struct pico_ipv6_neighbor {
-    enum pico_ipv6_neighbor_state state;
-    struct pico_ip6 address;
-    union pico_hw_addr hwaddr;
-    struct pico_device *dev;
-    uint16_t is_router;
-    uint16_t failure_count;
-    pico_time expire;
-};
+#define PICO_ND_STATE_INCOMPLETE            PICO_NEIGH_INCOMPLETE
+#define PICO_ND_STATE_REACHABLE             PICO_NEIGH_REACHABLE
+#define PICO_ND_STATE_STALE                 PICO_NEIGH_STALE
+#define PICO_ND_STATE_DELAY                 PICO_NEIGH_DELAY
+#define PICO_ND_STATE_PROBE                 PICO_NEIGH_PROBE
 
 /******************************************************************************
  *  Function prototypes
@@ -69,36 +57,26 @@ static int pico_6lp_nd_neigh_adv_process(struct pico_frame *f);
 static int neigh_sol_detect_dad_6lp(struct pico_frame *f);
 #endif
 
-static int pico_ipv6_neighbor_compare(void *ka, void *kb)
-{
-    struct pico_ipv6_neighbor *a = ka, *b = kb;
-    return pico_ipv6_compare(&a->address, &b->address);
-}
-PICO_TREE_DECLARE(NCache, pico_ipv6_neighbor_compare);
+static pico_time pico_nd_retrans(struct pico_neighbor *n);
+static void pico_nd_solicit(struct pico_neighbor *n);
+static void pico_ipv6_nd_unreachable(struct pico_neighbor *n);
+
+static const struct pico_neighbor_proto nd_proto = {
+    .l3_proto = PICO_IDETH_IPV6,
+    .addr_len = PICO_SIZE_IP6,
+    .max_solicit = PICO_ND_MAX_SOLICIT,
+    .max_pending = PICO_ND_MAX_FRAMES_QUEUED,
+    .reachable = PICO_ND_REACHABLE_TIME,
+    .delay = PICO_ND_DELAY_FIRST_PROBE_TIME,
+    .gc = PICO_ND_GC_TIME,
+    .retrans = pico_nd_retrans,
+    .solicit = pico_nd_solicit,
+    .unreachable = pico_ipv6_nd_unreachable,
+};
 
-static struct pico_ipv6_neighbor *pico_nd_find_neighbor(struct pico_ip6 *dst)
+static struct pico_neighbor *pico_nd_find_neighbor(struct pico_ip6 *dst, struct pico_device *dev)
 {
-    struct pico_ipv6_neighbor test = {
-        0
-    };
-
-    test.address = *dst;
-    return pico_tree_findKey(&NCache, &test);
-}
-
-static void pico_ipv6_nd_queued_trigger(void)
-{
-    int i;
-    struct pico_frame *f;
-    for (i = 0; i < PICO_ND_MAX_FRAMES_QUEUED; i++)
-    {
-        f = frames_queued_v6[i];
-        if (f) {
-            if (pico_datalink_send(f) <= 0)
-                pico_frame_discard(f);
-            frames_queued_v6[i] = NULL;
-        }
-    }
+    return pico_neighbor_find(&nd_proto, dev, dst->addr);
 }
 
 static void ipv6_duplicate_detected(struct pico_ipv6_link *l)
@@ -117,131 +95,78 @@ static void ipv6_duplicate_detected(struct pico_ipv6_link *l)
         pico_device_ipv6_random_ll(dev);
 }
 
-static struct pico_ipv6_neighbor *pico_nd_add(struct pico_ip6 *addr, struct pico_device *dev)
+static struct pico_neighbor *pico_nd_add(struct pico_ip6 *addr, struct pico_device *dev)
 {
-    struct pico_ipv6_neighbor *n;
-    char address[120];
     /* Create a new NCE */
-    n = PICO_ZALLOC(sizeof(struct pico_ipv6_neighbor));
+    struct pico_neighbor *n = pico_neighbor_add(&nd_proto, dev, addr->addr);
     if (!n)
-        return NULL;
-    pico_ipv6_to_string(address, addr->addr);
-    memcpy(&n->address, addr, sizeof(struct pico_ip6));
-    n->dev = dev;
-
-    if (pico_tree_insert(&NCache, n)) {
-        nd_dbg("IPv6 ND: Failed to insert neigbor in tree\n");
-		PICO_FREE(n);
-		return NULL;
-	}
+        nd_dbg("IPv6 ND: Failed to insert neigbor in cache\n");
 
     return n;
 }
 
-static void pico_ipv6_nd_unreachable(struct pico_ip6 *a)
+static void pico_ipv6_nd_unreachable(struct pico_neighbor *n)
 {
-    int i;
     struct pico_frame *f;
-    struct pico_ipv6_hdr *hdr;
-    struct pico_ip6 dst;
 #ifdef PICO_SUPPORT_6LOWPAN
     /* 6LP: Find any 6LoWPAN-hosts for which this address might have been a default gateway.
      * If such a host found, send a router solicitation again */
-    pico_6lp_nd_unreachable_gateway(a);
+    pico_6lp_nd_unreachable_gateway(&n->addr.ip6);
 #endif /* PICO_SUPPORT_6LOWPAN */
-    for (i = 0; i < PICO_ND_MAX_FRAMES_QUEUED; i++)
-    {
-        f = frames_queued_v6[i];
-        if (f) {
-            hdr = (struct pico_ipv6_hdr *) f->net_hdr;
-            dst = pico_ipv6_route_get_gateway(&hdr->dst);
-            if (pico_ipv6_is_unspecified(dst.addr))
-                dst = hdr->dst;
-
-            if (memcmp(dst.addr, a->addr, PICO_SIZE_IP6) == 0) {
-                if (!pico_source_is_local(f)) {
-                    pico_notify_dest_unreachable(f);
-                }
-
-                pico_frame_discard(f);
-                frames_queued_v6[i] = NULL;
-            }
+    for (f = n->pending.head; f; f = f->next) {
+        if (!pico_source_is_local(f)) {
+            pico_notify_dest_unreachable(f);
         }
     }
 }
 
-static void pico_nd_new_expire_time(struct pico_ipv6_neighbor *n)
+static pico_time pico_nd_retrans(struct pico_neighbor *n)
 {
-    if (n->state == PICO_ND_STATE_REACHABLE)
-        n->expire = PICO_TIME_MS() + PICO_ND_REACHABLE_TIME;
-    else if ((n->state == PICO_ND_STATE_DELAY) || (n->state == PICO_ND_STATE_STALE))
-        n->expire = PICO_TIME_MS() + PICO_ND_DELAY_FIRST_PROBE_TIME;
-    else {
-        n->expire = n->dev->hostvars.retranstime + PICO_TIME_MS();
-    }
+    return n->dev->hostvars.retranstime;
 }
 
-static void pico_nd_discover(struct pico_ipv6_neighbor *n)
+static void pico_nd_solicit(struct pico_neighbor *n)
 {
-    char IPADDR[64];
-
-    if (!n) {
-        return;
+    /* dbg("Sending NS for %02x:...:%02x\n", n->addr.ip6.addr[0], n->addr.ip6.addr[15]); */
+    if (n->state == PICO_ND_STATE_INCOMPLETE) {
+        pico_icmp6_neighbor_solicitation(n->dev, &n->addr.ip6, PICO_ICMP6_ND_SOLICITED, &n->addr.ip6);
     } else {
-        if (n->expire != (pico_time)0) {
-            return;
-        } else {
-            pico_ipv6_to_string(IPADDR, n->address.addr);
-            /* dbg("Sending NS for %s\n", IPADDR); */
-            if (++n->failure_count > PICO_ND_MAX_SOLICIT)
-                return;
-
-            if (n->state == PICO_ND_STATE_INCOMPLETE) {
-                pico_icmp6_neighbor_solicitation(n->dev, &n->address, PICO_ICMP6_ND_SOLICITED, &n->address);
-            } else {
-                pico_icmp6_neighbor_solicitation(n->dev, &n->address, PICO_ICMP6_ND_UNICAST, &n->address);
-            }
-
-            pico_nd_new_expire_time(n);
-        }
+        pico_icmp6_neighbor_solicitation(n->dev, &n->addr.ip6, PICO_ICMP6_ND_UNICAST, &n->addr.ip6);
     }
 }
 
-static struct pico_eth *pico_nd_get_neighbor(struct pico_ip6 *addr, struct pico_ipv6_neighbor *n, struct pico_device *dev)
+static struct pico_neighbor *pico_nd_get_neighbor(struct pico_ip6 *addr, struct pico_neighbor *n, struct pico_device *dev)
 {
     /* dbg("Finding neighbor %02x:...:%02x, state = %d\n", addr->addr[0], addr->addr[15], n?n->state:-1); */
 
     if (!n) {
         n = pico_nd_add(addr, dev);
-        pico_nd_discover(n);
-        return NULL;
-    } else {
-        if (n->state == PICO_ND_STATE_INCOMPLETE) {
-            return NULL;
-        } else if (n->state == PICO_ND_STATE_STALE) {
-            n->state = PICO_ND_STATE_DELAY;
-            pico_nd_new_expire_time(n);
-        }
+        if (n && (pico_neighbor_solicit(n) < 0))
+            pico_neighbor_del(n);
 
-        if (n->state != PICO_ND_STATE_REACHABLE) {
-            pico_nd_discover(n);
-        }
+        return NULL;
     }
-    return &n->hwaddr.mac;
+
+    return pico_neighbor_use(n);
 }
 
-static struct pico_eth *pico_nd_get(struct pico_ip6 *address, struct pico_device *dev)
+static struct pico_ip6 pico_nd_nexthop(struct pico_ip6 *address)
 {
-    struct pico_ip6 gateway = {{0}}, addr = {{0}};
+    struct pico_ip6 gateway = {{0}};
 
     /* should we use gateway, or is dst local (gateway == 0)? */
     gateway = pico_ipv6_route_get_gateway(address);
     if (memcmp(gateway.addr, PICO_IP6_ANY, PICO_SIZE_IP6) == 0)
-        addr = *address;
-    else
-        addr = gateway;
+        return *address;
 
-    return pico_nd_get_neighbor(&addr, pico_nd_find_neighbor(&addr), dev);
+    return gateway;
+}
+
+static struct pico_neighbor *pico_nd_get(struct pico_ip6 *address, struct pico_device *dev)
+{
+    struct pico_ip6 addr = pico_nd_nexthop(address);
+
+    return pico_nd_get_neighbor(&addr, pico_nd_find_neighbor(&addr, dev), dev);
 }
 
 static int nd_options(uint8_t *options, struct pico_icmp6_opt_lladdr *opt, uint8_t expected_opt, int optlen, int len)
@@ -311,20 +236,23 @@ static size_t pico_hw_addr_len(struct pico_device *dev, struct pico_icmp6_opt_ll
     return len;
 }
 
-static void pico_ipv6_neighbor_update(struct pico_ipv6_neighbor *n, struct pico_icmp6_opt_lladdr *opt, struct pico_device *dev)
+static int pico_ipv6_neighbor_update(struct pico_neighbor *n, struct pico_icmp6_opt_lladdr *opt, struct pico_device *dev, uint8_t state)
 {
-    memcpy(n->hwaddr.data, opt->addr.data, pico_hw_addr_len(dev, opt));
+    if (!opt)
+        return pico_neighbor_update(n, NULL, 0, state);
+
+    return pico_neighbor_update(n, opt->addr.data, (uint32_t)pico_hw_addr_len(dev, opt), state);
 }
 
-static int pico_ipv6_neighbor_compare_stored(struct pico_ipv6_neighbor *n, struct pico_icmp6_opt_lladdr *opt, struct pico_device *dev)
+static int pico_ipv6_neighbor_compare_stored(struct pico_neighbor *n, struct pico_icmp6_opt_lladdr *opt, struct pico_device *dev)
 {
     return memcmp(n->hwaddr.data, opt->addr.data, pico_hw_addr_len(dev, opt));
 }
 
-static void neigh_adv_reconfirm_router_option(struct pico_ipv6_neighbor *n, unsigned int isRouter)
+static void neigh_adv_reconfirm_router_option(struct pico_neighbor *n, unsigned int isRouter)
 {
     if (!isRouter && n->is_router) {
-        pico_ipv6_router_down(&n->address);
+        pico_ipv6_router_down(&n->addr.ip6);
     }
 
     if (isRouter)
@@ -334,13 +262,10 @@ static void neigh_adv_reconfirm_router_option(struct pico_ipv6_neighbor *n, unsi
 }
 
 
-static int neigh_adv_reconfirm_no_tlla(struct pico_ipv6_neighbor *n, struct pico_icmp6_hdr *hdr)
+static int neigh_adv_reconfirm_no_tlla(struct pico_neighbor *n, struct pico_icmp6_hdr *hdr)
 {
     if (IS_SOLICITED(hdr)) {
-        n->state = PICO_ND_STATE_REACHABLE;
-        n->failure_count = 0;
-        pico_ipv6_nd_queued_trigger();
-        pico_nd_new_expire_time(n);
+        pico_ipv6_neighbor_update(n, NULL, NULL, PICO_ND_STATE_REACHABLE);
         return 0;
     }
 
@@ -348,36 +273,26 @@ static int neigh_adv_reconfirm_no_tlla(struct pico_ipv6_neighbor *n, struct pico
 }
 
 
-static int neigh_adv_reconfirm(struct pico_ipv6_neighbor *n, struct pico_icmp6_opt_lladdr *opt, struct pico_icmp6_hdr *hdr, struct pico_device *dev)
+static int neigh_adv_reconfirm(struct pico_neighbor *n, struct pico_icmp6_opt_lladdr *opt, struct pico_icmp6_hdr *hdr, struct pico_device *dev)
 {
 
     if (IS_SOLICITED(hdr) && !IS_OVERRIDE(hdr) && (pico_ipv6_neighbor_compare_stored(n, opt, dev) == 0)) {
-        n->state = PICO_ND_STATE_REACHABLE;
-        n->failure_count = 0;
-        pico_ipv6_nd_queued_trigger();
-        pico_nd_new_expire_time(n);
+        pico_ipv6_neighbor_update(n, NULL, dev, PICO_ND_STATE_REACHABLE);
         return 0;
     }
 
     if ((n->state == PICO_ND_STATE_REACHABLE) && IS_SOLICITED(hdr) && !IS_OVERRIDE(hdr)) {
-        n->state = PICO_ND_STATE_STALE;
+        pico_ipv6_neighbor_update(n, NULL, dev, PICO_ND_STATE_STALE);
         return 0;
     }
 
     if (IS_SOLICITED(hdr) && IS_OVERRIDE(hdr)) {
-        pico_ipv6_neighbor_update(n, opt, dev);
-        n->state = PICO_ND_STATE_REACHABLE;
-        n->failure_count = 0;
-        pico_ipv6_nd_queued_trigger();
-        pico_nd_new_expire_time(n);
+        pico_ipv6_neighbor_update(n, opt, dev, PICO_ND_STATE_REACHABLE);
         return 0;
     }
 
     if (!IS_SOLICITED(hdr) && IS_OVERRIDE(hdr) && (pico_ipv6_neighbor_compare_stored(n, opt, dev) != 0)) {
-        pico_ipv6_neighbor_update(n, opt, dev);
-        n->state = PICO_ND_STATE_STALE;
-        pico_ipv6_nd_queued_trigger();
-        pico_nd_new_expire_time(n);
+        pico_ipv6_neighbor_update(n, opt, dev, PICO_ND_STATE_STALE);
         return 0;
     }
 
@@ -392,15 +307,14 @@ static int neigh_adv_reconfirm(struct pico_ipv6_neighbor *n, struct pico_icmp6_o
          *     b. Otherwise, the received advertisement should be ignored and
          *        MUST NOT update the cache.
          */
-        n->state = PICO_ND_STATE_STALE;
-        pico_nd_new_expire_time(n);
+        pico_ipv6_neighbor_update(n, NULL, dev, PICO_ND_STATE_STALE);
         return 0;
     }
 
     return -1;
 }
 
-static void neigh_adv_process_incomplete(struct pico_ipv6_neighbor *n, struct pico_frame *f, struct pico_icmp6_opt_lladdr *opt)
+static void neigh_adv_process_incomplete(struct pico_neighbor *n, struct pico_frame *f, struct pico_icmp6_opt_lladdr *opt)
 {
     struct pico_icmp6_hdr *icmp6_hdr = NULL;
     if (!n || !f) {
@@ -410,17 +324,10 @@ static void neigh_adv_process_incomplete(struct pico_ipv6_neighbor *n, struct pi
             return;
         else {
             if (IS_SOLICITED(icmp6_hdr)) {
-                n->state = PICO_ND_STATE_REACHABLE;
-                n->failure_count = 0;
-                pico_nd_new_expire_time(n);
+                pico_ipv6_neighbor_update(n, opt, f->dev, PICO_ND_STATE_REACHABLE);
             } else {
-                n->state = PICO_ND_STATE_STALE;
+                pico_ipv6_neighbor_update(n, opt, f->dev, PICO_ND_STATE_STALE);
             }
-
-            if (opt)
-                pico_ipv6_neighbor_update(n, opt, f->dev);
-
-            pico_ipv6_nd_queued_trigger();
         }
     }
 }
@@ -429,7 +336,7 @@ static void neigh_adv_process_incomplete(struct pico_ipv6_neighbor *n, struct pi
 static int neigh_adv_process(struct pico_frame *f)
 {
     struct pico_icmp6_hdr *icmp6_hdr = NULL;
-    struct pico_ipv6_neighbor *n = NULL;
+    struct pico_neighbor *n = NULL;
     struct pico_icmp6_opt_lladdr opt = {
         0
     };
@@ -448,7 +355,7 @@ static int neigh_adv_process(struct pico_frame *f)
 #endif
 
     /* Check if there's a NCE in the cache */
-    n = pico_nd_find_neighbor(&icmp6_hdr->msg.info.neigh_adv.target);
+    n = pico_nd_find_neighbor(&icmp6_hdr->msg.info.neigh_adv.target, f->dev);
     if (!n) {
         return 0;
     }
@@ -469,24 +376,24 @@ static int neigh_adv_process(struct pico_frame *f)
 
 }
 
-static struct pico_ipv6_neighbor *pico_ipv6_neighbor_from_sol_new(struct pico_ip6 *ip, struct pico_icmp6_opt_lladdr *opt, struct pico_device *dev)
+static struct pico_neighbor *pico_ipv6_neighbor_from_sol_new(struct pico_ip6 *ip, struct pico_icmp6_opt_lladdr *opt, struct pico_device *dev)
 {
-    size_t len = pico_hw_addr_len(dev, opt);
-    struct pico_ipv6_neighbor *n = NULL;
+    struct pico_neighbor *n = NULL;
     n = pico_nd_add(ip, dev);
     if (!n)
         return NULL;
 
-    memcpy(n->hwaddr.data, opt->addr.data, len);
-    memset(n->hwaddr.data + len, 0, sizeof(union pico_hw_addr) - len);
-    n->state = PICO_ND_STATE_STALE;
-    pico_ipv6_nd_queued_trigger();
+    if (pico_ipv6_neighbor_update(n, opt, dev, PICO_ND_STATE_STALE) < 0) {
+        pico_neighbor_del(n);
+        return NULL;
+    }
+
     return n;
 }
 
 static void pico_ipv6_neighbor_from_unsolicited(struct pico_frame *f)
 {
-    struct pico_ipv6_neighbor *n = NULL;
+    struct pico_neighbor *n = NULL;
     struct pico_icmp6_opt_lladdr opt = {
         0
     };
@@ -494,14 +401,11 @@ static void pico_ipv6_neighbor_from_unsolicited(struct pico_frame *f)
     int valid_lladdr = neigh_options(f, &opt, PICO_ND_OPT_LLADDR_SRC);
 
     if (!pico_ipv6_is_unspecified(ip->src.addr) && (valid_lladdr > 0)) {
-        n = pico_nd_find_neighbor(&ip->src);
+        n = pico_nd_find_neighbor(&ip->src, f->dev);
         if (!n) {
             n = pico_ipv6_neighbor_from_sol_new(&ip->src, &opt, f->dev);
         } else if (memcmp(opt.addr.data, n->hwaddr.data, pico_hw_addr_len(f->dev, &opt))) {
-            pico_ipv6_neighbor_update(n, &opt, f->dev);
-            n->state = PICO_ND_STATE_STALE;
-            pico_ipv6_nd_queued_trigger();
-            pico_nd_new_expire_time(n);
+            pico_ipv6_neighbor_update(n, &opt, f->dev, PICO_ND_STATE_STALE);
         }
 
         if (!n)
@@ -972,12 +876,16 @@ static int pico_6lp_nd_neigh_adv_process(struct pico_frame *f)
 }
 
 /* Add a new 6LoWPAN neighbor with lifetime from ARO */
-static struct pico_ipv6_neighbor *pico_nd_add_6lp(struct pico_ip6 naddr, struct pico_icmp6_opt_aro *aro, struct pico_device *dev)
+static struct pico_neighbor *pico_nd_add_6lp(struct pico_ip6 naddr, struct pico_icmp6_opt_aro *aro, struct pico_device *dev)
 {
-    struct pico_ipv6_neighbor *new = NULL;
+    struct pico_neighbor *new = NULL;
 
     if ((new = pico_nd_add(&naddr, dev))) {
-        new->expire = PICO_TIME_MS() + (pico_time)(ONE_MINUTE * aro->lifetime);
+        if (pico_neighbor_expire(new, (pico_time)(ONE_MINUTE * aro->lifetime)) < 0) {
+            pico_neighbor_del(new);
+            return NULL;
+        }
+
         dbg("ARO Lifetime: %d minutes\n", aro->lifetime);
     } else {
         return NULL;
@@ -1031,7 +939,7 @@ static int neigh_sol_dad_reply(struct pico_frame *sol, struct pico_icmp6_opt_lla
 /* RFC6775 §6.5.1.  Checking for Duplicates */
 static int neigh_sol_detect_dad_6lp(struct pico_frame *f)
 {
-    struct pico_ipv6_neighbor *n = NULL;
+    struct pico_neighbor *n = NULL;
     struct pico_icmp6_opt_lladdr *sllao = NULL;
     struct pico_icmp6_hdr *icmp = NULL;
     struct pico_icmp6_opt_aro *aro = NULL;
@@ -1046,7 +954,7 @@ static int neigh_sol_detect_dad_6lp(struct pico_frame *f)
         return -1;
 
     /* See RFC6775 $6.5.1: Checking for duplicates */
-    if (!(n = pico_nd_find_neighbor(&icmp->msg.info.neigh_sol.target))) {
+    if (!(n = pico_nd_find_neighbor(&icmp->msg.info.neigh_sol.target, f->dev))) {
         /* No dup, add neighbor to cache */
         if (pico_nd_add_6lp(icmp->msg.info.neigh_sol.target, aro, f->dev))
             neigh_sol_dad_reply(f, sllao, aro, ICMP6_ARO_SUCCES);
@@ -1055,15 +963,14 @@ static int neigh_sol_detect_dad_6lp(struct pico_frame *f)
         return 0;
     } else {
         if (!aro->lifetime) {
-            pico_tree_delete(&NCache, n);
-            PICO_FREE(n);
+            pico_neighbor_del(n);
             neigh_sol_dad_reply(f, sllao, aro, ICMP6_ARO_SUCCES);
             return 0;
         }
         /* Check if hwaddr differs */
         len = pico_hw_addr_len(f->dev, sllao);
         if (memcmp(sllao->addr.data, n->hwaddr.data, len) == 0) {
-            n->expire = PICO_TIME_MS() + (pico_time)(ONE_MINUTE * aro->lifetime);
+            pico_neighbor_expire(n, (pico_time)(ONE_MINUTE * aro->lifetime));
             neigh_sol_dad_reply(f, sllao, aro, ICMP6_ARO_DUP);
         }
         return 0;
@@ -1385,68 +1292,13 @@ static int pico_nd_redirect_recv(struct pico_frame *f)
     return 0;
 }
 
-static void pico_ipv6_nd_timer_elapsed(pico_time now, struct pico_ipv6_neighbor *n)
-{
-    (void)now;
-    switch(n->state) {
-    case PICO_ND_STATE_INCOMPLETE:
-    /* intentional fall through */
-    case PICO_ND_STATE_PROBE:
-        if (n->failure_count > PICO_ND_MAX_SOLICIT) {
-            pico_ipv6_nd_unreachable(&n->address);
-            pico_tree_delete(&NCache, n);
-            PICO_FREE(n);
-            return;
-        }
-
-        n->expire = 0ull;
-        pico_nd_discover(n);
-        break;
-
-    case PICO_ND_STATE_REACHABLE:
-        n->state = PICO_ND_STATE_STALE;
-        /* dbg("IPv6_ND: neighbor expired!\n"); */
-        return;
-
-    case PICO_ND_STATE_STALE:
-        break;
-
-    case PICO_ND_STATE_DELAY:
-        n->expire = 0ull;
-        n->state = PICO_ND_STATE_PROBE;
-        break;
-    default:
-        dbg("IPv6_ND: neighbor in wrong state!\n");
-    }
-    pico_nd_new_expire_time(n);
-}
-
-static void pico_ipv6_nd_timer_callback(pico_time now, void *arg)
-{
-    struct pico_tree_node *index = NULL, *_tmp = NULL;
-    struct pico_ipv6_neighbor *n;
-
-    (void)arg;
-    pico_tree_foreach_safe(index, &NCache, _tmp)
-    {
-        n = index->keyValue;
-        if ( now > n->expire ) {
-            pico_ipv6_nd_timer_elapsed(now, n);
-        }
-    }
-    if (!pico_timer_add(200, pico_ipv6_nd_timer_callback, NULL)) {
-        dbg("IPV6 ND: Failed to start callback timer\n");
-        /* TODO no idea what consequences this has */
-    }
-}
-
 #define PICO_IPV6_ND_MIN_RADV_INTERVAL  (5000)
 #define PICO_IPV6_ND_MAX_RADV_INTERVAL (15000)
 
 static void pico_ipv6_nd_ra_timer_callback(pico_time now, void *arg)
 {
     struct pico_tree_node *devindex = NULL;
-    struct pico_tree_node *rindex = NULL;
+    struct pico_rb_node *rindex = NULL;
     struct pico_device *dev;
     struct pico_ipv6_route *rt;
     struct pico_ip6 nm64 = { {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0, 0, 0, 0, 0, 0, 0, 0 } };
@@ -1454,9 +1306,9 @@ static void pico_ipv6_nd_ra_timer_callback(pico_time now, void *arg)
 
     (void)arg;
     (void)now;
-    pico_tree_foreach(rindex, &IPV6Routes)
+    pico_rb_foreach(rindex, &IPV6Routes)
     {
-        rt = rindex->keyValue;
+        rt = pico_rb_entry(rindex, struct pico_ipv6_route, node);
         if (pico_ipv6_compare(&nm64, &rt->netmask) == 0) {
             pico_tree_foreach(devindex, &Device_tree) {
                 dev = devindex->keyValue;
@@ -1478,10 +1330,12 @@ static void pico_ipv6_nd_ra_timer_callback(pico_time now, void *arg)
 
 /* Public API */
 
-struct pico_eth *pico_ipv6_get_neighbor(struct pico_frame *f)
+struct pico_neighbor *pico_ipv6_nd_resolve(struct pico_frame *f, struct pico_eth **local)
 {
     struct pico_ipv6_hdr *hdr = NULL;
     struct pico_ipv6_link *l = NULL;
+
+    *local = NULL;
     if (!f)
         return NULL;
 
@@ -1492,35 +1346,46 @@ struct pico_eth *pico_ipv6_get_neighbor(struct pico_frame *f)
 
     /* address belongs to ourselves? */
     l = pico_ipv6_link_get(&hdr->dst);
-    if (l && !l->dev->mode)
-        return &l->dev->eth->mac;
-    else if (l && PICO_DEV_IS_6LOWPAN(l->dev))
-        return (struct pico_eth *)l->dev->eth;
+    if (l && !l->dev->mode) {
+        *local = &l->dev->eth->mac;
+        return NULL;
+    } else if (l && PICO_DEV_IS_6LOWPAN(l->dev)) {
+        *local = (struct pico_eth *)l->dev->eth;
+        return NULL;
+    }
 
     return pico_nd_get(&hdr->dst, f->dev);
 }
 
+struct pico_eth *pico_ipv6_get_neighbor(struct pico_frame *f)
+{
+    struct pico_eth *local;
+    struct pico_neighbor *n = pico_ipv6_nd_resolve(f, &local);
+
+    if (n)
+        return &n->hwaddr.mac;
+
+    return local;
+}
+
+/* Park the frame on its unresolved neighbour. The frame is always consumed. */
 void pico_ipv6_nd_postpone(struct pico_frame *f)
 {
-    int i;
-    static int last_enq = -1;
-    for (i = 0; i < PICO_ND_MAX_FRAMES_QUEUED; i++)
-    {
-        if (!frames_queued_v6[i]) {
-            frames_queued_v6[i] = f;
-            last_enq = i;
-            return;
-        }
-    }
-    /* Overwrite the oldest frame in the buffer */
-    if (++last_enq >= PICO_ND_MAX_FRAMES_QUEUED) {
-        last_enq = 0;
+    struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+    struct pico_neighbor *n = NULL;
+    struct pico_ip6 addr;
+
+    if (hdr) {
+        addr = pico_nd_nexthop(&hdr->dst);
+        n = pico_nd_find_neighbor(&addr, f->dev);
     }
 
-    if (frames_queued_v6[last_enq])
-        pico_frame_discard(frames_queued_v6[last_enq]);
+    if (!n) {
+        pico_frame_discard(f);
+        return;
+    }
 
-    frames_queued_v6[last_enq] = f;
+    pico_neighbor_postpone(n, f);
 }
 
 
@@ -1560,24 +1425,17 @@ int pico_ipv6_nd_recv(struct pico_frame *f)
 
 void pico_ipv6_nd_init(void)
 {
-    uint32_t timer_cb = 0, ra_timer_cb = 0;
-
-    timer_cb = pico_timer_add(200, pico_ipv6_nd_timer_callback, NULL);
-    if (!timer_cb) {
-        nd_dbg("IPv6 ND: Failed to start callback timer\n");
-        return;
-    }
+    uint32_t ra_timer_cb = 0;
 
+    /* Neighbour cache entries carry their own timers */
     ra_timer_cb = pico_timer_add(200, pico_ipv6_nd_ra_timer_callback, NULL);
     if (!ra_timer_cb) {
         nd_dbg("IPv6 ND: Failed to start RA callback timer\n");
-        pico_timer_cancel(timer_cb);
         return;
     }
 
     if (!pico_timer_add(1000, pico_ipv6_check_lifetime_expired, NULL)) {
         nd_dbg("IPv6 ND: Failed to start check_lifetime timer\n");
-        pico_timer_cancel(timer_cb);
         pico_timer_cancel(ra_timer_cb);
         return;
     }
@@ -25,6 +25,11 @@ struct pico_nd_hostvars {
 
 void pico_ipv6_nd_init(void);
 struct pico_eth *pico_ipv6_get_neighbor(struct pico_frame *f);
+struct pico_neighbor;
+struct pico_eth;
+/* Next hop of an outgoing frame: the neighbour entry, or NULL with *local set
+ * for one of our own addresses, or NULL while resolving (see pico_ipv6_nd_postpone) */
+struct pico_neighbor *pico_ipv6_nd_resolve(struct pico_frame *f, struct pico_eth **local);
 void pico_ipv6_nd_postpone(struct pico_frame *f);
 int pico_ipv6_nd_recv(struct pico_frame *f);
 
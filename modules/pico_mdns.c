@@ -247,6 +247,268 @@ static PICO_TREE_DECLARE(MyRecords, &pico_mdns_record_cmp_name_type);
 /* Cookie-tree */
 static PICO_TREE_DECLARE(Cookies, &pico_mdns_cookie_cmp);
 
+/* ****************************************************************************
+ *  MARK: INDEXES
+ *  Cache and MyRecords are also hashed on the record name, case-insensitive,
+ *  so lookups by name or by name and type walk one chain instead of the whole
+ *  tree. Records are chained through their 'next' field and are never in both
+ *  tables. Cache records are kept in a min-heap on their next timer event,
+ *  counted in mDNS ticks, so the tick only looks at the records that are due.
+ * ****************************************************************************/
+#ifndef PICO_MDNS_INDEX_SIZE
+#define PICO_MDNS_INDEX_SIZE (64u) /* Power of two */
+#endif
+
+static struct pico_mdns_record *MyRecordsIndex[PICO_MDNS_INDEX_SIZE];
+
+#if PICO_MDNS_ALLOW_CACHING == 1
+static struct pico_mdns_record *CacheIndex[PICO_MDNS_INDEX_SIZE];
+
+/* 1-based, heap_index 0 means not in the heap */
+static struct pico_mdns_record **cache_heap = NULL;
+static uint32_t cache_heap_len = 0;
+static uint32_t cache_heap_size = 0;
+static uint32_t cache_clock = 0;
+#endif
+
+static uint32_t
+pico_mdns_index_hash( const char *name )
+{
+    uint32_t h = 5381u;
+    uint8_t c = 0;
+
+    while ((c = (uint8_t)*(name++))) {
+        if (c >= 'A' && c <= 'Z')
+            c = (uint8_t)(c + ('a' - 'A'));
+
+        h = (h * 33u) ^ c;
+    }
+    return h & (PICO_MDNS_INDEX_SIZE - 1u);
+}
+
+static struct pico_mdns_record **
+pico_mdns_index_of( pico_mdns_rtree *tree )
+{
+#if PICO_MDNS_ALLOW_CACHING == 1
+    if (tree == &Cache)
+        return CacheIndex;
+#endif
+    if (tree == &MyRecords)
+        return MyRecordsIndex;
+
+    return NULL;
+}
+
+static void
+pico_mdns_index_unlink( struct pico_mdns_record **index,
+                        struct pico_mdns_record *record )
+{
+    struct pico_mdns_record **pp = NULL;
+
+    pp = &index[pico_mdns_index_hash(record->record->rname)];
+    while (*pp && (*pp != record))
+        pp = &(*pp)->next;
+    if (*pp)
+        *pp = record->next;
+
+    record->next = NULL;
+}
+
+#if PICO_MDNS_ALLOW_CACHING == 1
+static uint32_t
+pico_mdns_cache_due( struct pico_mdns_record *record )
+{
+    return (record->refresh) ? (record->refresh) : (record->expire);
+}
+
+static void
+pico_mdns_heap_set( uint32_t i, struct pico_mdns_record *record )
+{
+    cache_heap[i] = record;
+    record->heap_index = i;
+}
+
+static void
+pico_mdns_heap_up( uint32_t i )
+{
+    struct pico_mdns_record *record = cache_heap[i];
+    uint32_t due = pico_mdns_cache_due(record);
+
+    while ((i > 1) && (pico_mdns_cache_due(cache_heap[i >> 1]) > due)) {
+        pico_mdns_heap_set(i, cache_heap[i >> 1]);
+        i >>= 1;
+    }
+    pico_mdns_heap_set(i, record);
+}
+
+static void
+pico_mdns_heap_down( uint32_t i )
+{
+    struct pico_mdns_record *record = cache_heap[i];
+    uint32_t due = pico_mdns_cache_due(record);
+    uint32_t child = 0;
+
+    while ((child = i << 1) <= cache_heap_len) {
+        if ((child < cache_heap_len) &&
+            (pico_mdns_cache_due(cache_heap[child + 1]) <
+             pico_mdns_cache_due(cache_heap[child])))
+            child++;
+
+        if (pico_mdns_cache_due(cache_heap[child]) >= due)
+            break;
+
+        pico_mdns_heap_set(i, cache_heap[child]);
+        i = child;
+    }
+    pico_mdns_heap_set(i, record);
+}
+
+static int
+pico_mdns_heap_push( struct pico_mdns_record *record )
+{
+    struct pico_mdns_record **grown = NULL;
+    uint32_t size = 0;
+
+    if (cache_heap_len + 1u >= cache_heap_size) {
+        size = (cache_heap_size) ? (cache_heap_size << 1) : (16u);
+        grown = PICO_ZALLOC(size * sizeof(struct pico_mdns_record *));
+        if (!grown) {
+            pico_err = PICO_ERR_ENOMEM;
+            return -1;
+        }
+
+        if (cache_heap) {
+            memcpy(grown, cache_heap,
+                   cache_heap_size * sizeof(struct pico_mdns_record *));
+            PICO_FREE(cache_heap);
+        }
+
+        cache_heap = grown;
+        cache_heap_size = size;
+    }
+
+    cache_heap[++cache_heap_len] = record;
+    pico_mdns_heap_up(cache_heap_len);
+    return 0;
+}
+
+static void
+pico_mdns_heap_remove( struct pico_mdns_record *record )
+{
+    uint32_t i = record->heap_index;
+
+    if (!i)
+        return;
+
+    record->heap_index = 0;
+    if (i == cache_heap_len) {
+        cache_heap_len--;
+        return;
+    }
+
+    pico_mdns_heap_set(i, cache_heap[cache_heap_len--]);
+    pico_mdns_heap_up(i);
+    pico_mdns_heap_down(cache_heap[i]->heap_index);
+}
+
+/* After the due tick of a record in the heap changed */
+static void
+pico_mdns_heap_fix( struct pico_mdns_record *record )
+{
+    if (!record->heap_index)
+        return;
+
+    pico_mdns_heap_up(record->heap_index);
+    pico_mdns_heap_down(record->heap_index);
+}
+#endif /* PICO_MDNS_ALLOW_CACHING */
+
+/* ****************************************************************************
+ *  Inserts a record in Cache or MyRecords, or in any other tree, keeping the
+ *  indexes up to date.
+ *
+ *  @param tree   Tree to insert the record in.
+ *  @param record mDNS record to insert.
+ *  @return Same as pico_tree_insert: NULL when inserted, the record already
+ *			present or &LEAF otherwise.
+ * ****************************************************************************/
+static void *
+pico_mdns_table_insert( pico_mdns_rtree *tree,
+                        struct pico_mdns_record *record )
+{
+    struct pico_mdns_record **index = NULL;
+    uint32_t h = 0;
+    void *ret = NULL;
+
+    if ((ret = pico_tree_insert(tree, record)))
+        return ret;
+
+    if (!(index = pico_mdns_index_of(tree)))
+        return NULL;
+
+#if PICO_MDNS_ALLOW_CACHING == 1
+    if ((tree == &Cache) && pico_mdns_heap_push(record)) {
+        pico_tree_delete(tree, record);
+        return &LEAF;
+    }
+#endif
+
+    h = pico_mdns_index_hash(record->record->rname);
+    record->next = index[h];
+    index[h] = record;
+    return NULL;
+}
+
+/* ****************************************************************************
+ *  Deletes a record from a tree, and from the indexes of Cache or MyRecords.
+ *
+ *  @param tree   Tree to delete the record from.
+ *  @param record Key of the record to delete.
+ *  @return The record that was removed from the tree, NULL if not found.
+ * ****************************************************************************/
+static struct pico_mdns_record *
+pico_mdns_table_delete( pico_mdns_rtree *tree,
+                        struct pico_mdns_record *record )
+{
+    struct pico_mdns_record **index = NULL;
+    struct pico_mdns_record *found = NULL;
+
+    if (!(found = pico_tree_delete(tree, record)))
+        return NULL;
+
+    if ((index = pico_mdns_index_of(tree))) {
+        pico_mdns_index_unlink(index, found);
+#if PICO_MDNS_ALLOW_CACHING == 1
+        pico_mdns_heap_remove(found);
+#endif
+    }
+
+    return found;
+}
+
+/* ****************************************************************************
+ *  Deletes all the records in Cache or MyRecords, and clears their indexes.
+ * ****************************************************************************/
+static void
+pico_mdns_table_destroy( pico_mdns_rtree *tree )
+{
+    struct pico_mdns_record **index = NULL;
+
+    if ((index = pico_mdns_index_of(tree)))
+        memset(index, 0, PICO_MDNS_INDEX_SIZE * sizeof(*index));
+
+#if PICO_MDNS_ALLOW_CACHING == 1
+    if ((tree == &Cache) && cache_heap) {
+        PICO_FREE(cache_heap);
+        cache_heap = NULL;
+        cache_heap_len = 0;
+        cache_heap_size = 0;
+    }
+#endif
+
+    PICO_MDNS_RTREE_DESTROY(tree);
+}
+
 /* ****************************************************************************
  *  MARK: PROTOTYPES                                                          */
 static int
@@ -508,6 +770,35 @@ pico_mdns_record_copy( struct pico_mdns_record *record )
     return copy;
 }
 
+/* ****************************************************************************
+ *  Adds a hit of a lookup to a tree of hits, or a copy of it.
+ *
+ *  @param hits   Tree with found hits.
+ *  @param record Record that was found.
+ *  @param copy   Whether to add a copy of the record instead of the record.
+ * ****************************************************************************/
+static void
+pico_mdns_rtree_add_hit( pico_mdns_rtree *hits,
+                         struct pico_mdns_record *record,
+                         uint8_t copy )
+{
+#if PICO_MDNS_ALLOW_CACHING == 1
+    /* Cache entries don't count down, bring the TTL up to date */
+    if (record->heap_index)
+        record->current_ttl = record->expire - cache_clock;
+#endif
+
+    if (copy)
+        record = pico_mdns_record_copy(record);
+
+    if (record)
+        if (pico_tree_insert(hits, record) != NULL)
+            /* either key was already in there, or couldn't be inserted. */
+            /* Only delete record if it was copied */
+            if (copy)
+                pico_mdns_record_delete((void **)&record);
+}
+
 /* ****************************************************************************
  *  Looks for multiple mDNS records in a tree with the same name.
  *
@@ -523,6 +814,7 @@ pico_mdns_rtree_find_name( pico_mdns_rtree *tree,
     PICO_MDNS_RTREE_DECLARE(hits);
     struct pico_tree_node *node = NULL;
     struct pico_mdns_record *record = NULL;
+    struct pico_mdns_record **index = NULL;
 
     /* Check params */
     if (!name || !tree) {
@@ -530,20 +822,21 @@ pico_mdns_rtree_find_name( pico_mdns_rtree *tree,
         return hits;
     }
 
+    /* Walk the hash chain of indexed tables */
+    if ((index = pico_mdns_index_of(tree))) {
+        for (record = index[pico_mdns_index_hash(name)]; record;
+             record = record->next) {
+            if (strcasecmp(record->record->rname, name) == 0)
+                pico_mdns_rtree_add_hit(&hits, record, copy);
+        }
+        return hits;
+    }
+
     /* Iterate over tree */
     pico_tree_foreach(node, tree) {
         record = node->keyValue;
-        if (record && strcasecmp(record->record->rname, name) == 0) {
-            if (copy)
-                record = pico_mdns_record_copy(record);
-
-            if (record)
-                if (pico_tree_insert(&hits, record) != NULL)
-                    /* either key was already in there, or couldn't be inserted. */
-                    /* Only delete record if it was copied */
-                    if (copy)
-                        pico_mdns_record_delete((void **)&record);
-        }
+        if (record && strcasecmp(record->record->rname, name) == 0)
+            pico_mdns_rtree_add_hit(&hits, record, copy);
     }
 
     return hits;
@@ -577,6 +870,7 @@ pico_mdns_rtree_find_name_type( pico_mdns_rtree *tree,
     };
     struct pico_tree_node *node = NULL;
     struct pico_mdns_record *record = NULL;
+    struct pico_mdns_record **index = NULL;
     test_dns_record.rsuffix = &test_dns_suffix;
     test.record = &test_dns_record;
 
@@ -589,22 +883,21 @@ pico_mdns_rtree_find_name_type( pico_mdns_rtree *tree,
     test.record->rname = name;
     test.record->rsuffix->rtype = short_be(rtype);
 
+    /* Walk the hash chain of indexed tables */
+    if ((index = pico_mdns_index_of(tree))) {
+        for (record = index[pico_mdns_index_hash(name)]; record;
+             record = record->next) {
+            if (0 == pico_mdns_record_cmp_name_type(record, &test))
+                pico_mdns_rtree_add_hit(&hits, record, copy);
+        }
+        return hits;
+    }
+
     /* Iterate over the tree */
     pico_tree_foreach(node, tree) {
         record = node->keyValue;
-        if ((record) && (0 == pico_mdns_record_cmp_name_type(record, &test))) {
-            if (copy)
-                record = pico_mdns_record_copy(record);
-
-            if (record){
-                if (pico_tree_insert(&hits, record) != NULL) {
-                    /* either key was already in there, or couldn't be inserted. */
-                    /* Only delete record if it was copied */
-                    if (copy)
-                        pico_mdns_record_delete((void **)&record);
-            	}
-            }
-        }
+        if ((record) && (0 == pico_mdns_record_cmp_name_type(record, &test)))
+            pico_mdns_rtree_add_hit(&hits, record, copy);
     }
 
     return hits;
@@ -622,7 +915,8 @@ pico_mdns_rtree_del_name( pico_mdns_rtree *tree,
                           const char *name )
 {
     struct pico_tree_node *node = NULL, *safe = NULL;
-    struct pico_mdns_record *record = NULL;
+    struct pico_mdns_record *record = NULL, *next = NULL;
+    struct pico_mdns_record **index = NULL;
 
     /* Check params */
     if (!name || !tree) {
@@ -630,6 +924,19 @@ pico_mdns_rtree_del_name( pico_mdns_rtree *tree,
         return -1;
     }
 
+    /* Walk the hash chain of indexed tables */
+    if ((index = pico_mdns_index_of(tree))) {
+        for (record = index[pico_mdns_index_hash(name)]; record;
+             record = next) {
+            next = record->next;
+            if (strcasecmp(record->record->rname, name) == 0) {
+                record = pico_mdns_table_delete(tree, record);
+                pico_mdns_record_delete((void **)&record);
+            }
+        }
+        return 0;
+    }
+
     /* Iterate over tree */
     pico_tree_foreach_safe(node, tree, safe) {
         record = node->keyValue;
@@ -657,8 +964,9 @@ pico_mdns_rtree_del_name_type( pico_mdns_rtree *tree,
                                char *name,
                                uint16_t type )
 {
-    struct pico_tree_node *node = NULL, *next = NULL;
-    struct pico_mdns_record *record = NULL;
+    struct pico_tree_node *node = NULL, *safe = NULL;
+    struct pico_mdns_record *record = NULL, *next = NULL;
+    struct pico_mdns_record **index = NULL;
     struct pico_dns_record_suffix test_dns_suffix = {
         0, 1, 0, 0
     };
@@ -681,8 +989,21 @@ pico_mdns_rtree_del_name_type( pico_mdns_rtree *tree,
     test.record->rname = name;
     test.record->rsuffix->rtype = short_be(type);
 
+    /* Walk the hash chain of indexed tables */
+    if ((index = pico_mdns_index_of(tree))) {
+        for (record = index[pico_mdns_index_hash(name)]; record;
+             record = next) {
+            next = record->next;
+            if (0 == pico_mdns_record_cmp_name_type(record, &test)) {
+                record = pico_mdns_table_delete(tree, record);
+                pico_mdns_record_delete((void **)&record);
+            }
+        }
+        return 0;
+    }
+
     /* Iterate over the tree */
-    pico_tree_foreach_safe(node, tree, next) {
+    pico_tree_foreach_safe(node, tree, safe) {
         record = node->keyValue;
         if ((record) && (0 == pico_mdns_record_cmp_name_type(record, &test))) {
             record = pico_tree_delete(tree, record);
@@ -830,7 +1151,7 @@ pico_mdns_record_resolve_conflict( struct pico_mdns_record *record,
     }
 
     /* Step 3: delete conflicting record from my records */
-    pico_tree_delete(&MyRecords, record);
+    pico_mdns_table_delete(&MyRecords, record);
     pico_mdns_record_delete((void **)&record);
 
     /* Step 4: Try to reclaim the newly created records */
@@ -1289,7 +1610,7 @@ pico_mdns_my_records_add( pico_mdns_rtree *records, uint8_t reclaim )
                 record->claim_id = claim_id_count;
             }
 
-            if (pico_tree_insert(&MyRecords, record) == &LEAF) {
+            if (pico_mdns_table_insert(&MyRecords, record) == &LEAF) {
                 mdns_dbg("MDNS: Failed to insert record in tree\n");
                 return -1;
 			}
@@ -1475,6 +1796,33 @@ pico_mdns_my_records_probed( pico_mdns_rtree *records )
 /* MARK: ^ MY RECORDS */
 /* MARK: v CACHE COHERENCY */
 #if PICO_MDNS_ALLOW_CACHING == 1
+#if PICO_MDNS_CONTINUOUS_REFRESH == 1
+/* ****************************************************************************
+ *  Schedules the next refresh of a cache entry. Records are reconfirmed @ 80%,
+ *  85%, 90% and 95% of their original TTL, + 2% rnd.
+ *
+ *  @param record Cache record, its expire tick and rttl must be set.
+ *  @return void
+ * ****************************************************************************/
+static void
+pico_mdns_cache_schedule_refresh( struct pico_mdns_record *record )
+{
+    uint32_t original = long_be(record->record->rsuffix->rttl);
+    uint32_t start = record->expire - original;
+    uint32_t rnd = pico_rand() % 3;
+    uint32_t at = 0, p = 0;
+
+    record->refresh = 0;
+    for (p = 80; p <= 95; p += 5) {
+        at = start + ((original * (p + rnd)) / 100);
+        if (at > cache_clock && at < record->expire) {
+            record->refresh = at;
+            return;
+        }
+    }
+}
+#endif
+
 /* ****************************************************************************
  *  Updates TTL of a cache entry.
  *
@@ -1495,6 +1843,13 @@ pico_mdns_cache_update_ttl( struct pico_mdns_record *record,
         record->record->rsuffix->rttl = long_be(1u);
         record->current_ttl = 1u;
     }
+
+    record->expire = cache_clock + record->current_ttl;
+    record->refresh = 0;
+#if PICO_MDNS_CONTINUOUS_REFRESH == 1
+    pico_mdns_cache_schedule_refresh(record);
+#endif
+    pico_mdns_heap_fix(record);
 }
 
 static int
@@ -1547,9 +1902,9 @@ pico_mdns_cache_add( struct pico_mdns_record *record )
         return -1;
     } else {
         /* Set current TTL to the original TTL before inserting */
-        record->current_ttl = rttl;
+        pico_mdns_cache_update_ttl(record, rttl);
 
-        if (pico_tree_insert(&Cache, record) != NULL)
+        if (pico_mdns_table_insert(&Cache, record) != NULL)
             return -1;
 
         mdns_dbg("RR cached. TICK TACK TICK TACK...\n");
@@ -1593,75 +1948,41 @@ pico_mdns_cache_add_record( struct pico_mdns_record *record )
     return 0;
 }
 
-#if PICO_MDNS_CONTINUOUS_REFRESH == 1
-/* ****************************************************************************
- *  Determine if the current TTL is at a refreshing point.
- *
- *  @param original Original TTL to calculate refreshing points
- *  @param current  Current TTL to check.
- *  @return 1 when Current TTL is at refresh point. 0 when it's not.
- * ****************************************************************************/
-static int
-pico_mdns_ttl_at_refresh_time( uint32_t original,
-                               uint32_t current )
-{
-    uint32_t rnd = 0;
-    rnd = pico_rand() % 3;
-
-    if (((original - current ==
-          ((original * (80 + rnd)) / 100)) ? 1 : 0) ||
-        ((original - current ==
-          ((original * (85 + rnd)) / 100)) ? 1 : 0) ||
-        ((original - current ==
-          ((original * (90 + rnd)) / 100)) ? 1 : 0) ||
-        ((original - current ==
-          ((original * (95 + rnd)) / 100)) ? 1 : 0))
-        return 1;
-    else
-        return 0;
-}
-#endif
-
 /* ****************************************************************************
  *  Utility function to update the TTL of cache entries and check for expired
  *  ones. When continuous refreshing is enabled the records will be reconfirmed
- *	@ 80%, 85%, 90% and 95% of their original TTL.
+ *	@ 80%, 85%, 90% and 95% of their original TTL. Only the records that are
+ *  due are visited.
  * ****************************************************************************/
 static void
 pico_mdns_cache_check_expiries( void )
 {
-    struct pico_tree_node *node = NULL, *next = NULL;
     struct pico_mdns_record *record = NULL;
 #if PICO_MDNS_CONTINUOUS_REFRESH == 1
-    uint32_t current = 0, original = 0;
-    uint16_t type 0;
+    uint16_t type = 0;
     char *url = NULL;
 #endif
 
-    /* Check for expired cache records */
-    pico_tree_foreach_safe(node, &Cache, next) {
-        if ((record = node->keyValue)) {
-            /* Update current ttl and delete when TTL is 0*/
-            if ((--(record->current_ttl)) == 0) {
-                record = pico_tree_delete(&Cache, record);
-                pico_mdns_record_delete((void **)&record);
-            }
-
+    cache_clock++;
+    while (cache_heap_len &&
+           pico_mdns_cache_due((record = cache_heap[1])) <= cache_clock) {
 #if PICO_MDNS_CONTINUOUS_REFRESH == 1
-            /* Determine original and current ttl */
-            original = long_be(record->record->rsuffix->rttl);
-            current = record->current_ttl;
-
-            /* Cache refresh at 80 or 85/90/95% of TTL + 2% rnd */
-            if (pico_mdns_ttl_at_refresh_time(original, current)) {
-                url = pico_dns_qname_to_url(record->record->rname);
-                type = short_be(record->record->rsuffix->rtype)
-                       pico_mdns_getrecord_generic(url, type, NULL, NULL);
+        if (record->refresh) {
+            url = pico_dns_qname_to_url(record->record->rname);
+            type = short_be(record->record->rsuffix->rtype);
+            if (url) {
+                pico_mdns_getrecord_generic(url, type, NULL, NULL);
                 PICO_FREE(url);
             }
 
-#endif
+            pico_mdns_cache_schedule_refresh(record);
+            pico_mdns_heap_fix(record);
+            continue;
         }
+#endif
+        /* TTL is 0 */
+        record = pico_mdns_table_delete(&Cache, record);
+        pico_mdns_record_delete((void **)&record);
     }
 }
 #endif /* PICO_MDNS_ALLOW_CACHING */
@@ -2516,17 +2837,17 @@ pico_mdns_gather_service_meta( pico_mdns_rtree *antree,
         pico_rtree_add_copy(antree, ptr_record);
 
         /* Insert the created service record in MyRecords, alread in, destroy */
-        if (pico_tree_insert(&MyRecords, meta_record)) {
+        if (pico_mdns_table_insert(&MyRecords, meta_record)) {
             mdns_dbg("MDNS: Failed to insert meta record in tree\n");
             pico_mdns_record_delete((void **)&meta_record);
             pico_mdns_record_delete((void **)&ptr_record);
             return -1;
         }
 
-        if (pico_tree_insert(&MyRecords, ptr_record)) {
+        if (pico_mdns_table_insert(&MyRecords, ptr_record)) {
             mdns_dbg("MDNS: Failed to insert ptr record in tree\n");
             pico_mdns_record_delete((void **)&ptr_record);
-            pico_tree_delete(&MyRecords, meta_record);
+            pico_mdns_table_delete(&MyRecords, meta_record);
             pico_mdns_record_delete((void **)&meta_record);
         }
     }
@@ -2634,7 +2955,8 @@ pico_mdns_reply( pico_mdns_rtree *antree, struct pico_ip4 peer )
 
 /* ****************************************************************************
  *  Parses DNS records from a plain chunk of data and looks for them in the
- *  answer tree. If they're found, they will be removed from the tree.
+ *  answer tree. If they're found with at least half of their TTL left, they
+ *  will be removed from the tree and deleted (RFC6762: 7.1).
  *
  *  @param rtree   Tree to look in for known answers
  *  @param packet  DNS packet in which to look for known answers
@@ -2648,13 +2970,13 @@ pico_mdns_apply_k_a_s( pico_mdns_rtree *rtree,
                        uint16_t ancount,
                        uint8_t **data )
 {
-    struct pico_tree_node *node = NULL, *next = NULL;
     struct pico_mdns_record *record = NULL, ka = {
         0
     };
     struct pico_dns_record answer = {
         0
     };
+    uint32_t ttl = 0;
     uint16_t i = 0;
 
     /* Check params */
@@ -2678,11 +3000,13 @@ pico_mdns_apply_k_a_s( pico_mdns_rtree *rtree,
         pico_dns_record_decompress(&answer, packet);
         ka.record = &answer;
 
-        /* If the answer is in the record vector */
-        pico_tree_foreach_safe(node, rtree, next) {
-            if ((record = node->keyValue)) {
-                if (pico_mdns_record_cmp(record, &ka) == 0)
-                    record = pico_tree_delete(rtree, record);
+        /* If the answer is in the record vector, the tree is ordered by
+         * type, name and rdata so this is a single lookup */
+        if ((record = pico_tree_findKey(rtree, &ka))) {
+            ttl = long_be(record->record->rsuffix->rttl);
+            if (long_be(answer.rsuffix->rttl) >= (ttl >> 1)) {
+                record = pico_tree_delete(rtree, record);
+                pico_mdns_record_delete((void **)&record);
             }
         }
         PICO_FREE(ka.record->rname);
@@ -2900,6 +3224,69 @@ pico_mdns_event4( uint16_t ev, struct pico_socket *s )
 
 /* MARK: ADDRESS RESOLUTION */
 
+#if PICO_MDNS_ALLOW_CACHING == 1
+/* ****************************************************************************
+ *  Collects the known answers to put in a query from the Cache: the records
+ *  that answer one of the questions and still have more than half of their
+ *  TTL left (RFC6762: 7.1). Stops when the packet would exceed the mDNS MTU.
+ *
+ *  @param qtree  Questions of the query.
+ *  @param antree DNS record tree to add copies of the known answers to, with
+ *				  their remaining TTL.
+ *  @return void
+ * ****************************************************************************/
+static void
+pico_mdns_cache_known_answers( pico_dns_qtree *qtree,
+                               pico_dns_rtree *antree )
+{
+    struct pico_tree_node *node = NULL;
+    struct pico_dns_question *question = NULL;
+    struct pico_mdns_record *record = NULL;
+    struct pico_dns_record *copy = NULL;
+    uint32_t size = sizeof(struct pico_dns_header);
+    uint32_t ttl = 0, left = 0;
+    uint16_t qtype = 0;
+
+    pico_tree_foreach(node, qtree) {
+        if ((question = node->keyValue))
+            size += question->qname_length +
+                    (uint32_t)sizeof(struct pico_dns_question_suffix);
+    }
+
+    pico_tree_foreach(node, qtree) {
+        if (!(question = node->keyValue))
+            continue;
+
+        qtype = short_be(question->qsuffix->qtype);
+        for (record = CacheIndex[pico_mdns_index_hash(question->qname)];
+             record; record = record->next) {
+            if (strcasecmp(record->record->rname, question->qname) ||
+                ((PICO_DNS_TYPE_ANY != qtype) &&
+                 (short_be(record->record->rsuffix->rtype) != qtype)))
+                continue;
+
+            ttl = long_be(record->record->rsuffix->rttl);
+            left = record->expire - cache_clock;
+            if (left <= (ttl >> 1))
+                continue;
+
+            size += (uint32_t)record->record->rname_length +
+                    (uint32_t)sizeof(struct pico_dns_record_suffix) +
+                    short_be(record->record->rsuffix->rdlength);
+            if (size > PICO_MDNS_MAXBUF)
+                return;
+
+            if (!(copy = pico_dns_record_copy(record->record)))
+                return;
+
+            copy->rsuffix->rttl = long_be(left);
+            if (pico_tree_insert(antree, copy))
+                pico_dns_record_delete((void **)&copy);
+        }
+    }
+}
+#endif
+
 /* ****************************************************************************
  *  Send a mDNS query packet on the wire. This is scheduled with a pico_timer-
  *  event.
@@ -2911,6 +3298,7 @@ static void
 pico_mdns_send_query_packet( pico_time now, void *arg )
 {
     struct pico_mdns_cookie *cookie = (struct pico_mdns_cookie *)arg;
+    PICO_DNS_RTREE_DECLARE(antree);
     pico_dns_qtree *questions = NULL;
     pico_dns_packet *packet = NULL;
     uint16_t len = 0;
@@ -2921,9 +3309,14 @@ pico_mdns_send_query_packet( pico_time now, void *arg )
     if (!cookie || cookie->type != PICO_MDNS_PACKET_TYPE_QUERY)
         return;
 
-    /* Create DNS query packet */
+    /* Create DNS query packet, with the answers we know already */
     questions = &(cookie->qtree);
-    if (!(packet = pico_dns_query_create(questions, NULL, NULL, NULL, &len))) {
+#if PICO_MDNS_ALLOW_CACHING == 1
+    pico_mdns_cache_known_answers(questions, &antree);
+#endif
+    packet = pico_dns_query_create(questions, &antree, NULL, NULL, &len);
+    PICO_DNS_RTREE_DESTROY(&antree);
+    if (!packet) {
         mdns_dbg("Could not create query packet!\n");
         return;
     }
@@ -3575,9 +3968,9 @@ pico_mdns_cleanup( void )
 
     /* Clear out every memory structure used by mDNS */
 #if PICO_MDNS_ALLOW_CACHING == 1
-    PICO_MDNS_RTREE_DESTROY(&Cache);
+    pico_mdns_table_destroy(&Cache);
 #endif /* PICO_MDNS_ALLOW_CACHING */
-    PICO_MDNS_RTREE_DESTROY(&MyRecords);
+    pico_mdns_table_destroy(&MyRecords);
     PICO_MDNS_CTREE_DESTROY(&Cookies);
 
     /* Cancel every timer */
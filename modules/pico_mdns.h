@@ -59,6 +59,10 @@ struct pico_mdns_record
     uint32_t current_ttl;           /* Current TTL */
     uint8_t flags;                  /* Resource Record flags */
     uint8_t claim_id;               /* Claim ID number */
+    struct pico_mdns_record *next;  /* Hash chain in Cache or MyRecords */
+    uint32_t expire;                /* Cache: tick at which the RR expires */
+    uint32_t refresh;               /* Cache: tick of the next refresh query */
+    uint32_t heap_index;            /* Cache: position in the expiry heap */
 };
 
 /* ****************************************************************************
@@ -10,6 +10,23 @@
 #include "pico_tree.h"
 #include "pico_config.h"
 #include "pico_protocol.h" /* For pico_err */
+#include "pico_queue.h"    /* For pico_mutex_* */
+
+/* Size class frontend: heap requests up to the largest class are served from
+ * per class free lists, refilled from and drained to the page manager in batches. */
+#ifndef PICO_MM_CACHE_MAX
+#define PICO_MM_CACHE_MAX 32   /* cached blocks per class before draining */
+#endif
+#ifndef PICO_MM_BATCH
+#define PICO_MM_BATCH 8        /* blocks moved per refill or drain */
+#endif
+#ifndef PICO_MM_THREAD_LOCAL
+# ifdef PICO_SUPPORT_MUTEX
+#  define PICO_MM_THREAD_LOCAL __thread
+# else
+#  define PICO_MM_THREAD_LOCAL
+# endif
+#endif
 
 #ifdef DEBUG_MM
 #define DBG_MM(x, args ...)        dbg("[%s:%s:%i] "x" \n",__FILE__,__func__,__LINE__ ,##args )
@@ -75,6 +92,7 @@ static uint32_t slab_size_global = PICO_MEM_DEFAULT_SLAB_SIZE;
  */
 #define HEAP_BLOCK_NOT_FREE 0xCAFED001
 #define HEAP_BLOCK_FREE 0xCAFED00E
+#define MM_CACHED_MAGIC 0xCAFED00C
 
 #define SLAB_BLOCK_TYPE 0
 #define HEAP_BLOCK_TYPE 1
@@ -200,6 +218,60 @@ struct pico_mem_slab_node
 
 static struct pico_mem_manager*manager = NULL;
 
+static const uint16_t mm_class_size[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768
+};
+#define MM_CLASSES (sizeof(mm_class_size) / sizeof(mm_class_size[0]))
+#define MM_CLASS_MAX 768
+#define MM_CLASS_SHIFT 4
+#define MM_CLASS_OF(len) (mm_class_of[((len) + (1u << MM_CLASS_SHIFT) - 1) >> MM_CLASS_SHIFT])
+
+/* Smallest class holding (i << MM_CLASS_SHIFT) bytes */
+static const uint8_t mm_class_of[(MM_CLASS_MAX >> MM_CLASS_SHIFT) + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7,
+    7, 8, 8, 8, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9,
+    9, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+    10
+};
+
+/* Data of a cached block, which stays HEAP_BLOCK_NOT_FREE for the page manager */
+struct pico_mem_cached
+{
+    struct pico_mem_cached*next;
+    uint32_t magic;
+};
+
+struct pico_mem_class_cache
+{
+    struct pico_mem_cached*head;
+    uint32_t count;
+};
+
+struct pico_mem_cache
+{
+    struct pico_mem_class_cache cls[MM_CLASSES];
+    uint32_t generation;
+};
+
+static PICO_MM_THREAD_LOCAL struct pico_mem_cache mm_cache;
+/* Bumped by deinit: caches of another generation point into freed pages */
+static uint32_t mm_generation;
+#ifdef PICO_SUPPORT_MUTEX
+/* Created by init, freed by deinit. Held by every path into the page manager,
+ * which includes page0 and the slab tree: those never lock themselves. */
+static void*mm_mutex = NULL;
+#define MM_LOCK()             pico_mutex_lock(mm_mutex)
+#define MM_UNLOCK()           pico_mutex_unlock(mm_mutex)
+/* Read by the lock-free fast path */
+#define MM_GENERATION()       __atomic_load_n(&mm_generation, __ATOMIC_ACQUIRE)
+#define MM_GENERATION_BUMP()  __atomic_add_fetch(&mm_generation, 1u, __ATOMIC_RELEASE)
+#else
+#define MM_LOCK()             do {} while(0)
+#define MM_UNLOCK()           do {} while(0)
+#define MM_GENERATION()       (mm_generation)
+#define MM_GENERATION_BUMP()  (mm_generation++)
+#endif
+
 /*
  * This compare function will be called by pico_tree.c to compare 2 keyValues (type: struct pico_mem_slab_nodes)
  * We want to compare slab_nodes by their size. We also want to be able to directly compare an integer, which explains
@@ -343,11 +415,7 @@ static void _pico_mem_init_page(struct pico_mem_page*page, size_t slabsize)
     DBG_MM_GREEN("Initialized page %p with slabsize %u", page, slabsize);
 }
 
-/*
- * Initializes the memory by creating a memory manager page and one page with default slab size
- * A maximum space of memsize can be occupied by the memory manager at any time
- */
-void pico_mem_init(uint32_t memsize)
+static void _pico_mem_init(uint32_t memsize)
 {
     struct pico_mem_block*first_block;
     struct pico_mem_page*page;
@@ -421,10 +489,7 @@ void pico_mem_init(uint32_t memsize)
     }
 }
 
-/*
- * Deinitializes the memory manager, returning all its memory to the system's control.
- */
-void pico_mem_deinit()
+static void _pico_mem_deinit(void)
 {
     struct pico_mem_page*next_page;
     struct pico_mem_manager_extra*next_manager_page;
@@ -452,10 +517,44 @@ void pico_mem_deinit()
         pico_free(manager);
         manager = NULL;
         slab_size_global = PICO_MEM_DEFAULT_SLAB_SIZE;
+        MM_GENERATION_BUMP();
         DBG_MM_GREEN("Memory manager reset");
     }
 }
 
+/*
+ * Initializes the memory by creating a memory manager page and one page with default slab size
+ * A maximum space of memsize can be occupied by the memory manager at any time
+ */
+void pico_mem_init(uint32_t memsize)
+{
+#ifdef PICO_SUPPORT_MUTEX
+    if(mm_mutex == NULL)
+        mm_mutex = pico_mutex_init();
+#endif
+    MM_LOCK();
+    _pico_mem_init(memsize);
+    MM_UNLOCK();
+}
+
+/*
+ * Deinitializes the memory manager, returning all its memory to the system's control.
+ * No other thread may use the memory manager while, or after, this runs.
+ */
+void pico_mem_deinit()
+{
+    MM_LOCK();
+    _pico_mem_deinit();
+    MM_UNLOCK();
+#ifdef PICO_SUPPORT_MUTEX
+    if(mm_mutex != NULL)
+    {
+        PICOTCP_MUTEX_DEL(mm_mutex);
+        mm_mutex = NULL;
+    }
+#endif
+}
+
 /*
  * This function is called internally by page0_zalloc if there isn't enough space left in the heap of the initial memory page
  * This function allocates heap space in extra manager pages, creating new pages as necessary.
@@ -575,6 +674,7 @@ static void*_pico_mem_manager_extra_alloc(struct pico_mem_manager_extra*heap_pag
 /*
  * Page0 zalloc is called by pico_tree.c so that nodes which contain pointers to the free slab objects are put in the
  * manager page. Additional manager pages can be created if necessary.
+ * Only called from within the page manager, with mm_mutex held.
  */
 void*pico_mem_page0_zalloc(size_t len)
 {
@@ -689,8 +789,7 @@ void*pico_mem_page0_zalloc(size_t len)
 static void _pico_mem_free_and_merge_heap_block(struct pico_mem_page*page, struct pico_mem_block*mem_block)
 {
     uint8_t*byteptr;
-    /* pico_mem_block* prev = NULL; */
-    struct pico_mem_block*prev;
+    struct pico_mem_block*prev = NULL;
     struct pico_mem_block*curr;
     struct pico_mem_block*next;
 
@@ -722,7 +821,8 @@ static void _pico_mem_free_and_merge_heap_block(struct pico_mem_page*page, struc
         next = (struct pico_mem_block*) byteptr;
     }
     DBG_MM("Checking heap block (%s) with size %u at %p", (curr->internals.heap_block.free == HEAP_BLOCK_FREE) ? "free" : "not free", curr->internals.heap_block.size, curr);
-    if(curr->type == HEAP_BLOCK_TYPE && prev->internals.heap_block.free == HEAP_BLOCK_FREE && curr->internals.heap_block.free == HEAP_BLOCK_FREE)
+    /* prev is NULL when the heap is a single block */
+    if(prev != NULL && curr->type == HEAP_BLOCK_TYPE && prev->internals.heap_block.free == HEAP_BLOCK_FREE && curr->internals.heap_block.free == HEAP_BLOCK_FREE)
     {
         DBG_MM_BLUE("Merging blocks with sizes %u and %u", prev->internals.heap_block.size, curr->internals.heap_block.size);
         prev->internals.heap_block.size += (uint32_t)sizeof(struct pico_mem_block) + curr->internals.heap_block.size;
@@ -975,9 +1075,9 @@ static void*_pico_mem_find_slab(size_t len)
 }
 
 /*
- * This method is called by the picotcp stack to free memory.
+ * Returns a block to the page it was taken from. Called by the size class frontend.
  */
-void pico_mem_free(void*ptr)
+static void _pico_mem_free(void*ptr)
 {
     struct pico_mem_block*generic_block;
     struct pico_mem_page*page;
@@ -1103,7 +1203,7 @@ static size_t _pico_mem_determine_slab_size(size_t len)
 /************************NEW***************************/
 
 /*
- * This method will be called by the picotcp stack to allocate new memory.
+ * Page manager allocation, used by the size class frontend to refill its caches.
  * If the requested size is bigger than the threshold of a slab object,
  * then the manager will try to find an appropriate slab object and return a pointer
  * to the beginning of the data in that slab object.
@@ -1120,7 +1220,7 @@ static size_t _pico_mem_determine_slab_size(size_t len)
  *
  * In any other case, the manager will return NULL.
  */
-void*pico_mem_zalloc(size_t len)
+static void*_pico_mem_zalloc(size_t len)
 {
     struct pico_mem_page*page;
     void*returnCandidate;
@@ -1231,8 +1331,194 @@ void*pico_mem_zalloc(size_t len)
     /* TODO: Careful, if the current slabsize is determined in another way, this needs to change too */
     return _pico_mem_find_slab(slab_size_global);
 }
+
+/*
+ * Size class frontend
+ *
+ * Blocks freed by the stack are kept on the free list of their class, linked through
+ * their first data bytes. An allocation pops the list head in O(1).
+ * With PICO_SUPPORT_MUTEX every thread has its own lists, so only refill and drain
+ * (the page manager itself) take the lock, and the fast path only reads the generation. Blocks cached by a thread that exits are
+ * lost until pico_mem_deinit.
+ */
+static struct pico_mem_cache*_pico_mem_cache(void)
+{
+    struct pico_mem_cache*cache = &mm_cache;
+    uint32_t generation = MM_GENERATION();
+
+    if(cache->generation != generation)
+    {
+        memset(cache, 0, sizeof(struct pico_mem_cache));
+        cache->generation = generation;
+    }
+
+    return cache;
+}
+
+static void _pico_mem_cache_push(struct pico_mem_class_cache*cls, void*ptr)
+{
+    struct pico_mem_cached*c = (struct pico_mem_cached*)ptr;
+
+    c->magic = MM_CACHED_MAGIC;
+    c->next = cls->head;
+    cls->head = c;
+    cls->count++;
+}
+
+static void*_pico_mem_cache_pop(struct pico_mem_class_cache*cls)
+{
+    struct pico_mem_cached*c = cls->head;
+
+    if(c == NULL)
+        return NULL;
+
+    cls->head = c->next;
+    cls->count--;
+    c->magic = 0;
+    return c;
+}
+
+/* The magic may be user data: only a block on the list is a double free */
+static int _pico_mem_cache_contains(struct pico_mem_class_cache*cls, void*ptr)
+{
+    struct pico_mem_cached*c;
+
+    if(((struct pico_mem_cached*)ptr)->magic != MM_CACHED_MAGIC)
+        return 0;
+
+    for(c = cls->head; c != NULL; c = c->next)
+    {
+        if((void*)c == ptr)
+            return 1;
+    }
+    return 0;
+}
+
+/* Takes a batch of blocks from the page manager, the first one is returned */
+static void*_pico_mem_cache_refill(struct pico_mem_class_cache*cls, size_t size)
+{
+    void*ret;
+    void*ptr;
+    uint32_t i;
+
+    MM_LOCK();
+    ret = _pico_mem_zalloc(size);
+    for(i = 1; ret && (i < PICO_MM_BATCH); i++)
+    {
+        ptr = _pico_mem_zalloc(size);
+        if(ptr == NULL)
+            break;
+
+        /* The page manager fell back to a slab: the heap is full, stop here */
+        if(((struct pico_mem_block*)ptr - 1)->type != HEAP_BLOCK_TYPE)
+        {
+            _pico_mem_free(ptr);
+            break;
+        }
+
+        _pico_mem_cache_push(cls, ptr);
+    }
+    MM_UNLOCK();
+    return ret;
+}
+
+/* Gives count blocks of a class back to the page manager */
+static void _pico_mem_cache_drain(struct pico_mem_class_cache*cls, uint32_t count)
+{
+    void*ptr;
+
+    MM_LOCK();
+    while(count-- > 0)
+    {
+        ptr = _pico_mem_cache_pop(cls);
+        if(ptr == NULL)
+            break;
+
+        _pico_mem_free(ptr);
+    }
+    MM_UNLOCK();
+}
+
+/*
+ * This method will be called by the picotcp stack to allocate new memory.
+ * Heap sized requests are served by the size class caches, everything else
+ * (and a cache miss) goes to the page manager.
+ */
+void*pico_mem_zalloc(size_t len)
+{
+    struct pico_mem_class_cache*cls;
+    void*ret;
+    uint8_t c;
+
+    if(manager == NULL)
+    {
+        DBG_MM_RED("Invalid alloc, a memory manager hasn't been instantiated yet!");
+        return NULL;
+    }
+
+    if(len > MM_CLASS_MAX)
+    {
+        MM_LOCK();
+        ret = _pico_mem_zalloc(len);
+        MM_UNLOCK();
+        return ret;
+    }
+
+    c = MM_CLASS_OF(len);
+    cls = &_pico_mem_cache()->cls[c];
+    ret = _pico_mem_cache_pop(cls);
+    if(ret == NULL)
+        return _pico_mem_cache_refill(cls, mm_class_size[c]);
+
+    memset(ret, 0, len);
+    return ret;
+}
+
+/*
+ * This method is called by the picotcp stack to free memory.
+ */
+void pico_mem_free(void*ptr)
+{
+    struct pico_mem_block*block;
+    struct pico_mem_class_cache*cls;
+    uint32_t size;
+    uint8_t c;
+
+    if(ptr == NULL)
+        return;
+
+    block = (struct pico_mem_block*)ptr - 1;
+    size = block->internals.heap_block.size;
+    if((block->type == HEAP_BLOCK_TYPE) && (block->internals.heap_block.free == HEAP_BLOCK_NOT_FREE) &&
+       (size >= mm_class_size[0]) && (size <= MM_CLASS_MAX))
+    {
+        /* Largest class that fits in the block */
+        c = MM_CLASS_OF(size);
+        if(mm_class_size[c] > size)
+            c--;
+
+        cls = &_pico_mem_cache()->cls[c];
+        if(_pico_mem_cache_contains(cls, ptr))
+        {
+            DBG_MM_RED("ERROR: Double free on a cached heap block (recovered)!");
+            return;
+        }
+
+        _pico_mem_cache_push(cls, ptr);
+        if(cls->count > PICO_MM_CACHE_MAX)
+            _pico_mem_cache_drain(cls, PICO_MM_BATCH);
+
+        return;
+    }
+
+    MM_LOCK();
+    _pico_mem_free(ptr);
+    MM_UNLOCK();
+}
+
 /*
  * This method frees heap space used in the manager page, or in one of the extra manager pages
+ * Only called from within the page manager, with mm_mutex held.
  */
 void pico_mem_page0_free(void*ptr)
 {
@@ -1288,6 +1574,12 @@ void pico_mem_cleanup(uint32_t timestamp)
     int i;
 
     DBG_MM_YELLOW("Starting cleanup with timestamp %u", timestamp);
+    /* Only this thread's caches can be reached from here */
+    for(i = 0; i < (int)MM_CLASSES; i++)
+        _pico_mem_cache_drain(&_pico_mem_cache()->cls[i], _pico_mem_cache()->cls[i].count);
+
+    MM_LOCK();
+
     /* Iterate over all pages */
     page = manager->first_page;
     prev_page = NULL;
@@ -1460,6 +1752,7 @@ void pico_mem_cleanup(uint32_t timestamp)
         prev_heap_page = heap_page;
         heap_page = heap_page->next;
     }
+    MM_UNLOCK();
 }
 
 
@@ -25,22 +25,68 @@
 #define nat_dbg(...) do {} while(0)
 #endif
 
-#define PICO_NAT_TIMEWAIT  240000 /* msec (4 mins) */
+/* Connection tracking table: every tuple is hashed twice, once on the private
+ * side (src_addr, src_port, proto) for outbound lookups and once on the public
+ * side (nat_port, proto) for inbound lookups. Both tables start with
+ * 2^PICO_NAT_HASH_BITS buckets and double when the load factor exceeds 2.
+ */
+#ifndef PICO_NAT_HASH_BITS
+#define PICO_NAT_HASH_BITS      6u
+#endif
+#ifndef PICO_NAT_HASH_BITS_MAX
+#define PICO_NAT_HASH_BITS_MAX  16u
+#endif
+
+/* Expiry timer wheel: PICO_NAT_WHEEL_SLOTS buckets of PICO_NAT_WHEEL_TICK msec */
+#ifndef PICO_NAT_WHEEL_SLOTS
+#define PICO_NAT_WHEEL_SLOTS    64u
+#endif
+#define PICO_NAT_WHEEL_TICK     4000u /* msec */
+
+/* Idle timeouts (msec), per protocol and TCP state */
+#define PICO_NAT_TIMEOUT_TCP_SYN      120000u   /* 2 mins */
+#define PICO_NAT_TIMEOUT_TCP_EST      86400000u /* 24 hours */
+#define PICO_NAT_TIMEOUT_TCP_FIN      240000u   /* 4 mins */
+#define PICO_NAT_TIMEOUT_TCP_CLOSED   10000u    /* 10 secs */
+#define PICO_NAT_TIMEOUT_UDP          240000u   /* 4 mins */
+#define PICO_NAT_TIMEOUT_ICMP         60000u    /* 1 min */
+#define PICO_NAT_TIMEOUT_OTHER        240000u   /* 4 mins */
+
+/* Range of public ports handed out to outbound connections (host order) */
+#ifndef PICO_NAT_PORT_MIN
+#define PICO_NAT_PORT_MIN       1024u
+#endif
+#ifndef PICO_NAT_PORT_MAX
+#define PICO_NAT_PORT_MAX       65535u
+#endif
+#define PICO_NAT_PORT_RETRY     128
 
 #define PICO_NAT_INBOUND   0
 #define PICO_NAT_OUTBOUND  1
 
+#define PICO_NAT_TCP_NONE         0
+#define PICO_NAT_TCP_SYN          1
+#define PICO_NAT_TCP_ESTABLISHED  2
+#define PICO_NAT_TCP_FIN          3
+#define PICO_NAT_TCP_CLOSED       4
+
 struct pico_nat_tuple {
+    struct pico_nat_tuple *out_next;    /* outbound hash chain */
+    struct pico_nat_tuple *in_next;     /* inbound hash chain */
+    struct pico_nat_tuple *wheel_next;  /* expiry bucket */
+    struct pico_nat_tuple *wheel_prev;
+    pico_time expire;
     uint8_t proto;
-    uint16_t conn_active : 11;
-    uint16_t portforward : 1;
-    uint16_t rst : 1;
-    uint16_t syn : 1;
-    uint16_t fin_in : 1;
-    uint16_t fin_out : 1;
+    uint8_t tcp_state;
+    uint8_t portforward : 1;
+    uint8_t rst : 1;
+    uint8_t syn : 1;
+    uint8_t fin_in : 1;
+    uint8_t fin_out : 1;
     uint16_t src_port;
     uint16_t dst_port;
     uint16_t nat_port;
+    uint16_t wheel_slot;
     struct pico_ip4 src_addr;
     struct pico_ip4 dst_addr;
     struct pico_ip4 nat_addr;
@@ -48,99 +94,226 @@ struct pico_nat_tuple {
 
 static struct pico_ipv4_link *nat_link = NULL;
 
-static int nat_cmp_natport(struct pico_nat_tuple *a, struct pico_nat_tuple *b)
+static struct pico_nat_tuple **NATOutbound = NULL;
+static struct pico_nat_tuple **NATInbound = NULL;
+static uint32_t nat_hash_bits = 0;
+static uint32_t nat_count = 0;
+static struct pico_nat_tuple *NATWheel[PICO_NAT_WHEEL_SLOTS];
+static pico_time nat_wheel_last = 0; /* last wheel tick processed */
+static uint32_t nat_timer = 0;
+static uint32_t nat_port_next = 0;   /* host order */
+
+static inline uint32_t nat_hash(uint32_t key)
 {
+    return (key * 2654435761u) >> (32u - nat_hash_bits);
+}
 
-    if (a->nat_port < b->nat_port)
-        return -1;
+static inline uint32_t nat_hash_outbound(struct pico_ip4 *src_addr, uint16_t src_port, uint8_t proto)
+{
+    return nat_hash(src_addr->addr ^ ((uint32_t)src_port << 8) ^ proto);
+}
+
+static inline uint32_t nat_hash_inbound(uint16_t nat_port, uint8_t proto)
+{
+    return nat_hash(((uint32_t)proto << 16) | nat_port);
+}
 
-    if (a->nat_port > b->nat_port)
+static struct pico_nat_tuple *nat_find_outbound(struct pico_ip4 *src_addr, uint16_t src_port, uint8_t proto)
+{
+    struct pico_nat_tuple *t;
+    if (!NATOutbound)
+        return NULL;
 
-        return 1;
+    t = NATOutbound[nat_hash_outbound(src_addr, src_port, proto)];
+    while (t) {
+        if ((t->src_addr.addr == src_addr->addr) && (t->src_port == src_port) && (t->proto == proto))
+            return t;
 
-    return 0;
+        t = t->out_next;
+    }
+    return NULL;
+}
 
+static struct pico_nat_tuple *nat_find_inbound(uint16_t nat_port, uint8_t proto)
+{
+    struct pico_nat_tuple *t;
+    if (!NATInbound)
+        return NULL;
+
+    t = NATInbound[nat_hash_inbound(nat_port, proto)];
+    while (t) {
+        if ((t->nat_port == nat_port) && (t->proto == proto))
+            return t;
+
+        t = t->in_next;
+    }
+    return NULL;
+}
+
+static void nat_hash_link(struct pico_nat_tuple *t)
+{
+    uint32_t hash = nat_hash_outbound(&t->src_addr, t->src_port, t->proto);
+    t->out_next = NATOutbound[hash];
+    NATOutbound[hash] = t;
+    hash = nat_hash_inbound(t->nat_port, t->proto);
+    t->in_next = NATInbound[hash];
+    NATInbound[hash] = t;
 }
 
-static int nat_cmp_srcport(struct pico_nat_tuple *a, struct pico_nat_tuple *b)
+static int nat_hash_resize(uint32_t bits)
 {
+    struct pico_nat_tuple **old_out = NATOutbound, **new_out, **new_in;
+    struct pico_nat_tuple *t, *next;
+    uint32_t i, old_size = nat_hash_bits ? (1u << nat_hash_bits) : 0u;
 
-    if (a->src_port < b->src_port)
+    new_out = PICO_ZALLOC(sizeof(struct pico_nat_tuple *) << bits);
+    new_in = PICO_ZALLOC(sizeof(struct pico_nat_tuple *) << bits);
+    if (!new_out || !new_in) {
+        if (new_out)
+            PICO_FREE(new_out);
+
+        if (new_in)
+            PICO_FREE(new_in);
+
+        pico_err = PICO_ERR_ENOMEM;
         return -1;
+    }
 
-    if (a->src_port > b->src_port)
+    if (NATInbound)
+        PICO_FREE(NATInbound);
 
-        return 1;
+    NATOutbound = new_out;
+    NATInbound = new_in;
+    nat_hash_bits = bits;
+    for (i = 0; i < old_size; i++) {
+        for (t = old_out[i]; t; t = next) {
+            next = t->out_next;
+            nat_hash_link(t);
+        }
+    }
+    if (old_out)
+        PICO_FREE(old_out);
 
     return 0;
-
 }
 
-static int nat_cmp_proto(struct pico_nat_tuple *a, struct pico_nat_tuple *b)
+static void nat_hash_unlink(struct pico_nat_tuple *t)
 {
-    if (a->proto < b->proto)
-        return -1;
+    struct pico_nat_tuple **pp;
 
-    if (a->proto > b->proto)
-        return 1;
+    pp = &NATOutbound[nat_hash_outbound(&t->src_addr, t->src_port, t->proto)];
+    while (*pp && (*pp != t))
+        pp = &(*pp)->out_next;
+    if (*pp)
+        *pp = t->out_next;
 
-    return 0;
+    pp = &NATInbound[nat_hash_inbound(t->nat_port, t->proto)];
+    while (*pp && (*pp != t))
+        pp = &(*pp)->in_next;
+    if (*pp)
+        *pp = t->in_next;
+
+    nat_count--;
 }
 
-static int nat_cmp_address(struct pico_nat_tuple *a, struct pico_nat_tuple *b)
+static inline uint32_t nat_wheel_slot(pico_time tick)
 {
-    return pico_ipv4_compare(&a->src_addr, &b->src_addr);
+    return (uint32_t)(tick % PICO_NAT_WHEEL_SLOTS);
 }
 
-static int nat_cmp_inbound(void *ka, void *kb)
+static void nat_wheel_unlink(struct pico_nat_tuple *t)
 {
-    struct pico_nat_tuple *a = ka, *b = kb;
-    int cport = nat_cmp_natport(a, b);
-    if (cport)
-        return cport;
+    if (t->wheel_prev)
+        t->wheel_prev->wheel_next = t->wheel_next;
+    else if (NATWheel[t->wheel_slot] == t)
+        NATWheel[t->wheel_slot] = t->wheel_next;
 
-    return nat_cmp_proto(a, b);
-}
+    if (t->wheel_next)
+        t->wheel_next->wheel_prev = t->wheel_prev;
 
+    t->wheel_next = NULL;
+    t->wheel_prev = NULL;
+}
 
-static int nat_cmp_outbound(void *ka, void *kb)
+/* Entries are filed in the bucket of their expiry tick. Refreshing an entry
+ * only moves t->expire forward: the entry is re-filed lazily when its old
+ * bucket comes up, so the per-packet path never touches the wheel.
+ */
+static void nat_wheel_link(struct pico_nat_tuple *t, pico_time tick)
 {
-    struct pico_nat_tuple *a = ka, *b = kb;
-    int caddr, cport;
+    uint32_t slot;
+    if (tick <= nat_wheel_last)
+        tick = nat_wheel_last + 1;
+
+    slot = nat_wheel_slot(tick);
+    t->wheel_slot = (uint16_t)slot;
+    t->wheel_prev = NULL;
+    t->wheel_next = NATWheel[slot];
+    if (t->wheel_next)
+        t->wheel_next->wheel_prev = t;
+
+    NATWheel[slot] = t;
+}
 
-    caddr = nat_cmp_address(a, b);
-    if (caddr)
-        return caddr;
+static pico_time nat_tuple_timeout(struct pico_nat_tuple *t)
+{
+    switch (t->proto) {
+    case PICO_PROTO_TCP:
+        switch (t->tcp_state) {
+        case PICO_NAT_TCP_ESTABLISHED:
+            return PICO_NAT_TIMEOUT_TCP_EST;
+        case PICO_NAT_TCP_FIN:
+            return PICO_NAT_TIMEOUT_TCP_FIN;
+        case PICO_NAT_TCP_CLOSED:
+            return PICO_NAT_TIMEOUT_TCP_CLOSED;
+        default:
+            return PICO_NAT_TIMEOUT_TCP_SYN;
+        }
+    case PICO_PROTO_UDP:
+        return PICO_NAT_TIMEOUT_UDP;
+    case PICO_PROTO_ICMP4:
+        return PICO_NAT_TIMEOUT_ICMP;
+    default:
+        return PICO_NAT_TIMEOUT_OTHER;
+    }
+}
 
-    cport = nat_cmp_srcport(a, b);
+static inline void nat_tuple_refresh(struct pico_nat_tuple *t)
+{
+    pico_time expire = pico_tick + nat_tuple_timeout(t);
+    if (expire >= t->expire) {
+        /* Closing states may only shorten the lifetime */
+        if (t->tcp_state < PICO_NAT_TCP_FIN)
+            t->expire = expire;
 
-    if (cport)
-        return cport;
+        return;
+    }
 
-    return nat_cmp_proto(a, b);
+    /* Shortened lifetime (FIN/RST seen): re-file now instead of waiting for
+     * the old, later bucket to come up */
+    nat_wheel_unlink(t);
+    t->expire = expire;
+    nat_wheel_link(t, expire / PICO_NAT_WHEEL_TICK);
 }
 
-static PICO_TREE_DECLARE(NATOutbound, nat_cmp_outbound);
-static PICO_TREE_DECLARE(NATInbound, nat_cmp_inbound);
-
 void pico_ipv4_nat_print_table(void)
 {
     struct pico_nat_tuple *t = NULL;
-    struct pico_tree_node *index = NULL;
+    uint32_t i;
     (void)t;
 
     nat_dbg("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
     nat_dbg("+                                                        NAT table                                                       +\n");
     nat_dbg("+------------------------------------------------------------------------------------------------------------------------+\n");
-    nat_dbg("+ src_addr | src_port | dst_addr | dst_port | nat_addr | nat_port | proto | conn active | FIN1 | FIN2 | SYN | RST | FORW +\n");
+    nat_dbg("+ src_addr | src_port | dst_addr | dst_port | nat_addr | nat_port | proto |  expire (ms)  | FIN1 | FIN2 | SYN | RST | FORW +\n");
     nat_dbg("+------------------------------------------------------------------------------------------------------------------------+\n");
 
-    pico_tree_foreach(index, &NATOutbound)
-    {
-        t = index->keyValue;
-        nat_dbg("+ %08X |  %05u   | %08X |  %05u   | %08X |  %05u   |  %03u  |     %03u     |   %u  |   %u  |  %u  |  %u  |   %u  +\n",
-                long_be(t->src_addr.addr), t->src_port, long_be(t->dst_addr.addr), t->dst_port, long_be(t->nat_addr.addr), t->nat_port,
-                t->proto, t->conn_active, t->fin_in, t->fin_out, t->syn, t->rst, t->portforward);
+    for (i = 0; NATOutbound && (i < (1u << nat_hash_bits)); i++) {
+        for (t = NATOutbound[i]; t; t = t->out_next) {
+            nat_dbg("+ %08X |  %05u   | %08X |  %05u   | %08X |  %05u   |  %03u  | %13lu |   %u  |   %u  |  %u  |  %u  |   %u  +\n",
+                    long_be(t->src_addr.addr), t->src_port, long_be(t->dst_addr.addr), t->dst_port, long_be(t->nat_addr.addr), t->nat_port,
+                    t->proto, (unsigned long)t->expire, t->fin_in, t->fin_out, t->syn, t->rst, t->portforward);
+        }
     }
     nat_dbg("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
 }
@@ -153,25 +326,14 @@ void pico_ipv4_nat_print_table(void)
  */
 static struct pico_nat_tuple *pico_ipv4_nat_find_tuple(uint16_t nat_port, struct pico_ip4 *src_addr, uint16_t src_port, uint8_t proto)
 {
-    struct pico_nat_tuple *found = NULL, test = {
+    struct pico_ip4 any = {
         0
     };
 
-    test.nat_port = nat_port;
-    test.src_port = src_port;
-    test.proto = proto;
-    if (src_addr)
-        test.src_addr = *src_addr;
-
     if (nat_port)
-        found = pico_tree_findKey(&NATInbound, &test);
-    else
-        found = pico_tree_findKey(&NATOutbound, &test);
+        return nat_find_inbound(nat_port, proto);
 
-    if (found)
-        return found;
-    else
-        return NULL;
+    return nat_find_outbound(src_addr ? src_addr : &any, src_port, proto);
 }
 
 int pico_ipv4_nat_find(uint16_t nat_port, struct pico_ip4 *src_addr, uint16_t src_port, uint8_t proto)
@@ -186,9 +348,22 @@ int pico_ipv4_nat_find(uint16_t nat_port, struct pico_ip4 *src_addr, uint16_t sr
 }
 
 static struct pico_nat_tuple *pico_ipv4_nat_add(struct pico_ip4 dst_addr, uint16_t dst_port, struct pico_ip4 src_addr, uint16_t src_port,
-                                                struct pico_ip4 nat_addr, uint16_t nat_port, uint8_t proto)
+                                                struct pico_ip4 nat_addr, uint16_t nat_port, uint8_t proto, uint8_t portforward)
 {
-    struct pico_nat_tuple *t = PICO_ZALLOC(sizeof(struct pico_nat_tuple));
+    struct pico_nat_tuple *t;
+
+    if (nat_find_inbound(nat_port, proto) || nat_find_outbound(&src_addr, src_port, proto)) {
+        pico_err = PICO_ERR_EEXIST;
+        return NULL;
+    }
+
+    if (!NATOutbound || ((nat_count >> 1) >= (1u << nat_hash_bits) && (nat_hash_bits < PICO_NAT_HASH_BITS_MAX))) {
+        /* A failed resize is only fatal when there is no table at all */
+        if ((nat_hash_resize(NATOutbound ? (nat_hash_bits + 1u) : PICO_NAT_HASH_BITS) < 0) && !NATOutbound)
+            return NULL;
+    }
+
+    t = PICO_ZALLOC(sizeof(struct pico_nat_tuple));
     if (!t) {
         pico_err = PICO_ERR_ENOMEM;
         return NULL;
@@ -201,40 +376,61 @@ static struct pico_nat_tuple *pico_ipv4_nat_add(struct pico_ip4 dst_addr, uint16
     t->nat_addr = nat_addr;
     t->nat_port = nat_port;
     t->proto = proto;
-    t->conn_active = 1;
-    t->portforward = 0;
-    t->rst = 0;
-    t->syn = 0;
-    t->fin_in = 0;
-    t->fin_out = 0;
-
-    if (pico_tree_insert(&NATOutbound, t)) {
-        PICO_FREE(t);
-        return NULL;
-    }
+    t->tcp_state = PICO_NAT_TCP_NONE;
+    t->portforward = portforward & 1u;
 
-    if (pico_tree_insert(&NATInbound, t)) {
-        pico_tree_delete(&NATOutbound, t);
-        PICO_FREE(t);
-        return NULL;
+    nat_hash_link(t);
+    nat_count++;
+
+    /* Port forwards are static and never expire */
+    if (!t->portforward) {
+        t->expire = pico_tick + nat_tuple_timeout(t);
+        nat_wheel_link(t, t->expire / PICO_NAT_WHEEL_TICK);
     }
 
     return t;
 }
 
+static void pico_ipv4_nat_tuple_del(struct pico_nat_tuple *t)
+{
+    nat_hash_unlink(t);
+    if (!t->portforward)
+        nat_wheel_unlink(t);
+
+    PICO_FREE(t);
+}
+
 static int pico_ipv4_nat_del(uint16_t nat_port, uint8_t proto)
 {
     struct pico_nat_tuple *t = NULL;
     t = pico_ipv4_nat_find_tuple(nat_port, NULL, 0, proto);
-    if (t) {
-        pico_tree_delete(&NATOutbound, t);
-        pico_tree_delete(&NATInbound, t);
-        PICO_FREE(t);
-    }
+    if (t)
+        pico_ipv4_nat_tuple_del(t);
 
     return 0;
 }
 
+/* Hands out public ports sequentially from [PICO_NAT_PORT_MIN, PICO_NAT_PORT_MAX].
+ * Only the inbound hash is consulted: local sockets in turn refuse to bind a
+ * port that is in use by the NAT (see pico_port_in_use_by_nat()).
+ */
+static uint16_t pico_ipv4_nat_alloc_port(uint8_t proto)
+{
+    int retry = PICO_NAT_PORT_RETRY;
+    uint16_t nport;
+
+    while (retry--) {
+        if ((nat_port_next < PICO_NAT_PORT_MIN) || (nat_port_next > PICO_NAT_PORT_MAX))
+            nat_port_next = PICO_NAT_PORT_MIN;
+
+        nport = short_be((uint16_t)nat_port_next);
+        nat_port_next++;
+        if (!nat_find_inbound(nport, proto))
+            return nport;
+    }
+    return 0;
+}
+
 static struct pico_trans *pico_nat_generate_tuple_trans(struct pico_ipv4_hdr *net, struct pico_frame *f)
 {
     struct pico_trans *trans = NULL;
@@ -263,28 +459,19 @@ static struct pico_nat_tuple *pico_ipv4_nat_generate_tuple(struct pico_frame *f)
     struct pico_trans *trans = NULL;
     struct pico_ipv4_hdr *net = (struct pico_ipv4_hdr *)f->net_hdr;
     uint16_t nport = 0;
-    uint8_t retry = 32;
-
-    /* generate NAT port */
-    do {
-        uint32_t rand = pico_rand();
-        nport = (uint16_t) (rand & 0xFFFFU);
-        nport = (uint16_t)((nport % (65535 - 1024)) + 1024U);
-        nport = short_be(nport);
-
-        if (pico_is_port_free(net->proto, nport, NULL, &pico_proto_ipv4))
-            break;
-    } while (--retry);
-
-    if (!retry)
-        return NULL;
 
     trans = pico_nat_generate_tuple_trans(net, f);
     if(!trans)
         return NULL;
 
-    return pico_ipv4_nat_add(net->dst, trans->dport, net->src, trans->sport, nat_link->address, nport, net->proto);
-    /* XXX return pico_ipv4_nat_add(nat_link->address, port, net->src, trans->sport, net->proto); */
+    nport = pico_ipv4_nat_alloc_port(net->proto);
+    if (!nport) {
+        nat_dbg("NAT: no free port available\n");
+        pico_err = PICO_ERR_EAGAIN;
+        return NULL;
+    }
+
+    return pico_ipv4_nat_add(net->dst, trans->dport, net->src, trans->sport, nat_link->address, nport, net->proto, 0);
 }
 
 static inline void pico_ipv4_nat_set_tcp_flags(struct pico_nat_tuple *t, struct pico_frame *f, uint8_t direction)
@@ -301,12 +488,24 @@ static inline void pico_ipv4_nat_set_tcp_flags(struct pico_nat_tuple *t, struct
 
     if ((tcp->flags & PICO_TCP_FIN) && (direction == PICO_NAT_OUTBOUND))
         t->fin_out = 1;
+
+    if (t->rst || (t->fin_in && t->fin_out))
+        t->tcp_state = PICO_NAT_TCP_CLOSED;
+    else if (t->fin_in || t->fin_out)
+        t->tcp_state = PICO_NAT_TCP_FIN;
+    else if ((t->tcp_state == PICO_NAT_TCP_NONE) && (tcp->flags & PICO_TCP_SYN) && (direction == PICO_NAT_OUTBOUND))
+        t->tcp_state = PICO_NAT_TCP_SYN;
+    else if ((t->tcp_state == PICO_NAT_TCP_NONE) || ((t->tcp_state == PICO_NAT_TCP_SYN) && (direction == PICO_NAT_INBOUND)))
+        t->tcp_state = PICO_NAT_TCP_ESTABLISHED;
 }
 
 static int pico_ipv4_nat_sniff_session(struct pico_nat_tuple *t, struct pico_frame *f, uint8_t direction)
 {
     struct pico_ipv4_hdr *net = (struct pico_ipv4_hdr *)f->net_hdr;
 
+    if (!t)
+        return -1;
+
     switch (net->proto) {
     case PICO_PROTO_TCP:
     {
@@ -315,7 +514,6 @@ static int pico_ipv4_nat_sniff_session(struct pico_nat_tuple *t, struct pico_fra
     }
 
     case PICO_PROTO_UDP:
-        t->conn_active = 1;
         break;
 
     case PICO_PROTO_ICMP4:
@@ -326,64 +524,61 @@ static int pico_ipv4_nat_sniff_session(struct pico_nat_tuple *t, struct pico_fra
         return -1;
     }
 
+    if (!t->portforward)
+        nat_tuple_refresh(t);
+
     return 0;
 }
 
+/* Advances the expiry wheel up to 'now': only the buckets whose tick has
+ * passed are visited. Entries found there that were refreshed in the meantime
+ * are moved to the bucket of their new expiry time.
+ */
 static void pico_ipv4_nat_table_cleanup(pico_time now, void *_unused)
 {
-    struct pico_tree_node *index = NULL, *_tmp = NULL;
-    struct pico_nat_tuple *t = NULL;
-    IGNORE_PARAMETER(now);
+    struct pico_nat_tuple *t = NULL, *next = NULL;
+    pico_time tick = now / PICO_NAT_WHEEL_TICK;
+    uint32_t n = 0;
     IGNORE_PARAMETER(_unused);
     nat_dbg("NAT: before table cleanup:\n");
     pico_ipv4_nat_print_table();
 
-    pico_tree_foreach_reverse_safe(index, &NATOutbound, _tmp)
-    {
-        t = index->keyValue;
-        switch (t->proto)
-        {
-        case PICO_PROTO_TCP:
-            if (t->portforward)
-                break;
-            else if (t->conn_active == 0 || t->conn_active > 360) /* conn active for > 24 hours */
-                pico_ipv4_nat_del(t->nat_port, t->proto);
-            else if (t->rst || (t->fin_in && t->fin_out))
-                t->conn_active = 0;
-            else
-                t->conn_active++;
-
-            break;
-
-        case PICO_PROTO_UDP:
-            if (t->portforward)
-                break;
-            else if (t->conn_active > 1)
-                pico_ipv4_nat_del(t->nat_port, t->proto);
-            else
-                t->conn_active++;
-
-            break;
-
-        case PICO_PROTO_ICMP4:
-            if (t->conn_active > 1)
-                pico_ipv4_nat_del(t->nat_port, t->proto);
-            else
-                t->conn_active++;
-            break;
-
-        default:
-            /* unknown protocol in NAT table, delete when it has existed NAT_TIMEWAIT */
-            if (t->conn_active > 1)
-                pico_ipv4_nat_del(t->nat_port, t->proto);
-            else
-                t->conn_active++;
+    if ((nat_wheel_last == 0) || (tick < nat_wheel_last))
+        nat_wheel_last = (tick > 0) ? (tick - 1) : 0;
+
+    while ((nat_wheel_last < tick) && (n++ < PICO_NAT_WHEEL_SLOTS)) {
+        uint32_t slot = nat_wheel_slot(++nat_wheel_last);
+        t = NATWheel[slot];
+        NATWheel[slot] = NULL;
+        while (t) {
+            next = t->wheel_next;
+            t->wheel_next = NULL;
+            t->wheel_prev = NULL;
+            if (t->expire <= now) {
+                nat_hash_unlink(t);
+                PICO_FREE(t);
+            } else {
+                nat_wheel_link(t, t->expire / PICO_NAT_WHEEL_TICK);
+            }
+
+            t = next;
         }
     }
+    nat_wheel_last = tick;
 
     nat_dbg("NAT: after table cleanup:\n");
     pico_ipv4_nat_print_table();
-    if (!pico_timer_add(PICO_NAT_TIMEWAIT, pico_ipv4_nat_table_cleanup, NULL)) {
+}
+
+static void pico_ipv4_nat_wheel_timer(pico_time now, void *_unused)
+{
+    nat_timer = 0;
+    pico_ipv4_nat_table_cleanup(now, _unused);
+    if (!nat_link)
+        return;
+
+    nat_timer = pico_timer_add(PICO_NAT_WHEEL_TICK, pico_ipv4_nat_wheel_timer, NULL);
+    if (!nat_timer) {
         nat_dbg("NAT: Failed to start cleanup timer\n");
         /* TODO no more NAT table cleanup now */
     }
@@ -400,13 +595,12 @@ int pico_ipv4_port_forward(struct pico_ip4 nat_addr, uint16_t nat_port, struct p
     switch (flag)
     {
     case PICO_NAT_PORT_FORWARD_ADD:
-        t = pico_ipv4_nat_add(any_addr, any_port, src_addr, src_port, nat_addr, nat_port, proto);
+        t = pico_ipv4_nat_add(any_addr, any_port, src_addr, src_port, nat_addr, nat_port, proto, 1);
         if (!t) {
             pico_err = PICO_ERR_EAGAIN;
             return -1;
         }
 
-        t->portforward = 1;
         break;
 
     case PICO_NAT_PORT_FORWARD_DEL:
@@ -505,6 +699,9 @@ int pico_ipv4_nat_outbound(struct pico_frame *f, struct pico_ip4 *link_addr)
         if (!tuple)
             tuple = pico_ipv4_nat_generate_tuple(f);
 
+        if (!tuple)
+            return -1;
+
         /* replace src IP and src PORT */
         net->src = tuple->nat_addr;
         trans->sport = tuple->nat_port;
@@ -523,6 +720,9 @@ int pico_ipv4_nat_outbound(struct pico_frame *f, struct pico_ip4 *link_addr)
         if (!tuple)
             tuple = pico_ipv4_nat_generate_tuple(f);
 
+        if (!tuple)
+            return -1;
+
         /* replace src IP and src PORT */
         net->src = tuple->nat_addr;
         trans->sport = tuple->nat_port;
@@ -558,11 +758,17 @@ int pico_ipv4_nat_enable(struct pico_ipv4_link *link)
         return -1;
     }
 
-    if (!pico_timer_add(PICO_NAT_TIMEWAIT, pico_ipv4_nat_table_cleanup, NULL)) {
-        nat_dbg("NAT: Failed to start cleanup timer\n");
-        return -1;
+    if (!nat_timer) {
+        nat_timer = pico_timer_add(PICO_NAT_WHEEL_TICK, pico_ipv4_nat_wheel_timer, NULL);
+        if (!nat_timer) {
+            nat_dbg("NAT: Failed to start cleanup timer\n");
+            return -1;
+        }
     }
 
+    if (!nat_port_next)
+        nat_port_next = PICO_NAT_PORT_MIN + (pico_rand() % (PICO_NAT_PORT_MAX - PICO_NAT_PORT_MIN + 1u));
+
     nat_link = link;
 
     return 0;
@@ -571,6 +777,8 @@ int pico_ipv4_nat_enable(struct pico_ipv4_link *link)
 int pico_ipv4_nat_disable(void)
 {
     nat_link = NULL;
+    pico_timer_cancel(nat_timer);
+    nat_timer = 0;
     return 0;
 }
 
@@ -0,0 +1,316 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   Neighbour table engine, used by ARP and IPv6 ND.
+ *********************************************************************/
+
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_neighbor.h"
+
+#ifdef DEBUG_NEIGHBOR
+    #define neigh_dbg dbg
+#else
+    #define neigh_dbg(...) do {} while(0)
+#endif
+
+static struct pico_neighbor *neigh_table[PICO_NEIGHBOR_HASH_SIZE];
+static uint32_t neigh_count;
+
+static uint32_t neigh_hash(const struct pico_neighbor_proto *p, const uint8_t *addr)
+{
+    uint32_t h = p->l3_proto;
+    uint32_t w;
+    uint8_t i;
+
+    /* xor of the address words: IPv6 interface identifiers end up in the low bits */
+    for (i = 0; (uint8_t)(i + 4) <= p->addr_len; i = (uint8_t)(i + 4)) {
+        memcpy(&w, addr + i, sizeof(w));
+        h ^= w;
+    }
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return h & (PICO_NEIGHBOR_HASH_SIZE - 1);
+}
+
+struct pico_neighbor *pico_neighbor_find(const struct pico_neighbor_proto *p, struct pico_device *dev, const void *addr)
+{
+    struct pico_neighbor *n = neigh_table[neigh_hash(p, addr)];
+
+    while (n) {
+        if ((n->proto == p) && (!dev || (n->dev == dev)) && (memcmp(&n->addr, addr, p->addr_len) == 0))
+            return n;
+
+        n = n->next;
+    }
+    return NULL;
+}
+
+struct pico_neighbor *pico_neighbor_add(const struct pico_neighbor_proto *p, struct pico_device *dev, const void *addr)
+{
+    struct pico_neighbor *n;
+    uint32_t h = neigh_hash(p, addr);
+
+    if (neigh_count >= PICO_NEIGHBOR_MAX_ENTRIES) {
+        neigh_dbg("NEIGHBOR: table full\n");
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    n = PICO_ZALLOC(sizeof(struct pico_neighbor));
+    if (!n) {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    memcpy(&n->addr, addr, p->addr_len);
+    n->proto = p;
+    n->dev = dev;
+    n->state = PICO_NEIGH_INCOMPLETE;
+    n->pending.max_frames = p->max_pending;
+    n->next = neigh_table[h];
+    neigh_table[h] = n;
+    neigh_count++;
+    return n;
+}
+
+void pico_neighbor_del(struct pico_neighbor *n)
+{
+    struct pico_neighbor **pp = &neigh_table[neigh_hash(n->proto, (const uint8_t *)&n->addr)];
+
+    while (*pp && (*pp != n))
+        pp = &(*pp)->next;
+    if (*pp) {
+        *pp = n->next;
+        neigh_count--;
+    }
+
+    if (n->proto->release)
+        n->proto->release(n);
+
+    if (n->timer)
+        pico_timer_cancel(n->timer);
+
+    pico_queue_empty(&n->pending);
+    PICO_FREE(n);
+}
+
+struct pico_neighbor *pico_neighbor_next(const struct pico_neighbor_proto *p, struct pico_neighbor *prev)
+{
+    struct pico_neighbor *n = NULL;
+    uint32_t h = 0;
+
+    if (prev) {
+        n = prev->next;
+        h = neigh_hash(prev->proto, (const uint8_t *)&prev->addr) + 1;
+    }
+
+    for (;;) {
+        while (n && (n->proto != p))
+            n = n->next;
+        if (n || (h >= PICO_NEIGHBOR_HASH_SIZE))
+            return n;
+
+        n = neigh_table[h++];
+    }
+}
+
+void pico_neighbor_flush_dev(struct pico_device *dev)
+{
+    struct pico_neighbor *n, *next;
+    uint32_t h;
+
+    for (h = 0; h < PICO_NEIGHBOR_HASH_SIZE; h++) {
+        for (n = neigh_table[h]; n; n = next) {
+            next = n->next;
+            if (n->dev == dev)
+                pico_neighbor_del(n);
+        }
+    }
+}
+
+static void neigh_timer(pico_time now, void *arg);
+
+int pico_neighbor_expire(struct pico_neighbor *n, pico_time expire)
+{
+    if (n->timer)
+        pico_timer_cancel(n->timer);
+
+    n->timer = pico_timer_add(expire, neigh_timer, n);
+    if (!n->timer) {
+        neigh_dbg("NEIGHBOR: Failed to start entry timer\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int neigh_send_solicit(struct pico_neighbor *n)
+{
+    n->probes++;
+    n->proto->solicit(n);
+    return pico_neighbor_expire(n, n->proto->retrans(n));
+}
+
+int pico_neighbor_solicit(struct pico_neighbor *n)
+{
+    n->probes = 0;
+    return neigh_send_solicit(n);
+}
+
+static void neigh_timer(pico_time now, void *arg)
+{
+    struct pico_neighbor *n = (struct pico_neighbor *)arg;
+    const struct pico_neighbor_proto *p = n->proto;
+
+    n->timer = 0;
+    switch (n->state) {
+    case PICO_NEIGH_INCOMPLETE:
+    case PICO_NEIGH_PROBE:
+        if (n->probes < p->max_solicit) {
+            if (neigh_send_solicit(n) == 0)
+                return;
+
+            break;
+        }
+
+        neigh_dbg("NEIGHBOR: no answer after %d solicitations\n", n->probes);
+        if (p->unreachable)
+            p->unreachable(n);
+
+        break;
+    case PICO_NEIGH_DELAY:
+        n->state = PICO_NEIGH_PROBE;
+        if (pico_neighbor_solicit(n) == 0)
+            return;
+
+        break;
+    case PICO_NEIGH_REACHABLE:
+        if (now < (n->confirmed + p->reachable)) {
+            /* confirmed lately, check again on the next timeout */
+            if (pico_neighbor_expire(n, n->confirmed + p->reachable - now) == 0)
+                return;
+
+            break;
+        }
+
+        /* still used to send, until that triggers a probe */
+        n->state = PICO_NEIGH_STALE;
+        if (pico_neighbor_expire(n, p->gc) == 0)
+            return;
+
+        break;
+    case PICO_NEIGH_PERMANENT:
+        return;
+    default:
+        /* STALE, and not used since */
+        break;
+    }
+    pico_neighbor_del(n);
+}
+
+static void neigh_flush(struct pico_neighbor *n)
+{
+    struct pico_frame *f;
+
+    while ((f = pico_dequeue(&n->pending)) != NULL) {
+        if (pico_datalink_send(f) <= 0)
+            pico_frame_discard(f);
+    }
+}
+
+int pico_neighbor_update(struct pico_neighbor *n, const uint8_t *hw, uint32_t hwlen, uint8_t state)
+{
+    uint8_t old = n->state;
+    int ret = 0;
+
+    if (hw) {
+        if (hwlen > PICO_NEIGH_HWADDR_MAX)
+            hwlen = PICO_NEIGH_HWADDR_MAX;
+
+        memset(n->hwaddr.data, 0, PICO_NEIGH_HWADDR_MAX);
+        memcpy(n->hwaddr.data, hw, hwlen);
+        if (n->dev && n->dev->eth && !n->dev->mode) {
+            memcpy(n->l2hdr, n->hwaddr.mac.addr, PICO_SIZE_ETH);
+            memcpy(n->l2hdr + PICO_SIZE_ETH, n->dev->eth->mac.addr, PICO_SIZE_ETH);
+            memcpy(n->l2hdr + 2 * PICO_SIZE_ETH, &n->proto->l3_proto, sizeof(uint16_t));
+        }
+    }
+
+    if (old == PICO_NEIGH_PERMANENT)
+        return 0;
+
+    n->state = state;
+    switch (state) {
+    case PICO_NEIGH_REACHABLE:
+        n->confirmed = pico_tick;
+        n->probes = 0;
+        /* a running timer re-arms itself from the confirmation time */
+        if ((old != PICO_NEIGH_REACHABLE) || !n->timer)
+            ret = pico_neighbor_expire(n, n->proto->reachable);
+
+        break;
+    case PICO_NEIGH_STALE:
+        ret = pico_neighbor_expire(n, n->proto->gc);
+        break;
+    case PICO_NEIGH_PERMANENT:
+        if (n->timer)
+            pico_timer_cancel(n->timer);
+
+        n->timer = 0;
+        break;
+    default:
+        break;
+    }
+
+    if (state != PICO_NEIGH_INCOMPLETE)
+        neigh_flush(n);
+
+    return ret;
+}
+
+struct pico_neighbor *pico_neighbor_use(struct pico_neighbor *n)
+{
+    int ret = 0;
+
+    switch (n->state) {
+    case PICO_NEIGH_INCOMPLETE:
+        return NULL;
+    case PICO_NEIGH_STALE:
+        /* keep using the cached address while it is verified */
+        if (n->proto->delay) {
+            n->state = PICO_NEIGH_DELAY;
+            ret = pico_neighbor_expire(n, n->proto->delay);
+        } else {
+            n->state = PICO_NEIGH_PROBE;
+            ret = pico_neighbor_solicit(n);
+        }
+
+        break;
+    default:
+        break;
+    }
+
+    if (ret < 0) {
+        pico_neighbor_del(n);
+        return NULL;
+    }
+
+    return n;
+}
+
+void pico_neighbor_postpone(struct pico_neighbor *n, struct pico_frame *f)
+{
+    if (n->state != PICO_NEIGH_INCOMPLETE) {
+        pico_frame_discard(f);
+        return;
+    }
+
+    /* Queue full: the oldest frame makes room */
+    if (n->pending.max_frames && (n->pending.frames >= n->pending.max_frames))
+        pico_frame_discard(pico_dequeue(&n->pending));
+
+    if (pico_enqueue(&n->pending, f) <= 0)
+        pico_frame_discard(f);
+}
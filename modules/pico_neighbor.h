@@ -0,0 +1,98 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+ *********************************************************************/
+#ifndef INCLUDE_PICO_NEIGHBOR
+#define INCLUDE_PICO_NEIGHBOR
+#include "pico_config.h"
+#include "pico_addressing.h"
+#include "pico_device.h"
+#include "pico_frame.h"
+#include "pico_queue.h"
+#include "pico_eth.h"
+
+/* Neighbour table shared by ARP and IPv6 ND. Entries are hashed on
+ * (protocol, device, L3 address), each with its own timer and queue of
+ * frames waiting for resolution. */
+
+/* Reachability states, RFC 4861 7.3.2 */
+#define PICO_NEIGH_INCOMPLETE   0
+#define PICO_NEIGH_REACHABLE    1
+#define PICO_NEIGH_STALE        2
+#define PICO_NEIGH_DELAY        3
+#define PICO_NEIGH_PROBE        4
+#define PICO_NEIGH_PERMANENT    5
+
+/* Hash buckets, power of two */
+#ifndef PICO_NEIGHBOR_HASH_SIZE
+#define PICO_NEIGHBOR_HASH_SIZE     (128)
+#endif
+
+#ifndef PICO_NEIGHBOR_MAX_ENTRIES
+#define PICO_NEIGHBOR_MAX_ENTRIES   (512)
+#endif
+
+#define PICO_NEIGH_HWADDR_MAX       (8)
+
+struct pico_neighbor;
+
+/* Per protocol part of the state machine */
+struct pico_neighbor_proto {
+    uint16_t l3_proto;          /* ethertype, network order */
+    uint8_t addr_len;           /* L3 address length */
+    uint8_t max_solicit;        /* requests per INCOMPLETE or PROBE round */
+    uint32_t max_pending;       /* frames parked on an INCOMPLETE entry */
+    pico_time reachable;        /* REACHABLE lifetime after a confirmation */
+    pico_time delay;            /* STALE entry in use waits this long before probing, 0 to probe at once */
+    pico_time gc;               /* unused STALE entries are dropped after this */
+    pico_time (*retrans)(struct pico_neighbor *n);
+    /* multicast while INCOMPLETE, unicast to the cached address while PROBE */
+    void (*solicit)(struct pico_neighbor *n);
+    /* resolution failed: the entry and its pending frames are freed next */
+    void (*unreachable)(struct pico_neighbor *n);
+    /* optional, the entry is about to be freed */
+    void (*release)(struct pico_neighbor *n);
+};
+
+union pico_neighbor_hw {
+    struct pico_eth mac;
+    uint8_t data[PICO_NEIGH_HWADDR_MAX];
+};
+
+struct pico_neighbor {
+    /* Ethernet header towards this neighbour (daddr, saddr, proto),
+     * valid once the hardware address is known */
+    uint8_t l2hdr[PICO_SIZE_ETHHDR];
+    union pico_neighbor_hw hwaddr;
+    union pico_address addr;
+    struct pico_device *dev;
+    const struct pico_neighbor_proto *proto;
+    struct pico_neighbor *next; /* hash chain */
+    pico_time confirmed;
+    uint32_t timer;
+    uint8_t state;
+    uint8_t probes;             /* solicitations sent in the current round */
+    uint8_t is_router;          /* ND only */
+    struct pico_queue pending;
+};
+
+/* dev may be NULL to match any device */
+struct pico_neighbor *pico_neighbor_find(const struct pico_neighbor_proto *p, struct pico_device *dev, const void *addr);
+struct pico_neighbor *pico_neighbor_add(const struct pico_neighbor_proto *p, struct pico_device *dev, const void *addr);
+void pico_neighbor_del(struct pico_neighbor *n);
+struct pico_neighbor *pico_neighbor_next(const struct pico_neighbor_proto *p, struct pico_neighbor *prev);
+void pico_neighbor_flush_dev(struct pico_device *dev);
+
+/* Start a solicitation round */
+int pico_neighbor_solicit(struct pico_neighbor *n);
+/* New hardware address (hw may be NULL) and state; flushes the pending frames */
+int pico_neighbor_update(struct pico_neighbor *n, const uint8_t *hw, uint32_t hwlen, uint8_t state);
+/* Restart the entry timer */
+int pico_neighbor_expire(struct pico_neighbor *n, pico_time expire);
+/* Called for each frame sent: the entry, or NULL while unresolved */
+struct pico_neighbor *pico_neighbor_use(struct pico_neighbor *n);
+/* Park a frame until the neighbour resolves, always consumes it */
+void pico_neighbor_postpone(struct pico_neighbor *n, struct pico_frame *f);
+
+#endif
@@ -112,11 +112,43 @@ PACKED_STRUCT_DEF olsrhdr
 
 
 
+#define OLSR_METRIC_INF        ((uint16_t)0xFFFF)
+#define OLSR_NEIGHB_HOLD_TIME  (3 * OLSR_HELLO_INTERVAL)
+
+/* Node table buckets, power of two */
+#ifndef OLSR_HASH_SIZE
+#define OLSR_HASH_SIZE 64
+#endif
+
+/* Node flags */
+#define OLSR_F_LOCAL    0x01    /* one of our interfaces */
+#define OLSR_F_NEIGH    0x02    /* linked from a local interface */
+#define OLSR_F_SPF      0x04    /* distance being recomputed */
+#define OLSR_F_DIRTY    0x08    /* route to update */
+#define OLSR_F_ROUTE    0x10    /* route installed */
+#define OLSR_F_TC       0x20    /* ansn valid */
+#define OLSR_F_COVERED  0x40    /* 2-hop neighbour reached by an MPR */
+
+/* Directed link: "to" is a neighbour of "from", learned from the
+ * datagram source, HELLO, TC or MID messages */
+struct olsr_link_entry
+{
+    struct olsr_route_entry *from;
+    struct olsr_route_entry *to;
+    struct olsr_link_entry *next_out;
+    struct olsr_link_entry *next_in;
+    pico_time expire;
+    uint8_t lq, nlq;
+};
+
 /* Globals */
 static struct pico_socket *udpsock = NULL;
 uint16_t my_ansn = 0;
 static struct olsr_route_entry  *Local_interfaces = NULL;
 static struct olsr_dev_entry    *Local_devices    = NULL;
+static struct olsr_route_entry  *Nodes[OLSR_HASH_SIZE];
+static struct olsr_route_entry  *Dirty_nodes = NULL;
+static int mpr_dirty = 0;
 
 static struct olsr_dev_entry *olsr_get_deventry(struct pico_device *dev)
 {
@@ -146,7 +178,6 @@ static struct olsr_route_entry *get_next_hop(struct olsr_route_entry *dst)
 {
     struct olsr_route_entry *hop = dst;
     while(hop) {
-        /* olsr_dbg("Finding next hop to %08x m=%d\n", hop->destination.addr, hop->metric); */
         if(hop->metric <= 1)
             return hop;
 
@@ -155,102 +186,430 @@ static struct olsr_route_entry *get_next_hop(struct olsr_route_entry *dst)
     return NULL;
 }
 
-static inline void olsr_route_add(struct olsr_route_entry *el)
+/* MARK: node table */
+
+static inline uint32_t olsr_hash(uint32_t addr)
+{
+    addr ^= addr >> 16;
+    addr ^= addr >> 8;
+    return addr & (OLSR_HASH_SIZE - 1);
+}
+
+static struct olsr_route_entry *olsr_node_find(uint32_t addr)
+{
+    struct olsr_route_entry *n = Nodes[olsr_hash(addr)];
+
+    while (n && (n->destination.addr != addr))
+        n = n->hnext;
+    return n;
+}
+
+static struct olsr_route_entry *olsr_node_get(uint32_t addr)
 {
-    /* char dest[16],nxdest[16]; */
-    struct olsr_route_entry *nexthop;
+    struct olsr_route_entry *n = olsr_node_find(addr);
+    uint32_t h;
 
-    if(!el)
+    if (n)
+        return n;
+
+    n = PICO_ZALLOC(sizeof(struct olsr_route_entry));
+    if (!n) {
+        OOM();
+        return NULL;
+    }
+
+    n->destination.addr = addr;
+    n->metric = OLSR_METRIC_INF;
+    n->link_type = OLSRLINK_UNKNOWN;
+    n->lq = 0xFF;
+    n->nlq = 0xFF;
+    h = olsr_hash(addr);
+    n->hnext = Nodes[h];
+    Nodes[h] = n;
+    return n;
+}
+
+static void olsr_node_dirty(struct olsr_route_entry *n)
+{
+    if (n->flags & OLSR_F_DIRTY)
         return;
 
-    my_ansn++;
+    n->flags |= OLSR_F_DIRTY;
+    n->dirty_next = Dirty_nodes;
+    Dirty_nodes = n;
+}
+
+/* MARK: shortest path tree
+ * Links have cost 1. The tree is only updated where a link change moves
+ * distances: an added link relaxes forward from its head, a removed tree
+ * link recomputes the subtree hanging from it. Every node whose distance
+ * or first hop may have changed is queued on Dirty_nodes. */
+
+static void spf_detach(struct olsr_route_entry *n)
+{
+    struct olsr_route_entry **pp;
+
+    if (!n->gateway)
+        return;
+
+    for (pp = &n->gateway->children; *pp; pp = &(*pp)->sibling) {
+        if (*pp == n) {
+            *pp = n->sibling;
+            break;
+        }
+    }
+    n->sibling = NULL;
+    n->gateway = NULL;
+}
+
+static void spf_attach(struct olsr_route_entry *n, struct olsr_route_entry *parent)
+{
+    spf_detach(n);
+    n->gateway = parent;
+    n->sibling = parent->children;
+    parent->children = n;
+    n->metric = (uint16_t)(parent->metric + 1u);
+    n->iface = parent->iface;
+    olsr_node_dirty(n);
+}
+
+static void spf_link_added(struct olsr_link_entry *l)
+{
+    struct olsr_route_entry *head, *tail, *x, *y;
+    struct olsr_link_entry *o;
+
+    if ((l->from->metric == OLSR_METRIC_INF) || ((l->from->metric + 1u) >= l->to->metric))
+        return;
+
+    /* Breadth first from the head of the link: distances only decrease */
+    spf_attach(l->to, l->from);
+    head = tail = l->to;
+    head->spf_next = NULL;
+    while (head) {
+        x = head;
+        head = head->spf_next;
+        for (o = x->links_out; o; o = o->next_out) {
+            y = o->to;
+            if ((x->metric + 1u) < y->metric) {
+                spf_attach(y, x);
+                y->spf_next = NULL;
+                if (head)
+                    tail->spf_next = y;
+                else
+                    head = y;
 
-    nexthop = get_next_hop(el);
-    if (el->gateway && nexthop && (nexthop->destination.addr != el->destination.addr)) {
-        /* 2-hops route or more */
-        el->next = el->gateway->children;
-        el->gateway->children = el;
-        el->link_type = OLSRLINK_MPR;
-        olsr_dbg("[OLSR]  ----------Adding route to %08x via %08x metric %d\n", el->destination.addr, nexthop->destination.addr, el->metric);
-        pico_ipv4_route_add(el->destination, HOST_NETMASK, nexthop->destination, (int) el->metric, NULL);
-    } else if (el->iface) {
-        /* neighbor */
-        struct olsr_route_entry *ei = olsr_get_ethentry(el->iface);
-        struct pico_ip4 no_gw = {
-            0U
-        };
-        if (el->link_type == OLSRLINK_UNKNOWN)
-            el->link_type = OLSRLINK_SYMMETRIC;
-
-        if (ei) {
-            el->next = ei->children;
-            ei->children = el;
+                tail = y;
+            }
         }
+    }
+}
 
-        olsr_dbg("[OLSR]  ----------Adding neighbor %08x iface %s\n", el->destination.addr, el->iface->name);
+static uint16_t spf_min_pending(struct olsr_route_entry *list)
+{
+    uint16_t d = OLSR_METRIC_INF;
 
-        pico_ipv4_route_add(el->destination, HOST_NETMASK, no_gw, 1, pico_ipv4_link_by_dev(el->iface));
+    for (; list; list = list->spf_next) {
+        if ((list->flags & OLSR_F_SPF) && (list->metric < d))
+            d = list->metric;
     }
+    return d;
 }
 
-static inline void olsr_route_del(struct olsr_route_entry *r)
+/* The tree link to v is gone: place again v and its subtree */
+static void spf_link_removed(struct olsr_route_entry *v)
+{
+    struct olsr_route_entry *list, *tail, *x, *c, *next, *p;
+    struct olsr_link_entry *l;
+    uint16_t d;
+
+    spf_detach(v);
+    list = tail = v;
+    v->spf_next = NULL;
+    for (x = list; x; x = x->spf_next) {
+        for (c = x->children; c; c = next) {
+            next = c->sibling;
+            c->sibling = NULL;
+            c->gateway = NULL;
+            c->spf_next = NULL;
+            tail->spf_next = c;
+            tail = c;
+        }
+        x->children = NULL;
+        x->flags |= OLSR_F_SPF;
+        x->metric = OLSR_METRIC_INF;
+        olsr_node_dirty(x);
+    }
+
+    /* Best parent outside the subtree, kept in gateway until settled */
+    for (x = list; x; x = x->spf_next) {
+        for (l = x->links_in; l; l = l->next_in) {
+            p = l->from;
+            if (!(p->flags & OLSR_F_SPF) && (p->metric != OLSR_METRIC_INF) && ((p->metric + 1u) < x->metric)) {
+                x->metric = (uint16_t)(p->metric + 1u);
+                x->gateway = p;
+            }
+        }
+    }
+
+    /* Settle by increasing distance, relaxing inside the subtree only:
+     * distances outside of it did not depend on it. */
+    for (d = spf_min_pending(list); d != OLSR_METRIC_INF; d = spf_min_pending(list)) {
+        for (x = list; x; x = x->spf_next) {
+            if (!(x->flags & OLSR_F_SPF) || (x->metric != d))
+                continue;
+
+            x->flags &= (uint8_t)~OLSR_F_SPF;
+            p = x->gateway;
+            x->gateway = NULL;
+            spf_attach(x, p);
+            for (l = x->links_out; l; l = l->next_out) {
+                if ((l->to->flags & OLSR_F_SPF) && ((d + 1u) < l->to->metric)) {
+                    l->to->metric = (uint16_t)(d + 1u);
+                    l->to->gateway = x;
+                }
+            }
+        }
+    }
+
+    /* Unreachable */
+    for (x = list; x; x = x->spf_next)
+        x->flags &= (uint8_t)~OLSR_F_SPF;
+}
+
+/* MARK: links */
+
+static void olsr_neighbors_changed(void)
 {
-    struct olsr_route_entry *cur, *prev = NULL, *lst;
-    /* olsr_dbg("[OLSR] DELETING route..................\n"); */
     my_ansn++;
-    if (r->gateway) {
-        lst = r->gateway->children;
-    } else if (r->iface) {
-        lst = olsr_get_ethentry(r->iface);
-    } else {
-        lst = Local_interfaces;
+    mpr_dirty = 1;
+}
+
+static struct olsr_link_entry *olsr_link_set(struct olsr_route_entry *from, struct olsr_route_entry *to, pico_time expire, uint8_t lq, uint8_t nlq)
+{
+    struct olsr_link_entry *l;
+
+    if (from == to)
+        return NULL;
+
+    for (l = from->links_out; l; l = l->next_out) {
+        if (l->to == to) {
+            if (expire > l->expire)
+                l->expire = expire;
+
+            l->lq = lq;
+            l->nlq = nlq;
+            return l;
+        }
     }
 
-    cur = lst, prev = NULL;
-    while(cur) {
-        if (cur == r) {
-            /* found */
-            if (r->gateway) {
-                pico_ipv4_route_del(r->destination, HOST_NETMASK, r->metric);
-                olsr_dbg("[OLSR] Deleting route to %08x \n", r->destination.addr);
-                if (!prev)
-                    r->gateway->children = r->next;
+    l = PICO_ZALLOC(sizeof(struct olsr_link_entry));
+    if (!l) {
+        OOM();
+        return NULL;
+    }
+
+    l->from = from;
+    l->to = to;
+    l->expire = expire;
+    l->lq = lq;
+    l->nlq = nlq;
+    l->next_out = from->links_out;
+    from->links_out = l;
+    l->next_in = to->links_in;
+    to->links_in = l;
+
+    if (from->flags & OLSR_F_LOCAL) {
+        to->flags |= OLSR_F_NEIGH;
+        olsr_neighbors_changed();
+    } else if (from->flags & OLSR_F_NEIGH) {
+        mpr_dirty = 1;
+    }
+
+    spf_link_added(l);
+    return l;
+}
+
+static void olsr_link_del(struct olsr_link_entry *l)
+{
+    struct olsr_link_entry **pp;
+    struct olsr_route_entry *to = l->to;
+
+    for (pp = &l->from->links_out; *pp != l; pp = &(*pp)->next_out) ;
+    *pp = l->next_out;
+    for (pp = &to->links_in; *pp != l; pp = &(*pp)->next_in) ;
+    *pp = l->next_in;
+
+    if (l->from->flags & OLSR_F_LOCAL) {
+        struct olsr_link_entry *in;
+
+        to->flags &= (uint8_t)~OLSR_F_NEIGH;
+        for (in = to->links_in; in; in = in->next_in) {
+            if (in->from->flags & OLSR_F_LOCAL)
+                to->flags |= OLSR_F_NEIGH;
+        }
+        olsr_neighbors_changed();
+    } else if (l->from->flags & OLSR_F_NEIGH) {
+        mpr_dirty = 1;
+    }
+
+    if (to->gateway == l->from)
+        spf_link_removed(to);
+
+    PICO_FREE(l);
+}
+
+/* MARK: routes */
+
+/* Push the changes of the dirty nodes to the IPv4 routing table.
+ * Neighbours go first: they are the gateways of all other routes. */
+static void olsr_routes_sync(void)
+{
+    struct olsr_route_entry *n, *nexthop;
+    struct pico_ip4 gw;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        for (n = Dirty_nodes; n; n = n->dirty_next) {
+            int wanted = !(n->flags & OLSR_F_LOCAL) && (n->metric != OLSR_METRIC_INF);
+
+            gw.addr = 0;
+            if (wanted && (n->metric > 1)) {
+                nexthop = get_next_hop(n);
+                if (!nexthop || (nexthop->metric != 1))
+                    wanted = 0;
                 else
-                    prev->next = r->next;
+                    gw = nexthop->destination;
             }
 
-            while (r->children) {
-                olsr_route_del(r->children);
-                /* Orphans must die. */
-                /* PICO_FREE(r->children); */
+            if (pass == 0) {
+                if ((n->flags & OLSR_F_ROUTE) && (!wanted || (n->route_metric != n->metric) || (n->route_gw.addr != gw.addr))) {
+                    olsr_dbg("[OLSR] Deleting route to %08x\n", n->destination.addr);
+                    pico_ipv4_route_del(n->destination, HOST_NETMASK, n->route_metric);
+                    n->flags &= (uint8_t)~OLSR_F_ROUTE;
+                }
+
+                if (!wanted || (n->metric != 1))
+                    continue;
+            } else if (!wanted || (n->metric == 1)) {
+                continue;
+            }
+
+            if ((n->flags & OLSR_F_ROUTE) || pico_ipv4_link_get(&n->destination))
+                continue;
+
+            olsr_dbg("[OLSR] Adding route to %08x via %08x metric %d\n", n->destination.addr, gw.addr, n->metric);
+            if (pico_ipv4_route_add(n->destination, HOST_NETMASK, gw, (int)n->metric,
+                                    (n->metric == 1) ? pico_ipv4_link_by_dev(n->iface) : NULL) == 0) {
+                n->flags |= OLSR_F_ROUTE;
+                n->route_gw = gw;
+                n->route_metric = n->metric;
             }
-            return;
         }
+    }
 
-        prev = cur;
-        cur = cur->next;
+    for (n = Dirty_nodes; n; n = nexthop) {
+        nexthop = n->dirty_next;
+        n->dirty_next = NULL;
+        n->flags &= (uint8_t)~OLSR_F_DIRTY;
+    }
+    Dirty_nodes = NULL;
+}
+
+/* MARK: MPR selection, RFC 3626 8.3.1 heuristic
+ * Recomputed only when the 1 or 2-hop neighbourhood changed. */
+
+#define olsr_is_two_hop(n) (!((n)->flags & (OLSR_F_LOCAL | OLSR_F_NEIGH)))
+
+static uint16_t olsr_mpr_gain(struct olsr_route_entry *n)
+{
+    struct olsr_link_entry *o;
+    uint16_t gain = 0;
+
+    for (o = n->links_out; o; o = o->next_out) {
+        if (olsr_is_two_hop(o->to) && !(o->to->flags & OLSR_F_COVERED))
+            gain++;
+    }
+    return gain;
+}
+
+static void olsr_mpr_select(struct olsr_route_entry *n)
+{
+    struct olsr_link_entry *o;
+
+    n->link_type = OLSRLINK_MPR;
+    for (o = n->links_out; o; o = o->next_out) {
+        if (olsr_is_two_hop(o->to))
+            o->to->flags |= OLSR_F_COVERED;
     }
 }
 
-static struct olsr_route_entry *get_route_by_address(struct olsr_route_entry *lst, uint32_t ip)
+static void olsr_mpr_update(void)
 {
-    struct olsr_route_entry *found;
-    if(lst) {
-        if (lst->destination.addr == ip) {
-            return lst;
+    struct olsr_route_entry *local, *best;
+    struct olsr_link_entry *l, *o;
+    uint16_t gain, best_gain;
+
+    if (!mpr_dirty)
+        return;
+
+    mpr_dirty = 0;
+    for (local = Local_interfaces; local; local = local->next) {
+        for (l = local->links_out; l; l = l->next_out) {
+            l->to->link_type = OLSRLINK_SYMMETRIC;
+            for (o = l->to->links_out; o; o = o->next_out) {
+                o->to->mpr_cover = 0;
+                o->to->flags &= (uint8_t)~OLSR_F_COVERED;
+            }
         }
+    }
+
+    for (local = Local_interfaces; local; local = local->next) {
+        for (l = local->links_out; l; l = l->next_out) {
+            for (o = l->to->links_out; o; o = o->next_out) {
+                if (olsr_is_two_hop(o->to))
+                    o->to->mpr_cover++;
+            }
+        }
+    }
 
-        /* recursive function, could be dangerous for stack overflow if a lot of routes are available... */
-        found = get_route_by_address(lst->children, ip);
-        if (found)
-            return found;
+    /* Neighbours that are the only way to some 2-hop neighbour */
+    for (local = Local_interfaces; local; local = local->next) {
+        for (l = local->links_out; l; l = l->next_out) {
+            for (o = l->to->links_out; o; o = o->next_out) {
+                if (olsr_is_two_hop(o->to) && (o->to->mpr_cover == 1)) {
+                    l->to->link_type = OLSRLINK_MPR;
+                    break;
+                }
+            }
+        }
+    }
 
-        found = get_route_by_address(lst->next, ip);
-        if (found)
-            return found;
+    for (local = Local_interfaces; local; local = local->next) {
+        for (l = local->links_out; l; l = l->next_out) {
+            if (l->to->link_type == OLSRLINK_MPR)
+                olsr_mpr_select(l->to);
+        }
     }
 
-    return NULL;
+    /* Then the ones covering most of what is left */
+    do {
+        best = NULL;
+        best_gain = 0;
+        for (local = Local_interfaces; local; local = local->next) {
+            for (l = local->links_out; l; l = l->next_out) {
+                if (l->to->link_type == OLSRLINK_MPR)
+                    continue;
+
+                gain = olsr_mpr_gain(l->to);
+                if (gain > best_gain) {
+                    best = l->to;
+                    best_gain = gain;
+                }
+            }
+        }
+        if (best)
+            olsr_mpr_select(best);
+    } while (best);
 }
 
 #define OLSR_C_SHIFT (uint32_t)4 /* 1/16 */
@@ -316,22 +675,47 @@ static uint32_t olsr2seconds(uint8_t olsr)
     return seconds;
 }
 
-static void olsr_garbage_collector(struct olsr_route_entry *sublist)
+/* Milliseconds of validity of a message */
+static pico_time olsr_vtime(uint8_t vtime)
 {
-    if(!sublist)
-        return;
+    pico_time t = (pico_time)olsr2seconds(vtime) * 1000u;
 
-    if (sublist->time_left <= 0) {
-        olsr_route_del(sublist);
-        PICO_FREE(sublist);
-        return;
-    } else {
-        /* sublist->time_left -= 2u; */
-        sublist->time_left -= 8u;
-    }
+    if (t < OLSR_NEIGHB_HOLD_TIME)
+        t = OLSR_NEIGHB_HOLD_TIME;
 
-    olsr_garbage_collector(sublist->children);
-    olsr_garbage_collector(sublist->next);
+    return t;
+}
+
+static void olsr_expire(pico_time now)
+{
+    struct olsr_route_entry *n, **pp;
+    struct olsr_link_entry *l, *next;
+    uint32_t h;
+
+    for (h = 0; h < OLSR_HASH_SIZE; h++) {
+        for (n = Nodes[h]; n; n = n->hnext) {
+            for (l = n->links_out; l; l = next) {
+                next = l->next_out;
+                if (l->expire <= now)
+                    olsr_link_del(l);
+            }
+        }
+    }
+    olsr_routes_sync();
+
+    /* Nodes without links are unreachable, and forgotten */
+    for (h = 0; h < OLSR_HASH_SIZE; h++) {
+        pp = &Nodes[h];
+        while (*pp) {
+            n = *pp;
+            if (!(n->flags & OLSR_F_LOCAL) && !n->links_in && !n->links_out) {
+                *pp = n->hnext;
+                PICO_FREE(n);
+            } else {
+                pp = &n->hnext;
+            }
+        }
+    }
 }
 
 struct olsr_fwd_pkt
@@ -430,124 +814,138 @@ static void olsr_scheduled_output(uint32_t when, void *buffer, uint16_t size, st
 }
 
 
+static struct olsr_route_entry *olsr_local_add(struct pico_device *dev, uint32_t addr)
+{
+    struct olsr_route_entry *e = olsr_node_get(addr);
+    struct olsr_link_entry *l;
+
+    if (!e || (e->flags & OLSR_F_LOCAL))
+        return e;
+
+    /* Known as a remote node until now */
+    if (e->gateway)
+        spf_link_removed(e);
+
+    spf_detach(e);
+    e->flags |= OLSR_F_LOCAL;
+    e->link_type = OLSRLINK_SYMMETRIC;
+    e->iface = dev;
+    e->metric = 0;
+    e->lq = 0xFF;
+    e->nlq = 0xFF;
+    e->next = Local_interfaces;
+    Local_interfaces = e;
+    olsr_node_dirty(e);
+    for (l = e->links_out; l; l = l->next_out) {
+        l->to->flags |= OLSR_F_NEIGH;
+        spf_link_added(l);
+    }
+    olsr_neighbors_changed();
+    return e;
+}
+
 static void refresh_routes(void)
 {
-    struct olsr_route_entry *local;
     struct olsr_dev_entry *icur = Local_devices;
 
-    /* Refresh local entries */
-    /* Step 1: set zero expire time for local addresses and neighbors*/
-    local = Local_interfaces;
-    while(local) {
-        local = local->next;
-    }
-    /* Step 2: refresh timer for entries that are still valid.
-     * Add new entries.
-     */
+    /* Addresses added to the devices since */
     while(icur) {
         struct pico_ipv4_link *lnk = NULL;
         do {
             lnk = pico_ipv4_link_by_dev_next(icur->dev, lnk);
-            if (!lnk) break;
-
-            local = olsr_get_ethentry(icur->dev);
-            if (local) {
-                local->time_left = (OLSR_HELLO_INTERVAL << 2);
-            } else if (lnk) {
-                struct olsr_route_entry *e = PICO_ZALLOC(sizeof (struct olsr_route_entry));
-                if (!e) {
-                    olsr_dbg("olsr: adding local route entry\n");
-                    OOM();
-                    return;
-                }
-
-                e->destination.addr = lnk->address.addr; /* Always pick the first address */
-                e->time_left = (OLSR_HELLO_INTERVAL << 2);
-                e->iface = icur->dev;
-                e->metric = 0;
-                e->lq = 0xFF;
-                e->nlq = 0xFF;
-                e->next = Local_interfaces;
-                Local_interfaces = e;
+            if (lnk && !olsr_local_add(icur->dev, lnk->address.addr)) {
+                olsr_dbg("olsr: adding local route entry\n");
+                return;
             }
         } while (lnk);
 
-        /* disabled if device type != eth */
-        /* refresh_neighbors(icur->dev); */
         icur = icur->next;
     }
+    olsr_routes_sync();
+}
+
+/* Walk the links of all the local interfaces, resuming after *bookmark */
+static struct olsr_link_entry *olsr_neighbor_next(struct olsr_route_entry **local, struct olsr_link_entry *l)
+{
+    if (l)
+        l = l->next_out;
+    else if (*local)
+        l = (*local)->links_out;
+
+    while (!l && *local) {
+        *local = (*local)->next;
+        if (*local)
+            l = (*local)->links_out;
+    }
+    return l;
+}
+
+static struct olsr_link_entry *olsr_neighbor_first(struct olsr_route_entry **local, struct olsr_link_entry *bookmark)
+{
+    struct olsr_link_entry *l;
+
+    *local = Local_interfaces;
+    if (bookmark) {
+        *local = bookmark->from;
+        return bookmark;
+    }
+
+    l = olsr_neighbor_next(local, NULL);
+    return l;
 }
 
-static uint32_t olsr_build_hello_neighbors(uint8_t *buf, uint32_t size, struct olsr_route_entry **bookmark)
+static uint32_t olsr_build_hello_neighbors(uint8_t *buf, uint32_t size, struct olsr_link_entry **bookmark)
 {
     uint32_t ret = 0;
-    struct olsr_route_entry *local, *neighbor;
+    struct olsr_route_entry *local;
+    struct olsr_link_entry *l;
     struct olsr_neighbor *dst = (struct olsr_neighbor *) buf;
     uint32_t total_link_size = sizeof(struct olsr_neighbor) + sizeof(struct olsr_link);
-    local = Local_interfaces;
-    while (local) {
-        neighbor = local->children;
-        if (*bookmark) {
-            while ((neighbor) && *bookmark != neighbor)
-                neighbor = neighbor->next;
-        }
-
-        while (neighbor) {
-            struct olsr_link *li = (struct olsr_link *) (buf + ret);
 
-            if ((size - ret) < total_link_size) {
-                /* Incomplete list, new datagram needed. */
-                *bookmark = neighbor;
-                return ret;
-            }
+    for (l = olsr_neighbor_first(&local, *bookmark); l; l = olsr_neighbor_next(&local, l)) {
+        struct olsr_link *li = (struct olsr_link *) (buf + ret);
 
-            li->link_code = neighbor->link_type;
-            li->reserved = 0;
-            li->link_msg_size = short_be((uint16_t)total_link_size);
-            ret += (uint32_t)sizeof(struct olsr_link);
-            dst = (struct olsr_neighbor *) (buf + ret);
-            dst->addr = neighbor->destination.addr;
-            dst->nlq = neighbor->nlq;
-            dst->lq = neighbor->lq;
-            dst->reserved = 0;
-            ret += (uint32_t)sizeof(struct olsr_neighbor);
-            neighbor = neighbor->next;
+        if ((size - ret) < total_link_size) {
+            /* Incomplete list, new datagram needed. */
+            *bookmark = l;
+            return ret;
         }
-        local = local->next;
+
+        li->link_code = l->to->link_type;
+        li->reserved = 0;
+        li->link_msg_size = short_be((uint16_t)total_link_size);
+        ret += (uint32_t)sizeof(struct olsr_link);
+        dst = (struct olsr_neighbor *) (buf + ret);
+        dst->addr = l->to->destination.addr;
+        dst->nlq = l->nlq;
+        dst->lq = l->lq;
+        dst->reserved = 0;
+        ret += (uint32_t)sizeof(struct olsr_neighbor);
     }
     *bookmark = NULL; /* All the list was visited, no more dgrams needed */
     return ret;
 }
 
-static uint32_t olsr_build_tc_neighbors(uint8_t *buf, uint32_t size, struct olsr_route_entry **bookmark)
+static uint32_t olsr_build_tc_neighbors(uint8_t *buf, uint32_t size, struct olsr_link_entry **bookmark)
 {
     uint32_t ret = 0;
-    struct olsr_route_entry *local, *neighbor;
+    struct olsr_route_entry *local;
+    struct olsr_link_entry *l;
     struct olsr_neighbor *dst = (struct olsr_neighbor *) buf;
-    local = Local_interfaces;
-    while (local) {
-        neighbor = local->children;
-        if (*bookmark) {
-            while ((neighbor) && *bookmark != neighbor)
-                neighbor = neighbor->next;
-        }
 
-        while (neighbor) {
-            if (size - ret < sizeof(struct olsr_neighbor)) {
-                /* Incomplete list, new datagram needed. */
-                *bookmark = neighbor;
-                return ret;
-            }
-
-            dst->addr = neighbor->destination.addr;
-            dst->nlq = neighbor->nlq;
-            dst->lq = neighbor->lq;
-            dst->reserved = 0;
-            ret += (uint32_t)sizeof(struct olsr_neighbor);
-            dst = (struct olsr_neighbor *) (buf + ret);
-            neighbor = neighbor->next;
+    for (l = olsr_neighbor_first(&local, *bookmark); l; l = olsr_neighbor_next(&local, l)) {
+        if (size - ret < sizeof(struct olsr_neighbor)) {
+            /* Incomplete list, new datagram needed. */
+            *bookmark = l;
+            return ret;
         }
-        local = local->next;
+
+        dst->addr = l->to->destination.addr;
+        dst->nlq = l->nlq;
+        dst->lq = l->lq;
+        dst->reserved = 0;
+        ret += (uint32_t)sizeof(struct olsr_neighbor);
+        dst = (struct olsr_neighbor *) (buf + ret);
     }
     *bookmark = NULL; /* All the list was visited, no more dgrams needed */
     return ret;
@@ -578,7 +976,7 @@ static void olsr_compose_tc_dgram(struct pico_device *pdev, struct pico_ipv4_lin
 {
     struct olsrmsg *msg_tc, *msg_mid;
     uint32_t size = 0, r;
-    struct olsr_route_entry *last_neighbor = NULL;
+    struct olsr_link_entry *last_neighbor = NULL;
     uint8_t *dgram;
     struct olsr_hmsg_tc *tc;
     do {
@@ -646,8 +1044,8 @@ static void olsr_compose_tc_dgram(struct pico_device *pdev, struct pico_ipv4_lin
 static void olsr_compose_hello_dgram(struct pico_device *pdev, struct pico_ipv4_link *ep)
 {
     struct olsrmsg *msg_hello;
-    uint32_t size = 0, r;
-    struct olsr_route_entry *last_neighbor = NULL;
+    uint32_t size = 0, r = 0;
+    struct olsr_link_entry *last_neighbor = NULL;
     uint8_t *dgram;
     struct olsr_hmsg_hello *hello;
     /* HELLO Message */
@@ -707,181 +1105,99 @@ static void olsr_make_dgram(struct pico_device *pdev, int full)
 /* Old code was relying on ethernet arp requests */
 #define arp_storm(...) do {} while(0)
 
-static void recv_mid(uint8_t *buffer, uint32_t len, struct olsr_route_entry *origin)
+static void recv_mid(uint8_t *buffer, uint32_t len, struct olsr_route_entry *origin, pico_time expire)
 {
     uint32_t parsed = 0;
-    uint32_t *address;
+    struct pico_ip4 address;
     struct olsr_route_entry *e;
 
     if (len % sizeof(uint32_t)) /*drop*/
         return;
 
+    /* The other interfaces of origin, one hop behind it */
     while (len > parsed) {
-        address = (uint32_t *)(buffer + parsed);
-        e = get_route_by_address(Local_interfaces, *address);
-        if (!e) {
-            e = PICO_ZALLOC(sizeof(struct olsr_route_entry));
-            if (!e) {
-                olsr_dbg("olsr allocating route\n");
-                OOM();
-                return;
-            }
-
-            e->time_left = (OLSR_HELLO_INTERVAL << 2);
-            e->destination.addr = *address;
-            e->gateway = origin;
-            /* e->iface = origin->iface; */
-            e->iface = NULL;
-            e->metric = (uint16_t)(origin->metric + 1u);
-            e->lq = origin->lq;
-            e->nlq = origin->nlq;
-            olsr_route_add(e);
-            arp_storm(&e->destination);
-        } else if (e->metric > (origin->metric + 1)) {
-            olsr_route_del(e);
-            e->metric = (uint16_t)(origin->metric + 1u);
-            e->gateway = origin;
-            e->time_left = (OLSR_HELLO_INTERVAL << 2);
-            olsr_route_add(e);
-        }
-
+        memcpy(&address.addr, buffer + parsed, sizeof(uint32_t));
         parsed += (uint32_t)sizeof(uint32_t);
+        if (pico_ipv4_link_get(&address))
+            continue;
+
+        e = olsr_node_get(address.addr);
+        if (e)
+            olsr_link_set(origin, e, expire, origin->lq, origin->nlq);
     }
 }
 
-/* static void recv_hello(uint8_t *buffer, uint32_t len, struct olsr_route_entry *origin) */
-static void recv_hello(uint8_t *buffer, uint32_t len, struct olsr_route_entry *origin, uint16_t hops)
+static void recv_hello(uint8_t *buffer, uint32_t len, struct olsr_route_entry *origin, pico_time expire)
 {
     struct olsr_link *li;
     struct olsr_route_entry *e;
-    uint32_t parsed = 0;
+    uint32_t parsed = 0, end, pos;
     struct olsr_neighbor *neigh;
+    struct pico_ip4 address;
 
-    if (!origin)
-        return;
-
-    /* Don't parse hello messages that were forwarded */
-    if (hops > 0 || origin->metric > 1)
-        return;
-
-    if (pico_ipv4_link_get(&origin->destination))
-        return;
-
+    while ((len - parsed) >= sizeof(struct olsr_link)) {
+        li = (struct olsr_link *) (buffer + parsed);
+        end = parsed + short_be(li->link_msg_size);
+        if ((end <= parsed) || (end > len))
+            return;
 
-    while (len > parsed) {
-        li = (struct olsr_link *) buffer;
-        neigh = (struct olsr_neighbor *)(buffer + parsed + sizeof(struct olsr_link));
-        parsed += short_be(li->link_msg_size);
-        e = get_route_by_address(Local_interfaces, neigh->addr);
-        if (!e) {
-            e = PICO_ZALLOC(sizeof(struct olsr_route_entry));
-            if (!e) {
-                olsr_dbg("olsr allocating route\n");
-                OOM();
-                return;
-            }
+        for (pos = parsed + (uint32_t)sizeof(struct olsr_link); (pos + sizeof(struct olsr_neighbor)) <= end; pos += (uint32_t)sizeof(struct olsr_neighbor)) {
+            neigh = (struct olsr_neighbor *)(buffer + pos);
+            address.addr = neigh->addr;
+            if (pico_ipv4_link_get(&address))
+                continue;
 
-            e->time_left = (OLSR_HELLO_INTERVAL << 2);
-            e->destination.addr = neigh->addr;
-            e->gateway = origin;
-            e->iface = NULL;
-            e->metric = (uint16_t)(origin->metric + hops + 1);
-            e->link_type = OLSRLINK_UNKNOWN;
-            e->lq = MIN(origin->lq, neigh->lq);
-            e->nlq = MIN(origin->nlq, neigh->nlq);
-            olsr_route_add(e);
-            arp_storm(&e->destination);
-        } else if ((e->gateway != origin) && (origin->metric > 1) && (e->metric > (origin->metric + hops + 1))) {
-            olsr_route_del(e);
-            e->metric = (uint16_t)(origin->metric + hops + 1);
-            e->gateway = origin;
-            e->time_left = (OLSR_HELLO_INTERVAL << 2);
-            olsr_route_add(e);
-        } else {
-            e->time_left = (OLSR_HELLO_INTERVAL << 2);
+            e = olsr_node_get(neigh->addr);
+            if (e)
+                olsr_link_set(origin, e, expire, neigh->lq, neigh->nlq);
         }
+        parsed = end;
     }
 }
 
-/* static uint32_t reconsider_topology(uint8_t *buf, uint32_t size, struct olsr_route_entry *e) */
-static uint32_t reconsider_topology(uint8_t *buf, uint32_t size, struct olsr_route_entry *e)
+static void reconsider_topology(uint8_t *buf, uint32_t size, struct olsr_route_entry *e, pico_time expire)
 {
     struct olsr_hmsg_tc *tc = (struct olsr_hmsg_tc *) buf;
-    uint16_t new_ansn = short_be(tc->ansn);
+    uint16_t new_ansn;
     uint32_t parsed = sizeof(struct olsr_hmsg_tc);
     struct olsr_route_entry *rt;
     struct olsr_neighbor *n;
-    uint32_t retval = 0;
-
-    if (!e->advertised_tc)
-        retval = 1;
+    struct pico_ip4 address;
 
-    if (e->advertised_tc && fresher(new_ansn, e->ansn))
-    {
-        PICO_FREE(e->advertised_tc); /* <--- XXX check invalid free? */
-        e->advertised_tc = NULL;
-        retval = 1;
-    }
-
-    /* Ignore self packets */
-    if (pico_ipv4_link_get(&e->destination))
-        return 0;
+    if (size < sizeof(struct olsr_hmsg_tc))
+        return;
 
-    if (!e->advertised_tc) {
-        e->advertised_tc = PICO_ZALLOC(size);
-        if (!e->advertised_tc) {
-            OOM();
-            olsr_dbg("Allocating forward packet\n");
-            return 0;
-        }
+    /* Outdated advertised set */
+    new_ansn = short_be(tc->ansn);
+    if ((e->flags & OLSR_F_TC) && (new_ansn != e->ansn) && !fresher(new_ansn, e->ansn))
+        return;
 
-        memcpy(e->advertised_tc, buf, size);
-        e->ansn = new_ansn;
-        while (parsed < size) {
-            n = (struct olsr_neighbor *) (buf + parsed);
-            parsed += (uint32_t)sizeof(struct olsr_neighbor);
-            rt = get_route_by_address(Local_interfaces, n->addr);
-            if (rt && (rt->gateway == e)) {
-                /* Refresh existing node */
-                rt->time_left = e->time_left;
-            } else if (!rt || (rt->metric > (e->metric + 1)) || (rt->nlq < n->nlq)) {
-                if (!rt) {
-                    rt = PICO_ZALLOC(sizeof (struct olsr_route_entry));
-                    if (!rt) {
-                        OOM();
-                        return retval;
-                    }
-
-                    rt->destination.addr = n->addr;
-                    rt->link_type = OLSRLINK_UNKNOWN;
-                } else {
-                    olsr_route_del(rt);
-                }
+    e->ansn = new_ansn;
+    e->flags |= OLSR_F_TC;
+    while ((parsed + sizeof(struct olsr_neighbor)) <= size) {
+        n = (struct olsr_neighbor *) (buf + parsed);
+        parsed += (uint32_t)sizeof(struct olsr_neighbor);
+        address.addr = n->addr;
+        if (pico_ipv4_link_get(&address))
+            continue;
 
-                rt->iface = e->iface;
-                rt->gateway = e;
-                rt->metric = (uint16_t)(e->metric + 1);
-                rt->lq = n->lq; /* 0xff */
-                rt->nlq = n->nlq; /* 0xff */
-                rt->time_left = e->time_left; /* 256 */
-                olsr_route_add(rt);
-            }
-        }
-        /* olsr_dbg("Routes changed...\n"); */
+        rt = olsr_node_get(n->addr);
+        if (rt)
+            olsr_link_set(e, rt, expire, n->lq, n->nlq);
     }
-
-    return retval;
 }
 
 
-static void olsr_recv(uint8_t *buffer, uint32_t len)
+static void olsr_recv(uint8_t *buffer, uint32_t len, struct pico_ip4 *src, struct pico_device *dev)
 {
     struct olsrmsg *msg;
     struct olsrhdr *oh = (struct olsrhdr *) buffer;
-    struct olsr_route_entry *ancestor;
+    struct olsr_route_entry *local, *neighbor;
     uint32_t parsed = 0;
     uint16_t outsize = 0;
+    uint16_t msg_size;
     uint8_t *datagram;
+    pico_time now = PICO_TIME_MS();
 
     if (len != short_be(oh->len)) {
         return;
@@ -892,111 +1208,105 @@ static void olsr_recv(uint8_t *buffer, uint32_t len)
         return;
     }
 
+    local = olsr_get_ethentry(dev);
+    if (!local)
+        local = Local_interfaces;
+
+    if (!local || pico_ipv4_link_get(src))
+        return;
+
+    /* The sender is a neighbour */
+    neighbor = olsr_node_get(src->addr);
+    if (neighbor)
+        olsr_link_set(local, neighbor, now + OLSR_NEIGHB_HOLD_TIME, 0xFF, 0xFF);
+
     parsed += (uint32_t)sizeof(struct olsrhdr);
 
     datagram = PICO_ZALLOC(DGRAM_MAX_SIZE);
     if (!datagram) {
         OOM();
+        olsr_routes_sync();
         return;
     }
 
     outsize = (uint16_t) (outsize + (sizeof(struct olsrhdr)));
     /* Section 1: parsing received messages. */
-    while (len > parsed) {
+    while ((len - parsed) >= sizeof(struct olsrmsg)) {
         struct olsr_route_entry *origin;
+        uint8_t *body;
+        uint32_t body_len;
+        pico_time expire;
+
         msg = (struct olsrmsg *) (buffer + parsed);
-        origin = get_route_by_address(Local_interfaces, msg->orig.addr);
+        msg_size = short_be(msg->size);
+        if ((msg_size < sizeof(struct olsrmsg)) || (msg_size > (len - parsed)))
+            break;
 
         if(pico_ipv4_link_find(&msg->orig) != NULL) {
             /* olsr_dbg("rebound\n"); */
-            parsed += short_be(msg->size);
+            parsed += msg_size;
             continue;
         }
 
         /* OLSR's TTL expired. */
         if (msg->ttl < 1u) {
-            parsed += short_be(msg->size);
+            parsed += msg_size;
             continue;
         }
 
+        origin = olsr_node_get(msg->orig.addr);
         if (!origin) {
-            if (msg->hop == 0) {
-                struct olsr_route_entry *e = PICO_ZALLOC(sizeof (struct olsr_route_entry));
-                if (!e) {
-                    parsed += short_be(msg->size);
-                    OOM();
-                    break;
-                }
-
-                e->destination.addr = msg->orig.addr;
-                e->link_type = OLSRLINK_SYMMETRIC;
-                e->time_left = (OLSR_HELLO_INTERVAL << 2);
-                e->iface = Local_devices->dev;
-                e->gateway = olsr_get_ethentry(e->iface);
-                e->metric = 1;
-                e->lq = 0xFF;
-                e->nlq = 0xFF;
-                olsr_route_add(e);
-            }
-
-            parsed += short_be(msg->size);
+            parsed += msg_size;
             continue;
         }
 
-        /* We know this is a Master host and a neighbor */
-        origin->link_type = OLSRLINK_MPR;
-        origin->time_left = olsr2seconds(msg->vtime);
+        body = buffer + parsed + sizeof(struct olsrmsg);
+        body_len = (uint32_t)(msg_size - sizeof(struct olsrmsg));
+        expire = now + olsr_vtime(msg->vtime);
         switch(msg->type) {
         case OLSRMSG_HELLO:
-            ancestor = olsr_get_ethentry(origin->iface);
-            if ((origin->metric > 1) && ancestor) {
-                olsr_route_del(origin);
-                origin->gateway = ancestor;
-                origin->metric = 1;
-                olsr_route_add(origin);
-            }
+            /* Don't parse hello messages that were forwarded */
+            if ((msg->hop == 0) && (body_len >= sizeof(struct olsr_hmsg_hello)))
+                recv_hello(body + sizeof(struct olsr_hmsg_hello), body_len - (uint32_t)sizeof(struct olsr_hmsg_hello), origin, expire);
 
-            recv_hello(buffer + (uint32_t)parsed + (uint32_t)sizeof(struct olsrmsg) + (uint32_t)sizeof(struct olsr_hmsg_hello),
-                       (uint32_t) ((short_be(msg->size) - (sizeof(struct olsrmsg))) - (uint32_t)sizeof(struct olsr_hmsg_hello)),
-                       origin, msg->hop);
             msg->ttl = 0;
             break;
         case OLSRMSG_MID:
             if ((origin->seq != 0) && (!fresher(short_be(msg->seq), origin->seq))) {
                 msg->ttl = 0;
             } else {
-                recv_mid(buffer + parsed + sizeof(struct olsrmsg), (uint32_t)(short_be(msg->size) - (sizeof(struct olsrmsg))), origin);
-                /* olsr_dbg("MID forwarded from origin %08x (seq: %u)\n", long_be(msg->orig.addr), short_be(msg->seq)); */
+                recv_mid(body, body_len, origin, expire);
                 origin->seq = short_be(msg->seq);
             }
 
             break;
         case OLSRMSG_TC:
-            if(!pico_ipv4_link_find(&origin->destination)) {
-                reconsider_topology(buffer + parsed + sizeof(struct olsrmsg), (uint32_t)(short_be(msg->size) - (sizeof(struct olsrmsg))), origin);
-                if ((origin->seq != 0) && (!fresher(short_be(msg->seq), origin->seq))) {
-                    msg->ttl = 0;
-                } else {
-                    /* olsr_dbg("TC forwarded from origin %08x (seq: %u)\n", long_be(msg->orig.addr), short_be(msg->seq)); */
-                    origin->seq = short_be(msg->seq);
-                }
+            reconsider_topology(body, body_len, origin, expire);
+            if ((origin->seq != 0) && (!fresher(short_be(msg->seq), origin->seq))) {
+                msg->ttl = 0;
+            } else {
+                /* olsr_dbg("TC forwarded from origin %08x (seq: %u)\n", long_be(msg->orig.addr), short_be(msg->seq)); */
+                origin->seq = short_be(msg->seq);
             }
 
             break;
         default:
             PICO_FREE(datagram);
+            olsr_routes_sync();
             return;
         }
 
-        if (msg->ttl > 1) {
+        if ((msg->ttl > 1) && ((outsize + msg_size) <= DGRAM_MAX_SIZE)) {
             msg->hop++;
             msg->ttl--;
-            memcpy(datagram + outsize, msg, short_be(msg->size));
-            outsize = (uint16_t)(outsize + short_be(msg->size));
+            memcpy(datagram + outsize, msg, msg_size);
+            outsize = (uint16_t)(outsize + msg_size);
         }
 
-        parsed += short_be(msg->size);
+        parsed += msg_size;
     }
+    olsr_routes_sync();
+
     /* Section 2: forwarding parsed messages that got past the filter. */
     if ((outsize > sizeof(struct olsrhdr))) {
         /* Finalize FWD packet */
@@ -1014,6 +1324,10 @@ static void wakeup(uint16_t ev, struct pico_socket *s)
     struct pico_ip4 ANY = {
         0
     };
+    struct pico_ip4 src;
+    struct pico_msginfo info = {
+        0
+    };
     uint16_t port = OLSR_PORT;
     recvbuf = PICO_ZALLOC(DGRAM_MAX_SIZE);
     if (!recvbuf) {
@@ -1022,9 +1336,9 @@ static void wakeup(uint16_t ev, struct pico_socket *s)
     }
 
     if (ev & PICO_SOCK_EV_RD) {
-        r = pico_socket_recv(s, recvbuf, DGRAM_MAX_SIZE);
+        r = pico_socket_recvfrom_extended(s, recvbuf, DGRAM_MAX_SIZE, &src, &port, &info);
         if (r > 0)
-            olsr_recv(recvbuf, (uint32_t)r);
+            olsr_recv(recvbuf, (uint32_t)r, &src, info.dev);
     }
 
     if (ev == PICO_SOCK_EV_ERR) {
@@ -1042,8 +1356,9 @@ static void olsr_hello_tick(pico_time when, void *unused)
     struct olsr_dev_entry *d;
     (void)when;
     (void)unused;
-    olsr_garbage_collector(Local_interfaces);
+    olsr_expire(PICO_TIME_MS());
     refresh_routes();
+    olsr_mpr_update();
     d = Local_devices;
     while(d) {
         olsr_make_dgram(d->dev, 0);
@@ -1133,33 +1448,14 @@ int pico_olsr_add(struct pico_device *dev)
     Local_devices = od;
 
     do {
-        char ipaddr[20];
         lnk = pico_ipv4_link_by_dev_next(dev, lnk);
-        if (lnk) {
-            struct olsr_route_entry *e = PICO_ZALLOC(sizeof(struct olsr_route_entry));
-            /* olsr_dbg("OLSR: Found IP address %08x\n", long_be(lnk->address.addr)); */
-            pico_ipv4_to_string(ipaddr, (lnk->address.addr));
-            /* olsr_dbg("OLSR: Found IP address %s\n", ipaddr); */
-            if (!e) {
-                olsr_dbg("olsr allocating route\n");
-                pico_err = PICO_ERR_ENOMEM;
-                return -1;
-            }
-
-            e->destination.addr = lnk->address.addr;
-            e->link_type = OLSRLINK_SYMMETRIC;
-            e->time_left = (OLSR_HELLO_INTERVAL << 2);
-            e->gateway = NULL;
-            e->children = NULL;
-            e->iface = dev;
-            e->metric = 0;
-            e->lq = 0xFF;
-            e->nlq = 0xFF;
-            e->next = Local_interfaces;
-            Local_interfaces = e;
-
+        if (lnk && !olsr_local_add(dev, lnk->address.addr)) {
+            olsr_dbg("olsr allocating route\n");
+            pico_err = PICO_ERR_ENOMEM;
+            return -1;
         }
     } while(lnk);
+    olsr_routes_sync();
 
     return 0;
 }
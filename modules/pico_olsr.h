@@ -9,20 +9,31 @@
 
 
 /* Objects */
+struct olsr_link_entry;
+
+/* A node of the topology: local interface, neighbour or remote host */
 struct olsr_route_entry
 {
-    struct olsr_route_entry         *next;
-    uint32_t time_left;
+    struct olsr_route_entry         *next;      /* local interfaces only */
+    struct olsr_route_entry         *hnext;     /* node table chain */
     struct pico_ip4 destination;
-    struct olsr_route_entry         *gateway;
-    struct pico_device              *iface;
-    uint16_t metric;
+    struct olsr_route_entry         *gateway;   /* parent in the shortest path tree */
+    struct pico_device              *iface;     /* device of the first hop */
+    uint16_t metric;                            /* hops, 0 for local interfaces */
     uint8_t link_type;
-    struct olsr_route_entry         *children;
+    uint8_t flags;
+    struct olsr_route_entry         *children;  /* shortest path tree */
+    struct olsr_route_entry         *sibling;
+    struct olsr_route_entry         *spf_next;  /* nodes being recomputed */
+    struct olsr_route_entry         *dirty_next; /* routes to update */
+    struct olsr_link_entry          *links_out;
+    struct olsr_link_entry          *links_in;
+    struct pico_ip4 route_gw;                   /* route in the IPv4 table */
+    uint16_t route_metric;
+    uint16_t mpr_cover;
     uint16_t ansn;
     uint16_t seq;
     uint8_t lq, nlq;
-    uint8_t                         *advertised_tc;
 };
 
 
@@ -0,0 +1,231 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   Path MTU cache.
+ *********************************************************************/
+
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_protocol.h"
+#include "pico_pmtu.h"
+
+#ifdef PICO_SUPPORT_PMTU
+
+#ifdef DEBUG_PMTU
+    #define pmtu_dbg dbg
+#else
+    #define pmtu_dbg(...) do {} while(0)
+#endif
+
+/* Expired entries are collected this often */
+#define PMTU_GC_INTERVAL (PICO_PMTU_TIMEOUT >> 2)
+
+struct pmtu_entry {
+    union pico_address addr;
+    struct pmtu_entry *next;
+    pico_time expire;
+    uint32_t mtu;
+    uint16_t proto;
+};
+
+static struct pmtu_entry *pmtu_table[PICO_PMTU_HASH_SIZE];
+static uint32_t pmtu_count;
+static uint32_t pmtu_timer;
+
+static uint32_t pmtu_addr_len(uint16_t proto)
+{
+    return (proto == PICO_PROTO_IPV6) ? PICO_SIZE_IP6 : PICO_SIZE_IP4;
+}
+
+static uint32_t pmtu_hash(uint16_t proto, const union pico_address *dst)
+{
+    const uint8_t *addr = (const uint8_t *)dst;
+    uint32_t h = proto;
+    uint32_t w, i;
+
+    for (i = 0; i < pmtu_addr_len(proto); i += 4) {
+        memcpy(&w, addr + i, sizeof(w));
+        h ^= w;
+    }
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return h & (PICO_PMTU_HASH_SIZE - 1);
+}
+
+static struct pmtu_entry *pmtu_find(uint16_t proto, const union pico_address *dst)
+{
+    struct pmtu_entry *e = pmtu_table[pmtu_hash(proto, dst)];
+
+    while (e) {
+        if ((e->proto == proto) && (memcmp(&e->addr, dst, pmtu_addr_len(proto)) == 0))
+            return e;
+
+        e = e->next;
+    }
+    return NULL;
+}
+
+static void pmtu_gc(pico_time now, void *arg)
+{
+    struct pmtu_entry **pp, *e;
+    uint32_t h;
+
+    (void)arg;
+    pmtu_timer = 0;
+    for (h = 0; h < PICO_PMTU_HASH_SIZE; h++) {
+        pp = &pmtu_table[h];
+        while (*pp) {
+            e = *pp;
+            if (e->expire <= now) {
+                *pp = e->next;
+                pmtu_count--;
+                PICO_FREE(e);
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+
+    if (pmtu_count)
+        pmtu_timer = pico_timer_add(PMTU_GC_INTERVAL, pmtu_gc, NULL);
+}
+
+/* Unlinks the entry closest to expiry, an expired one if there is any.
+ * The gc may not have run yet, so expired entries can still fill the table. */
+static struct pmtu_entry *pmtu_evict(void)
+{
+    struct pmtu_entry **pp, **victim = NULL, *e;
+    uint32_t h;
+
+    for (h = 0; h < PICO_PMTU_HASH_SIZE; h++) {
+        for (pp = &pmtu_table[h]; *pp; pp = &(*pp)->next) {
+            if (!victim || ((*pp)->expire < (*victim)->expire))
+                victim = pp;
+        }
+    }
+    if (!victim)
+        return NULL;
+
+    e = *victim;
+    *victim = e->next;
+    pmtu_count--;
+    memset(e, 0, sizeof(struct pmtu_entry));
+    return e;
+}
+
+uint32_t pico_pmtu_get(uint16_t proto, const union pico_address *dst)
+{
+    struct pmtu_entry *e;
+
+    if (!pmtu_count)
+        return 0;
+
+    e = pmtu_find(proto, dst);
+    if (!e || (e->expire <= PICO_TIME_MS()))
+        return 0;
+
+    return e->mtu;
+}
+
+int pico_pmtu_lower(uint16_t proto, const union pico_address *dst, uint32_t mtu)
+{
+    struct pmtu_entry *e;
+    uint32_t h, min = (proto == PICO_PROTO_IPV6) ? PICO_PMTU_MIN_IPV6 : PICO_PMTU_MIN_IPV4;
+
+    if (!dst) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    if (mtu < min)
+        mtu = min;
+
+    e = pmtu_find(proto, dst);
+    if (e) {
+        /* RFC 1191 6.3: a report never raises the estimate */
+        if ((e->expire > PICO_TIME_MS()) && (mtu >= e->mtu))
+            return 0;
+
+        e->mtu = mtu;
+        e->expire = PICO_TIME_MS() + PICO_PMTU_TIMEOUT;
+        pmtu_dbg("PMTU: lowered to %u\n", mtu);
+        return 1;
+    }
+
+    if (pmtu_count >= PICO_PMTU_MAX_ENTRIES) {
+        pmtu_dbg("PMTU: table full, replacing the oldest entry\n");
+        e = pmtu_evict();
+    } else {
+        e = PICO_ZALLOC(sizeof(struct pmtu_entry));
+    }
+
+    if (!e) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    if (!pmtu_timer) {
+        pmtu_timer = pico_timer_add(PMTU_GC_INTERVAL, pmtu_gc, NULL);
+        if (!pmtu_timer) {
+            pmtu_dbg("PMTU: Failed to start gc timer\n");
+            PICO_FREE(e);
+            return -1;
+        }
+    }
+
+    memcpy(&e->addr, dst, pmtu_addr_len(proto));
+    e->proto = proto;
+    e->mtu = mtu;
+    e->expire = PICO_TIME_MS() + PICO_PMTU_TIMEOUT;
+    h = pmtu_hash(proto, dst);
+    e->next = pmtu_table[h];
+    pmtu_table[h] = e;
+    pmtu_count++;
+    pmtu_dbg("PMTU: new entry, %u\n", mtu);
+    return 1;
+}
+
+void pico_pmtu_raise(uint16_t proto, const union pico_address *dst, uint32_t mtu)
+{
+    struct pmtu_entry *e = pmtu_count ? pmtu_find(proto, dst) : NULL;
+
+    if (e && (mtu > e->mtu)) {
+        e->mtu = mtu;
+        e->expire = PICO_TIME_MS() + PICO_PMTU_TIMEOUT;
+    }
+}
+
+uint32_t pico_pmtu_plateau(uint32_t len)
+{
+    static const uint16_t plateaus[] = {
+        32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68
+    };
+    uint32_t i;
+
+    for (i = 0; i < (sizeof(plateaus) / sizeof(plateaus[0])); i++) {
+        if (plateaus[i] < len)
+            return plateaus[i];
+    }
+    return 68;
+}
+
+void pico_pmtu_flush(void)
+{
+    struct pmtu_entry *e;
+    uint32_t h;
+
+    for (h = 0; h < PICO_PMTU_HASH_SIZE; h++) {
+        while ((e = pmtu_table[h]) != NULL) {
+            pmtu_table[h] = e->next;
+            PICO_FREE(e);
+        }
+    }
+    pmtu_count = 0;
+    if (pmtu_timer)
+        pico_timer_cancel(pmtu_timer);
+
+    pmtu_timer = 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+ *********************************************************************/
+#ifndef INCLUDE_PICO_PMTU
+#define INCLUDE_PICO_PMTU
+#include "pico_config.h"
+#include "pico_addressing.h"
+
+/* Path MTU cache, RFC 1191 and RFC 8201. Entries are keyed on
+ * (network protocol, destination) and only exist for paths narrower
+ * than the outgoing link. They age out after PICO_PMTU_TIMEOUT, so a
+ * larger path MTU is tried again. */
+
+/* Hash buckets, power of two */
+#ifndef PICO_PMTU_HASH_SIZE
+#define PICO_PMTU_HASH_SIZE     (32)
+#endif
+
+/* When full, a new report replaces the entry closest to expiry */
+#ifndef PICO_PMTU_MAX_ENTRIES
+#define PICO_PMTU_MAX_ENTRIES   (128)
+#endif
+
+/* RFC 1191 6.3: ten minutes */
+#ifndef PICO_PMTU_TIMEOUT
+#define PICO_PMTU_TIMEOUT       (600000u)
+#endif
+
+/* Smaller reports are raised to this, against forged ICMP */
+#ifndef PICO_PMTU_MIN_IPV4
+#define PICO_PMTU_MIN_IPV4      (576u)
+#endif
+
+#define PICO_PMTU_MIN_IPV6      (1280u)
+
+/* proto is PICO_PROTO_IPV4 or PICO_PROTO_IPV6.
+ * The cached path MTU towards dst, 0 if there is none. */
+uint32_t pico_pmtu_get(uint16_t proto, const union pico_address *dst);
+/* A packet of more than mtu bytes did not make it (ICMP or a lost probe).
+ * Returns 1 if the estimate went down, 0 if not, -1 on error. */
+int pico_pmtu_lower(uint16_t proto, const union pico_address *dst, uint32_t mtu);
+/* A packet of mtu bytes went through: raises an existing entry */
+void pico_pmtu_raise(uint16_t proto, const union pico_address *dst, uint32_t mtu);
+/* RFC 1191 7.1: largest plateau below len, for routers not reporting the MTU */
+uint32_t pico_pmtu_plateau(uint32_t len);
+void pico_pmtu_flush(void);
+
+#endif
@@ -0,0 +1,434 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   Queueing discipline for device output: strict priority bands, each one
+   scheduling its flows with DRR and CoDel (as fq_codel), optionally
+   shaped by a token bucket.
+ *********************************************************************/
+
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_device.h"
+#include "pico_protocol.h"
+#include "pico_queue.h"
+#include "pico_ipv4.h"
+#include "pico_ipv6.h"
+#include "pico_qdisc.h"
+#include "pico_token_bucket.h"
+
+#ifdef DEBUG_QDISC
+    #define qdisc_dbg dbg
+#else
+    #define qdisc_dbg(...) do {} while(0)
+#endif
+
+struct qdisc_flow {
+    struct pico_queue q;
+    struct qdisc_flow *next;    /* active list */
+    int32_t deficit;
+    uint8_t active;
+    uint8_t dropping;
+    uint32_t count;
+    pico_time first_above;
+    pico_time drop_next;
+};
+
+struct qdisc_band {
+    struct qdisc_flow flow[PICO_QDISC_FLOWS];
+    struct qdisc_flow *head;
+    struct qdisc_flow *tail;
+};
+
+struct pico_qdisc {
+    struct pico_qdisc_config cfg;
+    struct pico_token_bucket shaper;
+    struct qdisc_band band[PICO_QDISC_BANDS];
+    struct pico_frame *next;    /* picked for transmission, not sent yet */
+    uint8_t next_paid;          /* shaper tokens already taken for 'next' */
+    uint32_t mtu;
+    struct pico_qdisc_stats stats;
+};
+
+/**************** CLASSIFICATION ****************/
+
+static int qdisc_band(struct pico_frame *f)
+{
+    if (!IS_IPV4(f) && !IS_IPV6(f))
+        return 0;
+
+    if (f->priority > 0)
+        return 0;
+
+    if (f->priority == 0)
+        return 1;
+
+    return 2;
+}
+
+static uint32_t qdisc_flow_hash(struct pico_frame *f)
+{
+    uint32_t h = 0;
+    uint8_t proto = 0;
+    struct pico_trans *trans;
+
+    if (IS_IPV4(f)) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        h = hdr->src.addr ^ hdr->dst.addr;
+        proto = hdr->proto;
+    }
+
+#ifdef PICO_SUPPORT_IPV6
+    else if (IS_IPV6(f)) {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+        uint32_t a, b;
+        memcpy(&a, &hdr->src.addr[12], sizeof(uint32_t));
+        memcpy(&b, &hdr->dst.addr[12], sizeof(uint32_t));
+        h = a ^ b;
+        proto = hdr->nxthdr;
+    }
+#endif
+
+    if ((proto == PICO_PROTO_TCP || proto == PICO_PROTO_UDP) && f->transport_hdr) {
+        trans = (struct pico_trans *)f->transport_hdr;
+        h ^= ((uint32_t)trans->sport << 16) | trans->dport;
+    }
+
+    h ^= proto;
+    h *= 2654435761u;
+    return (h >> 16) % PICO_QDISC_FLOWS;
+}
+
+/**************** FLOW QUEUES ****************/
+
+static void qdisc_flow_activate(struct qdisc_band *band, struct qdisc_flow *flow, uint32_t quantum)
+{
+    flow->active = 1;
+    flow->deficit = (int32_t)quantum;
+    flow->next = NULL;
+    if (band->tail)
+        band->tail->next = flow;
+    else
+        band->head = flow;
+
+    band->tail = flow;
+}
+
+static void qdisc_flow_pop_active(struct qdisc_band *band)
+{
+    struct qdisc_flow *flow = band->head;
+    band->head = flow->next;
+    if (!band->head)
+        band->tail = NULL;
+
+    flow->next = NULL;
+}
+
+static struct pico_frame *qdisc_flow_dequeue(struct pico_qdisc *q, struct qdisc_flow *flow)
+{
+    struct pico_frame *f = pico_dequeue(&flow->q);
+    if (f)
+        q->stats.backlog--;
+
+    return f;
+}
+
+static void qdisc_drop(struct pico_qdisc *q, struct pico_frame *f)
+{
+    qdisc_dbg("qdisc: drop frame %p\n", f);
+    (void)q;
+    pico_frame_discard(f);
+}
+
+/* Makes room by dropping the head of the longest flow queue */
+static void qdisc_drop_fattest(struct pico_qdisc *q)
+{
+    struct qdisc_flow *fat = NULL;
+    int b, i;
+
+    for (b = 0; b < PICO_QDISC_BANDS; b++) {
+        for (i = 0; i < PICO_QDISC_FLOWS; i++) {
+            if (!fat || q->band[b].flow[i].q.size > fat->q.size)
+                fat = &q->band[b].flow[i];
+        }
+    }
+    if (fat && fat->q.frames) {
+        qdisc_drop(q, qdisc_flow_dequeue(q, fat));
+        q->stats.overlimits++;
+    }
+}
+
+/**************** CODEL ****************/
+
+static uint32_t qdisc_isqrt(uint32_t x)
+{
+    uint32_t r = 0, bit = 1u << 30;
+
+    while (bit > x)
+        bit >>= 2;
+
+    while (bit) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+
+        bit >>= 2;
+    }
+    return r;
+}
+
+static pico_time qdisc_codel_control(struct pico_qdisc *q, pico_time t, uint32_t count)
+{
+    uint32_t root = qdisc_isqrt(count);
+    return t + q->cfg.interval / (root ? root : 1u);
+}
+
+static int qdisc_codel_should_drop(struct pico_qdisc *q, struct qdisc_flow *flow, struct pico_frame *f, pico_time now)
+{
+    pico_time sojourn = (now > f->timestamp) ? (now - f->timestamp) : 0;
+
+    if (sojourn < q->cfg.target || flow->q.size <= q->mtu) {
+        flow->first_above = 0;
+        return 0;
+    }
+
+    if (!flow->first_above) {
+        flow->first_above = now + q->cfg.interval;
+        return 0;
+    }
+
+    return (now >= flow->first_above);
+}
+
+static struct pico_frame *qdisc_codel_dequeue(struct pico_qdisc *q, struct qdisc_flow *flow, pico_time now)
+{
+    struct pico_frame *f = qdisc_flow_dequeue(q, flow);
+
+    if (!f || q->cfg.no_codel)
+        return f;
+
+    if (flow->dropping) {
+        if (!qdisc_codel_should_drop(q, flow, f, now)) {
+            flow->dropping = 0;
+            return f;
+        }
+
+        while (f && flow->dropping && now >= flow->drop_next) {
+            qdisc_drop(q, f);
+            q->stats.codel_drops++;
+            flow->count++;
+            f = qdisc_flow_dequeue(q, flow);
+            if (!f || !qdisc_codel_should_drop(q, flow, f, now))
+                flow->dropping = 0;
+            else
+                flow->drop_next = qdisc_codel_control(q, flow->drop_next, flow->count);
+        }
+    } else if (qdisc_codel_should_drop(q, flow, f, now)) {
+        qdisc_drop(q, f);
+        q->stats.codel_drops++;
+        f = qdisc_flow_dequeue(q, flow);
+        flow->dropping = 1;
+        /* re-entering the dropping state soon after leaving it: resume
+         * close to the previous drop rate */
+        if (flow->count > 2 && now < flow->drop_next + 16u * q->cfg.interval)
+            flow->count -= 2;
+        else
+            flow->count = 1;
+
+        flow->drop_next = qdisc_codel_control(q, now, flow->count);
+    }
+
+    return f;
+}
+
+/**************** SCHEDULER ****************/
+
+static struct pico_frame *qdisc_select(struct pico_qdisc *q, pico_time now)
+{
+    struct qdisc_band *band;
+    struct qdisc_flow *flow;
+    struct pico_frame *f;
+    int b;
+
+    for (b = 0; b < PICO_QDISC_BANDS; b++) {
+        band = &q->band[b];
+        while (band->head) {
+            flow = band->head;
+            if (flow->deficit <= 0) {
+                /* quantum used up: move to the back of the round */
+                flow->deficit += (int32_t)q->cfg.quantum;
+                if (flow != band->tail) {
+                    qdisc_flow_pop_active(band);
+                    band->tail->next = flow;
+                    band->tail = flow;
+                }
+
+                continue;
+            }
+
+            f = qdisc_codel_dequeue(q, flow, now);
+            if (!f) {
+                qdisc_flow_pop_active(band);
+                flow->active = 0;
+                continue;
+            }
+
+            flow->deficit -= (int32_t)f->len;
+            return f;
+        }
+    }
+    return NULL;
+}
+
+int32_t pico_qdisc_enqueue(struct pico_device *dev, struct pico_frame *f)
+{
+    struct pico_qdisc *q = dev->qdisc;
+    struct qdisc_band *band;
+    struct qdisc_flow *flow;
+
+    if (q->stats.backlog >= q->cfg.limit)
+        qdisc_drop_fattest(q);
+
+    band = &q->band[qdisc_band(f)];
+    flow = &band->flow[qdisc_flow_hash(f)];
+    f->timestamp = pico_tick;
+    if (pico_enqueue(&flow->q, f) < 0)
+        return -1;
+
+    if (!flow->active)
+        qdisc_flow_activate(band, flow, q->cfg.quantum);
+
+    q->stats.backlog++;
+    q->stats.enqueued++;
+    return (int32_t)q->stats.backlog;
+}
+
+struct pico_frame *pico_qdisc_peek(struct pico_device *dev)
+{
+    struct pico_qdisc *q = dev->qdisc;
+
+    if (!q->next) {
+        q->next = qdisc_select(q, pico_tick);
+        q->next_paid = 0;
+    }
+
+    if (!q->next)
+        return NULL;
+
+    if (q->cfg.rate && !q->next_paid) {
+        if (pico_token_bucket_consume(&q->shaper, q->next->len, pico_tick) < 0)
+            return NULL;
+
+        q->next_paid = 1;
+    }
+
+    return q->next;
+}
+
+struct pico_frame *pico_qdisc_dequeue(struct pico_device *dev)
+{
+    struct pico_qdisc *q = dev->qdisc;
+    struct pico_frame *f;
+
+    if (!pico_qdisc_peek(dev))
+        return NULL;
+
+    f = q->next;
+    q->next = NULL;
+    q->stats.sent++;
+    return f;
+}
+
+/**************** API ****************/
+
+int pico_qdisc_attach(struct pico_device *dev, const struct pico_qdisc_config *cfg)
+{
+    struct pico_qdisc *q;
+    struct pico_frame *f;
+
+    if (!dev || dev->qdisc) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    q = PICO_ZALLOC(sizeof(struct pico_qdisc));
+    if (!q) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    if (cfg)
+        q->cfg = *cfg;
+
+    q->mtu = dev->mtu + dev->overhead;
+    if (!q->cfg.limit)
+        q->cfg.limit = PICO_QDISC_LIMIT;
+
+    if (!q->cfg.quantum)
+        q->cfg.quantum = q->mtu;
+
+    if (!q->cfg.target)
+        q->cfg.target = PICO_QDISC_TARGET;
+
+    if (!q->cfg.interval)
+        q->cfg.interval = PICO_QDISC_INTERVAL;
+
+    if (!q->cfg.burst)
+        q->cfg.burst = q->cfg.rate / 10u;
+
+    if (q->cfg.burst < q->mtu)
+        q->cfg.burst = q->mtu;
+
+    pico_token_bucket_init(&q->shaper, q->cfg.rate, q->cfg.burst, pico_tick);
+    dev->qdisc = q;
+
+    /* take over what is already waiting on the device */
+    while ((f = pico_dequeue(dev->q_out)) != NULL)
+        pico_qdisc_enqueue(dev, f);
+
+    return 0;
+}
+
+int pico_qdisc_detach(struct pico_device *dev)
+{
+    struct pico_qdisc *q;
+    struct pico_frame *f;
+    int b, i;
+
+    if (!dev || !dev->qdisc) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    q = dev->qdisc;
+    /* hand pending frames back to the device queue, in scheduling order */
+    q->cfg.no_codel = 1;
+    if (q->next && pico_enqueue(dev->q_out, q->next) < 0)
+        pico_frame_discard(q->next);
+
+    while ((f = qdisc_select(q, pico_tick)) != NULL) {
+        if (pico_enqueue(dev->q_out, f) < 0)
+            pico_frame_discard(f);
+    }
+    for (b = 0; b < PICO_QDISC_BANDS; b++) {
+        for (i = 0; i < PICO_QDISC_FLOWS; i++)
+            pico_queue_empty(&q->band[b].flow[i].q);
+    }
+    dev->qdisc = NULL;
+    PICO_FREE(q);
+    return 0;
+}
+
+int pico_qdisc_get_stats(struct pico_device *dev, struct pico_qdisc_stats *stats)
+{
+    if (!dev || !dev->qdisc || !stats) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    *stats = dev->qdisc->stats;
+    return 0;
+}
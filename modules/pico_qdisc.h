@@ -0,0 +1,61 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+ *********************************************************************/
+#ifndef INCLUDE_PICO_QDISC
+#define INCLUDE_PICO_QDISC
+#include "pico_config.h"
+#include "pico_device.h"
+#include "pico_frame.h"
+
+/* Number of flow queues per priority band */
+#ifndef PICO_QDISC_FLOWS
+#define PICO_QDISC_FLOWS        (16)
+#endif
+
+/* Defaults used for the zero fields of struct pico_qdisc_config */
+#ifndef PICO_QDISC_LIMIT
+#define PICO_QDISC_LIMIT        (128)
+#endif
+#ifndef PICO_QDISC_TARGET
+#define PICO_QDISC_TARGET       (5)     /* ms */
+#endif
+#ifndef PICO_QDISC_INTERVAL
+#define PICO_QDISC_INTERVAL     (100)   /* ms */
+#endif
+
+/* Frames with a positive priority, and non-IP frames such as ARP, go to the
+ * first band; priority 0 to the second band; negative priorities to the last.
+ * Bands are served in strict priority order; within a band, flows are served
+ * round robin by byte deficit (DRR), each flow queue being managed by CoDel. */
+#define PICO_QDISC_BANDS        (3)
+
+struct pico_qdisc_config {
+    uint32_t rate;      /* shaping rate in bytes per second, 0 for no shaping */
+    uint32_t burst;     /* shaper bucket in bytes, 0 for 100 ms of traffic (at least one MTU) */
+    uint32_t limit;     /* frames queued over all bands */
+    uint32_t quantum;   /* DRR quantum in bytes, 0 for the device MTU */
+    uint32_t target;    /* CoDel target delay in ms */
+    uint32_t interval;  /* CoDel interval in ms */
+    uint8_t no_codel;   /* plain DRR, drop only on overflow */
+};
+
+struct pico_qdisc_stats {
+    uint32_t backlog;   /* frames queued */
+    uint32_t enqueued;
+    uint32_t sent;
+    uint32_t overlimits; /* dropped because the queue was full */
+    uint32_t codel_drops;
+};
+
+int pico_qdisc_attach(struct pico_device *dev, const struct pico_qdisc_config *cfg);
+int pico_qdisc_detach(struct pico_device *dev);
+int pico_qdisc_get_stats(struct pico_device *dev, struct pico_qdisc_stats *stats);
+
+/* Called by the stack */
+int32_t pico_qdisc_enqueue(struct pico_device *dev, struct pico_frame *f);
+struct pico_frame *pico_qdisc_peek(struct pico_device *dev);
+struct pico_frame *pico_qdisc_dequeue(struct pico_device *dev);
+
+#endif
@@ -0,0 +1,103 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   Simulated clock and discrete event driver.
+ *********************************************************************/
+
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_dev_pipe.h"
+#include "pico_simtime.h"
+
+#ifdef PICO_SUPPORT_SIMTIME
+
+#ifdef DEBUG_SIMTIME
+    #define simtime_dbg dbg
+#else
+    #define simtime_dbg(...) do {} while(0)
+#endif
+
+uint64_t (*pico_time_source)(void) = NULL;
+static pico_time simtime_now;
+
+static uint64_t simtime_clock(void)
+{
+    return simtime_now;
+}
+
+void pico_simtime_start(pico_time now)
+{
+    simtime_now = now;
+    pico_time_source = simtime_clock;
+    pico_rand_seed(PICO_SIMTIME_SEED);
+}
+
+void pico_simtime_stop(void)
+{
+    pico_time_source = NULL;
+}
+
+pico_time pico_simtime_now(void)
+{
+    return simtime_now;
+}
+
+void pico_simtime_advance(pico_time ms)
+{
+    simtime_now += ms;
+}
+
+/* Timers fire once the clock is past their expiry */
+static pico_time simtime_next_event(pico_time end)
+{
+    pico_time next = end, t;
+
+    if ((pico_timer_next(&t) == 0) && (t + 1 < next))
+        next = t + 1;
+
+    if ((pico_pipe_next(&t) == 0) && (t < next))
+        next = t;
+
+    if (next <= simtime_now)
+        next = simtime_now + 1;
+
+    return next;
+}
+
+int pico_simtime_run(pico_time duration, int (*done)(void *), void *arg)
+{
+    pico_time end = simtime_now + duration;
+    uint32_t busy = 0;
+
+    if (pico_time_source != simtime_clock) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    for (;;) {
+        if (done && done(arg))
+            return 1;
+
+        pico_stack_tick();
+        if (pico_stack_tick_busy()) {
+            if (++busy < PICO_SIMTIME_TICKS_PER_MS)
+                continue;
+
+            simtime_now++;
+        } else {
+            if (simtime_now >= end)
+                return 0;
+
+            simtime_now = simtime_next_event(end);
+            simtime_dbg("SIMTIME: idle, on to %llu\n", (unsigned long long)simtime_now);
+        }
+
+        if (simtime_now > end)
+            return 0;
+
+        busy = 0;
+    }
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+ *********************************************************************/
+#ifndef INCLUDE_PICO_SIMTIME
+#define INCLUDE_PICO_SIMTIME
+#include "pico_config.h"
+
+/* Simulated clock. Once started, PICO_TIME_MS() reads it instead of the
+ * wall clock, and pico_simtime_run() drives the stack as a discrete event
+ * simulation: it ticks while there is work, and when there is none jumps
+ * the clock straight to the next timer or pipe arrival. Runs are
+ * reproducible, and as fast as the stack can process its frames.
+ *
+ * Start the clock before pico_stack_init(), so that every timer is set on
+ * simulated time. */
+
+#ifdef PICO_SUPPORT_SIMTIME
+
+/* Busy ticks in a row that count as 1 ms, so that a stack that always has
+ * work still sees time go by */
+#ifndef PICO_SIMTIME_TICKS_PER_MS
+#define PICO_SIMTIME_TICKS_PER_MS   (100)
+#endif
+
+/* pico_rand() restarts from here, it picks TCP sequence numbers and ports */
+#ifndef PICO_SIMTIME_SEED
+#define PICO_SIMTIME_SEED           (0x5EED5EEDu)
+#endif
+
+void pico_simtime_start(pico_time now);
+void pico_simtime_stop(void);
+pico_time pico_simtime_now(void);
+/* Moves the clock forward without ticking */
+void pico_simtime_advance(pico_time ms);
+
+/* Runs the stack for duration ms of simulated time, events due at the end
+ * included, or until done(arg), checked before every tick, returns nonzero.
+ * done may be NULL. Returns 1 if done() stopped it, 0 when the time is up,
+ * -1 if the clock isn't running. */
+int pico_simtime_run(pico_time duration, int (*done)(void *), void *arg);
+
+#endif
+
+#endif
@@ -198,12 +198,12 @@ int pico_socket_tcp_deliver(struct pico_sockport *sp, struct pico_frame *f)
 {
     struct pico_socket *found = NULL;
     struct pico_socket *target = NULL;
-    struct pico_tree_node *index = NULL;
-    struct pico_tree_node *_tmp;
+    struct pico_rb_node *index = NULL;
+    struct pico_rb_node *_tmp;
     struct pico_socket *s = NULL;
 
-    pico_tree_foreach_safe(index, &sp->socks, _tmp){
-        s = index->keyValue;
+    pico_sockport_foreach_safe(index, sp, _tmp){
+        s = pico_sockport_entry(index);
         /* 4-tuple identification of socket (port-IP) */
         if (IS_IPV4(f)) {
             found = socket_tcp_deliver_ipv4(s, f);
@@ -43,144 +43,178 @@ static int pico_enqueue_and_wakeup_if_needed(struct pico_queue *q_in, struct pic
 }
 #endif
 
-#ifdef PICO_SUPPORT_IPV4
 #ifdef PICO_SUPPORT_MCAST
-static inline int pico_socket_udp_deliver_ipv4_mcast_initial_checks(struct pico_socket *s, struct pico_frame *f)
+/* Loopback and local address checks, on top of the group membership */
+static int pico_socket_udp_mcast_accept(struct pico_socket *s, struct pico_frame *f, union pico_address *src)
 {
-    struct pico_ip4 p_dst;
-    struct pico_ipv4_hdr *ip4hdr;
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_IPV4(f)) {
+        if ((pico_ipv4_link_get(&src->ip4)) && (PICO_SOCKET_GETOPT(s, PICO_SOCKET_OPT_MULTICAST_LOOP) == 0u))
+            return -1; /* Datagram from ourselves, Loop disabled */
 
-    ip4hdr = (struct pico_ipv4_hdr*)(f->net_hdr);
-    p_dst.addr = ip4hdr->dst.addr;
-    if (pico_ipv4_is_multicast(p_dst.addr) && (pico_socket_mcast_filter(s, (union pico_address *)&ip4hdr->dst, (union pico_address *)&ip4hdr->src) < 0))
-        return -1;
+        if ((s->local_addr.ip4.addr == PICO_IPV4_INADDR_ANY) || (pico_ipv4_link_find(&s->local_addr.ip4) == f->dev))
+            return 0;
+    }
 
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(f)) {
+        if ((pico_ipv6_link_get(&src->ip6)) && (PICO_SOCKET_GETOPT(s, PICO_SOCKET_OPT_MULTICAST_LOOP) == 0u))
+            return -1; /* Datagram from ourselves, Loop disabled */
 
-    if ((pico_ipv4_link_get(&ip4hdr->src)) && (PICO_SOCKET_GETOPT(s, PICO_SOCKET_OPT_MULTICAST_LOOP) == 0u)) {
-        /* Datagram from ourselves, Loop disabled, discarding. */
-        return -1;
+        if (pico_ipv6_is_unspecified(s->local_addr.ip6.addr) || (pico_ipv6_link_find(&s->local_addr.ip6) == f->dev))
+            return 0;
     }
 
-    return 0;
+#endif
+    return -1;
 }
+#endif
 
-
-static int pico_socket_udp_deliver_ipv4_mcast(struct pico_socket *s, struct pico_frame *f)
+#ifdef PICO_SUPPORT_IPV4
+static int pico_socket_udp_deliver_ipv4_bcast(struct pico_socket *s, struct pico_frame *f)
 {
-    struct pico_ip4 s_local;
-    struct pico_frame *cpy;
-    struct pico_device *dev = pico_ipv4_link_find(&s->local_addr.ip4);
+    struct pico_ipv4_hdr *ip4hdr = (struct pico_ipv4_hdr*)(f->net_hdr);
 
-    s_local.addr = s->local_addr.ip4.addr;
+    if ((pico_ipv4_link_get(&ip4hdr->src)) && (PICO_SOCKET_GETOPT(s, PICO_SOCKET_OPT_MULTICAST_LOOP) == 0u)) {
+        /* Datagram from ourselves, Loop disabled, discarding. */
+        return -1;
+    }
 
-    if (pico_socket_udp_deliver_ipv4_mcast_initial_checks(s, f) < 0)
+    if ((s->local_addr.ip4.addr == PICO_IPV4_INADDR_ANY) || /* If our local ip is ANY, or.. */
+        (pico_ipv4_link_find(&s->local_addr.ip4) == f->dev)) { /* the source of the bcast packet is a neighbor... */
         return 0;
-
-    if ((s_local.addr == PICO_IPV4_INADDR_ANY) || /* If our local ip is ANY, or.. */
-        (dev == f->dev)) {     /* the source of the bcast packet is a neighbor... */
-        cpy = pico_frame_copy(f);
-        if (!cpy)
-            return -1;
-
-        pico_enqueue_and_wakeup_if_needed(&s->q_in, s, cpy);
     }
 
-    return 0;
-}
-#endif
-static int pico_socket_udp_deliver_ipv4_unicast(struct pico_socket *s, struct pico_frame *f)
-{
-    struct pico_frame *cpy;
-    /* Either local socket is ANY, or matches dst */
-    cpy = pico_frame_copy(f);
-    if (!cpy)
-        return -1;
-
-    pico_enqueue_and_wakeup_if_needed(&s->q_in, s, cpy);
-
-    return 0;
+    return -1;
 }
 
-
 static int pico_socket_udp_deliver_ipv4(struct pico_socket *s, struct pico_frame *f)
 {
-    int ret = 0;
     struct pico_ip4 s_local, p_dst;
     struct pico_ipv4_hdr *ip4hdr;
     ip4hdr = (struct pico_ipv4_hdr*)(f->net_hdr);
     s_local.addr = s->local_addr.ip4.addr;
     p_dst.addr = ip4hdr->dst.addr;
-    if ((pico_ipv4_is_broadcast(p_dst.addr)) || pico_ipv4_is_multicast(p_dst.addr)) {
-#ifdef PICO_SUPPORT_MCAST
-        ret = pico_socket_udp_deliver_ipv4_mcast(s, f);
-#endif
+    if (pico_ipv4_is_broadcast(p_dst.addr)) {
+        if (pico_socket_udp_deliver_ipv4_bcast(s, f) == 0) {
+            pico_enqueue_and_wakeup_if_needed(&s->q_in, s, f);
+            return 0;
+        }
     } else if ((s_local.addr == PICO_IPV4_INADDR_ANY) || (s_local.addr == p_dst.addr)) {
-        ret = pico_socket_udp_deliver_ipv4_unicast(s, f);
+        /* Either local socket is ANY, or matches dst */
+        pico_enqueue_and_wakeup_if_needed(&s->q_in, s, f);
+        return 0;
     }
 
     pico_frame_discard(f);
-    return ret;
+    return 0;
 }
 #endif
 
 #ifdef PICO_SUPPORT_IPV6
-#ifdef PICO_SUPPORT_MCAST
-static inline int pico_socket_udp_deliver_ipv6_mcast(struct pico_socket *s, struct pico_frame *f)
+static int pico_socket_udp_deliver_ipv6(struct pico_socket *s, struct pico_frame *f)
 {
+    struct pico_ip6 s_local, p_dst;
     struct pico_ipv6_hdr *ip6hdr;
-    struct pico_frame *cpy;
-    struct pico_device *dev = pico_ipv6_link_find(&s->local_addr.ip6);
-
     ip6hdr = (struct pico_ipv6_hdr*)(f->net_hdr);
-
-    if ((pico_ipv6_link_get(&ip6hdr->src)) && (PICO_SOCKET_GETOPT(s, PICO_SOCKET_OPT_MULTICAST_LOOP) == 0u)) {
-        /* Datagram from ourselves, Loop disabled, discarding. */
+    s_local = s->local_addr.ip6;
+    p_dst = ip6hdr->dst;
+    if (pico_ipv6_is_multicast(p_dst.addr)) {
+#ifdef PICO_SUPPORT_MCAST
+        /* group nobody joined */
+        if (pico_socket_udp_mcast_accept(s, f, (union pico_address *)&ip6hdr->src) == 0) {
+            pico_enqueue_and_wakeup_if_needed(&s->q_in, s, f);
+            return 0;
+        }
+#endif
+    }
+    else if (pico_ipv6_is_unspecified(s->local_addr.ip6.addr) || (pico_ipv6_compare(&s_local, &p_dst) == 0))
+    { /* Either local socket is ANY, or matches dst */
+        pico_enqueue_and_wakeup_if_needed(&s->q_in, s, f);
         return 0;
     }
 
+    pico_frame_discard(f);
+    return 0;
+}
+#endif
 
-    if (pico_ipv6_is_unspecified(s->local_addr.ip6.addr) || /* If our local ip is ANY, or.. */
-        (dev == f->dev)) {     /* the source of the bcast packet is a neighbor... */
-        cpy = pico_frame_copy(f);
-        if (!cpy)
-        {
-            return -1;
+#ifdef PICO_SUPPORT_MCAST
+static void pico_socket_udp_enqueue_mcast(struct pico_socket *s, struct pico_frame *f)
+{
+    if (pico_enqueue(&s->q_in, f) > 0)
+        s->ev_pending |= PICO_SOCK_EV_RD;
+    else
+        pico_frame_discard(f);
+}
+
+/* Every receiver but the last gets a copy sharing the buffer, the last one gets f.
+ * Returns -1 if f found no receiver, without consuming it.
+ * The wakeups come last: a callback may close sockets, or consume f. */
+static int pico_socket_udp_deliver_mcast(struct pico_sockport *sp, struct pico_frame *f, uint16_t proto, union pico_address *dst, union pico_address *src)
+{
+    struct pico_socket *s, *last = NULL;
+    struct pico_frame *cpy;
+    struct pico_mcast_it it = {
+        0
+    };
+    union pico_address grp, from;
+    uint16_t port = sp->number;
+
+    while ((s = pico_socket_mcast_next(&it, proto, port, dst, src)) != NULL) {
+        if (pico_socket_udp_mcast_accept(s, f, src) < 0)
+            continue;
+
+        if (last) {
+            cpy = pico_frame_copy(f);
+            if (cpy)
+                pico_socket_udp_enqueue_mcast(last, cpy);
         }
 
-        pico_enqueue_and_wakeup_if_needed(&s->q_in, s, cpy);
+        last = s;
     }
+    if (!last)
+        return -1;
+
+    grp = *dst;
+    from = *src;
+    pico_socket_udp_enqueue_mcast(last, f);
+
+    /* Each socket is woken once, the walk restarts if a callback changed the index */
+    while ((s = pico_socket_mcast_next(&it, proto, port, &grp, &from)) != NULL) {
+        if (!(s->ev_pending & PICO_SOCK_EV_RD))
+            continue;
 
+        s->ev_pending &= (uint16_t)(~PICO_SOCK_EV_RD);
+        if (s->wakeup)
+            s->wakeup(PICO_SOCK_EV_RD, s);
+    }
     return 0;
 }
-#endif
-static int pico_socket_udp_deliver_ipv6(struct pico_socket *s, struct pico_frame *f)
+
+static int pico_socket_udp_is_mcast(struct pico_frame *f, uint16_t *proto, union pico_address **dst, union pico_address **src)
 {
-    struct pico_ip6 s_local, p_dst;
-    struct pico_ipv6_hdr *ip6hdr;
-    struct pico_frame *cpy;
-    ip6hdr = (struct pico_ipv6_hdr*)(f->net_hdr);
-    s_local = s->local_addr.ip6;
-    p_dst = ip6hdr->dst;
-    if ((pico_ipv6_is_multicast(p_dst.addr))) {
-#ifdef PICO_SUPPORT_MCAST
-        int retval = pico_socket_udp_deliver_ipv6_mcast(s, f);
-        pico_frame_discard(f);
-        return retval;
-#endif
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_IPV4(f)) {
+        struct pico_ipv4_hdr *ip4hdr = (struct pico_ipv4_hdr*)(f->net_hdr);
+        *proto = PICO_PROTO_IPV4;
+        *dst = (union pico_address *)&ip4hdr->dst;
+        *src = (union pico_address *)&ip4hdr->src;
+        return pico_ipv4_is_multicast(ip4hdr->dst.addr);
     }
-    else if (pico_ipv6_is_unspecified(s->local_addr.ip6.addr) || (pico_ipv6_compare(&s_local, &p_dst) == 0))
-    { /* Either local socket is ANY, or matches dst */
-        cpy = pico_frame_copy(f);
-        if (!cpy)
-        {
-            pico_frame_discard(f);
-            return -1;
-        }
 
-        pico_enqueue_and_wakeup_if_needed(&s->q_in, s, cpy);
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(f)) {
+        struct pico_ipv6_hdr *ip6hdr = (struct pico_ipv6_hdr*)(f->net_hdr);
+        *proto = PICO_PROTO_IPV6;
+        *dst = (union pico_address *)&ip6hdr->dst;
+        *src = (union pico_address *)&ip6hdr->src;
+        return pico_ipv6_is_multicast(ip6hdr->dst.addr);
     }
 
-    pico_frame_discard(f);
+#endif
     return 0;
 }
 #endif
@@ -188,14 +222,31 @@ static int pico_socket_udp_deliver_ipv6(struct pico_socket *s, struct pico_frame
 
 int pico_socket_udp_deliver(struct pico_sockport *sp, struct pico_frame *f)
 {
-    struct pico_tree_node *index = NULL;
-    struct pico_tree_node *_tmp;
+    struct pico_rb_node *index = NULL;
+    struct pico_rb_node *_tmp;
     struct pico_socket *s = NULL;
+#ifdef PICO_SUPPORT_MCAST
+    union pico_address *dst, *src;
+    uint16_t proto;
+#endif
     pico_err = PICO_ERR_EPROTONOSUPPORT;
     #ifdef PICO_SUPPORT_UDP
     pico_err = PICO_ERR_NOERR;
-    pico_tree_foreach_safe(index, &sp->socks, _tmp){
-        s = index->keyValue;
+#ifdef PICO_SUPPORT_MCAST
+    if (pico_socket_udp_is_mcast(f, &proto, &dst, &src)) {
+        if (pico_socket_udp_deliver_mcast(sp, f, proto, dst, src) == 0)
+            return 0;
+
+        /* IPv6 sockets get multicast without joining, as before */
+        if (proto == PICO_PROTO_IPV4) {
+            pico_frame_discard(f);
+            return 0;
+        }
+    }
+
+#endif
+    pico_sockport_foreach_safe(index, sp, _tmp){
+        s = pico_sockport_entry(index);
         if (IS_IPV4(f)) { /* IPV4 */
 #ifdef PICO_SUPPORT_IPV4
             return pico_socket_udp_deliver_ipv4(s, f);
@@ -0,0 +1,142 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   Per device and per protocol statistics.
+ *********************************************************************/
+
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_device.h"
+#include "pico_protocol.h"
+#include "pico_tree.h"
+#include "pico_qdisc.h"
+#include "pico_stats.h"
+
+#ifdef PICO_SUPPORT_STATS
+
+static struct pico_stats_loop stats_loop;
+
+static void stats_queue_get(struct pico_queue_stats *dst, const struct pico_queue *q)
+{
+    if (q)
+        *dst = q->stats;
+    else
+        memset(dst, 0, sizeof(*dst));
+}
+
+static void stats_queue_reset(struct pico_queue *q)
+{
+    if (q)
+        memset(&q->stats, 0, sizeof(q->stats));
+}
+
+static void stats_device_get(struct pico_stats_entry *e, struct pico_device *dev)
+{
+#ifdef PICO_SUPPORT_QDISC
+    struct pico_qdisc_stats qs;
+#endif
+
+    memset(e, 0, sizeof(*e));
+    memcpy(e->name, dev->name, PICO_STATS_NAME_LEN - 1);
+    e->type = PICO_STATS_DEVICE;
+    stats_queue_get(&e->in, dev->q_in);
+    stats_queue_get(&e->out, dev->q_out);
+    e->rx = e->in.enqueued;
+    e->tx = dev->stats_tx;
+    e->drop = dev->stats_drop;
+    e->queue_full = e->in.full + e->out.full;
+#ifdef PICO_SUPPORT_QDISC
+    if (dev->qdisc && (pico_qdisc_get_stats(dev, &qs) == 0)) {
+        e->drop += qs.codel_drops;
+        e->queue_full += qs.overlimits;
+    }
+#endif
+}
+
+static void stats_protocol_get(struct pico_stats_entry *e, struct pico_protocol *p)
+{
+    memset(e, 0, sizeof(*e));
+    memcpy(e->name, p->name, PICO_STATS_NAME_LEN - 1);
+    e->type = PICO_STATS_PROTOCOL;
+    e->layer = (uint8_t)p->layer;
+    stats_queue_get(&e->in, p->q_in);
+    stats_queue_get(&e->out, p->q_out);
+    e->rx = e->in.dequeued;
+    e->tx = e->out.dequeued;
+    e->queue_full = e->in.full + e->out.full;
+}
+
+int pico_stats_snapshot(struct pico_stats_entry *entries, uint32_t max)
+{
+    struct pico_tree_node *index;
+    struct pico_protocol *p = NULL;
+    uint32_t n = 0;
+
+    if (!entries && max) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    pico_tree_foreach(index, &Device_tree) {
+        if (n < max)
+            stats_device_get(&entries[n], index->keyValue);
+
+        n++;
+    }
+
+    while ((p = pico_protocol_next(p)) != NULL) {
+        if (n < max)
+            stats_protocol_get(&entries[n], p);
+
+        n++;
+    }
+    return (int)n;
+}
+
+void pico_stats_loop_get(struct pico_stats_loop *loop)
+{
+    if (loop)
+        *loop = stats_loop;
+}
+
+void pico_stats_reset(void)
+{
+    struct pico_tree_node *index;
+    struct pico_device *dev;
+    struct pico_protocol *p = NULL;
+
+    pico_tree_foreach(index, &Device_tree) {
+        dev = index->keyValue;
+        stats_queue_reset(dev->q_in);
+        stats_queue_reset(dev->q_out);
+        dev->stats_tx = 0;
+        dev->stats_drop = 0;
+    }
+
+    while ((p = pico_protocol_next(p)) != NULL) {
+        stats_queue_reset(p->q_in);
+        stats_queue_reset(p->q_out);
+    }
+    memset(&stats_loop, 0, sizeof(stats_loop));
+}
+
+void pico_stats_loop_update(const int *score, const int *left, uint32_t phases)
+{
+    uint32_t i;
+
+    if (phases > PICO_STATS_LOOP_PHASES)
+        phases = PICO_STATS_LOOP_PHASES;
+
+    stats_loop.ticks++;
+    for (i = 0; i < phases; i++) {
+        stats_loop.score[i] = (uint32_t)score[i];
+        if (left[i] < score[i])
+            stats_loop.used[i] += (uint32_t)(score[i] - left[i]);
+
+        if (left[i] <= 0)
+            stats_loop.exhausted[i]++;
+    }
+}
+
+#endif
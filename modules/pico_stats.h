@@ -0,0 +1,60 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+ *********************************************************************/
+#ifndef INCLUDE_PICO_STATS
+#define INCLUDE_PICO_STATS
+#include "pico_config.h"
+#include "pico_queue.h"
+
+/* Counters for tuning queue sizes and loop scores. With PICO_SUPPORT_STATS
+ * every pico_queue counts what goes through it and how deep it got, and
+ * stamps frames on enqueue to build a latency histogram on dequeue
+ * (PICO_STATS_LATENCY). The snapshot reads those counters back per device
+ * and per protocol. Without PICO_SUPPORT_STATS none of it is compiled in. */
+
+#ifdef PICO_SUPPORT_STATS
+
+#define PICO_STATS_DEVICE           (0)
+#define PICO_STATS_PROTOCOL         (1)
+
+/* Phases of pico_stack_tick(): device in, datalink in, network in,
+ * transport in, socket in, sockets, socket out, transport out, network out,
+ * datalink out, device out */
+#define PICO_STATS_LOOP_PHASES      (11)
+
+#define PICO_STATS_NAME_LEN         (16)
+
+struct pico_stats_entry {
+    char name[PICO_STATS_NAME_LEN];
+    uint8_t type;               /* PICO_STATS_DEVICE or PICO_STATS_PROTOCOL */
+    uint8_t layer;              /* enum pico_layer, 0 for devices */
+    uint32_t rx;
+    uint32_t tx;
+    uint32_t drop;              /* devices only: receive allocation failures, CoDel drops */
+    uint32_t queue_full;        /* frames refused by q_in, q_out or the qdisc */
+    struct pico_queue_stats in;
+    struct pico_queue_stats out;
+};
+
+struct pico_stats_loop {
+    uint32_t ticks;
+    uint32_t score[PICO_STATS_LOOP_PHASES];     /* budget in the last tick */
+    uint32_t used[PICO_STATS_LOOP_PHASES];      /* budget spent, all ticks */
+    uint32_t exhausted[PICO_STATS_LOOP_PHASES]; /* ticks that spent all of it */
+};
+
+/* Fills up to max entries, devices first. Returns how many there are, which
+ * may be more than max. */
+int pico_stats_snapshot(struct pico_stats_entry *entries, uint32_t max);
+void pico_stats_loop_get(struct pico_stats_loop *loop);
+/* Clears the counters of every device, protocol and the loop. The qdisc
+ * keeps its own. */
+void pico_stats_reset(void);
+
+/* Called by the stack */
+void pico_stats_loop_update(const int *score, const int *left, uint32_t phases);
+#endif
+
+#endif
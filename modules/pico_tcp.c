@@ -16,6 +16,9 @@
 #include "pico_socket_tcp.h"
 #include "pico_queue.h"
 #include "pico_tree.h"
+#include "pico_ipv4.h"
+#include "pico_ipv6.h"
+#include "pico_pmtu.h"
 
 #define TCP_IS_STATE(s, st) ((s->state & PICO_SOCKET_STATE_TCP) == st)
 #define TCP_SOCK(s) ((struct pico_socket_tcp *)s)
@@ -33,13 +36,15 @@
 #define PICO_TCP_MAX_RETRANS         10
 #define PICO_TCP_MAX_CONNECT_RETRIES 3
 
-#define PICO_TCP_LOOKAHEAD      0x00
-#define PICO_TCP_FIRST_DUPACK   0x01
-#define PICO_TCP_SECOND_DUPACK  0x02
-#define PICO_TCP_RECOVER        0x03
-#define PICO_TCP_BLACKOUT       0x04
-#define PICO_TCP_UNREACHABLE    0x05
-#define PICO_TCP_WINDOW_FULL    0x06
+/* Packetization layer path MTU discovery, RFC 4821 */
+#ifndef PICO_TCP_PLPMTUD_BASE
+#define PICO_TCP_PLPMTUD_BASE       1024u   /* MTU to fall back to on a black hole */
+#endif
+#ifndef PICO_TCP_PLPMTUD_INTERVAL
+#define PICO_TCP_PLPMTUD_INTERVAL   600000u /* ms before a settled search starts over */
+#endif
+#define PICO_TCP_PLPMTUD_STEP       32u     /* search is over below this range */
+#define PICO_TCP_PLPMTUD_BH_RETRIES 2       /* timeouts of a large segment before a black hole is assumed */
 
 #define ONE_GIGABYTE ((uint32_t)(1024UL * 1024UL * 1024UL))
 
@@ -48,8 +53,8 @@
 /* check if the hold queue contains data (again Nagle) */
 #define IS_TCP_HOLDQ_EMPTY(t)   (t->tcpq_hold.size == 0)
 
-#define IS_INPUT_QUEUE(q)  (q->pool.compare == input_segment_compare)
-#define TCP_INPUT_OVERHEAD (sizeof(struct tcp_input_segment) + sizeof(struct pico_tree_node))
+#define IS_INPUT_QUEUE(q)  (q->input)
+#define TCP_INPUT_OVERHEAD (sizeof(struct tcp_input_segment))
 
 
 #ifdef PICO_SUPPORT_TCP
@@ -81,6 +86,7 @@ static void *Mutex = NULL;
 /* Input segment, used to keep only needed data, not the full frame */
 struct tcp_input_segment
 {
+    struct pico_rb_node node;
     uint32_t seq;
     /* Pointer to payload */
     unsigned char *payload;
@@ -88,12 +94,13 @@ struct tcp_input_segment
 };
 
 /* Function to compare input segments */
-static int input_segment_compare(void *ka, void *kb)
+static inline int input_segment_compare(struct tcp_input_segment *a, struct tcp_input_segment *b)
 {
-    struct tcp_input_segment *a = ka, *b = kb;
     return pico_seq_compare(a->seq, b->seq);
 }
 
+PICO_RB_GENERATE(tcp_inseg, struct tcp_input_segment, node, input_segment_compare)
+
 static struct tcp_input_segment *segment_from_frame(struct pico_frame *f)
 {
     struct tcp_input_segment *seg;
@@ -118,20 +125,33 @@ static struct tcp_input_segment *segment_from_frame(struct pico_frame *f)
     return seg;
 }
 
-static int segment_compare(void *ka, void *kb)
+static inline int segment_compare(struct pico_frame *a, struct pico_frame *b)
 {
-    struct pico_frame *a = ka, *b = kb;
     return pico_seq_compare(SEQN(a), SEQN(b));
 }
 
+PICO_RB_GENERATE(tcp_outseg, struct pico_frame, tcp_node, segment_compare)
+
 struct pico_tcp_queue
 {
-    struct pico_tree pool;
+    struct pico_rb_tree pool;
     uint32_t max_size;
     uint32_t size;
     uint32_t frames;
+    uint8_t input; /* holds tcp_input_segments rather than frames */
 };
 
+static void *segment_of(struct pico_tcp_queue *tq, struct pico_rb_node *n)
+{
+    if (!n)
+        return NULL;
+
+    if (IS_INPUT_QUEUE(tq))
+        return pico_rb_entry(n, struct tcp_input_segment, node);
+
+    return pico_rb_entry(n, struct pico_frame, tcp_node);
+}
+
 static void tcp_discard_all_segments(struct pico_tcp_queue *tq);
 static void *peek_segment(struct pico_tcp_queue *tq, uint32_t seq)
 {
@@ -144,7 +164,7 @@ static void *peek_segment(struct pico_tcp_queue *tq, uint32_t seq)
         f.transport_hdr = (uint8_t *) (&H);
         H.seq = long_be(seq);
 
-        return pico_tree_findKey(&tq->pool, &f);
+        return tcp_outseg_find(&tq->pool, &f);
     }
     else
     {
@@ -153,14 +173,14 @@ static void *peek_segment(struct pico_tcp_queue *tq, uint32_t seq)
         };
         dummy.seq = seq;
 
-        return pico_tree_findKey(&tq->pool, &dummy);
+        return tcp_inseg_find(&tq->pool, &dummy);
     }
 
 }
 
 static void *first_segment(struct pico_tcp_queue *tq)
 {
-    return pico_tree_first(&tq->pool);
+    return segment_of(tq, pico_rb_first(&tq->pool));
 }
 
 static void *next_segment(struct pico_tcp_queue *tq, void *cur)
@@ -198,7 +218,7 @@ static int32_t do_enqueue_segment(struct pico_tcp_queue *tq, void *f, uint16_t p
         goto out;
     }
 
-    if (pico_tree_insert(&tq->pool, f) != 0)
+    if ((IS_INPUT_QUEUE(tq) ? (void *)tcp_inseg_insert(&tq->pool, f) : (void *)tcp_outseg_insert(&tq->pool, f)) != NULL)
     {
         ret = 0;
         goto out;
@@ -240,7 +260,16 @@ static void pico_discard_segment(struct pico_tcp_queue *tq, void *f)
                                       (((struct tcp_input_segment *)f)->payload_len) :
                                       (((struct pico_frame *)f)->buffer_len));
     PICOTCP_MUTEX_LOCK(Mutex);
-    f1 = pico_tree_delete(&tq->pool, f);
+    if (IS_INPUT_QUEUE(tq)) {
+        f1 = tcp_inseg_find(&tq->pool, f);
+        if (f1)
+            tcp_inseg_remove(&tq->pool, f1);
+    } else {
+        f1 = tcp_outseg_find(&tq->pool, f);
+        if (f1)
+            tcp_outseg_remove(&tq->pool, f1);
+    }
+
     if (f1) {
         tq->size -= (uint16_t)payload_len;
         if (payload_len > 0)
@@ -309,6 +338,15 @@ struct pico_socket_tcp {
     uint8_t ts_ok;
     uint8_t mss_ok;
     uint8_t scale_ok;
+    uint16_t mss_peer;          /* MSS option of the peer, 0 if none */
+#ifdef PICO_SUPPORT_PMTU
+    /* PLPMTUD search, as mss values */
+    uint16_t plpmtu_safe;       /* mss before the probe, 0 if not probing */
+    uint16_t plpmtu_high;       /* smallest mss known to be lost, 0 if none */
+    uint8_t plpmtu_sent;        /* a segment of the probed size is out */
+    uint32_t plpmtu_seq;        /* end of that segment */
+    pico_time plpmtu_next;      /* no probe before this */
+#endif
     struct tcp_sack_block *sacks;
     uint8_t jumbo;
     uint32_t linger_timeout;
@@ -329,6 +367,13 @@ struct pico_socket_tcp {
 
     /* FIN timer */
     uint32_t fin_tmr;
+
+    /* Counters, see struct pico_tcp_info */
+    uint64_t bytes_acked;
+    uint32_t retrans;
+    uint32_t rto_events;
+    uint32_t recoveries;
+    uint32_t zero_window_probes;
 };
 
 /* Queues */
@@ -342,6 +387,11 @@ static struct pico_queue tcp_out = {
 /* If Nagle enabled, this function can make 1 new segment from smaller segments in hold queue */
 static struct pico_frame *pico_hold_segment_make(struct pico_socket_tcp *t);
 
+#ifdef PICO_SUPPORT_PMTU
+static void tcp_plpmtu_acked(struct pico_socket_tcp *t, uint32_t ack);
+static struct pico_frame *tcp_plpmtu_timeout(struct pico_socket_tcp *t, struct pico_frame *f);
+#endif
+
 /* checks if tcpq_in is empty */
 int pico_tcp_queue_in_is_empty(struct pico_socket *s)
 {
@@ -388,14 +438,14 @@ static int release_until(struct pico_tcp_queue *q, uint32_t seq)
 static int release_all_until(struct pico_tcp_queue *q, uint32_t seq, pico_time *timestamp)
 {
     void *f = NULL;
-    struct pico_tree_node *idx, *temp;
+    struct pico_rb_node *idx, *temp;
     int seq_result;
     int ret = 0;
     *timestamp = 0;
 
-    pico_tree_foreach_safe(idx, &q->pool, temp)
+    pico_rb_foreach_safe(idx, &q->pool, temp)
     {
-        f = idx->keyValue;
+        f = segment_of(q, idx);
 
         if (IS_INPUT_QUEUE(q))
             seq_result = pico_seq_compare(((struct tcp_input_segment *)f)->seq + ((struct tcp_input_segment *)f)->payload_len, seq);
@@ -763,11 +813,11 @@ static inline int tcp_sack_marker(struct pico_frame *f, uint32_t start, uint32_t
 static void tcp_process_sack(struct pico_socket_tcp *t, uint32_t start, uint32_t end)
 {
     struct pico_frame *f;
-    struct pico_tree_node *index, *temp;
+    struct pico_rb_node *index, *temp;
     uint16_t count = 0;
 
-    pico_tree_foreach_safe(index, &t->tcpq_out.pool, temp){
-        f = index->keyValue;
+    pico_rb_foreach_safe(index, &t->tcpq_out.pool, temp){
+        f = pico_rb_entry(index, struct pico_frame, tcp_node);
         if (tcp_sack_marker(f, start, end, &count) == 0)
             goto done;
     }
@@ -849,6 +899,7 @@ static inline void tcp_parse_option_mss(struct pico_socket_tcp *t, uint8_t len,
     t->mss_ok = 1;
     mss = short_from(opt + *idx);
     *idx += (uint32_t)sizeof(uint16_t);
+    t->mss_peer = short_be(mss);
     if (t->mss > short_be(mss))
         t->mss = short_be(mss);
 }
@@ -1058,13 +1109,14 @@ struct pico_socket *pico_tcp_open(uint16_t family)
     t->sock.timestamp = TCP_TIME;
     pico_socket_set_family(&t->sock, family);
     t->mss = (uint16_t)(pico_socket_get_mss(&t->sock) - PICO_SIZE_TCPHDR);
-    t->tcpq_in.pool.root = t->tcpq_hold.pool.root = t->tcpq_out.pool.root = &LEAF;
-    t->tcpq_hold.pool.compare = t->tcpq_out.pool.compare = segment_compare;
-    t->tcpq_in.pool.compare = input_segment_compare;
+    t->tcpq_in.input = 1;
     t->tcpq_in.max_size = PICO_DEFAULT_SOCKETQ;
     t->tcpq_out.max_size = PICO_DEFAULT_SOCKETQ;
     t->tcpq_hold.max_size = 2u * t->mss;
     rto_set(t, PICO_TCP_RTO_MIN);
+#ifdef PICO_SUPPORT_PMTU
+    t->plpmtu_next = TCP_TIME + PICO_TCP_PLPMTUD_INTERVAL;
+#endif
 
     /* Uncomment next line and disable Nagle by default */
     t->sock.opt_flags |= (1 << PICO_SOCKET_OPT_TCPNODELAY);
@@ -1754,8 +1806,23 @@ static int tcp_data_in(struct pico_socket *s, struct pico_frame *f)
 
 static int tcp_ack_advance_una(struct pico_socket_tcp *t, struct pico_frame *f, pico_time *timestamp)
 {
-    int ret =  release_all_until(&t->tcpq_out, ACKN(f), timestamp);
+    struct pico_rb_node *idx;
+    struct pico_frame *seg;
+    uint32_t acked = 0;
+    int ret;
+
+    /* Payload of the segments released below, the queue counts whole frames */
+    pico_rb_foreach(idx, &t->tcpq_out.pool) {
+        seg = segment_of(&t->tcpq_out, idx);
+        if (pico_seq_compare(SEQN(seg) + seg->payload_len, ACKN(f)) > 0)
+            break;
+
+        acked += seg->payload_len;
+    }
+
+    ret = release_all_until(&t->tcpq_out, ACKN(f), timestamp);
     if (ret > 0) {
+        t->bytes_acked += acked;
         t->sock.ev_pending |= PICO_SOCK_EV_WR;
     }
 
@@ -1855,6 +1922,8 @@ static int tcp_rto_xmit(struct pico_socket_tcp *t, struct pico_frame *f)
 
     if (pico_enqueue(&tcp_out, cpy) > 0) {
         t->snd_last_out = SEQN(cpy);
+        t->retrans++;
+        t->rto_events++;
         add_retransmission_timer(t, (t->rto << (++t->backoff)) + TCP_TIME);
         tcp_dbg("TCP_CWND, %lu, %u, %u, %u\n", TCP_TIME, t->cwnd, t->ssthresh, t->in_flight);
         tcp_dbg("Sending RTO!\n");
@@ -1871,6 +1940,7 @@ static void tcp_next_zerowindow_probe(struct pico_socket_tcp *t)
 {
     tcp_dbg("Sending probe!\n");
     tcp_send_probe(t);
+    t->zero_window_probes++;
     add_retransmission_timer(t, (t->rto << ++t->backoff) + TCP_TIME);
 }
 
@@ -1899,6 +1969,14 @@ static inline int tcp_retrans_timeout_check_queue(struct pico_socket_tcp *t)
         if (t->x_mode != PICO_TCP_BLACKOUT)
             tcp_first_timeout(t);
 
+#ifdef PICO_SUPPORT_PMTU
+        f = tcp_plpmtu_timeout(t, f);
+        if (!f) {
+            add_retransmission_timer(t, (t->rto << t->backoff) + TCP_TIME);
+            return -1;
+        }
+
+#endif
         tcp_add_header(t, f);
         if (tcp_rto_xmit(t, f) > 0) /* A segment has been rexmit'd */
             return -1;
@@ -1962,7 +2040,7 @@ static void tcp_retrans_timeout(pico_time val, void *sock)
 
 static void add_retransmission_timer(struct pico_socket_tcp *t, pico_time next_ts)
 {
-    struct pico_tree_node *index;
+    struct pico_rb_node *index;
     pico_time now = TCP_TIME;
     pico_time val = 0;
 
@@ -1970,8 +2048,8 @@ static void add_retransmission_timer(struct pico_socket_tcp *t, pico_time next_t
     if (next_ts == 0) {
         struct pico_frame *f;
 
-        pico_tree_foreach(index, &t->tcpq_out.pool){
-            f = index->keyValue;
+        pico_rb_foreach(index, &t->tcpq_out.pool){
+            f = pico_rb_entry(index, struct pico_frame, tcp_node);
             if ((next_ts == 0) || ((f->timestamp < next_ts) && (f->timestamp > 0))) {
                 next_ts = f->timestamp;
                 val = next_ts + (t->rto << t->backoff);
@@ -2012,6 +2090,7 @@ static int tcp_retrans(struct pico_socket_tcp *t, struct pico_frame *f)
 
         if (pico_enqueue(&tcp_out, cpy) > 0) {
             t->in_flight++;
+            t->retrans++;
             t->snd_last_out = SEQN(cpy);
         } else {
             pico_frame_discard(cpy);
@@ -2029,7 +2108,7 @@ static void tcp_ack_dbg(struct pico_socket *s, struct pico_frame *f)
 {
     uint32_t una, nxt, ack, cur;
     struct pico_frame *una_f = NULL, *cur_f;
-    struct pico_tree_node *idx;
+    struct pico_rb_node *idx;
     struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
     char info[64];
     char tmp[64];
@@ -2038,9 +2117,9 @@ static void tcp_ack_dbg(struct pico_socket *s, struct pico_frame *f)
     tcp_dbg("===================================\n");
     tcp_dbg("Queue out (%d/%d). ACKED=%08x\n", t->tcpq_out.size, t->tcpq_out.max_size, ack);
 
-    pico_tree_foreach(idx, &t->tcpq_out.pool) {
+    pico_rb_foreach(idx, &t->tcpq_out.pool) {
         info[0] = 0;
-        cur_f = idx->keyValue;
+        cur_f = pico_rb_entry(idx, struct pico_frame, tcp_node);
         cur = SEQN(cur_f);
         if (!una_f) {
             una_f = cur_f;
@@ -2153,6 +2232,11 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
         } else
             t->in_flight -= (acked);
 
+#ifdef PICO_SUPPORT_PMTU
+        if (acked > 0)
+            tcp_plpmtu_acked(t, ACKN(f));
+#endif
+
     } else if ((t->snd_old_ack == ACKN(f)) &&              /* We've just seen this ack, and... */
                ((0 == (hdr->flags & (PICO_TCP_PSH | PICO_TCP_SYN))) &&
                 (f->payload_len == 0)) &&              /* This is a pure ack, and... */
@@ -2164,6 +2248,7 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
             tcp_dbg("Mode: DUPACK %d, due to PURE ACK %0x, len = %d\n", t->x_mode, SEQN(f), f->payload_len);
             /* tcp_dbg("ACK: %x - QUEUE: %x\n", ACKN(f), SEQN(first_segment(&t->tcpq_out))); */
             if (t->x_mode == PICO_TCP_RECOVER) {              /* Switching mode */
+                t->recoveries++;
                 if (t->in_flight > PICO_TCP_IW)
                     t->cwnd = (uint16_t)t->in_flight;
                 else
@@ -2412,8 +2497,9 @@ static int tcp_syn(struct pico_socket *s, struct pico_frame *f)
     mtu = (uint16_t)pico_socket_get_mss(&new->sock);
     new->mss = (uint16_t)(mtu - PICO_SIZE_TCPHDR);
     tcp_parse_options(f);
-    new->tcpq_in.max_size = PICO_DEFAULT_SOCKETQ;
-    new->tcpq_out.max_size = PICO_DEFAULT_SOCKETQ;
+    /* Buffer sizes set on the listening socket carry over */
+    new->tcpq_in.max_size = ((struct pico_socket_tcp *)s)->tcpq_in.max_size;
+    new->tcpq_out.max_size = ((struct pico_socket_tcp *)s)->tcpq_out.max_size;
     new->tcpq_hold.max_size = 2u * mtu;
     new->rcv_nxt = long_be(hdr->seq) + 1;
     new->snd_nxt = long_be(pico_paws());
@@ -2427,6 +2513,12 @@ static int tcp_syn(struct pico_socket *s, struct pico_frame *f)
     new->sock.parent = s;
     new->sock.wakeup = s->wakeup;
     rto_set(new, PICO_TCP_RTO_MIN);
+#ifdef PICO_SUPPORT_PMTU
+    new->plpmtu_safe = 0;
+    new->plpmtu_high = 0;
+    new->plpmtu_sent = 0;
+    new->plpmtu_next = TCP_TIME + PICO_TCP_PLPMTUD_INTERVAL;
+#endif
     /* Initialize timestamp values */
     new->sock.state = PICO_SOCKET_STATE_BOUND | PICO_SOCKET_STATE_CONNECTED | PICO_SOCKET_STATE_TCP_SYN_RECV;
     pico_socket_add(&new->sock);
@@ -2877,6 +2969,12 @@ static struct pico_frame *tcp_split_segment(struct pico_socket_tcp *t, struct pi
     f2 = pico_socket_frame_alloc(&t->sock, get_sock_dev(&t->sock), (uint16_t) (size2 + overhead));
 
     if (!f1 || !f2) {
+        if (f1)
+            pico_frame_discard(f1);
+
+        if (f2)
+            pico_frame_discard(f2);
+
         pico_err = PICO_ERR_ENOMEM;
         return NULL;
     }
@@ -2907,11 +3005,20 @@ static struct pico_frame *tcp_split_segment(struct pico_socket_tcp *t, struct pi
     tcp_add_options_frame(t, f1);
     tcp_add_options_frame(t, f2);
 
+    f1->timestamp = f->timestamp;
+    f2->timestamp = f->timestamp;
+
     /* Get rid of the full frame */
     pico_discard_segment(&t->tcpq_out, f);
 
-    /* Enqueue f2 for later send... */
-    if (pico_enqueue_segment(&t->tcpq_out, f2) < 0) {
+    /* Both halves stay queued until acknowledged */
+    if (pico_enqueue_segment(&t->tcpq_out, f1) <= 0) {
+        tcp_dbg("Discarding invalid segment\n");
+        pico_frame_discard(f1);
+        f1 = NULL;
+    }
+
+    if (pico_enqueue_segment(&t->tcpq_out, f2) <= 0) {
         tcp_dbg("Discarding invalid segment\n");
         pico_frame_discard(f2);
     }
@@ -2920,6 +3027,142 @@ static struct pico_frame *tcp_split_segment(struct pico_socket_tcp *t, struct pi
     return f1;
 }
 
+#ifdef PICO_SUPPORT_PMTU
+/* MARK: path MTU */
+
+static uint32_t tcp_mss_to_mtu(struct pico_socket_tcp *t, uint16_t mss)
+{
+    uint32_t net = PICO_SIZE_IP4HDR;
+
+    if (t->sock.net && (t->sock.net->proto_number == PICO_PROTO_IPV6))
+        net = PICO_SIZE_IP6HDR;
+
+    return mss + PICO_SIZE_TCPHDR + net;
+}
+
+/* Largest mss the link and the peer take */
+static uint16_t tcp_mss_max(struct pico_socket_tcp *t)
+{
+    uint16_t mss = (uint16_t)(pico_socket_get_link_mss(&t->sock) - PICO_SIZE_TCPHDR);
+
+    if (t->mss_peer && (t->mss_peer < mss))
+        mss = t->mss_peer;
+
+    return mss;
+}
+
+/* Path MTU cache went down towards the peer (ICMP): send again what
+ * did not fit, RFC 1191 6.5 */
+void pico_tcp_pmtu_update(struct pico_socket *s)
+{
+    struct pico_socket_tcp *t = TCP_SOCK(s);
+    struct pico_frame *una;
+    uint16_t mss = (uint16_t)(pico_socket_get_mss(s) - PICO_SIZE_TCPHDR);
+
+    if (t->mss_peer && (t->mss_peer < mss))
+        mss = t->mss_peer;
+
+    if (mss >= t->mss)
+        return;
+
+    tcp_dbg("TCP> path MTU, mss %u -> %u\n", t->mss, mss);
+    t->mss = mss;
+    t->plpmtu_safe = 0;
+    t->plpmtu_sent = 0;
+    t->plpmtu_high = (uint16_t)(mss + 1u);
+    t->plpmtu_next = TCP_TIME + PICO_TCP_PLPMTUD_INTERVAL;
+
+    una = first_segment(&t->tcpq_out);
+    if (!tcp_is_allowed_to_send(t) || !una || (una->payload_len <= mss))
+        return;
+
+    /* Everything after it was as large, go back to it */
+    t->snd_nxt = SEQN(una);
+    t->in_flight = 0;
+    pico_tcp_output(s, (int)t->cwnd);
+}
+
+/* Try a larger mss, halfway to the smallest size known to fail. The
+ * probe is the first data segment sent at that size. */
+static void tcp_plpmtu_probe(struct pico_socket_tcp *t)
+{
+    uint16_t high;
+
+    if (t->plpmtu_safe || (TCP_TIME < t->plpmtu_next))
+        return;
+
+    high = tcp_mss_max(t);
+    if (t->plpmtu_high && (t->plpmtu_high <= high))
+        high = (uint16_t)(t->plpmtu_high - 1u);
+
+    if ((uint32_t)(t->mss + PICO_TCP_PLPMTUD_STEP) > high) {
+        /* Search over, start again from the top later on */
+        t->plpmtu_high = 0;
+        t->plpmtu_next = TCP_TIME + PICO_TCP_PLPMTUD_INTERVAL;
+        return;
+    }
+
+    t->plpmtu_safe = t->mss;
+    t->plpmtu_sent = 0;
+    t->mss = (uint16_t)(t->mss + ((high - t->mss + 1u) >> 1));
+    tcp_dbg("TCP> PLPMTUD probing mss %u\n", t->mss);
+}
+
+static void tcp_plpmtu_sent(struct pico_socket_tcp *t, struct pico_frame *f)
+{
+    if (t->plpmtu_safe && !t->plpmtu_sent && (f->payload_len > t->plpmtu_safe)) {
+        t->plpmtu_sent = 1;
+        t->plpmtu_seq = SEQN(f) + f->payload_len;
+    }
+}
+
+static void tcp_plpmtu_acked(struct pico_socket_tcp *t, uint32_t ack)
+{
+    if (!t->plpmtu_sent || (pico_seq_compare(ack, t->plpmtu_seq) < 0))
+        return;
+
+    /* Probe went through, go on searching */
+    t->plpmtu_safe = 0;
+    t->plpmtu_sent = 0;
+    t->plpmtu_next = TCP_TIME;
+    pico_pmtu_raise(t->sock.net->proto_number, &t->sock.remote_addr, tcp_mss_to_mtu(t, t->mss));
+}
+
+/* Retransmission timeout on f, the first unacknowledged segment */
+static struct pico_frame *tcp_plpmtu_timeout(struct pico_socket_tcp *t, struct pico_frame *f)
+{
+    uint16_t base;
+
+    if (t->plpmtu_sent && (f->payload_len > t->plpmtu_safe)) {
+        /* The probe was lost */
+        t->plpmtu_high = t->mss;
+        t->mss = t->plpmtu_safe;
+        t->plpmtu_safe = 0;
+        t->plpmtu_sent = 0;
+        t->plpmtu_next = TCP_TIME;
+    } else if (!t->plpmtu_safe && (t->backoff >= PICO_TCP_PLPMTUD_BH_RETRIES)) {
+        /* No answer and no ICMP either: black hole, RFC 4821 7.7 */
+        base = (uint16_t)(PICO_TCP_PLPMTUD_BASE - (tcp_mss_to_mtu(t, 0)));
+        if (f->payload_len <= base)
+            return f;
+
+        t->plpmtu_high = (uint16_t)(f->payload_len);
+        if (t->mss > base)
+            t->mss = base;
+
+        t->plpmtu_next = TCP_TIME;
+        pico_pmtu_lower(t->sock.net->proto_number, &t->sock.remote_addr, PICO_TCP_PLPMTUD_BASE);
+    } else {
+        return f;
+    }
+
+    if (f->payload_len <= t->mss)
+        return f;
+
+    return tcp_split_segment(t, f, t->mss);
+}
+#endif
+
 
 int pico_tcp_output(struct pico_socket *s, int loop_score)
 {
@@ -2929,6 +3172,9 @@ int pico_tcp_output(struct pico_socket *s, int loop_score)
     int data_sent = 0;
     int32_t seq_diff = 0;
 
+#ifdef PICO_SUPPORT_PMTU
+    tcp_plpmtu_probe(t);
+#endif
     una = first_segment(&t->tcpq_out);
     f = peek_segment(&t->tcpq_out, t->snd_nxt);
 
@@ -2967,6 +3213,19 @@ int pico_tcp_output(struct pico_socket *s, int loop_score)
                 t->cwnd = 1;
         }
 
+#ifdef PICO_SUPPORT_PMTU
+        /* Queued before the path MTU went down */
+        if (f->payload_len > t->mss) {
+            f = tcp_split_segment(t, f, t->mss);
+            if (!f)
+                break;
+
+            if (una && (pico_seq_compare(SEQN(f), SEQN(una)) <= 0))
+                una = f;
+        }
+
+        tcp_plpmtu_sent(t, f);
+#endif
         tcp_dbg("TCP> DEQUEUED (for output) frame %08x, acks %08x len= %d, remaining frames %d\n", SEQN(f), ACKN(f), f->payload_len, t->tcpq_out.frames);
         tcp_send(t, f);
         sent++;
@@ -3113,8 +3372,10 @@ static int pico_tcp_push_nagle_hold(struct pico_socket_tcp *t, struct pico_frame
 
 static int pico_tcp_push_nagle_on(struct pico_socket_tcp *t, struct pico_frame *f)
 {
-    /* Nagle's algorithm enabled, check if ready to send, or put frame in hold queue */
-    if (IS_TCP_IDLE(t) && IS_TCP_HOLDQ_EMPTY(t))
+    /* Nagle's algorithm enabled, check if ready to send, or put frame in hold queue.
+     * A full sized segment has nothing to wait for. */
+    if (IS_TCP_HOLDQ_EMPTY(t) &&
+        (IS_TCP_IDLE(t) || (f->payload_len >= (uint16_t)(t->mss + PICO_SIZE_TCPHDR - pico_tcp_overhead(&t->sock)))))
         return pico_tcp_push_nagle_enqueue(t, f);
 
     return pico_tcp_push_nagle_hold(t, f);
@@ -3158,15 +3419,13 @@ int pico_tcp_push(struct pico_protocol *self, struct pico_frame *f)
 
 inline static void tcp_discard_all_segments(struct pico_tcp_queue *tq)
 {
-    struct pico_tree_node *index = NULL, *index_safe = NULL;
+    struct pico_rb_node *index = NULL, *index_safe = NULL;
     PICOTCP_MUTEX_LOCK(Mutex);
-    pico_tree_foreach_safe(index, &tq->pool, index_safe)
+    pico_rb_foreach_safe(index, &tq->pool, index_safe)
     {
-        void *f = index->keyValue;
-        if(!f)
-            break;
+        void *f = segment_of(tq, index);
 
-        pico_tree_delete(&tq->pool, f);
+        pico_rb_erase(&tq->pool, index);
         if(IS_INPUT_QUEUE(tq))
         {
             struct tcp_input_segment *inp = (struct tcp_input_segment *)f;
@@ -3311,4 +3570,51 @@ int pico_tcp_set_linger(struct pico_socket *s, uint32_t value)
     return 0;
 }
 
+int pico_tcp_get_info(struct pico_socket *s, struct pico_tcp_info *info)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
+
+    if (!s || !info || (s->proto != &pico_proto_tcp)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    memset(info, 0, sizeof(*info));
+    info->state = (uint16_t)(s->state & PICO_SOCKET_STATE_TCP);
+    info->local_port = short_be(s->local_port);
+    info->remote_port = short_be(s->remote_port);
+    info->net = s->net ? s->net->proto_number : 0;
+    info->local_addr = s->local_addr;
+    info->remote_addr = s->remote_addr;
+
+    info->srtt = t->avg_rtt;
+    info->rttvar = t->rttvar;
+    info->rto = t->rto;
+    info->cwnd = t->cwnd;
+    info->ssthresh = t->ssthresh;
+    info->in_flight = t->in_flight;
+    info->x_mode = t->x_mode;
+    info->backoff = t->backoff;
+    info->sack_ok = t->sack_ok;
+    info->ts_ok = t->ts_ok;
+    info->mss = t->mss;
+    info->mss_peer = t->mss_peer;
+    info->snd_wnd = (uint32_t)t->recv_wnd << t->recv_wnd_scale;
+    info->rcv_wnd = (uint32_t)t->wnd << t->wnd_scale;
+
+    info->out_queued = t->tcpq_out.size;
+    info->out_frames = t->tcpq_out.frames;
+    info->out_max = t->tcpq_out.max_size;
+    info->in_queued = t->tcpq_in.size;
+    info->in_max = t->tcpq_in.max_size;
+    info->hold_queued = t->tcpq_hold.size;
+
+    info->bytes_acked = t->bytes_acked;
+    info->retrans = t->retrans;
+    info->rto_events = t->rto_events;
+    info->recoveries = t->recoveries;
+    info->zero_window_probes = t->zero_window_probes;
+    return 0;
+}
+
 #endif /* PICO_SUPPORT_TCP */
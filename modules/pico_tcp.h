@@ -70,6 +70,57 @@ PACKED_STRUCT_DEF tcp_pseudo_hdr_ipv4
 #define PICO_TCP_RSTACK    (PICO_TCP_RST | PICO_TCP_ACK)
 
 
+/* Transmission modes (x_mode) */
+#define PICO_TCP_LOOKAHEAD      0x00
+#define PICO_TCP_FIRST_DUPACK   0x01
+#define PICO_TCP_SECOND_DUPACK  0x02
+#define PICO_TCP_RECOVER        0x03
+#define PICO_TCP_BLACKOUT       0x04
+#define PICO_TCP_UNREACHABLE    0x05
+#define PICO_TCP_WINDOW_FULL    0x06
+
+/* State of a connection, see pico_tcp_get_info(). Times are in ms, windows
+ * and queues in bytes, cwnd and ssthresh in segments. */
+struct pico_tcp_info {
+    uint16_t state;             /* PICO_SOCKET_STATE_TCP_* */
+    uint16_t local_port;        /* host byte order */
+    uint16_t remote_port;
+    uint16_t net;               /* PICO_PROTO_IPV4 or PICO_PROTO_IPV6 */
+    union pico_address local_addr;
+    union pico_address remote_addr;
+
+    /* Congestion control */
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rto;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t in_flight;         /* segments */
+    uint8_t x_mode;             /* PICO_TCP_LOOKAHEAD, ... */
+    uint8_t backoff;
+    uint8_t sack_ok;
+    uint8_t ts_ok;
+    uint16_t mss;
+    uint16_t mss_peer;
+    uint32_t snd_wnd;           /* last window of the peer, scaled */
+    uint32_t rcv_wnd;
+
+    /* Queues */
+    uint32_t out_queued;
+    uint32_t out_frames;
+    uint32_t out_max;
+    uint32_t in_queued;
+    uint32_t in_max;
+    uint32_t hold_queued;       /* held back by Nagle */
+
+    /* Since the connection was opened */
+    uint64_t bytes_acked;
+    uint32_t retrans;           /* segments sent again, for any reason */
+    uint32_t rto_events;        /* retransmissions on timeout */
+    uint32_t recoveries;        /* fast recoveries entered on dupacks */
+    uint32_t zero_window_probes;
+};
+
 PACKED_STRUCT_DEF pico_tcp_option
 {
     uint8_t kind;
@@ -101,6 +152,8 @@ int pico_tcp_set_keepalive_intvl(struct pico_socket *s, uint32_t value);
 int pico_tcp_set_keepalive_time(struct pico_socket *s, uint32_t value);
 int pico_tcp_set_linger(struct pico_socket *s, uint32_t value);
 uint16_t pico_tcp_get_socket_mss(struct pico_socket *s);
+void pico_tcp_pmtu_update(struct pico_socket *s);
 int pico_tcp_check_listen_close(struct pico_socket *s);
+int pico_tcp_get_info(struct pico_socket *s, struct pico_tcp_info *info);
 
 #endif
@@ -35,8 +35,13 @@
 
 #define AUTOMA_STATES (TFTP_STATE_CLOSING + 1)
 
-/* MAX_OPTIONS_SIZE: "timeout" 255 "tsize" filesize =>  8 + 4 + 6 + 11 */
-#define MAX_OPTIONS_SIZE 29
+/* MAX_OPTIONS_SIZE: "timeout" 255 "tsize" filesize "blksize" 65464
+ * "windowsize" 65535 =>  8 + 4 + 6 + 11 + 8 + 6 + 11 + 6 */
+#define MAX_OPTIONS_SIZE 60
+
+/* RFC 2348 and RFC 7440 ranges */
+#define TFTP_BLKSIZE_MAX     65464U
+#define TFTP_WINDOWSIZE_MAX  65535U
 
 /* RRQ and WRQ packets (opcodes 1 and 2 respectively) */
 PACKED_STRUCT_DEF pico_tftp_hdr
@@ -59,6 +64,7 @@ PACKED_STRUCT_DEF pico_tftp_err_hdr
 };
 
 #define PICO_TFTP_TOTAL_BLOCK_SIZE (PICO_TFTP_PAYLOAD_SIZE + (int32_t)sizeof(struct pico_tftp_data_hdr))
+#define PICO_TFTP_MAX_BLOCK_SIZE (PICO_TFTP_MAX_BLKSIZE + (int32_t)sizeof(struct pico_tftp_data_hdr))
 #define tftp_payload(p) (((uint8_t *)(p)) + sizeof(struct pico_tftp_data_hdr))
 
 /* STATUS FLAGS */
@@ -88,7 +94,14 @@ struct pico_tftp_session {
     int32_t file_size;
     int32_t len;
     uint8_t option_timeout;
-    uint8_t tftp_block[PICO_TFTP_TOTAL_BLOCK_SIZE];
+    uint16_t option_blksize;
+    uint16_t option_windowsize;
+    /* TX: oldest block not acked yet, RX: last block acked */
+    uint16_t window_base;
+    /* TX with windowsize > 1: copy of the blocks in flight, for retransmission */
+    uint16_t *window_len;
+    uint8_t *window;
+    uint8_t tftp_block[PICO_TFTP_MAX_BLOCK_SIZE];
     int32_t block_len;
 };
 
@@ -154,7 +167,9 @@ static int extract_value(char *str, uint32_t *value, uint32_t max)
     return 0;
 }
 
-static int parse_optional_arguments(char *option_string, int32_t len, int *options, uint8_t *timeout, int32_t *filesize)
+/* blksize and windowsize are only parsed when the caller wants them */
+static int parse_optional_arguments(char *option_string, int32_t len, int *options, uint8_t *timeout, int32_t *filesize,
+                                    uint16_t *blksize, uint16_t *windowsize)
 {
     char *pos;
     char *end_args = option_string + len;
@@ -187,12 +202,48 @@ static int parse_optional_arguments(char *option_string, int32_t len, int *optio
                     return -1;
 
                 *options |= PICO_TFTP_OPTION_FILE;
+            } else if (blksize && !pico_strncasecmp("blksize", current_option, (size_t)(pos - current_option))) {
+                ret = extract_value(pos, &value, TFTP_BLKSIZE_MAX);
+                if (ret || value < PICO_TFTP_MIN_BLKSIZE)
+                    return -1;
+
+                *blksize = (uint16_t)value;
+                *options |= PICO_TFTP_OPTION_BLKSIZE;
+            } else if (windowsize && !pico_strncasecmp("windowsize", current_option, (size_t)(pos - current_option))) {
+                ret = extract_value(pos, &value, TFTP_WINDOWSIZE_MAX);
+                if (ret || value < 1)
+                    return -1;
+
+                *windowsize = (uint16_t)value;
+                *options |= PICO_TFTP_OPTION_WINDOWSIZE;
             }
         }
     }
     return 0;
 }
 
+static inline int32_t tftp_blksize(struct pico_tftp_session *session)
+{
+    if (session->options & PICO_TFTP_OPTION_BLKSIZE)
+        return session->option_blksize;
+
+    return PICO_TFTP_PAYLOAD_SIZE;
+}
+
+static inline uint16_t tftp_windowsize(struct pico_tftp_session *session)
+{
+    if (session->options & PICO_TFTP_OPTION_WINDOWSIZE)
+        return session->option_windowsize;
+
+    return 1;
+}
+
+/* Blocks sent and not acked yet */
+static inline uint16_t tftp_in_flight(struct pico_tftp_session *session)
+{
+    return (uint16_t)(session->packet_counter - session->window_base);
+}
+
 static inline struct pico_tftp_session *pico_tftp_session_create(struct pico_socket *sock, union pico_address *remote_addr)
 {
     struct pico_tftp_session *session;
@@ -276,6 +327,9 @@ static int del_session(struct pico_tftp_session *idx)
             else
                 prev->next = pos->next;
 
+            if (idx->window_len)
+                PICO_FREE(idx->window_len);
+
             PICO_FREE(idx);
             return 0;
         }
@@ -362,6 +416,7 @@ static void tftp_send_ack(struct pico_tftp_session *session)
 
     dh->opcode = short_be(PICO_TFTP_ACK);
     dh->block = short_be(session->packet_counter);
+    session->window_base = session->packet_counter;
 
     if (session->socket) {
         pico_socket_sendto(session->socket, dh, (int) sizeof(struct pico_tftp_err_hdr),
@@ -397,6 +452,26 @@ static size_t prepare_options_string(struct pico_tftp_session *session, char *st
         len += (size_t)res;
     }
 
+    if (session->options & PICO_TFTP_OPTION_BLKSIZE) {
+        strcpy(&str_options[len], "blksize");
+        len += 8;
+        res = num2string(session->option_blksize, &str_options[len], 6);
+        if (res < 0)
+            return 0;
+
+        len += (size_t)res;
+    }
+
+    if (session->options & PICO_TFTP_OPTION_WINDOWSIZE) {
+        strcpy(&str_options[len], "windowsize");
+        len += 11;
+        res = num2string(session->option_windowsize, &str_options[len], 6);
+        if (res < 0)
+            return 0;
+
+        len += (size_t)res;
+    }
+
     return len;
 }
 
@@ -540,28 +615,99 @@ static void tftp_send_error(struct pico_tftp_session *session, union pico_addres
         (void)pico_socket_sendto(server.listen_socket, eh, (int) (len + (int32_t)sizeof(struct pico_tftp_err_hdr)), a, port);
 }
 
+static inline uint8_t *tftp_window_slot(struct pico_tftp_session *session, uint16_t block)
+{
+    size_t slot_size = (size_t)tftp_blksize(session) + sizeof(struct pico_tftp_data_hdr);
+
+    return session->window + (size_t)(block % tftp_windowsize(session)) * slot_size;
+}
+
+/* One allocation: the packet lengths, then one block sized slot per window position */
+static int tftp_window_alloc(struct pico_tftp_session *session)
+{
+    uint16_t ws = tftp_windowsize(session);
+    size_t slot_size = (size_t)tftp_blksize(session) + sizeof(struct pico_tftp_data_hdr);
+
+    session->window_len = PICO_ZALLOC(ws * (sizeof(uint16_t) + slot_size));
+    if (!session->window_len)
+        return -1;
+
+    session->window = (uint8_t *)(session->window_len + ws);
+    return 0;
+}
+
+/* Send again every block not acked yet, oldest first */
+static void tftp_resend_window(struct pico_tftp_session *session)
+{
+    uint16_t block;
+
+    for (block = session->window_base; block != session->packet_counter; block++)
+        pico_socket_sendto(session->socket, tftp_window_slot(session, block), session->window_len[block % tftp_windowsize(session)],
+                           &session->remote_address, session->remote_port);
+    tftp_schedule_timeout(session, PICO_TFTP_TIMEOUT);
+}
+
 static void tftp_send_data(struct pico_tftp_session *session, const uint8_t *data, int32_t len)
 {
     struct pico_tftp_data_hdr *dh;
 
+    if ((tftp_windowsize(session) > 1) && !session->window && tftp_window_alloc(session)) {
+        strcpy((char *)session->tftp_block, "Out of memory");
+        do_callback(session, PICO_TFTP_EV_ERR_LOCAL, session->tftp_block, 0);
+        tftp_finish(session);
+        return;
+    }
+
     dh = (struct pico_tftp_data_hdr *) session->tftp_block;
     dh->opcode = short_be(PICO_TFTP_DATA);
-    dh->block = short_be(session->packet_counter++);
+    dh->block = short_be(session->packet_counter);
 
-    if (len < PICO_TFTP_PAYLOAD_SIZE)
+    if (len < tftp_blksize(session))
         session->state = TFTP_STATE_WAIT_LAST_ACK;
     else
         session->state = TFTP_STATE_TX;
 
     memcpy(session->tftp_block + sizeof(struct pico_tftp_data_hdr), data, (size_t)len);
-    pico_socket_sendto(session->socket, session->tftp_block, (int)(len + (int32_t)sizeof(struct pico_tftp_data_hdr)),
+    session->len = len + (int32_t)sizeof(struct pico_tftp_data_hdr);
+    if (session->window) {
+        memcpy(tftp_window_slot(session, session->packet_counter), session->tftp_block, (size_t)session->len);
+        session->window_len[session->packet_counter % tftp_windowsize(session)] = (uint16_t)session->len;
+    }
+
+    session->packet_counter++;
+    pico_socket_sendto(session->socket, session->tftp_block, session->len,
                        &session->remote_address, session->remote_port);
     tftp_schedule_timeout(session, PICO_TFTP_TIMEOUT);
 }
 
+/* Ask the application for blocks until the window is full or it stops sending */
+static void tftp_fill_window(struct pico_tftp_session *session, uint16_t event, int32_t len)
+{
+    uint16_t counter;
+
+    do {
+        counter = session->packet_counter;
+        do_callback(session, event, session->tftp_block, len);
+        event = PICO_TFTP_EV_OK;
+        len = 0;
+    } while ((session->state == TFTP_STATE_TX) && (session->packet_counter != counter) &&
+             (tftp_in_flight(session) < tftp_windowsize(session)));
+}
+
+/* RX: ack the last block, and every windowsize blocks otherwise */
+static void tftp_rx_ack(struct pico_tftp_session *session, int32_t payload_len)
+{
+    if ((payload_len < tftp_blksize(session)) ||
+        ((uint16_t)(session->packet_counter - session->window_base) >= tftp_windowsize(session)))
+        tftp_send_ack(session);
+    else
+        tftp_schedule_timeout(session, PICO_TFTP_TIMEOUT);
+}
+
+/* len is the payload length */
 static inline void tftp_eval_finish(struct pico_tftp_session *session, int32_t len)
 {
-    if (len < PICO_TFTP_PAYLOAD_SIZE) {
+    if (len < tftp_blksize(session)) {
         pico_socket_close(session->socket);
         session->state = TFTP_STATE_CLOSING;
     }
@@ -622,10 +768,12 @@ static void tftp_req(uint8_t *block, int32_t len, union pico_address *a, uint16_
     }
 }
 
+/* Returns the number of blocks newly acked, 0 for a duplicate or late ACK */
 static int event_ack_base(struct pico_tftp_session *session, int32_t len, union pico_address *a, uint16_t port)
 {
     struct pico_tftp_data_hdr *dh;
     uint16_t block_n;
+    uint16_t ahead;
     const char *wrong_address = "Wrong address";
     const char *wrong_block = "Wrong packet number";
 
@@ -639,14 +787,20 @@ static int event_ack_base(struct pico_tftp_session *session, int32_t len, union
 
     dh = (struct pico_tftp_data_hdr *)session->tftp_block;
     block_n = short_be(dh->block);
-    if (block_n != (session->packet_counter - 1U)) {
+    ahead = (uint16_t)(block_n - session->window_base);
+    if (ahead >= 0x8000U)
+        return 0;
+
+    if (ahead >= tftp_in_flight(session)) {
         strcpy((char *)session->tftp_block, wrong_block);
         do_callback(session, PICO_TFTP_EV_ERR_PEER, session->tftp_block, len);
         tftp_send_error(session, a, port, TFTP_ERR_EILL, wrong_block);
         return -1;
     }
 
-    return 0;
+    session->window_base = (uint16_t)(block_n + 1U);
+    session->retry = 0;
+    return ahead + 1;
 }
 
 static inline int event_ack0_check(struct pico_tftp_session *session, int32_t len, union pico_address *a, uint16_t port)
@@ -674,25 +828,38 @@ static void event_ack0_wr(struct pico_tftp_session *session, int32_t len, union
 {
     if (!event_ack0_check(session, len, a, port)) {
         session->remote_port = port;
-        do_callback(session, PICO_TFTP_EV_OK, session->tftp_block, 0);
+        /* no OACK: the server ignored the options */
+        session->options &= ~(PICO_TFTP_OPTION_BLKSIZE | PICO_TFTP_OPTION_WINDOWSIZE);
+        tftp_fill_window(session, PICO_TFTP_EV_OK, 0);
     }
 }
 
 static void event_ack0_woc(struct pico_tftp_session *session, int32_t len, union pico_address *a, uint16_t port)
 {
     if (!event_ack0_check(session, len, a, port))
-        do_callback(session, PICO_TFTP_EV_OPT, session->tftp_block, 0);
+        tftp_fill_window(session, PICO_TFTP_EV_OPT, 0);
 }
 
 static void event_ack(struct pico_tftp_session *session, int32_t len, union pico_address *a, uint16_t port)
 {
-    if (!event_ack_base(session, len, a, port))
-        do_callback(session, PICO_TFTP_EV_OK, session->tftp_block, 0);
+    if (event_ack_base(session, len, a, port) <= 0)
+        return;
+
+    /* Partial ACK: the receiver dropped the blocks after a gap, roll back to it */
+    if (tftp_in_flight(session))
+        tftp_resend_window(session);
+
+    tftp_fill_window(session, PICO_TFTP_EV_OK, 0);
 }
 
 static void event_ack_last(struct pico_tftp_session *session, int32_t len, union pico_address *a, uint16_t port)
 {
-    if (!event_ack_base(session, len, a, port))
+    if (event_ack_base(session, len, a, port) <= 0)
+        return;
+
+    if (tftp_in_flight(session))
+        tftp_resend_window(session);
+    else
         tftp_finish(session);
 }
 
@@ -700,28 +867,41 @@ static void event_data(struct pico_tftp_session *session, int32_t len, union pic
 {
     struct pico_tftp_data_hdr *dh;
     int32_t payload_len = len - (int32_t)sizeof(struct pico_tftp_data_hdr);
+    uint16_t distance;
 
     if (tftp_data_prepare(session, a, port))
         return;
 
     dh = (struct pico_tftp_data_hdr *)session->tftp_block;
-    if (short_be(dh->block) > (session->packet_counter +  1U)) {
-        strcpy((char *)session->tftp_block, "Wrong/unexpected sequence number");
-        do_callback(session, PICO_TFTP_EV_ERR_LOCAL, session->tftp_block, 0);
-        tftp_send_error(session, a, port, TFTP_ERR_EILL, "TFTP connection broken!");
-        return;
-    }
-
-    if (short_be(dh->block) == (session->packet_counter + 1U)) {
+    distance = (uint16_t)(short_be(dh->block) - session->packet_counter);
+    if (distance == 1) {
         session->packet_counter++;
+        session->retry = 0;
         if (do_callback(session, PICO_TFTP_EV_OK, tftp_payload(session->tftp_block), payload_len) >= 0) {
             if (!(session->status & SESSION_STATUS_APP_ACK))
-                tftp_send_ack(session);
+                tftp_rx_ack(session, payload_len);
         }
 
         if (!(session->status & SESSION_STATUS_APP_ACK))
-            tftp_eval_finish(session, len);
+            tftp_eval_finish(session, payload_len);
+
+        return;
     }
+
+    if (tftp_windowsize(session) == 1) {
+        if (short_be(dh->block) > (session->packet_counter +  1U)) {
+            strcpy((char *)session->tftp_block, "Wrong/unexpected sequence number");
+            do_callback(session, PICO_TFTP_EV_ERR_LOCAL, session->tftp_block, 0);
+            tftp_send_error(session, a, port, TFTP_ERR_EILL, "TFTP connection broken!");
+        }
+
+        return;
+    }
+
+    /* RFC 7440: blocks after a gap are dropped and the last one in order is acked,
+     * once. A repeated last block means that ACK was lost. */
+    if ((distance == 0) || ((distance <= tftp_windowsize(session)) && (session->window_base != session->packet_counter)))
+        tftp_send_ack(session);
 }
 
 static void event_data_rdr(struct pico_tftp_session *session, int32_t len, union pico_address *a, uint16_t port)
@@ -731,6 +911,8 @@ static void event_data_rdr(struct pico_tftp_session *session, int32_t len, union
 
     session->remote_port = port;
     session->state = TFTP_STATE_RX;
+    /* no OACK: the server ignored the options */
+    session->options &= ~(PICO_TFTP_OPTION_BLKSIZE | PICO_TFTP_OPTION_WINDOWSIZE);
     event_data(session, len, a, port);
 }
 
@@ -756,37 +938,58 @@ static void event_err(struct pico_tftp_session *session, int32_t len, union pico
     tftp_finish(session);
 }
 
-static inline void event_oack(struct pico_tftp_session *session, int32_t len, union pico_address *a, uint16_t port)
+static inline int event_oack(struct pico_tftp_session *session, int32_t len, union pico_address *a, uint16_t port)
 {
     char *option_string = (char *)session->tftp_block + sizeof(struct pico_tftp_hdr);
     int ret;
     int proposed_options = session->options;
+    int options = 0;
+    uint16_t blksize = 0;
+    uint16_t windowsize = 0;
 
     (void)a;
 
     session->remote_port = port;
 
-    ret = parse_optional_arguments(option_string, len - (int32_t)sizeof(struct pico_tftp_hdr), &session->options, &session->option_timeout, &session->file_size);
-    if (ret || (session->options & ~proposed_options)) {
+    ret = parse_optional_arguments(option_string, len - (int32_t)sizeof(struct pico_tftp_hdr), &options, &session->option_timeout,
+                                   &session->file_size, &blksize, &windowsize);
+    /* The server may only lower blksize and windowsize */
+    if (ret || (options & ~proposed_options) ||
+        ((options & PICO_TFTP_OPTION_BLKSIZE) && (blksize > session->option_blksize)) ||
+        ((options & PICO_TFTP_OPTION_WINDOWSIZE) && (windowsize > session->option_windowsize))) {
         do_callback(session, PICO_TFTP_EV_ERR_PEER, session->tftp_block, len);
         tftp_send_error(session, a, port, TFTP_ERR_EOPT, "Invalid option");
-        return;
+        return -1;
     }
 
-    do_callback(session, PICO_TFTP_EV_OPT, session->tftp_block, len);
+    /* left out of the OACK: refused */
+    session->options = (proposed_options & ~(PICO_TFTP_OPTION_BLKSIZE | PICO_TFTP_OPTION_WINDOWSIZE)) | options;
+    if (options & PICO_TFTP_OPTION_BLKSIZE)
+        session->option_blksize = blksize;
+
+    if (options & PICO_TFTP_OPTION_WINDOWSIZE)
+        session->option_windowsize = windowsize;
+
+    return 0;
 }
 
 static void event_oack_rr(struct pico_tftp_session *session, int32_t len, union pico_address *a, uint16_t port)
 {
-    event_oack(session, len, a, port);
+    if (event_oack(session, len, a, port))
+        return;
+
+    do_callback(session, PICO_TFTP_EV_OPT, session->tftp_block, len);
     tftp_send_ack(session);
     session->state = TFTP_STATE_RX;
 }
 
 static void event_oack_wr(struct pico_tftp_session *session, int32_t len, union pico_address *a, uint16_t port)
 {
-    event_oack(session, len, a, port);
+    if (event_oack(session, len, a, port))
+        return;
+
     session->state = TFTP_STATE_TX;
+    tftp_fill_window(session, PICO_TFTP_EV_OPT, len);
 }
 
 static void event_timeout(struct pico_tftp_session *session, pico_time t)
@@ -802,7 +1005,13 @@ static void event_timeout(struct pico_tftp_session *session, pico_time t)
         return;
     }
 
-    tftp_send(session, 0);
+    if (session->state == TFTP_STATE_RX)
+        tftp_send_ack(session);
+    else if (session->window)
+        tftp_resend_window(session);
+    else
+        tftp_send(session, 0);
+
     if (session->options & PICO_TFTP_OPTION_TIME)
         new_timeout = session->option_timeout * 1000U;
     else {
@@ -902,7 +1111,7 @@ static void tftp_cb(uint16_t ev, struct pico_socket *s)
             return;
         }
 
-        r = pico_socket_recvfrom(s, session->tftp_block, PICO_TFTP_TOTAL_BLOCK_SIZE, &ep, &port);
+        r = pico_socket_recvfrom(s, session->tftp_block, PICO_TFTP_MAX_BLOCK_SIZE, &ep, &port);
         if (r < (int)sizeof(struct pico_tftp_hdr))
             return;
 
@@ -1053,6 +1262,24 @@ int pico_tftp_get_option(struct pico_tftp_session *session, uint8_t type, int32_
             return -1;
         }
 
+        break;
+    case PICO_TFTP_OPTION_BLKSIZE:
+        if (session->options & PICO_TFTP_OPTION_BLKSIZE)
+            *value = session->option_blksize;
+        else {
+            pico_err = PICO_ERR_ENOENT;
+            return -1;
+        }
+
+        break;
+    case PICO_TFTP_OPTION_WINDOWSIZE:
+        if (session->options & PICO_TFTP_OPTION_WINDOWSIZE)
+            *value = session->option_windowsize;
+        else {
+            pico_err = PICO_ERR_ENOENT;
+            return -1;
+        }
+
         break;
     default:
         pico_err = PICO_ERR_EINVAL;
@@ -1092,6 +1319,30 @@ int pico_tftp_set_option(struct pico_tftp_session *session, uint8_t type, int32_
             session->options &= ~PICO_TFTP_OPTION_TIME;
         }
 
+        break;
+    case PICO_TFTP_OPTION_BLKSIZE:
+        if (value < PICO_TFTP_MIN_BLKSIZE) {
+            pico_err = PICO_ERR_EINVAL;
+            return -1;
+        }
+
+        if (value > PICO_TFTP_MAX_BLKSIZE)
+            value = PICO_TFTP_MAX_BLKSIZE;
+
+        session->option_blksize = (uint16_t)value;
+        session->options |= PICO_TFTP_OPTION_BLKSIZE;
+        break;
+    case PICO_TFTP_OPTION_WINDOWSIZE:
+        if (value < 1) {
+            pico_err = PICO_ERR_EINVAL;
+            return -1;
+        }
+
+        if (value > PICO_TFTP_MAX_WINDOWSIZE)
+            value = PICO_TFTP_MAX_WINDOWSIZE;
+
+        session->option_windowsize = (uint16_t)value;
+        session->options |= PICO_TFTP_OPTION_WINDOWSIZE;
         break;
     default:
         pico_err = PICO_ERR_EINVAL;
@@ -1117,7 +1368,7 @@ int pico_tftp_start_rx(struct pico_tftp_session *session, uint16_t port, const c
     if (port != short_be(PICO_TFTP_PORT)) {
         session->remote_port = port;
         session->state = TFTP_STATE_RX;
-        if (session->options & (PICO_TFTP_OPTION_FILE | PICO_TFTP_OPTION_TIME))
+        if (session->options)
             tftp_send_oack(session);
         else
             tftp_send_ack(session);
@@ -1136,6 +1387,7 @@ int pico_tftp_start_tx(struct pico_tftp_session *session, uint16_t port, const c
 
     session->callback = user_cb;
     session->packet_counter = 1u;
+    session->window_base = 1u;
     session->argument = arg;
 
     add_session(session);
@@ -1171,11 +1423,16 @@ int32_t pico_tftp_send(struct pico_tftp_session *session, const uint8_t *data, i
 
     size = len;
 
-    if (size > PICO_TFTP_PAYLOAD_SIZE) {
+    if (size > tftp_blksize(session)) {
         pico_err = PICO_ERR_EINVAL;
         return -1;
     }
 
+    if (session->window && (tftp_in_flight(session) >= tftp_windowsize(session))) {
+        pico_err = PICO_ERR_EAGAIN;
+        return -1;
+    }
+
     tftp_send_data(session, data, size);
 
     return len;
@@ -1207,7 +1464,27 @@ int pico_tftp_parse_request_args(char *args, int32_t len, int *options, uint8_t
 
     args = extract_arg_pointer(args, end_args, &pos);
 
-    return parse_optional_arguments(args, (int32_t)(end_args - args), options, timeout, filesize);
+    return parse_optional_arguments(args, (int32_t)(end_args - args), options, timeout, filesize, NULL, NULL);
+}
+
+int pico_tftp_parse_request_opts(char *args, int32_t len, int *options, uint8_t *timeout, int32_t *filesize,
+                                 uint16_t *blksize, uint16_t *windowsize)
+{
+    char *pos;
+    char *end_args = args + len;
+
+    args = extract_arg_pointer(args, end_args, &pos);
+
+    if (parse_optional_arguments(args, (int32_t)(end_args - args), options, timeout, filesize, blksize, windowsize))
+        return -1;
+
+    if ((*options & PICO_TFTP_OPTION_BLKSIZE) && (*blksize > PICO_TFTP_MAX_BLKSIZE))
+        *blksize = PICO_TFTP_MAX_BLKSIZE;
+
+    if ((*options & PICO_TFTP_OPTION_WINDOWSIZE) && (*windowsize > PICO_TFTP_MAX_WINDOWSIZE))
+        *windowsize = PICO_TFTP_MAX_WINDOWSIZE;
+
+    return 0;
 }
 
 int pico_tftp_abort(struct pico_tftp_session *session, uint16_t error, const char *reason)
@@ -1268,6 +1545,8 @@ struct pico_tftp_session *pico_tftp_app_setup(union pico_address *a, uint16_t po
 
 int pico_tftp_app_start_rx(struct pico_tftp_session *session, const char *filename)
 {
+    /* pico_tftp_get() hands out one block at a time */
+    session->options &= ~PICO_TFTP_OPTION_WINDOWSIZE;
     return pico_tftp_start_rx(session, session->remote_port, filename, application_rx_cb, session->argument);
 }
 
@@ -1315,9 +1594,15 @@ int32_t pico_tftp_put(struct pico_tftp_session *session, uint8_t *data, int32_t
     if (synchro < 0)
         return synchro;
 
-    if (len > PICO_TFTP_PAYLOAD_SIZE)
-        len = PICO_TFTP_PAYLOAD_SIZE;
+    if (len > tftp_blksize(session))
+        len = tftp_blksize(session);
+
+    if (pico_tftp_send(session, data, len) < 0)
+        return -1;
+
+    /* room left in the window: the next block can go without waiting */
+    if ((session->state == TFTP_STATE_TX) && (tftp_in_flight(session) < tftp_windowsize(session)))
+        *(int*)session->argument = 1;
 
-    pico_tftp_send(session, data, len);
     return len;
 }
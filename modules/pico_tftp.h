@@ -44,6 +44,20 @@
 /* timeout: 0 -> adaptative, 1-255 -> fixed */
 #define PICO_TFTP_OPTION_TIME 2
 
+/* blksize (RFC 2348): payload bytes per DATA block */
+#define PICO_TFTP_OPTION_BLKSIZE 4
+
+/* windowsize (RFC 7440): DATA blocks sent per ACK */
+#define PICO_TFTP_OPTION_WINDOWSIZE 8
+
+#define PICO_TFTP_MIN_BLKSIZE 8
+/* Larger blksize/windowsize values are lowered to these while negotiating */
+#ifndef PICO_TFTP_MAX_BLKSIZE
+#define PICO_TFTP_MAX_BLKSIZE 1428
+#endif
+#ifndef PICO_TFTP_MAX_WINDOWSIZE
+#define PICO_TFTP_MAX_WINDOWSIZE 16
+#endif
 
 #define PICO_TFTP_MAX_TIMEOUT 255
 #define PICO_TFTP_MAX_FILESIZE (65535 * 512 - 1)
@@ -65,6 +79,9 @@ int32_t pico_tftp_send(struct pico_tftp_session *session, const uint8_t *data, i
 int pico_tftp_listen(uint16_t family, void (*cb)(union pico_address *addr, uint16_t port, uint16_t opcode, char *filename, int32_t len));
 
 int pico_tftp_parse_request_args(char *args, int32_t len, int *options, uint8_t *timeout, int32_t *filesize);
+/* Same, also reporting the blksize and windowsize options, lowered to the local maximum */
+int pico_tftp_parse_request_opts(char *args, int32_t len, int *options, uint8_t *timeout, int32_t *filesize,
+                                 uint16_t *blksize, uint16_t *windowsize);
 
 int pico_tftp_abort(struct pico_tftp_session *session, uint16_t error, const char *reason);
 int pico_tftp_close_server(void);
@@ -36,7 +36,8 @@ endif
 ifeq ($(IEEE802154), 1)
 	6LOWPAN_OPTIONS+=-DPICO_SUPPORT_802154
 	POSIX_OBJ+=modules/pico_dev_radiotest.o \
-			modules/pico_dev_radio_mgr.o
+			modules/pico_dev_radio_mgr.o \
+			modules/pico_dev_radiomesh.o
 endif
 
 OPTIONS+=$(6LOWPAN_OPTIONS)
@@ -0,0 +1,2 @@
+OPTIONS+=-DPICO_SUPPORT_CAPTURE
+MOD_OBJ+=$(LIBBASE)modules/pico_capture.o
@@ -1,3 +1,4 @@
 OPTIONS+=-DPICO_SUPPORT_ETH
+MOD_OBJ+=$(LIBBASE)modules/pico_neighbor.o
 MOD_OBJ+=$(LIBBASE)modules/pico_arp.o
 MOD_OBJ+=$(LIBBASE)modules/pico_ethernet.o
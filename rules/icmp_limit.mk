@@ -0,0 +1,2 @@
+OPTIONS+=-DPICO_SUPPORT_ICMP_LIMIT
+MOD_OBJ+=$(LIBBASE)modules/pico_icmp_limit.o
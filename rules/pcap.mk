@@ -1 +1,3 @@
+OPTIONS+=-DPICO_SUPPORT_PCAP
 MOD_OBJ+=$(LIBBASE)modules/pico_dev_pcap.o
+BENCH_LDFLAGS+=-lpcap
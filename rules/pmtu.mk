@@ -0,0 +1,2 @@
+OPTIONS+=-DPICO_SUPPORT_PMTU
+MOD_OBJ+=$(LIBBASE)modules/pico_pmtu.o
@@ -0,0 +1,2 @@
+OPTIONS+=-DPICO_SUPPORT_QDISC
+MOD_OBJ+=$(LIBBASE)modules/pico_qdisc.o
@@ -0,0 +1,3 @@
+OPTIONS+=-DPICO_SUPPORT_SIMTIME
+MOD_OBJ+=$(LIBBASE)modules/pico_simtime.o
+MOD_OBJ+=$(LIBBASE)modules/pico_dev_pipe.o
@@ -0,0 +1,2 @@
+OPTIONS+=-DPICO_SUPPORT_STATS
+MOD_OBJ+=$(LIBBASE)modules/pico_stats.o
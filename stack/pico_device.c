@@ -19,6 +19,9 @@
 #include "pico_802154.h"
 #include "pico_6lowpan.h"
 #include "pico_6lowpan_ll.h"
+#include "pico_qdisc.h"
+#include "pico_capture.h"
+#include "pico_neighbor.h"
 #include "pico_addressing.h"
 #define PICO_DEVICE_DEFAULT_MTU (1500)
 
@@ -270,6 +273,13 @@ static void pico_queue_destroy(struct pico_queue *q)
 
 void pico_device_destroy(struct pico_device *dev)
 {
+#ifdef PICO_SUPPORT_QDISC
+    if (dev->qdisc)
+        pico_qdisc_detach(dev);
+#endif
+#if defined(PICO_SUPPORT_ETH) || defined(PICO_SUPPORT_IPV6)
+    pico_neighbor_flush_dev(dev);
+#endif
 
     pico_queue_destroy(dev->q_in);
     pico_queue_destroy(dev->q_out);
@@ -322,6 +332,10 @@ static int devloop_in(struct pico_device *dev, int loop_score)
         /* Receive */
         f = pico_dequeue(dev->q_in);
         if (f) {
+#ifdef PICO_SUPPORT_CAPTURE
+            if (pico_capture_active)
+                pico_capture_frame(f, PICO_CAPTURE_IN);
+#endif
             pico_datalink_receive(f);
             loop_score--;
         }
@@ -339,20 +353,41 @@ static int devloop_sendto_dev(struct pico_device *dev, struct pico_frame *f)
     return (dev->send(dev, f->start, (int)f->len) <= 0);
 }
 
+static struct pico_frame *devloop_out_peek(struct pico_device *dev)
+{
+#ifdef PICO_SUPPORT_QDISC
+    if (dev->qdisc)
+        return pico_qdisc_peek(dev);
+#endif
+    if (dev->q_out->frames == 0)
+        return NULL;
+
+    return pico_queue_peek(dev->q_out);
+}
+
+static struct pico_frame *devloop_out_dequeue(struct pico_device *dev)
+{
+#ifdef PICO_SUPPORT_QDISC
+    if (dev->qdisc)
+        return pico_qdisc_dequeue(dev);
+#endif
+    return pico_dequeue(dev->q_out);
+}
+
 static int devloop_out(struct pico_device *dev, int loop_score)
 {
     struct pico_frame *f;
     while(loop_score > 0) {
-        if (dev->q_out->frames == 0)
-            break;
-
         /* Device dequeue + send */
-        f = pico_queue_peek(dev->q_out);
+        f = devloop_out_peek(dev);
         if (!f)
             break;
 
         if (devloop_sendto_dev(dev, f) == 0) { /* success. */
-            f = pico_dequeue(dev->q_out);
+#ifdef PICO_SUPPORT_STATS
+            dev->stats_tx++;
+#endif
+            f = devloop_out_dequeue(dev);
             pico_frame_discard(f); /* SINGLE POINT OF DISCARD for OUTGOING FRAMES */
             loop_score--;
         } else
@@ -224,3 +224,37 @@ void pico_protocol_init(struct pico_protocol *p)
     dbg("Protocol %s registered (layer: %d).\n", p->name, p->layer);
 }
 
+
+#ifdef PICO_SUPPORT_STATS
+struct pico_protocol *pico_protocol_next(struct pico_protocol *prev)
+{
+    struct pico_tree *layers[] = {
+        &Datalink_proto_tree, &Network_proto_tree, &Transport_proto_tree, &Socket_proto_tree
+    };
+    const uint32_t nr = (uint32_t)(sizeof(layers) / sizeof(layers[0]));
+    struct pico_tree_node *n = NULL;
+    uint32_t i = 0;
+
+    if (prev) {
+        while ((i < nr) && !n) {
+            n = pico_tree_findNode(layers[i], prev);
+            if (!n)
+                i++;
+        }
+        if (!n)
+            return NULL;
+
+        n = pico_tree_next(n);
+    } else {
+        n = pico_tree_firstNode(layers[0]->root);
+    }
+
+    while (n == &LEAF) {
+        if (++i >= nr)
+            return NULL;
+
+        n = pico_tree_firstNode(layers[i]->root);
+    }
+    return n->keyValue;
+}
+#endif
@@ -18,6 +18,7 @@
 #include "pico_icmp4.h"
 #include "pico_nat.h"
 #include "pico_tree.h"
+#include "pico_pmtu.h"
 #include "pico_device.h"
 #include "pico_socket_multicast.h"
 #include "pico_socket_tcp.h"
@@ -139,9 +140,8 @@ static int socket_cmp_addresses(struct pico_socket *a, struct pico_socket *b)
     return ret;
 }
 
-static int socket_cmp(void *ka, void *kb)
+static inline int socket_cmp(struct pico_socket *a, struct pico_socket *b)
 {
-    struct pico_socket *a = ka, *b = kb;
     int ret = 0;
 
     /* First, order by network family */
@@ -159,11 +159,12 @@ static int socket_cmp(void *ka, void *kb)
 }
 
 
-#define INIT_SOCKPORT { {&LEAF, socket_cmp}, 0, 0 }
+PICO_RB_GENERATE(sock_tree, struct pico_socket, node, socket_cmp)
 
-static int sockport_cmp(void *ka, void *kb)
+#define INIT_SOCKPORT { PICO_RB_TREE_INIT, {NULL, NULL, NULL, 0}, 0, 0 }
+
+static inline int sockport_cmp(struct pico_sockport *a, struct pico_sockport *b)
 {
-    struct pico_sockport *a = ka, *b = kb;
     if (a->number < b->number)
         return -1;
 
@@ -173,8 +174,10 @@ static int sockport_cmp(void *ka, void *kb)
     return 0;
 }
 
-static PICO_TREE_DECLARE(UDPTable, sockport_cmp);
-static PICO_TREE_DECLARE(TCPTable, sockport_cmp);
+PICO_RB_GENERATE(sockport_tree, struct pico_sockport, node, sockport_cmp)
+
+static struct pico_rb_tree UDPTable = PICO_RB_TREE_INIT;
+static struct pico_rb_tree TCPTable = PICO_RB_TREE_INIT;
 
 struct pico_sockport *pico_get_sockport(uint16_t proto, uint16_t port)
 {
@@ -182,10 +185,10 @@ struct pico_sockport *pico_get_sockport(uint16_t proto, uint16_t port)
     test.number = port;
 
     if (proto == PICO_PROTO_UDP)
-        return pico_tree_findKey(&UDPTable, &test);
+        return sockport_tree_find(&UDPTable, &test);
 
     else if (proto == PICO_PROTO_TCP)
-        return pico_tree_findKey(&TCPTable, &test);
+        return sockport_tree_find(&TCPTable, &test);
 
     else return NULL;
 }
@@ -211,10 +214,10 @@ static int pico_port_in_use_with_this_ipv4_address(struct pico_sockport *sp, str
 {
     if (sp) {
         struct pico_ip4 *s_local;
-        struct pico_tree_node *idx;
+        struct pico_rb_node *idx;
         struct pico_socket *s;
-        pico_tree_foreach(idx, &sp->socks) {
-            s = idx->keyValue;
+        pico_sockport_foreach(idx, sp) {
+            s = pico_sockport_entry(idx);
             if (s->net == &pico_proto_ipv4) {
                 s_local = (struct pico_ip4*) &s->local_addr;
                 if ((s_local->addr == PICO_IPV4_INADDR_ANY) || (s_local->addr == ip.addr)) {
@@ -255,10 +258,10 @@ static int pico_port_in_use_with_this_ipv6_address(struct pico_sockport *sp, str
 {
     if (sp) {
         struct pico_ip6 *s_local;
-        struct pico_tree_node *idx;
+        struct pico_rb_node *idx;
         struct pico_socket *s;
-        pico_tree_foreach(idx, &sp->socks) {
-            s = idx->keyValue;
+        pico_sockport_foreach(idx, sp) {
+            s = pico_sockport_entry(idx);
             if (s->net == &pico_proto_ipv6) {
                 s_local = (struct pico_ip6*) &s->local_addr;
                 if ((pico_ipv6_is_unspecified(s_local->addr)) || (!memcmp(s_local->addr, ip.addr, PICO_SIZE_IP6))) {
@@ -339,7 +342,7 @@ static int pico_check_socket(struct pico_socket *s)
 {
     struct pico_sockport *test;
     struct pico_socket *found;
-    struct pico_tree_node *index;
+    struct pico_rb_node *index;
 
     test = pico_get_sockport(PROTO(s), s->local_port);
 
@@ -347,8 +350,8 @@ static int pico_check_socket(struct pico_socket *s)
         return -1;
     }
 
-    pico_tree_foreach(index, &test->socks){
-        found = index->keyValue;
+    pico_sockport_foreach(index, test){
+        found = pico_sockport_entry(index);
         if (s == found) {
             return 0;
         }
@@ -360,17 +363,17 @@ static int pico_check_socket(struct pico_socket *s)
 struct pico_socket *pico_sockets_find(uint16_t local, uint16_t remote)
 {
     struct pico_socket *sock = NULL;
-    struct pico_tree_node *index = NULL;
+    struct pico_rb_node *index = NULL;
     struct pico_sockport *sp = NULL;
 
     sp = pico_get_sockport(PICO_PROTO_TCP, local);
     if(sp)
     {
-        pico_tree_foreach(index, &sp->socks)
+        pico_sockport_foreach(index, sp)
         {
-            if(((struct pico_socket *)index->keyValue)->remote_port == remote)
+            if(pico_sockport_entry(index)->remote_port == remote)
             {
-                sock = (struct pico_socket *)index->keyValue;
+                sock = pico_sockport_entry(index);
                 break;
             }
         }
@@ -403,12 +406,11 @@ int8_t pico_socket_add(struct pico_socket *s)
 
         sp->proto = PROTO(s);
         sp->number = s->local_port;
-        sp->socks.root = &LEAF;
-        sp->socks.compare = socket_cmp;
 
         if (PROTO(s) == PICO_PROTO_UDP)
         {
-            if (pico_tree_insert(&UDPTable, sp)) {
+            if (sockport_tree_insert(&UDPTable, sp)) {
+                pico_err = PICO_ERR_EEXIST;
 				PICO_FREE(sp);
 				PICOTCP_MUTEX_UNLOCK(Mutex);
 				return -1;
@@ -417,7 +419,8 @@ int8_t pico_socket_add(struct pico_socket *s)
         }
         else if (PROTO(s) == PICO_PROTO_TCP)
         {
-            if (pico_tree_insert(&TCPTable, sp)) {
+            if (sockport_tree_insert(&TCPTable, sp)) {
+                pico_err = PICO_ERR_EEXIST;
 				PICO_FREE(sp);
 				PICOTCP_MUTEX_UNLOCK(Mutex);
 				return -1;
@@ -425,7 +428,8 @@ int8_t pico_socket_add(struct pico_socket *s)
         }
     }
 
-    if (pico_tree_insert(&sp->socks, s)) {
+    if (sock_tree_insert(&sp->socks, s)) {
+        pico_err = PICO_ERR_EEXIST;
 		PICOTCP_MUTEX_UNLOCK(Mutex);
 		return -1;
 	}
@@ -433,9 +437,9 @@ int8_t pico_socket_add(struct pico_socket *s)
     PICOTCP_MUTEX_UNLOCK(Mutex);
 #ifdef DEBUG_SOCKET_TREE
     {
-        struct pico_tree_node *index;
-        pico_tree_foreach(index, &sp->socks){
-            s = index->keyValue;
+        struct pico_rb_node *index;
+        pico_sockport_foreach(index, sp){
+            s = pico_sockport_entry(index);
             dbg(">>>> List Socket lc=%hu rm=%hu\n", short_be(s->local_port), short_be(s->remote_port));
         }
 
@@ -480,14 +484,14 @@ static void socket_garbage_collect(pico_time now, void *arg)
 
 static void pico_socket_check_empty_sockport(struct pico_socket *s, struct pico_sockport *sp)
 {
-    if(pico_tree_empty(&sp->socks)) {
+    if(pico_rb_empty(&sp->socks)) {
         if (PROTO(s) == PICO_PROTO_UDP)
         {
-            pico_tree_delete(&UDPTable, sp);
+            sockport_tree_remove(&UDPTable, sp);
         }
         else if (PROTO(s) == PICO_PROTO_TCP)
         {
-            pico_tree_delete(&TCPTable, sp);
+            sockport_tree_remove(&TCPTable, sp);
         }
 
         if(sp_tcp == sp)
@@ -509,7 +513,9 @@ int8_t pico_socket_del(struct pico_socket *s)
     }
 
     PICOTCP_MUTEX_LOCK(Mutex);
-    pico_tree_delete(&sp->socks, s);
+    if (pico_rb_linked(&sp->socks, &s->node))
+        sock_tree_remove(&sp->socks, s);
+
     pico_socket_check_empty_sockport(s, sp);
 #ifdef PICO_SUPPORT_MCAST
     pico_multicast_delete(s);
@@ -807,9 +813,10 @@ static uint16_t pico_socket_high_port(uint16_t proto)
         do {
             uint32_t rand = pico_rand();
             port = (uint16_t) (rand & 0xFFFFU);
-            port = (uint16_t)((port % (65535 - 1024)) + 1024U);
-            if (pico_is_port_free(proto, port, NULL, NULL)) {
-                return short_be(port);
+            port = short_be((uint16_t)((port % (65535 - 1024)) + 1024U));
+            /* Not held by any socket, not even one in TIME_WAIT */
+            if (!pico_get_sockport(proto, port)) {
+                return port;
             }
         } while(1);
     }
@@ -1278,7 +1285,7 @@ static uint32_t pico_socket_adapt_mss_to_proto(struct pico_socket *s, uint32_t m
     return mss;
 }
 
-uint32_t pico_socket_get_mss(struct pico_socket *s)
+uint32_t pico_socket_get_link_mss(struct pico_socket *s)
 {
     uint32_t mss = PICO_MIN_MSS;
     if (!s)
@@ -1296,6 +1303,22 @@ uint32_t pico_socket_get_mss(struct pico_socket *s)
     return pico_socket_adapt_mss_to_proto(s, mss);
 }
 
+uint32_t pico_socket_get_mss(struct pico_socket *s)
+{
+    uint32_t mss = pico_socket_get_link_mss(s);
+#ifdef PICO_SUPPORT_PMTU
+    uint32_t pmtu;
+
+    if (s && s->net) {
+        pmtu = pico_pmtu_get(s->net->proto_number, &s->remote_addr);
+        if (pmtu && (pico_socket_adapt_mss_to_proto(s, pmtu) < mss))
+            mss = pico_socket_adapt_mss_to_proto(s, pmtu);
+    }
+
+#endif
+    return mss;
+}
+
 
 static int pico_socket_xmit_avail_space(struct pico_socket *s)
 {
@@ -1765,10 +1788,9 @@ struct pico_socket *pico_socket_accept(struct pico_socket *s, void *orig, uint16
          */
         pico_err = PICO_ERR_EAGAIN;
         if (sp) {
-            struct pico_tree_node *index;
-            /* RB_FOREACH(found, socket_tree, &sp->socks) { */
-            pico_tree_foreach(index, &sp->socks){
-                found = index->keyValue;
+            struct pico_rb_node *index;
+            pico_sockport_foreach(index, sp){
+                found = pico_sockport_entry(index);
                 if ((s == found->parent) && ((found->state & PICO_SOCKET_STATE_TCP) == PICO_SOCKET_STATE_TCP_ESTABLISHED)) {
                     found->parent = NULL;
                     pico_err = PICO_ERR_NOERR;
@@ -2025,26 +2047,22 @@ static int pico_sockets_loop_udp(int loop_score)
 {
 
 #ifdef PICO_SUPPORT_UDP
-    static struct pico_tree_node *index_udp;
     struct pico_sockport *start;
     struct pico_socket *s;
     struct pico_frame *f;
 
     if (sp_udp == NULL)
-    {
-        index_udp = pico_tree_firstNode(UDPTable.root);
-        sp_udp = index_udp->keyValue;
-    }
+        sp_udp = sockport_tree_first(&UDPTable);
 
     /* init start node */
     start = sp_udp;
 
     /* round-robin all transport protocols, break if traversed all protocols */
     while (loop_score > SL_LOOP_MIN && sp_udp != NULL) {
-        struct pico_tree_node *index;
+        struct pico_rb_node *index;
 
-        pico_tree_foreach(index, &sp_udp->socks){
-            s = index->keyValue;
+        pico_sockport_foreach(index, sp_udp){
+            s = pico_sockport_entry(index);
             f = pico_dequeue(&s->q_out);
             while (f && (loop_score > 0)) {
                 pico_proto_udp.push(&pico_proto_udp, f);
@@ -2054,14 +2072,9 @@ static int pico_sockets_loop_udp(int loop_score)
             }
         }
 
-        index_udp = pico_tree_next(index_udp);
-        sp_udp = index_udp->keyValue;
-
+        sp_udp = sockport_tree_next(sp_udp);
         if (sp_udp == NULL)
-        {
-            index_udp = pico_tree_firstNode(UDPTable.root);
-            sp_udp = index_udp->keyValue;
-        }
+            sp_udp = sockport_tree_first(&UDPTable);
 
         if (sp_udp == start)
             break;
@@ -2075,20 +2088,16 @@ static int pico_sockets_loop_tcp(int loop_score)
 #ifdef PICO_SUPPORT_TCP
     struct pico_sockport *start;
     struct pico_socket *s;
-    static struct pico_tree_node *index_tcp;
     if (sp_tcp == NULL)
-    {
-        index_tcp = pico_tree_firstNode(TCPTable.root);
-        sp_tcp = index_tcp->keyValue;
-    }
+        sp_tcp = sockport_tree_first(&TCPTable);
 
     /* init start node */
     start = sp_tcp;
 
     while (loop_score > SL_LOOP_MIN && sp_tcp != NULL) {
-        struct pico_tree_node *index = NULL, *safe_index = NULL;
-        pico_tree_foreach_safe(index, &sp_tcp->socks, safe_index){
-            s = index->keyValue;
+        struct pico_rb_node *index = NULL, *safe_index = NULL;
+        pico_sockport_foreach_safe(index, sp_tcp, safe_index){
+            s = pico_sockport_entry(index);
             loop_score = pico_tcp_output(s, loop_score);
             if ((s->ev_pending) && s->wakeup) {
                 s->wakeup(s->ev_pending, s);
@@ -2104,24 +2113,18 @@ static int pico_sockets_loop_tcp(int loop_score)
             if(check_socket_sanity(s) < 0)
             {
                 pico_socket_del(s);
-                index_tcp = NULL; /* forcing the restart of loop */
-                sp_tcp = NULL;
+                sp_tcp = NULL; /* forcing the restart of loop */
                 break;
             }
         }
 
-        /* check if RB_FOREACH ended, if not, break to keep the cur sp_tcp */
-        if (!index_tcp || (index && index->keyValue))
+        /* check if the foreach ended, if not, break to keep the cur sp_tcp */
+        if (!sp_tcp || index)
             break;
 
-        index_tcp = pico_tree_next(index_tcp);
-        sp_tcp = index_tcp->keyValue;
-
+        sp_tcp = sockport_tree_next(sp_tcp);
         if (sp_tcp == NULL)
-        {
-            index_tcp = pico_tree_firstNode(TCPTable.root);
-            sp_tcp = index_tcp->keyValue;
-        }
+            sp_tcp = sockport_tree_first(&TCPTable);
 
         if (sp_tcp == start)
             break;
@@ -2142,28 +2145,57 @@ int pico_sockets_loop(int loop_score)
 int pico_count_sockets(uint8_t proto)
 {
     struct pico_sockport *sp;
-    struct pico_tree_node *idx_sp, *idx_s;
+    struct pico_rb_node *idx_s;
     int count = 0;
 
     if ((proto == 0) || (proto == PICO_PROTO_TCP)) {
-        pico_tree_foreach(idx_sp, &TCPTable) {
-            sp = idx_sp->keyValue;
-            if (sp) {
-                pico_tree_foreach(idx_s, &sp->socks)
-                count++;
-            }
+        for (sp = sockport_tree_first(&TCPTable); sp; sp = sockport_tree_next(sp)) {
+            pico_sockport_foreach(idx_s, sp)
+            count++;
         }
     }
 
     if ((proto == 0) || (proto == PICO_PROTO_UDP)) {
-        pico_tree_foreach(idx_sp, &UDPTable) {
-            sp = idx_sp->keyValue;
-            if (sp) {
-                pico_tree_foreach(idx_s, &sp->socks)
-                count++;
-            }
+        for (sp = sockport_tree_first(&UDPTable); sp; sp = sockport_tree_next(sp)) {
+            pico_sockport_foreach(idx_s, sp)
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static int pico_socket_foreach_table(struct pico_rb_tree *table, int (*cb)(struct pico_socket *s, void *arg), void *arg, int *count)
+{
+    struct pico_sockport *sp;
+    struct pico_rb_node *idx_s;
+
+    for (sp = sockport_tree_first(table); sp; sp = sockport_tree_next(sp)) {
+        pico_sockport_foreach(idx_s, sp) {
+            (*count)++;
+            if (cb(pico_sockport_entry(idx_s), arg) != 0)
+                return -1;
         }
     }
+    return 0;
+}
+
+int pico_socket_foreach(uint8_t proto, int (*cb)(struct pico_socket *s, void *arg), void *arg)
+{
+    int count = 0;
+
+    if (!cb) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    if ((proto == 0) || (proto == PICO_PROTO_TCP)) {
+        if (pico_socket_foreach_table(&TCPTable, cb, arg, &count) < 0)
+            return count;
+    }
+
+    if ((proto == 0) || (proto == PICO_PROTO_UDP))
+        pico_socket_foreach_table(&UDPTable, cb, arg, &count);
 
     return count;
 }
@@ -2263,11 +2295,11 @@ int pico_transport_error(struct pico_frame *f, uint8_t proto, int code)
         ret = -1;
     }
     if (port) {
-        struct pico_tree_node *index;
+        struct pico_rb_node *index;
         ret = 0;
 
-        pico_tree_foreach(index, &port->socks) {
-            s = index->keyValue;
+        pico_sockport_foreach(index, port) {
+            s = pico_sockport_entry(index);
             if (trans->dport == s->remote_port) {
                 if (s->wakeup) {
                     pico_transport_error_set_picoerr(code);
@@ -2283,5 +2315,35 @@ int pico_transport_error(struct pico_frame *f, uint8_t proto, int code)
     pico_frame_discard(f);
     return ret;
 }
+
+#ifdef PICO_SUPPORT_PMTU
+/* The path MTU towards the destination of f went down */
+int pico_transport_pmtu_update(struct pico_frame *f, uint8_t proto)
+{
+#ifdef PICO_SUPPORT_TCP
+    struct pico_trans *trans = (struct pico_trans*) f->transport_hdr;
+    struct pico_sockport *port = NULL;
+    struct pico_rb_node *index;
+    struct pico_socket *s;
+
+    /* UDP picks up the new size on the next send */
+    if (proto == PICO_PROTO_TCP)
+        port = pico_get_sockport(proto, trans->sport);
+
+    if (port) {
+        pico_sockport_foreach(index, port) {
+            s = pico_sockport_entry(index);
+            if (trans->dport == s->remote_port)
+                pico_tcp_pmtu_update(s);
+        }
+    }
+
+#else
+    IGNORE_PARAMETER(proto);
+#endif
+    pico_frame_discard(f);
+    return 0;
+}
+#endif
 #endif
 #endif
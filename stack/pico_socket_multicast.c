@@ -15,6 +15,11 @@
 #define so_mcast_dbg(...) do { } while(0)
 #endif
 
+/* Group index buckets, power of two */
+#ifndef PICO_MCAST_INDEX_SIZE
+#define PICO_MCAST_INDEX_SIZE 256
+#endif
+
 /*                       socket
  *                         |
  *                    MCASTListen
@@ -27,6 +32,9 @@
  *
  *   MCASTListen: RBTree(mcast_link, mcast_group)
  *   MCASTSources: RBTree(source)
+ *
+ * Every listen is also chained in mcast_index, hashed on (proto, group), so
+ * delivery finds the sockets of a group without walking all sockets.
  */
 struct pico_mcast_listen
 {
@@ -36,6 +44,8 @@ struct pico_mcast_listen
     struct pico_tree MCASTSources;
     struct pico_tree MCASTSources_ipv6;
     uint16_t proto;
+    struct pico_socket *s;
+    struct pico_mcast_listen *index_next;
 };
 /* Parameters */
 struct pico_mcast
@@ -214,6 +224,52 @@ static struct pico_mcast_listen *listen_find(struct pico_socket *s, union pico_a
 #endif
     return NULL;
 }
+static struct pico_mcast_listen *mcast_index[PICO_MCAST_INDEX_SIZE];
+/* Bumped on every change to the index, invalidates the iterators */
+static uint32_t mcast_index_gen;
+
+static uint32_t mcast_index_hash(uint16_t proto, union pico_address *grp)
+{
+    uint32_t h = grp->ip4.addr ^ proto;
+#ifdef PICO_SUPPORT_IPV6
+    uint32_t w;
+    int i;
+
+    if (proto == PICO_PROTO_IPV6) {
+        for (i = 4; i < PICO_SIZE_IP6; i += 4) {
+            memcpy(&w, grp->ip6.addr + i, sizeof(w));
+            h ^= w;
+        }
+    }
+
+#endif
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return h & (PICO_MCAST_INDEX_SIZE - 1);
+}
+
+static void mcast_index_add(struct pico_socket *s, struct pico_mcast_listen *listen)
+{
+    uint32_t h = mcast_index_hash(listen->proto, &listen->mcast_group);
+
+    listen->s = s;
+    listen->index_next = mcast_index[h];
+    mcast_index[h] = listen;
+    mcast_index_gen++;
+}
+
+static void mcast_index_del(struct pico_mcast_listen *listen)
+{
+    struct pico_mcast_listen **pp = &mcast_index[mcast_index_hash(listen->proto, &listen->mcast_group)];
+
+    while (*pp && (*pp != listen))
+        pp = &(*pp)->index_next;
+    if (*pp)
+        *pp = listen->index_next;
+
+    mcast_index_gen++;
+}
+
 static union pico_address *pico_mcast_get_link_address(struct pico_socket *s, union pico_link *mcast_link)
 {
     if( IS_SOCK_IPV4(s))
@@ -455,87 +511,22 @@ static int pico_socket_aggregate_mcastfilters(union pico_address *mcast_link, un
     return filter_mode;
 }
 
-static int pico_socket_mcast_filter_include(struct pico_mcast_listen *listen, union pico_address *src)
+static int pico_socket_mcast_source_filtering(struct pico_mcast_listen *listen, union pico_address *src)
 {
-    struct pico_tree_node *index = NULL;
-#ifdef PICO_DEBUG_MCAST
-    char tmp_string[PICO_IPV6_STRING];
-#endif
-    if(!pico_tree_empty(&listen->MCASTSources)) {
-        pico_tree_foreach(index, &listen->MCASTSources)
-        {
-            if (src->ip4.addr == ((union pico_address *)index->keyValue)->ip4.addr) {
-                so_mcast_dbg("MCAST: IP %08X in included socket source list\n", src->ip4.addr);
-                return 0;
-            }
-        }
-    }
+    struct pico_tree *tree = &listen->MCASTSources;
+    int found;
 
 #ifdef PICO_SUPPORT_IPV6
-    if(!pico_tree_empty(&listen->MCASTSources_ipv6)) {
-        pico_tree_foreach(index, &listen->MCASTSources_ipv6)
-        {
-            if (memcmp(&src->ip6, &((union pico_address *)index->keyValue)->ip6, sizeof(struct pico_ip6))) {
-#ifdef PICO_DEBUG_MCAST
-                pico_ipv6_to_string(tmp_string, src->ip6.addr);
-                so_mcast_dbg("MCAST: IP %s in included socket source list\n", tmp_string);
-#endif
-                return 0;
-            }
-        }
-    }
+    if (listen->proto == PICO_PROTO_IPV6)
+        tree = &listen->MCASTSources_ipv6;
 
 #endif
-    /* XXX IPV6 ADDRESS */
-    so_mcast_dbg("MCAST: IP %08X NOT in included socket source list\n", src->ip4.addr);
-    return -1;
-
-}
-
-static int pico_socket_mcast_filter_exclude(struct pico_mcast_listen *listen, union pico_address *src)
-{
-    struct pico_tree_node *index = NULL;
-#ifdef PICO_DEBUG_MCAST
-    char tmp_string[PICO_IPV6_STRING];
-#endif
-    if(!pico_tree_empty(&listen->MCASTSources)) {
-        pico_tree_foreach(index, &listen->MCASTSources)
-        {
-            if (src->ip4.addr == ((union pico_address *)index->keyValue)->ip4.addr) {
-                so_mcast_dbg("MCAST: IP %08X in excluded socket source list\n", src->ip4.addr);
-                return -1;
-            }
-        }
-    }
-
-#ifdef PICO_SUPPORT_IPV6
-    if(!pico_tree_empty(&listen->MCASTSources_ipv6)) {
-        pico_tree_foreach(index, &listen->MCASTSources_ipv6)
-        {
-            if (memcmp(&src->ip6, &((union pico_address *)index->keyValue)->ip6, sizeof(struct pico_ip6))) {
-#ifdef PICO_DEBUG_MCAST
-                pico_ipv6_to_string(tmp_string, src->ip6.addr);
-                so_mcast_dbg("MCAST: IP %s in excluded socket source list\n", tmp_string);
-#endif
-                return 0;
-            }
-        }
-    }
-
-#endif
-    /* XXX IPV6 ADDRESS  */
-    so_mcast_dbg("MCAST: IP %08X NOT in excluded socket source list\n", src->ip4.addr);
-    return 0;
-}
-
-static int pico_socket_mcast_source_filtering(struct pico_mcast_listen *listen, union pico_address *src)
-{
-    /* perform source filtering */
+    found = (tree->root != NULL) && (pico_tree_findKey(tree, src) != NULL);
     if (listen->filter_mode == PICO_IP_MULTICAST_INCLUDE)
-        return pico_socket_mcast_filter_include(listen, src);
+        return found ? 0 : -1;
 
     if (listen->filter_mode == PICO_IP_MULTICAST_EXCLUDE)
-        return pico_socket_mcast_filter_exclude(listen, src);
+        return found ? -1 : 0;
 
     return -1;
 }
@@ -543,7 +534,7 @@ static int pico_socket_mcast_source_filtering(struct pico_mcast_listen *listen,
 static void *pico_socket_mcast_filter_link_get(struct pico_socket *s)
 {
     /* check if no multicast enabled on socket */
-    if (!s->MCASTListen)
+    if (!mcast_get_listen_tree(s))
         return NULL;
 
     if( IS_SOCK_IPV4(s)) {
@@ -564,27 +555,71 @@ static void *pico_socket_mcast_filter_link_get(struct pico_socket *s)
     return NULL;
 }
 
-int pico_socket_mcast_filter(struct pico_socket *s, union pico_address *mcast_group, union pico_address *src)
+static union pico_address *pico_socket_mcast_filter_link_address(struct pico_socket *s)
 {
-    void *mcast_link = NULL;
-    struct pico_mcast_listen *listen = NULL;
-    mcast_link = pico_socket_mcast_filter_link_get(s);
+    void *mcast_link = pico_socket_mcast_filter_link_get(s);
+
     if (!mcast_link)
-        return -1;
+        return NULL;
 
-    if(IS_SOCK_IPV4(s))
-        listen = listen_find(s, (union pico_address *) &((struct pico_ipv4_link*)(mcast_link))->address, mcast_group);
+    if (IS_SOCK_IPV4(s))
+        return (union pico_address *) &((struct pico_ipv4_link*)(mcast_link))->address;
 
 #ifdef PICO_SUPPORT_IPV6
-    else if(IS_SOCK_IPV6(s))
-        listen = listen_find(s, (union pico_address *)&((struct pico_ipv6_link*)(mcast_link))->address, mcast_group);
+    if (IS_SOCK_IPV6(s))
+        return (union pico_address *) &((struct pico_ipv6_link*)(mcast_link))->address;
+
 #endif
+    return NULL;
+}
+
+int pico_socket_mcast_filter(struct pico_socket *s, union pico_address *mcast_group, union pico_address *src)
+{
+    union pico_address *lnk;
+    struct pico_mcast_listen *listen = NULL;
+
+    lnk = pico_socket_mcast_filter_link_address(s);
+    if (!lnk)
+        return -1;
+
+    listen = listen_find(s, lnk, mcast_group);
     if (!listen)
         return -1;
 
     return pico_socket_mcast_source_filtering(listen, src);
 }
 
+struct pico_socket *pico_socket_mcast_next(struct pico_mcast_it *it, uint16_t proto, uint16_t port, union pico_address *grp, union pico_address *src)
+{
+    struct pico_mcast_listen *listen;
+    union pico_address *lnk;
+
+    /* The cursor may have been freed since: start over */
+    if (it->listen && (it->gen == mcast_index_gen))
+        listen = ((struct pico_mcast_listen *)it->listen)->index_next;
+    else
+        listen = mcast_index[mcast_index_hash(proto, grp)];
+
+    for (; listen; listen = listen->index_next) {
+        if ((listen->proto != proto) || (listen->s->local_port != port) ||
+            pico_address_compare(&listen->mcast_group, grp, proto))
+            continue;
+
+        /* only the listen on the socket's own link counts */
+        lnk = pico_socket_mcast_filter_link_address(listen->s);
+        if (!lnk || pico_address_compare(lnk, &listen->mcast_link, proto))
+            continue;
+
+        if (pico_socket_mcast_source_filtering(listen, src) < 0)
+            continue;
+
+        it->listen = listen;
+        it->gen = mcast_index_gen;
+        return listen->s;
+    }
+    it->listen = NULL;
+    return NULL;
+}
 
 static struct pico_ipv4_link *get_mcast_link(union pico_address *a)
 {
@@ -873,6 +908,7 @@ void pico_multicast_delete(struct pico_socket *s)
 #endif
             }
 
+            mcast_index_del(listen);
             pico_tree_delete(listen_tree, listen);
             PICO_FREE(listen);
         }
@@ -1000,6 +1036,8 @@ static int mcast_so_addm(struct pico_socket *s, void *value)
 		return -1;
 	}
 
+    mcast_index_add(s, mcast.listen);
+
     filter_mode = pico_socket_aggregate_mcastfilters(mcast.address, &mcast.mreq->mcast_group_addr);
     if (filter_mode < 0)
         return -1;
@@ -1040,6 +1078,7 @@ static int mcast_so_dropm(struct pico_socket *s, void *value)
         source = index->keyValue;
         pico_tree_delete(tree, source);
     }
+    mcast_index_del(mcast.listen);
     pico_tree_delete(listen_tree, mcast.listen);
     PICO_FREE(mcast.listen);
     if (pico_tree_empty(listen_tree)) {
@@ -1266,6 +1305,8 @@ static int mcast_so_addsrcm(struct pico_socket *s, void *value)
             PICO_FREE(mcast.listen);
 			return -1;
 		}
+
+        mcast_index_add(s, mcast.listen);
         reference_count = 1;
     }
 
@@ -1322,6 +1363,7 @@ static int mcast_so_dropsrcm(struct pico_socket *s, void *value)
     pico_tree_delete(tree, source);
     if (pico_tree_empty(tree)) { /* 1 if empty, 0 otherwise */
         reference_count = 1;
+        mcast_index_del(mcast.listen);
         pico_tree_delete(listen_tree, mcast.listen);
         PICO_FREE(mcast.listen);
         if (pico_tree_empty(listen_tree)) {
@@ -1451,6 +1493,16 @@ int pico_socket_mcast_filter(struct pico_socket *s, union pico_address *mcast_gr
     return -1;
 }
 
+struct pico_socket *pico_socket_mcast_next(struct pico_mcast_it *it, uint16_t proto, uint16_t port, union pico_address *grp, union pico_address *src)
+{
+    IGNORE_PARAMETER(proto);
+    IGNORE_PARAMETER(port);
+    IGNORE_PARAMETER(grp);
+    IGNORE_PARAMETER(src);
+    it->listen = NULL;
+    return NULL;
+}
+
 void pico_multicast_delete(struct pico_socket *s)
 {
     (void)s;
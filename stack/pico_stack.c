@@ -31,6 +31,9 @@
 #include "pico_udp.h"
 #include "pico_tcp.h"
 #include "pico_socket.h"
+#include "pico_qdisc.h"
+#include "pico_stats.h"
+#include "pico_capture.h"
 #include "heap.h"
 
 /* Mockables */
@@ -466,8 +469,13 @@ int32_t pico_stack_recv(struct pico_device *dev, uint8_t *buffer, uint32_t len)
     struct pico_frame *f = pico_stack_recv_new_frame (dev, buffer, len);
     int32_t ret;
 
-    if (!f)
+    if (!f) {
+#ifdef PICO_SUPPORT_STATS
+        if (len)
+            dev->stats_drop++;
+#endif
         return -1;
+    }
 
     ret = pico_enqueue(dev->q_in, f);
     if (ret <= 0) {
@@ -487,6 +495,9 @@ static int32_t _pico_stack_recv_zerocopy(struct pico_device *dev, uint8_t *buffe
     if (!f)
     {
         dbg("Cannot alloc incoming frame!\n");
+#ifdef PICO_SUPPORT_STATS
+        dev->stats_drop++;
+#endif
         return -1;
     }
 
@@ -539,6 +550,14 @@ int32_t pico_sendto_dev(struct pico_frame *f)
             pico_rand_feed(rand);
         }
 
+#ifdef PICO_SUPPORT_CAPTURE
+        if (pico_capture_active)
+            pico_capture_frame(f, PICO_CAPTURE_OUT);
+#endif
+#ifdef PICO_SUPPORT_QDISC
+        if (f->dev->qdisc)
+            return pico_qdisc_enqueue(f->dev, f);
+#endif
         return pico_enqueue(f->dev->q_out, f);
     }
 }
@@ -590,6 +609,40 @@ int32_t pico_seq_compare(uint32_t a, uint32_t b)
     return 0;
 }
 
+#ifdef PICO_SUPPORT_SIMTIME
+/* Set when the last pico_stack_tick() fired a timer or moved a frame */
+static int stack_tick_busy;
+
+void pico_rand_seed(uint32_t seed)
+{
+    _rand_seed = seed;
+}
+
+int pico_stack_tick_busy(void)
+{
+    return stack_tick_busy;
+}
+
+int pico_timer_next(pico_time *expire)
+{
+    struct pico_timer_ref *tref = heap_first(Timers);
+    if (!tref)
+        return -1;
+
+    *expire = tref->expire;
+    return 0;
+}
+
+static void stack_tick_check_busy(const int *score, const int *left, int phases)
+{
+    int i;
+    for (i = 0; i < phases; i++) {
+        if (left[i] < score[i])
+            stack_tick_busy = 1;
+    }
+}
+#endif
+
 static void pico_check_timers(void)
 {
     struct pico_timer *t;
@@ -597,8 +650,12 @@ static void pico_check_timers(void)
     pico_tick = PICO_TIME_MS();
     while((tref) && (tref->expire < pico_tick)) {
         t = tref->tmr;
-        if (t && t->timer)
+        if (t && t->timer) {
+#ifdef PICO_SUPPORT_SIMTIME
+            stack_tick_busy = 1;
+#endif
             t->timer(pico_tick, t->arg);
+        }
 
         if (t)
         {
@@ -757,6 +814,9 @@ void pico_stack_tick(void)
         0
     };
 
+#ifdef PICO_SUPPORT_SIMTIME
+    stack_tick_busy = 0;
+#endif
     pico_check_timers();
 
     /* dbg("LOOP_SCORES> %3d - %3d - %3d - %3d - %3d - %3d - %3d - %3d - %3d - %3d - %3d\n",score[0],score[1],score[2],score[3],score[4],score[5],score[6],score[7],score[8],score[9],score[10]); */
@@ -803,6 +863,13 @@ void pico_stack_tick(void)
     ret[10] = pico_devices_loop(score[10], PICO_LOOP_DIR_OUT);
     pico_rand_feed((uint32_t)ret[10]);
 
+#ifdef PICO_SUPPORT_STATS
+    pico_stats_loop_update(score, ret, PROTO_DEF_NR);
+#endif
+#ifdef PICO_SUPPORT_SIMTIME
+    stack_tick_check_busy(score, ret, PROTO_DEF_NR);
+#endif
+
     /* calculate new loop scores for next iteration */
     calc_score(score, index, (int (*)[])avg, ret);
 }
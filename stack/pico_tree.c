@@ -563,3 +563,266 @@ static void fix_delete_collisions(struct pico_tree*tree, struct pico_tree_node *
     }
     node->color = BLACK;
 }
+
+/*
+ * Intrusive tree
+ */
+static void rb_set_child(struct pico_rb_tree *tree, struct pico_rb_node *parent,
+                         struct pico_rb_node *old, struct pico_rb_node *new)
+{
+    if (!parent)
+        tree->root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+static void rb_rotate_left(struct pico_rb_tree *tree, struct pico_rb_node *x)
+{
+    struct pico_rb_node *y = x->right;
+
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+
+    y->parent = x->parent;
+    rb_set_child(tree, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(struct pico_rb_tree *tree, struct pico_rb_node *x)
+{
+    struct pico_rb_node *y = x->left;
+
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+
+    y->parent = x->parent;
+    rb_set_child(tree, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+#define RB_IS_BLACK(n) (!(n) || ((n)->color == BLACK))
+
+void pico_rb_insert_color(struct pico_rb_tree *tree, struct pico_rb_node *n)
+{
+    struct pico_rb_node *p, *g, *u;
+
+    while ((p = n->parent) && (p->color == RED)) {
+        /* a red parent is never the root */
+        g = p->parent;
+        if (p == g->left) {
+            u = g->right;
+            if (!RB_IS_BLACK(u)) {
+                p->color = BLACK;
+                u->color = BLACK;
+                g->color = RED;
+                n = g;
+                continue;
+            }
+
+            if (n == p->right) {
+                rb_rotate_left(tree, p);
+                n = p;
+                p = n->parent;
+            }
+
+            p->color = BLACK;
+            g->color = RED;
+            rb_rotate_right(tree, g);
+        } else {
+            u = g->left;
+            if (!RB_IS_BLACK(u)) {
+                p->color = BLACK;
+                u->color = BLACK;
+                g->color = RED;
+                n = g;
+                continue;
+            }
+
+            if (n == p->left) {
+                rb_rotate_right(tree, p);
+                n = p;
+                p = n->parent;
+            }
+
+            p->color = BLACK;
+            g->color = RED;
+            rb_rotate_left(tree, g);
+        }
+    }
+    tree->root->color = BLACK;
+}
+
+static void rb_transplant(struct pico_rb_tree *tree, struct pico_rb_node *u, struct pico_rb_node *v)
+{
+    rb_set_child(tree, u->parent, u, v);
+    if (v)
+        v->parent = u->parent;
+}
+
+/* x (possibly a NULL leaf, hence xp) carries an extra black */
+static void rb_erase_fixup(struct pico_rb_tree *tree, struct pico_rb_node *x, struct pico_rb_node *xp)
+{
+    struct pico_rb_node *w;
+
+    while ((x != tree->root) && RB_IS_BLACK(x)) {
+        if (x == xp->left) {
+            w = xp->right;
+            if (w->color == RED) {
+                w->color = BLACK;
+                xp->color = RED;
+                rb_rotate_left(tree, xp);
+                w = xp->right;
+            }
+
+            if (RB_IS_BLACK(w->left) && RB_IS_BLACK(w->right)) {
+                w->color = RED;
+                x = xp;
+                xp = x->parent;
+                continue;
+            }
+
+            if (RB_IS_BLACK(w->right)) {
+                w->left->color = BLACK;
+                w->color = RED;
+                rb_rotate_right(tree, w);
+                w = xp->right;
+            }
+
+            w->color = xp->color;
+            xp->color = BLACK;
+            w->right->color = BLACK;
+            rb_rotate_left(tree, xp);
+        } else {
+            w = xp->left;
+            if (w->color == RED) {
+                w->color = BLACK;
+                xp->color = RED;
+                rb_rotate_right(tree, xp);
+                w = xp->left;
+            }
+
+            if (RB_IS_BLACK(w->left) && RB_IS_BLACK(w->right)) {
+                w->color = RED;
+                x = xp;
+                xp = x->parent;
+                continue;
+            }
+
+            if (RB_IS_BLACK(w->left)) {
+                w->right->color = BLACK;
+                w->color = RED;
+                rb_rotate_left(tree, w);
+                w = xp->left;
+            }
+
+            w->color = xp->color;
+            xp->color = BLACK;
+            w->left->color = BLACK;
+            rb_rotate_right(tree, xp);
+        }
+
+        x = tree->root;
+        break;
+    }
+    if (x)
+        x->color = BLACK;
+}
+
+void pico_rb_erase(struct pico_rb_tree *tree, struct pico_rb_node *n)
+{
+    struct pico_rb_node *x, *xp, *y;
+    uint8_t color = n->color;
+
+    if (!n->left) {
+        x = n->right;
+        xp = n->parent;
+        rb_transplant(tree, n, x);
+    } else if (!n->right) {
+        x = n->left;
+        xp = n->parent;
+        rb_transplant(tree, n, x);
+    } else {
+        /* successor takes the place of n */
+        y = n->right;
+        while (y->left)
+            y = y->left;
+        color = y->color;
+        x = y->right;
+        if (y->parent == n) {
+            xp = y;
+        } else {
+            xp = y->parent;
+            rb_transplant(tree, y, x);
+            y->right = n->right;
+            y->right->parent = y;
+        }
+
+        rb_transplant(tree, n, y);
+        y->left = n->left;
+        y->left->parent = y;
+        y->color = n->color;
+    }
+
+    if (color == BLACK)
+        rb_erase_fixup(tree, x, xp);
+
+    n->parent = n->left = n->right = NULL;
+}
+
+struct pico_rb_node *pico_rb_first(const struct pico_rb_tree *tree)
+{
+    struct pico_rb_node *n = tree->root;
+
+    if (n)
+        while (n->left)
+            n = n->left;
+    return n;
+}
+
+struct pico_rb_node *pico_rb_last(const struct pico_rb_tree *tree)
+{
+    struct pico_rb_node *n = tree->root;
+
+    if (n)
+        while (n->right)
+            n = n->right;
+    return n;
+}
+
+struct pico_rb_node *pico_rb_next(const struct pico_rb_node *n)
+{
+    struct pico_rb_node *p;
+
+    if (n->right) {
+        p = n->right;
+        while (p->left)
+            p = p->left;
+        return p;
+    }
+
+    while ((p = n->parent) && (n == p->right))
+        n = p;
+    return p;
+}
+
+struct pico_rb_node *pico_rb_prev(const struct pico_rb_node *n)
+{
+    struct pico_rb_node *p;
+
+    if (n->left) {
+        p = n->left;
+        while (p->right)
+            p = p->right;
+        return p;
+    }
+
+    while ((p = n->parent) && (n == p->left))
+        n = p;
+    return p;
+}
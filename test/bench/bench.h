@@ -0,0 +1,73 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   Common helpers for the benchmarks in test/bench.
+   Results are printed one per line, as
+       bench,<suite>,<case>,<value>,<unit>
+   so that runs can be collected and compared by scripts. After
+   bench_init(), they are all that goes to stdout.
+ *********************************************************************/
+#ifndef PICO_BENCH_H
+#define PICO_BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static FILE *bench_out;
+
+/* Keeps stdout for the results: anything else printed from here on, the
+ * stack's dbg() output included, goes to stderr. Call it first in main(). */
+static inline void bench_init(void)
+{
+    int fd;
+
+    fflush(stdout);
+    fd = dup(STDOUT_FILENO);
+    if (fd < 0)
+        return;
+
+    bench_out = fdopen(fd, "w");
+    if (!bench_out) {
+        close(fd);
+        return;
+    }
+
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void bench_report(const char *suite, const char *name, double value, const char *unit)
+{
+    FILE *out = bench_out ? bench_out : stdout;
+
+    fprintf(out, "bench,%s,%s,%.3f,%s\n", suite, name, value, unit);
+    fflush(out);
+}
+
+/* Operations per second over an interval measured with bench_now_ns() */
+static inline double bench_rate(uint64_t ops, uint64_t start, uint64_t end)
+{
+    if (end <= start)
+        return 0.0;
+
+    return (double)ops * 1e9 / (double)(end - start);
+}
+
+/* Deterministic PRNG, so every run exercises the same workload */
+static inline uint32_t bench_rand(uint32_t *seed)
+{
+    *seed = (*seed * 1103515245u) + 12345u;
+    return *seed >> 1;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#!/bin/bash
+# Compares two runs of a benchmark: bench_compare.sh <baseline> <new> [tolerance %]
+# Only the "bench,<suite>,<case>,<value>,<unit>" lines are read. Rates
+# (units with "/s") are better higher, everything else lower. Simulated
+# results ("sim_" units) are the same on every run, so they get no tolerance.
+# Exits 1 if anything got worse, or went missing.
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <baseline> <new> [tolerance %]"
+    exit 2
+fi
+
+TOL=${3:-10}
+
+awk -F, -v tol="$TOL" '
+    $1 != "bench" { next }
+    FNR == NR { base[$2 "," $3] = $4; unit[$2 "," $3] = $5; next }
+    {
+        key = $2 "," $3
+        seen[key] = 1
+        if (!(key in base)) {
+            printf("new      %-50s %12.3f %s\n", key, $4, $5)
+            next
+        }
+        old = base[key] + 0
+        cur = $4 + 0
+        t = ($5 ~ /^sim_/) ? 0 : tol
+        if ($5 ~ /\/s$/)
+            worse = (cur < old * (1 - t / 100))
+        else
+            worse = (cur > old * (1 + t / 100))
+        change = (old != 0) ? (cur - old) * 100 / old : 0
+        printf("%-8s %-50s %12.3f -> %12.3f %s (%+.1f%%)\n", worse ? "WORSE" : "ok", key, old, cur, $5, change)
+        if (worse)
+            bad++
+    }
+    END {
+        for (key in base) {
+            if (!(key in seen)) {
+                printf("MISSING  %s\n", key)
+                bad++
+            }
+        }
+        exit(bad ? 1 : 0)
+    }' "$1" "$2"
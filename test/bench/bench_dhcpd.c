@@ -0,0 +1,143 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   DHCP server benchmark: ten thousand clients coming back after a power
+   cycle, each with a DISCOVER and a REQUEST, then the same clients
+   reconnecting with new transactions, and a snapshot and restore of the
+   lease database. Messages are handed to the server as they come off
+   the socket, replies go out on a null device.
+ *********************************************************************/
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "modules/pico_dev_null.c"
+#include "modules/pico_dhcp_server.c"
+#include "bench.h"
+
+#define BENCH_CLIENTS       10000u
+#define BENCH_MSG_SIZE      (sizeof(struct pico_dhcp_hdr) + 32u)
+
+static struct pico_ip4 bench_server = {
+    0
+};
+
+static uint32_t bench_msg(uint8_t *buf, uint32_t client, uint32_t xid, uint8_t type)
+{
+    struct pico_dhcp_hdr *hdr = (struct pico_dhcp_hdr *)buf;
+    uint32_t offset = 0;
+
+    memset(buf, 0, BENCH_MSG_SIZE);
+    hdr->op = PICO_DHCP_OP_REQUEST;
+    hdr->htype = PICO_DHCP_HTYPE_ETH;
+    hdr->hlen = PICO_SIZE_ETH;
+    hdr->xid = xid;
+    hdr->hwaddr[0] = 0x02;
+    hdr->hwaddr[3] = (uint8_t)(client >> 16);
+    hdr->hwaddr[4] = (uint8_t)(client >> 8);
+    hdr->hwaddr[5] = (uint8_t)client;
+    hdr->dhcp_magic = PICO_DHCPD_MAGIC_COOKIE;
+
+    offset += pico_dhcp_opt_msgtype(DHCP_OPT(hdr, offset), type);
+    if (type == PICO_DHCP_MSG_REQUEST)
+        offset += pico_dhcp_opt_serverid(DHCP_OPT(hdr, offset), &bench_server);
+
+    offset += pico_dhcp_opt_end(DHCP_OPT(hdr, offset));
+    return (uint32_t)sizeof(struct pico_dhcp_hdr) + offset;
+}
+
+/* DISCOVER then REQUEST for every client, as one burst each */
+static void bench_burst(struct pico_socket *s, const char *name, uint32_t round)
+{
+    uint8_t buf[BENCH_MSG_SIZE];
+    struct pico_dhcp_server_negotiation *n;
+    uint64_t t0, t1;
+    uint32_t i, len, bound = 0;
+    char label[64];
+
+    t0 = bench_now_ns();
+    for (i = 0; i < BENCH_CLIENTS; i++) {
+        len = bench_msg(buf, i, long_be((round << 24) | i), PICO_DHCP_MSG_DISCOVER);
+        pico_dhcp_server_recv(s, buf, len);
+        pico_stack_tick();
+    }
+    for (i = 0; i < BENCH_CLIENTS; i++) {
+        len = bench_msg(buf, i, long_be((round << 24) | i), PICO_DHCP_MSG_REQUEST);
+        pico_dhcp_server_recv(s, buf, len);
+        pico_stack_tick();
+    }
+    t1 = bench_now_ns();
+
+    for (i = 0; i < BENCH_CLIENTS; i++) {
+        n = pico_dhcp_server_find_negotiation(long_be((round << 24) | i));
+        if (n && n->state == PICO_DHCP_STATE_BOUND)
+            bound++;
+    }
+    if (bound != BENCH_CLIENTS) {
+        fprintf(stderr, "dhcpd: %u of %u clients bound\n", bound, BENCH_CLIENTS);
+        exit(1);
+    }
+
+    snprintf(label, sizeof(label), "%s_msgs", name);
+    bench_report("dhcpd", label, bench_rate(2u * BENCH_CLIENTS, t0, t1), "msg/s");
+}
+
+int main(void)
+{
+    struct pico_device *null;
+    struct pico_ip4 netmask;
+    struct pico_dhcp_server_setting setting = {
+        0
+    };
+    struct pico_dhcp_server_setting *dhcps;
+    uint8_t *snapshot;
+    uint64_t t0, t1;
+    int size;
+
+    pico_stack_init();
+    null = pico_null_create("null0");
+    if (!null)
+        return 1;
+
+    bench_server.addr = long_be(0x0A320001);
+    netmask.addr = long_be(0xFFFFC000);
+    if (pico_ipv4_link_add(null, bench_server, netmask) < 0)
+        return 1;
+
+    setting.server_ip = bench_server;
+    setting.pool_start = long_be(0x0A320010);
+    setting.pool_end = long_be(0x0A323FF0);
+    setting.lease_time = long_be(3600);
+    if (pico_dhcp_server_initiate(&setting) < 0)
+        return 1;
+
+    dhcps = dhcps_find_setting(null);
+    bench_burst(dhcps->s, "power_cycle", 1);
+    bench_burst(dhcps->s, "reconnect", 2);
+
+    size = pico_dhcp_server_leases_save(null, NULL, 0);
+    snapshot = malloc((size_t)size);
+    if (!snapshot)
+        return 1;
+
+    t0 = bench_now_ns();
+    if (pico_dhcp_server_leases_save(null, snapshot, (uint32_t)size) != size)
+        return 1;
+
+    t1 = bench_now_ns();
+    bench_report("dhcpd", "snapshot_save", (double)(t1 - t0) / 1e6, "ms");
+
+    pico_dhcp_server_destroy(null);
+    if (pico_dhcp_server_initiate(&setting) < 0)
+        return 1;
+
+    t0 = bench_now_ns();
+    if (pico_dhcp_server_leases_restore(null, snapshot, (uint32_t)size) != (int)BENCH_CLIENTS)
+        return 1;
+
+    t1 = bench_now_ns();
+    bench_report("dhcpd", "snapshot_restore", (double)(t1 - t0) / 1e6, "ms");
+
+    free(snapshot);
+    pico_dhcp_server_destroy(null);
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   ICMP flood benchmark: echo requests and datagrams to a closed port are
+   pushed into the loop device as fast as the stack takes them, from one
+   source and from a scan of spoofed sources, with and without the ICMP
+   rate limits. Replies are counted on their way out of the loop device
+   and dropped there instead of coming back in.
+ *********************************************************************/
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_icmp4.h"
+#include "pico_udp.h"
+#include "pico_dev_loop.h"
+#include "pico_icmp_limit.h"
+#include "bench.h"
+
+#define BENCH_PKTS          51200u  /* whole batches */
+#define BENCH_BATCH         64u
+#define BENCH_PAYLOAD       56u
+#define BENCH_IP_LOCAL      0x7F000001 /* 127.0.0.1 */
+#define BENCH_IP_SOURCES    0x7F010000 /* 127.1.0.0/16 */
+
+static uint8_t bench_pkt[PICO_SIZE_IP4HDR + PICO_ICMPHDR_UN_SIZE + BENCH_PAYLOAD];
+static uint32_t bench_replies;
+
+static int bench_loop_send(struct pico_device *dev, void *buf, int len)
+{
+    (void)dev;
+    (void)buf;
+    bench_replies++;
+    return len;
+}
+
+static uint16_t bench_craft(uint8_t proto, uint32_t src, uint16_t seq)
+{
+    struct pico_ipv4_hdr *net = (struct pico_ipv4_hdr *)bench_pkt;
+    uint8_t *l4 = bench_pkt + PICO_SIZE_IP4HDR;
+    uint16_t len = (uint16_t)sizeof(bench_pkt);
+
+    memset(bench_pkt, 0, sizeof(bench_pkt));
+    net->vhl = 0x45;
+    net->len = short_be(len);
+    net->id = short_be(seq);
+    net->ttl = 64;
+    net->proto = proto;
+    net->src.addr = long_be(src);
+    net->dst.addr = long_be(BENCH_IP_LOCAL);
+    net->crc = short_be(pico_checksum(net, PICO_SIZE_IP4HDR));
+
+    if (proto == PICO_PROTO_ICMP4) {
+        struct pico_icmp4_hdr *icmp = (struct pico_icmp4_hdr *)l4;
+        icmp->type = PICO_ICMP_ECHO;
+        icmp->hun.ih_idseq.idseq_id = short_be(0x1234);
+        icmp->hun.ih_idseq.idseq_seq = short_be(seq);
+        icmp->crc = short_be(pico_checksum(icmp, (uint32_t)(len - PICO_SIZE_IP4HDR)));
+    } else {
+        struct pico_udp_hdr *udp = (struct pico_udp_hdr *)l4;
+        udp->trans.sport = short_be(40000);
+        udp->trans.dport = short_be((uint16_t)(20000u + (seq % 1000u)));
+        udp->len = short_be((uint16_t)(len - PICO_SIZE_IP4HDR));
+    }
+
+    return len;
+}
+
+static uint32_t bench_handled(uint8_t cls)
+{
+    struct pico_icmp_limit_stats st;
+
+    pico_icmp_limit_get_stats(&st);
+    return st.sent[cls] + st.limited[cls] + st.capped[cls];
+}
+
+static void bench_flood(struct pico_device *loop, const char *name, uint8_t proto, uint32_t sources, int limited)
+{
+    struct pico_icmp_limit_config cfg = { 0 };
+    uint8_t cls = (proto == PICO_PROTO_ICMP4) ? PICO_ICMP_LIMIT_ECHO : PICO_ICMP_LIMIT_ERROR;
+    uint32_t i, j, stuck;
+    uint64_t t0, t1;
+    char label[64];
+    uint16_t len;
+
+    if (limited) {
+        cfg.rate = (cls == PICO_ICMP_LIMIT_ECHO) ? PICO_ICMP_LIMIT_ECHO_RATE : PICO_ICMP_LIMIT_ERROR_RATE;
+        cfg.total = (cls == PICO_ICMP_LIMIT_ECHO) ? PICO_ICMP_LIMIT_ECHO_TOTAL : PICO_ICMP_LIMIT_ERROR_TOTAL;
+    }
+
+    pico_icmp_limit_flush();
+    pico_icmp_limit_set(cls, &cfg);
+    bench_replies = 0;
+
+    t0 = bench_now_ns();
+    for (i = 0; i < BENCH_PKTS; i += BENCH_BATCH) {
+        for (j = i; j < i + BENCH_BATCH; j++) {
+            len = bench_craft(proto, BENCH_IP_SOURCES + (j % sources), (uint16_t)j);
+            pico_stack_recv(loop, bench_pkt, len);
+        }
+        stuck = 0;
+        while ((bench_handled(cls) < i + BENCH_BATCH) && (stuck++ < 1000))
+            pico_stack_tick();
+    }
+    /* Let the last replies out */
+    pico_stack_tick();
+    t1 = bench_now_ns();
+
+    if (bench_handled(cls) != BENCH_PKTS) {
+        fprintf(stderr, "icmp_flood: %u of %u packets handled\n", bench_handled(cls), BENCH_PKTS);
+        exit(1);
+    }
+
+    snprintf(label, sizeof(label), "%s_%s", name, limited ? "limited" : "unlimited");
+    bench_report("icmp_flood", label, bench_rate(BENCH_PKTS, t0, t1), "pkt/s");
+    snprintf(label, sizeof(label), "%s_%s_replies", name, limited ? "limited" : "unlimited");
+    bench_report("icmp_flood", label, (double)bench_replies, "pkts");
+}
+
+int main(void)
+{
+    struct pico_device *loop;
+    struct pico_ip4 addr, netmask;
+    int limited;
+
+    pico_stack_init();
+    loop = pico_loop_create();
+    if (!loop)
+        return 1;
+
+    loop->send = bench_loop_send;
+    addr.addr = long_be(BENCH_IP_LOCAL);
+    netmask.addr = long_be(0xFF000000);
+    pico_ipv4_link_add(loop, addr, netmask);
+
+    for (limited = 0; limited < 2; limited++) {
+        bench_flood(loop, "echo_one_source", PICO_PROTO_ICMP4, 1, limited);
+        bench_flood(loop, "echo_scan", PICO_PROTO_ICMP4, BENCH_PKTS, limited);
+        bench_flood(loop, "closed_port_scan", PICO_PROTO_UDP, BENCH_PKTS, limited);
+    }
+
+    return 0;
+}
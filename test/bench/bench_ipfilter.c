@@ -0,0 +1,204 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   IP filter classification benchmark: installs an increasing number of
+   random prefix/port-range rules and measures packets classified per
+   second, once with packets drawn from the installed rules and once with
+   random packets that mostly match none. Rules use the priority action,
+   so no packet is consumed.
+ *********************************************************************/
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_ipv6.h"
+#include "pico_udp.h"
+#include "pico_ipfilter.h"
+#include "bench.h"
+
+#define BENCH_PKTS      1000000
+
+static struct pico_frame *bench_udp_frame(uint16_t net)
+{
+    uint16_t nlen = (net == PICO_PROTO_IPV4) ? PICO_SIZE_IP4HDR : PICO_SIZE_IP6HDR;
+    struct pico_frame *f = pico_frame_alloc((uint32_t)(nlen + PICO_UDPHDR_SIZE + 32));
+
+    if (!f)
+        exit(1);
+
+    f->net_hdr = f->buffer;
+    f->net_len = nlen;
+    f->transport_hdr = f->buffer + nlen;
+    f->transport_len = PICO_UDPHDR_SIZE + 32;
+    if (net == PICO_PROTO_IPV4) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        hdr->vhl = 0x45;
+        hdr->ttl = 64;
+        hdr->proto = PICO_PROTO_UDP;
+    } else {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+        hdr->vtf = long_be(0x60000000);
+        hdr->nxthdr = PICO_PROTO_UDP;
+    }
+
+    return f;
+}
+
+static void bench_rule(struct pico_ipfilter_rule *r, uint16_t net, uint32_t *seed)
+{
+    uint32_t v = bench_rand(seed);
+
+    memset(r, 0, sizeof(*r));
+    r->net = net;
+    r->proto = PICO_PROTO_UDP;
+    r->action = FILTER_PRIORITY;
+    if (net == PICO_PROTO_IPV4) {
+        r->src.ip4.addr = long_be(0x0a000000u | (v & 0xFFFF00u));
+        r->src_prefix = 24;
+    } else {
+        r->src.ip6.addr[0] = 0x20;
+        r->src.ip6.addr[1] = 0x01;
+        r->src.ip6.addr[5] = (uint8_t)(v >> 8);
+        r->src.ip6.addr[6] = (uint8_t)(v >> 16);
+        r->src_prefix = 56;
+    }
+
+    v = bench_rand(seed);
+    r->dport_min = (uint16_t)(1024u + (v % 60000u));
+    r->dport_max = (uint16_t)(r->dport_min + (v >> 20) % 64u);
+}
+
+static void bench_packet(struct pico_frame *f, uint16_t net, uint32_t *seed)
+{
+    uint32_t v = bench_rand(seed);
+    struct pico_udp_hdr *udp = (struct pico_udp_hdr *)f->transport_hdr;
+
+    if (net == PICO_PROTO_IPV4) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        hdr->src.addr = long_be(0x0a000000u | (v & 0xFFFFFFu));
+        hdr->dst.addr = long_be(0x0a010001u);
+    } else {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+        hdr->src.addr[0] = 0x20;
+        hdr->src.addr[1] = 0x01;
+        hdr->src.addr[5] = (uint8_t)(v >> 8);
+        hdr->src.addr[6] = (uint8_t)(v >> 16);
+        hdr->src.addr[15] = (uint8_t)v;
+    }
+
+    v = bench_rand(seed);
+    udp->trans.sport = short_be(5000);
+    udp->trans.dport = short_be((uint16_t)(1024u + (v % 60000u)));
+}
+
+/* A packet inside the ranges of rule r */
+static void bench_packet_hit(struct pico_frame *f, struct pico_ipfilter_rule *r, uint32_t *seed)
+{
+    uint32_t v = bench_rand(seed);
+    struct pico_udp_hdr *udp = (struct pico_udp_hdr *)f->transport_hdr;
+
+    if (r->net == PICO_PROTO_IPV4) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        hdr->src.addr = r->src.ip4.addr | long_be(v & 0xFFu);
+        hdr->dst.addr = long_be(0x0a010001u);
+    } else {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+        memcpy(hdr->src.addr, r->src.ip6.addr, PICO_SIZE_IP6);
+        hdr->src.addr[15] = (uint8_t)v;
+    }
+
+    udp->trans.sport = short_be(5000);
+    udp->trans.dport = short_be((uint16_t)(r->dport_min + (v >> 8) % (uint32_t)(r->dport_max - r->dport_min + 1)));
+}
+
+static uint32_t bench_hits(uint32_t *ids, uint32_t rules)
+{
+    uint32_t i, hits, total = 0;
+
+    for (i = 0; i < rules; i++) {
+        if (pico_ipfilter_hits(ids[i], &hits) == 0)
+            total += hits;
+    }
+    return total;
+}
+
+static void bench_ipfilter_run(uint16_t net, uint32_t rules)
+{
+    struct pico_frame *f = bench_udp_frame(net);
+    struct pico_ipfilter_rule *r = calloc(rules, sizeof(struct pico_ipfilter_rule));
+    uint32_t *ids = calloc(rules, sizeof(uint32_t));
+    uint32_t seed = 7, i, total;
+    const char *fam = (net == PICO_PROTO_IPV4) ? "ipv4" : "ipv6";
+    uint64_t t0, t1;
+    char name[64];
+
+    if (!ids || !r)
+        exit(1);
+
+    for (i = 0; i < rules; i++) {
+        bench_rule(&r[i], net, &seed);
+        ids[i] = pico_ipfilter_add(&r[i]);
+        if (!ids[i]) {
+            fprintf(stderr, "ipfilter: rule %u not added\n", i);
+            exit(1);
+        }
+    }
+
+    /* the first packet compiles the rule set */
+    bench_packet(f, net, &seed);
+    t0 = bench_now_ns();
+    ipfilter(f);
+    t1 = bench_now_ns();
+    snprintf(name, sizeof(name), "%s_compile_%u_rules", fam, rules);
+    bench_report("ipfilter", name, (double)(t1 - t0) / 1000.0, "us");
+
+    total = bench_hits(ids, rules);
+    t0 = bench_now_ns();
+    for (i = 0; i < BENCH_PKTS; i++) {
+        bench_packet_hit(f, &r[bench_rand(&seed) % rules], &seed);
+        ipfilter(f);
+    }
+    t1 = bench_now_ns();
+    snprintf(name, sizeof(name), "%s_classify_hit_%u_rules", fam, rules);
+    bench_report("ipfilter", name, bench_rate(BENCH_PKTS, t0, t1), "pkt/s");
+    snprintf(name, sizeof(name), "%s_matched_hit_%u_rules", fam, rules);
+    bench_report("ipfilter", name, (double)(bench_hits(ids, rules) - total) * 100.0 / (double)BENCH_PKTS, "%");
+
+    total = bench_hits(ids, rules);
+    t0 = bench_now_ns();
+    for (i = 0; i < BENCH_PKTS; i++) {
+        bench_packet(f, net, &seed);
+        ipfilter(f);
+    }
+    t1 = bench_now_ns();
+    snprintf(name, sizeof(name), "%s_classify_miss_%u_rules", fam, rules);
+    bench_report("ipfilter", name, bench_rate(BENCH_PKTS, t0, t1), "pkt/s");
+    snprintf(name, sizeof(name), "%s_matched_miss_%u_rules", fam, rules);
+    bench_report("ipfilter", name, (double)(bench_hits(ids, rules) - total) * 100.0 / (double)BENCH_PKTS, "%");
+
+    for (i = 0; i < rules; i++)
+        pico_ipfilter_del(ids[i]);
+
+    free(ids);
+    free(r);
+    pico_frame_discard(f);
+}
+
+int main(void)
+{
+    static const uint32_t rules[] = {
+        10, 100, 1000, 5000
+    };
+    uint32_t i;
+
+    bench_init();
+    pico_stack_init();
+    for (i = 0; i < sizeof(rules) / sizeof(rules[0]); i++)
+        bench_ipfilter_run(PICO_PROTO_IPV4, rules[i]);
+
+#ifdef PICO_SUPPORT_IPV6
+    for (i = 0; i < sizeof(rules) / sizeof(rules[0]); i++)
+        bench_ipfilter_run(PICO_PROTO_IPV6, rules[i]);
+#endif
+
+    return 0;
+}
@@ -0,0 +1,333 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   mDNS responder and cache benchmark, for a busy LAN with hundreds of
+   advertised services: announcements filling the cache, queries with
+   known answers against the local records, and the cache expiry tick.
+   Packets are handed to the responder as they come off the socket.
+
+   Usage: bench_mdns [capture.pcap]
+   With PCAP=1 an Ethernet capture (e.g. tcpdump -w) is replayed as well,
+   once, through a pico_dev_pcap device: the mDNS datagrams sent to
+   224.0.0.251 go up the stack to a responder socket.
+ *********************************************************************/
+#include "pico_stack.h"
+#include "modules/pico_mdns.c"
+#ifdef PICO_SUPPORT_PCAP
+#include "pico_dev_pcap.h"
+#endif
+#include "bench.h"
+
+#define BENCH_SERVICES      500
+#define BENCH_LOCAL         200
+#define BENCH_ROUNDS        40
+#define BENCH_QUERIES       200000
+#define BENCH_TTL           4500
+
+struct bench_pkt {
+    uint8_t *buf;
+    uint16_t len;
+};
+
+static struct pico_ip4 bench_peer = {
+    0x0a000002
+};
+
+static void bench_name(char *url, size_t size, const char *fmt, uint32_t i)
+{
+    snprintf(url, size, fmt, i);
+}
+
+/* One announcement for a service instance: PTR, TXT and A */
+static struct bench_pkt bench_announcement(uint32_t i, uint32_t ttl)
+{
+    PICO_DNS_RTREE_DECLARE(antree);
+    struct pico_mdns_record *ptr, *txt, *a;
+    char instance[64], host[32];
+    uint8_t txtdata[32];
+    uint32_t addr = long_be(0x0a010000u | i);
+    struct bench_pkt pkt;
+
+    bench_name(instance, sizeof(instance), "svc%u._http._tcp.local", i);
+    bench_name(host, sizeof(host), "host%u.local", i);
+    memset(txtdata, 'x', sizeof(txtdata));
+    txtdata[0] = (uint8_t)(sizeof(txtdata) - 1);
+
+    ptr = pico_mdns_record_create("_http._tcp.local", instance, (uint16_t)strlen(instance),
+                                  PICO_DNS_TYPE_PTR, ttl, PICO_MDNS_RECORD_SHARED);
+    txt = pico_mdns_record_create(instance, txtdata, sizeof(txtdata),
+                                  PICO_DNS_TYPE_TXT, ttl, PICO_MDNS_RECORD_UNIQUE);
+    a = pico_mdns_record_create(host, &addr, 4, PICO_DNS_TYPE_A, ttl,
+                                PICO_MDNS_RECORD_UNIQUE);
+    if (!ptr || !txt || !a)
+        exit(1);
+
+    pico_tree_insert(&antree, ptr->record);
+    pico_tree_insert(&antree, txt->record);
+    pico_tree_insert(&antree, a->record);
+    pkt.buf = (uint8_t *)pico_dns_answer_create(&antree, NULL, NULL, &pkt.len);
+    if (!pkt.buf)
+        exit(1);
+
+    pico_tree_destroy(&antree, NULL);
+    pico_mdns_record_delete((void **)&ptr);
+    pico_mdns_record_delete((void **)&txt);
+    pico_mdns_record_delete((void **)&a);
+    return pkt;
+}
+
+/* A query for the TXT record of a local service, with it as known answer
+ * in one out of two queries */
+static struct bench_pkt bench_query(uint32_t i, int known)
+{
+    PICO_DNS_QTREE_DECLARE(qtree);
+    PICO_DNS_RTREE_DECLARE(antree);
+    struct pico_dns_question *q;
+    struct pico_mdns_record *txt = NULL;
+    char instance[64];
+    uint8_t txtdata[16];
+    uint16_t qlen = 0;
+    struct bench_pkt pkt;
+
+    bench_name(instance, sizeof(instance), "local%u._http._tcp.local", i);
+    memset(txtdata, 'y', sizeof(txtdata));
+    txtdata[0] = (uint8_t)(sizeof(txtdata) - 1);
+
+    q = pico_dns_question_create(instance, &qlen, PICO_PROTO_IPV4, PICO_DNS_TYPE_TXT,
+                                 PICO_DNS_CLASS_IN, 0);
+    if (!q)
+        exit(1);
+
+    pico_tree_insert(&qtree, q);
+    if (known) {
+        txt = pico_mdns_record_create(instance, txtdata, sizeof(txtdata),
+                                      PICO_DNS_TYPE_TXT, BENCH_TTL, PICO_MDNS_RECORD_UNIQUE);
+        if (!txt)
+            exit(1);
+
+        pico_tree_insert(&antree, txt->record);
+    }
+
+    pkt.buf = (uint8_t *)pico_dns_query_create(&qtree, &antree, NULL, NULL, &pkt.len);
+    if (!pkt.buf)
+        exit(1);
+
+    pico_tree_destroy(&antree, NULL);
+    if (txt)
+        pico_mdns_record_delete((void **)&txt);
+
+    PICO_DNS_QTREE_DESTROY(&qtree);
+    return pkt;
+}
+
+static void bench_local_records(void)
+{
+    struct pico_mdns_record *txt;
+    char instance[64];
+    uint8_t txtdata[16];
+    uint32_t i;
+
+    memset(txtdata, 'y', sizeof(txtdata));
+    txtdata[0] = (uint8_t)(sizeof(txtdata) - 1);
+    for (i = 0; i < BENCH_LOCAL; i++) {
+        bench_name(instance, sizeof(instance), "local%u._http._tcp.local", i);
+        txt = pico_mdns_record_create(instance, txtdata, sizeof(txtdata),
+                                      PICO_DNS_TYPE_TXT, BENCH_TTL, PICO_MDNS_RECORD_UNIQUE);
+        if (!txt)
+            exit(1);
+
+        txt->flags |= (PICO_MDNS_RECORD_PROBED | PICO_MDNS_RECORD_CLAIMED);
+        if (pico_mdns_table_insert(&MyRecords, txt))
+            exit(1);
+    }
+}
+
+static void bench_feed(const struct bench_pkt *pkt)
+{
+    static uint8_t scratch[PICO_MDNS_MAXBUF * 2];
+
+    /* the socket hands out a fresh copy of each datagram */
+    memcpy(scratch, pkt->buf, pkt->len);
+    pico_mdns_recv(scratch, pkt->len, bench_peer);
+}
+
+static void bench_responses(void)
+{
+    struct bench_pkt *pkts;
+    uint32_t i, r;
+    uint64_t t0, t1;
+
+    pkts = malloc(BENCH_SERVICES * sizeof(struct bench_pkt));
+    if (!pkts)
+        exit(1);
+
+    for (i = 0; i < BENCH_SERVICES; i++)
+        pkts[i] = bench_announcement(i, BENCH_TTL);
+
+    /* first round fills the cache, the next ones refresh it */
+    t0 = bench_now_ns();
+    for (r = 0; r < BENCH_ROUNDS; r++)
+        for (i = 0; i < BENCH_SERVICES; i++)
+            bench_feed(&pkts[i]);
+    t1 = bench_now_ns();
+
+    if (pico_tree_count(&Cache) != BENCH_SERVICES * 3) {
+        fprintf(stderr, "mdns: %d records cached\n", pico_tree_count(&Cache));
+        exit(1);
+    }
+
+    bench_report("mdns", "announcements", bench_rate((uint64_t)BENCH_ROUNDS * BENCH_SERVICES, t0, t1), "pkt/s");
+    for (i = 0; i < BENCH_SERVICES; i++)
+        PICO_FREE(pkts[i].buf);
+    free(pkts);
+}
+
+static void bench_queries(void)
+{
+    struct bench_pkt pkts[64];
+    uint32_t i, seed = 7;
+    uint64_t t0, t1;
+
+    bench_local_records();
+    for (i = 0; i < 64; i++)
+        pkts[i] = bench_query(bench_rand(&seed) % BENCH_LOCAL, (int)(i & 1));
+
+    t0 = bench_now_ns();
+    for (i = 0; i < BENCH_QUERIES; i++)
+        bench_feed(&pkts[i & 63]);
+    t1 = bench_now_ns();
+
+    bench_report("mdns", "queries_known_answers", bench_rate(BENCH_QUERIES, t0, t1), "pkt/s");
+    for (i = 0; i < 64; i++)
+        PICO_FREE(pkts[i].buf);
+}
+
+static void bench_tick(void)
+{
+    uint64_t t0, t1;
+    uint32_t i;
+
+    /* a full cache where nothing is due yet */
+    t0 = bench_now_ns();
+    for (i = 1; i < BENCH_TTL; i++)
+        pico_mdns_cache_check_expiries();
+    t1 = bench_now_ns();
+    if (pico_tree_count(&Cache) != BENCH_SERVICES * 3) {
+        fprintf(stderr, "mdns: %d records cached\n", pico_tree_count(&Cache));
+        exit(1);
+    }
+
+    bench_report("mdns", "tick_full_cache", (double)(t1 - t0) / (BENCH_TTL - 1), "ns");
+
+    /* then everything expires at once */
+    t0 = bench_now_ns();
+    pico_mdns_cache_check_expiries();
+    t1 = bench_now_ns();
+    if (pico_tree_count(&Cache) != 0) {
+        fprintf(stderr, "mdns: %d records left in cache\n", pico_tree_count(&Cache));
+        exit(1);
+    }
+
+    bench_report("mdns", "expiries", bench_rate(BENCH_SERVICES * 3, t0, t1), "rr/s");
+}
+
+#ifdef PICO_SUPPORT_PCAP
+static int (*bench_pcap_poll)(struct pico_device *dev, int loop_score);
+static int bench_pcap_eof;
+static uint32_t bench_pcap_pkts;
+
+/* pcap_dispatch reads nothing once the file is done */
+static int bench_capture_poll(struct pico_device *dev, int loop_score)
+{
+    int left = bench_pcap_poll(dev, loop_score);
+
+    if (left >= loop_score)
+        bench_pcap_eof = 1;
+
+    return left;
+}
+
+/* pico_mdns_event4, counting the datagrams */
+static void bench_capture_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    static uint8_t buf[PICO_MDNS_MAXBUF];
+    struct pico_ip4 peer;
+    uint16_t port;
+    int r;
+
+    if (!(ev & PICO_SOCK_EV_RD))
+        return;
+
+    while ((r = pico_socket_recvfrom(s, buf, PICO_MDNS_MAXBUF, &peer, &port)) > 0) {
+        pico_mdns_recv(buf, r, peer);
+        bench_pcap_pkts++;
+    }
+}
+
+static void bench_capture(char *path)
+{
+    uint8_t mac[6] = {
+        0x02, 0x00, 0x00, 0x00, 0x53, 0x53
+    };
+    struct pico_ip4 addr, netmask;
+    struct pico_ip_mreq mreq;
+    struct pico_device *dev;
+    uint16_t port = short_be(mdns_port);
+    uint64_t t0, t1;
+
+    dev = pico_pcap_create_fromfile(path, "pcap0", mac);
+    if (!dev) {
+        fprintf(stderr, "mdns: cannot open %s\n", path);
+        exit(1);
+    }
+
+    bench_pcap_poll = dev->poll;
+    dev->poll = bench_capture_poll;
+    pico_string_to_ipv4("10.53.0.1", &addr.addr);
+    pico_string_to_ipv4("255.255.0.0", &netmask.addr);
+    if (pico_ipv4_link_add(dev, addr, netmask))
+        exit(1);
+
+    /* The responder's socket, so answers go back out through the device */
+    mdns_sock_ipv4 = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_UDP, bench_capture_wakeup);
+    if (!mdns_sock_ipv4 || pico_socket_bind(mdns_sock_ipv4, &inaddr_any, &port))
+        exit(1);
+
+    pico_string_to_ipv4(PICO_MDNS_DEST_ADDR4, &mreq.mcast_group_addr.ip4.addr);
+    mreq.mcast_link_addr.ip4 = addr;
+    if (pico_socket_setoption(mdns_sock_ipv4, PICO_IP_ADD_MEMBERSHIP, &mreq))
+        exit(1);
+
+    t0 = bench_now_ns();
+    while (!bench_pcap_eof)
+        pico_stack_tick();
+    t1 = bench_now_ns();
+    if (!bench_pcap_pkts) {
+        fprintf(stderr, "mdns: no mDNS packets in %s\n", path);
+        exit(1);
+    }
+
+    bench_report("mdns", "capture_replay", bench_rate(bench_pcap_pkts, t0, t1), "pkt/s");
+    pico_device_destroy(dev);
+}
+#else
+static void bench_capture(char *path)
+{
+    fprintf(stderr, "mdns: %s not replayed, build with PCAP=1\n", path);
+    exit(1);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    pico_stack_init();
+    bench_responses();
+    bench_queries();
+    bench_tick();
+    if (argc > 1)
+        bench_capture(argv[1]);
+
+    pico_mdns_cleanup();
+    return 0;
+}
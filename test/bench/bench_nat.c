@@ -0,0 +1,143 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   NAT (natbox) throughput benchmark: creates a number of flows through
+   the translator and then measures outbound/inbound translations per
+   second with random flow selection.
+ *********************************************************************/
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_udp.h"
+#include "pico_nat.h"
+#include "pico_dev_loop.h"
+#include "bench.h"
+
+#define BENCH_PKTS      1000000
+#define BENCH_IP_PRIV   0x0a280000 /* 10.40.0.0/16 */
+#define BENCH_IP_PUB    0x0a320001 /* 10.50.0.1 */
+#define BENCH_IP_DST    0x08080808
+
+static struct pico_frame *bench_udp_frame(void)
+{
+    struct pico_frame *f = pico_frame_alloc(PICO_SIZE_IP4HDR + PICO_UDPHDR_SIZE + 32);
+    struct pico_ipv4_hdr *net;
+    struct pico_udp_hdr *udp;
+
+    if (!f)
+        exit(1);
+
+    f->net_hdr = f->buffer;
+    f->net_len = PICO_SIZE_IP4HDR;
+    f->transport_hdr = f->buffer + PICO_SIZE_IP4HDR;
+    f->transport_len = PICO_UDPHDR_SIZE + 32;
+    f->payload = f->transport_hdr + PICO_UDPHDR_SIZE;
+    f->payload_len = 32;
+    net = (struct pico_ipv4_hdr *)f->net_hdr;
+    udp = (struct pico_udp_hdr *)f->transport_hdr;
+    net->vhl = 0x45;
+    net->len = short_be((uint16_t)f->buffer_len);
+    net->ttl = 64;
+    net->proto = PICO_PROTO_UDP;
+    udp->len = short_be((uint16_t)f->transport_len);
+    return f;
+}
+
+static void bench_flow_out(struct pico_frame *f, uint32_t flow)
+{
+    struct pico_ipv4_hdr *net = (struct pico_ipv4_hdr *)f->net_hdr;
+    struct pico_udp_hdr *udp = (struct pico_udp_hdr *)f->transport_hdr;
+    net->src.addr = long_be(BENCH_IP_PRIV + 2 + (flow >> 6));
+    net->dst.addr = long_be(BENCH_IP_DST);
+    udp->trans.sport = short_be((uint16_t)(10000 + (flow & 0x3F)));
+    udp->trans.dport = short_be(53);
+}
+
+static void bench_nat_run(struct pico_ip4 *pub, uint32_t flows)
+{
+    struct pico_frame *f = bench_udp_frame();
+    struct pico_ipv4_hdr *net = (struct pico_ipv4_hdr *)f->net_hdr;
+    struct pico_udp_hdr *udp = (struct pico_udp_hdr *)f->transport_hdr;
+    uint16_t *nat_ports = calloc(flows, sizeof(uint16_t));
+    uint32_t seed = 42, i, flow;
+    uint64_t t0, t1;
+    char name[64];
+
+    if (!nat_ports)
+        exit(1);
+
+    t0 = bench_now_ns();
+    for (i = 0; i < flows; i++) {
+        bench_flow_out(f, i);
+        if (pico_ipv4_nat_outbound(f, pub) < 0) {
+            fprintf(stderr, "nat: flow %u not created\n", i);
+            exit(1);
+        }
+
+        nat_ports[i] = udp->trans.sport;
+    }
+    t1 = bench_now_ns();
+    snprintf(name, sizeof(name), "setup_%u_flows", flows);
+    bench_report("nat", name, bench_rate(flows, t0, t1), "flows/s");
+
+    t0 = bench_now_ns();
+    for (i = 0; i < BENCH_PKTS; i++) {
+        flow = bench_rand(&seed) % flows;
+        bench_flow_out(f, flow);
+        pico_ipv4_nat_outbound(f, pub);
+    }
+    t1 = bench_now_ns();
+    snprintf(name, sizeof(name), "outbound_%u_flows", flows);
+    bench_report("nat", name, bench_rate(BENCH_PKTS, t0, t1), "pkt/s");
+
+    t0 = bench_now_ns();
+    for (i = 0; i < BENCH_PKTS; i++) {
+        flow = bench_rand(&seed) % flows;
+        net->src.addr = long_be(BENCH_IP_DST);
+        net->dst.addr = pub->addr;
+        udp->trans.sport = short_be(53);
+        udp->trans.dport = nat_ports[flow];
+        if (pico_ipv4_nat_inbound(f, pub) < 0) {
+            fprintf(stderr, "nat: inbound miss on flow %u\n", flow);
+            exit(1);
+        }
+    }
+    t1 = bench_now_ns();
+    snprintf(name, sizeof(name), "inbound_%u_flows", flows);
+    bench_report("nat", name, bench_rate(BENCH_PKTS, t0, t1), "pkt/s");
+
+    /* Drop the table before the next round */
+    for (i = 0; i < flows; i++)
+        pico_ipv4_port_forward(*pub, nat_ports[i], *pub, 0, PICO_PROTO_UDP, PICO_NAT_PORT_FORWARD_DEL);
+
+    free(nat_ports);
+    pico_frame_discard(f);
+}
+
+int main(void)
+{
+    static const uint32_t flows[] = {
+        100, 1000, 10000, 50000
+    };
+    struct pico_device *dev;
+    struct pico_ip4 pub = {
+        .addr = long_be(BENCH_IP_PUB)
+    };
+    struct pico_ip4 nm = {
+        .addr = long_be(0xFFFF0000)
+    };
+    uint32_t i;
+
+    pico_stack_init();
+    dev = pico_loop_create();
+    if (!dev || pico_ipv4_link_add(dev, pub, nm) < 0)
+        return 1;
+
+    if (pico_ipv4_nat_enable(pico_ipv4_link_get(&pub)) < 0)
+        return 1;
+
+    for (i = 0; i < sizeof(flows) / sizeof(flows[0]); i++)
+        bench_nat_run(&pub, flows[i]);
+
+    return 0;
+}
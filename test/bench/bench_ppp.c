@@ -0,0 +1,216 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   PPP HDLC framing benchmark: FCS-16, TX framing into the device ring and
+   RX unescaping of a byte stream delivered in UART sized chunks.
+   The device is driven directly, without a modem or LCP negotiation.
+ *********************************************************************/
+#include "pico_stack.h"
+#include "modules/pico_dev_ppp.c"
+#include "bench.h"
+
+#define BENCH_FRAMES    20000
+#define BENCH_PAYLOAD   1400
+#define BENCH_FCS_BYTES (64u * 1024u * 1024u)
+
+static struct pico_device_ppp bench_dev;
+static struct pico_queue bench_q_in;
+static uint32_t bench_chunk;
+static uint64_t bench_tx_bytes;
+
+static uint8_t *bench_stream;
+static uint32_t bench_stream_len;
+static uint32_t bench_stream_pos;
+
+/* Bit by bit FCS-16, as a reference */
+static uint16_t bench_fcs_bitwise(uint16_t fcs, const uint8_t *buf, uint32_t len)
+{
+    uint32_t i;
+    int b;
+
+    for (i = 0; i < len; i++) {
+        fcs ^= buf[i];
+        for (b = 0; b < 8; b++)
+            fcs = (fcs & 1u) ? (uint16_t)((fcs >> 1) ^ 0x8408u) : (uint16_t)(fcs >> 1);
+    }
+    return fcs;
+}
+
+static int bench_serial_send(struct pico_device *dev, const void *buf, int len)
+{
+    IGNORE_PARAMETER(dev);
+    IGNORE_PARAMETER(buf);
+    if ((uint32_t)len > bench_chunk)
+        len = (int)bench_chunk;
+
+    bench_tx_bytes += (uint64_t)len;
+    return len;
+}
+
+static int bench_serial_record(struct pico_device *dev, const void *buf, int len)
+{
+    IGNORE_PARAMETER(dev);
+    memcpy(bench_stream + bench_stream_len, buf, (size_t)len);
+    bench_stream_len += (uint32_t)len;
+    return len;
+}
+
+static int bench_serial_recv(struct pico_device *dev, void *buf, int len)
+{
+    uint32_t n = bench_stream_len - bench_stream_pos;
+
+    IGNORE_PARAMETER(dev);
+    if (n > bench_chunk)
+        n = bench_chunk;
+
+    if (n > (uint32_t)len)
+        n = (uint32_t)len;
+
+    memcpy(buf, bench_stream + bench_stream_pos, n);
+    bench_stream_pos += n;
+    return (int)n;
+}
+
+static void bench_dev_init(void)
+{
+    memset(&bench_dev, 0, sizeof(bench_dev));
+    memset(&bench_q_in, 0, sizeof(bench_q_in));
+    bench_dev.dev.q_in = &bench_q_in;
+    bench_dev.ipcp_state = PPP_IPCP_STATE_OPENED;
+    bench_dev.modem_state = PPP_MODEM_STATE_CONNECTED;
+    ppp_rx_reset(&bench_dev);
+}
+
+static void bench_payload(uint8_t *buf, uint32_t len)
+{
+    uint32_t seed = 3, i;
+
+    /* random bytes: about 1 in 128 needs escaping */
+    for (i = 0; i < len; i++)
+        buf[i] = (uint8_t)bench_rand(&seed);
+}
+
+static void bench_fcs(void)
+{
+    uint8_t buf[2048];
+    uint32_t i, rounds = BENCH_FCS_BYTES / sizeof(buf);
+    volatile uint16_t sink = 0;
+    uint64_t t0, t1;
+
+    bench_payload(buf, sizeof(buf));
+    if (ppp_fcs_start(buf, sizeof(buf)) != bench_fcs_bitwise(0xFFFF, buf, sizeof(buf))) {
+        fprintf(stderr, "ppp: FCS mismatch\n");
+        exit(1);
+    }
+
+    t0 = bench_now_ns();
+    for (i = 0; i < rounds; i++)
+        sink = (uint16_t)(sink + bench_fcs_bitwise(0xFFFF, buf, sizeof(buf)));
+    t1 = bench_now_ns();
+    bench_report("ppp", "fcs16_bitwise", bench_rate(BENCH_FCS_BYTES, t0, t1) / 1e6, "MB/s");
+
+    t0 = bench_now_ns();
+    for (i = 0; i < rounds; i++)
+        sink = (uint16_t)(sink + ppp_fcs_start(buf, sizeof(buf)));
+    t1 = bench_now_ns();
+    bench_report("ppp", "fcs16_table", bench_rate(BENCH_FCS_BYTES, t0, t1) / 1e6, "MB/s");
+    (void)sink;
+}
+
+static void bench_tx(uint32_t chunk)
+{
+    uint8_t payload[BENCH_PAYLOAD];
+    uint32_t i, sent = 0;
+    uint64_t t0, t1;
+    char name[64];
+
+    bench_payload(payload, sizeof(payload));
+    bench_dev_init();
+    bench_dev.serial_send = bench_serial_send;
+    bench_chunk = chunk;
+    bench_tx_bytes = 0;
+
+    t0 = bench_now_ns();
+    for (i = 0; i < BENCH_FRAMES; i++) {
+        /* the line takes one chunk per call, as a UART FIFO would */
+        while (pico_ppp_send(&bench_dev.dev, payload, sizeof(payload)) == 0)
+            ppp_tx_flush(&bench_dev);
+        sent++;
+    }
+    while (bench_dev.tx_len)
+        ppp_tx_flush(&bench_dev);
+    t1 = bench_now_ns();
+
+    snprintf(name, sizeof(name), "tx_chunk_%u", chunk);
+    bench_report("ppp", name, bench_rate((uint64_t)sent * BENCH_PAYLOAD * 8u, t0, t1) / 1e6, "Mbit/s");
+}
+
+static void bench_rx(uint32_t chunk)
+{
+    uint8_t payload[BENCH_PAYLOAD];
+    struct pico_frame *f;
+    uint32_t i, frames = 0, bad = 0;
+    uint64_t t0, t1;
+    char name[64];
+
+    bench_payload(payload, sizeof(payload));
+
+    /* encode the stream once */
+    bench_dev_init();
+    bench_stream = malloc((size_t)BENCH_FRAMES * (BENCH_PAYLOAD * 2u + 16u));
+    if (!bench_stream)
+        exit(1);
+
+    bench_stream_len = 0;
+    bench_dev.serial_send = bench_serial_record;
+    for (i = 0; i < BENCH_FRAMES; i++)
+        pico_ppp_send(&bench_dev.dev, payload, sizeof(payload));
+
+    bench_dev_init();
+    bench_dev.serial_recv = bench_serial_recv;
+    bench_stream_pos = 0;
+    bench_chunk = chunk;
+
+    t0 = bench_now_ns();
+    while (bench_stream_pos < bench_stream_len || bench_dev.rx_chunk_pos < bench_dev.rx_chunk_len) {
+        pico_ppp_poll(&bench_dev.dev, 64);
+        while ((f = pico_dequeue(&bench_q_in)) != NULL) {
+            if (f->len != BENCH_PAYLOAD)
+                bad++;
+
+            frames++;
+            pico_frame_discard(f);
+        }
+    }
+    t1 = bench_now_ns();
+
+    if (frames != BENCH_FRAMES || bad) {
+        fprintf(stderr, "ppp: %u frames received, %u bad\n", frames, bad);
+        exit(1);
+    }
+
+    snprintf(name, sizeof(name), "rx_chunk_%u", chunk);
+    bench_report("ppp", name, bench_rate((uint64_t)frames * BENCH_PAYLOAD * 8u, t0, t1) / 1e6, "Mbit/s");
+    if (bench_dev.rx_frame)
+        pico_frame_discard(bench_dev.rx_frame);
+
+    free(bench_stream);
+}
+
+int main(void)
+{
+    static const uint32_t chunks[] = {
+        16, 64, 256
+    };
+    uint32_t i;
+
+    bench_fcs();
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+        bench_tx(chunks[i]);
+
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+        bench_rx(chunks[i]);
+
+    return 0;
+}
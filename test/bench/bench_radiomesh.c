@@ -0,0 +1,173 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   6LoWPAN benchmark on the in-process radio medium: a 32 by 32 grid of
+   nodes on one stack. Every node joins a link-local group and sends it a
+   datagram that fits in one frame, then a subset sends one that needs
+   fragmentation. Each node hears its grid neighbours, one millisecond
+   of medium time per stack tick.
+ *********************************************************************/
+#include "pico_stack.h"
+#include "pico_socket.h"
+#include "pico_ipv6.h"
+#include "pico_dev_radiomesh.h"
+#include "bench.h"
+
+#define BENCH_SIDE          32u
+#define BENCH_NODES         (BENCH_SIDE * BENCH_SIDE)
+#define BENCH_PORT          5000
+#define BENCH_SMALL         24
+#define BENCH_LARGE         400
+#define BENCH_FRAG_SENDERS  64u
+
+static struct pico_ip6 bench_group = {{ 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x12, 0x34 }};
+
+static uint32_t bench_received = 0;
+static uint8_t bench_buf[BENCH_LARGE];
+
+static void bench_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    if (ev & PICO_SOCK_EV_RD) {
+        while (pico_socket_recvfrom(s, bench_buf, sizeof(bench_buf), NULL, NULL) > 0)
+            bench_received++;
+    }
+}
+
+static uint32_t bench_degree(uint32_t id)
+{
+    uint32_t x = id % BENCH_SIDE, y = id / BENCH_SIDE, d = 0;
+
+    if (x > 0)
+        d++;
+    if (x + 1 < BENCH_SIDE)
+        d++;
+    if (y > 0)
+        d++;
+    if (y + 1 < BENCH_SIDE)
+        d++;
+    return d;
+}
+
+/* Ticks until every neighbour got its copy, returns the medium time used */
+static pico_time bench_run(struct pico_radiomesh *mesh, uint32_t expected)
+{
+    pico_time start = pico_radiomesh_time(mesh);
+    uint32_t idle = 0, last = bench_received;
+
+    while (bench_received < expected && idle < 1000) {
+        pico_stack_tick();
+        pico_radiomesh_advance(mesh, 1);
+        if (bench_received == last) {
+            idle++;
+        } else {
+            idle = 0;
+            last = bench_received;
+        }
+    }
+    return pico_radiomesh_time(mesh) - start;
+}
+
+static void bench_flood(struct pico_radiomesh *mesh, struct pico_socket *s, struct pico_device **nodes,
+                        const char *name, uint32_t senders, uint32_t stride, int len)
+{
+    struct pico_radiomesh_stats before, after;
+    struct pico_msginfo info = { 0 };
+    uint32_t i, expected = 0;
+    uint64_t t0, t1;
+    pico_time vt;
+    char label[64];
+
+    pico_radiomesh_get_stats(mesh, &before);
+    bench_received = 0;
+    t0 = bench_now_ns();
+    for (i = 0; i < senders; i++) {
+        info.dev = nodes[i * stride];
+        expected += bench_degree(i * stride);
+        if (pico_socket_sendto_extended(s, bench_buf, len, &bench_group, short_be(BENCH_PORT), &info) != len) {
+            fprintf(stderr, "radiomesh: send from node %u failed\n", i * stride);
+            exit(1);
+        }
+    }
+    vt = bench_run(mesh, expected);
+    t1 = bench_now_ns();
+    pico_radiomesh_get_stats(mesh, &after);
+
+    snprintf(label, sizeof(label), "%s_datagrams", name);
+    bench_report("radiomesh", label, bench_rate(bench_received, t0, t1), "dgram/s");
+    snprintf(label, sizeof(label), "%s_frames", name);
+    bench_report("radiomesh", label, bench_rate(after.delivered - before.delivered, t0, t1), "frame/s");
+    snprintf(label, sizeof(label), "%s_delivery", name);
+    bench_report("radiomesh", label, 100.0 * (double)bench_received / (double)expected, "%");
+    snprintf(label, sizeof(label), "%s_medium_time", name);
+    bench_report("radiomesh", label, (double)vt, "ms");
+}
+
+int main(void)
+{
+    struct pico_radiomesh *mesh;
+    struct pico_device **nodes;
+    struct pico_socket *s, *tx;
+    struct pico_ip6 any = {{ 0 }};
+    struct pico_ip_mreq mreq;
+    uint16_t port = short_be(BENCH_PORT);
+    uint8_t loop = 1;
+    uint64_t t0, t1;
+    uint32_t i;
+
+    bench_init();
+    pico_stack_init();
+    mesh = pico_radiomesh_create(1);
+    nodes = malloc(BENCH_NODES * sizeof(struct pico_device *));
+    if (!mesh || !nodes)
+        return 1;
+
+    t0 = bench_now_ns();
+    for (i = 0; i < BENCH_NODES; i++) {
+        nodes[i] = pico_radiomesh_node_add(mesh, (uint16_t)i);
+        if (!nodes[i])
+            return 1;
+    }
+    if (pico_radiomesh_grid(mesh, BENCH_SIDE, BENCH_SIDE, 0, 1) < 0)
+        return 1;
+
+    t1 = bench_now_ns();
+    bench_report("radiomesh", "setup_1024_nodes", (double)(t1 - t0) / 1e6, "ms");
+
+    s = pico_socket_open(PICO_PROTO_IPV6, PICO_PROTO_UDP, bench_wakeup);
+    if (!s || pico_socket_bind(s, &any, &port) < 0)
+        return 1;
+
+    /* Every sender is an address of this stack */
+    if (pico_socket_setoption(s, PICO_IP_MULTICAST_LOOP, &loop) < 0)
+        return 1;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mcast_group_addr.ip6 = bench_group;
+    for (i = 0; i < BENCH_NODES; i++) {
+        mreq.mcast_link_addr.ip6 = pico_ipv6_linklocal_get(nodes[i])->address;
+        if (pico_socket_setoption(s, PICO_IP_ADD_MEMBERSHIP, &mreq) < 0)
+            return 1;
+    }
+
+    /* Sending sets the local address, which would narrow down what s accepts */
+    tx = pico_socket_open(PICO_PROTO_IPV6, PICO_PROTO_UDP, NULL);
+    if (!tx)
+        return 1;
+
+    /* Let the membership reports of all nodes go by */
+    for (i = 0; i < 200; i++) {
+        pico_stack_tick();
+        pico_radiomesh_advance(mesh, 1);
+    }
+
+    memset(bench_buf, 0x5a, sizeof(bench_buf));
+    bench_flood(mesh, tx, nodes, "single_frame", BENCH_NODES, 1, BENCH_SMALL);
+    bench_flood(mesh, tx, nodes, "fragmented", BENCH_FRAG_SENDERS, BENCH_NODES / BENCH_FRAG_SENDERS, BENCH_LARGE);
+
+    pico_socket_close(tx);
+    pico_socket_close(s);
+    pico_radiomesh_destroy(mesh);
+    free(nodes);
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   TFTP transfer benchmark: a client writes a firmware sized image to the
+   server of the same stack over the loop device, with and without the
+   blksize and windowsize options.
+ *********************************************************************/
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_dev_loop.h"
+#include "pico_tftp.h"
+#include "bench.h"
+
+#define BENCH_IMAGE_SIZE    (4u * 1024u * 1024u)
+
+static uint8_t *bench_image;
+static uint32_t bench_tx_pos;
+static uint32_t bench_rx_pos;
+static uint32_t bench_rx_bad;
+static int bench_done;
+static int bench_error;
+
+static int bench_tx_cb(struct pico_tftp_session *session, uint16_t event, uint8_t *block, int32_t len, void *arg)
+{
+    int32_t blksize = PICO_TFTP_PAYLOAD_SIZE;
+    uint32_t n;
+
+    (void)block;
+    (void)len;
+    (void)arg;
+    if (event != PICO_TFTP_EV_OK && event != PICO_TFTP_EV_OPT) {
+        bench_error = 1;
+        return 0;
+    }
+
+    pico_tftp_get_option(session, PICO_TFTP_OPTION_BLKSIZE, &blksize);
+    n = BENCH_IMAGE_SIZE - bench_tx_pos;
+    if (n > (uint32_t)blksize)
+        n = (uint32_t)blksize;
+
+    if (pico_tftp_send(session, bench_image + bench_tx_pos, (int32_t)n) >= 0)
+        bench_tx_pos += n;
+
+    return 0;
+}
+
+static int bench_rx_cb(struct pico_tftp_session *session, uint16_t event, uint8_t *block, int32_t len, void *arg)
+{
+    int32_t blksize = PICO_TFTP_PAYLOAD_SIZE;
+
+    (void)arg;
+    if (event == PICO_TFTP_EV_OPT)
+        return 0;
+
+    if (event != PICO_TFTP_EV_OK) {
+        bench_error = 1;
+        return 0;
+    }
+
+    if ((bench_rx_pos + (uint32_t)len > BENCH_IMAGE_SIZE) || memcmp(bench_image + bench_rx_pos, block, (size_t)len))
+        bench_rx_bad++;
+
+    bench_rx_pos += (uint32_t)len;
+    pico_tftp_get_option(session, PICO_TFTP_OPTION_BLKSIZE, &blksize);
+    if (len < blksize)
+        bench_done = 1;
+
+    return 0;
+}
+
+static void bench_listen_cb(union pico_address *addr, uint16_t port, uint16_t opcode, char *filename, int32_t len)
+{
+    struct pico_tftp_session *session;
+    int options;
+    uint8_t timeout;
+    int32_t filesize;
+    uint16_t blksize, windowsize;
+
+    if (opcode != PICO_TFTP_WRQ ||
+        pico_tftp_parse_request_opts(filename, len, &options, &timeout, &filesize, &blksize, &windowsize)) {
+        pico_tftp_reject_request(addr, port, TFTP_ERR_EOPT, "Bad request");
+        return;
+    }
+
+    session = pico_tftp_session_setup(addr, PICO_PROTO_IPV4);
+    if (!session) {
+        bench_error = 1;
+        return;
+    }
+
+    if (options & PICO_TFTP_OPTION_BLKSIZE)
+        pico_tftp_set_option(session, PICO_TFTP_OPTION_BLKSIZE, blksize);
+
+    if (options & PICO_TFTP_OPTION_WINDOWSIZE)
+        pico_tftp_set_option(session, PICO_TFTP_OPTION_WINDOWSIZE, windowsize);
+
+    pico_tftp_start_rx(session, port, filename, bench_rx_cb, NULL);
+}
+
+static void bench_transfer(union pico_address *server, uint16_t blksize, uint16_t windowsize)
+{
+    struct pico_tftp_session *session;
+    uint64_t t0, t1;
+    char name[64];
+
+    bench_tx_pos = 0;
+    bench_rx_pos = 0;
+    bench_rx_bad = 0;
+    bench_done = 0;
+    bench_error = 0;
+
+    session = pico_tftp_session_setup(server, PICO_PROTO_IPV4);
+    if (!session)
+        exit(1);
+
+    if (blksize != PICO_TFTP_PAYLOAD_SIZE)
+        pico_tftp_set_option(session, PICO_TFTP_OPTION_BLKSIZE, blksize);
+
+    if (windowsize > 1)
+        pico_tftp_set_option(session, PICO_TFTP_OPTION_WINDOWSIZE, windowsize);
+
+    t0 = bench_now_ns();
+    if (pico_tftp_start_tx(session, short_be(PICO_TFTP_PORT), "firmware.bin", bench_tx_cb, NULL) < 0)
+        exit(1);
+
+    while (!bench_done && !bench_error)
+        pico_stack_tick();
+    t1 = bench_now_ns();
+
+    if (bench_error || bench_rx_bad || bench_rx_pos != BENCH_IMAGE_SIZE) {
+        fprintf(stderr, "tftp: %u of %u bytes received, %u bad blocks\n", bench_rx_pos, BENCH_IMAGE_SIZE, bench_rx_bad);
+        exit(1);
+    }
+
+    snprintf(name, sizeof(name), "write_blksize_%u_window_%u", blksize, windowsize);
+    bench_report("tftp", name, bench_rate((uint64_t)BENCH_IMAGE_SIZE * 8u, t0, t1) / 1e6, "Mbit/s");
+
+    /* let both sessions close */
+    t0 = bench_now_ns();
+    while (bench_now_ns() - t0 < 20000000ull)
+        pico_stack_tick();
+}
+
+int main(void)
+{
+    static const uint16_t combos[][2] = {
+        { PICO_TFTP_PAYLOAD_SIZE, 1 },
+        { PICO_TFTP_MAX_BLKSIZE, 1 },
+        { PICO_TFTP_MAX_BLKSIZE, 8 },
+        { PICO_TFTP_MAX_BLKSIZE, PICO_TFTP_MAX_WINDOWSIZE }
+    };
+    struct pico_device *loop;
+    struct pico_ip4 addr, netmask;
+    union pico_address server;
+    uint32_t seed = 7, i;
+
+    bench_image = malloc(BENCH_IMAGE_SIZE);
+    if (!bench_image)
+        return 1;
+
+    for (i = 0; i < BENCH_IMAGE_SIZE; i++)
+        bench_image[i] = (uint8_t)bench_rand(&seed);
+
+    pico_stack_init();
+    loop = pico_loop_create();
+    if (!loop)
+        return 1;
+
+    addr.addr = long_be(0x7F000001);
+    netmask.addr = long_be(0xFF000000);
+    pico_ipv4_link_add(loop, addr, netmask);
+    server.ip4 = addr;
+
+    if (pico_tftp_listen(PICO_PROTO_IPV4, bench_listen_cb) < 0)
+        return 1;
+
+    for (i = 0; i < sizeof(combos) / sizeof(combos[0]); i++)
+        bench_transfer(&server, combos[i][0], combos[i][1]);
+
+    free(bench_image);
+    return 0;
+}
@@ -0,0 +1,556 @@
+/*********************************************************************
+   PicoTCP. Copyright (c) 2012-2017 Altran Intelligent Systems. Some rights reserved.
+   See COPYING, LICENSE.GPLv2 and LICENSE.GPLv3 for usage.
+
+   TCP and UDP benchmark over pipe devices, on simulated time.
+   Both ends are sockets of this stack, one on each end of a pipe. The
+   stack runs under pico_simtime, so link delays and timers cost no wall
+   time and the protocol side of the results is the same on every run:
+     - "sim" units are measured on the simulated clock and only change
+       when the protocol behaves differently (window, recovery, timers).
+     - The others are wall clock and measure the CPU the stack spends, on
+       links with no bandwidth or delay limit.
+   Bulk goodput stays well below the link rate. The socket buffers cap it,
+   or with 256K buffers the congestion window does: ssthresh starts from
+   PICO_DEFAULT_SOCKETQ, and past it cwnd grows one segment per round
+   trip. Recovery resends everything from the lost segment on
+   (go-back-N), so "retrans" counts about a window per loss.
+   Compare two runs with test/bench/bench_compare.sh.
+ *********************************************************************/
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_socket.h"
+#include "pico_tcp.h"
+#include "pico_dev_pipe.h"
+#include "pico_simtime.h"
+#include "bench.h"
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define BENCH_HEAP_USED() ((uint64_t)mallinfo2().uordblks)
+#endif
+
+#define BENCH_PORT          5001
+#define BENCH_BUFSIZE       (256u * 1024u)
+#define BENCH_BULK_SIM      (4u * 1024u * 1024u)
+#define BENCH_BULK_CPU      (32u * 1024u * 1024u)
+#define BENCH_RR_N          2000u
+#define BENCH_RR_LEN        64u
+#define BENCH_UDP_N         200000u
+#define BENCH_UDP_WINDOW    64u
+#define BENCH_CONN_N        2000u
+#define BENCH_CONN_BATCH    100u                /* the timer heap is bounded, let TIME_WAIT drain */
+#define BENCH_MEM_CONN      128u
+#define BENCH_TIMEOUT       (3600u * 1000u)     /* simulated ms */
+
+struct bench_net {
+    struct pico_device *a, *b;
+    struct pico_ip4 a_addr, b_addr;
+};
+
+/* One case at a time: the sockets and counters of the running case */
+static struct {
+    struct pico_socket *listen, *cli, *srv;
+    uint64_t total, sent, rcvd;
+    uint32_t conns, closed;
+    uint32_t bufsize;
+    int nodelay;
+    /* request/response */
+    uint32_t rr_done, rr_got;
+    pico_time rr_sim;
+    uint64_t rr_wall;
+    uint32_t rr_lat_sim[BENCH_RR_N];
+    uint64_t rr_lat_wall[BENCH_RR_N];
+} B;
+
+static uint8_t bench_buf[64 * 1024];
+static uint32_t bench_subnet;
+
+static void bench_fail(const char *what)
+{
+    fprintf(stderr, "throughput: %s\n", what);
+    exit(1);
+}
+
+/* a and b on 10.60.<n>.0/24, each reaching the other through the pipe */
+static void bench_net_up(struct bench_net *n, const struct pico_pipe_link *link, uint32_t mtu)
+{
+    struct pico_ip4 mask, host, any;
+    char na[16], nb[16];
+
+    bench_subnet++;
+    snprintf(na, sizeof(na), "tpa%u", bench_subnet);
+    snprintf(nb, sizeof(nb), "tpb%u", bench_subnet);
+    n->a = pico_pipe_create(na, nb, link, &n->b);
+    if (!n->a)
+        bench_fail("pipe");
+
+    if (mtu) {
+        n->a->mtu = mtu;
+        n->b->mtu = mtu;
+    }
+
+    n->a_addr.addr = long_be(0x0A3C0001u | (bench_subnet << 8));
+    n->b_addr.addr = long_be(0x0A3C0002u | (bench_subnet << 8));
+    mask.addr = long_be(0xFFFFFF00u);
+    host.addr = 0xFFFFFFFFu;
+    any.addr = 0;
+    if (pico_ipv4_link_add(n->a, n->a_addr, mask) || pico_ipv4_link_add(n->b, n->b_addr, mask) ||
+        pico_ipv4_route_add(n->b_addr, host, any, 1, pico_ipv4_link_get(&n->a_addr)) ||
+        pico_ipv4_route_add(n->a_addr, host, any, 1, pico_ipv4_link_get(&n->b_addr)))
+        bench_fail("addresses");
+}
+
+static void bench_net_down(struct bench_net *n)
+{
+    /* Let the closes play out before the devices go */
+    pico_simtime_run(BENCH_TIMEOUT, NULL, NULL);
+    pico_device_destroy(n->a);
+    pico_device_destroy(n->b);
+}
+
+static void bench_setopts(struct pico_socket *s, uint16_t proto)
+{
+    uint32_t size = B.bufsize ? B.bufsize : BENCH_BUFSIZE;
+    int nodelay = B.nodelay;
+
+    pico_socket_setoption(s, PICO_SOCKET_OPT_RCVBUF, &size);
+    pico_socket_setoption(s, PICO_SOCKET_OPT_SNDBUF, &size);
+    if (proto == PICO_PROTO_TCP)
+        pico_socket_setoption(s, PICO_TCP_NODELAY, &nodelay);
+}
+
+static struct pico_socket *bench_listen(struct bench_net *n, uint16_t proto, void (*wakeup)(uint16_t, struct pico_socket *))
+{
+    struct pico_socket *s = pico_socket_open(PICO_PROTO_IPV4, proto, wakeup);
+    uint16_t port = short_be(BENCH_PORT);
+
+    if (!s || pico_socket_bind(s, &n->b_addr, &port))
+        bench_fail("bind");
+
+    bench_setopts(s, proto);
+    if ((proto == PICO_PROTO_TCP) && pico_socket_listen(s, BENCH_MEM_CONN))
+        bench_fail("listen");
+
+    return s;
+}
+
+static struct pico_socket *bench_connect(struct bench_net *n, void (*wakeup)(uint16_t, struct pico_socket *))
+{
+    struct pico_socket *s = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_TCP, wakeup);
+
+    if (!s)
+        bench_fail("socket");
+
+    bench_setopts(s, PICO_PROTO_TCP);
+    if (pico_socket_connect(s, &n->b_addr, short_be(BENCH_PORT)))
+        bench_fail("connect");
+
+    return s;
+}
+
+/* Server side: accepts, reads everything, echoes it back if asked to */
+static int bench_echo;
+
+static void bench_srv_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    struct pico_ip4 peer;
+    uint16_t port;
+    int r;
+
+    if (ev & PICO_SOCK_EV_CONN) {
+        B.srv = pico_socket_accept(s, &peer, &port);
+        if (!B.srv)
+            bench_fail("accept");
+
+        B.conns++;
+        return;
+    }
+
+    if (ev & PICO_SOCK_EV_RD) {
+        while ((r = pico_socket_read(s, bench_buf, (int)sizeof(bench_buf))) > 0) {
+            B.rcvd += (uint64_t)r;
+            if (bench_echo && (pico_socket_write(s, bench_buf, r) != r))
+                bench_fail("echo");
+        }
+    }
+
+    if (ev & PICO_SOCK_EV_CLOSE)
+        pico_socket_close(s);
+}
+
+/* Bulk transfer, client to server */
+
+static void bench_bulk_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    uint64_t left;
+    int w;
+
+    if (!(ev & (PICO_SOCK_EV_CONN | PICO_SOCK_EV_WR)))
+        return;
+
+    while (B.sent < B.total) {
+        left = B.total - B.sent;
+        w = pico_socket_write(s, bench_buf, (int)((left < sizeof(bench_buf)) ? left : sizeof(bench_buf)));
+        if (w <= 0)
+            break;
+
+        B.sent += (uint64_t)w;
+    }
+}
+
+static int bench_bulk_done(void *arg)
+{
+    (void)arg;
+    return B.rcvd == B.total;
+}
+
+static void bench_bulk(const char *name, const struct pico_pipe_link *link, uint32_t mtu, uint32_t bufsize, uint64_t total)
+{
+    struct pico_tcp_info info;
+    struct bench_net n;
+    pico_time t0;
+    uint64_t w0, w1;
+    char label[64];
+
+    memset(&B, 0, sizeof(B));
+    B.total = total;
+    B.bufsize = bufsize;
+    bench_echo = 0;
+    bench_net_up(&n, link, mtu);
+    B.listen = bench_listen(&n, PICO_PROTO_TCP, bench_srv_wakeup);
+
+    t0 = pico_simtime_now();
+    w0 = bench_now_ns();
+    B.cli = bench_connect(&n, bench_bulk_wakeup);
+    if (pico_simtime_run(BENCH_TIMEOUT, bench_bulk_done, NULL) != 1)
+        bench_fail(name);
+
+    w1 = bench_now_ns();
+    pico_tcp_get_info(B.cli, &info);
+    if (link->bandwidth) {
+        snprintf(label, sizeof(label), "%s_goodput", name);
+        bench_report("tcp_bulk", label, (double)total * 8.0 / 1000.0 / (double)(pico_simtime_now() - t0), "sim_Mbit/s");
+        snprintf(label, sizeof(label), "%s_retrans", name);
+        bench_report("tcp_bulk", label, (double)info.retrans, "sim_segments");
+    } else {
+        bench_report("tcp_bulk", name, bench_rate(total, w0, w1) / 1e6, "MB/s");
+    }
+
+    pico_socket_close(B.cli);
+    pico_socket_close(B.listen);
+    bench_net_down(&n);
+}
+
+/* Request/response: one BENCH_RR_LEN request at a time, echoed back */
+
+static void bench_rr_send(struct pico_socket *s)
+{
+    B.rr_got = 0;
+    B.rr_sim = pico_simtime_now();
+    B.rr_wall = bench_now_ns();
+    /* Header, then body: the second write is where Nagle waits */
+    if ((pico_socket_write(s, bench_buf, BENCH_RR_LEN / 4) != BENCH_RR_LEN / 4) ||
+        (pico_socket_write(s, bench_buf, BENCH_RR_LEN - BENCH_RR_LEN / 4) != BENCH_RR_LEN - BENCH_RR_LEN / 4))
+        bench_fail("request");
+}
+
+static void bench_rr_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    uint8_t resp[BENCH_RR_LEN];
+    int r;
+
+    if (ev & PICO_SOCK_EV_CONN)
+        bench_rr_send(s);
+
+    if (!(ev & PICO_SOCK_EV_RD))
+        return;
+
+    while ((r = pico_socket_read(s, resp, (int)sizeof(resp))) > 0) {
+        B.rr_got += (uint32_t)r;
+        if (B.rr_got < BENCH_RR_LEN)
+            continue;
+
+        B.rr_lat_sim[B.rr_done] = (uint32_t)(pico_simtime_now() - B.rr_sim);
+        B.rr_lat_wall[B.rr_done] = bench_now_ns() - B.rr_wall;
+        if (++B.rr_done < BENCH_RR_N)
+            bench_rr_send(s);
+    }
+}
+
+static int bench_rr_done(void *arg)
+{
+    (void)arg;
+    return B.rr_done == BENCH_RR_N;
+}
+
+static int bench_cmp32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int bench_cmp64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_rr(const char *name, const struct pico_pipe_link *link, int nodelay)
+{
+    static const uint32_t pct[] = {
+        50, 90, 99
+    };
+    struct bench_net n;
+    char label[64];
+    uint32_t i, at;
+
+    memset(&B, 0, sizeof(B));
+    B.nodelay = nodelay;
+    bench_echo = 1;
+    bench_net_up(&n, link, 0);
+    B.listen = bench_listen(&n, PICO_PROTO_TCP, bench_srv_wakeup);
+    B.cli = bench_connect(&n, bench_rr_wakeup);
+    if (pico_simtime_run(BENCH_TIMEOUT, bench_rr_done, NULL) != 1)
+        bench_fail(name);
+
+    qsort(B.rr_lat_sim, BENCH_RR_N, sizeof(B.rr_lat_sim[0]), bench_cmp32);
+    qsort(B.rr_lat_wall, BENCH_RR_N, sizeof(B.rr_lat_wall[0]), bench_cmp64);
+    for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+        at = (BENCH_RR_N * pct[i]) / 100u;
+        snprintf(label, sizeof(label), "%s_p%u", name, pct[i]);
+        if (link->delay)
+            bench_report("tcp_rr", label, (double)B.rr_lat_sim[at], "sim_ms");
+        else
+            bench_report("tcp_rr", label, (double)B.rr_lat_wall[at] / 1000.0, "us");
+    }
+
+    pico_socket_close(B.cli);
+    pico_socket_close(B.listen);
+    bench_net_down(&n);
+}
+
+/* Connection setup: connect, wait for the handshake, close, next */
+
+static void bench_conn_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    if (ev & PICO_SOCK_EV_CONN) {
+        B.closed++;
+        pico_socket_close(s);
+    }
+}
+
+static struct bench_net *bench_conn_net;
+
+static int bench_conn_done(void *arg)
+{
+    (void)arg;
+    if (B.closed == B.total)
+        return 1;
+
+    /* One connection at a time */
+    if (B.conns == B.closed && B.sent == B.closed) {
+        bench_connect(bench_conn_net, bench_conn_wakeup);
+        B.sent++;
+    }
+
+    return 0;
+}
+
+static void bench_conn(void)
+{
+    struct pico_pipe_link link = {
+        0
+    };
+    struct bench_net n;
+    uint64_t w0, wall = 0;
+
+    memset(&B, 0, sizeof(B));
+    bench_echo = 0;
+    bench_net_up(&n, &link, 0);
+    bench_conn_net = &n;
+    B.listen = bench_listen(&n, PICO_PROTO_TCP, bench_srv_wakeup);
+
+    while (B.total < BENCH_CONN_N) {
+        B.total += BENCH_CONN_BATCH;
+        w0 = bench_now_ns();
+        if (pico_simtime_run(BENCH_TIMEOUT, bench_conn_done, NULL) != 1)
+            bench_fail("conn");
+
+        wall += bench_now_ns() - w0;
+        pico_simtime_run(10 * PICO_SOCKET_LINGER_TIMEOUT, NULL, NULL);
+    }
+
+    bench_report("tcp_conn", "setup_rate", bench_rate(BENCH_CONN_N, 0, wall), "conn/s");
+    pico_socket_close(B.listen);
+    bench_net_down(&n);
+}
+
+/* Memory held by established connections, both ends counted */
+
+static void bench_mem_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    (void)s;
+    if (ev & PICO_SOCK_EV_CONN)
+        B.closed++;
+}
+
+static int bench_mem_done(void *arg)
+{
+    (void)arg;
+    return (B.conns == BENCH_MEM_CONN) && (B.closed == BENCH_MEM_CONN);
+}
+
+static void bench_mem(void)
+{
+#ifdef BENCH_HEAP_USED
+    struct pico_pipe_link link = {
+        0
+    };
+    static struct pico_socket *cli[BENCH_MEM_CONN];
+    struct bench_net n;
+    uint64_t before, after;
+    uint32_t i;
+
+    memset(&B, 0, sizeof(B));
+    bench_echo = 0;
+    bench_net_up(&n, &link, 0);
+    B.listen = bench_listen(&n, PICO_PROTO_TCP, bench_srv_wakeup);
+    pico_simtime_run(BENCH_TIMEOUT, NULL, NULL);
+
+    before = BENCH_HEAP_USED();
+    for (i = 0; i < BENCH_MEM_CONN; i++)
+        cli[i] = bench_connect(&n, bench_mem_wakeup);
+    if (pico_simtime_run(BENCH_TIMEOUT, bench_mem_done, NULL) != 1)
+        bench_fail("mem");
+
+    /* Nothing in flight */
+    pico_simtime_run(1000, NULL, NULL);
+    after = BENCH_HEAP_USED();
+    bench_report("tcp_mem", "per_connection", (double)(after - before) / BENCH_MEM_CONN, "bytes");
+
+    for (i = 0; i < BENCH_MEM_CONN; i++)
+        pico_socket_close(cli[i]);
+    pico_socket_close(B.listen);
+    bench_net_down(&n);
+#endif
+}
+
+/* UDP: datagrams to the server, at most BENCH_UDP_WINDOW on their way */
+
+static uint32_t bench_udp_len;
+
+static void bench_udp_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    uint8_t dgram[1500];
+    struct pico_ip4 peer;
+    uint16_t port;
+    int r;
+
+    if (!(ev & PICO_SOCK_EV_RD))
+        return;
+
+    while ((r = pico_socket_recvfrom(s, dgram, (int)sizeof(dgram), &peer, &port)) > 0)
+        B.rcvd++;
+}
+
+static struct bench_net *bench_udp_net;
+
+static int bench_udp_done(void *arg)
+{
+    uint16_t port = short_be(BENCH_PORT);
+
+    (void)arg;
+    while ((B.sent < B.total) && (B.sent - B.rcvd < BENCH_UDP_WINDOW)) {
+        if (pico_socket_sendto(B.cli, bench_buf, (int)bench_udp_len, &bench_udp_net->b_addr, port) <= 0)
+            break;
+
+        B.sent++;
+    }
+    return B.rcvd == B.total;
+}
+
+static void bench_udp(uint32_t len)
+{
+    struct pico_pipe_link link = {
+        0
+    };
+    struct bench_net n;
+    uint64_t w0, w1;
+    char label[64];
+
+    memset(&B, 0, sizeof(B));
+    B.total = BENCH_UDP_N;
+    bench_udp_len = len;
+    bench_net_up(&n, &link, 0);
+    bench_udp_net = &n;
+    B.listen = bench_listen(&n, PICO_PROTO_UDP, bench_udp_wakeup);
+    B.cli = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_UDP, bench_udp_wakeup);
+    if (!B.cli)
+        bench_fail("udp socket");
+
+    w0 = bench_now_ns();
+    if (pico_simtime_run(BENCH_TIMEOUT, bench_udp_done, NULL) != 1)
+        bench_fail("udp");
+
+    w1 = bench_now_ns();
+    snprintf(label, sizeof(label), "len%u", len);
+    bench_report("udp", label, bench_rate(BENCH_UDP_N, w0, w1), "pkt/s");
+    pico_socket_close(B.cli);
+    pico_socket_close(B.listen);
+    bench_net_down(&n);
+}
+
+int main(void)
+{
+    /* 100 Mbit/s, 10 ms each way: 250 KB in flight fill it. The link queue
+     * holds all of that, so the socket buffers and the congestion window
+     * set the pace. */
+    static const uint32_t bufs[] = {
+        16u * 1024u, 64u * 1024u, 256u * 1024u
+    };
+    static const uint32_t losses[] = {
+        0, 1000, 10000
+    };
+    static const uint32_t mtus[] = {
+        576, 1500
+    };
+    struct pico_pipe_link link;
+    char name[64];
+    uint32_t m, b, l;
+
+    bench_init();
+    pico_simtime_start(1000);
+    pico_stack_init();
+
+    for (m = 0; m < 2; m++) {
+        for (b = 0; b < 3; b++) {
+            for (l = 0; l < 3; l++) {
+                memset(&link, 0, sizeof(link));
+                link.bandwidth = 100000000u;
+                link.delay = 10;
+                link.queue = 256u * 1024u;
+                link.loss = losses[l];
+                link.seed = 1;
+                snprintf(name, sizeof(name), "mss%u_buf%uk_loss%uppm", mtus[m] - 40u, bufs[b] / 1024u, losses[l]);
+                bench_bulk(name, &link, mtus[m], bufs[b], BENCH_BULK_SIM);
+            }
+        }
+    }
+
+    memset(&link, 0, sizeof(link));
+    for (m = 0; m < 2; m++) {
+        snprintf(name, sizeof(name), "mss%u_cpu", mtus[m] - 40u);
+        bench_bulk(name, &link, mtus[m], 0, BENCH_BULK_CPU);
+    }
+
+    bench_rr("nodelay_cpu", &link, 1);
+    link.delay = 1;
+    bench_rr("nodelay_1ms", &link, 1);
+    bench_rr("nagle_1ms", &link, 0);
+
+    bench_udp(64);
+    bench_udp(1472);
+    bench_conn();
+    bench_mem();
+    return 0;
+}
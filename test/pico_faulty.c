@@ -8,6 +8,9 @@
 uint32_t mm_failure_count = 0;
 uint32_t cur_mem, max_mem;
 
+/* pico_simtime's clock, for tests that don't link it */
+uint64_t (*pico_time_source)(void) __attribute__((weak)) = NULL;
+
 static int called_atexit = 0;
 
 
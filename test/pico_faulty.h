@@ -98,9 +98,18 @@ static inline void pico_free(void *x)
 extern int32_t prescale_time;
 #endif
 
+#ifdef PICO_SUPPORT_SIMTIME
+/* Milliseconds from pico_simtime, NULL for the wall clock */
+extern uint64_t (*pico_time_source)(void);
+#endif
+
 static inline uint32_t PICO_TIME(void)
 {
     struct timeval t;
+#ifdef PICO_SUPPORT_SIMTIME
+    if (pico_time_source)
+        return (uint32_t)(pico_time_source() / 1000);
+#endif
     gettimeofday(&t, NULL);
   #ifdef TIME_PRESCALE
     return (prescale_time < 0) ? (uint32_t)(t.tv_sec / 1000 << (-prescale_time)) : \
@@ -113,6 +122,10 @@ static inline uint32_t PICO_TIME(void)
 static inline uint32_t PICO_TIME_MS(void)
 {
     struct timeval t;
+#ifdef PICO_SUPPORT_SIMTIME
+    if (pico_time_source)
+        return (uint32_t)pico_time_source();
+#endif
     gettimeofday(&t, NULL);
   #ifdef TIME_PRESCALER
     uint32_t tmp = ((t.tv_sec * 1000) + (t.tv_usec / 1000));
@@ -1298,6 +1298,59 @@ START_TEST(tc_pico_iphc_decompress)
     ENDING(test);
 }
 END_TEST
+
+/* Hop-by-hop header followed by ICMPv6, as MLD sends it: net_len only covers
+ * the IPv6 header and the next header of the extension can't be elided */
+static const unsigned char hbh_frame[56] = {
+0x60, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0xff, /* `....... */
+0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* ........ */
+0x02, 0x80, 0xe1, 0x03, 0x00, 0x00, 0x9d, 0x00, /* ........ */
+0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* ........ */
+0x00, 0x00, 0x00, 0xff, 0xfe, 0x00, 0x65, 0x63, /* ......ec */
+0x3a, 0x00, 0x05, 0x02, 0x00, 0x00, 0x01, 0x00, /* :....... */
+0x8f, 0x00, 0x12, 0x34, 0x00, 0x00, 0x00, 0x00  /* ...4.... */
+};
+
+START_TEST(tc_pico_iphc_ext_roundtrip)
+{
+    int test = 1;
+    struct pico_frame *f = pico_frame_alloc(56);
+    union pico_ll_addr src = { .pan = {.addr.data = {0x00,0x80,0xe1,0x03,0x00,0x00,0x9d,0x00}, .mode = AM_6LOWPAN_EXT } };
+    union pico_ll_addr dst = { .pan = {.addr.data = {0x65,0x63,0xe1,0x03,0x00,0x00,0x9d,0x00}, .mode = AM_6LOWPAN_SHORT } };
+    struct pico_device dev;
+    struct pico_frame *comp = NULL, *dec = NULL;
+
+    dev.mode = LL_MODE_IEEE802154;
+    memcpy(f->buffer, hbh_frame, 56);
+    f->net_hdr = f->buffer;
+    f->net_len = PICO_SIZE_IP6HDR;
+    f->transport_hdr = f->buffer + PICO_SIZE_IP6HDR;
+    f->transport_len = 16;
+    f->len = 56;
+    f->dev = &dev;
+    f->src = src;
+    f->dst = dst;
+
+    STARTING();
+    pico_stack_init();
+
+    TRYING("Trying to compress and decompress a frame with an inline next header\n");
+    comp = pico_iphc_compress(f);
+    FAIL_UNLESS(comp, test, "Should've compressed the frame");
+    dec = pico_iphc_decompress(comp);
+    FAIL_UNLESS(dec, test, "Should've decompressed the frame");
+    OUTPUT();
+    dbg_buffer(dec->net_hdr, dec->len);
+    RESULTS();
+    FAIL_UNLESS(56 == dec->len, test, "Should've returned a length of 56, len = %d", dec->len);
+    FAIL_UNLESS(0 == memcmp(dec->net_hdr, hbh_frame, 56), test, "Should've restored the original frame");
+
+    pico_frame_discard(f);
+    pico_frame_discard(comp);
+    pico_frame_discard(dec);
+    ENDING(test);
+}
+END_TEST
 #endif
 
 static struct pico_frame *rx = NULL;
@@ -1465,6 +1518,89 @@ static void app_ping(char *arg)
         free(abort);
 }
 
+static struct pico_frame *reasm_frag(struct pico_device *dev, uint16_t len, uint8_t node)
+{
+    union pico_ll_addr src = { .pan = {.addr.data = {0x00,0x01}, .mode = AM_6LOWPAN_SHORT } };
+    union pico_ll_addr dst = { .pan = {.addr.data = {0x00,0x02}, .mode = AM_6LOWPAN_SHORT } };
+    struct pico_frame *f = pico_frame_alloc(len);
+
+    src.pan.addr.data[1] = node;
+    memset(f->buffer, 0xAB, len);
+    f->start = f->buffer;
+    f->net_hdr = f->buffer;
+    f->net_len = 8;
+    f->len = len;
+    f->dev = dev;
+    f->src = src;
+    f->dst = dst;
+    return f;
+}
+
+START_TEST(tc_reassembly)
+{
+    int test = 0;
+    int32_t ret = 0;
+    struct pico_device *dev = NULL;
+    struct pico_frame *f = NULL;
+    struct reasm_ctx *c = NULL;
+    uint16_t tag = 0;
+    int i = 0;
+
+    STARTING();
+    pico_stack_init();
+    dev = pico_radiotest_create(4, 1, 0, 1, NULL);
+    FAIL_UNLESS(dev, test, "Should've created a device");
+
+    TRYING("Out of order and duplicate fragments\n");
+    ret = defrag_place(reasm_frag(dev, 16, 1), 48, 1, 16);
+    FAIL_UNLESS(ret > 0, test, "Should've started a reassembly");
+    ret = defrag_place(reasm_frag(dev, 16, 1), 48, 1, 16);
+    FAIL_UNLESS(ret > 0, test, "Should've accepted a duplicate");
+    f = reasm_frag(dev, 16, 1);
+    c = reasm_find(f, 48, 1, reasm_key(f, 48, 1));
+    FAIL_UNLESS(c && 16 == c->copied, test, "Duplicates shouldn't count, copied = %d", c ? c->copied : -1);
+    ret = defrag_place(f, 48, 1, 0);
+    FAIL_UNLESS(ret > 0, test, "Should've placed the first fragment");
+    FAIL_UNLESS(32 == c->copied && 8 == c->f->net_len, test, "Should've taken net_len from the first fragment");
+    ret = defrag_place(reasm_frag(dev, 16, 1), 48, 1, 40);
+    FAIL_UNLESS(ret < 0, test, "Should've dropped a fragment beyond the datagram");
+    FAIL_UNLESS(1 == reasm_active, test, "Should've one reassembly active, %d", reasm_active);
+
+    TRYING("Pool exhaustion and expiry\n");
+    for (tag = 2; tag <= PICO_6LOWPAN_REASSEMBLY_CTX + 1; tag++) {
+        ret = defrag_place(reasm_frag(dev, 8, (uint8_t)tag), 48, tag, 8);
+        FAIL_UNLESS(ret > 0, test, "Should've started a reassembly, evicting when full");
+    }
+    FAIL_UNLESS(PICO_6LOWPAN_REASSEMBLY_CTX == reasm_active, test, "Pool should be full, %d", reasm_active);
+    for (i = 0; i < FRAG_TIMEOUT; i++) {
+        pico_timer_cancel(reasm_timer);
+        reasm_tick(PICO_TIME_MS(), NULL);
+    }
+    FAIL_UNLESS(PICO_6LOWPAN_REASSEMBLY_CTX == reasm_active, test, "Shouldn't have expired yet");
+    pico_timer_cancel(reasm_timer);
+    reasm_tick(PICO_TIME_MS(), NULL);
+    FAIL_UNLESS(0 == reasm_active && 0 == reasm_timer, test, "Should've expired all, %d left", reasm_active);
+
+    TRYING("One sender can't take more than its share\n");
+    ret = defrag_place(reasm_frag(dev, 8, 2), 48, 1, 8);
+    FAIL_UNLESS(ret > 0, test, "Should've started a reassembly");
+    for (tag = 1; tag <= PICO_6LOWPAN_REASSEMBLY_PER_SRC + 1; tag++) {
+        ret = defrag_place(reasm_frag(dev, 8, 3), 48, tag, 8);
+        FAIL_UNLESS(ret > 0, test, "Should've started a reassembly");
+    }
+    FAIL_UNLESS(PICO_6LOWPAN_REASSEMBLY_PER_SRC + 1 == reasm_active, test, "Sender should be capped, %d active", reasm_active);
+    f = reasm_frag(dev, 8, 3);
+    FAIL_UNLESS(!reasm_find(f, 48, 1, reasm_key(f, 48, 1)), test, "Should've dropped the sender's oldest");
+    FAIL_UNLESS(reasm_find(f, 48, 2, reasm_key(f, 48, 2)), test, "Should've kept the sender's newer ones");
+    pico_frame_discard(f);
+    f = reasm_frag(dev, 8, 2);
+    FAIL_UNLESS(reasm_find(f, 48, 1, reasm_key(f, 48, 1)), test, "Should've kept the other sender's");
+    pico_frame_discard(f);
+
+    ENDING(test);
+}
+END_TEST
+
 START_TEST(tc_tx_rx)
 {
     int test = 0;
@@ -1559,8 +1695,10 @@ static Suite *pico_suite(void)
     TCase *TCase_decompressor_nhc_ext = tcase_create("Unit test for decompressor_nhc_ext");
     TCase *TCase_pico_iphc_compress = tcase_create("Unit test for pico_iphc_compress");
     TCase *TCase_pico_iphc_decompress = tcase_create("Unit test for pico_iphc_decompress");
+    TCase *TCase_pico_iphc_ext_roundtrip = tcase_create("Unit test for pico_iphc_compress/decompress with extension headers");
 #endif
 
+    TCase *TCase_reassembly = tcase_create("Unit test for reassembly");
     TCase *TCase_tx_rx = tcase_create("Unit test for tx_rx");
 
     tcase_add_test(TCase_compare_prefix, tc_compare_prefix);
@@ -1614,8 +1752,12 @@ static Suite *pico_suite(void)
     suite_add_tcase(s, TCase_pico_iphc_compress);
     tcase_add_test(TCase_pico_iphc_decompress, tc_pico_iphc_decompress);
     suite_add_tcase(s, TCase_pico_iphc_decompress);
+    tcase_add_test(TCase_pico_iphc_ext_roundtrip, tc_pico_iphc_ext_roundtrip);
+    suite_add_tcase(s, TCase_pico_iphc_ext_roundtrip);
 #endif
 
+    tcase_add_test(TCase_reassembly, tc_reassembly);
+    suite_add_tcase(s, TCase_reassembly);
     tcase_add_test(TCase_tx_rx ,tc_tx_rx);
     suite_add_tcase(s, TCase_tx_rx);
 
@@ -0,0 +1,249 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_device.h"
+#include "modules/pico_dev_null.c"
+#include "modules/pico_capture.c"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+static uint32_t ring_mem[2048];
+static uint8_t out[8192];
+
+static struct pico_frame *cframe(struct pico_device *dev, uint32_t len, uint8_t proto)
+{
+    struct pico_frame *f = pico_frame_alloc(len);
+    uint32_t i;
+
+    fail_if(!f);
+    for (i = 0; i < len; i++)
+        f->buffer[i] = (uint8_t)i;
+    f->buffer[0] = 0x45;
+    f->buffer[9] = proto;
+    f->start = f->buffer;
+    f->len = len;
+    f->dev = dev;
+    return f;
+}
+
+static void ccapture(struct pico_device *dev, uint32_t len, uint8_t proto, uint8_t dir)
+{
+    struct pico_frame *f = cframe(dev, len, proto);
+    pico_capture_frame(f, dir);
+    pico_frame_discard(f);
+}
+
+/* Walks pcapng blocks, counts the packets and checks their lengths */
+static uint32_t cwalk(const uint8_t *buf, uint32_t len, uint32_t *flags)
+{
+    uint32_t pos = 0, type, blen, n = 0;
+
+    while (pos < len) {
+        type = capture_get32(buf + pos);
+        blen = capture_get32(buf + pos + 4);
+        fail_if(blen < 12 || (blen & 3) || (pos + blen > len));
+        fail_if(capture_get32(buf + pos + blen - 4) != blen);
+        if (type == PCAPNG_EPB) {
+            n++;
+            if (flags)
+                *flags = capture_get32(buf + pos + blen - 12);
+        } else {
+            fail_if(type != PCAPNG_SHB && type != PCAPNG_IDB);
+        }
+
+        pos += blen;
+    }
+    return n;
+}
+
+START_TEST(tc_capture_pcapng)
+{
+    struct pico_capture_ring *ring = (struct pico_capture_ring *)ring_mem;
+    struct pico_capture_cursor c;
+    struct pico_capture_filter filter;
+    struct pico_device *dev;
+    struct pico_frame *f;
+    uint32_t flags = 0;
+    int n;
+
+    pico_stack_init();
+    dev = pico_null_create("cap0");
+    fail_if(!dev);
+
+    fail_if(pico_capture_start(NULL, sizeof(ring_mem), NULL) != -1);
+    fail_if(pico_capture_start(ring_mem, 16, NULL) != -1);
+    fail_if(pico_capture_start(ring_mem, sizeof(ring_mem), NULL) != 0);
+    fail_if(ring->size != 4096);
+    fail_if(pico_capture_cursor_init(ring, &c) != 0);
+
+    /* Section header, then the interface, then the packet */
+    ccapture(dev, 60, 17, PICO_CAPTURE_IN);
+    n = pico_capture_read(ring, &c, out, sizeof(out));
+    fail_if(n != 28 + 40 + 44 + 60);
+    fail_if(capture_get32(out) != PCAPNG_SHB || capture_get32(out + 8) != PCAPNG_BOM);
+    fail_if(capture_get32(out + 28) != PCAPNG_IDB);
+    fail_if((capture_get32(out + 36) & 0xFFFF) != LINKTYPE_RAW);
+    fail_if(cwalk(out, (uint32_t)n, &flags) != 1 || flags != 1);
+    fail_if(memcmp(out + 68 + 28, "\x45\x01\x02", 3) != 0);
+    fail_if(pico_capture_read(ring, &c, out, sizeof(out)) != 0);
+
+    /* Output goes through pico_sendto_dev() */
+    f = cframe(dev, 100, 6);
+    fail_if(pico_sendto_dev(f) <= 0);
+    n = pico_capture_read(ring, &c, out, sizeof(out));
+    fail_if(cwalk(out, (uint32_t)n, &flags) != 1 || flags != 2);
+
+    /* Snap length */
+    memset(&filter, 0, sizeof(filter));
+    filter.snaplen = 20;
+    fail_if(pico_capture_start(ring_mem, sizeof(ring_mem), &filter) != 0);
+    fail_if(pico_capture_cursor_init(ring, &c) != 0);
+    ccapture(dev, 200, 17, PICO_CAPTURE_OUT);
+    n = pico_capture_read(ring, &c, out, sizeof(out));
+    fail_if(n != 28 + 40 + 44 + 20);
+    fail_if(capture_get32(out + 68 + 20) != 20 || capture_get32(out + 68 + 24) != 200);
+
+    /* Buffer too small for the next block */
+    ccapture(dev, 200, 17, PICO_CAPTURE_OUT);
+    fail_if(pico_capture_read(ring, &c, out, 32) != -1);
+
+    pico_capture_stop();
+    ccapture(dev, 60, 17, PICO_CAPTURE_IN);
+    fail_if(ring->captured != 2);
+    pico_device_destroy(dev);
+}
+END_TEST
+
+START_TEST(tc_capture_filter)
+{
+    struct pico_capture_ring *ring = (struct pico_capture_ring *)ring_mem;
+    struct pico_capture_cursor c;
+    struct pico_capture_filter filter;
+    struct pico_device *a, *b;
+    int n;
+
+    pico_stack_init();
+    a = pico_null_create("capa");
+    b = pico_null_create("capb");
+    fail_if(!a || !b);
+
+    /* UDP coming in on a */
+    memset(&filter, 0, sizeof(filter));
+    filter.dev = a;
+    filter.dir = PICO_CAPTURE_IN;
+    filter.n_match = 2;
+    filter.match[0].offset = 0;
+    filter.match[0].size = 1;
+    filter.match[0].mask = 0xF0;
+    filter.match[0].value = 0x40;
+    filter.match[1].offset = 9;
+    filter.match[1].size = 1;
+    filter.match[1].mask = 0xFF;
+    filter.match[1].value = 17;
+    fail_if(pico_capture_start(ring_mem, sizeof(ring_mem), &filter) != 0);
+    fail_if(pico_capture_cursor_init(ring, &c) != 0);
+
+    ccapture(a, 60, 17, PICO_CAPTURE_IN);
+    ccapture(a, 60, 6, PICO_CAPTURE_IN);
+    ccapture(a, 60, 17, PICO_CAPTURE_OUT);
+    ccapture(b, 60, 17, PICO_CAPTURE_IN);
+    ccapture(a, 8, 17, PICO_CAPTURE_IN);    /* too short for the match */
+    n = pico_capture_read(ring, &c, out, sizeof(out));
+    fail_if(cwalk(out, (uint32_t)n, NULL) != 1);
+
+    /* 16 bit match, both directions, every device */
+    filter.dev = NULL;
+    filter.dir = 0;
+    filter.n_match = 1;
+    filter.match[0].offset = 2;
+    filter.match[0].size = 2;
+    filter.match[0].mask = 0xFFFF;
+    filter.match[0].value = 0x0203;
+    fail_if(pico_capture_start(ring_mem, sizeof(ring_mem), &filter) != 0);
+    fail_if(pico_capture_cursor_init(ring, &c) != 0);
+    ccapture(a, 60, 6, PICO_CAPTURE_IN);
+    ccapture(b, 60, 17, PICO_CAPTURE_OUT);
+    n = pico_capture_read(ring, &c, out, sizeof(out));
+    fail_if(cwalk(out, (uint32_t)n, NULL) != 2);
+    fail_if(ring->preamble_len != 28 + 2 * 40);
+
+    filter.n_match = PICO_CAPTURE_MATCH_MAX + 1;
+    fail_if(pico_capture_start(ring_mem, sizeof(ring_mem), &filter) != -1);
+    pico_device_destroy(a);
+    pico_device_destroy(b);
+}
+END_TEST
+
+START_TEST(tc_capture_wrap)
+{
+    struct pico_capture_ring *ring = (struct pico_capture_ring *)ring_mem;
+    struct pico_capture_cursor c, late;
+    struct pico_device *dev;
+    uint32_t i, got = 0;
+    int n;
+
+    pico_stack_init();
+    dev = pico_null_create("capw");
+    fail_if(!dev);
+
+    /* 1 KB of room, 144 byte blocks */
+    fail_if(pico_capture_start(ring_mem, (uint32_t)sizeof(struct pico_capture_ring) + 1100, NULL) != 0);
+    fail_if(ring->size != 1024);
+    fail_if(pico_capture_cursor_init(ring, &c) != 0);
+    fail_if(pico_capture_cursor_init(ring, &late) != 0);
+
+    /* A reader that keeps up sees every packet across the wraps */
+    for (i = 0; i < 100; i++) {
+        ccapture(dev, 100, 17, PICO_CAPTURE_IN);
+        if ((i % 3) == 2) {
+            n = pico_capture_read(ring, &c, out, sizeof(out));
+            got += cwalk(out, (uint32_t)n, NULL);
+        }
+    }
+    n = pico_capture_read(ring, &c, out, sizeof(out));
+    got += cwalk(out, (uint32_t)n, NULL);
+    fail_if(got != 100 || c.lost != 0);
+
+    /* One that doesn't loses what was overwritten and carries on */
+    n = pico_capture_read(ring, &late, out, sizeof(out));
+    fail_if(cwalk(out, (uint32_t)n, NULL) != 0);
+    fail_if(late.lost == 0 || late.pos != ring->head);
+    ccapture(dev, 100, 17, PICO_CAPTURE_IN);
+    n = pico_capture_read(ring, &late, out, sizeof(out));
+    fail_if(cwalk(out, (uint32_t)n, NULL) != 1);
+
+    /* Bigger than the ring */
+    ccapture(dev, 1200, 17, PICO_CAPTURE_IN);
+    fail_if(ring->dropped != 1);
+    pico_capture_stop();
+    pico_device_destroy(dev);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_capture_pcapng = tcase_create("Unit test for capture_pcapng");
+    TCase *TCase_capture_filter = tcase_create("Unit test for capture_filter");
+    TCase *TCase_capture_wrap = tcase_create("Unit test for capture_wrap");
+
+    tcase_add_test(TCase_capture_pcapng, tc_capture_pcapng);
+    suite_add_tcase(s, TCase_capture_pcapng);
+    tcase_add_test(TCase_capture_filter, tc_capture_filter);
+    suite_add_tcase(s, TCase_capture_filter);
+    tcase_add_test(TCase_capture_wrap, tc_capture_wrap);
+    suite_add_tcase(s, TCase_capture_wrap);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
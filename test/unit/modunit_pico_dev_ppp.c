@@ -83,6 +83,45 @@ static int unit_serial_send(struct pico_device *dev, const void *buf, int len)
     return len;
 }
 
+static uint8_t serial_partial[256];
+static uint32_t serial_partial_len = 0;
+static uint32_t serial_partial_max = 0;
+
+static int unit_serial_send_partial(struct pico_device *dev, const void *buf, int len)
+{
+    uint32_t n = (uint32_t)len;
+    IGNORE_PARAMETER(dev);
+    if (n > serial_partial_max)
+        n = serial_partial_max;
+
+    if (serial_partial_len + n > sizeof(serial_partial))
+        n = (uint32_t)sizeof(serial_partial) - serial_partial_len;
+
+    memcpy(serial_partial + serial_partial_len, buf, n);
+    serial_partial_len += n;
+    return (int)n;
+}
+
+static uint8_t serial_in[256];
+static uint32_t serial_in_len = 0;
+static uint32_t serial_in_pos = 0;
+static uint32_t serial_in_chunk = 1;
+
+static int unit_serial_recv(struct pico_device *dev, void *buf, int len)
+{
+    uint32_t n = serial_in_len - serial_in_pos;
+    IGNORE_PARAMETER(dev);
+    if (n > serial_in_chunk)
+        n = serial_in_chunk;
+
+    if (n > (uint32_t)len)
+        n = (uint32_t)len;
+
+    memcpy(buf, serial_in + serial_in_pos, n);
+    serial_in_pos += n;
+    return (int)n;
+}
+
 uint8_t test_string[5][10] = {
     { 0x7e, 'a', 'b', 'c', 'd', 0x7e },
     { 0x7e, 'a', 0x7e, 'c', 'd', 0x7e },
@@ -228,17 +267,55 @@ START_TEST(tc_ppp_fcs_verify)
     char hello[8] = "hello";
     uint16_t fcs = ppp_fcs_start((uint8_t *)hello, 5);
     fcs = ppp_fcs_finish(fcs);
-    memcpy(hello + 5, &fcs, 2);
-    fail_if(0 != ppp_fcs_verify((uint8_t *)hello, 7));
+    hello[5] = (char)(fcs & 0xFFu);
+    hello[6] = (char)(fcs >> 8);
+    /* the FCS over the frame and its own FCS is the good residue */
+    fail_if(ppp_fcs_start((uint8_t *)hello, 7) != PPP_FCS_GOOD);
     hello[0] = 'B';
     hello[1] = 'y';
     hello[2] = 'e';
     hello[3] = 'z';
     hello[4] = 'z';
-    fail_if(-1 != ppp_fcs_verify((uint8_t *)hello, 7));
+    fail_if(ppp_fcs_start((uint8_t *)hello, 7) == PPP_FCS_GOOD);
 
 }
 END_TEST
+START_TEST(tc_ppp_tx_ring)
+{
+    uint8_t ip[40];
+    uint32_t i;
+
+    memset(&_ppp, 0, sizeof(_ppp));
+    _ppp.serial_send = unit_serial_send_partial;
+    _ppp.ipcp_state = PPP_IPCP_STATE_OPENED;
+    for (i = 0; i < sizeof(ip); i++)
+        ip[i] = (uint8_t)(0x60 + i);
+
+    /* the line takes 5 bytes per call: the rest waits in the ring */
+    serial_partial_max = 5;
+    serial_partial_len = 0;
+    fail_if(pico_ppp_send(&_ppp.dev, ip, sizeof(ip)) != sizeof(ip));
+    fail_if(_ppp.tx_len == 0);
+    fail_if(serial_partial_len != 5);
+    serial_partial_max = 1000;
+    ppp_tx_flush(&_ppp);
+    fail_if(_ppp.tx_len != 0);
+    fail_if(serial_partial[0] != PPPF_FLAG_SEQ || serial_partial[serial_partial_len - 1] != PPPF_FLAG_SEQ);
+    /* 0x7d and 0x7e in the payload are escaped */
+    for (i = 1; i < serial_partial_len - 1; i++)
+        fail_if(serial_partial[i] == PPPF_FLAG_SEQ);
+    fail_if(serial_partial_len < 1 + 4 + sizeof(ip) + 2 + 2 + 1);
+
+    /* a line that takes nothing fills the ring, then sends are refused */
+    serial_partial_max = 0;
+    for (i = 0; i < 200; i++) {
+        if (pico_ppp_send(&_ppp.dev, ip, sizeof(ip)) == 0)
+            break;
+    }
+    fail_if(i == 200);
+    fail_if(_ppp.tx_len > PICO_PPP_TX_RING);
+}
+END_TEST
 START_TEST(tc_pico_ppp_ctl_send)
 {
     uint8_t pkt[32] = { };
@@ -834,24 +911,27 @@ END_TEST
 
 START_TEST(tc_ppp_process_packet_payload)
 {
-    /* Empty, tested with ppp_process_packet, below. */
-}
-END_TEST
-START_TEST(tc_ppp_process_packet)
-{
-    /* Empty, tested with ppp_recv_data, below. */
+    /* Empty, tested with ppp_rx_stream in tc_ppp_recv_data, below. */
 }
 END_TEST
 START_TEST(tc_ppp_recv_data)
 {
     uint8_t pkt[20] = "";
+    uint8_t ip[32];
     struct pico_lcp_hdr *lcpreq;
+    struct pico_frame *f;
+    struct pico_queue q_in = {
+        0
+    };
+    uint32_t i, used;
+    int frames = 0;
 
     /* This creates an LCP ack */
     printf("Unit test: Packet forgery. Creating LCP ACK... \n");
     called_serial_send = 0;
     memset(&_ppp, 0, sizeof(_ppp));
     _ppp.serial_send = unit_serial_send;
+    _ppp.dev.q_in = &q_in;
     _ppp.pkt = pkt;
     _ppp.len = 4;
     lcpreq = (struct pico_lcp_hdr *)_ppp.pkt;
@@ -861,10 +941,46 @@ START_TEST(tc_ppp_recv_data)
     /* LCP ack is now in the buffer, and can be processed */
     printf("Unit test: Packet forgery. Injecting LCP ACK... \n");
     ppp_lcp_ev = 0;
-    ppp_recv_data(&_ppp, serial_buffer + 1, serial_out_len - 2);
+    ppp_rx_reset(&_ppp);
+    used = ppp_rx_stream(&_ppp, serial_buffer, serial_out_len, &frames);
+    fail_if(used != serial_out_len);
+    fail_if(frames != 1);
     fail_if(ppp_lcp_ev != PPP_LCP_EVENT_RCA);
+
+    /* Same frame, one byte at a time */
+    ppp_lcp_ev = 0;
+    frames = 0;
+    for (i = 0; i < serial_out_len; i++)
+        fail_if(ppp_rx_stream(&_ppp, serial_buffer + i, 1, &frames) != 1);
+    fail_if(frames != 1);
+    fail_if(ppp_lcp_ev != PPP_LCP_EVENT_RCA);
+
+    /* Corrupted frame: dropped */
+    ppp_lcp_ev = 0;
+    serial_buffer[serial_out_len - 4] ^= 0x01;
+    ppp_rx_stream(&_ppp, serial_buffer, serial_out_len, &frames);
+    fail_if(ppp_lcp_ev != 0);
+
+    /* IP frame: unescaped in rx_frame, then through pico_stack_recv() */
+    _ppp.ipcp_state = PPP_IPCP_STATE_OPENED;
+    LCPOPT_SET_PEER((&_ppp), LCPOPT_ADDRCTL_COMP);
+    for (i = 0; i < sizeof(ip); i++)
+        ip[i] = (uint8_t)(0x60 + i);
+    fail_if(pico_ppp_send(&_ppp.dev, ip, sizeof(ip)) != sizeof(ip));
+    fail_if(serial_out_len > sizeof(serial_buffer));
+    frames = 0;
+    ppp_rx_stream(&_ppp, serial_buffer, serial_out_len, &frames);
+    fail_if(frames != 1);
+    fail_if(q_in.frames != 1);
+    f = pico_dequeue(&q_in);
+    fail_if(f->len != sizeof(ip));
+    fail_if(memcmp(f->start, ip, sizeof(ip)) != 0);
+    fail_if(f->dev != &_ppp.dev);
+    pico_frame_discard(f);
+    fail_if(_ppp.rx_frame == NULL);
+    pico_frame_discard(_ppp.rx_frame);
+    _ppp.rx_frame = NULL;
     printf("OK!\n");
-    /* TODO: Increase coverage. */
 }
 END_TEST
 
@@ -1043,7 +1159,49 @@ START_TEST(tc_ipcp_start_timer)
 END_TEST
 START_TEST(tc_pico_ppp_poll)
 {
-    /* TODO: test this: static int pico_ppp_poll(struct pico_device *dev, int loop_score) */
+    uint8_t pkt[20] = "";
+    struct pico_lcp_hdr *lcpreq;
+
+    memset(&_ppp, 0, sizeof(_ppp));
+    _ppp.serial_send = unit_serial_send;
+    _ppp.pkt = pkt;
+    _ppp.len = 4;
+    lcpreq = (struct pico_lcp_hdr *)_ppp.pkt;
+    lcpreq->len = short_be(4);
+    lcp_send_configure_ack(&_ppp);
+
+    /* two frames, read by the device in 3 byte chunks */
+    memcpy(serial_in, serial_buffer, serial_out_len);
+    memcpy(serial_in + serial_out_len, serial_buffer, serial_out_len);
+    serial_in_len = serial_out_len * 2;
+    serial_in_pos = 0;
+    serial_in_chunk = 3;
+    _ppp.serial_recv = unit_serial_recv;
+    _ppp.modem_state = PPP_MODEM_STATE_CONNECTED;
+    ppp_rx_reset(&_ppp);
+
+    /* one frame per loop score unit */
+    ppp_lcp_ev = 0;
+    fail_if(pico_ppp_poll(&_ppp.dev, 1) != 0);
+    fail_if(ppp_lcp_ev != PPP_LCP_EVENT_RCA);
+    fail_if(serial_in_pos == serial_in_len);
+    ppp_lcp_ev = 0;
+    fail_if(pico_ppp_poll(&_ppp.dev, 10) != 9);
+    fail_if(ppp_lcp_ev != PPP_LCP_EVENT_RCA);
+    fail_if(serial_in_pos != serial_in_len);
+
+    /* AT mode: lines are passed to the modem FSM */
+    memcpy(serial_in, "\r\nOK\r\n", 6);
+    serial_in_len = 6;
+    serial_in_pos = 0;
+    _ppp.modem_state = PPP_MODEM_STATE_RESET;
+    ppp_modem_ev = 0;
+    mock_modem_state = modem_state;
+    pico_ppp_poll(&_ppp.dev, 10);
+    fail_if(ppp_modem_ev != PPP_MODEM_EVENT_OK);
+    mock_modem_state = NULL;
+    if (_ppp.rx_frame)
+        pico_frame_discard(_ppp.rx_frame);
 }
 END_TEST
 START_TEST(tc_pico_ppp_link_state)
@@ -1172,6 +1330,7 @@ Suite *pico_suite(void)
     TCase *TCase_ppp_fcs_finish = tcase_create("Unit test for ppp_fcs_finish");
     TCase *TCase_ppp_fcs_start = tcase_create("Unit test for ppp_fcs_start");
     TCase *TCase_ppp_fcs_verify = tcase_create("Unit test for ppp_fcs_verify");
+    TCase *TCase_ppp_tx_ring = tcase_create("Unit test for the PPP TX ring");
     TCase *TCase_pico_ppp_ctl_send = tcase_create("Unit test for pico_ppp_ctl_send");
     TCase *TCase_pico_ppp_send = tcase_create("Unit test for pico_ppp_send");
     TCase *TCase_ppp_modem_start_timer = tcase_create("Unit test for ppp_modem_start_timer");
@@ -1204,7 +1363,6 @@ Suite *pico_suite(void)
     TCase *TCase_ipcp_process_in = tcase_create("Unit test for ipcp_process_in");
     TCase *TCase_ipcp6_process_in = tcase_create("Unit test for ipcp6_process_in");
     TCase *TCase_ppp_process_packet_payload = tcase_create("Unit test for ppp_process_packet_payload");
-    TCase *TCase_ppp_process_packet = tcase_create("Unit test for ppp_process_packet");
     TCase *TCase_ppp_recv_data = tcase_create("Unit test for ppp_recv_data");
     TCase *TCase_lcp_this_layer_up = tcase_create("Unit test for lcp_this_layer_up");
     TCase *TCase_lcp_this_layer_down = tcase_create("Unit test for lcp_this_layer_down");
@@ -1252,6 +1410,8 @@ Suite *pico_suite(void)
     suite_add_tcase(s, TCase_ppp_fcs_start);
     tcase_add_test(TCase_ppp_fcs_verify, tc_ppp_fcs_verify);
     suite_add_tcase(s, TCase_ppp_fcs_verify);
+    tcase_add_test(TCase_ppp_tx_ring, tc_ppp_tx_ring);
+    suite_add_tcase(s, TCase_ppp_tx_ring);
     tcase_add_test(TCase_pico_ppp_ctl_send, tc_pico_ppp_ctl_send);
     suite_add_tcase(s, TCase_pico_ppp_ctl_send);
     tcase_add_test(TCase_pico_ppp_send, tc_pico_ppp_send);
@@ -1316,8 +1476,6 @@ Suite *pico_suite(void)
     suite_add_tcase(s, TCase_ipcp6_process_in);
     tcase_add_test(TCase_ppp_process_packet_payload, tc_ppp_process_packet_payload);
     suite_add_tcase(s, TCase_ppp_process_packet_payload);
-    tcase_add_test(TCase_ppp_process_packet, tc_ppp_process_packet);
-    suite_add_tcase(s, TCase_ppp_process_packet);
     tcase_add_test(TCase_ppp_recv_data, tc_ppp_recv_data);
     suite_add_tcase(s, TCase_ppp_recv_data);
     tcase_add_test(TCase_lcp_this_layer_up, tc_lcp_this_layer_up);
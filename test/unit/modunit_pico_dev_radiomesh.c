@@ -0,0 +1,140 @@
+#include "pico_stack.h"
+#include "pico_6lowpan_ll.h"
+#include "modules/pico_dev_radiomesh.c"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+static union pico_ll_addr short_addr(uint16_t id)
+{
+    union pico_ll_addr a;
+
+    memset(&a, 0, sizeof(a));
+    a.pan.mode = AM_6LOWPAN_SHORT;
+    a.pan.addr.data[0] = (uint8_t)(id >> 8);
+    a.pan.addr.data[1] = (uint8_t)id;
+    return a;
+}
+
+static uint32_t pending(struct pico_radiomesh *mesh, uint16_t id)
+{
+    struct radiomesh_node *n = radiomesh_get(mesh, id);
+    return n->tail - n->head;
+}
+
+START_TEST(tc_radiomesh_topology)
+{
+    struct pico_radiomesh *mesh = NULL;
+    struct pico_device *dev[3];
+    struct pico_radiomesh_stats st;
+    uint8_t buf[40] = { 0 };
+    uint16_t i;
+
+    pico_stack_init();
+    mesh = pico_radiomesh_create(7);
+    fail_if(!mesh);
+    for (i = 0; i < 3; i++) {
+        dev[i] = pico_radiomesh_node_add(mesh, i);
+        fail_if(!dev[i]);
+    }
+    fail_if(pico_radiomesh_node_add(mesh, 1) != NULL);
+    fail_if(pico_radiomesh_node_add(mesh, 0xFFFF) != NULL);
+    fail_if(pico_radiomesh_link(mesh, 0, 5, 0, 0) != -1);
+    fail_if(pico_radiomesh_link(mesh, 0, 1, 101, 0) != -1);
+
+    /* 0 - 1 - 2 */
+    fail_if(pico_radiomesh_grid(mesh, 3, 1, 0, 10) != 0);
+    fail_if(radiomesh_get(mesh, 1)->n_links != 2);
+
+    /* Broadcast is heard by the neighbours only */
+    fail_if(radiomesh_send(dev[1], buf, sizeof(buf), short_addr(1), short_addr(0xFFFF)) != sizeof(buf));
+    fail_if(pending(mesh, 0) != 1 || pending(mesh, 2) != 1 || pending(mesh, 1) != 0);
+
+    /* Unicast reaches the destination only, or nobody */
+    fail_if(radiomesh_send(dev[0], buf, sizeof(buf), short_addr(0), short_addr(1)) != sizeof(buf));
+    fail_if(pending(mesh, 1) != 1);
+    fail_if(radiomesh_send(dev[0], buf, sizeof(buf), short_addr(0), short_addr(2)) != sizeof(buf));
+    fail_if(radiomesh_send(dev[0], buf, sizeof(buf), short_addr(0), short_addr(9)) != sizeof(buf));
+    fail_if(pending(mesh, 2) != 1);
+
+    /* Nothing before the link latency */
+    fail_if(radiomesh_poll(dev[2], 8) != 8);
+    pico_radiomesh_advance(mesh, 10);
+    fail_if(pico_radiomesh_time(mesh) != 10);
+    fail_if(radiomesh_poll(dev[2], 8) != 7);
+    fail_if(pending(mesh, 2) != 0);
+
+    pico_radiomesh_get_stats(mesh, &st);
+    fail_if(st.sent != 4 || st.delivered != 1 || st.unreachable != 2);
+
+    pico_radiomesh_destroy(mesh);
+    fail_if(pico_get_device("mesh1") != NULL);
+}
+END_TEST
+
+START_TEST(tc_radiomesh_loss)
+{
+    struct pico_radiomesh *mesh = NULL;
+    struct pico_device *a, *b;
+    struct pico_radiomesh_stats st;
+    uint8_t buf[20] = { 0 };
+    uint32_t i, lost[2];
+    int run;
+
+    pico_stack_init();
+    for (run = 0; run < 2; run++) {
+        mesh = pico_radiomesh_create(42);
+        a = pico_radiomesh_node_add(mesh, 1);
+        b = pico_radiomesh_node_add(mesh, 2);
+        fail_if(!a || !b);
+        fail_if(pico_radiomesh_link(mesh, 1, 2, 30, 0) != 0);
+        for (i = 0; i < 1000; i++) {
+            radiomesh_send(a, buf, sizeof(buf), short_addr(1), short_addr(2));
+            radiomesh_get(mesh, 2)->head = radiomesh_get(mesh, 2)->tail;
+        }
+        pico_radiomesh_get_stats(mesh, &st);
+        lost[run] = (uint32_t)st.lost;
+        /* Same seed, same losses */
+        fail_if(st.lost < 200 || st.lost > 400);
+        pico_radiomesh_destroy(mesh);
+    }
+    fail_if(lost[0] != lost[1]);
+
+    /* A full ring drops */
+    mesh = pico_radiomesh_create(1);
+    a = pico_radiomesh_node_add(mesh, 1);
+    b = pico_radiomesh_node_add(mesh, 2);
+    fail_if(pico_radiomesh_link(mesh, 1, 2, 0, 0) != 0);
+    for (i = 0; i < PICO_RADIOMESH_RING + 3; i++)
+        radiomesh_send(a, buf, sizeof(buf), short_addr(1), short_addr(2));
+    pico_radiomesh_get_stats(mesh, &st);
+    fail_if(st.overflow != 3);
+    fail_if(pending(mesh, 2) != PICO_RADIOMESH_RING);
+    pico_radiomesh_destroy(mesh);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_radiomesh_topology = tcase_create("Unit test for radiomesh_topology");
+    TCase *TCase_radiomesh_loss = tcase_create("Unit test for radiomesh_loss");
+
+    tcase_add_test(TCase_radiomesh_topology, tc_radiomesh_topology);
+    suite_add_tcase(s, TCase_radiomesh_topology);
+    tcase_add_test(TCase_radiomesh_loss, tc_radiomesh_loss);
+    suite_add_tcase(s, TCase_radiomesh_loss);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -138,6 +138,135 @@ START_TEST(tc_pico_dns_ipv6_set_ptr)
 }
 END_TEST
 
+START_TEST(tc_pico_dns_cache)
+{
+    char name[32];
+    int i;
+
+    pico_stack_init();
+    pico_dns_cache_add("www.picotcp.com", PICO_DNS_TYPE_A, "10.1.1.1", 60);
+    pico_dns_cache_add("missing.picotcp.com", PICO_DNS_TYPE_A, NULL, 60);
+    pico_dns_cache_add("notcached.picotcp.com", PICO_DNS_TYPE_A, "10.1.1.2", 0);
+    fail_unless(dns_cache_count == 2);
+
+    /* Keyed on (qtype, name), names compare case-insensitive */
+    fail_if(!pico_dns_cache_find("WWW.PicoTCP.com", PICO_DNS_TYPE_A));
+    fail_if(pico_dns_cache_find("www.picotcp.com", PICO_DNS_TYPE_AAAA));
+    fail_if(pico_dns_cache_find("notcached.picotcp.com", PICO_DNS_TYPE_A));
+    fail_unless(strcmp(pico_dns_cache_find("www.picotcp.com", PICO_DNS_TYPE_A)->answer, "10.1.1.1") == 0);
+    fail_unless(pico_dns_cache_find("missing.picotcp.com", PICO_DNS_TYPE_A)->answer == NULL);
+
+    /* Full: the least recently used entry goes */
+    pico_dns_cache_find("www.picotcp.com", PICO_DNS_TYPE_A);
+    for (i = 0; i < PICO_DNS_CACHE_MAX; i++) {
+        snprintf(name, sizeof(name), "host%d.picotcp.com", i);
+        pico_dns_cache_add(name, PICO_DNS_TYPE_A, "10.1.1.3", 60);
+        if (i == 0)
+            pico_dns_cache_find("www.picotcp.com", PICO_DNS_TYPE_A);
+    }
+    fail_unless(dns_cache_count == PICO_DNS_CACHE_MAX);
+    fail_if(pico_dns_cache_find("missing.picotcp.com", PICO_DNS_TYPE_A));
+    fail_if(!pico_dns_cache_find("www.picotcp.com", PICO_DNS_TYPE_A));
+    fail_if(pico_dns_cache_find("host0.picotcp.com", PICO_DNS_TYPE_A));
+
+    pico_dns_client_cache_flush();
+    fail_unless(dns_cache_count == 0);
+    fail_unless(pico_tree_empty(&DNSCache));
+}
+END_TEST
+
+static int dns_cb_count;
+static char dns_cb_answer[32];
+
+static void dns_cb(char *str, void *arg)
+{
+    IGNORE_PARAMETER(arg);
+    dns_cb_count++;
+    dns_cb_answer[0] = 0;
+    if (str)
+        strncpy(dns_cb_answer, str, sizeof(dns_cb_answer) - 1);
+}
+
+START_TEST(tc_pico_dns_client_lookup)
+{
+    struct pico_dns_query *q = NULL;
+    int i;
+
+    pico_stack_init();
+    dns_cb_count = 0;
+
+    /* Answered from the cache, on the next tick */
+    pico_dns_cache_add("www.picotcp.com", PICO_DNS_TYPE_A, "10.1.1.1", 60);
+    fail_unless(pico_dns_client_lookup("www.picotcp.com", PICO_DNS_TYPE_A, dns_cb, NULL) == 1);
+    fail_unless(dns_cb_count == 0);
+    usleep(2000);
+    pico_stack_tick();
+    fail_unless((dns_cb_count == 1) && (strcmp(dns_cb_answer, "10.1.1.1") == 0));
+    fail_unless(pico_dns_client_lookup("www.picotcp.com", PICO_DNS_TYPE_AAAA, dns_cb, NULL) == 0);
+
+    /* Lookups of a name in flight share its query */
+    q = PICO_ZALLOC(sizeof(struct pico_dns_query) + 32);
+    fail_if(!q);
+    q->name = (char *)q + sizeof(struct pico_dns_query);
+    strcpy(q->name, "ftp.picotcp.com");
+    q->id = 42;
+    q->qtype = PICO_DNS_TYPE_A;
+    q->retrans = 1;
+    q->callback = dns_cb;
+    pico_tree_insert(&DNSTable, q);
+    for (i = 0; i < 3; i++)
+        fail_unless(pico_dns_client_lookup("FTP.picotcp.com", PICO_DNS_TYPE_A, dns_cb, NULL) == 1);
+    fail_unless(pico_tree_count(&DNSTable) == 1);
+
+    dns_cb_count = 0;
+    pico_dns_client_notify(q, NULL, PICO_ERR_ENOENT);
+    fail_unless(dns_cb_count == 4);
+    fail_unless(pico_err == PICO_ERR_ENOENT);
+
+    /* Answered: not joined anymore */
+    fail_unless(pico_dns_client_lookup("ftp.picotcp.com", PICO_DNS_TYPE_A, dns_cb, NULL) == 0);
+    while (q->waiters) {
+        struct pico_dns_waiter *w = q->waiters;
+        q->waiters = w->next;
+        PICO_FREE(w);
+    }
+    pico_tree_delete(&DNSTable, q);
+    PICO_FREE(q);
+    pico_dns_client_cache_flush();
+}
+END_TEST
+
+START_TEST(tc_pico_dns_client_negative_ttl)
+{
+    uint8_t nxdomain[] = {
+        0x00, 0x2a, 0x81, 0x83, /* id, response, NXDOMAIN */
+        0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00,
+        0x03, 'n', 'o', 'p', 0x07, 'p', 'i', 'c', 'o', 't', 'c', 'p', 0x03, 'c', 'o', 'm', 0x00,
+        0x00, 0x01, 0x00, 0x01,
+        0xc0, 0x10, /* picotcp.com */
+        0x00, 0x06, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, /* SOA, TTL 3600 */
+        0x00, 0x1e,
+        0x02, 'n', 's', 0xc0, 0x10,
+        0x02, 'h', 'm', 0xc0, 0x10,
+        0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02,
+        0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x04,
+        0x00, 0x00, 0x01, 0x2c  /* MINIMUM 300 */
+    };
+    struct pico_dns_header *hdr = (struct pico_dns_header *)nxdomain;
+
+    fail_unless(pico_dns_client_is_negative(hdr));
+    fail_unless(pico_dns_client_negative_ttl(hdr, sizeof(nxdomain)) == 300);
+
+    /* The SOA TTL caps the minimum */
+    nxdomain[41] = 0x00;
+    nxdomain[42] = 0x3c;
+    fail_unless(pico_dns_client_negative_ttl(hdr, sizeof(nxdomain)) == 60);
+
+    /* Truncated: no SOA, nothing cached */
+    fail_unless(pico_dns_client_negative_ttl(hdr, sizeof(nxdomain) - 4) == 0);
+}
+END_TEST
+
 
 Suite *pico_suite(void)
 {
@@ -166,6 +295,9 @@ Suite *pico_suite(void)
     TCase *TCase_pico_dns_client_user_callback = tcase_create("Unit test for pico_dns_client_user_callback");
     TCase *TCase_pico_dns_client_getaddr_init = tcase_create("Unit test for pico_dns_client_getaddr_init");
     TCase *TCase_pico_dns_ipv6_set_ptr = tcase_create("Unit test for pico_dns_ipv6_set_ptr");
+    TCase *TCase_pico_dns_cache = tcase_create("Unit test for pico_dns_cache");
+    TCase *TCase_pico_dns_client_lookup = tcase_create("Unit test for pico_dns_client_lookup");
+    TCase *TCase_pico_dns_client_negative_ttl = tcase_create("Unit test for pico_dns_client_negative_ttl");
 
 
     tcase_add_test(TCase_pico_dns_client_callback, tc_pico_dns_client_callback);
@@ -214,6 +346,12 @@ Suite *pico_suite(void)
     suite_add_tcase(s, TCase_pico_dns_client_getaddr_init);
     tcase_add_test(TCase_pico_dns_ipv6_set_ptr, tc_pico_dns_ipv6_set_ptr);
     suite_add_tcase(s, TCase_pico_dns_ipv6_set_ptr);
+    tcase_add_test(TCase_pico_dns_cache, tc_pico_dns_cache);
+    suite_add_tcase(s, TCase_pico_dns_cache);
+    tcase_add_test(TCase_pico_dns_client_lookup, tc_pico_dns_client_lookup);
+    suite_add_tcase(s, TCase_pico_dns_client_lookup);
+    tcase_add_test(TCase_pico_dns_client_negative_ttl, tc_pico_dns_client_negative_ttl);
+    suite_add_tcase(s, TCase_pico_dns_client_negative_ttl);
     return s;
 }
 
@@ -408,6 +408,7 @@ START_TEST(tc_pico_dns_fill_packet_rr_sections) /* MARK: dns_fill_packet_rr_sect
         0x00u, 0x04u,
         10u, 10u, 0u, 1u
     };
+    uint8_t *dest = NULL;
     uint16_t len = 0;
     int ret = 0;
 
@@ -422,8 +423,8 @@ START_TEST(tc_pico_dns_fill_packet_rr_sections) /* MARK: dns_fill_packet_rr_sect
     pico_tree_insert(&antree, record);
 
     /* Try to fill the rr sections with packet as a NULL-pointer */
-    ret = pico_dns_fill_packet_rr_sections(packet, &qtree, &antree,
-                                           &nstree, &artree);
+    ret = pico_dns_fill_packet_rr_sections(&antree, &nstree, &artree,
+                                           &dest, NULL);
     fail_unless(ret, "Checking of params failed!\n");
 
     len = (uint16_t)sizeof(struct pico_dns_header);
@@ -436,8 +437,9 @@ START_TEST(tc_pico_dns_fill_packet_rr_sections) /* MARK: dns_fill_packet_rr_sect
     /* Allocate the packet with the right size */
     packet = (pico_dns_packet *)PICO_ZALLOC((size_t)len);
     fail_if(NULL == packet, "Allocating packet failed!\n");
-    fail_if(pico_dns_fill_packet_rr_sections(packet, &qtree, &antree, &nstree,
-                                             &artree),
+    dest = (uint8_t *)packet + sizeof(struct pico_dns_header);
+    fail_if(pico_dns_fill_packet_rr_sections(&antree, &nstree, &artree,
+                                             &dest, NULL),
             "Filling of rr sections failed!\n");
 
     fail_unless(memcmp((void *)packet, (void *)cmp_buf, 39) == 0,
@@ -452,6 +454,7 @@ START_TEST(tc_pico_dns_fill_packet_question_section) /* MARK: dns_fill_packet_qu
     PICO_DNS_QTREE_DECLARE(qtree);
     struct pico_dns_question *a = NULL, *b = NULL;
     const char *qurl = "picotcp.com";
+    uint8_t *dest = NULL;
     uint8_t cmp_buf[45] = {
         0x00u, 0x00u,                     /* 2 */
         0x00u, 0x00u,                     /* 2 */
@@ -493,7 +496,8 @@ START_TEST(tc_pico_dns_fill_packet_question_section) /* MARK: dns_fill_packet_qu
     packet = (pico_dns_packet *)PICO_ZALLOC((size_t)len);
 
     fail_if(NULL == packet, "Allocating packet failed!\n");
-    fail_if(pico_dns_fill_packet_question_section(packet, &qtree),
+    dest = (uint8_t *)packet + sizeof(struct pico_dns_header);
+    fail_if(pico_dns_fill_packet_question_section(&qtree, &dest, NULL),
             "Filling of rr sections failed!\n");
 
     fail_unless(memcmp((void *)packet, (void *)cmp_buf, 45) == 0,
@@ -502,51 +506,70 @@ START_TEST(tc_pico_dns_fill_packet_question_section) /* MARK: dns_fill_packet_qu
     printf("*********************** ending %s * \n", __func__);
 }
 END_TEST
-START_TEST(tc_pico_dns_packet_compress_find_ptr) /* MARK: dns_packet_compress_find_ptr */
+START_TEST(tc_pico_dns_compress_find) /* MARK: dns_compress_find */
 {
+    struct pico_dns_compress c;
     uint8_t data[] = "abcdef\5local\0abcdef\4test\5local";
-    uint8_t *name = (uint8_t *)(data + 24);
-    uint16_t len = 31;
-    uint8_t *ptr = NULL;
+    uint16_t local = 0, test = 0;
 
     printf("*********************** starting %s * \n", __func__);
 
-    ptr = pico_dns_packet_compress_find_ptr(name, data, len);
-    fail_unless(ptr == (data + 6), "Finding compression ptr failed %p - %p!\n", ptr,
-                data + 6);
+    memset(&c, 0, sizeof(c));
+    c.packet = data;
+    pico_dns_compress_add(&c, data + 6, 7);
+    local = pico_dns_compress_find(&c, 0, data + 24);
+    fail_unless(local && (c.entry[local].offset == 6),
+                "Finding compression ptr failed!\n");
+
+    /* Only the known suffix is found */
+    test = pico_dns_compress_find(&c, local, data + 19);
+    fail_unless(test == 0, "Found a suffix that was never added!\n");
+    fail_unless(pico_dns_compress_find(&c, 0, data + 19) == 0,
+                "Found a label under the wrong parent!\n");
     printf("*********************** ending %s * \n", __func__);
 }
 END_TEST
-START_TEST(tc_pico_dns_packet_compress_name) /* MARK: dns_packet_compress_name */
+START_TEST(tc_pico_dns_compress_name) /* MARK: dns_compress_name */
 {
-    uint8_t buf[46] = {
-        0x00u, 0x00u,
-        0x00u, 0x00u,
-        0x00u, 0x00u,
-        0x00u, 0x00u,
-        0x00u, 0x00u,
-        0x00u, 0x00u,
-        0x07u, 'p', 'i', 'c', 'o', 't', 'c', 'p',
-        0x03u, 'c', 'o', 'm',
-        0x00u,
-        0x00u, 0x01u,
-        0x00u, 0x01u,
-        0x07u, 'p', 'i', 'c', 'o', 't', 'c', 'p',
-        0x03u, 'c', 'o', 'm',
+    struct pico_dns_compress c;
+    uint8_t buf[64] = {
+        0
+    };
+    uint8_t cmp_buf[45] = {
+        0x00u, 0x00u, 0x00u, 0x00u, 0x00u, 0x00u,
+        0x00u, 0x00u, 0x00u, 0x00u, 0x00u, 0x00u,
+        0x04u, 't', 'e', 's', 't',
+        0x05u, 'l', 'o', 'c', 'a', 'l',
         0x00u,
-        0x00u, 0x01u,
-        0x00u, 0x01u
+        0x03u, 'f', 'o', 'o', 0xC0u, 0x0Cu,
+        0x03u, 'b', 'a', 'r', 0xC0u, 0x11u,
+        0xC0u, 0x18u,
+        0x04u, 'T', 'E', 'S', 'T', 0xC0u, 0x11u
     };
+    static uint8_t test_local[] = "\4test\5local";
+    static uint8_t foo_test_local[] = "\3foo\4test\5local";
+    static uint8_t bar_local[] = "\3bar\5local";
+    static uint8_t upper_local[] = "\4TEST\5local";
+    uint8_t *ptr = NULL;
 
-    uint8_t *name = buf + 29u;
-    uint16_t len = 46;
-    int ret = 0;
     printf("*********************** starting %s * \n", __func__);
 
-    ret = pico_dns_packet_compress_name(name, buf, &len);
-    fail_unless(ret == 0, "dns_packet_compress_name returned error!\n");
-    fail_unless(len == (46 - 11), "packet_compress_name return wrong length!\n");
-    fail_unless(memcmp(name, "\xc0\x0c", 2) == 0, "packet_compress_name failed!\n");
+    memset(&c, 0, sizeof(c));
+    c.packet = buf;
+    ptr = buf + 12u;
+    ptr = pico_dns_compress_name(&c, ptr, test_local);
+    ptr = pico_dns_compress_name(&c, ptr, foo_test_local);
+    ptr = pico_dns_compress_name(&c, ptr, bar_local);
+    ptr = pico_dns_compress_name(&c, ptr, foo_test_local);
+    ptr = pico_dns_compress_name(&c, ptr, upper_local);
+    fail_unless(ptr == buf + 45, "compress_name wrote %d bytes!\n",
+                (int)(ptr - buf));
+    fail_unless(memcmp(buf, cmp_buf, 45) == 0, "compress_name failed!\n");
+
+    /* Without dictionary, names are copied as is */
+    ptr = pico_dns_compress_name(NULL, buf, foo_test_local);
+    fail_unless((ptr == buf + 16) && (memcmp(buf, "\3foo\4test\5local", 16) == 0),
+                "compress_name without dictionary failed!\n");
     printf("*********************** ending %s * \n", __func__);
 }
 END_TEST
@@ -606,12 +629,38 @@ START_TEST(tc_pico_dns_packet_compress) /* MARK: dns_packet_compress */
         0x00u, 0x04u,
         0x0Au, 0x0Au, 0x0A, 0x0A
     };
+    uint8_t bad[83];
     pico_dns_packet *packet = (pico_dns_packet *)buf;
     uint16_t len = 83;
     int ret = 0;
 
     printf("*********************** starting %s * \n", __func__);
 
+    /* rdata of the last record past the end */
+    memcpy(bad, buf, sizeof(bad));
+    len = 82;
+    ret = pico_dns_packet_compress((pico_dns_packet *)bad, &len);
+    fail_unless(ret < 0 && len == 82 && memcmp(bad, buf, sizeof(bad)) == 0,
+                "packet_compress accepted truncated rdata!\n");
+
+    /* label running past the end */
+    bad[64] = 0x3Fu;
+    len = 83;
+    ret = pico_dns_packet_compress((pico_dns_packet *)bad, &len);
+    fail_unless(ret < 0, "packet_compress accepted a label past the end!\n");
+
+    /* more records than the packet holds */
+    memcpy(bad, buf, sizeof(bad));
+    bad[11] = 0x01u;
+    ret = pico_dns_packet_compress((pico_dns_packet *)bad, &len);
+    fail_unless(ret < 0, "packet_compress read past the last record!\n");
+
+    /* truncated header */
+    len = 6;
+    ret = pico_dns_packet_compress(packet, &len);
+    fail_unless(ret < 0, "packet_compress accepted a truncated header!\n");
+
+    len = 83;
     ret = pico_dns_packet_compress(packet, &len);
 
     fail_unless(ret == 0, "dns_packet_compress returned error!\n");
@@ -825,7 +874,7 @@ START_TEST(tc_pico_dns_record_copy_flat) /* MARK: dns_record_copy_flat */
     ptr = buf + 20;
 
     /* Try to copy the record to a flat buffer */
-    ret = pico_dns_record_copy_flat(record, &ptr);
+    ret = pico_dns_record_copy_flat(record, &ptr, NULL);
 
     fail_unless(ret == 0, "dns_record_copy_flat returned error!\n");
     fail_unless(memcmp(buf + 20, cmp_buf, 27) == 0,
@@ -1323,8 +1372,8 @@ Suite *pico_suite(void)
     TCase *TCase_pico_dns_fill_packet_question_section = tcase_create("Unit test for 'pico_dns_fill_packet_question_sections'");
 
     /* DNS packet compression */
-    TCase *TCase_pico_dns_packet_compress_find_ptr = tcase_create("Unit test for 'pico_dns_packet_compress_find_ptr'");
-    TCase *TCase_pico_dns_packet_compress_name = tcase_create("Unit test for 'pico_dns_packet_compress_name'");
+    TCase *TCase_pico_dns_compress_find = tcase_create("Unit test for 'pico_dns_compress_find'");
+    TCase *TCase_pico_dns_compress_name = tcase_create("Unit test for 'pico_dns_compress_name'");
     TCase *TCase_pico_dns_packet_compress = tcase_create("Unit test for 'pico_dns_packet_compress'");
 
     /* DNS question functions */
@@ -1369,8 +1418,8 @@ Suite *pico_suite(void)
     tcase_add_test(TCase_pico_dns_fill_packet_rr_section, tc_pico_dns_fill_packet_rr_section);
     tcase_add_test(TCase_pico_dns_fill_packet_rr_sections, tc_pico_dns_fill_packet_rr_sections);
     tcase_add_test(TCase_pico_dns_fill_packet_question_section, tc_pico_dns_fill_packet_question_section);
-    tcase_add_test(TCase_pico_dns_packet_compress_find_ptr, tc_pico_dns_packet_compress_find_ptr);
-    tcase_add_test(TCase_pico_dns_packet_compress_name, tc_pico_dns_packet_compress_name);
+    tcase_add_test(TCase_pico_dns_compress_find, tc_pico_dns_compress_find);
+    tcase_add_test(TCase_pico_dns_compress_name, tc_pico_dns_compress_name);
     tcase_add_test(TCase_pico_dns_packet_compress, tc_pico_dns_packet_compress);
     tcase_add_test(TCase_pico_dns_question_fill_qsuffix, tc_pico_dns_question_fill_qsuffix);
     tcase_add_test(TCase_pico_dns_question_delete, tc_pico_dns_question_delete);
@@ -1405,8 +1454,8 @@ Suite *pico_suite(void)
     suite_add_tcase(s, TCase_pico_dns_fill_packet_rr_section);
     suite_add_tcase(s, TCase_pico_dns_fill_packet_rr_sections);
     suite_add_tcase(s, TCase_pico_dns_fill_packet_question_section);
-    suite_add_tcase(s, TCase_pico_dns_packet_compress_find_ptr);
-    suite_add_tcase(s, TCase_pico_dns_packet_compress_name);
+    suite_add_tcase(s, TCase_pico_dns_compress_find);
+    suite_add_tcase(s, TCase_pico_dns_compress_name);
     suite_add_tcase(s, TCase_pico_dns_packet_compress);
     suite_add_tcase(s, TCase_pico_dns_question_fill_qsuffix);
     suite_add_tcase(s, TCase_pico_dns_question_delete);
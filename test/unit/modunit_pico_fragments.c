@@ -18,26 +18,47 @@
 Suite *pico_suite(void);
 /* Mock! */
 static int transport_recv_called = 0;
-static uint32_t buffer_len_transport_receive = 0;
+static uint32_t transport_recv_len = 0;
+static uint32_t transport_recv_bad = 0;
 #define TESTPROTO 0x99
 #define TESTID    0x11
 int32_t pico_transport_receive(struct pico_frame *f, uint8_t proto)
 {
+    uint32_t i;
+
     fail_if(proto != TESTPROTO);
     transport_recv_called++;
-    buffer_len_transport_receive = f->buffer_len;
+    transport_recv_len = f->transport_len;
+    /* payload byte i holds i, wherever its fragment landed */
+    for (i = 0; i < f->transport_len; i++) {
+        if (f->transport_hdr[i] != (uint8_t)i)
+            transport_recv_bad++;
+    }
+    if (IS_IPV4(f)) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        fail_if(short_be(hdr->len) != PICO_SIZE_IP4HDR + f->transport_len);
+        fail_if(hdr->frag != 0);
+    } else {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+        fail_if(short_be(hdr->len) != f->transport_len);
+        fail_if(hdr->nxthdr != TESTPROTO);
+    }
+
     pico_frame_discard(f);
     return 0;
 }
 
 static int timer_add_called = 0;
+static int timer_add_fail = 0;
 uint32_t pico_timer_add(pico_time expire, void (*timer)(pico_time, void *), void *arg)
 {
     IGNORE_PARAMETER(expire);
     IGNORE_PARAMETER(arg);
     fail_if(timer != pico_frag_expire);
-    timer_add_called++;
-    return 0;
+    if (timer_add_fail)
+        return 0;
+
+    return (uint32_t)++timer_add_called;
 }
 
 static int timer_cancel_called = 0;
@@ -50,7 +71,10 @@ void pico_timer_cancel(uint32_t id)
 static int icmp4_frag_expired_called = 0;
 int pico_icmp4_frag_expired(struct pico_frame *f)
 {
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
     fail_unless(IS_IPV4(f));
+    /* only what was received from offset 0 is quoted */
+    fail_if(short_be(hdr->len) > PICO_SIZE_IP4HDR + f->transport_len);
     icmp4_frag_expired_called++;
     return 0;
 }
@@ -63,659 +87,376 @@ int pico_icmp6_frag_expired(struct pico_frame *f)
     return 0;
 }
 
-
-START_TEST(tc_pico_ipv6_frag_compare)
-{
-    struct pico_frame *a, *b;
-    a = pico_frame_alloc(10);
-    fail_if(!a);
-    b = pico_frame_alloc(10);
-    fail_if(!b);
-    a->frag = 0xaa00;
-    b->frag = 0xbb00;
-    fail_unless(pico_ipv6_frag_compare(a, b) < 0);
-    fail_unless(pico_ipv6_frag_compare(b, a) > 0);
-    b->frag = 0xaa00;
-    fail_unless(pico_ipv6_frag_compare(a, b) == 0);
-    pico_frame_discard(a);
-    pico_frame_discard(b);
-}
-END_TEST
-
-START_TEST(tc_pico_ipv4_frag_compare)
+static void frag_reset(void)
 {
-    struct pico_frame *a, *b;
-    a = pico_frame_alloc(10);
-    fail_if(!a);
-    b = pico_frame_alloc(10);
-    fail_if(!b);
-    a->frag = 0xaa00;
-    b->frag = 0xbb00;
-    fail_unless(pico_ipv4_frag_compare(a, b) < 0);
-    fail_unless(pico_ipv4_frag_compare(b, a) > 0);
-    b->frag = 0xaa00;
-    fail_unless(pico_ipv4_frag_compare(a, b) == 0);
-    pico_frame_discard(a);
-    pico_frame_discard(b);
-}
-END_TEST
+    struct pico_tree_node *index, *tmp;
 
-START_TEST(tc_pico_ipv6_fragments_complete)
-{
-    struct pico_frame *a, *b;
+    pico_tree_foreach_safe(index, &pico_frag_dgrams, tmp) {
+        pico_frag_dgram_free(index->keyValue);
+    }
+    fail_if(pico_frag_mem != 0);
     transport_recv_called = 0;
+    transport_recv_len = 0;
+    transport_recv_bad = 0;
+    timer_add_called = 0;
+    timer_add_fail = 0;
     timer_cancel_called = 0;
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = 1; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20; /* off = 32 */
-
-    pico_tree_insert(&ipv6_fragments, a);
-    pico_tree_insert(&ipv6_fragments, b);
-
-    pico_set_mm_failure(1);
-    pico_fragments_complete(64, TESTPROTO, PICO_PROTO_IPV6);
-    fail_if(transport_recv_called != 0);
-    fail_if(timer_cancel_called != 0);
-
-    pico_fragments_complete(64, TESTPROTO, PICO_PROTO_IPV6);
-    fail_if(transport_recv_called != 1);
-    fail_if(timer_cancel_called != 1);
+    icmp4_frag_expired_called = 0;
+    icmp6_frag_expired_called = 0;
 }
-END_TEST
 
-START_TEST(tc_pico_ipv4_fragments_complete)
+static int frag_count(void)
 {
-    struct pico_frame *a, *b;
-    transport_recv_called = 0;
-    timer_cancel_called = 0;
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = PICO_IPV4_MOREFRAG; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20 >> 3u; /* off = 32 */
-
-    pico_tree_insert(&ipv4_fragments, a);
-    pico_tree_insert(&ipv4_fragments, b);
-
-    pico_set_mm_failure(1);
-    pico_fragments_complete(64, TESTPROTO, PICO_PROTO_IPV4);
-    fail_if(transport_recv_called != 0);
-    fail_if(timer_cancel_called != 0);
+    struct pico_tree_node *index;
+    int n = 0;
 
-    pico_fragments_complete(64, TESTPROTO, PICO_PROTO_IPV4);
-    fail_if(transport_recv_called != 1);
-    fail_if(timer_cancel_called != 1);
+    pico_tree_foreach(index, &pico_frag_dgrams) {
+        n++;
+    }
+    return n;
 }
-END_TEST
 
-START_TEST(tc_pico_fragments_complete)
+static void frag_fill(struct pico_frame *f, uint32_t off, uint32_t len)
 {
-    /* Done in the two tests above */
+    uint32_t i;
+    for (i = 0; i < len; i++)
+        f->transport_hdr[i] = (uint8_t)(off + i);
 }
-END_TEST
 
-START_TEST(tc_pico_fragments_empty_tree)
+/* Feeds an IPv4 fragment carrying payload [off, off + len) */
+static void frag4(uint16_t id, uint32_t src, uint32_t dst, uint32_t off, uint32_t len, int more)
 {
-    PICO_TREE_DECLARE(tree, pico_ipv4_frag_compare);
-    struct pico_frame *a = NULL, *b = NULL;
-
-    pico_fragments_empty_tree(NULL);
-
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    /* Make sure we have different frames a and b (because of compare functions in PICO_TREE_DECLARE) */
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = PICO_IPV4_MOREFRAG; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20 >> 3u; /* off = 32 */
-
-    /* Insert them in the tree */
-    pico_tree_insert(&tree, a);
-    pico_tree_insert(&tree, b);
+    struct pico_frame *f = pico_frame_alloc(PICO_SIZE_IP4HDR + len);
+    struct pico_ipv4_hdr *hdr;
+
+    fail_if(!f);
+    f->net_hdr = f->buffer;
+    f->net_len = PICO_SIZE_IP4HDR;
+    f->transport_hdr = f->buffer + PICO_SIZE_IP4HDR;
+    f->transport_len = (uint16_t)len;
+    hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+    hdr->vhl = 0x45;
+    hdr->len = short_be((uint16_t)(PICO_SIZE_IP4HDR + len));
+    hdr->id = short_be(id);
+    hdr->src.addr = long_be(src);
+    hdr->dst.addr = long_be(dst);
+    f->frag = (uint16_t)((off >> 3) | (more ? PICO_IPV4_MOREFRAG : 0));
+    hdr->frag = short_be(f->frag);
+    frag_fill(f, off, len);
+    pico_ipv4_process_frag(hdr, f, TESTPROTO);
+    pico_frame_discard(f);
+}
 
-    pico_fragments_empty_tree(&tree);
+/* Feeds an IPv6 fragment carrying payload [off, off + len) */
+static void frag6(uint32_t id, uint32_t off, uint32_t len, int more)
+{
+    struct pico_frame *f = pico_frame_alloc(PICO_SIZE_IP6HDR + len);
+    struct pico_ipv6_hdr *hdr;
+    struct pico_ipv6_exthdr ext;
+
+    fail_if(!f);
+    f->net_hdr = f->buffer;
+    f->net_len = PICO_SIZE_IP6HDR;
+    f->transport_hdr = f->buffer + PICO_SIZE_IP6HDR;
+    f->transport_len = (uint16_t)len;
+    hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+    hdr->vtf = long_be(0x60000000);
+    hdr->len = short_be((uint16_t)(len + 8));
+    hdr->nxthdr = PICO_IPV6_EXTHDR_FRAG;
+    hdr->src.addr[0] = 0x20;
+    hdr->src.addr[15] = 1;
+    hdr->dst.addr[0] = 0x20;
+    hdr->dst.addr[15] = 2;
+    memset(&ext, 0, sizeof(ext));
+    ext.ext.frag.id[0] = (uint8_t)(id >> 24);
+    ext.ext.frag.id[1] = (uint8_t)(id >> 16);
+    ext.ext.frag.id[2] = (uint8_t)(id >> 8);
+    ext.ext.frag.id[3] = (uint8_t)id;
+    f->frag = (uint16_t)(off | (more ? 1 : 0));
+    frag_fill(f, off, len);
+    pico_ipv6_process_frag(&ext, f, TESTPROTO);
+    pico_frame_discard(f);
+}
 
-    /* Is tree empty? */
-    fail_if(!pico_tree_empty(&tree));
+START_TEST(tc_pico_frag_range_add)
+{
+    struct pico_frag_dgram dg;
+
+    memset(&dg, 0, sizeof(dg));
+    fail_if(pico_frag_range_add(&dg, 100, 200) != 0);
+    fail_if(pico_frag_range_add(&dg, 0, 50) != 0);
+    fail_if(pico_frag_range_add(&dg, 300, 400) != 0);
+    fail_if(dg.nranges != 3);
+
+    /* adjacent ranges merge without overlap */
+    fail_if(pico_frag_range_add(&dg, 50, 100) != 0);
+    fail_if(dg.nranges != 2);
+    fail_if(dg.ranges->start != 0 || dg.ranges->end != 200);
+
+    /* a range bridging a hole over both sides overlaps */
+    fail_if(pico_frag_range_add(&dg, 150, 350) != 1);
+    fail_if(dg.nranges != 1);
+    fail_if(dg.ranges->start != 0 || dg.ranges->end != 400);
+    fail_if(pico_frag_received_end(&dg) != 400);
+
+    /* duplicates overlap */
+    fail_if(pico_frag_range_add(&dg, 0, 8) != 1);
+    fail_if(dg.nranges != 1);
+
+    PICO_FREE(dg.ranges);
 }
 END_TEST
 
-START_TEST(tc_pico_fragments_check_complete)
+START_TEST(tc_pico_ipv4_process_frag)
 {
-    struct pico_frame *a, *b;
-    fail_if(pico_fragments_check_complete(&ipv4_fragments, TESTPROTO, PICO_PROTO_IPV4) != 1);
-    fail_if(pico_fragments_check_complete(&ipv6_fragments, TESTPROTO, PICO_PROTO_IPV6) != 1);
+    struct pico_ipv4_hdr hdr;
 
-    /* Case 1: IPV4 all packets received */
-    transport_recv_called = 0;
-    timer_cancel_called = 0;
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = PICO_IPV4_MOREFRAG; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20 >> 3u; /* off = 32 */
+    frag_reset();
 
-    pico_tree_insert(&ipv4_fragments, a);
-    pico_tree_insert(&ipv4_fragments, b);
+    /* NULL args provided */
+    pico_ipv4_process_frag(NULL, NULL, TESTPROTO);
+    memset(&hdr, 0, sizeof(hdr));
+    pico_ipv4_process_frag(&hdr, NULL, TESTPROTO);
+    fail_if(timer_add_called != 0);
+    fail_if(frag_count() != 0);
 
-    fail_if(pico_fragments_check_complete(&ipv4_fragments, TESTPROTO, PICO_PROTO_IPV4) != 0);
-    fail_if(transport_recv_called != 1);
+    /* In order */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 0, 32, 1);
+    fail_if(timer_add_called != 1);
+    fail_if(frag_count() != 1);
+    frag4(TESTID, 0x0a000001, 0x0a000002, 32, 32, 1);
+    fail_if(timer_add_called != 1);
+    fail_if(transport_recv_called != 0);
+    frag4(TESTID, 0x0a000001, 0x0a000002, 64, 32, 0);
     fail_if(timer_cancel_called != 1);
-
-    /* Case 2: IPV6 all packets received */
-    transport_recv_called = 0;
-    timer_cancel_called = 0;
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = 1; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20; /* off = 32 */
-
-    pico_tree_insert(&ipv6_fragments, a);
-    pico_tree_insert(&ipv6_fragments, b);
-
-    fail_if(pico_fragments_check_complete(&ipv6_fragments, TESTPROTO, PICO_PROTO_IPV6) != 0);
     fail_if(transport_recv_called != 1);
-    fail_if(timer_cancel_called != 1);
+    fail_if(transport_recv_len != 96);
+    fail_if(transport_recv_bad != 0);
 
+    /* Everything was received, no state left */
+    fail_if(frag_count() != 0);
+    fail_if(pico_frag_mem != 0);
 
-    /* Case 3: IPV4 NOT all packets received */
-    transport_recv_called = 0;
-    timer_cancel_called = 0;
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
+    /* A late duplicate starts a new datagram, which later expires */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 32, 32, 1);
+    fail_if(frag_count() != 1);
+    frag_reset();
+}
+END_TEST
 
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = PICO_IPV4_MOREFRAG; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20 >> 3u | PICO_IPV4_MOREFRAG; /* off = 32 + more frags */
-    /* b->frag = PICO_IPV4_MOREFRAG; /\* more frags *\/ */
-
-    pico_tree_insert(&ipv4_fragments, a);
-    pico_tree_insert(&ipv4_fragments, b);
-
-    fail_if(pico_fragments_check_complete(&ipv4_fragments, TESTPROTO, PICO_PROTO_IPV4) == 0);
+START_TEST(tc_pico_ipv4_out_of_order)
+{
+    struct pico_frag_dgram *dg;
+
+    frag_reset();
+
+    /* the last fragment first: the buffer is allocated at its final size */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 1600, 400, 0);
+    dg = pico_tree_first(&pico_frag_dgrams);
+    fail_if(!dg || !dg->has_last || dg->total != 2000);
+    fail_if(dg->size != 2000);
+    fail_if(dg->full->buffer_len != PICO_SIZE_IP4HDR + 2000);
+
+    frag4(TESTID, 0x0a000001, 0x0a000002, 800, 800, 1);
+    /* overlapping IPv4 fragments are accepted */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 800, 800, 1);
+    frag4(TESTID, 0x0a000001, 0x0a000002, 400, 800, 1);
+    fail_if(dg->nranges != 1);
+    fail_if(dg->size != 2000);
     fail_if(transport_recv_called != 0);
-    fail_if(timer_cancel_called != 0);
-
-    /* Case 4: IPV6 NOT all packets received */
-    transport_recv_called = 0;
-    timer_cancel_called = 0;
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = 1; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 1; /* more frags */
-
-    pico_tree_insert(&ipv6_fragments, a);
-    pico_tree_insert(&ipv6_fragments, b);
 
-    fail_if(pico_fragments_check_complete(&ipv6_fragments, TESTPROTO, PICO_PROTO_IPV6) == 0);
-    fail_if(transport_recv_called != 0);
-    fail_if(timer_cancel_called != 0);
+    frag4(TESTID, 0x0a000001, 0x0a000002, 0, 400, 1);
+    fail_if(transport_recv_called != 1);
+    fail_if(transport_recv_len != 2000);
+    fail_if(transport_recv_bad != 0);
+    fail_if(frag_count() != 0);
+    frag_reset();
 }
 END_TEST
 
-START_TEST(tc_pico_fragments_send_notify)
+START_TEST(tc_pico_frag_concurrent)
 {
-    struct pico_frame *a = NULL;
-    char ipv4_multicast_address[] = {
-        "224.0.0.1"
-    };
-
-    icmp4_frag_expired_called = 0;
-
-    /* Case 1: NULL fragment */
-
-    pico_fragments_send_notify(NULL);
-
-    /* Notify should not be send when supplied a NULL argument */
-    fail_if(icmp4_frag_expired_called);
-
-    /* Case 2: fragment with offset > 0 */
-    a = pico_frame_alloc(sizeof(struct pico_ipv4_hdr));
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-
-    a->net_hdr = a->buffer;
-    a->net_len = sizeof(struct pico_ipv4_hdr);
-    a->buffer[0] = 0x40;        /* IPV4 */
-    a->frag = 0x20 >> 3u;       /* off = 32 */
-
-    pico_fragments_send_notify(a);
-
-    /* fragment has offset > 0, no notify should be sent */
-    fail_if(icmp4_frag_expired_called);
-
-    /* Case 3: fragment with offset > 0 & multicast address */
-    pico_string_to_ipv4(ipv4_multicast_address, &((struct pico_ipv4_hdr*)(a->net_hdr))->dst.addr);
-    pico_fragments_send_notify(a);
-
-    /* fragment has offset > 0 AND multicast address, no notify should be sent */
-    fail_if(icmp4_frag_expired_called);
-
-    /* Case 4: fragment with offset == 0 */
-    a->net_hdr = a->buffer;
-    a->net_len = sizeof(struct pico_ipv4_hdr);
-    a->buffer[0] = 0x40;        /* IPV4 */
-    a->frag = PICO_IPV4_MOREFRAG; /* more frags */
-    pico_string_to_ipv4("127.0.0.1", &((struct pico_ipv4_hdr*)(a->net_hdr))->dst.addr); /* Set a non-nulticast address */
-
-    pico_fragments_send_notify(a);
-
-    /* fragment has offset == 0, notify should be sent */
-    fail_if(!icmp4_frag_expired_called);
-
-    /* Case 5: fragment with offset == 0 & multicast address */
-    icmp4_frag_expired_called = 0; /* reset flag */
-    pico_string_to_ipv4(ipv4_multicast_address, &((struct pico_ipv4_hdr*)(a->net_hdr))->dst.addr);
-
-    pico_fragments_send_notify(a);
-
-    /* fragment has offset == 0 but multicast address, notify should NOT sent */
-    fail_if(icmp4_frag_expired_called);
-
-    /* Cleanup */
-    pico_frame_discard(a);
+    frag_reset();
+
+    /* three datagrams interleaved: two ids from one host, the same id
+     * from another host */
+    frag4(1, 0x0a000001, 0x0a000002, 0, 64, 1);
+    frag4(2, 0x0a000001, 0x0a000002, 64, 64, 0);
+    frag4(1, 0x0a000003, 0x0a000002, 64, 16, 0);
+    fail_if(frag_count() != 3);
+    fail_if(timer_add_called != 3);
+
+    frag4(2, 0x0a000001, 0x0a000002, 0, 64, 1);
+    fail_if(transport_recv_called != 1 || transport_recv_len != 128);
+    frag4(1, 0x0a000003, 0x0a000002, 0, 64, 1);
+    fail_if(transport_recv_called != 2 || transport_recv_len != 80);
+    frag4(1, 0x0a000001, 0x0a000002, 64, 8, 0);
+    fail_if(transport_recv_called != 3 || transport_recv_len != 72);
+    fail_if(transport_recv_bad != 0);
+    fail_if(frag_count() != 0);
+    fail_if(timer_cancel_called != 3);
+    frag_reset();
 }
 END_TEST
 
-
-START_TEST(tc_pico_frag_expire)
+START_TEST(tc_pico_frag_invalid)
 {
-    struct pico_frame *a, *b;
-    /* Addr setup, choose a unicast addr */
-    struct pico_ip6 addr_1 = {{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 9 }};
-    char ipv4_multicast_address[] = {
-        "224.0.0.1"
-    };
-    struct pico_ip6 ipv6_multicast_addr = {{ 0xff, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 9 }};
-
-    /* Clear env vars */
-    icmp4_frag_expired_called = 0;
-    icmp6_frag_expired_called = 0;
-
-    /* Common tests */
-    /* Case 1: tree is NULL */
-    pico_frag_expire(0, NULL);
-    fail_if(icmp4_frag_expired_called);
-    fail_if(icmp6_frag_expired_called);
-
-    /* IPV4 TESTS */
-    /* Initial setup */
-    a = pico_frame_alloc(sizeof(struct pico_ipv4_hdr));
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(sizeof(struct pico_ipv4_hdr));
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    /* Case 1: first fragment was not received, do not send notify + empty tree */
-    a->net_hdr = a->buffer;
-    a->net_len = sizeof(struct pico_ipv4_hdr);
-    a->buffer[0] = 0x40;        /* IPV4 */
-    a->frag = 0x20 >> 3u;       /* off = 32 */
-
-    pico_tree_insert(&ipv4_fragments, a);
-
-    pico_frag_expire(0, (void*)(&ipv4_fragments));
-    fail_if(icmp4_frag_expired_called);
-    fail_if(!pico_tree_empty(&ipv4_fragments));
-
-    /* Case 2: first fragment was received, send notify + empty tree */
-
-    b->net_hdr = b->buffer;
-    b->net_len = sizeof(struct pico_ipv4_hdr);
-    b->buffer[0] = 0x40;        /* IPV4 */
-    b->frag = PICO_IPV4_MOREFRAG; /* more frags */
-
-    pico_tree_insert(&ipv4_fragments, b);
-
-    pico_frag_expire(0, (void*)(&ipv4_fragments));
-    fail_if(!icmp4_frag_expired_called);
-    fail_if(!pico_tree_empty(&ipv4_fragments));
-
-    /* Case 3: first fragment was received but it is multicast, do not send notify + empty tree */
-    /* Reallocate frame, it was discarded in the last pico_frag_expire() */
-    b = pico_frame_alloc(sizeof(struct pico_ipv4_hdr));
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-    /* Reset env vars */
-    icmp4_frag_expired_called = 0;
-
-    b->net_hdr = b->buffer;
-    b->net_len = sizeof(struct pico_ipv4_hdr);
-    b->buffer[0] = 0x40;        /* IPV4 */
-    b->frag = PICO_IPV4_MOREFRAG; /* more frags */
-
-    pico_string_to_ipv4(ipv4_multicast_address, &((struct pico_ipv4_hdr*)(b->net_hdr))->dst.addr);
-
-    pico_tree_insert(&ipv4_fragments, b);
-
-    pico_frag_expire(0, (void*)(&ipv4_fragments));
-    fail_if(icmp4_frag_expired_called);
-    fail_if(!pico_tree_empty(&ipv4_fragments));
-
-
-    /* IPV6 TESTS */
-    /* re-allocate frames, they were discarded in pico_frag_expire */
-    a = pico_frame_alloc(sizeof(struct pico_ipv6_hdr));
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(sizeof(struct pico_ipv6_hdr));
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    /* Case 4: first fragment was not received, do not send notify + empty tree */
-    a->net_hdr = a->buffer;
-    a->net_len = sizeof(struct pico_ipv6_hdr);
-    a->buffer[0] = 0x60;        /* IPV6 */
-    a->frag = 0x20;             /* off = 32 */
-    memcpy(((struct pico_ipv6_hdr*)(a->net_hdr))->dst.addr, addr_1.addr, PICO_SIZE_IP6);
-
-    pico_tree_insert(&ipv6_fragments, a);
-
-    pico_frag_expire(0, (void*)(&ipv6_fragments));
-    fail_if(icmp6_frag_expired_called);
-    fail_if(!pico_tree_empty(&ipv6_fragments));
-
-    /* Case 5: first fragment was received, send notify + empty tree */
-
-    b->net_hdr = b->buffer;
-    b->net_len = sizeof(struct pico_ipv6_hdr);
-    b->buffer[0] = 0x60;        /* IPV6 */
-    b->frag = 1;
-    memcpy(((struct pico_ipv6_hdr*)(b->net_hdr))->dst.addr, addr_1.addr, PICO_SIZE_IP6);
-
-    pico_tree_insert(&ipv6_fragments, b);
-
-    pico_frag_expire(0, (void*)(&ipv6_fragments));
-    fail_if(!icmp6_frag_expired_called);
-    fail_if(!pico_tree_empty(&ipv6_fragments));
-
-    /* Case 6: first fragment was received but it is multicast, do not send notify + empty tree */
-    /* Reallocate frame, it was discarded in the last pico_frag_expire() */
-    b = pico_frame_alloc(sizeof(struct pico_ipv6_hdr));
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-    /* Reset env vars */
-    icmp6_frag_expired_called = 0;
-
-    b->net_hdr = b->buffer;
-    b->net_len = sizeof(struct pico_ipv4_hdr);
-    b->buffer[0] = 0x60;        /* IPV4 */
-    b->frag = 1;
-
-    memcpy(((struct pico_ipv6_hdr*)(b->net_hdr))->dst.addr, ipv6_multicast_addr.addr, PICO_SIZE_IP6);
-
-    pico_tree_insert(&ipv6_fragments, b);
-
-    pico_frag_expire(0, (void*)(&ipv6_fragments));
-    fail_if(icmp6_frag_expired_called);
-    fail_if(!pico_tree_empty(&ipv6_fragments));
-
+    frag_reset();
+
+    /* two different last fragments */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 64, 32, 0);
+    frag4(TESTID, 0x0a000001, 0x0a000002, 128, 32, 0);
+    fail_if(frag_count() != 0);
+
+    /* data beyond the last fragment */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 64, 32, 0);
+    frag4(TESTID, 0x0a000001, 0x0a000002, 96, 32, 1);
+    fail_if(frag_count() != 0);
+
+    /* last fragment before data already received */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 128, 32, 1);
+    frag4(TESTID, 0x0a000001, 0x0a000002, 64, 32, 0);
+    fail_if(frag_count() != 0);
+
+    /* past the maximum datagram size */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 0xFFF8, 32, 0);
+    fail_if(frag_count() != 0);
+
+    /* empty fragments */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 64, 0, 1);
+    fail_if(frag_count() != 0);
+
+    /* no timer, no reassembly */
+    timer_add_fail = 1;
+    frag4(TESTID, 0x0a000001, 0x0a000002, 0, 32, 1);
+    fail_if(frag_count() != 0);
+    fail_if(pico_frag_mem != 0);
+    frag_reset();
 }
 END_TEST
-START_TEST(tc_pico_ipv6_frag_timer_on)
-{
-    /* Reset env variable */
-    timer_add_called = 0;
 
-    pico_ipv6_frag_timer_on();
-
-    /* Was timer added? */
-    fail_if(!timer_add_called);
+START_TEST(tc_pico_frag_too_many_holes)
+{
+    uint32_t i;
+
+    frag_reset();
+    for (i = 0; i < PICO_FRAG_MAX_RANGES; i++)
+        frag4(TESTID, 0x0a000001, 0x0a000002, i * 16, 8, 1);
+    fail_if(frag_count() != 1);
+    frag4(TESTID, 0x0a000001, 0x0a000002, i * 16, 8, 1);
+    fail_if(frag_count() != 0);
+    frag_reset();
 }
 END_TEST
-START_TEST(tc_pico_ipv4_frag_timer_on)
-{
-    /* Reset env variable */
-    timer_add_called = 0;
-
-    pico_ipv4_frag_timer_on();
 
-    /* Was timer added? */
-    fail_if(!timer_add_called);
+START_TEST(tc_pico_frag_mem_cap)
+{
+    struct pico_frag_dgram key;
+    uint32_t size = (PICO_FRAG_MEM_MAX / 3) & ~7u;
+
+    frag_reset();
+    frag4(1, 0x0a000001, 0x0a000002, size - 8, 8, 0);
+    frag4(2, 0x0a000001, 0x0a000002, size - 8, 8, 0);
+    fail_if(frag_count() != 2);
+    fail_if(pico_frag_mem > PICO_FRAG_MEM_MAX);
+
+    /* the third datagram does not fit: the oldest is dropped */
+    frag4(3, 0x0a000001, 0x0a000002, size - 8, 8, 0);
+    fail_if(frag_count() != 2);
+    fail_if(pico_frag_mem > PICO_FRAG_MEM_MAX);
+
+    memset(&key, 0, sizeof(key));
+    key.net = PICO_PROTO_IPV4;
+    key.proto = TESTPROTO;
+    key.id = short_be(1);
+    key.src.ip4.addr = long_be(0x0a000001);
+    key.dst.ip4.addr = long_be(0x0a000002);
+    fail_if(pico_tree_findKey(&pico_frag_dgrams, &key) != NULL);
+    key.id = short_be(3);
+    fail_if(pico_tree_findKey(&pico_frag_dgrams, &key) == NULL);
+
+    /* one datagram larger than the cap is never reassembled */
+    frag_reset();
+    frag4(1, 0x0a000001, 0x0a000002, 0, 0xFFF0, 1);
+    if ((0xFFF0 + PICO_SIZE_IP4HDR) > PICO_FRAG_MEM_MAX)
+        fail_if(frag_count() != 0);
+
+    frag_reset();
 }
 END_TEST
-START_TEST(tc_pico_ipv6_frag_match)
-{
-    struct pico_frame *a, *b;
-    struct pico_ipv6_hdr *ha, *hb;
-
-    /* Addr setup */
-    struct pico_ip6 addr_1 = {{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 9 }};
-    struct pico_ip6 addr_2 = {{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 8 }};
-
-    /* Inital setup */
-    a = pico_frame_alloc(sizeof(struct pico_ipv6_hdr));
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(sizeof(struct pico_ipv6_hdr));
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    /* Case 1: net hdr(s) are NULL */
-    a->net_hdr = NULL;
-    b->net_hdr = NULL;
-
-    fail_if(pico_ipv6_frag_match(a, b) != -2);
-
-    /* Init a frame */
-    a->net_hdr = a->buffer;
-    a->net_len = sizeof(struct pico_ipv6_hdr);
-
-    fail_if(pico_ipv6_frag_match(a, b) != -2);
 
-    /* Init b frame */
-    b->net_hdr = b->buffer;
-    b->net_len = sizeof(struct pico_ipv6_hdr);
-
-    /* Init hdrs for rest of tests*/
-    ha = (struct pico_ipv6_hdr *)a->net_hdr;
-    hb = (struct pico_ipv6_hdr *)b->net_hdr;
-
-    /* Case 2: src addr are different*/
-    /* Init a and b net hdr adresses */
-    memcpy(ha->src.addr, addr_1.addr, PICO_SIZE_IP6);
-    memcpy(ha->dst.addr, addr_2.addr, PICO_SIZE_IP6);
-    memcpy(hb->src.addr, addr_2.addr, PICO_SIZE_IP6);
-    memcpy(hb->dst.addr, addr_2.addr, PICO_SIZE_IP6);
-
-    fail_if(pico_ipv6_frag_match(a, b) != 1);
-
-    /* Case 3: dst addr are different*/
-    /* Init a and b net hdr adresses */
-    memcpy(ha->src.addr, addr_1.addr, PICO_SIZE_IP6);
-    memcpy(ha->dst.addr, addr_2.addr, PICO_SIZE_IP6);
-    memcpy(hb->src.addr, addr_1.addr, PICO_SIZE_IP6);
-    memcpy(hb->dst.addr, addr_1.addr, PICO_SIZE_IP6);
+START_TEST(tc_pico_ipv6_process_frag)
+{
+    struct pico_ipv6_exthdr ext;
 
-    fail_if(pico_ipv6_frag_match(a, b) != 2);
+    frag_reset();
 
-    /* Case 4: fragments are the same (src and dst are the same)*/
-    /* Init a and b net hdr adresses */
-    memcpy(ha->src.addr, addr_1.addr, PICO_SIZE_IP6);
-    memcpy(ha->dst.addr, addr_2.addr, PICO_SIZE_IP6);
-    memcpy(hb->src.addr, addr_1.addr, PICO_SIZE_IP6);
-    memcpy(hb->dst.addr, addr_2.addr, PICO_SIZE_IP6);
+    /* NULL args provided */
+    pico_ipv6_process_frag(NULL, NULL, TESTPROTO);
+    memset(&ext, 0, sizeof(ext));
+    pico_ipv6_process_frag(&ext, NULL, TESTPROTO);
+    fail_if(timer_add_called != 0);
 
-    fail_if(pico_ipv6_frag_match(a, b) != 0);
+    frag6(0x0F000000, 64, 32, 0);
+    frag6(0x0F000000, 0, 32, 1);
+    fail_if(transport_recv_called != 0);
+    frag6(0x0F000000, 32, 32, 1);
+    fail_if(transport_recv_called != 1);
+    fail_if(transport_recv_len != 96);
+    fail_if(transport_recv_bad != 0);
+    fail_if(frag_count() != 0);
+
+    /* RFC 5722: an overlap drops the datagram */
+    frag6(0x0F000001, 0, 32, 1);
+    frag6(0x0F000001, 16, 32, 1);
+    fail_if(frag_count() != 0);
+    frag6(0x0F000001, 32, 32, 0);
+    fail_if(transport_recv_called != 1);
 
-    /* Cleanup */
-    pico_frame_discard(a);
-    pico_frame_discard(b);
+    /* atomic fragment */
+    frag_reset();
+    frag6(0x0F000002, 0, 48, 0);
+    fail_if(transport_recv_called != 1 || transport_recv_len != 48);
+    frag_reset();
 }
 END_TEST
-START_TEST(tc_pico_ipv4_frag_match)
-{
-    struct pico_frame *a, *b;
-    struct pico_ipv4_hdr *ha, *hb;
-
-    /* Addr setup */
-    struct pico_ip4 addr_1 = {
-        .addr = long_be(0x0a280064)
-    };
-
-    struct pico_ip4 addr_2 = {
-        .addr = long_be(0x0a280312)
-    };
-
-    /* Case 1: frames are NULL */
-    a = NULL;
-    b = NULL;
-
-    fail_if(pico_ipv4_frag_match(a, b) != -1);
 
-    /* setup */
-    a = pico_frame_alloc(sizeof(struct pico_ipv4_hdr));
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(sizeof(struct pico_ipv4_hdr));
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-
-    /* Case 2: net hdr(s) are NULL */
-    a->net_hdr = NULL;
-    b->net_hdr = NULL;
-
-    fail_if(pico_ipv4_frag_match(a, b) != -2);
-
-    /* Init a frame */
-    a->net_hdr = a->buffer;
-    a->net_len = sizeof(struct pico_ipv4_hdr);
-
-    fail_if(pico_ipv4_frag_match(a, b) != -2);
-
-    /* Init b frame */
-    b->net_hdr = b->buffer;
-    b->net_len = sizeof(struct pico_ipv4_hdr);
-
-    /* Init hdrs for rest of tests*/
-    ha = (struct pico_ipv4_hdr *)a->net_hdr;
-    hb = (struct pico_ipv4_hdr *)b->net_hdr;
-
-    /* Case 3: src addr are different*/
-    /* Init a and b net hdr adresses */
-    ha->src = addr_1;
-    ha->dst = addr_2;
-    hb->src = addr_2;
-    hb->dst = addr_2;
-
-    fail_if(pico_ipv4_frag_match(a, b) != 1);
-
-    /* Case 4: dst addr are different*/
-    /* Init a and b net hdr adresses */
-    ha->src = addr_1;
-    ha->dst = addr_2;
-    hb->src = addr_1;
-    hb->dst = addr_1;
-
-    fail_if(pico_ipv4_frag_match(a, b) != 2);
+START_TEST(tc_pico_frag_expire)
+{
+    struct pico_frag_dgram *dg;
 
-    /* Case 5: fragments are the same (src and dst are the same)*/
-    /* Init a and b net hdr adresses */
-    ha->src = addr_1;
-    ha->dst = addr_2;
-    hb->src = addr_1;
-    hb->dst = addr_2;
+    frag_reset();
 
-    fail_if(pico_ipv4_frag_match(a, b) != 0);
+    /* first fragment missing: no notify */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 64, 32, 0);
+    dg = pico_tree_first(&pico_frag_dgrams);
+    fail_if(!dg);
+    pico_frag_expire(0, dg);
+    fail_if(icmp4_frag_expired_called);
+    fail_if(frag_count() != 0);
+    /* the firing timer is not cancelled */
+    fail_if(timer_cancel_called);
+
+    /* first fragment received, unicast: notify */
+    frag4(TESTID, 0x0a000001, 0x0a000002, 0, 32, 1);
+    frag4(TESTID, 0x0a000001, 0x0a000002, 64, 32, 0);
+    pico_frag_expire(0, pico_tree_first(&pico_frag_dgrams));
+    fail_if(icmp4_frag_expired_called != 1);
+    fail_if(frag_count() != 0);
+
+    /* multicast destination: no notify */
+    icmp4_frag_expired_called = 0;
+    frag4(TESTID, 0x0a000001, 0xe0000001, 0, 32, 1);
+    pico_frag_expire(0, pico_tree_first(&pico_frag_dgrams));
+    fail_if(icmp4_frag_expired_called);
 
-    /* Cleanup */
-    pico_frame_discard(a);
-    pico_frame_discard(b);
+    /* IPv6 */
+    frag6(0x0F000000, 0, 32, 1);
+    pico_frag_expire(0, pico_tree_first(&pico_frag_dgrams));
+    fail_if(icmp6_frag_expired_called != 1);
+    fail_if(frag_count() != 0);
+    fail_if(pico_frag_mem != 0);
+    frag_reset();
 }
 END_TEST
 
@@ -822,403 +563,47 @@ START_TEST(tc_pico_fragments_get_offset)
 }
 END_TEST
 
-START_TEST(tc_pico_fragments_reassemble)
-{
-    struct pico_frame *a, *b;
-
-    /* NULL tree */
-    transport_recv_called = 0;
-    buffer_len_transport_receive = 0;
-    fail_if(pico_fragments_reassemble(NULL, 0, TESTPROTO, PICO_PROTO_IPV4) != -1);
-    fail_if(transport_recv_called);
-
-    /* Empty tree */
-    transport_recv_called = 0;
-    buffer_len_transport_receive = 0;
-    fail_if(pico_fragments_reassemble(&ipv4_fragments, 0, TESTPROTO, PICO_PROTO_IPV4) != -2);
-    fail_if(transport_recv_called);
-
-    /* Empty tree */
-    transport_recv_called = 0;
-    buffer_len_transport_receive = 0;
-    fail_if(pico_fragments_reassemble(&ipv6_fragments, 0, TESTPROTO, PICO_PROTO_IPV6) != -2);
-    fail_if(transport_recv_called);
-
-    /* Case 1: IPV4 , everything good */
-    transport_recv_called = 0;
-    buffer_len_transport_receive = 0;
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = PICO_IPV4_MOREFRAG; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20 >> 3u; /* off = 32 */
-
-    pico_tree_insert(&ipv4_fragments, a);
-    pico_tree_insert(&ipv4_fragments, b);
-
-    fail_if(pico_fragments_reassemble(&ipv4_fragments, 64, TESTPROTO, PICO_PROTO_IPV4) != 0);
-    fail_if(transport_recv_called != 1);
-    fail_if(buffer_len_transport_receive != 64 + PICO_SIZE_IP4HDR);
-    fail_if(!pico_tree_empty(&ipv4_fragments));
-
-    /* Case 2: IPV6 , everything good */
-    transport_recv_called = 0;
-    buffer_len_transport_receive = 0;
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = 1; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20; /* off = 32 */
-
-    pico_tree_insert(&ipv6_fragments, a);
-    pico_tree_insert(&ipv6_fragments, b);
-
-    fail_if(pico_fragments_reassemble(&ipv6_fragments, 64, TESTPROTO, PICO_PROTO_IPV6) != 0);
-    fail_if(transport_recv_called != 1);
-    fail_if(buffer_len_transport_receive != 64 + PICO_SIZE_IP6HDR);
-    fail_if(!pico_tree_empty(&ipv4_fragments));
-
-    /* Case 3: IPV4 with mm failure*/
-    transport_recv_called = 0;
-    buffer_len_transport_receive = 0;
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = PICO_IPV4_MOREFRAG; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20 >> 3u; /* off = 32 */
-
-    pico_tree_insert(&ipv4_fragments, a);
-    pico_tree_insert(&ipv4_fragments, b);
-
-    pico_set_mm_failure(1);
-    fail_if(pico_fragments_reassemble(&ipv4_fragments, 64, TESTPROTO, PICO_PROTO_IPV4) != 1);
-    fail_if(transport_recv_called == 1);
-    fail_if(buffer_len_transport_receive != 0);
-    fail_if(pico_tree_empty(&ipv4_fragments));
-
-    /* Case 4: IPV6 with mm failure */
-    transport_recv_called = 0;
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = 1; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20; /* off = 32 */
-
-    pico_tree_insert(&ipv6_fragments, a);
-    pico_tree_insert(&ipv6_fragments, b);
-
-    pico_set_mm_failure(1);
-    fail_if(pico_fragments_reassemble(&ipv6_fragments, 64, TESTPROTO, PICO_PROTO_IPV6) != 1);
-    fail_if(transport_recv_called == 1);
-    fail_if(buffer_len_transport_receive != 0);
-    fail_if(pico_tree_empty(&ipv6_fragments));
-}
-END_TEST
-
-START_TEST(tc_pico_ipv6_process_frag)
-{
-    struct pico_ipv6_exthdr *hdr = NULL;
-    struct pico_frame *a = NULL, *b = NULL, *c = NULL;
-
-    /* NULL args provided */
-    ipv6_cur_frag_id = 0;
-    timer_add_called = 0;
-    pico_ipv6_process_frag(hdr, a, TESTPROTO);
-    fail_if(ipv6_cur_frag_id != 0);
-    fail_if(timer_add_called != 0);
-
-    /* init hdr */
-    hdr = PICO_ZALLOC(sizeof(struct pico_ipv6_exthdr));
-    hdr->ext.frag.id[0]= 0xF;
-
-    /* NULL frame provided */
-    ipv6_cur_frag_id = 0;
-    timer_add_called = 0;
-    pico_ipv6_process_frag(hdr, a, TESTPROTO);
-    fail_if(ipv6_cur_frag_id != 0);
-    fail_if(timer_add_called != 0);
-
-    /* init frame */
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-    c = pico_frame_alloc(64 + 20);
-    fail_if(!c);
-    printf("Allocated frame, %p\n", c);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = 1; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20 | 0x1; /* off = 32 */
-
-    c->net_hdr = c->buffer;
-    c->net_len = 20;
-    c->transport_len = 32;
-    c->transport_hdr = c->buffer + 20;
-    c->frag = 0x40; /* off = 64 */
-
-    /* Case 1: Empty fragments tree */
-    ipv6_cur_frag_id = 0;
-    timer_add_called = 0;
-    /* make sure tree is empty */
-    fail_if(!pico_tree_empty(&ipv6_fragments));
-
-    pico_ipv6_process_frag(hdr, a, TESTPROTO);
-    fail_if(ipv6_cur_frag_id != IP6_FRAG_ID(hdr));
-    fail_if(timer_add_called != 1);
-    fail_if(pico_tree_empty(&ipv6_fragments));
-    /* make sure we added the fragment to the tree */
-    fail_if(((struct pico_frame *)pico_tree_first(&ipv6_fragments))->buffer != a->buffer);
-
-    /* Case 2: Adding second fragment */
-    timer_add_called = 0;
-    pico_ipv6_process_frag(hdr, b, TESTPROTO);
-    fail_if(ipv6_cur_frag_id != IP6_FRAG_ID(hdr));
-    fail_if(timer_add_called != 0);
-    fail_if(pico_tree_empty(&ipv6_fragments));
-    /* make sure we added the fragment to the tree */
-    fail_if(((struct pico_frame *)pico_tree_last(&ipv6_fragments))->buffer != b->buffer);
-
-    /* Case 3: Adding final fragment */
-    timer_cancel_called = 0;
-    transport_recv_called = 0;
-    buffer_len_transport_receive = 0;
-    pico_ipv6_process_frag(hdr, c, TESTPROTO);
-    fail_if(ipv6_cur_frag_id != IP6_FRAG_ID(hdr));
-    fail_if(timer_cancel_called != 1);
-    fail_if(transport_recv_called != 1);
-    fail_if(buffer_len_transport_receive != 96 + PICO_SIZE_IP6HDR);
-    /* Everything was received, tree should be empty */
-    fail_if(!pico_tree_empty(&ipv6_fragments));
-
-    /* Cleanup */
-    pico_fragments_empty_tree(&ipv6_fragments);
-    pico_frame_discard(a);
-    pico_frame_discard(b);
-    pico_frame_discard(c);
-}
-END_TEST
-
-START_TEST(tc_pico_ipv4_process_frag)
-{
-    struct pico_ipv4_hdr *hdr = NULL;
-    struct pico_frame *a = NULL, *b = NULL, *c = NULL;
-
-    /* NULL args provided */
-    ipv4_cur_frag_id = 0;
-    timer_add_called = 0;
-    pico_ipv4_process_frag(hdr, a, TESTPROTO);
-    fail_if(ipv4_cur_frag_id != 0);
-    fail_if(timer_add_called != 0);
-
-    /* init hdr */
-    hdr = PICO_ZALLOC(sizeof(struct pico_ipv4_hdr));
-    hdr->id = TESTID;
-
-    /* NULL frame provided */
-    ipv4_cur_frag_id = 0;
-    timer_add_called = 0;
-    pico_ipv4_process_frag(hdr, a, TESTPROTO);
-    fail_if(ipv4_cur_frag_id != 0);
-    fail_if(timer_add_called != 0);
-
-    /* init frame */
-    a = pico_frame_alloc(32 + 20);
-    fail_if(!a);
-    printf("Allocated frame, %p\n", a);
-    b = pico_frame_alloc(32 + 20);
-    fail_if(!b);
-    printf("Allocated frame, %p\n", b);
-    c = pico_frame_alloc(64 + 20);
-    fail_if(!c);
-    printf("Allocated frame, %p\n", c);
-
-    a->net_hdr = a->buffer;
-    a->net_len = 20;
-    a->transport_len = 32;
-    a->transport_hdr = a->buffer + 20;
-    a->frag = PICO_IPV4_MOREFRAG; /* more frags */
-
-    b->net_hdr = b->buffer;
-    b->net_len = 20;
-    b->transport_len = 32;
-    b->transport_hdr = b->buffer + 20;
-    b->frag = 0x20 >> 3u | PICO_IPV4_MOREFRAG; /* off = 32 + more frags*/
-
-    c->net_hdr = c->buffer;
-    c->net_len = 20;
-    c->transport_len = 32;
-    c->transport_hdr = c->buffer + 20;
-    c->frag = 0x40 >> 3u; /* off = 64 */
-
-    /* Case 1: Empty fragments tree */
-    ipv4_cur_frag_id = 0;
-    timer_add_called = 0;
-    /* make sure tree is empty */
-    fail_if(!pico_tree_empty(&ipv4_fragments));
-
-    pico_ipv4_process_frag(hdr, a, TESTPROTO);
-    fail_if(ipv4_cur_frag_id != TESTID);
-    fail_if(timer_add_called != 1);
-    fail_if(pico_tree_empty(&ipv4_fragments));
-    /* make sure we added the fragment to the tree */
-    fail_if(((struct pico_frame *)pico_tree_first(&ipv4_fragments))->buffer != a->buffer);
-
-    /* Case 2: Adding second fragment */
-    timer_add_called = 0;
-    pico_ipv4_process_frag(hdr, b, TESTPROTO);
-    fail_if(ipv4_cur_frag_id != TESTID);
-    fail_if(timer_add_called != 0);
-    fail_if(pico_tree_empty(&ipv4_fragments));
-    /* make sure we added the fragment to the tree */
-    fail_if(((struct pico_frame *)pico_tree_last(&ipv4_fragments))->buffer != b->buffer);
-
-    /* Case 3: Adding final fragment */
-    timer_cancel_called = 0;
-    transport_recv_called = 0;
-    buffer_len_transport_receive = 0;
-    pico_ipv4_process_frag(hdr, c, TESTPROTO);
-    fail_if(ipv4_cur_frag_id != TESTID);
-    fail_if(timer_cancel_called != 1);
-    fail_if(transport_recv_called != 1);
-    fail_if(buffer_len_transport_receive != 96 + PICO_SIZE_IP4HDR);
-    /* Everything was received, tree should be empty */
-    fail_if(!pico_tree_empty(&ipv4_fragments));
-
-    /* Cleanup */
-    pico_fragments_empty_tree(&ipv4_fragments);
-    pico_frame_discard(a);
-    pico_frame_discard(b);
-    pico_frame_discard(c);
-}
-END_TEST
-
 Suite *pico_suite(void)
 {
     Suite *s = suite_create("PicoTCP");
 
-    TCase *TCase_pico_ipv6_process_frag = tcase_create("Unit test for pico_ipv6_process_frag");
+    TCase *TCase_pico_frag_range_add = tcase_create("Unit test for pico_frag_range_add");
     TCase *TCase_pico_ipv4_process_frag = tcase_create("Unit test for pico_ipv4_process_frag");
-
-    TCase *TCase_pico_fragments_reassemble = tcase_create("Unit test for pico_fragments_reassemble");
+    TCase *TCase_pico_ipv4_out_of_order = tcase_create("Unit test for out of order IPv4 fragments");
+    TCase *TCase_pico_frag_concurrent = tcase_create("Unit test for concurrent datagrams");
+    TCase *TCase_pico_frag_invalid = tcase_create("Unit test for inconsistent fragments");
+    TCase *TCase_pico_frag_too_many_holes = tcase_create("Unit test for PICO_FRAG_MAX_RANGES");
+    TCase *TCase_pico_frag_mem_cap = tcase_create("Unit test for PICO_FRAG_MEM_MAX");
+    TCase *TCase_pico_ipv6_process_frag = tcase_create("Unit test for pico_ipv6_process_frag");
+    TCase *TCase_pico_frag_expire = tcase_create("Unit test for pico_frag_expire");
     TCase *TCase_pico_fragments_get_offset = tcase_create("Unit test for pico_fragments_get_offset");
     TCase *TCase_pico_fragments_get_more_flag = tcase_create("Unit test for pico_fragments_get_more_flag");
     TCase *TCase_pico_fragments_get_header_length = tcase_create("Unit test for pico_fragments_get_header_length");
 
-    TCase *TCase_pico_fragments_empty_tree = tcase_create("Unit test for pico_fragments_empty_tree");
-    TCase *TCase_pico_fragments_send_notify = tcase_create("Unit test for pico_fragments_send_notify");
-    TCase *TCase_pico_ipv6_frag_compare = tcase_create("Unit test for pico_ipv6_frag_compare");
-    TCase *TCase_pico_ipv4_frag_compare = tcase_create("Unit test for pico_ipv4_frag_compare");
-    TCase *TCase_pico_ipv6_fragments_complete = tcase_create("Unit test for pico_ipv6_fragments_complete");
-    TCase *TCase_pico_ipv4_fragments_complete = tcase_create("Unit test for pico_ipv4_fragments_complete");
-    TCase *TCase_pico_fragments_complete = tcase_create("Unit test for pico_fragments_complete");
-    TCase *TCase_pico_fragments_check_complete = tcase_create("Unit test for pico_fragments_check_complete");
-    TCase *TCase_pico_frag_expire = tcase_create("Unit test for pico_frag_expire");
-    TCase *TCase_pico_ipv6_frag_timer_on = tcase_create("Unit test for pico_ipv6_frag_timer_on");
-    TCase *TCase_pico_ipv4_frag_timer_on = tcase_create("Unit test for pico_ipv4_frag_timer_on");
-    TCase *TCase_pico_ipv6_frag_match = tcase_create("Unit test for pico_ipv6_frag_match");
-    TCase *TCase_pico_ipv4_frag_match = tcase_create("Unit test for pico_ipv4_frag_match");
-
+    tcase_add_test(TCase_pico_frag_range_add, tc_pico_frag_range_add);
+    suite_add_tcase(s, TCase_pico_frag_range_add);
     tcase_add_test(TCase_pico_ipv4_process_frag, tc_pico_ipv4_process_frag);
     suite_add_tcase(s, TCase_pico_ipv4_process_frag);
+    tcase_add_test(TCase_pico_ipv4_out_of_order, tc_pico_ipv4_out_of_order);
+    suite_add_tcase(s, TCase_pico_ipv4_out_of_order);
+    tcase_add_test(TCase_pico_frag_concurrent, tc_pico_frag_concurrent);
+    suite_add_tcase(s, TCase_pico_frag_concurrent);
+    tcase_add_test(TCase_pico_frag_invalid, tc_pico_frag_invalid);
+    suite_add_tcase(s, TCase_pico_frag_invalid);
+    tcase_add_test(TCase_pico_frag_too_many_holes, tc_pico_frag_too_many_holes);
+    suite_add_tcase(s, TCase_pico_frag_too_many_holes);
+    tcase_add_test(TCase_pico_frag_mem_cap, tc_pico_frag_mem_cap);
+    suite_add_tcase(s, TCase_pico_frag_mem_cap);
     tcase_add_test(TCase_pico_ipv6_process_frag, tc_pico_ipv6_process_frag);
     suite_add_tcase(s, TCase_pico_ipv6_process_frag);
-    tcase_add_test(TCase_pico_fragments_reassemble, tc_pico_fragments_reassemble);
-    suite_add_tcase(s, TCase_pico_fragments_reassemble);
+    tcase_add_test(TCase_pico_frag_expire, tc_pico_frag_expire);
+    suite_add_tcase(s, TCase_pico_frag_expire);
     tcase_add_test(TCase_pico_fragments_get_offset, tc_pico_fragments_get_offset);
     suite_add_tcase(s, TCase_pico_fragments_get_offset);
     tcase_add_test(TCase_pico_fragments_get_more_flag, tc_pico_fragments_get_more_flag);
     suite_add_tcase(s, TCase_pico_fragments_get_more_flag);
     tcase_add_test(TCase_pico_fragments_get_header_length, tc_pico_fragments_get_header_length);
     suite_add_tcase(s, TCase_pico_fragments_get_header_length);
-    tcase_add_test(TCase_pico_fragments_send_notify, tc_pico_fragments_send_notify);
-    suite_add_tcase(s, TCase_pico_fragments_send_notify);
-    tcase_add_test(TCase_pico_fragments_empty_tree, tc_pico_fragments_empty_tree);
-    suite_add_tcase(s, TCase_pico_fragments_empty_tree);
-    tcase_add_test(TCase_pico_ipv6_frag_compare, tc_pico_ipv6_frag_compare);
-    suite_add_tcase(s, TCase_pico_ipv6_frag_compare);
-    tcase_add_test(TCase_pico_ipv4_frag_compare, tc_pico_ipv4_frag_compare);
-    suite_add_tcase(s, TCase_pico_ipv4_frag_compare);
-    tcase_add_test(TCase_pico_ipv6_fragments_complete, tc_pico_ipv6_fragments_complete);
-    suite_add_tcase(s, TCase_pico_ipv6_fragments_complete);
-    tcase_add_test(TCase_pico_ipv4_fragments_complete, tc_pico_ipv4_fragments_complete);
-    suite_add_tcase(s, TCase_pico_ipv4_fragments_complete);
-    tcase_add_test(TCase_pico_fragments_complete, tc_pico_fragments_complete);
-    suite_add_tcase(s, TCase_pico_fragments_complete);
-    tcase_add_test(TCase_pico_fragments_check_complete, tc_pico_fragments_check_complete);
-    suite_add_tcase(s, TCase_pico_fragments_check_complete);
-    tcase_add_test(TCase_pico_frag_expire, tc_pico_frag_expire);
-    suite_add_tcase(s, TCase_pico_frag_expire);
-    tcase_add_test(TCase_pico_ipv6_frag_timer_on, tc_pico_ipv6_frag_timer_on);
-    suite_add_tcase(s, TCase_pico_ipv6_frag_timer_on);
-    tcase_add_test(TCase_pico_ipv4_frag_timer_on, tc_pico_ipv4_frag_timer_on);
-    suite_add_tcase(s, TCase_pico_ipv4_frag_timer_on);
-    tcase_add_test(TCase_pico_ipv6_frag_match, tc_pico_ipv6_frag_match);
-    suite_add_tcase(s, TCase_pico_ipv6_frag_match);
-    tcase_add_test(TCase_pico_ipv4_frag_match, tc_pico_ipv4_frag_match);
-    suite_add_tcase(s, TCase_pico_ipv4_frag_match);
     return s;
 }
 
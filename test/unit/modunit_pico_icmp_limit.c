@@ -0,0 +1,156 @@
+#define PICO_SUPPORT_ICMP_LIMIT
+#include <pico_stack.h>
+#include <pico_protocol.h>
+#include "modules/pico_icmp_limit.c"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+static union pico_address dst4(uint32_t host)
+{
+    union pico_address a;
+
+    memset(&a, 0, sizeof(a));
+    a.ip4.addr = long_be(0x0A000000u | host);
+    return a;
+}
+
+static void limit_setup(uint8_t cls, uint32_t rate, uint32_t burst, uint32_t total)
+{
+    struct pico_icmp_limit_config cfg = { 0 };
+
+    cfg.rate = rate;
+    cfg.burst = burst;
+    cfg.total = total;
+    pico_icmp_limit_flush();
+    fail_if(pico_icmp_limit_set(cls, &cfg) != 0);
+    pico_tick = 1000;
+}
+
+START_TEST(tc_icmp_limit_destination)
+{
+    union pico_address a = dst4(1), b = dst4(2);
+    struct pico_icmp_limit_config cfg;
+    struct pico_icmp_limit_stats st;
+    uint32_t i;
+
+    pico_stack_init();
+    fail_if(pico_icmp_limit_get(PICO_ICMP_LIMIT_ECHO, &cfg) != 0);
+    fail_if(cfg.rate != PICO_ICMP_LIMIT_ECHO_RATE || cfg.total != PICO_ICMP_LIMIT_ECHO_TOTAL);
+    fail_if(pico_icmp_limit_get(PICO_ICMP_LIMIT_CLASSES, &cfg) != -1);
+    fail_if(pico_icmp_limit_set(PICO_ICMP_LIMIT_ERROR, NULL) != -1);
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, NULL) != -1);
+
+    limit_setup(PICO_ICMP_LIMIT_ERROR, 10, 5, 0);
+    for (i = 0; i < 5; i++)
+        fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != 0);
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != -1);
+
+    /* Other destinations, protocols and classes have buckets of their own */
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &b) != 0);
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV6, &a) != 0);
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ECHO, PICO_PROTO_IPV4, &a) != 0);
+
+    /* One token every 100 ms */
+    pico_tick += 99;
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != -1);
+    pico_tick += 1;
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != 0);
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != -1);
+
+    pico_icmp_limit_get_stats(&st);
+    fail_if(st.sent[PICO_ICMP_LIMIT_ERROR] != 8 || st.limited[PICO_ICMP_LIMIT_ERROR] != 3);
+    fail_if(st.sent[PICO_ICMP_LIMIT_ECHO] != 1 || st.entries != 3);
+
+    /* A new configuration refills the buckets */
+    limit_setup(PICO_ICMP_LIMIT_ERROR, 0, 0, 0);
+    for (i = 0; i < 100; i++)
+        fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != 0);
+    pico_icmp_limit_get_stats(&st);
+    fail_if(st.entries != 0);
+}
+END_TEST
+
+START_TEST(tc_icmp_limit_total)
+{
+    union pico_address a;
+    struct pico_icmp_limit_stats st;
+    uint32_t i;
+
+    pico_stack_init();
+    limit_setup(PICO_ICMP_LIMIT_ECHO, 10, 0, 20);
+
+    /* Spoofed sources each get a bucket, the total still holds */
+    for (i = 0; i < 100; i++) {
+        a = dst4(i);
+        pico_icmp_limit_consume(PICO_ICMP_LIMIT_ECHO, PICO_PROTO_IPV4, &a);
+    }
+    pico_icmp_limit_get_stats(&st);
+    fail_if(st.sent[PICO_ICMP_LIMIT_ECHO] != 20 || st.capped[PICO_ICMP_LIMIT_ECHO] != 80);
+
+    pico_tick += 1000;
+    a = dst4(1000);
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ECHO, PICO_PROTO_IPV4, &a) != 0);
+}
+END_TEST
+
+START_TEST(tc_icmp_limit_lru)
+{
+    union pico_address a;
+    struct pico_icmp_limit_stats st;
+    uint32_t i;
+
+    pico_stack_init();
+    limit_setup(PICO_ICMP_LIMIT_ERROR, 1, 1, 0);
+    for (i = 0; i < PICO_ICMP_LIMIT_ENTRIES; i++) {
+        a = dst4(i);
+        fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != 0);
+    }
+
+    /* 0 becomes the most recent, 1 the least */
+    a = dst4(0);
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != -1);
+    a = dst4(PICO_ICMP_LIMIT_ENTRIES);
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != 0);
+
+    a = dst4(0);
+    fail_if(icmp_limit_find(PICO_PROTO_IPV4, &a) == NULL);
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != -1);
+    a = dst4(1);
+    fail_if(icmp_limit_find(PICO_PROTO_IPV4, &a) != NULL);
+    fail_if(pico_icmp_limit_consume(PICO_ICMP_LIMIT_ERROR, PICO_PROTO_IPV4, &a) != 0);
+
+    pico_icmp_limit_get_stats(&st);
+    fail_if(st.evicted != 2 || st.entries != PICO_ICMP_LIMIT_ENTRIES);
+    pico_icmp_limit_flush();
+    fail_if(icmp_limit_newest || icmp_limit_oldest);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_icmp_limit_destination = tcase_create("Unit test for icmp_limit_destination");
+    TCase *TCase_icmp_limit_total = tcase_create("Unit test for icmp_limit_total");
+    TCase *TCase_icmp_limit_lru = tcase_create("Unit test for icmp_limit_lru");
+
+    tcase_add_test(TCase_icmp_limit_destination, tc_icmp_limit_destination);
+    suite_add_tcase(s, TCase_icmp_limit_destination);
+    tcase_add_test(TCase_icmp_limit_total, tc_icmp_limit_total);
+    suite_add_tcase(s, TCase_icmp_limit_total);
+    tcase_add_test(TCase_icmp_limit_lru, tc_icmp_limit_lru);
+    suite_add_tcase(s, TCase_icmp_limit_lru);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -24,250 +24,136 @@ void pico_frame_discard(struct pico_frame *f)
     (void)f;
 }
 
-volatile pico_err_t pico_err;
-
-
-
-START_TEST(tc_ipfilter)
+#ifdef PICO_SUPPORT_IPV6
+int pico_icmp6_packet_filtered(struct pico_frame *f)
 {
-    uint32_t r;
-    struct filter_node a = {
-        0
-    }, b = {
-        0
-    };
-    fail_if(filter_compare(&a, &b) != 0);
-
-
-    /* a is rule, matching packet b */
-    a.filter_id = 1;
-
-    /* check that rule is matched properly */
-    fail_if(filter_match_packet_find_rule(&a, &b) != &a);
-
-    /* a has a out port that does not match packet */
-    b.out_port = 8;
-    a.out_port = 7;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches all ports */
-    a.out_port = 0;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /*** NEXT TEST ***/
-
-
-    /* a has a in port that does not match packet */
-    b.in_port = 8;
-    a.in_port = 7;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches all ports */
-    a.in_port = 0;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a matches port exactly */
-    a.in_port = 0;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all out addresses */
-    b.out_addr = 0x010000a0;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a does not match b via 8-bit netmask */
-    a.out_addr = 0x000000c0;
-    a.out_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a does not match b at all*/
-    a.out_addr = 0x020000b0;
-    a.out_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches b via 8-bit netmask */
-    a.out_addr = 0x000000a0;
-    a.out_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a matches b exactly */
-    a.out_addr = 0x010000a0;
-    a.out_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all in addresses */
-    b.in_addr = 0x010000a0;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a does not match b via 8-bit netmask */
-    a.in_addr = 0x000000c0;
-    a.in_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a does not match b at all*/
-    a.in_addr = 0x020000b0;
-    a.in_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches b via 8-bit netmask */
-    a.in_addr = 0x000000a0;
-    a.in_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a matches b exactly */
-    a.in_addr = 0x010000a0;
-    a.in_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all protocols */
-    b.proto = 4u;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a does not match protocol */
-    a.proto = 5u;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches b's protocol */
-    a.proto = b.proto;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all devices */
-    b.fdev = (struct pico_device *) &b;
-    fail_if(filter_compare(&a, &b) != 0);
+    (void)f;
+    return 0;
+}
+#endif
 
-    /* a does not match device */
-    a.fdev = (struct pico_device *)&a;
-    fail_if(filter_compare(&a, &b) == 0);
+volatile pico_err_t pico_err;
+volatile pico_time pico_tick;
 
-    /* a matches b's device */
-    a.fdev = b.fdev;
-    fail_if(filter_compare(&a, &b) != 0);
 
 
-    /*** SAME TEST DUPLICATED WITH INVERTED ORDER OF PARAMETERS ***/
+static struct filter_node *rule_ipv4(struct filter_node *node, uint8_t proto, uint32_t src, uint8_t src_prefix,
+                                     uint32_t dst, uint8_t dst_prefix, uint16_t sport, uint16_t dport)
+{
+    struct pico_ipfilter_rule r;
+    memset(&r, 0, sizeof(r));
+    memset(node, 0, sizeof(struct filter_node));
+    r.net = PICO_PROTO_IPV4;
+    r.proto = proto;
+    r.src.ip4.addr = long_be(src);
+    r.src_prefix = src_prefix;
+    r.dst.ip4.addr = long_be(dst);
+    r.dst_prefix = dst_prefix;
+    r.sport_min = sport;
+    r.dport_min = dport;
+    r.action = FILTER_DROP;
+    fail_if(filter_rule_convert(&r, node) != 0);
+    return node;
+}
 
-    memset(&a, 0, sizeof(struct filter_node));
-    memset(&b, 0, sizeof(struct filter_node));
+static void key_ipv4(struct filter_key *k, uint8_t proto, uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport)
+{
+    memset(k, 0, sizeof(struct filter_key));
+    k->family = FILTER_FAMILY_IPV4;
+    k->val[FILTER_DIM_PROTO][0] = proto;
+    k->val[FILTER_DIM_SRC][0] = src;
+    k->val[FILTER_DIM_DST][0] = dst;
+    k->val[FILTER_DIM_SPORT][0] = sport;
+    k->val[FILTER_DIM_DPORT][0] = dport;
+}
 
-    a.filter_id = 2;
+START_TEST(tc_ipfilter)
+{
+    uint32_t r;
+    struct filter_node a;
+    struct filter_key b;
 
+    /* packet 10.0.0.1:1000 -> 10.0.1.1:80, protocol 4 */
+    key_ipv4(&b, 4, 0x0a000001, 0x0a000101, 1000, 80);
 
-    /* check that rule is matched properly */
-    fail_if(filter_match_packet_find_rule(&b, &a) != &a);
+    /* a matches everything */
+    rule_ipv4(&a, 0, 0x00000000, 0, 0x00000000, 0, 0, 0);
+    fail_if(filter_match_packet(&a, &b) != 0);
 
     /* a has a out port that does not match packet */
-    b.out_port = 8;
-    a.out_port = 7;
-    fail_if(filter_compare(&b, &a) == 0);
-
-    /* a matches all ports */
-    a.out_port = 0;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /*** NEXT TEST ***/
+    a.lo[FILTER_DIM_DPORT][0] = a.hi[FILTER_DIM_DPORT][0] = 81;
+    fail_if(filter_match_packet(&a, &b) == 0);
 
+    /* a matches a port range */
+    a.lo[FILTER_DIM_DPORT][0] = 1;
+    fail_if(filter_match_packet(&a, &b) != 0);
 
     /* a has a in port that does not match packet */
-    b.in_port = 8;
-    a.in_port = 7;
-    fail_if(filter_compare(&b, &a) == 0);
-
-    /* a matches all ports */
-    a.in_port = 0;
-    fail_if(filter_compare(&b, &a) != 0);
+    rule_ipv4(&a, 0, 0x00000000, 0, 0x00000000, 0, 1001, 0);
+    fail_if(filter_match_packet(&a, &b) == 0);
 
     /* a matches port exactly */
-    a.in_port = 0;
-    fail_if(filter_compare(&b, &a) != 0);
+    rule_ipv4(&a, 0, 0x00000000, 0, 0x00000000, 0, 1000, 80);
+    fail_if(filter_match_packet(&a, &b) != 0);
 
     /*** NEXT TEST ***/
 
-    /* a matches all out addresses */
-    b.out_addr = 0x010000a0;
-    fail_if(filter_compare(&b, &a) != 0);
+    /* a does not match b via 24-bit prefix */
+    rule_ipv4(&a, 0, 0x00000000, 0, 0x0a000000, 24, 0, 0);
+    fail_if(filter_match_packet(&a, &b) == 0);
 
-    /* a does not match b via 8-bit netmask */
-    a.out_addr = 0x000000c0;
-    a.out_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&b, &a) == 0);
+    /* a matches b via 16-bit prefix */
+    rule_ipv4(&a, 0, 0x00000000, 0, 0x0a000000, 16, 0, 0);
+    fail_if(filter_match_packet(&a, &b) != 0);
 
     /* a does not match b at all*/
-    a.out_addr = 0x020000b0;
-    a.out_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&b, &a) == 0);
-
-    /* a matches b via 8-bit netmask */
-    a.out_addr = 0x000000a0;
-    a.out_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&b, &a) != 0);
+    rule_ipv4(&a, 0, 0x00000000, 0, 0x0a000102, 32, 0, 0);
+    fail_if(filter_match_packet(&a, &b) == 0);
 
     /* a matches b exactly */
-    a.out_addr = 0x010000a0;
-    a.out_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all in addresses */
-    b.in_addr = 0x010000a0;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /* a does not match b via 8-bit netmask */
-    a.in_addr = 0x000000c0;
-    a.in_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&b, &a) == 0);
+    rule_ipv4(&a, 0, 0x0a000001, 32, 0x0a000101, 32, 0, 0);
+    fail_if(filter_match_packet(&a, &b) != 0);
 
-    /* a does not match b at all*/
-    a.in_addr = 0x020000b0;
-    a.in_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&b, &a) == 0);
-
-    /* a matches b via 8-bit netmask */
-    a.in_addr = 0x000000a0;
-    a.in_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /* a matches b exactly */
-    a.in_addr = 0x010000a0;
-    a.in_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&b, &a) != 0);
+    /* host bits in the rule address are ignored */
+    rule_ipv4(&a, 0, 0x0a00004d, 24, 0x00000000, 0, 0, 0);
+    fail_if(filter_match_packet(&a, &b) != 0);
 
     /*** NEXT TEST ***/
 
-    /* a matches all protocols */
-    b.proto = 4u;
-    fail_if(filter_compare(&b, &a) != 0);
-
     /* a does not match protocol */
-    a.proto = 5u;
-    fail_if(filter_compare(&b, &a) == 0);
+    rule_ipv4(&a, 5, 0x00000000, 0, 0x00000000, 0, 0, 0);
+    fail_if(filter_match_packet(&a, &b) == 0);
 
     /* a matches b's protocol */
-    a.proto = b.proto;
-    fail_if(filter_compare(&b, &a) != 0);
+    rule_ipv4(&a, 4, 0x00000000, 0, 0x00000000, 0, 0, 0);
+    fail_if(filter_match_packet(&a, &b) != 0);
 
     /*** NEXT TEST ***/
 
     /* a matches all devices */
-    b.fdev = (struct pico_device *)&b;
-    fail_if(filter_compare(&b, &a) != 0);
+    b.dev = (struct pico_device *) &b;
+    fail_if(filter_match_packet(&a, &b) != 0);
 
     /* a does not match device */
     a.fdev = (struct pico_device *)&a;
-    fail_if(filter_compare(&b, &a) == 0);
+    fail_if(filter_match_packet(&a, &b) == 0);
 
     /* a matches b's device */
-    a.fdev = b.fdev;
-    fail_if(filter_compare(&b, &a) != 0);
-
-
+    a.fdev = b.dev;
+    fail_if(filter_match_packet(&a, &b) != 0);
+
+    /* a does not match the address family */
+    b.family = FILTER_FAMILY_IPV6;
+    fail_if(filter_match_packet(&a, &b) == 0);
+
+    /*** NETMASK CONVERSION ***/
+    {
+        uint8_t prefix = 0xFF;
+        fail_if(filter_netmask_to_prefix(long_be(0xFFFFFF00), &prefix) != 0 || prefix != 24);
+        fail_if(filter_netmask_to_prefix(0, &prefix) != 0 || prefix != 0);
+        fail_if(filter_netmask_to_prefix(0xFFFFFFFF, &prefix) != 0 || prefix != 32);
+        fail_if(filter_netmask_to_prefix(long_be(0xFF00FF00), &prefix) == 0);
+    }
 
     /*********** TEST ADD FILTER **************/
 
@@ -299,12 +185,199 @@ START_TEST(tc_ipfilter)
 END_TEST
 
 
+START_TEST(tc_ipfilter_classify)
+{
+    struct pico_ipfilter_rule r;
+    struct filter_key k;
+    struct filter_node *lin, *cls;
+    uint32_t ids[64];
+    uint32_t seed = 0x1234567u;
+    uint32_t i, id, hits = 0;
+
+    /* random IPv4 rules over a small address and port space, so that they overlap */
+    for (i = 0; i < 64; i++) {
+        memset(&r, 0, sizeof(r));
+        r.net = PICO_PROTO_IPV4;
+        seed = seed * 1103515245u + 12345u;
+        r.proto = (uint8_t)(((seed >> 16) % 3u) ? 0 : 17);
+        r.src.ip4.addr = long_be(0x0a000000u | ((seed >> 8) & 0xFFu));
+        r.src_prefix = (uint8_t)(24u + ((seed >> 4) % 9u));
+        seed = seed * 1103515245u + 12345u;
+        r.dst.ip4.addr = long_be(0x0a000100u | ((seed >> 8) & 0xFFu));
+        r.dst_prefix = (uint8_t)(((seed >> 20) & 1u) ? 0 : 28);
+        r.dport_min = (uint16_t)((seed >> 12) % 64u);
+        r.dport_max = (uint16_t)(r.dport_min + ((seed >> 2) % 16u));
+        r.action = FILTER_DROP;
+        ids[i] = pico_ipfilter_add(&r);
+        fail_if(ids[i] == 0);
+    }
+    fail_if(filter_compile() != 0);
+
+    /* the compiled classifier must agree with a linear first-match scan */
+    for (i = 0; i < 20000; i++) {
+        seed = seed * 1103515245u + 12345u;
+        key_ipv4(&k, (uint8_t)(((seed >> 16) & 1u) ? 17 : 6), 0x0a000000u | ((seed >> 8) & 0xFFu),
+                 0x0a000100u | ((seed >> 20) & 0xFFu), 0, (uint16_t)((seed >> 2) % 96u));
+        lin = filter_classify_linear(&k);
+        cls = filter_classify(&k);
+        fail_if(lin != cls);
+    }
+
+    /* Out of memory: rules are matched one by one, and the compile isn't
+     * retried until the rule set changes */
+    filter_changed();
+    pico_set_mm_failure(1);
+    fail_if(filter_lookup(&k) != filter_classify_linear(&k));
+    fail_if(!filter_failed || !filter_dirty);
+    fail_if(filter_lookup(&k) != filter_classify_linear(&k));
+    fail_if(!filter_dirty);
+
+    for (i = 0; i < 64; i++)
+        fail_if(pico_ipfilter_del(ids[i]) != 0);
+    fail_if(filter_failed);
+    fail_if(pico_ipfilter_del(ids[0]) == 0);
+    fail_if(filter_count[FILTER_FAMILY_IPV4] != 0);
+
+#ifdef PICO_SUPPORT_IPV6
+    /* IPv6 prefix with a port range */
+    memset(&r, 0, sizeof(r));
+    r.net = PICO_PROTO_IPV6;
+    r.dst.ip6.addr[0] = 0x20;
+    r.dst.ip6.addr[1] = 0x01;
+    r.dst.ip6.addr[2] = 0x0d;
+    r.dst.ip6.addr[3] = 0xb8;
+    r.dst_prefix = 48;
+    r.dport_min = 1000;
+    r.dport_max = 2000;
+    r.action = FILTER_DROP;
+    id = pico_ipfilter_add(&r);
+    fail_if(id == 0);
+    fail_if(pico_ipfilter_add(&r) != id);
+    r.dst_prefix = 129;
+    fail_if(pico_ipfilter_add(&r) != 0);
+    fail_if(filter_compile() != 0);
+
+    memset(&k, 0, sizeof(k));
+    k.family = FILTER_FAMILY_IPV6;
+    k.val[FILTER_DIM_DST][0] = 0x20010db8u;
+    k.val[FILTER_DIM_DST][1] = 0x0000ffffu;
+    k.val[FILTER_DIM_DPORT][0] = 1500;
+    fail_if(filter_classify(&k) == NULL);
+    k.val[FILTER_DIM_DST][1] = 0x0001ffffu;
+    fail_if(filter_classify(&k) != NULL);
+    k.val[FILTER_DIM_DST][1] = 0;
+    k.val[FILTER_DIM_DPORT][0] = 2001;
+    fail_if(filter_classify(&k) != NULL);
+
+    /* IPv4 packets never match IPv6 rules */
+    key_ipv4(&k, 0, 0x20010db8u, 0x20010db8u, 0, 1500);
+    fail_if(filter_classify(&k) != NULL);
+
+    fail_if(pico_ipfilter_hits(id, &hits) != 0 || hits != 0);
+    fail_if(pico_ipfilter_hits(id + 1, &hits) == 0);
+    fail_if(pico_ipfilter_del(id) != 0);
+#else
+    (void)id;
+    (void)hits;
+#endif
+}
+END_TEST
+
+
+START_TEST(tc_ipfilter_groups)
+{
+    struct pico_ipfilter_rule r;
+    struct filter_key k;
+    uint32_t n = 2 * PICO_IPFILTER_GROUP + 8;
+    uint32_t *ids = calloc(n, sizeof(uint32_t));
+    uint32_t seed = 0x7654321u;
+    uint32_t i;
+
+    fail_if(!ids);
+
+    /* wide rules late in the set must not win over narrow rules added first */
+    for (i = 0; i < n; i++) {
+        memset(&r, 0, sizeof(r));
+        r.net = PICO_PROTO_IPV4;
+        seed = seed * 1103515245u + 12345u;
+        if (i < n - 8) {
+            r.src.ip4.addr = long_be(0x0a000000u | (i * 7u));
+            r.src_prefix = 32;
+        } else {
+            r.src.ip4.addr = long_be(0x0a000000u | ((seed >> 8) & 0xFFFu));
+            r.src_prefix = (uint8_t)(20 + (i & 7u));
+        }
+        r.dport_min = (uint16_t)((seed >> 12) % 64u);
+        r.dport_max = (uint16_t)(r.dport_min + ((seed >> 2) % 16u));
+        r.action = FILTER_DROP;
+        ids[i] = pico_ipfilter_add(&r);
+        fail_if(ids[i] == 0);
+    }
+    fail_if(filter_compile() != 0);
+    fail_if(filter_cls[FILTER_FAMILY_IPV4].ngroups != 3);
+
+    for (i = 0; i < 20000; i++) {
+        seed = seed * 1103515245u + 12345u;
+        key_ipv4(&k, 17, 0x0a000000u | ((seed >> 8) & 0xFFFu), 0x0a000101u, 0, (uint16_t)((seed >> 20) % 96u));
+        fail_if(filter_classify_linear(&k) != filter_classify(&k));
+    }
+
+    for (i = 0; i < n; i++)
+        fail_if(pico_ipfilter_del(ids[i]) != 0);
+    fail_if(filter_compile() != 0);
+    fail_if(filter_cls[FILTER_FAMILY_IPV4].ngroups != 0);
+    free(ids);
+}
+END_TEST
+
+
+START_TEST(tc_ipfilter_rate_limit)
+{
+    struct pico_ipfilter_rule r;
+    struct filter_node node;
+    struct pico_frame f;
+    uint8_t buf[PICO_SIZE_IP4HDR] = {
+        0x45, 0x00, 0x02, 0x58
+    };                              /* total length 600 */
+
+    memset(&r, 0, sizeof(r));
+    memset(&node, 0, sizeof(node));
+    memset(&f, 0, sizeof(f));
+    f.net_hdr = buf;
+    r.net = PICO_PROTO_IPV4;
+    r.action = FILTER_RATE_LIMIT;
+    fail_if(filter_rule_convert(&r, &node) == 0); /* needs a rate */
+
+    pico_tick = 10000;
+    r.rate = 1000;
+    r.burst = 1000;
+    fail_if(filter_rule_convert(&r, &node) != 0);
+    fail_if(node.function_ptr(&node, &f) != 0);
+    fail_if(node.function_ptr(&node, &f) != 1);
+    pico_tick += 100;
+    fail_if(node.function_ptr(&node, &f) != 1);
+    pico_tick += 100;
+    fail_if(node.function_ptr(&node, &f) != 0);
+
+    /* priority action marks the frame */
+    r.action = FILTER_PRIORITY;
+    r.priority = 3;
+    fail_if(filter_rule_convert(&r, &node) != 0);
+    fail_if(node.function_ptr(&node, &f) != 0);
+    fail_if(f.priority != 3);
+}
+END_TEST
+
+
 Suite *pico_suite(void)
 {
     Suite *s = suite_create("IPfilter module");
 
     TCase *TCase_ipfilter = tcase_create("Unit test for ipfilter");
     tcase_add_test(TCase_ipfilter, tc_ipfilter);
+    tcase_add_test(TCase_ipfilter, tc_ipfilter_classify);
+    tcase_add_test(TCase_ipfilter, tc_ipfilter_groups);
+    tcase_add_test(TCase_ipfilter, tc_ipfilter_rate_limit);
     suite_add_tcase(s, TCase_ipfilter);
     return s;
 }
@@ -18,62 +18,58 @@
 #define PICO_TIME (0)
 
 Suite *pico_suite(void);
-START_TEST(tc_pico_nd_new_expire_time)
+START_TEST(tc_pico_nd_neighbor_timers)
 {
-    struct pico_ipv6_neighbor n = {
-        0
-    };
+    struct pico_ip6 addr = {{ 0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7 }};
     struct pico_device d = { {0} };
+    struct pico_neighbor *n;
 
-    /* TODO: how to test these time values */
-
-    n.dev = &d;
-
+    pico_stack_init();
     d.hostvars.retranstime = 666;
+    n = pico_nd_add(&addr, &d);
+    fail_if(!n);
+    fail_unless(pico_nd_find_neighbor(&addr, &d) == n);
+    fail_unless(pico_nd_find_neighbor(&addr, NULL) == n);
+    fail_unless(pico_nd_retrans(n) == 666);
 
-    n.state = PICO_ND_STATE_INCOMPLETE;
-    pico_nd_new_expire_time(&n);
-
-    n.state = PICO_ND_STATE_REACHABLE;
-    pico_nd_new_expire_time(&n);
-
-
-    n.state = PICO_ND_STATE_STALE;
-    pico_nd_new_expire_time(&n);
-
-
-    n.state = PICO_ND_STATE_PROBE;
-    pico_nd_new_expire_time(&n);
+    /* each state arms its own timer */
+    fail_unless(pico_neighbor_update(n, NULL, 0, PICO_ND_STATE_REACHABLE) == 0);
+    fail_unless(n->timer != 0);
+    fail_unless(pico_neighbor_update(n, NULL, 0, PICO_ND_STATE_STALE) == 0);
+    fail_unless(n->timer != 0);
+    fail_unless(pico_neighbor_use(n) == n);
+    fail_unless(n->state == PICO_ND_STATE_DELAY);
 
+    pico_neighbor_del(n);
+    fail_unless(pico_nd_find_neighbor(&addr, &d) == NULL);
 }
 END_TEST
 START_TEST(tc_pico_nd_queue)
 {
     struct pico_ip6 addr = {{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 9 }};
+    struct pico_device d = { {0} };
+    struct pico_neighbor *n;
     int i;
     struct pico_frame *f = pico_frame_alloc(sizeof(struct pico_ipv6_hdr));
     struct pico_ipv6_hdr *h = (struct pico_ipv6_hdr *) f->buffer;
     f->net_hdr = (uint8_t*) h;
+    f->dev = &d;
     f->buffer[0] = 0x60; /* Ipv6 */
     memcpy(h->dst.addr, addr.addr, PICO_SIZE_IP6);
 
     fail_if(!f);
 
-    for (i = 0; i < PICO_ND_MAX_FRAMES_QUEUED; i++) {
-        fail_if(frames_queued_v6[i] != NULL);
-    }
-    pico_ipv6_nd_unreachable(&addr);
-    for (i = 0; i < PICO_ND_MAX_FRAMES_QUEUED; i++) {
-        fail_if(frames_queued_v6[i] != NULL);
-    }
-    pico_ipv6_nd_postpone(f);
-    fail_if(frames_queued_v6[0]->buffer != f->buffer);
+    /* no neighbour entry: dropped */
+    pico_ipv6_nd_postpone(pico_frame_copy(f));
 
-    pico_ipv6_nd_unreachable(&addr);
+    n = pico_nd_add(&addr, &d);
+    fail_if(!n);
+    for (i = 0; i < PICO_ND_MAX_FRAMES_QUEUED + 2; i++)
+        pico_ipv6_nd_postpone(pico_frame_copy(f));
+    fail_unless(n->pending.frames == PICO_ND_MAX_FRAMES_QUEUED);
 
-    for (i = 0; i < PICO_ND_MAX_FRAMES_QUEUED; i++) {
-        fail_if(frames_queued_v6[i] != NULL);
-    }
+    pico_neighbor_del(n);
+    pico_frame_discard(f);
 }
 END_TEST
 
@@ -193,7 +189,7 @@ Suite *pico_suite(void)
 {
     Suite *s = suite_create("PicoTCP");
 
-    TCase *TCase_pico_nd_new_expire_time = tcase_create("Unit test for pico_nd_new_expire_time");
+    TCase *TCase_pico_nd_neighbor_timers = tcase_create("Unit test for pico_ipv6_nd: neighbour entry timers");
     TCase *TCase_pico_nd_discover = tcase_create("Unit test for pico_nd_discover");
     TCase *TCase_neigh_options = tcase_create("Unit test for neigh_options");
     TCase *TCase_neigh_adv_complete = tcase_create("Unit test for neigh_adv_complete");
@@ -219,8 +215,8 @@ Suite *pico_suite(void)
     TCase *TCase_pico_nd_queue = tcase_create("Unit test for pico_ipv6_nd: queue for pending frames");
 
 
-    tcase_add_test(TCase_pico_nd_new_expire_time, tc_pico_nd_new_expire_time);
-    suite_add_tcase(s, TCase_pico_nd_new_expire_time);
+    tcase_add_test(TCase_pico_nd_neighbor_timers, tc_pico_nd_neighbor_timers);
+    suite_add_tcase(s, TCase_pico_nd_neighbor_timers);
     tcase_add_test(TCase_pico_nd_discover, tc_pico_nd_discover);
     suite_add_tcase(s, TCase_pico_nd_discover);
     tcase_add_test(TCase_neigh_options, tc_neigh_options);
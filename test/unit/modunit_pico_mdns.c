@@ -534,8 +534,8 @@ START_TEST(tc_mdns_cookie_apply_spt) /* MARK: mdns_cookie_apply_spt */
     /* Create 2 exactly the same cookies */
     pico_tree_insert(&(a.antree), &record1);
     pico_tree_insert(&(a.antree), &record2);
-    pico_tree_insert(&MyRecords, &record1);
-    pico_tree_insert(&MyRecords, &record2);
+    pico_mdns_table_insert(&MyRecords, &record1);
+    pico_mdns_table_insert(&MyRecords, &record2);
 
     ret = pico_mdns_cookie_apply_spt(&a, record3.record);
     fail_unless(ret, "mdns_cookie_apply_spt failed checking parms!\n");
@@ -1062,10 +1062,10 @@ void add_records( void ) /* MARK: helper to add records to MyRecords s*/
     fail_if(!record2, "Record could not be created!\n");
 
     /* Add the records to the tree */
-    pico_tree_insert(&MyRecords, record);
-    pico_tree_insert(&MyRecords, record1);
-    pico_tree_insert(&MyRecords, record2);
-    pico_tree_insert(&MyRecords, record3);
+    pico_mdns_table_insert(&MyRecords, record);
+    pico_mdns_table_insert(&MyRecords, record1);
+    pico_mdns_table_insert(&MyRecords, record2);
+    pico_mdns_table_insert(&MyRecords, record3);
 }
 START_TEST(tc_mdns_record_tree_find_name) /* MARK: mdns_record_find_name */
 {
@@ -1181,10 +1181,10 @@ START_TEST(tc_mdns_record_tree_del_name) /* MARK: mdns_record_tree_del_name */
     fail_if(!record2, "Record could not be created!\n");
 
     /* Add the records to the tree */
-    pico_tree_insert(&MyRecords, record);
-    pico_tree_insert(&MyRecords, record1);
-    pico_tree_insert(&MyRecords, record2);
-    pico_tree_insert(&MyRecords, record3);
+    pico_mdns_table_insert(&MyRecords, record);
+    pico_mdns_table_insert(&MyRecords, record1);
+    pico_mdns_table_insert(&MyRecords, record2);
+    pico_mdns_table_insert(&MyRecords, record3);
 
     /* Try to del the first tree records */
     ret = pico_mdns_rtree_del_name(&MyRecords, "\3foo\5local");
@@ -1357,10 +1357,10 @@ START_TEST(tc_mdns_my_records_claimed_id) /* MARK: mnds_my_records_claimed_id */
     fail_if(!record2, "Record could not be created!\n");
 
     /* Add the records to the tree */
-    pico_tree_insert(&MyRecords, record);
-    pico_tree_insert(&MyRecords, record1);
-    pico_tree_insert(&MyRecords, record2);
-    pico_tree_insert(&MyRecords, record3);
+    pico_mdns_table_insert(&MyRecords, record);
+    pico_mdns_table_insert(&MyRecords, record1);
+    pico_mdns_table_insert(&MyRecords, record2);
+    pico_mdns_table_insert(&MyRecords, record3);
 
     fail_unless(1 == pico_mdns_my_records_claimed_id(1, &hits),
                 "mdns_my_records_claimed_id_failed!\n");
@@ -1411,10 +1411,10 @@ START_TEST(tc_mdns_my_records_claimed) /* MARK: mdns_my_records_claimed */
     fail_if(!record2, "Record could not be created!\n");
 
     /* Add the records to the tree */
-    pico_tree_insert(&MyRecords, record);
-    pico_tree_insert(&MyRecords, record1);
-    pico_tree_insert(&MyRecords, record2);
-    pico_tree_insert(&MyRecords, record3);
+    pico_mdns_table_insert(&MyRecords, record);
+    pico_mdns_table_insert(&MyRecords, record1);
+    pico_mdns_table_insert(&MyRecords, record2);
+    pico_mdns_table_insert(&MyRecords, record3);
 
     pico_tree_insert(&rtree, record);
     pico_tree_insert(&rtree, record1);
@@ -1456,6 +1456,115 @@ START_TEST(tc_mdns_cache_add_record) /* MARK: mdns_cache_add_record */
     printf("*********************** ending %s * \n", __func__);
 }
 END_TEST
+START_TEST(tc_mdns_cache_check_expiries) /* MARK: mdns_cache_check_expiries */
+{
+    struct pico_mdns_record *a = NULL, *b = NULL, *c = NULL;
+    PICO_MDNS_RTREE_DECLARE(hits);
+    struct pico_ip4 rdata = {
+        long_be(0x00FFFFFF)
+    };
+    char url[] = "foo.local";
+    char url2[] = "bar.local";
+    char qname[] = "\3foo\5local";
+
+    printf("*********************** starting %s * \n", __func__);
+
+    a = pico_mdns_record_create(url, &rdata, 4, PICO_DNS_TYPE_A, 3,
+                                PICO_MDNS_RECORD_SHARED);
+    b = pico_mdns_record_create(url2, &rdata, 4, PICO_DNS_TYPE_A, 1,
+                                PICO_MDNS_RECORD_SHARED);
+    c = pico_mdns_record_create(url2, url, (uint16_t)strlen(url), PICO_DNS_TYPE_PTR, 2,
+                                PICO_MDNS_RECORD_SHARED);
+    fail_if(!a || !b || !c, "Record could not be created!\n");
+    fail_unless(0 == pico_mdns_cache_add_record(a), "cache_add failed!\n");
+    fail_unless(0 == pico_mdns_cache_add_record(b), "cache_add failed!\n");
+    fail_unless(0 == pico_mdns_cache_add_record(c), "cache_add failed!\n");
+    fail_unless(3 == cache_heap_len, "Expiry heap should hold 3 records!\n");
+
+    /* Index lookups */
+    hits = pico_mdns_rtree_find_name(&Cache, "\3BAR\5local", 0);
+    fail_unless(2 == pico_tree_count(&hits), "find_name should hit 2!\n");
+    pico_tree_destroy(&hits, NULL);
+    hits = pico_mdns_rtree_find_name_type(&Cache, qname,
+                                          PICO_DNS_TYPE_A, 0);
+    fail_unless(1 == pico_tree_count(&hits), "find_name_type should hit 1!\n");
+    pico_tree_destroy(&hits, NULL);
+
+    pico_mdns_cache_check_expiries();
+    fail_unless(2 == pico_tree_count(&Cache), "TTL 1 should have expired!\n");
+    hits = pico_mdns_rtree_find_name(&Cache, "\3bar\5local", 0);
+    fail_unless(1 == pico_tree_count(&hits), "Expired record still indexed!\n");
+    pico_tree_destroy(&hits, NULL);
+
+    /* Refreshing 'a' postpones its expiry */
+    fail_unless(0 == pico_mdns_cache_add_record(a), "cache_add failed!\n");
+    pico_mdns_cache_check_expiries();
+    fail_unless(1 == pico_tree_count(&Cache), "TTL 2 should have expired!\n");
+    hits = pico_mdns_rtree_find_name_type(&Cache, qname,
+                                          PICO_DNS_TYPE_A, 0);
+    fail_unless(1 == pico_tree_count(&hits), "find_name_type should hit 1!\n");
+    fail_unless(2 == ((struct pico_mdns_record *)pico_tree_first(&hits))->current_ttl,
+                "Remaining TTL should be 2!\n");
+    pico_tree_destroy(&hits, NULL);
+
+    pico_mdns_cache_check_expiries();
+    pico_mdns_cache_check_expiries();
+    fail_unless(0 == pico_tree_count(&Cache), "Cache should be empty!\n");
+    fail_unless(0 == cache_heap_len, "Expiry heap should be empty!\n");
+
+    pico_mdns_record_delete((void **)&a);
+    pico_mdns_record_delete((void **)&b);
+    pico_mdns_record_delete((void **)&c);
+
+    printf("*********************** ending %s * \n", __func__);
+}
+END_TEST
+START_TEST(tc_mdns_cache_known_answers) /* MARK: mdns_cache_known_answers */
+{
+    struct pico_mdns_record *record = NULL;
+    struct pico_dns_question *question = NULL;
+    struct pico_dns_record *ka = NULL;
+    PICO_DNS_QTREE_DECLARE(qtree);
+    PICO_DNS_RTREE_DECLARE(antree);
+    struct pico_ip4 rdata = {
+        long_be(0x00FFFFFF)
+    };
+    char url[] = "foo.local";
+    uint16_t len = 0;
+    int i = 0;
+
+    printf("*********************** starting %s * \n", __func__);
+
+    record = pico_mdns_record_create(url, &rdata, 4, PICO_DNS_TYPE_A, 120,
+                                     PICO_MDNS_RECORD_SHARED);
+    fail_if(!record, "Record could not be created!\n");
+    fail_unless(0 == pico_mdns_cache_add_record(record), "cache_add failed!\n");
+    question = pico_dns_question_create(url, &len, PICO_PROTO_IPV4,
+                                        PICO_DNS_TYPE_A, PICO_DNS_CLASS_IN, 0);
+    fail_if(!question, "Question could not be created!\n");
+    pico_tree_insert(&qtree, question);
+
+    for (i = 0; i < 10; i++)
+        pico_mdns_cache_check_expiries();
+    pico_mdns_cache_known_answers(&qtree, &antree);
+    fail_unless(1 == pico_tree_count(&antree), "Should know 1 answer!\n");
+    ka = pico_tree_first(&antree);
+    fail_unless(110 == long_be(ka->rsuffix->rttl),
+                "Known answer should carry the remaining TTL!\n");
+    PICO_DNS_RTREE_DESTROY(&antree);
+
+    /* Half of the TTL is gone */
+    for (i = 0; i < 50; i++)
+        pico_mdns_cache_check_expiries();
+    pico_mdns_cache_known_answers(&qtree, &antree);
+    fail_unless(0 == pico_tree_count(&antree), "Should know no answers!\n");
+
+    PICO_DNS_QTREE_DESTROY(&qtree);
+    pico_mdns_record_delete((void **)&record);
+
+    printf("*********************** ending %s * \n", __func__);
+}
+END_TEST
 #endif
 START_TEST(tc_pico_tree_merge)
 {
@@ -1527,8 +1636,8 @@ START_TEST(tc_mdns_handle_data_as_questions) /* MARK: handle_data_as_questions *
     record2->flags |= 0xC0;
 
     /* Add them to my records */
-    pico_tree_insert(&MyRecords, record1);
-    pico_tree_insert(&MyRecords, record2);
+    pico_mdns_table_insert(&MyRecords, record1);
+    pico_mdns_table_insert(&MyRecords, record2);
 
     ptr = ((uint8_t *)packet + 12);
 
@@ -1744,6 +1853,54 @@ START_TEST(tc_mdns_apply_known_answer_suppression) /* MARK: apply_k_a_s */
     printf("*********************** ending %s * \n", __func__);
 }
 END_TEST
+START_TEST(tc_mdns_apply_k_a_s_half_ttl) /* MARK: apply_k_a_s half TTL */
+{
+    pico_dns_packet *packet = NULL;
+    PICO_DNS_RTREE_DECLARE(antree);
+    PICO_MDNS_RTREE_DECLARE(rtree);
+    struct pico_mdns_record *a = NULL, *ka = NULL;
+    char url[] = "picotcp.com";
+    uint8_t rdata[4] = {
+        10, 10, 0, 1
+    };
+    uint8_t *ptr = NULL;
+    uint16_t len = 0;
+    int ret = 0;
+
+    printf("*********************** starting %s * \n", __func__);
+
+    a = pico_mdns_record_create(url, (void *)rdata, 4, PICO_DNS_TYPE_A, 120,
+                                PICO_MDNS_RECORD_SHARED);
+    ka = pico_mdns_record_create(url, (void *)rdata, 4, PICO_DNS_TYPE_A, 59,
+                                 PICO_MDNS_RECORD_SHARED);
+    fail_if(!a || !ka, "mdns_record_create returned NULL!\n");
+    pico_tree_insert(&antree, ka->record);
+    pico_tree_insert(&rtree, a);
+    packet = pico_dns_answer_create(&antree, NULL, NULL, &len);
+    fail_if (packet == NULL, "dns_answer_create returned NULL!\n");
+
+    /* Less than half of the TTL left, the peer wants to hear it again */
+    ptr = ((uint8_t *)packet + 12);
+    ret = pico_mdns_apply_k_a_s(&rtree, packet, 1, &ptr);
+    fail_unless(0 == ret, "mdns_apply_k_a_s returned error!\n");
+    fail_unless(1 == pico_tree_count(&rtree), "Answer shouldn't be suppressed!\n");
+    PICO_FREE(packet);
+
+    ka->record->rsuffix->rttl = long_be(60);
+    packet = pico_dns_answer_create(&antree, NULL, NULL, &len);
+    fail_if (packet == NULL, "dns_answer_create returned NULL!\n");
+    ptr = ((uint8_t *)packet + 12);
+    ret = pico_mdns_apply_k_a_s(&rtree, packet, 1, &ptr);
+    fail_unless(0 == ret, "mdns_apply_k_a_s returned error!\n");
+    fail_unless(0 == pico_tree_count(&rtree), "Answer should be suppressed!\n");
+
+    PICO_FREE(packet);
+    pico_tree_destroy(&antree, NULL);
+    pico_mdns_record_delete((void **)&ka);
+
+    printf("*********************** ending %s * \n", __func__);
+}
+END_TEST
 START_TEST(tc_mdns_send_query_packet) /* MARK: send_query_packet */
 {
     struct pico_mdns_cookie cookie;
@@ -2050,6 +2207,8 @@ Suite *pico_suite(void)
 
     /* Cache functions */
     TCase *TCase_mdns_cache_add_record = tcase_create("Unit test for mdns_cache_add_record");
+    TCase *TCase_mdns_cache_check_expiries = tcase_create("Unit test for mdns_cache_check_expiries");
+    TCase *TCase_mdns_cache_known_answers = tcase_create("Unit test for mdns_cache_known_answers");
 
     /* Handling receptions */
     TCase *TCase_mdns_populate_answer_vector = tcase_create("Unit test for mdns_populate_answer_vector");
@@ -2062,6 +2221,7 @@ Suite *pico_suite(void)
     TCase *TCase_mdns_sort_unicast_multicast = tcase_create("Unit test for mdns_sort_unicast_multicast");
     TCase *TCase_mdns_gather_additionals = tcase_create("Unit test for mdns_gather_additionals");
     TCase *TCase_mdns_apply_known_answer_suppression = tcase_create("Unit test for mdns_apply_known_answer_suppression");
+    TCase *TCase_mdns_apply_k_a_s_half_ttl = tcase_create("Unit test for mdns_apply_known_answer_suppression TTL check");
 
     /* Address resolving functions */
     TCase *TCase_mdns_send_query_packet = tcase_create("Unit test for mdns_send_query_packet");
@@ -2160,6 +2320,10 @@ Suite *pico_suite(void)
     /* Cache functions */
     tcase_add_test(TCase_mdns_cache_add_record, tc_mdns_cache_add_record);
     suite_add_tcase(s, TCase_mdns_cache_add_record);
+    tcase_add_test(TCase_mdns_cache_check_expiries, tc_mdns_cache_check_expiries);
+    suite_add_tcase(s, TCase_mdns_cache_check_expiries);
+    tcase_add_test(TCase_mdns_cache_known_answers, tc_mdns_cache_known_answers);
+    suite_add_tcase(s, TCase_mdns_cache_known_answers);
     tcase_add_test(TCase_mdns_populate_answer_vector, tc_mdns_populate_answer_vector);
     suite_add_tcase(s, TCase_mdns_populate_answer_vector);
 
@@ -2180,6 +2344,8 @@ Suite *pico_suite(void)
     suite_add_tcase(s, TCase_mdns_gather_additionals);
     tcase_add_test(TCase_mdns_apply_known_answer_suppression, tc_mdns_apply_known_answer_suppression);
     suite_add_tcase(s, TCase_mdns_apply_known_answer_suppression);
+    tcase_add_test(TCase_mdns_apply_k_a_s_half_ttl, tc_mdns_apply_k_a_s_half_ttl);
+    suite_add_tcase(s, TCase_mdns_apply_k_a_s_half_ttl);
 
     /* Address resolving functions */
     tcase_add_test(TCase_mdns_send_query_packet, tc_mdns_send_query_packet);
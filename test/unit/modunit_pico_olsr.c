@@ -0,0 +1,303 @@
+#define PICO_SUPPORT_OLSR
+#include <pico_stack.h>
+#include <pico_socket.h>
+#include <pico_device.h>
+#include <pico_ipv4.h>
+#include <pico_dev_loop.h>
+#include <pico_olsr.h>
+#include "modules/pico_olsr.c"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+#define NODE(x) (long_be(0x0A280000u | (x)))
+#define FOREVER ((pico_time)(-1))
+
+static struct olsr_route_entry *local;
+
+static void setup_local(void)
+{
+    static struct pico_device *loop;
+    struct pico_ip4 addr, nm;
+
+    if (!loop) {
+        pico_stack_init();
+        loop = pico_loop_create();
+        fail_if(!loop);
+        addr.addr = NODE(1);
+        nm.addr = long_be(0xFFFF0000u);
+        fail_if(pico_ipv4_link_add(loop, addr, nm) != 0);
+        fail_if(pico_olsr_add(loop) != 0);
+    }
+
+    local = olsr_node_find(NODE(1));
+    fail_if(!local);
+    fail_if(!(local->flags & OLSR_F_LOCAL));
+    fail_if(local->metric != 0);
+}
+
+static struct olsr_link_entry *link_find(uint32_t from, uint32_t to)
+{
+    struct olsr_route_entry *f = olsr_node_find(from);
+    struct olsr_link_entry *l;
+
+    for (l = f ? f->links_out : NULL; l; l = l->next_out) {
+        if (l->to->destination.addr == to)
+            return l;
+    }
+    return NULL;
+}
+
+static void link_add(uint32_t from, uint32_t to)
+{
+    fail_if(!olsr_link_set(olsr_node_get(from), olsr_node_get(to), FOREVER, 0xFF, 0xFF));
+}
+
+static void link_del(uint32_t from, uint32_t to)
+{
+    struct olsr_link_entry *l = link_find(from, to);
+
+    fail_if(!l);
+    olsr_link_del(l);
+}
+
+static uint16_t metric(uint32_t addr)
+{
+    struct olsr_route_entry *n = olsr_node_find(addr);
+
+    fail_if(!n);
+    return n->metric;
+}
+
+static uint32_t next_hop(uint32_t addr)
+{
+    struct olsr_route_entry *n = get_next_hop(olsr_node_find(addr));
+
+    return n ? n->destination.addr : 0;
+}
+
+static void flush_topology(void)
+{
+    olsr_expire(FOREVER);
+}
+
+START_TEST(tc_olsr_node_table)
+{
+    struct olsr_route_entry *a, *b;
+    uint32_t i;
+
+    setup_local();
+    a = olsr_node_get(NODE(100));
+    fail_if(!a);
+    fail_if(olsr_node_get(NODE(100)) != a);
+    fail_if(a->metric != OLSR_METRIC_INF);
+
+    /* same bucket */
+    b = olsr_node_get(NODE(100) ^ long_be((uint32_t)OLSR_HASH_SIZE << 8));
+    fail_if(!b || b == a);
+    fail_if(olsr_hash(a->destination.addr) != olsr_hash(b->destination.addr));
+    fail_if(olsr_node_find(NODE(100)) != a);
+
+    for (i = 200; i < 1200; i++)
+        fail_if(!olsr_node_get(NODE(i)));
+    for (i = 200; i < 1200; i++)
+        fail_if(olsr_node_find(NODE(i))->destination.addr != NODE(i));
+
+    /* nodes without links are dropped */
+    olsr_expire(PICO_TIME_MS());
+    fail_if(olsr_node_find(NODE(100)));
+    fail_if(olsr_node_find(NODE(500)));
+    fail_if(olsr_node_find(NODE(1)) != local);
+}
+END_TEST
+
+START_TEST(tc_olsr_spf_incremental)
+{
+    struct pico_ip4 dst;
+
+    setup_local();
+    /* L - A - B - C
+     *  \      /
+     *   D - E          */
+    link_add(NODE(1), NODE(2));
+    link_add(NODE(2), NODE(3));
+    link_add(NODE(3), NODE(4));
+    link_add(NODE(1), NODE(5));
+    link_add(NODE(5), NODE(6));
+    link_add(NODE(6), NODE(3));
+    olsr_routes_sync();
+
+    fail_if(metric(NODE(2)) != 1);
+    fail_if(metric(NODE(3)) != 2);
+    fail_if(metric(NODE(4)) != 3);
+    fail_if(metric(NODE(6)) != 2);
+    fail_if(next_hop(NODE(4)) != NODE(2));
+    dst.addr = NODE(4);
+    fail_if(pico_ipv4_route_get_gateway(&dst).addr != NODE(2));
+
+    /* B moves behind E, C follows */
+    link_del(NODE(2), NODE(3));
+    olsr_routes_sync();
+    fail_if(metric(NODE(3)) != 3);
+    fail_if(metric(NODE(4)) != 4);
+    fail_if(olsr_node_find(NODE(3))->gateway != olsr_node_find(NODE(6)));
+    fail_if(next_hop(NODE(4)) != NODE(5));
+    fail_if(pico_ipv4_route_get_gateway(&dst).addr != NODE(5));
+
+    /* Shortcut: C one hop from L */
+    link_add(NODE(1), NODE(4));
+    olsr_routes_sync();
+    fail_if(metric(NODE(4)) != 1);
+    fail_if(next_hop(NODE(4)) != NODE(4));
+    fail_if(!(olsr_node_find(NODE(4))->flags & OLSR_F_ROUTE));
+    fail_if(olsr_node_find(NODE(4))->route_metric != 1);
+
+    /* B, C cut off */
+    link_del(NODE(1), NODE(4));
+    link_del(NODE(5), NODE(6));
+    olsr_routes_sync();
+    fail_if(metric(NODE(6)) != OLSR_METRIC_INF);
+    fail_if(metric(NODE(3)) != OLSR_METRIC_INF);
+    fail_if(metric(NODE(4)) != OLSR_METRIC_INF);
+    fail_if(olsr_node_find(NODE(4))->flags & OLSR_F_ROUTE);
+    fail_if(olsr_node_find(NODE(4))->gateway);
+    fail_if(olsr_node_find(NODE(6))->children);
+
+    /* and back */
+    link_add(NODE(2), NODE(4));
+    olsr_routes_sync();
+    fail_if(metric(NODE(4)) != 2);
+    fail_if(metric(NODE(3)) != OLSR_METRIC_INF);
+    fail_if(pico_ipv4_route_get_gateway(&dst).addr != NODE(2));
+
+    flush_topology();
+    fail_if(olsr_node_find(NODE(2)));
+    fail_if(Dirty_nodes);
+}
+END_TEST
+
+START_TEST(tc_olsr_mpr)
+{
+    setup_local();
+    /* A covers X and Y, D only Y, G is the only way to Z */
+    link_add(NODE(1), NODE(2));
+    link_add(NODE(1), NODE(5));
+    link_add(NODE(1), NODE(7));
+    link_add(NODE(2), NODE(10));
+    link_add(NODE(2), NODE(11));
+    link_add(NODE(5), NODE(11));
+    link_add(NODE(7), NODE(12));
+    /* neighbours reaching each other are not 2-hop */
+    link_add(NODE(5), NODE(2));
+    olsr_routes_sync();
+
+    fail_if(!mpr_dirty);
+    olsr_mpr_update();
+    fail_if(mpr_dirty);
+    fail_if(olsr_node_find(NODE(2))->link_type != OLSRLINK_MPR);
+    fail_if(olsr_node_find(NODE(5))->link_type != OLSRLINK_SYMMETRIC);
+    fail_if(olsr_node_find(NODE(7))->link_type != OLSRLINK_MPR);
+
+    /* D becomes the only way to Y */
+    link_del(NODE(2), NODE(11));
+    fail_if(!mpr_dirty);
+    olsr_mpr_update();
+    fail_if(olsr_node_find(NODE(2))->link_type != OLSRLINK_MPR);
+    fail_if(olsr_node_find(NODE(5))->link_type != OLSRLINK_MPR);
+
+    flush_topology();
+}
+END_TEST
+
+START_TEST(tc_olsr_recv_hello)
+{
+    uint8_t buf[DGRAM_MAX_SIZE];
+    struct olsrhdr *oh = (struct olsrhdr *)buf;
+    struct olsrmsg *msg = (struct olsrmsg *)(buf + sizeof(struct olsrhdr));
+    struct olsr_link *li;
+    struct olsr_neighbor *neigh;
+    struct pico_ip4 src;
+    uint32_t len = sizeof(struct olsrhdr) + sizeof(struct olsrmsg) + sizeof(struct olsr_hmsg_hello);
+    uint32_t i;
+
+    setup_local();
+    memset(buf, 0, sizeof(buf));
+    /* two link messages, listing us and two other nodes */
+    for (i = 0; i < 2; i++) {
+        li = (struct olsr_link *)(buf + len);
+        li->link_code = OLSRLINK_SYMMETRIC;
+        li->link_msg_size = short_be((uint16_t)(sizeof(struct olsr_link) + (2 - i) * sizeof(struct olsr_neighbor)));
+        len += (uint32_t)sizeof(struct olsr_link);
+        neigh = (struct olsr_neighbor *)(buf + len);
+        neigh->addr = i ? NODE(21) : NODE(1);
+        neigh->lq = neigh->nlq = 0xFF;
+        len += (uint32_t)sizeof(struct olsr_neighbor);
+        if (i == 0) {
+            neigh = (struct olsr_neighbor *)(buf + len);
+            neigh->addr = NODE(22);
+            neigh->lq = neigh->nlq = 0xFF;
+            len += (uint32_t)sizeof(struct olsr_neighbor);
+        }
+    }
+    msg->type = OLSRMSG_HELLO;
+    msg->vtime = seconds2olsr(OLSR_HELLO_INTERVAL / 1000u * 3u);
+    msg->size = short_be((uint16_t)(len - sizeof(struct olsrhdr)));
+    msg->orig.addr = NODE(20);
+    msg->ttl = 1;
+    oh->len = short_be((uint16_t)len);
+
+    src.addr = NODE(20);
+    olsr_recv(buf, len, &src, local->iface);
+    fail_if(!link_find(NODE(1), NODE(20)));
+    fail_if(!link_find(NODE(20), NODE(21)));
+    fail_if(!link_find(NODE(20), NODE(22)));
+    fail_if(link_find(NODE(20), NODE(1)));
+    fail_if(metric(NODE(21)) != 2);
+    fail_if(metric(NODE(22)) != 2);
+    fail_if(next_hop(NODE(22)) != NODE(20));
+    fail_if(!(olsr_node_find(NODE(22))->flags & OLSR_F_ROUTE));
+
+    /* truncated link message */
+    flush_topology();
+    li = (struct olsr_link *)(buf + sizeof(struct olsrhdr) + sizeof(struct olsrmsg) + sizeof(struct olsr_hmsg_hello));
+    li->link_msg_size = short_be(0xFFF0);
+    olsr_recv(buf, len, &src, local->iface);
+    fail_if(!link_find(NODE(1), NODE(20)));
+    fail_if(link_find(NODE(20), NODE(22)));
+
+    /* everything expires */
+    olsr_expire(PICO_TIME_MS() + 60000u);
+    fail_if(olsr_node_find(NODE(20)));
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_olsr_node_table = tcase_create("Unit test for olsr_node_table");
+    TCase *TCase_olsr_spf_incremental = tcase_create("Unit test for olsr_spf_incremental");
+    TCase *TCase_olsr_mpr = tcase_create("Unit test for olsr_mpr");
+    TCase *TCase_olsr_recv_hello = tcase_create("Unit test for olsr_recv_hello");
+
+    tcase_add_test(TCase_olsr_node_table, tc_olsr_node_table);
+    suite_add_tcase(s, TCase_olsr_node_table);
+    tcase_add_test(TCase_olsr_spf_incremental, tc_olsr_spf_incremental);
+    suite_add_tcase(s, TCase_olsr_spf_incremental);
+    tcase_add_test(TCase_olsr_mpr, tc_olsr_mpr);
+    suite_add_tcase(s, TCase_olsr_mpr);
+    tcase_add_test(TCase_olsr_recv_hello, tc_olsr_recv_hello);
+    suite_add_tcase(s, TCase_olsr_recv_hello);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
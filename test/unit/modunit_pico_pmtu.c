@@ -0,0 +1,147 @@
+#define PICO_SUPPORT_PMTU
+#include <pico_stack.h>
+#include <pico_protocol.h>
+#include "modules/pico_pmtu.c"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+static union pico_address dst4(uint32_t host)
+{
+    union pico_address a;
+
+    memset(&a, 0, sizeof(a));
+    a.ip4.addr = long_be(0x0A000000u | host);
+    return a;
+}
+
+START_TEST(tc_pmtu_lower_raise)
+{
+    union pico_address a = dst4(1), b = dst4(2);
+
+    pico_stack_init();
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 0);
+    fail_if(pico_pmtu_lower(PICO_PROTO_IPV4, &a, 1400) != 1);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 1400);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &b) != 0);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV6, &a) != 0);
+
+    /* reports never raise */
+    fail_if(pico_pmtu_lower(PICO_PROTO_IPV4, &a, 1450) != 0);
+    fail_if(pico_pmtu_lower(PICO_PROTO_IPV4, &a, 1300) != 1);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 1300);
+
+    /* probes do */
+    pico_pmtu_raise(PICO_PROTO_IPV4, &a, 1350);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 1350);
+    pico_pmtu_raise(PICO_PROTO_IPV4, &b, 1350);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &b) != 0);
+
+    /* clamped to the protocol minimum */
+    fail_if(pico_pmtu_lower(PICO_PROTO_IPV4, &b, 68) != 1);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &b) != PICO_PMTU_MIN_IPV4);
+    fail_if(pico_pmtu_lower(PICO_PROTO_IPV6, &a, 576) != 1);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV6, &a) != PICO_PMTU_MIN_IPV6);
+
+    fail_if(pico_pmtu_lower(PICO_PROTO_IPV4, NULL, 1000) != -1);
+    pico_pmtu_flush();
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 0);
+    fail_if(pmtu_count || pmtu_timer);
+}
+END_TEST
+
+START_TEST(tc_pmtu_expire)
+{
+    union pico_address a = dst4(1);
+
+    pico_stack_init();
+    fail_if(pico_pmtu_lower(PICO_PROTO_IPV4, &a, 1000) != 1);
+    fail_if(!pmtu_timer);
+
+    /* an expired entry takes any report */
+    pmtu_table[pmtu_hash(PICO_PROTO_IPV4, &a)]->expire = PICO_TIME_MS();
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 0);
+    fail_if(pico_pmtu_lower(PICO_PROTO_IPV4, &a, 1200) != 1);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 1200);
+
+    pmtu_gc(PICO_TIME_MS() + PICO_PMTU_TIMEOUT, NULL);
+    fail_if(pmtu_count || pmtu_timer);
+}
+END_TEST
+
+START_TEST(tc_pmtu_full)
+{
+    union pico_address a;
+    uint32_t i;
+
+    pico_stack_init();
+    for (i = 0; i < PICO_PMTU_MAX_ENTRIES; i++) {
+        a = dst4(i + 1);
+        fail_if(pico_pmtu_lower(PICO_PROTO_IPV4, &a, 1000) != 1);
+    }
+
+    /* An expired entry makes room before the gc gets to it */
+    a = dst4(5);
+    pmtu_find(PICO_PROTO_IPV4, &a)->expire = PICO_TIME_MS();
+    a = dst4(PICO_PMTU_MAX_ENTRIES + 1);
+    fail_if(pico_pmtu_lower(PICO_PROTO_IPV4, &a, 1100) != 1);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 1100);
+    a = dst4(5);
+    fail_if(pmtu_find(PICO_PROTO_IPV4, &a) != NULL);
+    fail_if(pmtu_count != PICO_PMTU_MAX_ENTRIES);
+
+    /* Otherwise the one that expires first goes */
+    a = dst4(7);
+    pmtu_find(PICO_PROTO_IPV4, &a)->expire = PICO_TIME_MS() + 1;
+    a = dst4(PICO_PMTU_MAX_ENTRIES + 2);
+    fail_if(pico_pmtu_lower(PICO_PROTO_IPV4, &a, 1200) != 1);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 1200);
+    a = dst4(7);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 0);
+    a = dst4(8);
+    fail_if(pico_pmtu_get(PICO_PROTO_IPV4, &a) != 1000);
+    fail_if(pmtu_count != PICO_PMTU_MAX_ENTRIES);
+    pico_pmtu_flush();
+}
+END_TEST
+
+START_TEST(tc_pmtu_plateau)
+{
+    fail_if(pico_pmtu_plateau(1500) != 1492);
+    fail_if(pico_pmtu_plateau(1492) != 1006);
+    fail_if(pico_pmtu_plateau(65535) != 32000);
+    fail_if(pico_pmtu_plateau(576) != 508);
+    fail_if(pico_pmtu_plateau(68) != 68);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_pmtu_lower_raise = tcase_create("Unit test for pmtu_lower_raise");
+    TCase *TCase_pmtu_expire = tcase_create("Unit test for pmtu_expire");
+    TCase *TCase_pmtu_full = tcase_create("Unit test for pmtu_full");
+    TCase *TCase_pmtu_plateau = tcase_create("Unit test for pmtu_plateau");
+
+    tcase_add_test(TCase_pmtu_lower_raise, tc_pmtu_lower_raise);
+    suite_add_tcase(s, TCase_pmtu_lower_raise);
+    tcase_add_test(TCase_pmtu_expire, tc_pmtu_expire);
+    suite_add_tcase(s, TCase_pmtu_expire);
+    tcase_add_test(TCase_pmtu_full, tc_pmtu_full);
+    suite_add_tcase(s, TCase_pmtu_full);
+    tcase_add_test(TCase_pmtu_plateau, tc_pmtu_plateau);
+    suite_add_tcase(s, TCase_pmtu_plateau);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -0,0 +1,305 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_device.h"
+#include "pico_ipv4.h"
+#include "pico_udp.h"
+#include "modules/pico_qdisc.c"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+static struct pico_device *qdev(void)
+{
+    static struct pico_device dev;
+    static struct pico_queue q_out;
+    memset(&dev, 0, sizeof(dev));
+    memset(&q_out, 0, sizeof(q_out));
+    dev.mtu = 1000;
+    dev.q_out = &q_out;
+    return &dev;
+}
+
+static struct pico_frame *qframe(int8_t priority, uint16_t sport, uint32_t len)
+{
+    struct pico_frame *f = pico_frame_alloc(len);
+    struct pico_ipv4_hdr *hdr;
+    struct pico_udp_hdr *udp;
+
+    fail_if(!f);
+    memset(f->buffer, 0, len);
+    f->start = f->buffer;
+    f->len = len;
+    f->net_hdr = f->buffer;
+    f->transport_hdr = f->buffer + PICO_SIZE_IP4HDR;
+    hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+    hdr->vhl = 0x45;
+    hdr->proto = PICO_PROTO_UDP;
+    hdr->src.addr = long_be(0x0a000001);
+    hdr->dst.addr = long_be(0x0a000002);
+    udp = (struct pico_udp_hdr *)f->transport_hdr;
+    udp->trans.sport = short_be(sport);
+    udp->trans.dport = short_be(53);
+    f->priority = priority;
+    return f;
+}
+
+static struct pico_frame *qnext(struct pico_device *dev)
+{
+    return pico_qdisc_dequeue(dev);
+}
+
+static uint16_t qsport(struct pico_frame *f)
+{
+    return short_be(((struct pico_udp_hdr *)f->transport_hdr)->trans.sport);
+}
+
+START_TEST(tc_qdisc_priority)
+{
+    struct pico_device *dev = qdev();
+    struct pico_frame *f;
+    struct pico_qdisc_config cfg = {
+        0
+    };
+
+    cfg.no_codel = 1;
+    fail_if(pico_qdisc_attach(dev, &cfg) != 0);
+    fail_if(pico_qdisc_attach(dev, &cfg) == 0);
+    fail_if(pico_qdisc_peek(dev) != NULL);
+
+    fail_if(pico_qdisc_enqueue(dev, qframe(-5, 1, 100)) <= 0);
+    fail_if(pico_qdisc_enqueue(dev, qframe(0, 2, 100)) <= 0);
+    fail_if(pico_qdisc_enqueue(dev, qframe(5, 3, 100)) <= 0);
+
+    /* peek is stable until the frame is dequeued */
+    f = pico_qdisc_peek(dev);
+    fail_if(!f || f != pico_qdisc_peek(dev));
+
+    f = qnext(dev);
+    fail_if(qsport(f) != 3);
+    pico_frame_discard(f);
+    f = qnext(dev);
+    fail_if(qsport(f) != 2);
+    pico_frame_discard(f);
+    f = qnext(dev);
+    fail_if(qsport(f) != 1);
+    pico_frame_discard(f);
+    fail_if(qnext(dev) != NULL);
+    fail_if(pico_qdisc_detach(dev) != 0);
+    fail_if(pico_qdisc_detach(dev) == 0);
+}
+END_TEST
+
+START_TEST(tc_qdisc_drr)
+{
+    struct pico_device *dev = qdev();
+    struct pico_frame *f;
+    struct pico_qdisc_stats st;
+    struct pico_qdisc_config cfg = {
+        0
+    };
+    int i, small = 0;
+
+    cfg.no_codel = 1;
+    cfg.quantum = 1000;
+    fail_if(pico_qdisc_attach(dev, &cfg) != 0);
+
+    /* bulk flow enqueues first, then a sparse flow: the sparse flow
+     * must not wait behind the whole bulk backlog */
+    for (i = 0; i < 20; i++)
+        pico_qdisc_enqueue(dev, qframe(0, 1000, 1000));
+    for (i = 0; i < 2; i++)
+        pico_qdisc_enqueue(dev, qframe(0, 2000, 100));
+
+    for (i = 0; i < 4; i++) {
+        f = qnext(dev);
+        fail_if(!f);
+        if (qsport(f) == 2000)
+            small++;
+
+        pico_frame_discard(f);
+    }
+    fail_if(small != 2);
+
+    fail_if(pico_qdisc_get_stats(dev, &st) != 0);
+    fail_if(st.enqueued != 22 || st.sent != 4 || st.backlog != 18);
+
+    /* pending frames go back to the device queue */
+    fail_if(pico_qdisc_detach(dev) != 0);
+    fail_if(dev->q_out->frames != 18);
+    pico_queue_empty(dev->q_out);
+}
+END_TEST
+
+START_TEST(tc_qdisc_limit)
+{
+    struct pico_device *dev = qdev();
+    struct pico_qdisc_stats st;
+    struct pico_qdisc_config cfg = {
+        0
+    };
+    int i;
+
+    cfg.limit = 4;
+    fail_if(pico_qdisc_attach(dev, &cfg) != 0);
+    for (i = 0; i < 6; i++)
+        fail_if(pico_qdisc_enqueue(dev, qframe(0, 1, 100)) <= 0);
+
+    fail_if(pico_qdisc_get_stats(dev, &st) != 0);
+    fail_if(st.backlog != 4 || st.overlimits != 2);
+    fail_if(pico_qdisc_detach(dev) != 0);
+    pico_queue_empty(dev->q_out);
+}
+END_TEST
+
+START_TEST(tc_qdisc_codel)
+{
+    struct pico_device *dev = qdev();
+    struct pico_frame *f;
+    struct pico_qdisc_stats st;
+    struct pico_qdisc_config cfg = {
+        0
+    };
+    int i, sent = 0;
+
+    pico_tick = 1000;
+    fail_if(pico_qdisc_attach(dev, &cfg) != 0);
+    for (i = 0; i < 64; i++)
+        pico_qdisc_enqueue(dev, qframe(0, 1, 1000));
+
+    /* a standing queue: one frame leaves every 20 ms */
+    while ((f = qnext(dev)) != NULL) {
+        pico_frame_discard(f);
+        sent++;
+        pico_tick += 20;
+    }
+    fail_if(pico_qdisc_get_stats(dev, &st) != 0);
+    fail_if(st.codel_drops == 0);
+    fail_if((uint32_t)sent + st.codel_drops != 64);
+    fail_if(pico_qdisc_detach(dev) != 0);
+}
+END_TEST
+
+START_TEST(tc_qdisc_shaper)
+{
+    struct pico_device *dev = qdev();
+    struct pico_frame *f;
+    struct pico_qdisc_config cfg = {
+        0
+    };
+
+    pico_tick = 5000;
+    cfg.rate = 2000;
+    cfg.no_codel = 1;
+    fail_if(pico_qdisc_attach(dev, &cfg) != 0);
+    pico_qdisc_enqueue(dev, qframe(0, 1, 1000));
+    pico_qdisc_enqueue(dev, qframe(0, 1, 1000));
+
+    /* the bucket holds one MTU */
+    f = qnext(dev);
+    fail_if(!f);
+    pico_frame_discard(f);
+    fail_if(pico_qdisc_peek(dev) != NULL);
+
+    pico_tick += 250;
+    fail_if(pico_qdisc_peek(dev) != NULL);
+    pico_tick += 250;
+    f = qnext(dev);
+    fail_if(!f);
+    pico_frame_discard(f);
+    fail_if(pico_qdisc_detach(dev) != 0);
+}
+END_TEST
+
+START_TEST(tc_token_bucket)
+{
+    static const uint32_t rates[] = {
+        1234567, 1000001, 1500
+    };
+    struct pico_token_bucket tb;
+    pico_time now = 1000;
+    uint32_t i, j, r, ok = 0;
+
+    /* 3/s doesn't divide a second: polled every 150 ms, the fractions of a
+     * token must add up over a minute */
+    pico_token_bucket_init(&tb, 3, 0, now);
+    tb.tokens = 0;
+    for (i = 0; i < 400; i++) {
+        now += 150;
+        if (pico_token_bucket_consume(&tb, 1, now) == 0)
+            ok++;
+    }
+    fail_if(ok < 179 || ok > 180);
+
+    /* 10/s, everything taken at each poll: 60 s give 600 tokens, not one
+     * per poll */
+    pico_token_bucket_init(&tb, 10, 0, now);
+    tb.tokens = 0;
+    ok = 0;
+    for (i = 0; i < 400; i++) {
+        now += 150;
+        while (pico_token_bucket_consume(&tb, 1, now) == 0)
+            ok++;
+    }
+    fail_if(ok != 600);
+
+    /* A full bucket doesn't bank time */
+    pico_token_bucket_init(&tb, 3, 2, now);
+    now += 10000;
+    fail_if(pico_token_bucket_consume(&tb, 2, now) != 0);
+    fail_if(pico_token_bucket_consume(&tb, 1, now + 300) == 0);
+    fail_if(pico_token_bucket_consume(&tb, 1, now + 334) != 0);
+
+    /* Polled 50 times per ms at rates that don't divide 1000: a second
+     * gives one second of tokens, on top of the full bucket at the start */
+    for (r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        pico_token_bucket_init(&tb, rates[r], 1500, now);
+        ok = 0;
+        for (i = 0; i < 1000; i++) {
+            now++;
+            for (j = 0; j < 50; j++) {
+                while (pico_token_bucket_consume(&tb, 100, now) == 0)
+                    ok += 100;
+            }
+        }
+        fail_if(ok > rates[r] + 1500);
+        fail_if(ok + 100 < rates[r]);
+    }
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_qdisc_priority = tcase_create("Unit test for qdisc strict priority");
+    TCase *TCase_qdisc_drr = tcase_create("Unit test for qdisc DRR");
+    TCase *TCase_qdisc_limit = tcase_create("Unit test for qdisc limit");
+    TCase *TCase_qdisc_codel = tcase_create("Unit test for qdisc CoDel");
+    TCase *TCase_qdisc_shaper = tcase_create("Unit test for qdisc shaper");
+    TCase *TCase_token_bucket = tcase_create("Unit test for token bucket");
+
+    tcase_add_test(TCase_qdisc_priority, tc_qdisc_priority);
+    suite_add_tcase(s, TCase_qdisc_priority);
+    tcase_add_test(TCase_qdisc_drr, tc_qdisc_drr);
+    suite_add_tcase(s, TCase_qdisc_drr);
+    tcase_add_test(TCase_qdisc_limit, tc_qdisc_limit);
+    suite_add_tcase(s, TCase_qdisc_limit);
+    tcase_add_test(TCase_qdisc_codel, tc_qdisc_codel);
+    suite_add_tcase(s, TCase_qdisc_codel);
+    tcase_add_test(TCase_qdisc_shaper, tc_qdisc_shaper);
+    suite_add_tcase(s, TCase_qdisc_shaper);
+    tcase_add_test(TCase_token_bucket, tc_token_bucket);
+    suite_add_tcase(s, TCase_token_bucket);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -0,0 +1,318 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_device.h"
+#include "pico_ipv4.h"
+#include "pico_socket.h"
+#include "pico_tcp.h"
+#include "modules/pico_dev_pipe.c"
+#include "modules/pico_simtime.c"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+#define SIM_BYTES   (1024u * 1024u)
+#define SIM_SOCKBUF (32u * 1024u)
+
+static int sim_fired;
+static uint32_t sim_sent, sim_rcvd;
+static uint8_t sim_buf[4096];
+static struct pico_socket *sim_conn;
+static uint16_t sim_ports[2];
+
+struct sim_result {
+    pico_time elapsed;
+    struct pico_pipe_stats ab, ba;
+    uint64_t bytes_acked;
+    uint32_t retrans;
+};
+
+static void sim_timer(pico_time now, void *arg)
+{
+    IGNORE_PARAMETER(arg);
+    fail_if(now != PICO_TIME_MS());
+    sim_fired++;
+}
+
+static int sim_timer_done(void *arg)
+{
+    IGNORE_PARAMETER(arg);
+    return sim_fired;
+}
+
+START_TEST(tc_simtime_clock)
+{
+    fail_if(pico_simtime_run(10, NULL, NULL) != -1);
+
+    pico_simtime_start(1000);
+    pico_stack_init();
+    fail_if(PICO_TIME_MS() != 1000 || PICO_TIME() != 1);
+    pico_simtime_advance(500);
+    fail_if(PICO_TIME_MS() != 1500);
+
+    /* Straight to the timer, which fires once the clock is past it */
+    sim_fired = 0;
+    fail_if(pico_timer_add(3600 * 1000, sim_timer, NULL) == 0);
+    fail_if(pico_simtime_run(7200 * 1000, sim_timer_done, NULL) != 1);
+    fail_if(sim_fired != 1);
+    fail_if(pico_simtime_now() != 1500 + 3600 * 1000 + 1);
+
+    /* Nothing left before the end */
+    fail_if(pico_simtime_run(1000, NULL, NULL) != 0);
+    fail_if(pico_simtime_now() != 1501 + 3601 * 1000);
+
+    pico_simtime_stop();
+    fail_if(PICO_TIME_MS() == (uint32_t)pico_simtime_now());
+}
+END_TEST
+
+START_TEST(tc_pipe_link)
+{
+    struct pico_pipe_link link = {
+        8000000, 10, 3000
+    };                              /* a byte per us */
+    struct pico_pipe_stats st;
+    struct pico_device *a, *b = NULL, *c, *d = NULL, *loop;
+    pico_time due, t0;
+    uint32_t lost;
+    int i;
+
+    pico_simtime_start(1000);
+    pico_stack_init();
+    fail_if(pico_pipe_create("pa", "pb", &link, NULL) != NULL);
+    a = pico_pipe_create("pa", "pb", &link, &b);
+    fail_if(!a || !b);
+    fail_if(pico_pipe_next(&due) != -1);
+
+    /* Back to back: 1, 2 and 3 ms on the wire, then the delay. The fourth
+     * doesn't fit in the queue. */
+    t0 = pico_simtime_now();
+    for (i = 0; i < 4; i++)
+        fail_if(a->send(a, sim_buf, 1000) != 1000);
+    fail_if(pico_pipe_next(&due) != 0 || due != t0 + 11);
+    fail_if(pico_pipe_stats(a, &st) != 0);
+    fail_if(st.sent != 3 || st.dropped != 1);
+
+    fail_if(pico_simtime_run(11, NULL, NULL) != 0);
+    pico_pipe_stats(a, &st);
+    fail_if(st.delivered != 1);
+    fail_if(pico_simtime_run(2, NULL, NULL) != 0);
+    pico_pipe_stats(a, &st);
+    fail_if(st.delivered != 3);
+    fail_if(pico_pipe_next(&due) != -1);
+
+    /* Half lost, the same half for the same seed */
+    link.queue = 0;
+    link.loss = 500000;
+    link.seed = 7;
+    c = pico_pipe_create("pc", "pd", &link, &d);
+    fail_if(!c);
+    for (i = 0; i < 100; i++)
+        c->send(c, sim_buf, 10);
+    pico_pipe_stats(c, &st);
+    fail_if(st.sent + st.lost != 100 || st.lost < 25 || st.lost > 75);
+    pico_device_destroy(c);
+    pico_device_destroy(d);
+    lost = st.lost;
+    c = pico_pipe_create("pc", "pd", &link, &d);
+    fail_if(!c);
+    for (i = 0; i < 100; i++)
+        c->send(c, sim_buf, 10);
+    pico_pipe_stats(c, &st);
+    fail_if(st.lost != lost);
+    pico_device_destroy(c);
+    pico_device_destroy(d);
+
+    /* Without a peer it loops back */
+    loop = pico_pipe_create("pl", NULL, NULL, NULL);
+    fail_if(!loop);
+    fail_if(loop->send(loop, sim_buf, 100) != 100);
+    fail_if(pico_simtime_run(0, NULL, NULL) != 0);
+    pico_pipe_stats(loop, &st);
+    fail_if(st.delivered != 1);
+    fail_if(pico_pipe_stats(NULL, &st) != -1);
+
+    /* The other end goes away */
+    fail_if(b->send(b, sim_buf, 100) != 100);
+    pico_device_destroy(a);
+    fail_if(pico_pipe_next(&due) != -1);
+    fail_if(b->send(b, sim_buf, 100) != 100);
+    pico_pipe_stats(b, &st);
+    fail_if(st.sent != 1 || st.dropped != 1);
+    pico_device_destroy(b);
+    pico_device_destroy(loop);
+    pico_simtime_stop();
+}
+END_TEST
+
+static void sim_client_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    uint32_t len;
+    int w;
+
+    if (!(ev & (PICO_SOCK_EV_CONN | PICO_SOCK_EV_WR)))
+        return;
+
+    while (sim_sent < SIM_BYTES) {
+        len = SIM_BYTES - sim_sent;
+        if (len > sizeof(sim_buf))
+            len = sizeof(sim_buf);
+
+        w = pico_socket_write(s, sim_buf, (int)len);
+        if (w <= 0)
+            break;
+
+        sim_sent += (uint32_t)w;
+    }
+}
+
+static void sim_server_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    struct pico_ip4 peer;
+    uint16_t port;
+    uint8_t buf[1500];
+    int r;
+
+    if (ev & PICO_SOCK_EV_CONN) {
+        sim_conn = pico_socket_accept(s, &peer, &port);
+        fail_if(!sim_conn);
+    }
+
+    if (ev & PICO_SOCK_EV_RD) {
+        while ((r = pico_socket_read(s, buf, sizeof(buf))) > 0)
+            sim_rcvd += (uint32_t)r;
+    }
+}
+
+static int sim_tcp_done(void *arg)
+{
+    IGNORE_PARAMETER(arg);
+    return sim_rcvd == SIM_BYTES;
+}
+
+static int sim_tcp_closed(void *arg)
+{
+    IGNORE_PARAMETER(arg);
+    return !pico_get_sockport(PICO_PROTO_TCP, sim_ports[0]) &&
+           !pico_get_sockport(PICO_PROTO_TCP, sim_ports[1]);
+}
+
+/* A 1 MiB transfer from a fresh stack, torn down again once closed */
+static void sim_tcp_run(struct sim_result *res)
+{
+    /* 10 Mbit/s, 50 ms each way */
+    struct pico_pipe_link link = {
+        10000000, 50, 64000
+    };
+    struct pico_ip4 a_addr, b_addr, mask, host, any;
+    struct pico_device *a, *b = NULL;
+    struct pico_socket *srv, *cli;
+    struct pico_tcp_info info;
+    uint32_t size = SIM_SOCKBUF;
+    uint16_t port = short_be(5555);
+    pico_time t0;
+
+    pico_simtime_start(1000);
+    pico_stack_init();
+    a = pico_pipe_create("ta", "tb", &link, &b);
+    fail_if(!a || !b);
+    pico_string_to_ipv4("10.40.0.1", &a_addr.addr);
+    pico_string_to_ipv4("10.40.0.2", &b_addr.addr);
+    pico_string_to_ipv4("255.255.255.0", &mask.addr);
+    host.addr = 0xFFFFFFFFu;
+    any.addr = 0;
+    fail_if(pico_ipv4_link_add(a, a_addr, mask) != 0);
+    fail_if(pico_ipv4_link_add(b, b_addr, mask) != 0);
+    fail_if(pico_ipv4_route_add(b_addr, host, any, 1, pico_ipv4_link_get(&a_addr)) != 0);
+    fail_if(pico_ipv4_route_add(a_addr, host, any, 1, pico_ipv4_link_get(&b_addr)) != 0);
+
+    srv = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_TCP, sim_server_wakeup);
+    fail_if(!srv);
+    fail_if(pico_socket_bind(srv, &b_addr, &port) != 0);
+    fail_if(pico_socket_setoption(srv, PICO_SOCKET_OPT_RCVBUF, &size) != 0);
+    fail_if(pico_socket_setoption(srv, PICO_SOCKET_OPT_SNDBUF, &size) != 0);
+    fail_if(pico_socket_listen(srv, 1) != 0);
+    cli = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_TCP, sim_client_wakeup);
+    fail_if(!cli);
+
+    sim_sent = sim_rcvd = 0;
+    sim_conn = NULL;
+    t0 = pico_simtime_now();
+    fail_if(pico_socket_connect(cli, &b_addr, port) != 0);
+    fail_if(pico_simtime_run(60 * 1000, sim_tcp_done, NULL) != 1);
+    res->elapsed = pico_simtime_now() - t0;
+    fail_if(pico_pipe_stats(a, &res->ab) != 0);
+    fail_if(pico_pipe_stats(b, &res->ba) != 0);
+    fail_if(pico_tcp_get_info(cli, &info) != 0);
+    res->bytes_acked = info.bytes_acked;
+    res->retrans = info.retrans;
+
+    /* The accepted socket has the listener's buffers */
+    fail_if(!sim_conn);
+    size = 0;
+    fail_if(pico_socket_getoption(sim_conn, PICO_SOCKET_OPT_RCVBUF, &size) != 0 || size != SIM_SOCKBUF);
+    size = 0;
+    fail_if(pico_socket_getoption(sim_conn, PICO_SOCKET_OPT_SNDBUF, &size) != 0 || size != SIM_SOCKBUF);
+
+    /* Nothing may be left for the next run */
+    sim_ports[0] = port;
+    sim_ports[1] = cli->local_port;
+    pico_socket_close(srv);
+    pico_socket_close(sim_conn);
+    pico_socket_close(cli);
+    fail_if(pico_simtime_run(600 * 1000, sim_tcp_closed, NULL) != 1);
+    pico_device_destroy(a);
+    pico_device_destroy(b);
+    pico_simtime_stop();
+}
+
+START_TEST(tc_simtime_tcp)
+{
+    struct sim_result first, again;
+
+    sim_tcp_run(&first);
+
+    /* No faster than the wire. The receive window, not the link, sets the
+     * pace over 100 ms of round trip. */
+    fail_if(first.elapsed < (SIM_BYTES * 8u) / 10000u);
+    fail_if(first.elapsed > 20 * 1000);
+    fail_if(first.ab.sent == 0 || first.ba.sent == 0);
+    fail_if(first.bytes_acked == 0 || first.bytes_acked > SIM_BYTES);
+
+    /* The same on every run */
+    sim_tcp_run(&again);
+    fail_if(again.elapsed != first.elapsed);
+    fail_if(again.ab.sent != first.ab.sent || again.ab.delivered != first.ab.delivered);
+    fail_if(again.ab.dropped != first.ab.dropped || again.ab.lost != first.ab.lost);
+    fail_if(again.ba.sent != first.ba.sent || again.ba.delivered != first.ba.delivered);
+    fail_if(again.ba.dropped != first.ba.dropped || again.ba.lost != first.ba.lost);
+    fail_if(again.bytes_acked != first.bytes_acked || again.retrans != first.retrans);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_simtime_clock = tcase_create("Unit test for simtime_clock");
+    TCase *TCase_pipe_link = tcase_create("Unit test for pipe_link");
+    TCase *TCase_simtime_tcp = tcase_create("Unit test for simtime_tcp");
+
+    tcase_add_test(TCase_simtime_clock, tc_simtime_clock);
+    suite_add_tcase(s, TCase_simtime_clock);
+    tcase_add_test(TCase_pipe_link, tc_pipe_link);
+    suite_add_tcase(s, TCase_pipe_link);
+    tcase_add_test(TCase_simtime_tcp, tc_simtime_tcp);
+    suite_add_tcase(s, TCase_simtime_tcp);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
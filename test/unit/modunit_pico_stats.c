@@ -0,0 +1,154 @@
+#define PICO_STATS_TIME() (pico_tick)
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_device.h"
+#include "pico_protocol.h"
+#include "modules/pico_dev_null.c"
+#include "modules/pico_stats.c"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+static struct pico_frame *sframe(void)
+{
+    struct pico_frame *f = pico_frame_alloc(64);
+
+    fail_if(!f);
+    return f;
+}
+
+static struct pico_stats_entry *sfind(struct pico_stats_entry *e, int n, const char *name)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (strcmp(e[i].name, name) == 0)
+            return &e[i];
+
+    return NULL;
+}
+
+START_TEST(tc_stats_queue)
+{
+    struct pico_queue q;
+    struct pico_frame *f[3];
+    int i;
+
+    memset(&q, 0, sizeof(q));
+    q.max_frames = 2;
+    pico_tick = 1000;
+    for (i = 0; i < 3; i++)
+        f[i] = sframe();
+
+    fail_if(pico_enqueue(&q, f[0]) <= 0);
+    fail_if(pico_enqueue(&q, f[1]) <= 0);
+    fail_if(pico_enqueue(&q, f[2]) != -1);
+    fail_if(q.stats.enqueued != 2 || q.stats.full != 1 || q.stats.high_water != 2);
+
+    /* Out right away, then 5 ms later: 5 takes three halvings to reach 0 */
+    pico_frame_discard(pico_dequeue(&q));
+    pico_tick += 5;
+    pico_frame_discard(pico_dequeue(&q));
+    fail_if(q.stats.dequeued != 2);
+    fail_if(q.stats.latency[0] != 1 || q.stats.latency[3] != 1);
+
+    /* Very long waits end up in the last bucket */
+    fail_if(pico_enqueue(&q, f[2]) <= 0);
+    pico_tick += (pico_time)1 << 40;
+    pico_frame_discard(pico_dequeue(&q));
+    fail_if(q.stats.latency[PICO_STATS_LATENCY_BUCKETS - 1] != 1);
+    fail_if(q.stats.high_water != 2);
+}
+END_TEST
+
+START_TEST(tc_stats_protocol_next)
+{
+    struct pico_protocol *p = NULL;
+    int layer = 0, found = 0, n = 0;
+
+    pico_stack_init();
+    while ((p = pico_protocol_next(p)) != NULL) {
+        fail_if((int)p->layer < layer);
+        layer = (int)p->layer;
+        if (strcmp(p->name, "ipv4") == 0)
+            found = 1;
+
+        n++;
+    }
+    fail_if(!found || n < 4);
+}
+END_TEST
+
+START_TEST(tc_stats_snapshot)
+{
+    struct pico_device *dev;
+    struct pico_stats_entry e[64], *d;
+    struct pico_stats_loop loop;
+    uint8_t buf[64] = { 0 };
+    int n, i;
+
+    pico_stack_init();
+    dev = pico_null_create("stats0");
+    fail_if(!dev);
+    pico_stats_reset();
+
+    n = pico_stats_snapshot(NULL, 0);
+    fail_if(n < 2);
+    fail_if(pico_stats_snapshot(NULL, 1) != -1);
+    fail_if(pico_stats_snapshot(e, 1) != n);
+    fail_if(n > 64);
+
+    for (i = 0; i < 5; i++)
+        fail_if(pico_stack_recv(dev, buf, sizeof(buf)) <= 0);
+
+    fail_if(pico_stats_snapshot(e, 64) != n);
+    d = sfind(e, n, "stats0");
+    fail_if(!d || d->type != PICO_STATS_DEVICE);
+    fail_if(d->rx != 5 || d->in.high_water != 5 || d->in.dequeued != 0);
+    d = sfind(e, n, "ipv4");
+    fail_if(!d || d->type != PICO_STATS_PROTOCOL || d->layer != PICO_LAYER_NETWORK);
+
+    pico_stack_tick();
+    pico_stats_snapshot(e, 64);
+    d = sfind(e, n, "stats0");
+    fail_if(d->in.dequeued != 5);
+    pico_stats_loop_get(&loop);
+    fail_if(loop.ticks != 1 || loop.used[0] < 5);
+
+    pico_stats_reset();
+    pico_stats_snapshot(e, 64);
+    d = sfind(e, n, "stats0");
+    fail_if(d->rx != 0 || d->in.high_water != 0);
+    pico_stats_loop_get(&loop);
+    fail_if(loop.ticks != 0);
+    pico_device_destroy(dev);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_stats_queue = tcase_create("Unit test for stats_queue");
+    TCase *TCase_stats_protocol_next = tcase_create("Unit test for stats_protocol_next");
+    TCase *TCase_stats_snapshot = tcase_create("Unit test for stats_snapshot");
+
+    tcase_add_test(TCase_stats_queue, tc_stats_queue);
+    suite_add_tcase(s, TCase_stats_queue);
+    tcase_add_test(TCase_stats_protocol_next, tc_stats_protocol_next);
+    suite_add_tcase(s, TCase_stats_protocol_next);
+    tcase_add_test(TCase_stats_snapshot, tc_stats_snapshot);
+    suite_add_tcase(s, TCase_stats_snapshot);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -486,7 +486,102 @@ START_TEST(tc_tcp_data_in)
 END_TEST
 START_TEST(tc_tcp_ack_advance_una)
 {
-    /* TODO: test this: static int tcp_ack_advance_una(struct pico_socket_tcp *t, struct pico_frame *f, pico_time *timestamp) */
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)pico_tcp_open(PICO_PROTO_IPV4);
+    struct pico_frame *f, *ack;
+    pico_time tm;
+    uint32_t i;
+
+    fail_if(!t);
+    /* Only the payload counts, not the headers */
+    for (i = 0; i < 4; i++) {
+        f = pico_frame_alloc(PICO_SIZE_TCPHDR + 100);
+        fail_if(!f);
+        f->transport_hdr = f->start;
+        f->payload_len = 100;
+        ((struct pico_tcp_hdr *)f->transport_hdr)->seq = long_be(1000 + 100 * i);
+        fail_if(pico_enqueue_segment(&t->tcpq_out, f) <= 0);
+    }
+
+    ack = pico_frame_alloc(PICO_SIZE_TCPHDR);
+    fail_if(!ack);
+    ack->transport_hdr = ack->start;
+    ((struct pico_tcp_hdr *)ack->transport_hdr)->ack = long_be(1300);
+    fail_if(tcp_ack_advance_una(t, ack, &tm) != 3);
+    fail_if(t->bytes_acked != 300);
+
+    /* Nothing new */
+    fail_if(tcp_ack_advance_una(t, ack, &tm) != 0);
+    fail_if(t->bytes_acked != 300);
+
+    /* Past 4 GiB the count goes on */
+    t->bytes_acked = 0xFFFFFFFFull;
+    ((struct pico_tcp_hdr *)ack->transport_hdr)->ack = long_be(1400);
+    fail_if(tcp_ack_advance_una(t, ack, &tm) != 1);
+    fail_if(t->bytes_acked != 0xFFFFFFFFull + 100u);
+    pico_frame_discard(ack);
+}
+END_TEST
+START_TEST(tc_tcp_get_info)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)pico_tcp_open(PICO_PROTO_IPV4);
+    struct pico_socket udp;
+    struct pico_tcp_info info;
+
+    fail_if(!t);
+    memset(&udp, 0, sizeof(udp));
+    fail_if(pico_tcp_get_info(NULL, &info) != -1);
+    fail_if(pico_tcp_get_info(&t->sock, NULL) != -1);
+    fail_if(pico_tcp_get_info(&udp, &info) != -1);
+
+    t->sock.proto = &pico_proto_tcp;
+    t->sock.state = PICO_SOCKET_STATE_TCP_ESTABLISHED | PICO_SOCKET_STATE_CONNECTED;
+    t->sock.local_port = short_be(80);
+    t->avg_rtt = 40;
+    t->cwnd = 10;
+    t->ssthresh = 20;
+    t->in_flight = 3;
+    t->x_mode = PICO_TCP_RECOVER;
+    t->recv_wnd = 1000;
+    t->recv_wnd_scale = 2;
+    t->retrans = 7;
+    t->recoveries = 1;
+    t->bytes_acked = 5000000000ull;
+    fail_if(pico_tcp_get_info(&t->sock, &info) != 0);
+    fail_if(info.state != PICO_SOCKET_STATE_TCP_ESTABLISHED || info.local_port != 80);
+    fail_if(info.srtt != 40 || info.cwnd != 10 || info.ssthresh != 20 || info.in_flight != 3);
+    fail_if(info.x_mode != PICO_TCP_RECOVER || info.snd_wnd != 4000);
+    fail_if(info.retrans != 7 || info.recoveries != 1 || info.bytes_acked != 5000000000ull);
+    fail_if(info.out_max != t->tcpq_out.max_size);
+}
+END_TEST
+START_TEST(tc_pico_tcp_push_nagle_on)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)pico_tcp_open(PICO_PROTO_IPV4);
+    struct pico_frame *f;
+    uint16_t full;
+
+    fail_if(!t);
+    t->mss = 1000;
+    t->in_flight = 1;
+    full = (uint16_t)(t->mss + PICO_SIZE_TCPHDR - pico_tcp_overhead(&t->sock));
+
+    /* Data in flight, but a full sized segment goes out anyway */
+    f = pico_frame_alloc(PICO_SIZE_TCPHDR + full);
+    fail_if(!f);
+    f->transport_hdr = f->start;
+    f->payload_len = full;
+    ((struct pico_tcp_hdr *)f->transport_hdr)->seq = long_be(1000);
+    fail_if(pico_tcp_push_nagle_on(t, f) != full);
+    fail_if(t->tcpq_out.frames != 1 || t->tcpq_hold.frames != 0);
+
+    /* A small one waits */
+    f = pico_frame_alloc(PICO_SIZE_TCPHDR + 100);
+    fail_if(!f);
+    f->transport_hdr = f->start;
+    f->payload_len = 100;
+    ((struct pico_tcp_hdr *)f->transport_hdr)->seq = long_be(1000u + full);
+    fail_if(pico_tcp_push_nagle_on(t, f) != 100);
+    fail_if(t->tcpq_out.frames != 1 || t->tcpq_hold.frames != 1);
 }
 END_TEST
 START_TEST(tc_time_diff)
@@ -689,6 +784,8 @@ Suite *pico_suite(void)
     TCase *TCase_tcp_sack_prepare = tcase_create("Unit test for tcp_sack_prepare");
     TCase *TCase_tcp_data_in = tcase_create("Unit test for tcp_data_in");
     TCase *TCase_tcp_ack_advance_una = tcase_create("Unit test for tcp_ack_advance_una");
+    TCase *TCase_tcp_get_info = tcase_create("Unit test for tcp_get_info");
+    TCase *TCase_pico_tcp_push_nagle_on = tcase_create("Unit test for pico_tcp_push_nagle_on");
     TCase *TCase_time_diff = tcase_create("Unit test for time_diff");
     TCase *TCase_tcp_rtt = tcase_create("Unit test for tcp_rtt");
     TCase *TCase_tcp_congestion_control = tcase_create("Unit test for tcp_congestion_control");
@@ -782,6 +879,10 @@ Suite *pico_suite(void)
     suite_add_tcase(s, TCase_tcp_data_in);
     tcase_add_test(TCase_tcp_ack_advance_una, tc_tcp_ack_advance_una);
     suite_add_tcase(s, TCase_tcp_ack_advance_una);
+    tcase_add_test(TCase_tcp_get_info, tc_tcp_get_info);
+    suite_add_tcase(s, TCase_tcp_get_info);
+    tcase_add_test(TCase_pico_tcp_push_nagle_on, tc_pico_tcp_push_nagle_on);
+    suite_add_tcase(s, TCase_pico_tcp_push_nagle_on);
     tcase_add_test(TCase_time_diff, tc_time_diff);
     suite_add_tcase(s, TCase_time_diff);
     tcase_add_test(TCase_tcp_rtt, tc_tcp_rtt);
@@ -16,7 +16,11 @@ static int called_sendto = 0;
 static uint32_t called_pico_timer_add = 0;
 static int called_pico_timer_cancel = 0;
 static struct pico_socket example_socket;
+static struct pico_protocol example_net;
 static struct pico_tftp_session example_session;
+static uint8_t example_data[PICO_TFTP_MAX_BLKSIZE];
+static int32_t example_data_len;
+static int32_t sent_len;
 
 int pico_socket_close(struct pico_socket *s)
 {
@@ -34,9 +38,43 @@ int pico_socket_sendto(struct pico_socket *s, const void *buf, const int len, vo
     (void)dst;
     (void)remote_port;
     called_sendto++;
+    sent_len = len;
     return 0;
 }
 
+/* Sends one block of example_data_len bytes per call */
+static int tftp_sender_cb(struct pico_tftp_session *session, uint16_t err, uint8_t *block, int32_t len, void *arg)
+{
+    (void)block;
+    (void)len;
+    (void)arg;
+    called_user_cb++;
+    if (err == PICO_TFTP_EV_OK || err == PICO_TFTP_EV_OPT)
+        pico_tftp_send(session, example_data, example_data_len);
+
+    return 0;
+}
+
+static void example_window_session(uint16_t blksize, uint16_t windowsize)
+{
+    memset(&example_session, 0, sizeof(example_session));
+    example_net.proto_number = PICO_PROTO_IPV4;
+    example_socket.net = &example_net;
+    example_session.socket = &example_socket;
+    example_session.remote_address.ip4.addr = long_be(0x0A000001);
+    fail_if(pico_tftp_set_option(&example_session, PICO_TFTP_OPTION_BLKSIZE, blksize) != 0);
+    fail_if(pico_tftp_set_option(&example_session, PICO_TFTP_OPTION_WINDOWSIZE, windowsize) != 0);
+}
+
+static void example_recv(uint16_t opcode, uint16_t block, int32_t len)
+{
+    struct pico_tftp_data_hdr *dh = (struct pico_tftp_data_hdr *)example_session.tftp_block;
+
+    dh->opcode = short_be(opcode);
+    dh->block = short_be(block);
+    tftp_message_received(&example_session, example_session.tftp_block, len, &example_session.remote_address, 0);
+}
+
 int tftp_user_cb(struct pico_tftp_session *session, uint16_t err, uint8_t *block, int32_t len, void *arg)
 {
     (void)session;
@@ -229,6 +267,202 @@ START_TEST(tc_tftp_send_data)
 }
 END_TEST
 
+START_TEST(tc_tftp_options)
+{
+    char str[MAX_OPTIONS_SIZE];
+    char req[64] = "file";
+    size_t len;
+    int options;
+    uint8_t timeout;
+    int32_t filesize;
+    uint16_t blksize = 0, windowsize = 0;
+    int32_t value;
+
+    memset(&example_session, 0, sizeof(example_session));
+    fail_if(pico_tftp_set_option(&example_session, PICO_TFTP_OPTION_BLKSIZE, PICO_TFTP_MIN_BLKSIZE - 1) != -1);
+    fail_if(pico_tftp_set_option(&example_session, PICO_TFTP_OPTION_WINDOWSIZE, 0) != -1);
+    fail_if(pico_tftp_get_option(&example_session, PICO_TFTP_OPTION_BLKSIZE, &value) != -1);
+
+    /* larger values are lowered to what we support */
+    fail_if(pico_tftp_set_option(&example_session, PICO_TFTP_OPTION_BLKSIZE, 65464) != 0);
+    fail_if(pico_tftp_set_option(&example_session, PICO_TFTP_OPTION_WINDOWSIZE, 1000) != 0);
+    fail_if(pico_tftp_get_option(&example_session, PICO_TFTP_OPTION_BLKSIZE, &value) != 0 || value != PICO_TFTP_MAX_BLKSIZE);
+    fail_if(pico_tftp_get_option(&example_session, PICO_TFTP_OPTION_WINDOWSIZE, &value) != 0 || value != PICO_TFTP_MAX_WINDOWSIZE);
+    fail_if(tftp_blksize(&example_session) != PICO_TFTP_MAX_BLKSIZE);
+
+    /* round trip through the option string */
+    len = prepare_options_string(&example_session, str, 0);
+    fail_if(parse_optional_arguments(str, (int32_t)len, &options, &timeout, &filesize, &blksize, &windowsize) != 0);
+    fail_if(options != (PICO_TFTP_OPTION_BLKSIZE | PICO_TFTP_OPTION_WINDOWSIZE));
+    fail_if(blksize != PICO_TFTP_MAX_BLKSIZE || windowsize != PICO_TFTP_MAX_WINDOWSIZE);
+
+    /* ignored unless asked for */
+    fail_if(parse_optional_arguments(str, (int32_t)len, &options, &timeout, &filesize, NULL, NULL) != 0);
+    fail_if(options != 0);
+
+    /* out of the RFC ranges */
+    memcpy(str, "blksize\0" "7\0", 10);
+    fail_if(parse_optional_arguments(str, 10, &options, &timeout, &filesize, &blksize, &windowsize) != -1);
+    memcpy(str, "windowsize\0" "0\0", 13);
+    fail_if(parse_optional_arguments(str, 13, &options, &timeout, &filesize, &blksize, &windowsize) != -1);
+
+    /* requests get the local maximum */
+    memcpy(req + 5, "octet\0" "blksize\0" "65464\0" "windowsize\0" "64\0", 34);
+    fail_if(pico_tftp_parse_request_opts(req, 39, &options, &timeout, &filesize, &blksize, &windowsize) != 0);
+    fail_if(options != (PICO_TFTP_OPTION_BLKSIZE | PICO_TFTP_OPTION_WINDOWSIZE));
+    fail_if(blksize != PICO_TFTP_MAX_BLKSIZE || windowsize != PICO_TFTP_MAX_WINDOWSIZE);
+}
+END_TEST
+
+START_TEST(tc_tftp_oack)
+{
+    char oack[32];
+
+    /* the server lowers both options */
+    example_window_session(1024, 8);
+    example_session.callback = tftp_sender_cb;
+    example_session.state = TFTP_STATE_WRITE_REQUESTED;
+    example_session.packet_counter = 1;
+    example_session.window_base = 1;
+    example_data_len = 512;
+    memset(oack, 0, sizeof(oack));
+    oack[1] = PICO_TFTP_OACK;
+    memcpy(oack + 2, "blksize\0" "512\0" "windowsize\0" "4\0", 25);
+    memcpy(example_session.tftp_block, oack, 27);
+    called_sendto = 0;
+    expected_opcode = PICO_TFTP_DATA;
+    tftp_message_received(&example_session, example_session.tftp_block, 27, &example_session.remote_address, 0);
+    fail_if(tftp_blksize(&example_session) != 512);
+    fail_if(tftp_windowsize(&example_session) != 4);
+    fail_if(called_sendto != 4);
+    fail_if(tftp_in_flight(&example_session) != 4);
+    del_session(&example_session);
+
+    /* but may not raise them */
+    example_window_session(512, 4);
+    example_session.callback = tftp_user_cb;
+    example_session.state = TFTP_STATE_WRITE_REQUESTED;
+    memcpy(oack + 2, "blksize\0" "1024\0", 13);
+    memcpy(example_session.tftp_block, oack, 15);
+    called_sendto = 0;
+    expected_opcode = PICO_TFTP_ERROR;
+    tftp_message_received(&example_session, example_session.tftp_block, 15, &example_session.remote_address, 0);
+    fail_if(called_sendto != 1);
+    fail_if(example_session.state != TFTP_STATE_CLOSING);
+}
+END_TEST
+
+START_TEST(tc_tftp_window_tx)
+{
+    int i;
+
+    example_window_session(PICO_TFTP_MIN_BLKSIZE, 4);
+    example_session.callback = tftp_sender_cb;
+    example_session.state = TFTP_STATE_TX;
+    example_session.packet_counter = 1;
+    example_session.window_base = 1;
+    example_data_len = PICO_TFTP_MIN_BLKSIZE;
+    for (i = 0; i < PICO_TFTP_MIN_BLKSIZE; i++)
+        example_data[i] = (uint8_t)i;
+
+    /* the window fills up, then sending blocks */
+    called_sendto = 0;
+    expected_opcode = PICO_TFTP_DATA;
+    tftp_fill_window(&example_session, PICO_TFTP_EV_OK, 0);
+    fail_if(called_sendto != 4);
+    fail_if(example_session.packet_counter != 5);
+    fail_if(pico_tftp_send(&example_session, example_data, example_data_len) != -1);
+    fail_if(pico_err != PICO_ERR_EAGAIN);
+    fail_if(pico_tftp_send(&example_session, example_data, PICO_TFTP_MIN_BLKSIZE + 1) != -1);
+
+    /* full ACK: four new blocks */
+    called_sendto = 0;
+    example_recv(PICO_TFTP_ACK, 4, 4);
+    fail_if(called_sendto != 4);
+    fail_if(example_session.window_base != 5 || example_session.packet_counter != 9);
+
+    /* partial ACK: blocks 7 and 8 again, then 9 and 10 */
+    called_sendto = 0;
+    example_recv(PICO_TFTP_ACK, 6, 4);
+    fail_if(called_sendto != 4);
+    fail_if(example_session.window_base != 7 || example_session.packet_counter != 11);
+    fail_if(memcmp(tftp_window_slot(&example_session, 7) + 4, example_data, PICO_TFTP_MIN_BLKSIZE) != 0);
+
+    /* duplicate and late ACKs change nothing */
+    called_sendto = 0;
+    example_recv(PICO_TFTP_ACK, 6, 4);
+    example_recv(PICO_TFTP_ACK, 3, 4);
+    fail_if(called_sendto != 0);
+    fail_if(example_session.state != TFTP_STATE_TX);
+
+    /* timeout: the whole window again */
+    event_timeout(&example_session, 0);
+    fail_if(called_sendto != 4);
+    fail_if(sent_len != PICO_TFTP_MIN_BLKSIZE + 4);
+
+    /* last block, then the ACK for it closes */
+    example_data_len = 3;
+    called_sendto = 0;
+    example_recv(PICO_TFTP_ACK, 10, 4);
+    fail_if(called_sendto != 1);
+    fail_if(example_session.state != TFTP_STATE_WAIT_LAST_ACK);
+    called_pico_socket_close = 0;
+    example_recv(PICO_TFTP_ACK, 11, 4);
+    fail_if(!called_pico_socket_close);
+
+    /* ACK for a block never sent */
+    example_window_session(PICO_TFTP_MIN_BLKSIZE, 4);
+    example_session.callback = tftp_user_cb;
+    example_session.state = TFTP_STATE_TX;
+    example_session.packet_counter = 3;
+    example_session.window_base = 1;
+    expected_opcode = PICO_TFTP_ERROR;
+    called_sendto = 0;
+    example_recv(PICO_TFTP_ACK, 3, 4);
+    fail_if(called_sendto != 1);
+    fail_if(example_session.state != TFTP_STATE_CLOSING);
+}
+END_TEST
+
+START_TEST(tc_tftp_window_rx)
+{
+    uint16_t block;
+
+    example_window_session(PICO_TFTP_MIN_BLKSIZE, 4);
+    example_session.callback = tftp_user_cb;
+    example_session.state = TFTP_STATE_RX;
+    expected_opcode = PICO_TFTP_ACK;
+
+    /* one ACK per window */
+    called_sendto = 0;
+    called_user_cb = 0;
+    for (block = 1; block <= 8; block++)
+        example_recv(PICO_TFTP_DATA, block, PICO_TFTP_MIN_BLKSIZE + 4);
+    fail_if(called_user_cb != 8);
+    fail_if(called_sendto != 2);
+
+    /* gap: the last block in order is acked once */
+    called_sendto = 0;
+    example_recv(PICO_TFTP_DATA, 9, PICO_TFTP_MIN_BLKSIZE + 4);
+    example_recv(PICO_TFTP_DATA, 11, PICO_TFTP_MIN_BLKSIZE + 4);
+    example_recv(PICO_TFTP_DATA, 12, PICO_TFTP_MIN_BLKSIZE + 4);
+    fail_if(called_sendto != 1);
+    fail_if(example_session.packet_counter != 9);
+
+    /* the sender timed out and repeats blocks we have: ACK again */
+    called_sendto = 0;
+    example_recv(PICO_TFTP_DATA, 9, PICO_TFTP_MIN_BLKSIZE + 4);
+    fail_if(called_sendto != 1);
+
+    /* short block: last one, acked at once */
+    called_sendto = 0;
+    called_pico_socket_close = 0;
+    example_recv(PICO_TFTP_DATA, 10, 6);
+    fail_if(called_sendto != 1);
+    fail_if(!called_pico_socket_close);
+}
+END_TEST
+
 START_TEST(tc_pico_tftp_abort)
 {
     int ret;
@@ -320,6 +554,10 @@ Suite *pico_suite(void)
     TCase *TCase_tftp_receive = tcase_create("Unit test for tftp_receive");
     TCase *TCase_tftp_cb = tcase_create("Unit test for tftp_cb");
     TCase *TCase_tftp_socket_open = tcase_create("Unit test for tftp_socket_open");
+    TCase *TCase_tftp_options = tcase_create("Unit test for blksize and windowsize options");
+    TCase *TCase_tftp_oack = tcase_create("Unit test for event_oack");
+    TCase *TCase_tftp_window_tx = tcase_create("Unit test for the TX window");
+    TCase *TCase_tftp_window_rx = tcase_create("Unit test for the RX window");
 
 
 /*    tcase_add_test(TCase_check_opcode, tc_check_opcode); */
@@ -360,6 +598,14 @@ Suite *pico_suite(void)
     suite_add_tcase(s, TCase_tftp_cb);
     tcase_add_test(TCase_tftp_socket_open, tc_tftp_socket_open);
     suite_add_tcase(s, TCase_tftp_socket_open);
+    tcase_add_test(TCase_tftp_options, tc_tftp_options);
+    suite_add_tcase(s, TCase_tftp_options);
+    tcase_add_test(TCase_tftp_oack, tc_tftp_oack);
+    suite_add_tcase(s, TCase_tftp_oack);
+    tcase_add_test(TCase_tftp_window_tx, tc_tftp_window_tx);
+    suite_add_tcase(s, TCase_tftp_window_tx);
+    tcase_add_test(TCase_tftp_window_rx, tc_tftp_window_rx);
+    suite_add_tcase(s, TCase_tftp_window_rx);
     return s;
 }
 
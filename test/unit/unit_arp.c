@@ -25,17 +25,42 @@ START_TEST (arp_update_max_arp_reqs_test)
 }
 END_TEST
 
-START_TEST (arp_compare_test)
+START_TEST (arp_table_test)
 {
-    struct pico_arp a, b;
-    char ipstr[] = "192.168.1.1";
+    struct pico_ip4 ip;
+    struct pico_neighbor *a;
+    uint8_t mac[6] = {
+        0, 0, 0, 0xa, 0xb, 0xc
+    };
+    uint32_t i, count = neigh_count;
 
-    memset(&a, 0, sizeof(a));
-    pico_string_to_ipv4(ipstr, &b.ipv4.addr);
+    pico_stack_init();
+    /* many neighbours in one subnet, spread over the buckets */
+    for (i = 0; i < 200; i++) {
+        ip.addr = long_be(0x0A000000 + i);
+        mac[5] = (uint8_t)i;
+        fail_unless(pico_arp_create_entry(mac, ip, NULL) == 0);
+    }
+    fail_unless(neigh_count == count + 200);
+    for (i = 0; i < 200; i++) {
+        ip.addr = long_be(0x0A000000 + i);
+        a = arp_find(NULL, ip.addr);
+        fail_if(!a);
+        fail_unless(a->hwaddr.mac.addr[5] == (uint8_t)i);
+    }
+    /* same address again updates the entry */
+    ip.addr = long_be(0x0A000005);
+    mac[5] = 0x55;
+    fail_unless(pico_arp_create_entry(mac, ip, NULL) == 0);
+    fail_unless(neigh_count == count + 200);
+    fail_unless(pico_arp_lookup(&ip)->addr[5] == 0x55);
+    fail_unless(pico_arp_reverse_lookup((struct pico_eth *)mac)->addr == ip.addr);
 
-    fail_unless(arp_compare(&a, &b) == -1);
-    fail_unless(arp_compare(&b, &a) == 1);
-    fail_unless(arp_compare(&a, &a) == 0);
+    for (i = 0; i < 200; i++) {
+        ip.addr = long_be(0x0A000000 + i);
+        pico_neighbor_del(arp_find(NULL, ip.addr));
+    }
+    fail_unless(neigh_count == count);
 }
 END_TEST
 
@@ -44,57 +69,151 @@ START_TEST (arp_lookup_test)
     struct pico_ip4 ip;
     struct pico_eth *eth = NULL;
     char ipstr[] = "192.168.1.1";
-    struct pico_arp entry;
+    uint8_t mac[6] = {
+        0, 0, 0, 0xa, 0xb, 0xc
+    };
+    struct pico_neighbor *entry;
 
+    pico_string_to_ipv4(ipstr, &ip.addr);
     eth = pico_arp_lookup(&ip);
     fail_unless(eth == NULL);
 
-    pico_string_to_ipv4(ipstr, &ip.addr);
-    entry.ipv4 = ip;
-
     pico_stack_init();
-    fail_unless(pico_arp_add_entry(&entry) == 0);
-    entry.arp_status = PICO_ARP_STATUS_STALE;
-    eth = pico_arp_lookup(&ip);
-    fail_unless(eth == NULL);
-    pico_tree_delete(&arp_tree, &entry);
+    fail_unless(pico_arp_create_entry(mac, ip, NULL) == 0);
+    entry = arp_find(NULL, ip.addr);
+    fail_unless(pico_arp_lookup(&ip) == &entry->hwaddr.mac);
+
+    /* stale entries stay usable, unresolved ones are not */
+    entry->state = PICO_ARP_STATUS_STALE;
+    fail_unless(pico_arp_lookup(&ip) == &entry->hwaddr.mac);
+    entry->state = PICO_ARP_STATUS_INCOMPLETE;
+    fail_unless(pico_arp_lookup(&ip) == NULL);
+    pico_neighbor_del(entry);
 }
 END_TEST
 
 START_TEST (arp_expire_test)
 {
-    struct pico_arp entry;
-    entry.arp_status = PICO_ARP_STATUS_REACHABLE;
-    entry.timestamp = 0;
+    struct pico_ip4 ip = {
+        .addr = long_be(0x0A000101)
+    };
+    uint8_t mac[6] = {
+        0, 0, 0, 0xa, 0xb, 0xd
+    };
+    struct pico_neighbor *entry;
+
+    pico_stack_init();
+    fail_unless(pico_arp_create_entry(mac, ip, NULL) == 0);
+    entry = arp_find(NULL, ip.addr);
+    entry->confirmed = 0;
+
+    pico_timer_cancel(entry->timer);
+    neigh_timer(PICO_ARP_TIMEOUT, entry);
+    fail_unless(entry->state == PICO_ARP_STATUS_STALE);
+    fail_unless(entry->timer != 0);
 
-    arp_expire(PICO_ARP_TIMEOUT, &entry);
-    fail_unless(entry.arp_status == PICO_ARP_STATUS_STALE);
+    /* not used while stale: collected */
+    pico_timer_cancel(entry->timer);
+    neigh_timer(2 * PICO_ARP_TIMEOUT, entry);
+    fail_unless(arp_find(NULL, ip.addr) == NULL);
 }
 END_TEST
 
+static struct pico_frame *arp_ip_frame(struct pico_device *dev, struct pico_ip4 *dst)
+{
+    struct pico_frame *f = pico_frame_alloc(PICO_SIZE_ETHHDR + sizeof(struct pico_ipv4_hdr));
+    struct pico_ipv4_hdr *h;
+
+    fail_if(!f);
+    f->net_hdr = f->buffer + PICO_SIZE_ETHHDR;
+    f->dev = dev;
+    h = (struct pico_ipv4_hdr *) f->net_hdr;
+    h->vhl = 0x45;
+    h->dst.addr = dst->addr;
+    return f;
+}
+
 START_TEST(tc_pico_arp_queue)
 {
-    struct pico_ip4 addr = {
-        .addr = 0xaabbccdd
+    struct mock_device *mock;
+    uint8_t macaddr[6] = {
+        0, 0, 0xa, 0xa, 0xb, 0xe
     };
+    uint8_t peer[6] = {
+        0, 0, 0xa, 0xa, 0xb, 0x1
+    };
+    struct pico_ip4 netmask = {
+        .addr = long_be(0xffffff00)
+    };
+    struct pico_ip4 ip = {
+        .addr = long_be(0x0A29000B)
+    };
+    struct pico_ip4 dst = {
+        .addr = long_be(0x0A290021)
+    };
+    struct pico_ip4 dst2 = {
+        .addr = long_be(0x0A290022)
+    };
+    struct pico_neighbor *a;
+    struct pico_frame *f;
     int i;
-    struct pico_frame *f = pico_frame_alloc(sizeof(struct pico_ipv4_hdr));
-    struct pico_ipv4_hdr *h = (struct pico_ipv4_hdr *) f->buffer;
-    fail_if(!f);
-    f->net_hdr = (uint8_t *)h;
-    h->dst.addr = addr.addr;
 
-    for (i = 0; i < PICO_ND_MAX_FRAMES_QUEUED; i++) {
-        fail_if(frames_queued[i] != NULL);
-    }
-    pico_arp_unreachable(&addr);
-    for (i = 0; i < PICO_ND_MAX_FRAMES_QUEUED; i++) {
-        fail_if(frames_queued[i] != NULL);
+    pico_stack_init();
+    mock = pico_mock_create(macaddr);
+    fail_if(!mock, "MOCK DEVICE creation failed");
+    fail_if(pico_ipv4_link_add(mock->dev, ip, netmask), "add link to mock device failed");
+
+    /* a burst to an unresolved neighbour: one request, frames parked on it */
+    for (i = 0; i < PICO_ARP_MAX_PENDING + 3; i++) {
+        f = arp_ip_frame(mock->dev, &dst);
+        fail_unless(pico_arp_get(f) == NULL);
+        pico_arp_postpone(f);
     }
+    a = arp_find(mock->dev, dst.addr);
+    fail_if(!a);
+    fail_unless(a->state == PICO_ARP_STATUS_INCOMPLETE);
+    fail_unless(a->probes == 1);
+    fail_unless(a->pending.frames == PICO_ARP_MAX_PENDING);
+
+    /* a second neighbour keeps its own queue */
+    f = arp_ip_frame(mock->dev, &dst2);
+    fail_unless(pico_arp_get(f) == NULL);
     pico_arp_postpone(f);
-    fail_if(frames_queued[0]->buffer != f->buffer);
-    pico_arp_unreachable(&addr);
-    PICO_FREE(f);
+    fail_unless(a->pending.frames == PICO_ARP_MAX_PENDING);
+
+    /* resolving the first flushes only its own queue */
+    fail_unless(pico_arp_create_entry(peer, dst, mock->dev) == 0);
+    fail_unless(a->state == PICO_ARP_STATUS_REACHABLE);
+    fail_unless(a->pending.frames == 0);
+    fail_unless(arp_find(mock->dev, dst2.addr)->pending.frames == 1);
+    f = arp_ip_frame(mock->dev, &dst);
+    fail_unless(pico_arp_get(f) == &a->hwaddr.mac);
+    pico_frame_discard(f);
+
+    /* the second never answers */
+    a = arp_find(mock->dev, dst2.addr);
+    for (i = 0; i < PICO_ARP_MAX_REQUESTS; i++) {
+        pico_timer_cancel(a->timer);
+        neigh_timer(PICO_TIME_MS(), a);
+    }
+    fail_unless(arp_find(mock->dev, dst2.addr) == NULL);
+
+    /* stale entry is used while it is probed */
+    a = arp_find(mock->dev, dst.addr);
+    a->state = PICO_ARP_STATUS_STALE;
+    f = arp_ip_frame(mock->dev, &dst);
+    fail_unless(pico_arp_get(f) == &a->hwaddr.mac);
+    fail_unless(a->state == PICO_ARP_STATUS_PROBE);
+    fail_unless(pico_arp_get(f) == &a->hwaddr.mac);
+    for (i = 0; i < PICO_ARP_MAX_REQUESTS; i++) {
+        pico_timer_cancel(a->timer);
+        neigh_timer(PICO_TIME_MS(), a);
+    }
+    fail_unless(arp_find(mock->dev, dst.addr) == NULL);
+    fail_unless(pico_arp_get(f) == NULL);
+    pico_frame_discard(f);
+    pico_neighbor_del(arp_find(mock->dev, dst.addr));
+    pico_ipv4_link_del(mock->dev, ip);
 }
 END_TEST
 
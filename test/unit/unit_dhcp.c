@@ -317,19 +317,19 @@ START_TEST (test_dhcp_server_ipinarp)
 {
 /************************************************************************
  * Check if dhcp recv works correctly if
- *     MAC address of client is allready in arp table
+ *     the client already has a lease
  * Status : Done
  *************************************************************************/
     struct mock_device*mock;
     struct pico_dhcp_server_setting s = {
         0
     };
-    struct pico_ip4 ipv4address = {
-        .addr = long_be(0x0a280067)
-    };
     struct pico_ip4 xid = {
         .addr = long_be(0x00003d1d)
     };
+    struct pico_ip4 xid2 = {
+        .addr = long_be(0x00003d1e)
+    };
     struct pico_ip4 netmask = {
         .addr = long_be(0xffffff00)
     };
@@ -337,7 +337,9 @@ START_TEST (test_dhcp_server_ipinarp)
         .addr = long_be(0x0A28000A)
     };
     struct pico_socket sock = { };
-    struct pico_ip4 *stored_ipv4 = NULL;
+    struct pico_ip4 leased = {
+        0
+    };
     struct pico_dhcp_server_negotiation *dn = NULL;
     struct pico_eth *arp_resp = NULL;
     unsigned char macaddr1[6] = {
@@ -363,29 +365,129 @@ START_TEST (test_dhcp_server_ipinarp)
 
     /*Initiate test setup*/
     pico_stack_init();
-    pico_arp_create_entry(&(macaddr1[0]), ipv4address, s.dev);
 
     fail_if(pico_dhcp_server_initiate(&s), "DHCP_SERVER> server initiation failed");
 
     /* simulate reception of a DISCOVER packet */
     sock.local_addr.ip4 = serverip;
     pico_dhcp_server_recv(&sock, buf, len);
-
-    /* check if negotiation data is stored */
     dn = pico_dhcp_server_find_negotiation(xid.addr);
     fail_if(dn == NULL, "DCHP SERVER -> no negotiation stored after discover msg recvd");
+    leased = dn->ciaddr;
 
-    /* check if new ip is in ARP cache */
-    stored_ipv4 = pico_arp_reverse_lookup(&dn->hwaddr);
-    fail_if(stored_ipv4 == NULL, "DCHP SERVER -> new address is not inserted in ARP");
-    fail_unless(stored_ipv4->addr == dn->ciaddr.addr, "DCHP SERVER -> new ip not stored in negotiation data");
+    /* same client, new transaction */
+    memcpy(&(buf[4]), &(xid2.addr), sizeof(struct pico_ip4));
+    pico_dhcp_server_recv(&sock, buf, len);
+    fail_unless(pico_dhcp_server_find_negotiation(xid2.addr) == dn, "DCHP SERVER -> lease not found for known client");
+    fail_unless(pico_dhcp_server_find_negotiation(xid.addr) == NULL, "DCHP SERVER -> old transaction still indexed");
+    fail_unless(dn->ciaddr.addr == leased.addr, "DCHP SERVER -> known client got a new address");
 
-    /* check if new ip is in ARP cache */
-    arp_resp = pico_arp_lookup(&ipv4address);
+    /* check if the address is in arp cache */
+    arp_resp = pico_arp_lookup(&leased);
     fail_if(arp_resp == NULL, "DCHP SERVER -> address unavailable in arp cache");
 }
 END_TEST
 
+START_TEST (test_dhcp_server_leases)
+{
+/************************************************************************
+ * Check the lease database: pool exhaustion, release, expiry and
+ *     restoring a snapshot after a restart
+ * Status : Done
+ *************************************************************************/
+    struct mock_device*mock;
+    struct pico_dhcp_server_setting s = {
+        0
+    };
+    struct pico_ip4 netmask = {
+        .addr = long_be(0xffffff00)
+    };
+    struct pico_ip4 serverip = {
+        .addr = long_be(0x0A29000A)
+    };
+    struct pico_socket sock = { };
+    struct pico_dhcp_server_negotiation *dn = NULL;
+    unsigned char macaddr1[6] = {
+        0xc2, 0, 0, 0xa, 0xb, 0xf
+    };
+    uint8_t snapshot[64];
+    uint32_t len = 0, i, xid;
+    int size;
+    uint8_t buf[600] = {
+        0
+    };
+
+    printf("*********************** starting %s * \n", __func__);
+
+    mock = pico_mock_create(macaddr1);
+    fail_if(!mock, "MOCK DEVICE creation failed");
+    fail_if(pico_ipv4_link_add(mock->dev, serverip, netmask), "add link to mock device failed");
+    pico_stack_init();
+
+    /* three addresses, the server's own included */
+    s.server_ip = serverip;
+    s.pool_start = long_be(0x0A290009);
+    s.pool_end = long_be(0x0A29000B);
+    fail_if(pico_dhcp_server_initiate(&s), "DHCP_SERVER> server initiation failed");
+    sock.local_addr.ip4 = serverip;
+
+    fail_if(generate_dhcp_msg(buf, &len, DHCP_MSG_TYPE_DISCOVER), "DHCP_SERVER->failed to generate buffer");
+    for (i = 0; i < 3; i++) {
+        xid = long_be(0x1000u + i);
+        memcpy(&(buf[4]), &xid, sizeof(xid));
+        buf[33] = (uint8_t)i;
+        pico_dhcp_server_recv(&sock, buf, len);
+    }
+    fail_if(pico_dhcp_server_find_negotiation(long_be(0x1000u)) == NULL, "DHCP_SERVER> no lease for first client");
+    fail_if(pico_dhcp_server_find_negotiation(long_be(0x1001u)) == NULL, "DHCP_SERVER> no lease for second client");
+    fail_unless(pico_dhcp_server_find_negotiation(long_be(0x1002u)) == NULL, "DHCP_SERVER> lease beyond the pool");
+
+    /* released address goes to the waiting client */
+    dn = pico_dhcp_server_find_negotiation(long_be(0x1000u));
+    xid = long_be(0x1000u);
+    memcpy(&(buf[4]), &xid, sizeof(xid));
+    memcpy(&(buf[12]), &dn->ciaddr.addr, sizeof(uint32_t));
+    buf[33] = 0;
+    buf[0xF2] = PICO_DHCP_MSG_RELEASE;
+    pico_dhcp_server_recv(&sock, buf, len);
+    fail_unless(pico_dhcp_server_find_negotiation(long_be(0x1000u)) == NULL, "DHCP_SERVER> lease not released");
+    memset(&(buf[12]), 0, sizeof(uint32_t));
+    buf[0xF2] = PICO_DHCP_MSG_DISCOVER;
+    xid = long_be(0x1002u);
+    memcpy(&(buf[4]), &xid, sizeof(xid));
+    buf[33] = 2;
+    pico_dhcp_server_recv(&sock, buf, len);
+    dn = pico_dhcp_server_find_negotiation(long_be(0x1002u));
+    fail_if(dn == NULL, "DHCP_SERVER> released address not reused");
+
+    /* snapshot of the bound lease survives a restart */
+    dn->state = PICO_DHCP_STATE_BOUND;
+    size = pico_dhcp_server_leases_save(mock->dev, NULL, 0);
+    fail_unless(size == 8 + 16, "DHCP_SERVER> wrong snapshot size %d", size);
+    fail_unless(pico_dhcp_server_leases_save(mock->dev, snapshot, 8) < 0, "DHCP_SERVER> snapshot overflow");
+    fail_unless(pico_dhcp_server_leases_save(mock->dev, snapshot, sizeof(snapshot)) == size, "DHCP_SERVER> snapshot failed");
+    fail_if(pico_dhcp_server_destroy(mock->dev), "DHCP_SERVER> destroy failed");
+    fail_unless(pico_dhcp_server_find_negotiation(long_be(0x1002u)) == NULL, "DHCP_SERVER> leases left after destroy");
+    fail_if(pico_dhcp_server_initiate(&s), "DHCP_SERVER> server initiation failed");
+    fail_unless(pico_dhcp_server_leases_restore(mock->dev, snapshot, (uint32_t)size) == 1, "DHCP_SERVER> snapshot not restored");
+    fail_unless(pico_dhcp_server_leases_restore(mock->dev, buf, (uint32_t)size) < 0, "DHCP_SERVER> garbage restored");
+
+    /* the restored client gets its address back */
+    memcpy(&(buf[4]), &xid, sizeof(xid));
+    buf[0xF2] = PICO_DHCP_MSG_DISCOVER;
+    pico_dhcp_server_recv(&sock, buf, len);
+    dn = pico_dhcp_server_find_negotiation(xid);
+    fail_if(dn == NULL, "DHCP_SERVER> restored lease not found");
+    fail_unless(dn->state == PICO_DHCP_STATE_OFFER, "DHCP_SERVER> restored lease not offered");
+
+    /* expiry gives the address back to the pool */
+    pico_timer_cancel(dhcps_timer);
+    dhcps_expiry_tick(dn->expire + 1, NULL);
+    fail_unless(pico_dhcp_server_find_negotiation(xid) == NULL, "DHCP_SERVER> lease did not expire");
+    fail_if(pico_dhcp_server_destroy(mock->dev), "DHCP_SERVER> destroy failed");
+}
+END_TEST
+
 #if 0
 START_TEST (test_dhcp_client)
 {
@@ -252,6 +252,92 @@ START_TEST (test_nat_port_forwarding)
 }
 END_TEST
 
+START_TEST (test_nat_expiry)
+{
+    struct pico_ipv4_link link = {
+        .address = {.addr = long_be(0x0a320001)}
+    };                                                                       /* 10.50.0.1 */
+    struct pico_frame *f = pico_ipv4_alloc(&pico_proto_ipv4, NULL, PICO_SIZE_TCPHDR);
+    struct pico_ipv4_hdr *net = (struct pico_ipv4_hdr *)f->net_hdr;
+    struct pico_tcp_hdr *tcp = (struct pico_tcp_hdr *)f->transport_hdr;
+    struct pico_ip4 src_ori = {
+        .addr = long_be(0x0a280008)
+    };                                                      /* 10.40.0.8 */
+    struct pico_ip4 dst_ori = {
+        .addr = long_be(0x0a320009)
+    };                                                      /* 10.50.0.9 */
+    uint16_t sport_ori = short_be(5555);
+    uint16_t nat_port = 0, nat_port2 = 0;
+    struct pico_nat_tuple *t;
+
+    net->vhl = 0x45;
+    net->len = short_be(40);
+    net->ttl = 64;
+    net->proto = PICO_PROTO_TCP;
+    net->src = src_ori;
+    net->dst = dst_ori;
+    tcp->trans.sport = sport_ori;
+    tcp->trans.dport = short_be(80);
+    tcp->len = PICO_SIZE_TCPHDR << 2;
+    tcp->flags = PICO_TCP_SYN;
+
+    printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> NAT EXPIRY TEST\n");
+    pico_stack_init();
+    fail_if(pico_ipv4_nat_enable(&link));
+
+    /* SYN creates an entry with the short embryonic timeout */
+    fail_if(pico_ipv4_nat_outbound(f, &nat_link->address));
+    nat_port = tcp->trans.sport;
+    t = pico_ipv4_nat_find_tuple(nat_port, NULL, 0, PICO_PROTO_TCP);
+    fail_unless(t != NULL);
+    fail_unless(t->tcp_state == PICO_NAT_TCP_SYN);
+    fail_unless(t->expire == pico_tick + PICO_NAT_TIMEOUT_TCP_SYN);
+
+    /* Reply moves the connection to established, lifetime is extended */
+    net->src = dst_ori;
+    net->dst = link.address;
+    tcp->trans.sport = short_be(80);
+    tcp->trans.dport = nat_port;
+    tcp->flags = PICO_TCP_SYN | PICO_TCP_ACK;
+    fail_if(pico_ipv4_nat_inbound(f, &nat_link->address));
+    fail_unless(t->tcp_state == PICO_NAT_TCP_ESTABLISHED);
+    fail_unless(t->expire == pico_tick + PICO_NAT_TIMEOUT_TCP_EST);
+
+    /* Wheel ticks well before expiry keep the entry */
+    pico_tick += PICO_NAT_TIMEOUT_TCP_SYN + PICO_NAT_WHEEL_TICK;
+    pico_ipv4_nat_table_cleanup(pico_tick, NULL);
+    fail_unless(pico_ipv4_nat_find(nat_port, NULL, 0, PICO_PROTO_TCP));
+
+    /* RST shortens the lifetime, entry is reaped on the next pass over its bucket */
+    net->dst = link.address;
+    tcp->trans.dport = nat_port;
+    tcp->flags = PICO_TCP_RST;
+    fail_if(pico_ipv4_nat_inbound(f, &nat_link->address));
+    fail_unless(t->tcp_state == PICO_NAT_TCP_CLOSED);
+    pico_ipv4_nat_table_cleanup(pico_tick + PICO_NAT_TIMEOUT_TCP_CLOSED + 2 * PICO_NAT_WHEEL_TICK, NULL);
+    fail_if(pico_ipv4_nat_find(nat_port, NULL, 0, PICO_PROTO_TCP));
+    fail_if(pico_ipv4_nat_find(0, &src_ori, sport_ori, PICO_PROTO_TCP));
+
+    /* Public ports are handed out sequentially */
+    net->src = src_ori;
+    net->dst = dst_ori;
+    tcp->trans.sport = sport_ori;
+    tcp->trans.dport = short_be(80);
+    tcp->flags = PICO_TCP_SYN;
+    fail_if(pico_ipv4_nat_outbound(f, &nat_link->address));
+    nat_port = tcp->trans.sport;
+    net->src = src_ori;
+    tcp->trans.sport = short_be(5556);
+    fail_if(pico_ipv4_nat_outbound(f, &nat_link->address));
+    nat_port2 = tcp->trans.sport;
+    fail_if(nat_port == nat_port2);
+    fail_unless((short_be(nat_port2) == short_be(nat_port) + 1) || (short_be(nat_port2) == PICO_NAT_PORT_MIN));
+
+    fail_if(pico_ipv4_nat_disable());
+    pico_frame_discard(f);
+}
+END_TEST
+
 START_TEST (test_ipfilter)
 {
     struct pico_device *dev = NULL;
@@ -814,6 +900,186 @@ START_TEST (test_igmp_sockopts)
     fail_if(ret < 0, "socket close failed: %s\n", strerror(pico_err));
 }
 END_TEST
+
+static struct pico_frame *mcast_fanout_frame(struct pico_device *dev, uint32_t src, uint32_t dst, uint16_t port)
+{
+    struct pico_frame *f = pico_frame_alloc(PICO_SIZE_IP4HDR + PICO_UDPHDR_SIZE + 4);
+    struct pico_ipv4_hdr *hdr;
+    struct pico_udp_hdr *udp;
+
+    fail_if(!f, "frame alloc failed");
+    f->net_hdr = f->buffer;
+    f->net_len = PICO_SIZE_IP4HDR;
+    f->transport_hdr = f->buffer + PICO_SIZE_IP4HDR;
+    f->transport_len = PICO_UDPHDR_SIZE + 4;
+    f->dev = dev;
+    hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+    hdr->vhl = 0x45;
+    hdr->proto = PICO_PROTO_UDP;
+    hdr->src.addr = src;
+    hdr->dst.addr = dst;
+    udp = (struct pico_udp_hdr *)f->transport_hdr;
+    udp->trans.sport = short_be(1234);
+    udp->trans.dport = port;
+    return f;
+}
+
+START_TEST (test_mcast_fanout)
+{
+    struct pico_device *dev;
+    struct pico_socket *s[3];
+    struct pico_ip4 link[3], netmask, group, other, src, stranger;
+    struct pico_ip_mreq mreq;
+    struct pico_ip_mreq_source mreq_source;
+    struct pico_frame *f, *q[3];
+    uint16_t port = short_be(5500);
+    char addr[16];
+    int i, j, ret;
+
+    pico_stack_init();
+    dev = pico_null_create("fanout0");
+    netmask.addr = long_be(0xFFFF0000);
+    pico_string_to_ipv4("232.1.2.3", &group.addr);
+    pico_string_to_ipv4("232.1.2.4", &other.addr);
+    pico_string_to_ipv4("10.40.9.9", &src.addr);
+    pico_string_to_ipv4("10.40.9.10", &stranger.addr);
+
+    /* one socket per local address, all on the same port */
+    for (i = 0; i < 3; i++) {
+        snprintf(addr, sizeof(addr), "10.40.0.%d", i + 1);
+        pico_string_to_ipv4(addr, &link[i].addr);
+        ret = pico_ipv4_link_add(dev, link[i], netmask);
+        fail_if(ret < 0, "link add failed");
+        s[i] = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_UDP, NULL);
+        fail_if(!s[i], "socket open failed");
+        ret = pico_socket_bind(s[i], &link[i], &port);
+        fail_if(ret < 0, "bind failed");
+    }
+
+    /* s0 and s1 join, s2 only listens to another source */
+    for (i = 0; i < 2; i++) {
+        mreq.mcast_group_addr.ip4 = group;
+        mreq.mcast_link_addr.ip4 = link[i];
+        ret = pico_socket_setoption(s[i], PICO_IP_ADD_MEMBERSHIP, &mreq);
+        fail_if(ret < 0, "ADD_MEMBERSHIP failed");
+    }
+    mreq_source.mcast_group_addr.ip4 = group;
+    mreq_source.mcast_link_addr.ip4 = link[2];
+    mreq_source.mcast_source_addr.ip4 = stranger;
+    ret = pico_socket_setoption(s[2], PICO_IP_ADD_SOURCE_MEMBERSHIP, &mreq_source);
+    fail_if(ret < 0, "ADD_SOURCE_MEMBERSHIP failed");
+
+    f = mcast_fanout_frame(dev, src.addr, group.addr, port);
+    ret = pico_socket_udp_deliver(pico_get_sockport(PICO_PROTO_UDP, port), f);
+    fail_if(ret < 0, "deliver failed");
+    for (i = 0; i < 3; i++)
+        q[i] = pico_dequeue(&s[i]->q_in);
+    fail_if(!q[0] || !q[1], "member did not receive the datagram");
+    fail_if(q[2] != NULL, "source filter not applied");
+    fail_if(q[0]->buffer != q[1]->buffer, "fan-out copied the payload");
+    fail_if(*q[0]->usage_count != 2, "shared buffer not refcounted");
+    pico_frame_discard(q[0]);
+    pico_frame_discard(q[1]);
+
+    /* the included source reaches s2 as well, a group without members nobody */
+    f = mcast_fanout_frame(dev, stranger.addr, group.addr, port);
+    pico_socket_udp_deliver(pico_get_sockport(PICO_PROTO_UDP, port), f);
+    for (i = 0; i < 3; i++) {
+        fail_if(s[i]->q_in.frames != 1, "included source not delivered");
+        pico_frame_discard(pico_dequeue(&s[i]->q_in));
+    }
+    f = mcast_fanout_frame(dev, src.addr, other.addr, port);
+    pico_socket_udp_deliver(pico_get_sockport(PICO_PROTO_UDP, port), f);
+    for (i = 0; i < 3; i++)
+        fail_if(s[i]->q_in.frames != 0, "datagram for a foreign group delivered");
+
+    /* many groups on one socket, all unlinked from the index on close */
+    for (j = 0; j < 64; j++) {
+        mreq.mcast_group_addr.ip4.addr = long_be(0xE8010000u + (uint32_t)j);
+        mreq.mcast_link_addr.ip4 = link[0];
+        ret = pico_socket_setoption(s[0], PICO_IP_ADD_MEMBERSHIP, &mreq);
+        fail_if(ret < 0, "ADD_MEMBERSHIP failed");
+    }
+    for (i = 0; i < 3; i++)
+        pico_socket_close(s[i]);
+    for (j = 0; j < PICO_MCAST_INDEX_SIZE; j++)
+        fail_if(mcast_index[j] != NULL, "index not empty after close");
+}
+END_TEST
+
+static struct pico_socket *mcast_wake_socks[3];
+static int mcast_wake_calls;
+static int mcast_wake_close;
+
+static void mcast_wakeup(uint16_t ev, struct pico_socket *s)
+{
+    int i;
+
+    fail_if(ev != PICO_SOCK_EV_RD, "unexpected event");
+    fail_if(s->q_in.frames != 1, "woken before the datagram was queued");
+    mcast_wake_calls++;
+    if (!mcast_wake_close)
+        return;
+
+    /* closes every member, the ones not yet woken included */
+    for (i = 0; i < 3; i++)
+        pico_socket_close(mcast_wake_socks[i]);
+}
+
+START_TEST (test_mcast_fanout_close)
+{
+    struct pico_device *dev;
+    struct pico_ip4 link, netmask, group, src;
+    struct pico_ip_mreq mreq;
+    struct pico_frame *f;
+    uint16_t port = short_be(5501);
+    char addr[16];
+    int i, j, ret;
+
+    pico_stack_init();
+    dev = pico_null_create("fanout1");
+    netmask.addr = long_be(0xFFFF0000);
+    pico_string_to_ipv4("232.1.2.5", &group.addr);
+    pico_string_to_ipv4("10.41.9.9", &src.addr);
+    for (i = 0; i < 3; i++) {
+        snprintf(addr, sizeof(addr), "10.41.0.%d", i + 1);
+        pico_string_to_ipv4(addr, &link.addr);
+        ret = pico_ipv4_link_add(dev, link, netmask);
+        fail_if(ret < 0, "link add failed");
+        mcast_wake_socks[i] = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_UDP, mcast_wakeup);
+        fail_if(!mcast_wake_socks[i], "socket open failed");
+        ret = pico_socket_bind(mcast_wake_socks[i], &link, &port);
+        fail_if(ret < 0, "bind failed");
+        mreq.mcast_group_addr.ip4 = group;
+        mreq.mcast_link_addr.ip4 = link;
+        ret = pico_socket_setoption(mcast_wake_socks[i], PICO_IP_ADD_MEMBERSHIP, &mreq);
+        fail_if(ret < 0, "ADD_MEMBERSHIP failed");
+    }
+
+    /* one wakeup per member, once everyone has the datagram */
+    mcast_wake_calls = 0;
+    mcast_wake_close = 0;
+    f = mcast_fanout_frame(dev, src.addr, group.addr, port);
+    ret = pico_socket_udp_deliver(pico_get_sockport(PICO_PROTO_UDP, port), f);
+    fail_if(ret < 0, "deliver failed");
+    fail_if(mcast_wake_calls != 3, "members not woken once each");
+    for (i = 0; i < 3; i++) {
+        fail_if(mcast_wake_socks[i]->ev_pending != 0, "wakeup left pending");
+        pico_frame_discard(pico_dequeue(&mcast_wake_socks[i]->q_in));
+    }
+
+    /* the first callback closes all members: the fan-out must not touch them again */
+    mcast_wake_calls = 0;
+    mcast_wake_close = 1;
+    f = mcast_fanout_frame(dev, src.addr, group.addr, port);
+    ret = pico_socket_udp_deliver(pico_get_sockport(PICO_PROTO_UDP, port), f);
+    fail_if(ret < 0, "deliver failed");
+    fail_if(mcast_wake_calls != 1, "closed member woken");
+    fail_if(pico_get_sockport(PICO_PROTO_UDP, port) != NULL, "sockport left behind");
+    for (j = 0; j < PICO_MCAST_INDEX_SIZE; j++)
+        fail_if(mcast_index[j] != NULL, "index not empty after close");
+}
+END_TEST
 #endif
 
 START_TEST (test_slaacv4)
@@ -312,6 +312,31 @@ START_TEST (test_ipv6)
 }
 END_TEST
 
+START_TEST (test_ipv6_exthdr_bounds)
+{
+    struct pico_frame *f = pico_frame_alloc(48);
+    struct pico_ipv6_hdr *hdr;
+
+    fail_if(!f);
+    memset(f->buffer, 0, 48);
+    f->net_hdr = f->buffer;
+    hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+    hdr->vtf = long_be(0x60000000);
+    hdr->len = short_be(8);
+    hdr->nxthdr = PICO_IPV6_EXTHDR_HOPBYHOP;
+    f->net_hdr[40] = PICO_IPV6_EXTHDR_NONE;
+
+    /* 8 byte hop-by-hop header, then nothing */
+    fail_if(pico_ipv6_check_headers_sequence(f) != 0);
+
+    /* Hop-by-hop header claiming more than the payload */
+    f->net_hdr[41] = 0x20;
+    fail_if(pico_ipv6_check_headers_sequence(f) != -1);
+
+    pico_frame_discard(f);
+}
+END_TEST
+
 #ifdef PICO_SUPPORT_MCAST
 START_TEST (test_mld_sockopts)
 {
@@ -7,6 +7,7 @@
 #include "pico_mm.c"
 #include "pico_tree.c"
 #include <check.h>
+#include <time.h>
 
 volatile pico_err_t pico_err;
 
@@ -1486,18 +1487,18 @@ START_TEST (test_free)
 
     /* Free the slab block and check it */
     ck_assert(page0->slabs_free == page0->slabs_max - 1);
-    pico_mem_free(slab_block1 + 1);
+    _pico_mem_free(slab_block1 + 1);
     ck_assert(page0->slabs_free == page0->slabs_max);
 
     /* Free heap block 1 and check it */
-    pico_mem_free(block1 + 1);
+    _pico_mem_free(block1 + 1);
     ck_assert(block1->type == HEAP_BLOCK_TYPE);
     ck_assert(block1->internals.heap_block.free == HEAP_BLOCK_FREE);
     ck_assert(block1->internals.heap_block.size != size);
     ck_assert(block2->internals.heap_block.free == HEAP_BLOCK_NOT_FREE);
 
     /* Free heap block 2 and check it */
-    pico_mem_free(block2 + 1);
+    _pico_mem_free(block2 + 1);
     ck_assert(block2->type == HEAP_BLOCK_TYPE);
     ck_assert(block2->internals.heap_block.free == HEAP_BLOCK_FREE);
     ck_assert(block2->internals.heap_block.size != size);
@@ -1647,7 +1648,7 @@ START_TEST (test_zalloc)
 
     /* Scenario 0, part 1: manager = NULL */
     printf("SCENARIO 0\n");
-    byteptr = pico_mem_zalloc(PICO_MEM_DEFAULT_SLAB_SIZE);
+    byteptr = _pico_mem_zalloc(PICO_MEM_DEFAULT_SLAB_SIZE);
     ck_assert(byteptr == NULL);
 
     manager = pico_zalloc(PICO_MEM_PAGE_SIZE);
@@ -1718,32 +1719,32 @@ START_TEST (test_zalloc)
     manager_tree_insert(&manager->tree, slab_node1);
 
     /* Scenario 0, part 2: len>PICO_MAX_SLAB_SIZE */
-    byteptr = pico_mem_zalloc(PICO_MAX_SLAB_SIZE + 1);
+    byteptr = _pico_mem_zalloc(PICO_MAX_SLAB_SIZE + 1);
     ck_assert(byteptr == NULL);
     /* Scenario 1: Ask for an existing slab block */
     printf("SCENARIO 1\n");
-    byteptr = pico_mem_zalloc(PICO_MEM_DEFAULT_SLAB_SIZE);
+    byteptr = _pico_mem_zalloc(PICO_MEM_DEFAULT_SLAB_SIZE);
     ck_assert(byteptr == (uint8_t*) (slab_block + 1));
     /* Scenario 2: Ask for another slab block; a new page can be created */
     printf("SCENARIO 2\n");
-    byteptr = pico_mem_zalloc(PICO_MEM_DEFAULT_SLAB_SIZE);
+    byteptr = _pico_mem_zalloc(PICO_MEM_DEFAULT_SLAB_SIZE);
     ck_assert(manager->used_size == 3 * PICO_MEM_PAGE_SIZE);
     page1 = manager->first_page;
     ck_assert(page1->next_page == page0);
     ck_assert((uint8_t*) page1 < byteptr);
     ck_assert(byteptr < ((uint8_t*) page1) + PICO_MEM_PAGE_SIZE);
     /* Setup for scenario 3: */
-    pico_mem_zalloc(PICO_MEM_DEFAULT_SLAB_SIZE);
+    _pico_mem_zalloc(PICO_MEM_DEFAULT_SLAB_SIZE);
     /* Scenario 3: Ask for another slab block: no new page can be created, NULL should be returned */
     printf("SCENARIO 3\n");
-    byteptr = pico_mem_zalloc(PICO_MEM_DEFAULT_SLAB_SIZE);
+    byteptr = _pico_mem_zalloc(PICO_MEM_DEFAULT_SLAB_SIZE);
     ck_assert(byteptr == NULL);
     ck_assert(manager->used_size == 3 * PICO_MEM_PAGE_SIZE);
     /* Scenario 4: Ask for an existing heap block */
     printf("SCENARIO 4\n");
-    byteptr = pico_mem_zalloc(page1->heap_max_free_space);
+    byteptr = _pico_mem_zalloc(page1->heap_max_free_space);
     /* TODO: Why? */
-    /* byteptr = pico_mem_zalloc(page1->heap_max_free_space%4); */
+    /* byteptr = _pico_mem_zalloc(page1->heap_max_free_space%4); */
     ck_assert(page1->heap_max_free_space == 0);
     ck_assert((uint8_t*) page1 < byteptr);
     ck_assert(byteptr < ((uint8_t*) page1) + PICO_MEM_PAGE_SIZE);
@@ -1751,9 +1752,9 @@ START_TEST (test_zalloc)
     manager->size += PICO_MEM_PAGE_SIZE;
     /* Scenario 5; Ask for a heap block: none are available but a new page can be created */
     printf("SCENARIO 5\n");
-    byteptr = pico_mem_zalloc(page1->heap_max_size);
+    byteptr = _pico_mem_zalloc(page1->heap_max_size);
     /* TODO: Why? */
-    /* byteptr = pico_mem_zalloc(page1->heap_max_size%4); */
+    /* byteptr = _pico_mem_zalloc(page1->heap_max_size%4); */
     ck_assert(manager->used_size == 4 * PICO_MEM_PAGE_SIZE);
     page2 = manager->first_page;
     ck_assert(page2->next_page == page1);
@@ -1762,29 +1763,29 @@ START_TEST (test_zalloc)
     ck_assert(byteptr < ((uint8_t*) page2) + PICO_MEM_PAGE_SIZE);
     /* Scenario 6: Ask for a heap block: none are available and no new page can be created, but a slab block is available */
     printf("SCENARIO 6\n");
-    byteptr = pico_mem_zalloc(page1->heap_max_size);
+    byteptr = _pico_mem_zalloc(page1->heap_max_size);
     ck_assert((uint8_t*) page2 < byteptr);
     ck_assert(byteptr < ((uint8_t*) page2) + PICO_MEM_PAGE_SIZE);
     /* Scenario 7: A new page with a new slabsize must be created */
     printf("SCENARIO 7\n");
     manager->size += 3 * PICO_MEM_PAGE_SIZE;
-    byteptr = pico_mem_zalloc(slabsize);
+    byteptr = _pico_mem_zalloc(slabsize);
     block = (struct pico_mem_block*) (byteptr - sizeof(struct pico_mem_block));
     ck_assert(block->internals.slab_block.page->slab_size == PICO_MEM_DEFAULT_SLAB_SIZE);
-    byteptr = pico_mem_zalloc(slabsize);
+    byteptr = _pico_mem_zalloc(slabsize);
     block = (struct pico_mem_block*) (byteptr - sizeof(struct pico_mem_block));
     ck_assert(block->internals.slab_block.page->slab_size == PICO_MEM_DEFAULT_SLAB_SIZE);
-    byteptr = pico_mem_zalloc(slabsize);
+    byteptr = _pico_mem_zalloc(slabsize);
     block = (struct pico_mem_block*) (byteptr - sizeof(struct pico_mem_block));
     ck_assert(block->internals.slab_block.page->slab_size == PICO_MEM_DEFAULT_SLAB_SIZE);
     /* At this point, a new page should be created with the correct size */
-    byteptr = pico_mem_zalloc(slabsize);
+    byteptr = _pico_mem_zalloc(slabsize);
     block = (struct pico_mem_block*) (byteptr - sizeof(struct pico_mem_block));
     ck_assert(block->internals.slab_block.page->slab_size < PICO_MEM_DEFAULT_SLAB_SIZE);
     /* Scenario 8: A request for a heap block of less than PICO_MEM_MINIMUM_OBJECT_SIZE will have its size enlargened */
     printf("SCENARIO 8\n");
     oldHeapSize = manager->first_page->heap_max_free_space;
-    byteptr = pico_mem_zalloc(1);
+    byteptr = _pico_mem_zalloc(1);
     ck_assert(oldHeapSize == manager->first_page->heap_max_free_space + sizeof(struct pico_mem_block) + PICO_MEM_MINIMUM_OBJECT_SIZE);
 
     /*
@@ -2119,6 +2120,166 @@ START_TEST (test_cleanup)
 }
 END_TEST
 
+START_TEST (test_size_classes)
+{
+    struct pico_mem_block*block;
+    struct pico_mem_page*page;
+    uint8_t*a;
+    uint8_t*b;
+    uint8_t*p[64];
+    uint32_t free_space;
+    uint32_t i;
+
+    printf("\n***************Running test_size_classes***************\n\n");
+    pico_mem_init(64 * PICO_MEM_PAGE_SIZE);
+    page = manager->first_page;
+    free_space = page->heap_max_free_space;
+
+    /* Every size maps to the smallest class holding it */
+    for(i = 1; i <= MM_CLASS_MAX; i++)
+    {
+        ck_assert(mm_class_size[MM_CLASS_OF(i)] >= i);
+        ck_assert(MM_CLASS_OF(i) == 0 || mm_class_size[MM_CLASS_OF(i) - 1] < i);
+    }
+
+    /* A miss refills a batch: the first block is returned, the rest is cached */
+    a = pico_mem_zalloc(20);
+    ck_assert(a != NULL);
+    block = (struct pico_mem_block*)a - 1;
+    ck_assert(block->type == HEAP_BLOCK_TYPE);
+    ck_assert(block->internals.heap_block.size >= 32);
+    ck_assert(mm_cache.cls[1].count == PICO_MM_BATCH - 1);
+
+    /* Freed blocks are cached, and come back zeroed */
+    memset(a, 0xAA, 20);
+    pico_mem_free(a);
+    ck_assert(block->internals.heap_block.free == HEAP_BLOCK_NOT_FREE);
+    ck_assert(mm_cache.cls[1].head == (struct pico_mem_cached*)a);
+    ck_assert(mm_cache.cls[1].count == PICO_MM_BATCH);
+    b = pico_mem_zalloc(24);
+    ck_assert(b == a);
+    for(i = 0; i < 24; i++)
+        ck_assert(b[i] == 0);
+
+    /* User data that looks like a cached block is still freed */
+    ((struct pico_mem_cached*)b)->magic = MM_CACHED_MAGIC;
+    pico_mem_free(b);
+    ck_assert(mm_cache.cls[1].count == PICO_MM_BATCH);
+    b = pico_mem_zalloc(24);
+    ck_assert(b == a);
+
+    /* Double free is detected, the list stays intact */
+    pico_mem_free(b);
+    pico_mem_free(b);
+    ck_assert(mm_cache.cls[1].count == PICO_MM_BATCH);
+
+    /* A class never holds more than PICO_MM_CACHE_MAX blocks */
+    for(i = 0; i < 64; i++)
+    {
+        p[i] = pico_mem_zalloc(100);
+        ck_assert(p[i] != NULL);
+    }
+    for(i = 0; i < 64; i++)
+    {
+        pico_mem_free(p[i]);
+        ck_assert(mm_cache.cls[5].count <= PICO_MM_CACHE_MAX);
+    }
+
+    /* Larger requests bypass the caches */
+    a = pico_mem_zalloc(MM_CLASS_MAX + 4);
+    ck_assert(a != NULL);
+    pico_mem_free(a);
+    ck_assert(((struct pico_mem_block*)a - 1)->internals.heap_block.free == HEAP_BLOCK_FREE);
+
+    /* Cleanup drains the caches back to the pages */
+    pico_mem_cleanup(1000);
+    for(i = 0; i < MM_CLASSES; i++)
+        ck_assert(mm_cache.cls[i].count == 0);
+    ck_assert(manager->first_page->heap_max_free_space == free_space);
+
+    /* Caches do not survive deinit */
+    a = pico_mem_zalloc(20);
+    pico_mem_free(a);
+    pico_mem_deinit();
+    pico_mem_init(64 * PICO_MEM_PAGE_SIZE);
+    ck_assert(_pico_mem_cache()->cls[1].count == 0);
+    pico_mem_deinit();
+}
+END_TEST
+
+#define LATENCY_OPS 200000
+#define LATENCY_LIVE 256
+
+static uint64_t latency_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int latency_cmp(const void*a, const void*b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void latency_report(const char*name, const char*op, uint32_t*lat, uint32_t n)
+{
+    qsort(lat, n, sizeof(uint32_t), latency_cmp);
+    printf("mm latency %-8s %-6s n=%u p50=%uns p90=%uns p99=%uns p99.9=%uns max=%uns\n", name, op, n,
+           lat[n / 2], lat[(uint64_t)n * 90 / 100], lat[(uint64_t)n * 99 / 100], lat[(uint64_t)n * 999 / 1000], lat[n - 1]);
+}
+
+/* Random alloc/free mix of stack sized objects, every call timed */
+static void latency_run(const char*name, void*(*zalloc)(size_t), void (*release)(void*))
+{
+    static const size_t sizes[] = {
+        12, 24, 40, 64, 80, 128, 200, 300, 512
+    };
+    uint8_t*live[LATENCY_LIVE];
+    uint32_t*alloc_lat = pico_zalloc(LATENCY_OPS * sizeof(uint32_t));
+    uint32_t*free_lat = pico_zalloc(LATENCY_OPS * sizeof(uint32_t));
+    uint32_t seed = 42, na = 0, nf = 0, i, slot;
+    uint64_t t0;
+
+    ck_assert(alloc_lat != NULL && free_lat != NULL);
+    memset(live, 0, sizeof(live));
+    pico_mem_init(512 * PICO_MEM_PAGE_SIZE);
+    for(i = 0; i < LATENCY_OPS; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        slot = (seed >> 8) % LATENCY_LIVE;
+        t0 = latency_now_ns();
+        if(live[slot])
+        {
+            release(live[slot]);
+            free_lat[nf++] = (uint32_t)(latency_now_ns() - t0);
+            live[slot] = NULL;
+        }
+        else
+        {
+            live[slot] = zalloc(sizes[(seed >> 20) % (sizeof(sizes) / sizeof(sizes[0]))]);
+            alloc_lat[na++] = (uint32_t)(latency_now_ns() - t0);
+            ck_assert(live[slot] != NULL);
+        }
+    }
+
+    printf("\n");
+    latency_report(name, "zalloc", alloc_lat, na);
+    latency_report(name, "free", free_lat, nf);
+    pico_mem_deinit();
+    pico_free(alloc_lat);
+    pico_free(free_lat);
+}
+
+START_TEST (test_zalloc_latency)
+{
+    printf("\n***************Running test_zalloc_latency***************\n\n");
+    latency_run("pages", _pico_mem_zalloc, _pico_mem_free);
+    latency_run("classes", pico_mem_zalloc, pico_mem_free);
+}
+END_TEST
+
 Suite *pico_suite(void)
 {
     Suite *s = suite_create("PicoTCP");
@@ -2141,6 +2302,8 @@ Suite *pico_suite(void)
     tcase_add_test(mm, test_zalloc);
     tcase_add_test(mm, test_page0_free);
     tcase_add_test(mm, test_cleanup);
+    tcase_add_test(mm, test_size_classes);
+    tcase_add_test(mm, test_zalloc_latency);
     suite_add_tcase(s, mm);
 
     return s;
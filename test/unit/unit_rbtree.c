@@ -91,3 +91,155 @@ START_TEST (test_rbtree)
     printf("Test finished...\n");
 }
 END_TEST
+
+/* Intrusive variant */
+typedef struct
+{
+    struct pico_rb_node node;
+    int value;
+} ielem;
+
+static inline int icompare(ielem *a, ielem *b)
+{
+    return a->value - b->value;
+}
+
+PICO_RB_GENERATE(itest, ielem, node, icompare)
+
+/* Black height of the subtree, -1 if a red-black property is broken */
+static int rbtree_check(struct pico_rb_node *n, struct pico_rb_node *parent)
+{
+    int l, r;
+    if (!n)
+        return 1;
+
+    if (n->parent != parent)
+        return -1;
+
+    if ((n->color == 0) && ((n->left && n->left->color == 0) || (n->right && n->right->color == 0)))
+        return -1;
+
+    l = rbtree_check(n->left, n);
+    r = rbtree_check(n->right, n);
+    if ((l < 0) || (l != r))
+        return -1;
+
+    return l + (n->color != 0);
+}
+
+START_TEST (test_rbtree_intrusive)
+{
+    struct pico_rb_tree tree = PICO_RB_TREE_INIT;
+    ielem *e, *x, t;
+    int i, last, count;
+
+    e = malloc(RBTEST_SIZE * sizeof(ielem));
+    fail_if(!e);
+    memset(e, 0, RBTEST_SIZE * sizeof(ielem));
+    srand48(RBTEST_SIZE);
+    for (i = 0; i < RBTEST_SIZE; i++) {
+        e[i].value = (int)(lrand48() % (RBTEST_SIZE * 4));
+        if (itest_insert(&tree, &e[i]))
+            e[i].value = -1; /* duplicate, not linked */
+    }
+    fail_if(rbtree_check(tree.root, NULL) < 0, "Broken after insert");
+
+    last = -1;
+    count = 0;
+    for (x = itest_first(&tree); x; x = itest_next(x)) {
+        fail_if(x->value <= last, "Out of order");
+        last = x->value;
+        count++;
+    }
+    for (x = itest_last(&tree); x; x = itest_prev(x))
+        count--;
+    fail_unless(count == 0);
+
+    /* remove every other element, checking lookups and balance */
+    for (i = 0; i < RBTEST_SIZE; i += 2) {
+        if (e[i].value < 0)
+            continue;
+
+        t.value = e[i].value;
+        fail_unless(itest_find(&tree, &t) == &e[i]);
+        itest_remove(&tree, &e[i]);
+        fail_if(itest_find(&tree, &t), "Found after remove");
+    }
+    fail_if(rbtree_check(tree.root, NULL) < 0, "Broken after remove");
+
+    for (i = 1; i < RBTEST_SIZE; i += 2) {
+        if (e[i].value < 0)
+            continue;
+
+        itest_remove(&tree, &e[i]);
+    }
+    fail_unless(pico_rb_empty(&tree));
+    free(e);
+}
+END_TEST
+
+static uint32_t rbtree_ms(struct timeval *start)
+{
+    struct timeval end;
+    gettimeofday(&end, 0);
+    return (uint32_t)((end.tv_sec - start->tv_sec) * 1000 + (end.tv_usec - start->tv_usec) / 1000);
+}
+
+/* Same workload on both implementations: insert, look up, delete */
+START_TEST (test_rbtree_bench)
+{
+    static PICO_TREE_DECLARE(bench_tree, compare);
+    struct pico_rb_tree tree = PICO_RB_TREE_INIT;
+    elem *g, gt;
+    ielem *e, t;
+    struct timeval start;
+    int i, n = RBTEST_SIZE * 2, found = 0;
+    uint32_t ms[6];
+
+    g = malloc((size_t)n * sizeof(elem));
+    e = malloc((size_t)n * sizeof(ielem));
+    fail_if(!g || !e);
+    for (i = 0; i < n; i++) {
+        /* scattered, unique keys */
+        g[i].value = (int)(((uint32_t)i * 2654435761u) & 0x7fffffff);
+        e[i].value = g[i].value;
+    }
+
+    gettimeofday(&start, 0);
+    for (i = 0; i < n; i++)
+        pico_tree_insert(&bench_tree, &g[i]);
+    ms[0] = rbtree_ms(&start);
+    gettimeofday(&start, 0);
+    for (i = 0; i < n; i++) {
+        gt.value = g[(i * 7) % n].value;
+        found += (pico_tree_findKey(&bench_tree, &gt) != NULL);
+    }
+    ms[1] = rbtree_ms(&start);
+    gettimeofday(&start, 0);
+    for (i = 0; i < n; i++)
+        pico_tree_delete(&bench_tree, &g[i]);
+    ms[2] = rbtree_ms(&start);
+
+    gettimeofday(&start, 0);
+    for (i = 0; i < n; i++)
+        itest_insert(&tree, &e[i]);
+    ms[3] = rbtree_ms(&start);
+    gettimeofday(&start, 0);
+    for (i = 0; i < n; i++) {
+        t.value = e[(i * 7) % n].value;
+        found += (itest_find(&tree, &t) != NULL);
+    }
+    ms[4] = rbtree_ms(&start);
+    gettimeofday(&start, 0);
+    for (i = 0; i < n; i++)
+        itest_remove(&tree, &e[i]);
+    ms[5] = rbtree_ms(&start);
+
+    fail_unless(found == 2 * n);
+    fail_unless(pico_tree_empty(&bench_tree) && pico_rb_empty(&tree));
+    printf("Rbtree bench, %d entries (insert/find/delete ms): pico_tree %u/%u/%u, intrusive %u/%u/%u\n",
+           n, ms[0], ms[1], ms[2], ms[3], ms[4], ms[5]);
+    free(g);
+    free(e);
+}
+END_TEST
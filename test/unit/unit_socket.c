@@ -3,6 +3,20 @@ int pico_aodv_init(void)
 {
     return 0;
 }
+
+static int socket_foreach_count(struct pico_socket *s, void *arg)
+{
+    (void)s;
+    (*(int *)arg)++;
+    return 0;
+}
+
+static int socket_foreach_stop(struct pico_socket *s, void *arg)
+{
+    (void)s;
+    (void)arg;
+    return 1;
+}
 START_TEST (test_socket)
 {
     int ret = 0;
@@ -89,6 +103,14 @@ START_TEST (test_socket)
 
     fail_if (pico_count_sockets(PICO_PROTO_UDP) != 1);
     fail_if (pico_count_sockets(0) != 2);
+    count = 0;
+    fail_if(pico_socket_foreach(0, socket_foreach_count, &count) != 2);
+    fail_if(count != 2);
+    count = 0;
+    fail_if(pico_socket_foreach(PICO_PROTO_UDP, socket_foreach_count, &count) != 1);
+    fail_if(count != 1);
+    fail_if(pico_socket_foreach(0, socket_foreach_stop, NULL) != 1);
+    fail_if(pico_socket_foreach(0, NULL, NULL) != -1);
 
 
     ret = pico_socket_getname(sk_udp, &inaddr_got, &port_got, &proto);
@@ -412,6 +434,31 @@ START_TEST (test_socket)
 }
 END_TEST
 
+START_TEST (test_socket_high_port)
+{
+    struct pico_socket *s;
+    struct pico_ip4 any = {
+        0
+    };
+    uint16_t port, again;
+
+    pico_stack_init();
+    _rand_seed = 1;
+    port = pico_socket_high_port(PICO_PROTO_TCP);
+    fail_if(port == 0, "socket> no ephemeral port\n");
+    fail_if(short_be(port) < 1024, "socket> ephemeral port below 1024\n");
+
+    /* The same draw, with the port now taken */
+    s = pico_socket_open(PICO_PROTO_IPV4, PICO_PROTO_TCP, NULL);
+    fail_if(!s, "socket> tcp socket open failed\n");
+    fail_if(pico_socket_bind(s, &any, &port) != 0, "socket> bind to the ephemeral port failed\n");
+    _rand_seed = 1;
+    again = pico_socket_high_port(PICO_PROTO_TCP);
+    fail_if(again == port, "socket> ephemeral port handed out while in use\n");
+    pico_socket_close(s);
+}
+END_TEST
+
 #ifdef PICO_SUPPORT_CRC_FAULTY_UNIT_TEST
 START_TEST (test_crc_check)
 {
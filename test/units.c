@@ -26,6 +26,13 @@
 #include "pico_dev_mock.c"
 #include "pico_udp.c"
 #include "pico_tcp.c"
+#include "pico_neighbor.c"
+#include "pico_pmtu.c"
+#include "pico_icmp_limit.c"
+#include "pico_stats.c"
+#include "pico_capture.c"
+#include "pico_dev_pipe.c"
+#include "pico_simtime.c"
 #include "pico_arp.c"
 #include "pico_icmp4.c"
 #include "pico_dns_client.c"
@@ -35,6 +42,7 @@
 #include "pico_dhcp_client.c"
 #include "pico_nat.c"
 #include "pico_ipfilter.c"
+#include "pico_qdisc.c"
 #include "pico_tree.c"
 #include "pico_slaacv4.c"
 #include "pico_hotplug_detection.c"
@@ -150,6 +158,7 @@ Suite *pico_suite(void)
     tcase_add_test(dhcp, test_dhcp_server_ipinarp);
     tcase_add_test(dhcp, test_dhcp_server_ipninarp);
     tcase_add_test(dhcp, test_dhcp_server_api);
+    tcase_add_test(dhcp, test_dhcp_server_leases);
     tcase_add_test(dhcp, test_dhcp);
     suite_add_tcase(s, dhcp);
 
@@ -157,6 +166,8 @@ Suite *pico_suite(void)
     suite_add_tcase(s, dns);
 
     tcase_add_test(rb, test_rbtree);
+    tcase_add_test(rb, test_rbtree_intrusive);
+    tcase_add_test(rb, test_rbtree_bench);
     tcase_set_timeout(rb, 120);
     suite_add_tcase(s, rb);
 
@@ -165,11 +176,13 @@ Suite *pico_suite(void)
     suite_add_tcase(s, rb2);
 
     tcase_add_test(socket, test_socket);
+    tcase_add_test(socket, test_socket_high_port);
     suite_add_tcase(s, socket);
 
     tcase_add_test(nat, test_nat_enable_disable);
     tcase_add_test(nat, test_nat_translation);
     tcase_add_test(nat, test_nat_port_forwarding);
+    tcase_add_test(nat, test_nat_expiry);
     tcase_set_timeout(nat, 30);
     suite_add_tcase(s, nat);
 
@@ -184,6 +197,8 @@ Suite *pico_suite(void)
 
 #ifdef PICO_SUPPORT_MCAST
     tcase_add_test(igmp, test_igmp_sockopts);
+    tcase_add_test(igmp, test_mcast_fanout);
+    tcase_add_test(igmp, test_mcast_fanout_close);
     suite_add_tcase(s, igmp);
 #endif
 
@@ -201,6 +216,7 @@ Suite *pico_suite(void)
 
 #ifdef PICO_SUPPORT_IPV6
     tcase_add_test(ipv6, test_ipv6);
+    tcase_add_test(ipv6, test_ipv6_exthdr_bounds);
     suite_add_tcase(s, ipv6);
 #ifdef PICO_SUPPORT_MCAST
     tcase_add_test(mld, test_mld_sockopts);
@@ -209,7 +225,7 @@ Suite *pico_suite(void)
 #endif
 
     tcase_add_test(arp, arp_update_max_arp_reqs_test);
-    tcase_add_test(arp, arp_compare_test);
+    tcase_add_test(arp, arp_table_test);
     tcase_add_test(arp, arp_lookup_test);
     tcase_add_test(arp, arp_expire_test);
     tcase_add_test(arp, arp_receive_test);